@@ -6,20 +6,471 @@
  * 2. Chuyển ảnh thành JPEG buffer
  * 3. POST ảnh binary đến http://192.168.1.28:5000/upload
  * 4. Nhận response JSON từ server
+ *
+ * Ảnh chỉ được gửi khi có chuyển động (motion.h): hành lang trống thì chỉ
+ * gửi 1 ảnh mỗi MOTION_IDLE_MS để server biết camera vẫn sống.
+ *
+ * Upload dùng chung 1 kết nối keep-alive (setReuse): chỉ lần đầu, hoặc khi
+ * server đã đóng kết nối, mới tốn bắt tay TCP. Mỗi request in latency và
+ * tỉ lệ dùng lại kết nối.
+ *
+ * Chụp và gửi chạy song song: captureTask (core 1) chụp liên tục và đẩy
+ * frame vào hàng đợi sâu UPLOAD_QUEUE_DEPTH, uploadTask (core 0, cạnh
+ * WiFi) lấy ra và POST. Uploader chậm thì ảnh mới nhất thắng: hàng đợi đầy
+ * thì frame cũ nhất bị trả lại camera để nhường chỗ. Tốc độ upload vì vậy
+ * chỉ bị giới hạn bởi đường truyền, không phải tổng thời gian chụp + gửi.
+ *
+ * USE_STREAM_INGEST 1: thay vì mỗi frame 1 POST (header HTTP + chờ JSON
+ * trả về), giữ 1 kết nối TCP tới cổng ingest của server và đẩy frame nối
+ * tiếp, mỗi frame có header kiểu part multipart (như _STREAM_PART trong
+ * app_httpd.cpp). Server trả ACK từng dòng JSON, đọc lúc rảnh; chỉ chờ khi
+ * đã có INGEST_WINDOW frame chưa được ACK.
+ *
+ * USE_FACE_GATE 1: frame có chuyển động được tìm mặt ngay trên ESP32
+ * (face_detect.h), chỉ frame có mặt người mới được gửi, kèm khung mặt
+ * trong header X-Face-Count / X-Faces. Server thấy X-Face-Count: 0 thì
+ * bỏ qua bước Haar của nó. detect_faces chỉ chạy mỗi vài frame, giữa các
+ * lần đó khung mặt được bám theo (face_track.h), mỗi mặt có 1 id riêng.
+ *
+ * USE_FACE_TILES 1 (cần luồng ingest): frame có mặt người không gửi
+ * nguyên ảnh SVGA mà chỉ gửi các ô cắt quanh từng khuôn mặt (nới thêm
+ * FACE_PAD_PCT, nén lại thành JPEG nhỏ), kèm toạ độ cắt X-Crop để server
+ * đặt lại đúng vị trí. Ảnh toàn cảnh thu nhỏ chất lượng thấp chỉ gửi khi
+ * server yêu cầu ("want_context": true trong ACK).
+ *
+ * Chất lượng JPEG và cỡ frame tự chỉnh theo mạng (quality.h): mỗi lần gửi
+ * đo latency chụp -> server trả lời, thông lượng và server_ms trong câu
+ * trả lời, rồi hạ/nâng set_quality, set_framesize để giữ QUALITY_TARGET_MS.
+ *
+ * Buffer frame cấp theo cỡ JPEG thật (jpeg_size.h): mỗi frame được đếm vào
+ * histogram theo cỡ frame / chất lượng, percentile cao của nó (cộng biên)
+ * lưu trong NVS và lần khởi động sau esp_camera_init chỉ cấp đủ chừng đó,
+ * không cấp dư cho mọi board. Frame dài hơn buffer (bị cắt cụt) không gửi
+ * đi: đếm lại, hạ chất lượng ngay cho frame sau.
+ *
+ * Vòng chụp/gửi không cấp phát heap nội khi chạy ổn định: POST tự dựng
+ * trên WiFiClient với buffer tĩnh (không HTTPClient, không String), ACK
+ * đọc vào dòng cố định, log qua logf() theo LOG_LEVEL. logHeap() in mức
+ * heap thấp nhất từng có để kiểm tra sau nhiều ngày chạy. (Ô cắt khuôn mặt
+ * vẫn cấp phát, nhưng trong PSRAM.)
+ *
+ * USE_UDP_TRANSPORT 1: cho màn hình cửa trực tiếp, mất 1 frame còn hơn chờ
+ * TCP gửi lại. Mỗi JPEG cắt thành gói UDP vừa MTU (UdpFragHdr: id frame,
+ * số thứ tự mảnh), server ghép lại, frame thiếu mảnh quá hạn thì bỏ. Server
+ * có thể gửi NACK xin lại mảnh của frame mới nhất (giữ 1 bản trong PSRAM)
+ * và gói thống kê sau mỗi frame ghép xong.
+ *
+ * WiFi chạy nền (wifi_link.h): setup() không chờ kết nối, camera và
+ * captureTask chạy ngay. Mất mạng thì thử lại ngay 1 lần rồi giãn dần
+ * (backoff), không chặn việc chụp. BSSID/kênh của AP lần trước lưu trong
+ * NVS để kết nối lại không phải quét; staticIp khác 0.0.0.0 thì bỏ luôn
+ * DHCP. Mỗi lần có mạng in thời gian kết nối.
+ *
+ * Khởi động song song: WiFi dò AP / DHCP trong task của nó trong lúc
+ * setup() khởi tạo camera, áp profile, cấp buffer PSRAM và chụp sẵn 1
+ * frame. Frame đầu gửi xong thì in dòng "Boot timeline" (camera sẵn sàng,
+ * có IP, frame đầu đã gửi, tính từ lúc app chạy) để theo dõi thời gian mù
+ * sau mỗi lần mất điện.
  */
 
 #include <WiFi.h>
-#include <HTTPClient.h>
+#include <stdarg.h>
 #include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "motion.h"
+#include "quality.h"
+#include "jpeg_size.h"
+#include "profile.h"
+#include "face_detect.h"
+#include "face_track.h"
+#include "kernels.h"
+#include "wifi_link.h"
+#include "img_converters.h"
 
 // WiFi credentials
 const char* ssid = "I2";
 const char* password = "abcd1232";
+// Địa chỉ tĩnh: kết nối lại không chờ DHCP. 0.0.0.0: dùng DHCP
+IPAddress staticIp(0, 0, 0, 0);
+IPAddress gatewayIp(192, 168, 1, 1);
+IPAddress subnetMask(255, 255, 255, 0);
+IPAddress dnsIp(0, 0, 0, 0);  // 0.0.0.0: dùng gateway
+
+wifi_link_t wifi;
+
+// Mốc khởi động (esp_timer: us từ lúc app chạy, sau bootloader); 0: chưa tới
+struct {
+  int64_t cameraUs;     // esp_camera_init xong
+  int64_t warmUs;       // Profile đã áp, frame đầu đã chụp
+  int64_t ipUs;
+  int64_t firstSentUs;  // Frame đầu server nhận
+} bootTimeline;
 
 // Flask Server URL
 // ⚠️ QUAN TRỌNG: Sử dụng IP WiFi vì ESP32-CAM kết nối qua WiFi
 // IP WiFi của máy: 192.168.1.25 (kiểm tra bằng: ipconfig)
 const char* serverUrl = "http://192.168.1.24:5000/upload";
+// Tên camera (X-Camera-Id): mỗi ESP32-CAM 1 tên riêng, server giữ hàng đợi,
+// frame mới nhất và /stream/<tên> riêng cho từng camera
+const char* cameraId = "door1";
+#define UPLOAD_TIMEOUT_MS 10000
+
+// Mức log lúc biên dịch: 0 tắt, 1 lỗi, 2 thêm mỗi frame, 3 thêm JSON trả về
+#define LOG_LEVEL    2
+#define HEAP_LOG_MS  60000      // In mức heap thấp nhất từng có mỗi chừng này
+#define KERNELS_BENCH 0         // 1: lúc khởi động in số chu kỳ/pixel của các kernel ảnh xám (kernels.h)
+
+// printf vào buffer trên stack rồi ghi ra Serial: Serial.printf cấp phát
+// heap khi dòng dài hơn 64 byte
+void logf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void logf(const char* fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (n > 0) Serial.write((const uint8_t*)buf, min(n, (int)sizeof(buf) - 1));
+}
+#define LOG_ERR(...)   do { if (LOG_LEVEL >= 1) logf(__VA_ARGS__); } while (0)
+#define LOG_INFO(...)  do { if (LOG_LEVEL >= 2) logf(__VA_ARGS__); } while (0)
+#define LOG_DEBUG(...) do { if (LOG_LEVEL >= 3) logf(__VA_ARGS__); } while (0)
+
+// Luồng ingest TCP (app.py INGEST_PORT)
+#define USE_STREAM_INGEST  1
+const char* ingestHost = "192.168.1.24";
+const uint16_t ingestPort = 5001;
+#define INGEST_WINDOW      4      // Frame đã gửi mà chưa có ACK tối đa
+#define INGEST_ACK_TIMEOUT 10000  // ms chờ ACK khi cửa sổ đầy, quá thì nối lại
+
+// Luồng UDP (app.py UDP_PORT); bật thì thay cho ingest / POST
+#define USE_UDP_TRANSPORT  0
+const uint16_t udpPort = 5002;
+#define UDP_LOCAL_PORT     5003   // Nhận NACK / thống kê từ server
+#define UDP_PAYLOAD        1400   // JPEG mỗi gói: 1500 MTU - IP/UDP - UdpFragHdr
+#define UDP_BURST          8      // Nhường CPU cho WiFi sau chừng này gói
+
+// Ngưỡng phát hiện chuyển động (xem motion.h)
+#define MOTION_THRESH    12     // Độ lệch độ sáng trung bình của 1 khối (0..255)
+#define MOTION_MIN_SCORE 2      // % số khối thay đổi để tính là có chuyển động; 0: tắt lọc
+#define MOTION_HOLD_MS   2000   // Tiếp tục gửi thêm chừng này sau chuyển động cuối
+#define MOTION_IDLE_MS   30000  // Không có chuyển động: vẫn gửi 1 ảnh mỗi chừng này
+// Chất lượng ảnh (X-Sharpness, X-Luma): ảnh nhoè hoặc tối bị bỏ ngay trên
+// ESP32, server khỏi tốn 1 lần detect. Độ nét tuỳ cảnh, nên đặt theo giá
+// trị X-Sharpness của 1 ảnh nét cùng camera (khoảng 1/3 là hợp lý); 0: tắt.
+#define MOTION_MIN_SHARPNESS 0
+#define MOTION_MIN_LUMA      0  // Độ sáng trung bình tối thiểu (0..255); 0: tắt
+
+motion_t motion;
+
+// Lọc theo khuôn mặt. Không link bộ nhận diện (ESP-WHO) thì detect_faces
+// == NULL, frame đi tiếp như chỉ có lọc chuyển động.
+#define USE_FACE_GATE  1
+#define FACE_MAX_BOXES 4
+#define FACE_IDLE_MS   30000    // Không có mặt: vẫn gửi 1 ảnh (X-Face-Count: 0) mỗi chừng này
+
+// Ảnh xám QVGA/QQVGA cho detect_faces, khung mặt trả về theo toạ độ frame gốc
+face_work_t faceWork;
+// Nhận diện đầy đủ mỗi vài frame, giữa các lần đó bám theo khung cũ (face_track.h)
+face_tracker_t faceTrack;
+
+// Gửi ô cắt khuôn mặt thay cho cả frame
+#define USE_FACE_TILES    1
+#define FACE_PAD_PCT      25    // Nới khung mặt mỗi bên thêm chừng này % kích thước khung
+#define FACE_TILE_QUALITY 80    // fmt2jpg: 0..100, càng lớn càng nét
+#define CONTEXT_SCALE     4     // Ảnh toàn cảnh thu nhỏ 1/4 mỗi chiều
+#define CONTEXT_QUALITY   30
+#define MAX_TILES         (FACE_MAX_BOXES + 1)
+
+struct Tile {
+  uint8_t* jpg;               // malloc bởi fmt2jpg
+  size_t len;
+  int16_t x, y, w, h;         // Vùng cắt trong frame gốc (ảnh toàn cảnh: cả frame)
+  bool context;
+};
+
+volatile bool contextWanted = true;  // Server muốn ảnh toàn cảnh ở lần gửi ô cắt tới
+
+// Giữ latency đầu-cuối quanh mức này (xem quality.h)
+#define QUALITY_TARGET_MS 1500
+#define QUALITY_BAND_PCT  25    // Trễ lệch mục tiêu trong +-25% thì giữ nguyên
+#define QUALITY_BEST      8     // Giới hạn jpeg_quality (số nhỏ: nét hơn)
+#define QUALITY_WORST     40
+
+quality_t quality;
+
+// Buffer frame: cỡ lớn nhất esp_camera_init được cấp theo (jpeg_size.h)
+#define FB_MAX_SIZE_PSRAM FRAMESIZE_UXGA
+#define FB_MAX_SIZE_DRAM  FRAMESIZE_VGA
+
+jpeg_size_t jpegSize;
+// Thiết lập của frame bị cắt cụt gần nhất (captureTask ghi, uploadTask hạ chất lượng)
+volatile int truncatedQuality = -1;
+volatile framesize_t truncatedSize = FRAMESIZE_INVALID;
+
+// Pipeline chụp -> gửi
+#define UPLOAD_QUEUE_DEPTH 1    // Frame chờ gửi; +1 đang gửi +1 cho camera = fb_count
+#define CAPTURE_CORE       1
+#define UPLOAD_CORE        0
+#define TASK_STACK      8192
+
+struct QueuedFrame {
+  camera_fb_t* fb;
+  int motion;         // Điểm chuyển động lúc chụp
+  int sharpness;      // Độ nét và độ sáng trung bình (motion.h), -1: không tính được
+  int luma;
+  int faces;          // Số mặt detect_faces tìm được, -1: không chạy nhận diện
+  face_box_t boxes[FACE_MAX_BOXES];
+  int64_t queuedUs;   // Lúc vào hàng đợi, để đo thời gian chờ
+  int64_t captureUs;  // fb->timestamp (esp_timer), gửi trong X-Timestamp
+  uint32_t seq;       // Số thứ tự lúc chụp (X-Seq của /upload)
+  // Khi gửi ô cắt: fb đã trả lại camera (NULL), ảnh nằm trong tile[]
+  int tiles;
+  Tile tile[MAX_TILES];
+  uint16_t frameW, frameH;
+};
+
+// Trả frame buffer / giải phóng ô cắt của 1 frame
+void releaseFrame(QueuedFrame& q) {
+  if (q.fb) esp_camera_fb_return(q.fb);
+  for (int i = 0; i < q.tiles; i++) free(q.tile[i].jpg);
+  q.fb = NULL;
+  q.tiles = 0;
+}
+
+size_t frameBytes(const QueuedFrame& q) {
+  size_t n = q.fb ? q.fb->len : 0;
+  for (int i = 0; i < q.tiles; i++) n += q.tile[i].len;
+  return n;
+}
+
+// Nén 1 vùng của ảnh BGR888 (thứ tự của fmt2rgb888) thành JPEG; step > 1
+// lấy 1 điểm mỗi step điểm để thu nhỏ
+bool encodeRegion(const uint8_t* bgr, int frameW, int x, int y, int w, int h, int step, int quality, Tile& t) {
+  int ow = w / step, oh = h / step;
+  uint8_t* rgb = (uint8_t*)ps_malloc(ow * oh * 3);
+  if (!rgb) return false;
+  uint8_t* o = rgb;
+  for (int r = 0; r < oh; r++) {
+    const uint8_t* p = bgr + ((y + r * step) * frameW + x) * 3;
+    for (int c = 0; c < ow; c++, p += 3 * step) {
+      *o++ = p[2];
+      *o++ = p[1];
+      *o++ = p[0];
+    }
+  }
+  bool ok = fmt2jpg(rgb, ow * oh * 3, ow, oh, PIXFORMAT_RGB888, quality, &t.jpg, &t.len);
+  free(rgb);
+  t.x = x;
+  t.y = y;
+  t.w = w;
+  t.h = h;
+  return ok;
+}
+
+// Cắt các khuôn mặt (và ảnh toàn cảnh nếu server cần) thành tile[]
+bool makeTiles(QueuedFrame& q) {
+  camera_fb_t* fb = q.fb;
+  uint8_t* bgr = (uint8_t*)ps_malloc(fb->width * fb->height * 3);
+  if (!bgr) return false;
+  if (!fmt2rgb888(fb->buf, fb->len, fb->format, bgr)) {
+    free(bgr);
+    return false;
+  }
+  q.frameW = fb->width;
+  q.frameH = fb->height;
+  for (int i = 0; i < q.faces; i++) {
+    const face_box_t& b = q.boxes[i];
+    int px = b.w * FACE_PAD_PCT / 100, py = b.h * FACE_PAD_PCT / 100;
+    int x0 = max(b.x - px, 0), y0 = max(b.y - py, 0);
+    int x1 = min(b.x + b.w + px, (int)fb->width), y1 = min(b.y + b.h + py, (int)fb->height);
+    if (x1 - x0 < 8 || y1 - y0 < 8) continue;
+    Tile& t = q.tile[q.tiles];
+    t.context = false;
+    if (encodeRegion(bgr, fb->width, x0, y0, x1 - x0, y1 - y0, 1, FACE_TILE_QUALITY, t)) q.tiles++;
+  }
+  if (q.tiles && contextWanted) {
+    Tile& t = q.tile[q.tiles];
+    t.context = true;
+    if (encodeRegion(bgr, fb->width, 0, 0, fb->width, fb->height, CONTEXT_SCALE, CONTEXT_QUALITY, t)) {
+      q.tiles++;
+      contextWanted = false;
+    }
+  }
+  free(bgr);
+  return q.tiles > 0;
+}
+
+QueueHandle_t frameQueue;
+volatile uint32_t framesReplaced = 0;  // Bị frame mới hơn thay khi uploader chưa kịp lấy
+uint32_t captureSeq = 0;                // Đếm frame đã chụp, gửi trong X-Seq của /upload
+
+// Giá trị header X-Faces: "x,y,w,h,score,id;..." (rỗng nếu không có mặt),
+// id giữ nguyên cho cùng 1 khuôn mặt qua các frame
+void formatFaces(const QueuedFrame& q, char* out, size_t size) {
+  size_t n = 0;
+  out[0] = 0;
+  for (int i = 0; i < q.faces && n < size; i++) {
+    const face_box_t& b = q.boxes[i];
+    n += snprintf(out + n, size - n, "%s%d,%d,%d,%d,%d,%d", i ? ";" : "", b.x, b.y, b.w, b.h, b.score, b.id);
+  }
+}
+
+// Số nguyên sau key (vd "\"server_ms\":") trong JSON trả về, def nếu không có
+int jsonInt(const char* json, const char* key, int def) {
+  const char* p = strstr(json, key);
+  return p ? atoi(p + strlen(key)) : def;
+}
+
+// serverUrl tách 1 lần lúc setup: http://host[:port]/path
+char serverHost[64];
+uint16_t serverPort = 80;
+char serverPath[64];
+
+bool parseServerUrl(const char* url) {
+  const char* p = strstr(url, "://");
+  p = p ? p + 3 : url;
+  const char* slash = strchr(p, '/');
+  const char* end = slash ? slash : p + strlen(p);
+  const char* colon = (const char*)memchr(p, ':', end - p);
+  size_t hostLen = (colon ? colon : end) - p;
+  if (!hostLen || hostLen >= sizeof(serverHost)) return false;
+  memcpy(serverHost, p, hostLen);
+  serverHost[hostLen] = 0;
+  if (colon) serverPort = atoi(colon + 1);
+  snprintf(serverPath, sizeof(serverPath), "%s", slash ? slash : "/");
+  return true;
+}
+
+// Uploader sống suốt chương trình, giữ kết nối TCP giữa các lần POST.
+// POST tự dựng trên WiFiClient: header và JSON trả về nằm trong buffer
+// tĩnh, không có String nào được cấp phát mỗi frame.
+WiFiClient uploader;
+char requestHead[384 + FACE_MAX_BOXES * 32];
+char response[768];           // Body JSON, dài hơn thì bị cắt (phần thừa vẫn được đọc bỏ)
+struct {
+  uint32_t requests;   // POST đã gửi (kể cả lần thử lại)
+  uint32_t reused;     // ... đi trên kết nối có sẵn
+  uint32_t retries;    // Kết nối cũ đã bị server đóng, mở lại và gửi lại
+  uint32_t failures;
+  uint64_t totalUs;    // Tổng latency các POST thành công
+  uint32_t ok;
+} upStats;
+
+// 1 dòng header HTTP (bỏ \r\n, cắt nếu dài); -1 khi hết giờ / mất kết nối
+int readLine(WiFiClient& c, char* buf, size_t size, uint32_t t0) {
+  size_t n = 0;
+  while (millis() - t0 < UPLOAD_TIMEOUT_MS) {
+    int ch = c.read();
+    if (ch < 0) {
+      if (!c.connected()) return -1;
+      delay(1);
+      continue;
+    }
+    if (ch == '\n') {
+      if (n && buf[n - 1] == '\r') n--;
+      buf[n] = 0;
+      return n;
+    }
+    if (n + 1 < size) buf[n++] = ch;
+  }
+  return -1;
+}
+
+// Gửi 1 request, đọc hết câu trả lời vào response. Trả mã HTTP, -1 nếu
+// lỗi mạng; keepAlive = false khi server sẽ đóng kết nối sau câu trả lời.
+int postOnce(const QueuedFrame& q, bool& keepAlive) {
+  camera_fb_t* fb = q.fb;
+  int n = snprintf(requestHead, sizeof(requestHead),
+                   "POST %s HTTP/1.1\r\nHost: %s:%u\r\nConnection: keep-alive\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\nX-Camera-Id: %s\r\nX-Motion-Score: %d\r\n"
+                   "X-Sharpness: %d\r\nX-Luma: %d\r\nX-Seq: %u\r\nX-Timestamp: %lld.%06ld\r\nX-Send-Time: %lld\r\n",
+                   serverPath, serverHost, serverPort, (unsigned)fb->len, cameraId, q.motion, q.sharpness, q.luma, (unsigned)q.seq, (long long)(q.captureUs / 1000000),
+                   (long)(q.captureUs % 1000000), (long long)esp_timer_get_time());
+  if (q.faces >= 0) {
+    char faces[FACE_MAX_BOXES * 32];
+    formatFaces(q, faces, sizeof(faces));
+    n += snprintf(requestHead + n, sizeof(requestHead) - n, "X-Face-Count: %d\r\nX-Faces: %s\r\n", q.faces, faces);
+  }
+  n += snprintf(requestHead + n, sizeof(requestHead) - n, "\r\n");
+  keepAlive = false;
+  if (uploader.write((const uint8_t*)requestHead, n) != (size_t)n || uploader.write(fb->buf, fb->len) != fb->len) return -1;
+
+  char line[128];
+  uint32_t t0 = millis();
+  if (readLine(uploader, line, sizeof(line), t0) < 9 || strncmp(line, "HTTP/1.", 7)) return -1;
+  int code = atoi(line + 9);
+  keepAlive = line[7] == '1';
+  int length = -1;
+  while ((n = readLine(uploader, line, sizeof(line), t0)) > 0) {
+    if (!strncasecmp(line, "Content-Length:", 15)) length = atoi(line + 15);
+    if (!strncasecmp(line, "Connection:", 11)) keepAlive = !strcasestr(line + 11, "close");
+  }
+  if (n < 0) return -1;
+  if (length < 0) keepAlive = false;  // Không biết body dài bao nhiêu: đọc tới khi server đóng
+
+  size_t got = 0;
+  while ((length < 0 || got < (size_t)length) && millis() - t0 < UPLOAD_TIMEOUT_MS) {
+    uint8_t chunk[64];
+    size_t want = length < 0 ? sizeof(chunk) : min((size_t)length - got, sizeof(chunk));
+    int k = uploader.read(chunk, want);
+    if (k <= 0) {
+      if (!uploader.connected()) break;
+      delay(1);
+      continue;
+    }
+    if (got < sizeof(response) - 1) memcpy(response + got, chunk, min((size_t)k, sizeof(response) - 1 - got));
+    got += k;
+  }
+  response[min(got, sizeof(response) - 1)] = 0;
+  if (length >= 0 && got < (size_t)length) return -1;
+  return code;
+}
+
+// POST ảnh trên kết nối keep-alive. Nếu kết nối cũ đã chết (server đóng
+// khi rảnh), mở kết nối mới và gửi lại đúng 1 lần.
+int uploadFrame(const QueuedFrame& q) {
+  camera_fb_t* fb = q.fb;
+  int code = -1;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool reused = uploader.connected();
+    if (!reused) {
+      uploader.stop();
+      if (!uploader.connect(serverHost, serverPort)) {
+        LOG_ERR("✗ Unable to connect to server %s:%u\n", serverHost, serverPort);
+        break;
+      }
+      uploader.setNoDelay(true);
+    }
+    bool keepAlive;
+    int64_t t0 = esp_timer_get_time();
+    code = postOnce(q, keepAlive);
+    int64_t us = esp_timer_get_time() - t0;
+    if (code < 0 || !keepAlive) uploader.stop();
+    upStats.requests++;
+    if (reused) upStats.reused++;
+    if (code > 0) {
+      upStats.ok++;
+      upStats.totalUs += us;
+      LOG_INFO("✓ %d in %lld ms (%s), reuse %u/%u, avg %llu ms\n", code, (long long)(us / 1000), reused ? "reused" : "new conn",
+               (unsigned)upStats.reused, (unsigned)upStats.requests, (unsigned long long)(upStats.totalUs / upStats.ok / 1000));
+      LOG_DEBUG("✓ Response: %s\n", response);
+      quality_sample(&quality, fb->len, esp_timer_get_time() - q.queuedUs, us, jsonInt(response, "\"server_ms\":", -1));
+      return code;
+    }
+    if (!reused) break;
+    upStats.retries++;
+    LOG_INFO("  Keep-alive connection was closed, reconnecting\n");
+  }
+  upStats.failures++;
+  LOG_ERR("✗ Error code: %d\n", code);
+  if (code == -1) {
+    LOG_ERR("  → Connection failed. Check:\n"
+            "    1. Flask server is running (python app.py)\n"
+            "    2. Server IP is correct: %s\n"
+            "    3. Firewall allows port %u\n"
+            "    4. ESP32 and server on same network\n", serverUrl, serverPort);
+  }
+  return code;
+}
 
 // Camera pins cho ESP32-CAM AI-Thinker
 #define PWDN_GPIO_NUM     32
@@ -39,20 +490,416 @@ const char* serverUrl = "http://192.168.1.24:5000/upload";
 #define HREF_GPIO_NUM     23
 #define PCLK_GPIO_NUM     22
 
+WiFiClient ingest;
+uint32_t ingestSeq = 0;       // Số thứ tự frame cuối đã gửi
+uint32_t ingestAcked = 0;     // ... frame cuối đã có ACK
+int64_t ingestSentUs[INGEST_WINDOW];
+int64_t ingestQueuedUs[INGEST_WINDOW];  // Lúc chụp (vào hàng đợi), cho latency đầu-cuối
+size_t ingestBytes[INGEST_WINDOW];
+struct {
+  uint32_t frames;
+  uint32_t acks;
+  uint32_t connects;
+  uint64_t ackUs;             // Tổng thời gian gửi -> ACK
+} ingestStats;
+
+// Dòng ACK đang đọc dở, giữ qua các lần gọi
+char ackLine[1024];
+size_t ackLen = 0;
+
+void handleAck(const char* line) {
+  int k = jsonInt(line, "\"seq\":", -1);
+  if (k < 0) return;
+  uint32_t seq = k;
+  if (seq <= ingestAcked || seq > ingestSeq) return;
+  ingestAcked = seq;
+  int64_t us = esp_timer_get_time() - ingestSentUs[seq % INGEST_WINDOW];
+  ingestStats.acks++;
+  ingestStats.ackUs += us;
+  quality_sample(&quality, ingestBytes[seq % INGEST_WINDOW], esp_timer_get_time() - ingestQueuedUs[seq % INGEST_WINDOW], us,
+                 jsonInt(line, "\"server_ms\":", -1));
+  if (strstr(line, "\"want_context\": true")) contextWanted = true;
+  LOG_INFO("✓ ack #%u in %lld ms, faces %d, %u in flight, avg %llu ms\n", (unsigned)seq, (long long)(us / 1000),
+           jsonInt(line, "\"faces_detected\":", -1), (unsigned)(ingestSeq - ingestAcked),
+           (unsigned long long)(ingestStats.ackUs / ingestStats.acks / 1000));
+}
+
+// Đọc các dòng ACK đã tới: {"seq": S, "status": ..., "faces_detected": N, ...}
+// vào ackLine; dòng dài hơn buffer bị cắt, "seq" ở cuối thì mất ACK đó
+void readIngestAcks() {
+  while (ingest.available()) {
+    int c = ingest.read();
+    if (c < 0) break;
+    if (c != '\n') {
+      if (ackLen + 1 < sizeof(ackLine)) ackLine[ackLen++] = c;
+      continue;
+    }
+    ackLine[ackLen] = 0;
+    ackLen = 0;
+    handleAck(ackLine);
+  }
+}
+
+// 1 part: header kiểu multipart rồi tới JPEG
+bool writePart(uint32_t seq, const QueuedFrame& q, const uint8_t* buf, size_t len, const char* extra) {
+  char head[384 + FACE_MAX_BOXES * 32];
+  int n = snprintf(head, sizeof(head), "\r\n--frame\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\nX-Camera-Id: %s\r\nX-Seq: %u\r\nX-Motion-Score: %d\r\n"
+                   "X-Sharpness: %d\r\nX-Luma: %d\r\nX-Timestamp: %lld.%06ld\r\nX-Send-Time: %lld\r\n%s",
+                   (unsigned)len, cameraId, (unsigned)seq, q.motion, q.sharpness, q.luma, (long long)(q.captureUs / 1000000), (long)(q.captureUs % 1000000),
+                   (long long)esp_timer_get_time(), extra);
+  if (q.faces >= 0) {
+    char faces[FACE_MAX_BOXES * 32];
+    formatFaces(q, faces, sizeof(faces));
+    n += snprintf(head + n, sizeof(head) - n, "X-Face-Count: %d\r\nX-Faces: %s\r\n", q.faces, faces);
+  }
+  n += snprintf(head + n, sizeof(head) - n, "\r\n");
+  return ingest.write((const uint8_t*)head, n) == (size_t)n && ingest.write(buf, len) == len;
+}
+
+// Gửi 1 frame lên luồng ingest, mở (lại) kết nối nếu cần
+bool streamFrame(const QueuedFrame& q) {
+  camera_fb_t* fb = q.fb;
+  if (!ingest.connected()) {
+    ingest.stop();
+    if (!ingest.connect(ingestHost, ingestPort)) {
+      LOG_ERR("✗ Unable to connect to ingest %s:%u\n", ingestHost, ingestPort);
+      return false;
+    }
+    ingest.setNoDelay(true);
+    ingestAcked = ingestSeq;  // ACK của kết nối cũ không còn tới
+    ackLen = 0;
+    ingestStats.connects++;
+  }
+
+  // Cửa sổ đầy: chờ server xử lý bớt
+  uint32_t t0 = millis();
+  while (ingestSeq - ingestAcked >= INGEST_WINDOW) {
+    readIngestAcks();
+    if (!ingest.connected() || millis() - t0 > INGEST_ACK_TIMEOUT) {
+      LOG_ERR("✗ No ingest ACK, reconnecting\n");
+      ingest.stop();
+      return false;
+    }
+    delay(1);
+  }
+
+  uint32_t seq = ingestSeq + 1;
+  ingestSentUs[seq % INGEST_WINDOW] = esp_timer_get_time();
+  ingestQueuedUs[seq % INGEST_WINDOW] = q.queuedUs;
+  ingestBytes[seq % INGEST_WINDOW] = frameBytes(q);
+  bool ok = true;
+  if (fb) {
+    ok = writePart(seq, q, fb->buf, fb->len, "");
+  }
+  // Ô cắt: mỗi ô 1 part cùng X-Seq, server gom đủ X-Tile i/n rồi mới xử lý
+  for (int i = 0; ok && i < q.tiles; i++) {
+    const Tile& t = q.tile[i];
+    char extra[128];
+    snprintf(extra, sizeof(extra), "X-Tile: %d/%d\r\nX-Tile-Kind: %s\r\nX-Crop: %d,%d,%d,%d\r\nX-Frame-Size: %ux%u\r\n", i, q.tiles,
+             t.context ? "context" : "face", t.x, t.y, t.w, t.h, q.frameW, q.frameH);
+    ok = writePart(seq, q, t.jpg, t.len, extra);
+  }
+  if (!ok) {
+    LOG_ERR("✗ Ingest write failed, reconnecting\n");
+    ingest.stop();
+    return false;
+  }
+  ingestSeq = seq;
+  ingestStats.frames++;
+  readIngestAcks();
+  return true;
+}
+
+// Gói UDP: header little-endian + tối đa UDP_PAYLOAD byte JPEG
+#define UDP_MAGIC     0xCF
+#define UDP_VERSION   1
+#define UDP_FRAG      'F'     // ESP32 -> server: 1 mảnh frame
+#define UDP_NACK      'N'     // server -> ESP32: {frame id, số mảnh, chỉ số mảnh u16...}
+#define UDP_STATS     'S'     // server -> ESP32: sau mỗi frame ghép xong
+
+struct __attribute__((packed)) UdpFragHdr {
+  uint8_t magic;
+  uint8_t type;
+  uint16_t frag;        // Mảnh thứ mấy
+  uint16_t frags;       // Tổng số mảnh của frame
+  uint16_t len;         // Byte JPEG trong gói này
+  uint32_t frameId;
+  uint32_t frameLen;    // Cả JPEG
+  int8_t motion;
+  int8_t faces;         // -1: không chạy nhận diện
+  uint8_t version;
+  uint8_t reserved;
+};
+
+struct __attribute__((packed)) UdpStats {
+  uint8_t magic;
+  uint8_t type;
+  uint16_t serverMs;    // Server xử lý frame frameId
+  uint32_t frameId;     // Frame vừa ghép xong
+  uint32_t complete;    // Frame ghép đủ từ lúc server chạy
+  uint32_t dropped;     // Frame thiếu mảnh quá hạn, bị bỏ
+};
+
+WiFiUDP udp;
+uint32_t udpFrameId = 0;
+// Bản sao frame gửi gần nhất để trả lời NACK (fb đã trả lại camera)
+uint8_t* udpLast = NULL;
+size_t udpLastCap = 0;
+UdpFragHdr udpLastHdr;
+int64_t udpSentUs[INGEST_WINDOW];
+size_t udpBytes[INGEST_WINDOW];
+int64_t udpQueuedUs[INGEST_WINDOW];
+struct {
+  uint32_t frames;
+  uint32_t packets;
+  uint32_t sendErrors;
+  uint32_t nacks;
+  uint32_t resent;
+} udpStats;
+
+bool udpSendFrag(UdpFragHdr& h, const uint8_t* jpg, uint16_t frag) {
+  h.frag = frag;
+  h.len = min((size_t)UDP_PAYLOAD, (size_t)h.frameLen - (size_t)frag * UDP_PAYLOAD);
+  // endPacket lỗi khi hàng đợi TX của WiFi đầy: chờ 1 ms thử lại 1 lần
+  for (int attempt = 0; attempt < 2; attempt++) {
+    udp.beginPacket(ingestHost, udpPort);
+    udp.write((const uint8_t*)&h, sizeof(h));
+    udp.write(jpg + (size_t)frag * UDP_PAYLOAD, h.len);
+    if (udp.endPacket()) {
+      udpStats.packets++;
+      return true;
+    }
+    delay(1);
+  }
+  udpStats.sendErrors++;
+  return false;
+}
+
+// NACK / thống kê từ server, đọc lúc rảnh như ACK của ingest
+void readUdpFeedback() {
+  uint8_t pkt[UDP_PAYLOAD];
+  int n;
+  while ((n = udp.parsePacket()) > 0) {
+    n = udp.read(pkt, min(n, (int)sizeof(pkt)));
+    if (n < 6 || pkt[0] != UDP_MAGIC) continue;
+    if (pkt[1] == UDP_NACK) {
+      uint32_t id;
+      uint16_t count;
+      memcpy(&id, pkt + 2, 4);
+      memcpy(&count, pkt + 6, 2);
+      udpStats.nacks++;
+      // Chỉ frame mới nhất còn đáng gửi lại
+      if (id != udpLastHdr.frameId || !udpLast) continue;
+      for (int i = 0; i < count && 8 + 2 * i + 2 <= n; i++) {
+        uint16_t frag;
+        memcpy(&frag, pkt + 8 + 2 * i, 2);
+        if (frag < udpLastHdr.frags && udpSendFrag(udpLastHdr, udpLast, frag)) udpStats.resent++;
+      }
+    } else if (pkt[1] == UDP_STATS && n >= (int)sizeof(UdpStats)) {
+      UdpStats st;
+      memcpy(&st, pkt, sizeof(st));
+      if (udpFrameId - st.frameId >= INGEST_WINDOW) continue;
+      int64_t us = esp_timer_get_time() - udpSentUs[st.frameId % INGEST_WINDOW];
+      quality_sample(&quality, udpBytes[st.frameId % INGEST_WINDOW], esp_timer_get_time() - udpQueuedUs[st.frameId % INGEST_WINDOW], us, st.serverMs);
+      LOG_INFO("✓ udp #%u in %lld ms, server %u ms, %u complete / %u dropped, %u resent\n", (unsigned)st.frameId, (long long)(us / 1000),
+               st.serverMs, (unsigned)st.complete, (unsigned)st.dropped, (unsigned)udpStats.resent);
+    }
+  }
+}
+
+// Cắt frame thành gói UDP và gửi hết, không chờ gì từ server
+bool udpSendFrame(const QueuedFrame& q) {
+  camera_fb_t* fb = q.fb;
+  if (!fb) return false;
+  UdpFragHdr h = {};
+  h.magic = UDP_MAGIC;
+  h.type = UDP_FRAG;
+  h.version = UDP_VERSION;
+  h.frameId = ++udpFrameId;
+  h.frameLen = fb->len;
+  h.frags = (fb->len + UDP_PAYLOAD - 1) / UDP_PAYLOAD;
+  h.motion = q.motion;
+  h.faces = q.faces;
+  udpSentUs[h.frameId % INGEST_WINDOW] = esp_timer_get_time();
+  udpQueuedUs[h.frameId % INGEST_WINDOW] = q.queuedUs;
+  udpBytes[h.frameId % INGEST_WINDOW] = fb->len;
+  bool ok = true;
+  for (uint16_t i = 0; i < h.frags; i++) {
+    ok &= udpSendFrag(h, fb->buf, i);
+    if (i % UDP_BURST == UDP_BURST - 1) taskYIELD();
+  }
+  // Giữ bản sao cho NACK; chỉ cấp phát lại khi frame lớn hơn lần trước
+  if (fb->len > udpLastCap) {
+    free(udpLast);
+    udpLastCap = fb->len + fb->len / 4;
+    udpLast = (uint8_t*)ps_malloc(udpLastCap);
+    if (!udpLast) udpLastCap = 0;
+  }
+  if (udpLast) {
+    memcpy(udpLast, fb->buf, fb->len);
+    udpLastHdr = h;
+  }
+  udpStats.frames++;
+  readUdpFeedback();
+  return ok;
+}
+
+// Chụp liên tục, chỉ giữ frame có chuyển động
+void captureTask(void* arg) {
+  uint32_t lastQueued = 0;
+  while (true) {
+    camera_fb_t* fb = esp_camera_fb_get();
+    if (!fb) {
+      LOG_ERR("Camera capture failed\n");
+      delay(1000);
+      continue;
+    }
+    // JPEG dài hơn buffer bị cắt cụt: không gửi, uploadTask hạ chất lượng
+    sensor_t* sensor = esp_camera_sensor_get();
+    bool whole = jpeg_size_frame(&jpegSize, fb, sensor->status.quality);
+    if (jpeg_size_persist(&jpegSize)) {
+      LOG_INFO("Frame buffer need %u B saved for next boot (now %u B)\n", (unsigned)jpegSize.saved, (unsigned)jpegSize.capacity);
+    }
+    if (!whole) {
+      truncatedSize = sensor->status.framesize;
+      truncatedQuality = sensor->status.quality;
+      LOG_ERR("Truncated frame %ux%u, %u B in a %u B buffer, %u so far\n", fb->width, fb->height, (unsigned)fb->len, (unsigned)jpegSize.capacity,
+              (unsigned)jpegSize.truncated);
+      esp_camera_fb_return(fb);
+      continue;
+    }
+    // Cảnh đứng yên (hoặc ảnh nhoè / tối): bỏ ảnh, chụp lại ngay
+    if (!motion_gate(&motion, fb)) {
+      esp_camera_fb_return(fb);
+      delay(100);
+      continue;
+    }
+    QueuedFrame q = {fb, motion.score, motion.sharpness, motion.luma, -1};
+    q.tiles = 0;
+    // Mốc chụp theo đồng hồ thiết bị: server tách trễ trên ESP32 / Wi-Fi / server (X-Timestamp, X-Send-Time)
+    q.captureUs = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    q.seq = ++captureSeq;
+#if USE_FACE_GATE
+    if (detect_faces) {
+      int n = face_track(&faceTrack, &faceWork, fb, q.boxes, FACE_MAX_BOXES);
+      q.faces = n < 0 ? 0 : n > FACE_MAX_BOXES ? FACE_MAX_BOXES : n;
+      // Không có mặt: bỏ, trừ 1 ảnh mỗi FACE_IDLE_MS
+      if (!q.faces && millis() - lastQueued < FACE_IDLE_MS) {
+        esp_camera_fb_return(fb);
+        continue;
+      }
+    }
+#endif
+#if USE_FACE_TILES && USE_STREAM_INGEST && !USE_UDP_TRANSPORT
+    // Có mặt người: chỉ giữ các ô cắt, frame gốc trả lại camera ngay
+    if (q.faces > 0 && makeTiles(q)) {
+      esp_camera_fb_return(fb);
+      q.fb = NULL;
+    }
+#endif
+    q.queuedUs = esp_timer_get_time();
+    lastQueued = millis();
+    if (xQueueSend(frameQueue, &q, 0) != pdTRUE) {
+      // Hàng đợi đầy: bỏ frame cũ nhất, frame mới vào thay
+      QueuedFrame old;
+      if (xQueueReceive(frameQueue, &old, 0) == pdTRUE) {
+        releaseFrame(old);
+        framesReplaced++;
+      }
+      if (xQueueSend(frameQueue, &q, 0) != pdTRUE) releaseFrame(q);
+    }
+  }
+}
+
+// Heap nội (WiFi, driver camera dùng chung) sau mỗi frame: in khi xuống
+// mức thấp mới, và đều đặn mỗi HEAP_LOG_MS. Chạy ổn định thì mức thấp nhất
+// phải đứng yên sau vài frame đầu.
+void logHeap() {
+  static size_t lowest = SIZE_MAX;
+  static uint32_t lastLog = 0;
+  size_t minFree = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+  if (minFree >= lowest && millis() - lastLog < HEAP_LOG_MS) return;
+  lowest = minFree;
+  lastLog = millis();
+  LOG_INFO("Heap: %u free, %u lowest ever, %u largest block\n", (unsigned)heap_caps_get_free_size(MALLOC_CAP_INTERNAL), (unsigned)minFree,
+           (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+}
+
+// Có mạng / mất mạng: in thời gian kết nối, số lần rớt
+void logWifi(wifi_link_event_t e) {
+  if (e == WIFI_LINK_UP) {
+    if (!bootTimeline.ipUs) bootTimeline.ipUs = esp_timer_get_time();
+    IPAddress ip = WiFi.localIP();
+    LOG_INFO("WiFi up in %u ms (%s, attempt %u), IP %u.%u.%u.%u, avg %u ms, best %u, worst %u, %u drop(s)\n", (unsigned)wifi.last_connect_ms,
+             wifi.fast ? "cached AP" : "scan", (unsigned)wifi.attempts, ip[0], ip[1], ip[2], ip[3], (unsigned)(wifi.connect_ms_sum / wifi.connects),
+             (unsigned)wifi.best_connect_ms, (unsigned)wifi.worst_connect_ms, (unsigned)wifi.drops);
+  } else if (e == WIFI_LINK_DOWN) {
+    LOG_ERR("WiFi lost (reason %u), reconnecting\n", wifi.last_reason);
+  }
+}
+
+// Lấy frame mới nhất trong hàng đợi và gửi
+void uploadTask(void* arg) {
+  while (true) {
+    logWifi(wifi_link_poll(&wifi));
+    // Frame bị cắt cụt ở đúng thiết lập hiện tại (frame cũ còn trong driver thì bỏ qua)
+    if (truncatedQuality == quality.quality && truncatedSize == quality.size) {
+      truncatedQuality = -1;
+      if (quality_overflow(&quality, esp_camera_sensor_get())) {
+        LOG_INFO("Quality -> %d, frame %ux%u after truncation (%u)\n", quality.quality, resolution[quality.size].width, resolution[quality.size].height,
+                 (unsigned)quality.overflows);
+      }
+    }
+    QueuedFrame q;
+    if (xQueueReceive(frameQueue, &q, 50 / portTICK_PERIOD_MS) != pdTRUE) {
+#if USE_UDP_TRANSPORT
+      readUdpFeedback();
+#elif USE_STREAM_INGEST
+      readIngestAcks();  // ACK tới lúc không có frame mới: đo latency cho đúng
+#endif
+      continue;
+    }
+    LOG_INFO("Picture taken! Size: %u bytes%s, motion: %d, faces: %d, queued %lld ms, replaced %u\n", (unsigned)frameBytes(q), q.tiles ? " (tiles)" : "", q.motion, q.faces,
+             (long long)((esp_timer_get_time() - q.queuedUs) / 1000), (unsigned)framesReplaced);
+    if (wifi_link_up(&wifi)) {
+#if USE_UDP_TRANSPORT
+      bool sent = udpSendFrame(q);
+#elif USE_STREAM_INGEST
+      bool sent = streamFrame(q);
+#else
+      int code = uploadFrame(q);
+      bool sent = code >= 200 && code < 300;
+#endif
+      if (sent && !bootTimeline.firstSentUs) {
+        bootTimeline.firstSentUs = esp_timer_get_time();
+        LOG_INFO("Boot timeline: camera %lld ms, first frame %lld ms, IP %lld ms, first frame sent %lld ms\n", (long long)(bootTimeline.cameraUs / 1000),
+                 (long long)(bootTimeline.warmUs / 1000), (long long)(bootTimeline.ipUs / 1000), (long long)(bootTimeline.firstSentUs / 1000));
+      }
+    } else {
+      LOG_ERR("WiFi not connected\n");
+      delay(500);
+    }
+    // Giải phóng bộ nhớ
+    releaseFrame(q);
+    if (quality_adjust(&quality, esp_camera_sensor_get())) {
+      LOG_INFO("Quality -> %d, frame %ux%u (latency %d ms, %u B/ms, server %d ms)\n", quality.quality, resolution[quality.size].width,
+               resolution[quality.size].height, quality.latency_ms, (unsigned)quality.bytes_per_ms, quality.server_ms);
+    }
+    logHeap();
+  }
+}
+
 void setup() {
   Serial.begin(115200);
   
-  // Kết nối WiFi
-  WiFi.begin(ssid, password);
-  Serial.print("Connecting to WiFi");
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-  }
-  Serial.println("\nWiFi connected!");
-  Serial.print("IP: ");
-  Serial.println(WiFi.localIP());
-  
+  // Kết nối WiFi chạy nền trong lúc khởi tạo camera, không chờ
+  wifi_link_init(&wifi, ssid, password);
+  wifi.ip = staticIp;
+  wifi.gateway = gatewayIp;
+  wifi.subnet = subnetMask;
+  wifi.dns = dnsIp;
+  wifi_link_begin(&wifi);
+
   // Cấu hình camera
   camera_config_t config;
   config.ledc_channel = LEDC_CHANNEL_0;
@@ -80,81 +927,92 @@ void setup() {
   if(psramFound()){
     config.frame_size = FRAMESIZE_SVGA;  // 800x600
     config.jpeg_quality = 10;
-    config.fb_count = 2;
+    config.fb_count = UPLOAD_QUEUE_DEPTH + 2;
+    config.fb_location = CAMERA_FB_IN_PSRAM;
+    config.grab_mode = CAMERA_GRAB_LATEST;  // Luôn lấy frame mới nhất, không lấy frame cũ còn trong driver
   } else {
     config.frame_size = FRAMESIZE_VGA;   // 640x480
     config.jpeg_quality = 12;
-    config.fb_count = 1;
+    config.fb_count = 1;                 // Chỉ 1 buffer: chụp phải chờ gửi xong
+    config.fb_location = CAMERA_FB_IN_DRAM;
+    config.grab_mode = CAMERA_GRAB_WHEN_EMPTY;
   }
-  
+
+  // Buffer theo cỡ JPEG đo được lần chạy trước: init ở cỡ frame nhỏ nhất có
+  // buffer đủ chừng đó byte, rồi đặt lại cỡ chụp ngay sau init
+  framesize_t captureSize = config.frame_size;
+  size_t fbNeed = 0;
+  jpeg_size_load(&fbNeed);
+  if (fbNeed) config.frame_size = jpeg_size_buffer(fbNeed, psramFound() ? FB_MAX_SIZE_PSRAM : FB_MAX_SIZE_DRAM);
+
   // Khởi tạo camera
   esp_err_t err = esp_camera_init(&config);
+  if (err != ESP_OK && config.frame_size != captureSize) {
+    // Không đủ RAM cho buffer đó: cấp như mặc định
+    config.frame_size = captureSize;
+    err = esp_camera_init(&config);
+  }
   if (err != ESP_OK) {
     Serial.printf("Camera init failed: 0x%x", err);
     return;
   }
+  if (config.frame_size != captureSize) esp_camera_sensor_get()->set_framesize(esp_camera_sensor_get(), captureSize);
+  jpeg_size_init(&jpegSize, jpeg_size_capacity(config.frame_size), fbNeed);
+  Serial.printf("Frame buffers %u x %u B (need %u B)\n", (unsigned)config.fb_count, (unsigned)jpegSize.capacity, (unsigned)fbNeed);
   
-  Serial.println("Camera initialized successfully!");
-}
+  bootTimeline.cameraUs = esp_timer_get_time();
+  Serial.printf("Camera initialized in %lld ms\n", (long long)(bootTimeline.cameraUs / 1000));
 
-void loop() {
-  // Chụp ảnh
-  camera_fb_t * fb = esp_camera_fb_get();
-  if(!fb) {
-    Serial.println("Camera capture failed");
-    delay(1000);
-    return;
+#if KERNELS_BENCH
+  kernel_bench_t bench[8];
+  int benchCount = kernels_bench(bench, 8);
+  for (int i = 0; i < benchCount; i++) {
+    Serial.printf("Kernel %-12s scalar %u.%02u  %s %u.%02u cycles/px\n", bench[i].name, bench[i].scalar_cpp100 / 100, bench[i].scalar_cpp100 % 100,
+                  KERNELS_SWAR ? "swar" : "scalar", bench[i].fast_cpp100 / 100, bench[i].fast_cpp100 % 100);
   }
-  
-  Serial.println("Picture taken! Size: " + String(fb->len) + " bytes");
-  
-  // Gửi ảnh lên server
-  if(WiFi.status() == WL_CONNECTED) {
-    HTTPClient http;
-    
-    // Tăng timeout cho kết nối
-    http.setTimeout(10000); // 10 giây
-    
-    // Kết nối đến server
-    Serial.println("Connecting to: " + String(serverUrl));
-    
-    if(http.begin(serverUrl)) {
-      http.addHeader("Content-Type", "image/jpeg");
-      
-      // POST ảnh binary
-      Serial.println("Sending image...");
-      int httpResponseCode = http.POST(fb->buf, fb->len);
-      
-      if (httpResponseCode > 0) {
-        String response = http.getString();
-        Serial.println("✓ Response code: " + String(httpResponseCode));
-        Serial.println("✓ Response: " + response);
-      } else {
-        Serial.println("✗ Error code: " + String(httpResponseCode));
-        
-        // In chi tiết lỗi
-        if(httpResponseCode == -1) {
-          Serial.println("  → Connection failed. Check:");
-          Serial.println("    1. Flask server is running (python app.py)");
-          Serial.println("    2. Server IP is correct: " + String(serverUrl));
-          Serial.println("    3. Firewall allows port 5000");
-          Serial.println("    4. ESP32 and server on same network");
-        }
-      }
-      
-      http.end();
-    } else {
-      Serial.println("✗ Unable to connect to server!");
-      Serial.println("  Check server URL: " + String(serverUrl));
-    }
-  } else {
-    Serial.println("WiFi not connected");
+#endif
+
+  // Áp profile lưu trong NVS ngay sau init, trước khi có WiFi:
+  // frame đầu tiên đã đúng thiết lập, không chờ server gửi lại từng lệnh
+  char profileName[PROFILE_NAME_MAX + 1];
+  err = profile_boot(esp_camera_sensor_get(), profileName, sizeof(profileName));
+  Serial.printf("Profile %s%s\n", profileName, err == ESP_OK ? "" : " (apply failed)");
+
+  // Frame đầu sau init tốn thêm thời gian khởi động sensor và lần đo sáng
+  // đầu của AEC: chụp bỏ ngay lúc này, khi WiFi còn đang kết nối
+  camera_fb_t* warm = esp_camera_fb_get();
+  if (warm) esp_camera_fb_return(warm);
+  bootTimeline.warmUs = esp_timer_get_time();
+
+#if USE_UDP_TRANSPORT
+  udp.begin(UDP_LOCAL_PORT);
+#endif
+  if (!parseServerUrl(serverUrl)) {
+    Serial.printf("Bad server URL: %s\n", serverUrl);
   }
-  
-  // Giải phóng bộ nhớ
-  esp_camera_fb_return(fb);
-  
-  // Chờ 3 giây trước khi chụp ảnh tiếp theo
-  delay(500);
+
+  // Cỡ frame của profile là cỡ lớn nhất: chỉ hạ rồi nâng lại tới đó
+  quality_init(&quality, esp_camera_sensor_get());
+  quality.target_ms = QUALITY_TARGET_MS;
+  quality.band_pct = QUALITY_BAND_PCT;
+  quality.best_quality = QUALITY_BEST;
+  quality.worst_quality = QUALITY_WORST;
+
+  motion_init(&motion);
+  face_tracker_init(&faceTrack);
+  motion.thresh = MOTION_THRESH;
+  motion.min_score = MOTION_MIN_SCORE;
+  motion.hold_ms = MOTION_HOLD_MS;
+  motion.idle_ms = MOTION_IDLE_MS;
+  motion.min_sharpness = MOTION_MIN_SHARPNESS;
+  motion.min_luma = MOTION_MIN_LUMA;
+
+  frameQueue = xQueueCreate(UPLOAD_QUEUE_DEPTH, sizeof(QueuedFrame));
+  xTaskCreatePinnedToCore(captureTask, "capture", TASK_STACK, NULL, 2, NULL, CAPTURE_CORE);
+  xTaskCreatePinnedToCore(uploadTask, "upload", TASK_STACK, NULL, 2, NULL, UPLOAD_CORE);
 }
 
+void loop() {
+  // Việc chụp và gửi nằm ở captureTask / uploadTask
+  vTaskDelete(NULL);
+}
@@ -13,14 +13,24 @@
 // limitations under the License.
 #include "esp_http_server.h"
 #include "esp_timer.h"
+#include "esp_idf_version.h"
+#include "esp_heap_caps.h"
+#include "lwip/sockets.h"
+#include "esp_wifi.h"
 #include "esp_camera.h"
 #include "img_converters.h"
+#include "esp_jpg_decode.h"
 #include "fb_gfx.h"
 #include <Arduino.h>
 #include "esp32-hal-ledc.h"
 #include "sdkconfig.h"
 #include "camera_index.h"
 #include "board_config.h"
+#include "motion.h"
+#include "profile.h"
+#include "face_detect.h"
+#include "face_track.h"
+#include "frame_ring.h"
 
 #if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
 #include "esp32-hal-log.h"
@@ -43,8 +53,10 @@ typedef struct {
 
 #define PART_BOUNDARY "123456789000000000000987654321"
 static const char *_STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
-static const char *_STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
-static const char *_STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %d.%06d\r\n\r\n";
+// Boundary and part header of one frame, formatted and sent in one go. A
+// literal, not a pointer, so -Wformat checks the arguments of every caller.
+#define _STREAM_BOUNDARY_PART \
+  "\r\n--" PART_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %d.%06d\r\nX-Seq: %u\r\nX-Motion: %d\r\nX-Sharpness: %d\r\nX-Luma: %d\r\n\r\n"
 
 httpd_handle_t stream_httpd = NULL;
 httpd_handle_t camera_httpd = NULL;
@@ -72,23 +84,15 @@ static ra_filter_t *ra_filter_init(ra_filter_t *filter, size_t sample_size) {
   return filter;
 }
 
-// Face detection integration point (optional)
-#if defined(ENABLE_FACE_DETECT)
-typedef struct {
-  int x;
-  int y;
-  int w;
-  int h;
-  int score;
-} face_box_t;
-
-// Weak symbol: if your build links an ESP-WHO based implementation providing
-// `detect_faces`, it will be used. The function should return the number of
-// faces detected and fill the provided `face_box_t` array.
-extern "C" int detect_faces(const camera_fb_t *fb, face_box_t *boxes, int max_boxes) __attribute__((weak));
-#endif
+static void ra_filter_reset(ra_filter_t *filter) {
+  if (filter->values) {
+    memset(filter->values, 0, filter->size * sizeof(int));
+  }
+  filter->index = 0;
+  filter->count = 0;
+  filter->sum = 0;
+}
 
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
 static int ra_filter_run(ra_filter_t *filter, int value) {
   if (!filter->values) {
     return value;
@@ -103,7 +107,128 @@ static int ra_filter_run(ra_filter_t *filter, int value) {
   }
   return filter->sum / filter->count;
 }
-#endif
+
+// Always-on counters for /metrics (Prometheus text format). Observing is a
+// few adds under a spinlock, cheap enough for every frame in any build.
+#define METRICS_BUCKETS 10
+static const uint32_t metrics_bounds_us[METRICS_BUCKETS] = {1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000};
+static const char *metrics_bounds_le[METRICS_BUCKETS] = {"0.001", "0.002", "0.005", "0.01", "0.02", "0.05", "0.1", "0.2", "0.5", "1"};
+
+typedef struct {
+  uint32_t buckets[METRICS_BUCKETS + 1];  // Last one is +Inf
+  uint64_t sum_us;
+  uint32_t count;
+} metrics_hist_t;
+
+typedef struct {
+  metrics_hist_t capture;  // esp_camera_fb_get
+  metrics_hist_t age;      // Capture start (fb->timestamp) to esp_camera_fb_get handing the frame out
+  metrics_hist_t encode;   // frame2jpg for non-JPEG sensors
+  metrics_hist_t send;     // One stream frame, header + payload
+  uint64_t bytes_sent;
+  uint32_t frames_sent;
+  uint32_t frames_dropped;  // Viewer socket behind
+  uint32_t frames_paced;    // Held back by a viewer's ?fps=
+  uint32_t frames_still;    // Not published by the motion gate
+  uint32_t frames_overrun;  // Raw frames replaced before the encoder got to them
+  uint32_t capture_errors;
+  uint32_t frames_overwritten;  // Sensor frames the driver replaced before anyone took them (CAMERA_GRAB_LATEST)
+  uint32_t frames_missed;       // Sensor frames lost with every buffer taken (CAMERA_GRAB_WHEN_EMPTY)
+  uint32_t frames_stale;        // Taken and thrown away as older than the request (fb_get_after)
+  uint32_t sessions_rejected;  // Viewers turned away with a 503
+  uint32_t sessions_evicted;   // Viewers closed to make room
+} metrics_t;
+
+static metrics_t metrics;
+static portMUX_TYPE metrics_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void metrics_observe(metrics_hist_t *h, int64_t us) {
+  int i = 0;
+  while (i < METRICS_BUCKETS && us > metrics_bounds_us[i]) {
+    i++;
+  }
+  portENTER_CRITICAL(&metrics_mux);
+  h->buckets[i]++;
+  h->sum_us += us;
+  h->count++;
+  portEXIT_CRITICAL(&metrics_mux);
+}
+
+static void metrics_add(uint32_t *counter, uint32_t n) {
+  portENTER_CRITICAL(&metrics_mux);
+  *counter += n;
+  portEXIT_CRITICAL(&metrics_mux);
+}
+
+// Every frame buffer this file takes goes through camera_grab and
+// camera_release: /capture_mode can only restart the driver once they are
+// all back, and the buffer timestamps give the capture-to-dequeue age.
+// Sensor frames nobody took show up as a gap of more than one frame period
+// between consecutive buffers. The period is the shortest gap seen, let
+// grow by 1/256 per frame so it follows a slower frame size or clock.
+#define CAMERA_IDLE_US 1000000  // Longer between grabs: nobody was reading, the gap is not counted
+
+static int camera_held = 0;             // Buffers out of the driver
+static bool camera_restarting = false;  // camera_grab refuses while set
+static camera_grab_mode_t camera_grab_mode = CAMERA_GRAB_WHEN_EMPTY;
+static int64_t camera_last_ts = 0;
+static int64_t camera_last_grab = 0;
+static int64_t camera_period_us = 0;
+
+static int64_t fb_timestamp_us_tv(const struct timeval *tv) {
+  return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static int64_t fb_timestamp_us(const camera_fb_t *fb) {
+  return fb_timestamp_us_tv(&fb->timestamp);
+}
+
+static camera_fb_t *camera_grab() {
+  portENTER_CRITICAL(&metrics_mux);
+  bool refused = camera_restarting;
+  if (!refused) {
+    camera_held++;
+  }
+  portEXIT_CRITICAL(&metrics_mux);
+  if (refused) {
+    return NULL;
+  }
+  int64_t t0 = esp_timer_get_time();
+  camera_fb_t *fb = esp_camera_fb_get();
+  int64_t now = esp_timer_get_time();
+  if (!fb) {
+    portENTER_CRITICAL(&metrics_mux);
+    camera_held--;
+    portEXIT_CRITICAL(&metrics_mux);
+    return NULL;
+  }
+  int64_t ts = fb_timestamp_us(fb);
+  metrics_observe(&metrics.age, now - ts);
+  portENTER_CRITICAL(&metrics_mux);
+  int64_t gap = ts - camera_last_ts;
+  if (camera_last_ts && gap > 0) {
+    camera_period_us += camera_period_us >> 8;
+    if (!camera_period_us || gap < camera_period_us) {
+      camera_period_us = gap;
+    }
+    if (t0 - camera_last_grab < CAMERA_IDLE_US) {
+      uint32_t lost = (uint32_t)((gap + camera_period_us / 2) / camera_period_us) - 1;
+      *(camera_grab_mode == CAMERA_GRAB_LATEST ? &metrics.frames_overwritten : &metrics.frames_missed) += lost;
+    }
+  }
+  camera_last_ts = ts;
+  camera_last_grab = now;
+  portEXIT_CRITICAL(&metrics_mux);
+  return fb;
+}
+
+static void camera_release(camera_fb_t *fb) {
+  esp_camera_fb_return(fb);
+  portENTER_CRITICAL(&metrics_mux);
+  camera_held--;
+  portEXIT_CRITICAL(&metrics_mux);
+}
+
 #if defined(LED_GPIO_NUM)
 void enable_led(bool en) {  // Turn LED On or Off
   int duty = en ? led_duty : 0;
@@ -118,15 +243,141 @@ void enable_led(bool en) {  // Turn LED On or Off
 }
 #endif
 
+// BMP is converted while it is sent: the 54-byte header, then
+// BMP_STRIP_ROWS rows at a time through one strip buffer, instead of
+// frame2bmp's full-frame copy (1.4 MB at SVGA). The negative height in the
+// header makes the rows top-down so they go out in capture order. JPEG
+// frames go through esp_jpg_decode, whose MCU rows (8 or 16 lines) each
+// fill one strip.
+#define BMP_HEADER_LEN 54
+#define BMP_STRIP_ROWS 16
+
+typedef struct {
+  httpd_req_t *req;
+  camera_fb_t *fb;
+  uint8_t *strip;
+  size_t row_len;  // Bytes per BMP row: BGR888 padded to 4
+  size_t len;      // Bytes sent so far
+} bmp_chunking_t;
+
+static void bmp_put(uint8_t *p, uint32_t v, int n) {
+  for (int i = 0; i < n; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+static bool bmp_send(bmp_chunking_t *b, const uint8_t *data, size_t len) {
+  if (httpd_resp_send_chunk(b->req, (const char *)data, len) != ESP_OK) {
+    return false;
+  }
+  b->len += len;
+  return true;
+}
+
+static bool bmp_send_header(bmp_chunking_t *b) {
+  uint8_t h[BMP_HEADER_LEN] = {'B', 'M'};
+  uint32_t image = b->row_len * b->fb->height;
+  bmp_put(h + 2, BMP_HEADER_LEN + image, 4);
+  bmp_put(h + 10, BMP_HEADER_LEN, 4);
+  bmp_put(h + 14, 40, 4);  // BITMAPINFOHEADER
+  bmp_put(h + 18, b->fb->width, 4);
+  bmp_put(h + 22, -(int32_t)b->fb->height, 4);
+  bmp_put(h + 26, 1, 2);
+  bmp_put(h + 28, 24, 2);
+  bmp_put(h + 34, image, 4);
+  return bmp_send(b, h, sizeof(h));
+}
+
+static size_t bmp_jpg_read(void *arg, size_t index, uint8_t *buf, size_t len) {
+  bmp_chunking_t *b = (bmp_chunking_t *)arg;
+  if (buf) {
+    memcpy(buf, b->fb->buf + index, len);
+  }
+  return len;
+}
+
+// Decoded RGB888 block at x,y; a strip is complete with its rightmost block
+static bool bmp_jpg_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+  bmp_chunking_t *b = (bmp_chunking_t *)arg;
+  if (!data) {
+    // Start (at 0,0) announces the output size, end has nothing to do
+    return x || y || (w == b->fb->width && h == b->fb->height);
+  }
+  if (h > BMP_STRIP_ROWS) {
+    return false;
+  }
+  for (int r = 0; r < h; r++) {
+    const uint8_t *s = data + r * w * 3;
+    uint8_t *o = b->strip + r * b->row_len + x * 3;
+    for (int i = 0; i < w * 3; i += 3) {
+      o[i] = s[i + 2];
+      o[i + 1] = s[i + 1];
+      o[i + 2] = s[i];
+    }
+  }
+  if (x + w < b->fb->width) {
+    return true;
+  }
+  return bmp_send(b, b->strip, h * b->row_len);
+}
+
+static size_t bmp_pixel_bytes(pixformat_t format) {
+  switch (format) {
+    case PIXFORMAT_GRAYSCALE: return 1;
+    case PIXFORMAT_RGB565:
+    case PIXFORMAT_YUV422:    return 2;
+    case PIXFORMAT_RGB888:    return 3;
+    default:                  return 0;
+  }
+}
+
+static bool bmp_encode_stream(bmp_chunking_t *b) {
+  camera_fb_t *fb = b->fb;
+  if (!bmp_send_header(b)) {
+    return false;
+  }
+  if (fb->format == PIXFORMAT_JPEG) {
+    return esp_jpg_decode(fb->len, JPG_SCALE_NONE, bmp_jpg_read, bmp_jpg_write, b) == ESP_OK;
+  }
+  size_t src_row = fb->width * bmp_pixel_bytes(fb->format);
+  for (size_t y = 0; y < fb->height; y += BMP_STRIP_ROWS) {
+    size_t rows = fb->height - y < BMP_STRIP_ROWS ? fb->height - y : BMP_STRIP_ROWS;
+    for (size_t r = 0; r < rows; r++) {
+      if (!fmt2rgb888(fb->buf + (y + r) * src_row, src_row, fb->format, b->strip + r * b->row_len)) {
+        return false;
+      }
+    }
+    if (!bmp_send(b, b->strip, rows * b->row_len)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 static esp_err_t bmp_handler(httpd_req_t *req) {
   camera_fb_t *fb = NULL;
   esp_err_t res = ESP_OK;
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
   uint64_t fr_start = esp_timer_get_time();
 #endif
-  fb = esp_camera_fb_get();
+  int64_t cap_start = esp_timer_get_time();
+  fb = camera_grab();
   if (!fb) {
     log_e("Camera capture failed");
+    metrics_add(&metrics.capture_errors, 1);
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  metrics_observe(&metrics.capture, esp_timer_get_time() - cap_start);
+
+  bmp_chunking_t bchunk = {req, fb, NULL, (fb->width * 3 + 3) & ~3u, 0};
+  if (fb->format != PIXFORMAT_JPEG && !bmp_pixel_bytes(fb->format)) {
+    log_e("BMP: unsupported pixel format %d", fb->format);
+  } else {
+    bchunk.strip = (uint8_t *)calloc(BMP_STRIP_ROWS, bchunk.row_len);
+  }
+  if (!bchunk.strip) {
+    camera_release(fb);
     httpd_resp_send_500(req);
     return ESP_FAIL;
   }
@@ -139,21 +390,18 @@ static esp_err_t bmp_handler(httpd_req_t *req) {
   snprintf(ts, 32, "%lld.%06ld", fb->timestamp.tv_sec, fb->timestamp.tv_usec);
   httpd_resp_set_hdr(req, "X-Timestamp", (const char *)ts);
 
-  uint8_t *buf = NULL;
-  size_t buf_len = 0;
-  bool converted = frame2bmp(fb, &buf, &buf_len);
-  esp_camera_fb_return(fb);
-  if (!converted) {
+  if (bmp_encode_stream(&bchunk)) {
+    res = httpd_resp_send_chunk(req, NULL, 0);
+  } else {
     log_e("BMP Conversion failed");
-    httpd_resp_send_500(req);
-    return ESP_FAIL;
+    res = ESP_FAIL;
   }
-  res = httpd_resp_send(req, (const char *)buf, buf_len);
-  free(buf);
+  camera_release(fb);
+  free(bchunk.strip);
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
   uint64_t fr_end = esp_timer_get_time();
 #endif
-  log_i("BMP: %llums, %uB", (uint64_t)((fr_end - fr_start) / 1000), buf_len);
+  log_i("BMP: %llums, %uB", (uint64_t)((fr_end - fr_start) / 1000), bchunk.len);
   return res;
 }
 
@@ -169,27 +417,94 @@ static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_
   return len;
 }
 
+// Integer query parameter, def when absent
+static int query_int(httpd_req_t *req, const char *key, int def) {
+  char query[64];
+  char value[12];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK || httpd_query_key_value(query, key, value, sizeof(value)) != ESP_OK) {
+    return def;
+  }
+  return atoi(value);
+}
+
+// First frame whose capture started after `since` (esp_timer us), skipping
+// `skip` more after that: frames already buffered or being read out when a
+// setting changed are dropped. NULL on capture failure or timeout.
+static camera_fb_t *fb_get_after(int64_t since, int skip, int timeout_ms) {
+  while (esp_timer_get_time() - since < timeout_ms * 1000LL) {
+    camera_fb_t *fb = camera_grab();
+    if (!fb) {
+      return NULL;
+    }
+    if (fb_timestamp_us(fb) > since && skip-- <= 0) {
+      return fb;
+    }
+    camera_release(fb);
+    metrics_add(&metrics.frames_stale, 1);
+  }
+  return NULL;
+}
+
+#if defined(LED_GPIO_NUM)
+#define FLASH_SETTLE_FRAMES 0     // Default extra lit frames for AEC to adjust (?settle=)
+#define FLASH_MAX_SETTLE    8
+#define FLASH_TIMEOUT_MS    1000
+
+// Flash snapshot: drop frames that were already buffered (or started) before
+// the LED came on, then skip `settle` lit frames so auto exposure can catch
+// up. Returns as soon as that frame exists instead of after a fixed sleep.
+static camera_fb_t *capture_lit_frame(int settle) {
+  enable_led(true);
+  camera_fb_t *fb = fb_get_after(esp_timer_get_time(), settle, FLASH_TIMEOUT_MS);
+  enable_led(false);
+  if (!fb) {
+    log_e("No lit frame within %dms", FLASH_TIMEOUT_MS);
+  }
+  return fb;
+}
+#endif
+
+#define CAPTURE_FRESH_TIMEOUT_MS 1000
+
+static esp_err_t ring_capture(httpd_req_t *req);
+
 static esp_err_t capture_handler(httpd_req_t *req) {
+  char query[64];
+  char value[24];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK
+      && (httpd_query_key_value(query, "at", value, sizeof(value)) == ESP_OK || httpd_query_key_value(query, "ago", value, sizeof(value)) == ESP_OK
+          || httpd_query_key_value(query, "seq", value, sizeof(value)) == ESP_OK || httpd_query_key_value(query, "best", value, sizeof(value)) == ESP_OK)) {
+    return ring_capture(req);
+  }
   camera_fb_t *fb = NULL;
   esp_err_t res = ESP_OK;
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
   int64_t fr_start = esp_timer_get_time();
 #endif
 
+  // ?fresh=1: a frame whose capture started after the request, whatever the
+  // grab mode left buffered
+  bool fresh = query_int(req, "fresh", 0) == 1;
 #if defined(LED_GPIO_NUM)
-  enable_led(true);
-  vTaskDelay(150 / portTICK_PERIOD_MS);  // The LED needs to be turned on ~150ms before the call to esp_camera_fb_get()
-  fb = esp_camera_fb_get();              // or it won't be visible in the frame. A better way to do this is needed.
-  enable_led(false);
+  int64_t cap_start = esp_timer_get_time();
+  if (led_duty > 0) {
+    int settle = query_int(req, "settle", FLASH_SETTLE_FRAMES);
+    fb = capture_lit_frame(settle < 0 ? 0 : settle > FLASH_MAX_SETTLE ? FLASH_MAX_SETTLE : settle);
+  } else {
+    fb = fresh ? fb_get_after(cap_start, 0, CAPTURE_FRESH_TIMEOUT_MS) : camera_grab();
+  }
 #else
-  fb = esp_camera_fb_get();
+  int64_t cap_start = esp_timer_get_time();
+  fb = fresh ? fb_get_after(cap_start, 0, CAPTURE_FRESH_TIMEOUT_MS) : camera_grab();
 #endif
 
   if (!fb) {
     log_e("Camera capture failed");
+    metrics_add(&metrics.capture_errors, 1);
     httpd_resp_send_500(req);
     return ESP_FAIL;
   }
+  metrics_observe(&metrics.capture, esp_timer_get_time() - cap_start);
 
   httpd_resp_set_type(req, "image/jpeg");
   httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
@@ -215,7 +530,7 @@ static esp_err_t capture_handler(httpd_req_t *req) {
     fb_len = jchunk.len;
 #endif
   }
-  esp_camera_fb_return(fb);
+  camera_release(fb);
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
   int64_t fr_end = esp_timer_get_time();
 #endif
@@ -223,468 +538,3229 @@ static esp_err_t capture_handler(httpd_req_t *req) {
   return res;
 }
 
-static esp_err_t stream_handler(httpd_req_t *req) {
-  camera_fb_t *fb = NULL;
-  struct timeval _timestamp;
-  esp_err_t res = ESP_OK;
-  size_t _jpg_buf_len = 0;
-  uint8_t *_jpg_buf = NULL;
-  char *part_buf[128];
+// MJPEG fan-out: one capture task publishes refcounted frames, every /stream
+// client gets its own sender task (async request) that always sends the
+// newest frame and counts the ones it had to skip. A slow viewer only holds
+// the buffer it is sending, so with fb_count >= viewers + 1 it never holds
+// up capture or the other viewers.
+//
+// Capture runs pinned to the app core while the senders share the protocol
+// core with Wi-Fi and lwIP, so the next frame is grabbed while the previous
+// one is on the air: throughput is min(sensor fps, link fps) rather than
+// their harmonic sum. The hand-off is the one-deep "latest" slot, which
+// never lets a backlog build up.
+//
+// Non-JPEG frames (RGB565, grayscale for detection) are encoded by their
+// own task on the protocol core, below the senders' priority, taking the
+// raw frame from a one-deep slot of its own; the capture task meanwhile
+// runs the motion gate and face detection on the next one. Frames and
+// JPEG buffers come from fixed pools: one per sender, the newest, one
+// being captured and one being encoded, so steady-state streaming makes
+// no allocation. An encode buffer is sized to the frame (half a byte per
+// pixel) on first use and only grown after a frame did not fit.
+//
+// Renditions: /stream?size=<max width>&q=<quality> gets a smaller or
+// cheaper copy of the same frames. One task decodes each published JPEG at
+// 1/2, 1/4 or 1/8 scale (the largest that is at most size wide), encodes
+// it again at q and publishes it into that rendition's own latest slot, so
+// viewers asking for the same size and q share one encode, and the
+// rendition task only works on the newest frame: a slow encode skips
+// frames rather than queueing them. A rendition that would be the original
+// anyway (size at least the frame width, no q) is the original frame
+// itself. Up to STREAM_RENDITIONS different renditions at a time; a slot
+// is given back with its last viewer.
+//
+// Frames of a still scene are not published at all (see motion.h): with
+// the default gate an empty corridor costs one frame per idle_ms per
+// viewer. Settings are the motion_* variables of /control.
+//
+// Admission: at most STREAM_MAX_CLIENTS viewers. When they are all taken a
+// newcomer evicts the one that has gone longest without a frame delivered,
+// provided it has been stuck for STREAM_STALL_MS; a priority viewer
+// (?ingest=1, the face server's own pull) evicts the least recently served
+// browser even if it is not. Anyone else gets a 503. The evicted viewer's
+// sender closes its socket, which can take up to the send timeout while it
+// is stuck in a send, so one spare slot lets the newcomer start at once.
+#define STREAM_MAX_CLIENTS   4
+#define STREAM_SLOTS         (STREAM_MAX_CLIENTS + 1)
+#define STREAM_STALL_MS      5000
+#define STREAM_CAPTURE_STACK 4096
+#define STREAM_SENDER_STACK  4096
+#define STREAM_WAIT_MS       1000  // Sender wakes this often even without frames
+#define STREAM_MAX_FPS       60    // Highest ?fps= a viewer may ask for
+#define STREAM_BURST         2     // Token bucket depth, frames
+// 1: write the response head and each frame straight to the socket (plain
+// multipart until close, 2 sends per frame). 0: chunked encoding through
+// httpd_resp_send_chunk, which costs 3 sends per call (size, data, CRLF).
+#define STREAM_RAW_SEND      1
+#if CONFIG_FREERTOS_UNICORE
+#define STREAM_CAPTURE_CORE  tskNO_AFFINITY
+#define STREAM_SEND_CORE     tskNO_AFFINITY
+#else
+#define STREAM_CAPTURE_CORE  1     // APP_CPU: capture, motion and face detection
+#define STREAM_SEND_CORE     0     // PRO_CPU: next to the Wi-Fi and TCP/IP tasks
+#endif
+#define STREAM_ENCODE_CORE   STREAM_SEND_CORE
+// Face detection shares the capture core below the capture task, so it
+// only gets the time capture leaves over
+#define FACE_DETECT_CORE     STREAM_CAPTURE_CORE
+#define FACE_DETECT_PRIORITY (tskIDLE_PRIORITY + 2)
+#define FACE_DETECT_STACK    8192
+#define STREAM_ENCODE_STACK  4096
+#define STREAM_ENCODE_QUALITY 80
+#define STREAM_RENDITIONS    3
+#define STREAM_RENDITION_STACK 4096
+// Renditions add one latest frame each and the one being built, /thumb the one it reads
+#define STREAM_FRAMES        (STREAM_SLOTS + 4 + STREAM_RENDITIONS + 2)
+#define STREAM_ENCODE_BUFS   (STREAM_SLOTS + 2 + STREAM_RENDITIONS + 2)
+#define STREAM_ENCODE_GROW_MAX 2   // An encode buffer is at most 4x its first size
 
-  static int64_t last_frame = 0;
-  if (!last_frame) {
-    last_frame = esp_timer_get_time();
-  }
+#define STREAM_MAX_FACES     4     // Face boxes kept per frame
+#define STREAM_PART_BUF      512   // Part header or /events message (434 bytes with 4 boxes)
 
-  res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-  if (res != ESP_OK) {
-    return res;
-  }
+typedef struct __attribute__((packed)) {
+  int16_t x, y, w, h;
+  int16_t score;
+  int16_t id;  // Track id, the same face keeps it across frames
+} stream_box_t;
 
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  httpd_resp_set_hdr(req, "X-Framerate", "60");
+typedef struct {
+  camera_fb_t *fb;  // Returned to the driver on the last release; NULL once encoded
+  uint8_t *buf;
+  int encode_buf;   // stream_encode_bufs slot holding buf, -1: none
+  size_t len;
+  uint16_t width, height;
+  struct timeval timestamp;
+  uint32_t seq;  // A rendition keeps the seq of the frame it was made from
+  int motion;  // motion_score of the frame, -1: not scored
+  int sharpness;  // Of the motion gate's thumbnail, -1 with motion
+  int luma;
+  int faces;   // Valid boxes, only filled while a viewer asked for them
+  stream_box_t boxes[STREAM_MAX_FACES];
+  int refs;
+} stream_frame_t;
 
-#if defined(LED_GPIO_NUM)
-  isStreaming = true;
-  enable_led(true);
-#endif
+typedef struct {
+  httpd_req_t *req;
+  SemaphoreHandle_t ready;  // Given by the capture task for each new frame
+  uint32_t last_seq;
+  uint32_t sent;
+  uint32_t dropped;  // Frames published while this client was still sending
+  uint32_t paced;    // Frames skipped to hold the target fps
+  int target_fps;    // 0: as fast as capture and the socket allow
+  int64_t bucket_us; // Token bucket, one frame costs 1000000 / target_fps
+  int64_t last_send;
+  ra_filter_t interval;  // Actual ms between frames sent
+  uint64_t hdr_us;   // Time in header sends, all frames
+  uint64_t send_us;  // Time in header + payload sends, all frames
+  bool faces;        // Wants face boxes (/ws?faces=1, /events)
+  bool events;       // /events viewer: per-frame results instead of JPEGs
+  httpd_handle_t ws_hd;  // /ws viewer (req is NULL then)
+  int ws_fd;         // -1: MJPEG viewer, or a /ws socket that was replaced
+  int credits;       // Frames a /ws viewer is ready for
+  bool priority;     // ?ingest=1: only evicted when stalled
+  int rendition;     // stream_renditions slot, -1: the original frames
+  bool evicted;      // Sender closes the socket and frees the slot
+  int64_t last_ok;   // esp_timer time of the last frame delivered (or admission)
+  bool active;
+} stream_client_t;
 
-  while (true) {
-    fb = esp_camera_fb_get();
-    if (!fb) {
-      log_e("Camera capture failed");
-      res = ESP_FAIL;
-    } else {
-      _timestamp.tv_sec = fb->timestamp.tv_sec;
-      _timestamp.tv_usec = fb->timestamp.tv_usec;
-      if (fb->format != PIXFORMAT_JPEG) {
-        bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
-        esp_camera_fb_return(fb);
-        fb = NULL;
-        if (!jpeg_converted) {
-          log_e("JPEG compression failed");
-          res = ESP_FAIL;
-        }
-      } else {
-        _jpg_buf_len = fb->len;
-        _jpg_buf = fb->buf;
-      }
-    }
-    if (res == ESP_OK) {
-      res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
-    }
-    if (res == ESP_OK) {
-      size_t hlen = snprintf((char *)part_buf, 128, _STREAM_PART, _jpg_buf_len, _timestamp.tv_sec, _timestamp.tv_usec);
-      res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
-    }
-    if (res == ESP_OK) {
-      res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
-    }
-    if (fb) {
-      esp_camera_fb_return(fb);
-      fb = NULL;
-      _jpg_buf = NULL;
-    } else if (_jpg_buf) {
-      free(_jpg_buf);
-      _jpg_buf = NULL;
-    }
-    if (res != ESP_OK) {
-      log_e("Send frame failed");
-      break;
-    }
-    int64_t fr_end = esp_timer_get_time();
+static SemaphoreHandle_t stream_lock = NULL;
+static SemaphoreHandle_t sensor_lock = NULL;  // Held by /roi while the sensor window is not the stream's
+static stream_client_t stream_clients[STREAM_SLOTS];
+static stream_frame_t *stream_latest = NULL;
 
-    int64_t frame_time = fr_end - last_frame;
-    last_frame = fr_end;
+// A JPEG decoded at 1/2^scale into a BGR888 frame (the camera's RGB888
+// order), then encoded again. The frame buffer stays for the next one and
+// only grows with the frame size. At 1/8 the decoder only uses the DC
+// coefficient of each block, no IDCT, which makes thumbnails cheap.
+typedef struct {
+  uint8_t *buf;
+  size_t size;
+  uint16_t width, height;
+  const uint8_t *src;
+} jpeg_scaled_t;
 
-    frame_time /= 1000;
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-    uint32_t avg_frame_time = ra_filter_run(&ra_filter, frame_time);
+typedef struct {
+  int size;     // Widest the frames may be, 0: full size
+  int quality;  // JPEG quality, 0: STREAM_ENCODE_QUALITY (or the original when not scaled)
+  int viewers;  // 0: slot free
+  stream_frame_t *latest;
+  jpeg_scaled_t scaled;  // Only touched by the rendition task
+  uint32_t encodes;
+  uint32_t shared;  // Frames that were the original as is
+  uint32_t failed;
+  uint64_t encode_us;  // Decode + encode, all encodes
+} stream_rendition_t;
+
+static stream_rendition_t stream_renditions[STREAM_RENDITIONS];
+static TaskHandle_t stream_rendition_handle = NULL;
+static TaskHandle_t stream_capture_handle = NULL;
+static int stream_client_count = 0;  // Active slots, evicted ones until their sender is gone
+static int stream_admitted = 0;      // Viewers counted against STREAM_MAX_CLIENTS
+static uint32_t stream_seq = 0;
+static motion_t stream_motion;
+static frame_ring_t frame_ring;  // Published frames, for /capture?at= and /clip
+#if defined(ENABLE_FACE_DETECT)
+static face_work_t stream_face_work;  // Capture task's working image
+static face_tracker_t stream_face_track;
+static face_async_t stream_face_async;  // Detector task; the capture task only reduces frames
+static bool stream_face_async_on = false;
 #endif
-    log_i(
-      "MJPG: %uB %ums (%.1ffps), AVG: %ums (%.1ffps)", (uint32_t)(_jpg_buf_len), (uint32_t)frame_time, 1000.0 / (uint32_t)frame_time, avg_frame_time,
-      1000.0 / avg_frame_time
-    );
+
+static void stream_capture_task(void *arg);
+
+// Caller holds stream_lock
+static void stream_capture_start() {
+  if (!stream_capture_handle) {
+    xTaskCreatePinnedToCore(stream_capture_task, "stream_cap", STREAM_CAPTURE_STACK, NULL, tskIDLE_PRIORITY + 5, &stream_capture_handle, STREAM_CAPTURE_CORE);
   }
+}
 
-#if defined(LED_GPIO_NUM)
-  isStreaming = false;
-  enable_led(false);
+static void stream_init() {
+  stream_lock = xSemaphoreCreateMutex();
+  sensor_lock = xSemaphoreCreateMutex();
+  motion_init(&stream_motion);
+#if defined(ENABLE_FACE_DETECT)
+  face_tracker_init(&stream_face_track);
+  stream_face_async_on = face_async_start(&stream_face_async, FACE_DETECT_CORE, FACE_DETECT_PRIORITY, FACE_DETECT_STACK);
 #endif
-
-  return res;
+  for (int i = 0; i < STREAM_SLOTS; i++) {
+    stream_clients[i].ready = xSemaphoreCreateBinary();
+    ra_filter_init(&stream_clients[i].interval, 20);
+  }
+  // With a ring to fill the capture task runs from boot, viewers or not
+  if (frame_ring_init(&frame_ring, FRAME_RING_BYTES)) {
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    stream_capture_start();
+    xSemaphoreGive(stream_lock);
+  } else {
+    log_w("No PSRAM for the frame ring, /capture?at= and /clip are off");
+  }
 }
 
-static esp_err_t parse_get(httpd_req_t *req, char **obuf) {
-  char *buf = NULL;
-  size_t buf_len = 0;
+typedef struct {
+  uint8_t *buf;
+  size_t size;
+  bool used;
+} stream_encode_buf_t;
 
-  buf_len = httpd_req_get_url_query_len(req) + 1;
-  if (buf_len > 1) {
-    buf = (char *)malloc(buf_len);
-    if (!buf) {
-      httpd_resp_send_500(req);
-      return ESP_FAIL;
-    }
-    if (httpd_req_get_url_query_str(req, buf, buf_len) == ESP_OK) {
-      *obuf = buf;
-      return ESP_OK;
+// Both pools are under stream_lock
+static stream_frame_t stream_frames[STREAM_FRAMES];
+static bool stream_frame_used[STREAM_FRAMES];
+static stream_encode_buf_t stream_encode_bufs[STREAM_ENCODE_BUFS];
+static int stream_encode_grow = 0;  // Buffers are (pixels / 2) << this
+static stream_frame_t *stream_encode_pending = NULL;
+static TaskHandle_t stream_encode_handle = NULL;
+
+static stream_frame_t *stream_frame_new() {
+  stream_frame_t *f = NULL;
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  for (int i = 0; i < STREAM_FRAMES && !f; i++) {
+    if (!stream_frame_used[i]) {
+      stream_frame_used[i] = true;
+      f = &stream_frames[i];
     }
-    free(buf);
   }
-  httpd_resp_send_404(req);
-  return ESP_FAIL;
+  xSemaphoreGive(stream_lock);
+  if (f) {
+    memset(f, 0, sizeof(*f));
+    f->encode_buf = -1;
+  }
+  return f;
 }
 
-static esp_err_t cmd_handler(httpd_req_t *req) {
-  char *buf = NULL;
-  char variable[32];
-  char value[32];
-
-  if (parse_get(req, &buf) != ESP_OK) {
-    return ESP_FAIL;
+// Hands the camera buffer back and puts the frame and its JPEG buffer back in their pools
+static void stream_frame_free(stream_frame_t *f) {
+  if (f->fb) {
+    camera_release(f->fb);
+    f->fb = NULL;
   }
-  if (httpd_query_key_value(buf, "var", variable, sizeof(variable)) != ESP_OK || httpd_query_key_value(buf, "val", value, sizeof(value)) != ESP_OK) {
-    free(buf);
-    httpd_resp_send_404(req);
-    return ESP_FAIL;
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  if (f->encode_buf >= 0) {
+    stream_encode_bufs[f->encode_buf].used = false;
   }
-  free(buf);
+  stream_frame_used[f - stream_frames] = false;
+  xSemaphoreGive(stream_lock);
+}
 
-  int val = atoi(value);
-  log_i("%s = %d", variable, val);
-  sensor_t *s = esp_camera_sensor_get();
-  int res = 0;
-
-  if (!strcmp(variable, "framesize")) {
-    if (s->pixformat == PIXFORMAT_JPEG) {
-      res = s->set_framesize(s, (framesize_t)val);
-    }
-  } else if (!strcmp(variable, "quality")) {
-    res = s->set_quality(s, val);
-  } else if (!strcmp(variable, "contrast")) {
-    res = s->set_contrast(s, val);
-  } else if (!strcmp(variable, "brightness")) {
-    res = s->set_brightness(s, val);
-  } else if (!strcmp(variable, "saturation")) {
-    res = s->set_saturation(s, val);
-  } else if (!strcmp(variable, "gainceiling")) {
-    res = s->set_gainceiling(s, (gainceiling_t)val);
-  } else if (!strcmp(variable, "colorbar")) {
-    res = s->set_colorbar(s, val);
-  } else if (!strcmp(variable, "awb")) {
-    res = s->set_whitebal(s, val);
-  } else if (!strcmp(variable, "agc")) {
-    res = s->set_gain_ctrl(s, val);
-  } else if (!strcmp(variable, "aec")) {
-    res = s->set_exposure_ctrl(s, val);
-  } else if (!strcmp(variable, "hmirror")) {
-    res = s->set_hmirror(s, val);
-  } else if (!strcmp(variable, "vflip")) {
-    res = s->set_vflip(s, val);
-  } else if (!strcmp(variable, "awb_gain")) {
-    res = s->set_awb_gain(s, val);
-  } else if (!strcmp(variable, "agc_gain")) {
-    res = s->set_agc_gain(s, val);
-  } else if (!strcmp(variable, "aec_value")) {
-    res = s->set_aec_value(s, val);
-  } else if (!strcmp(variable, "aec2")) {
-    res = s->set_aec2(s, val);
-  } else if (!strcmp(variable, "dcw")) {
-    res = s->set_dcw(s, val);
-  } else if (!strcmp(variable, "bpc")) {
-    res = s->set_bpc(s, val);
-  } else if (!strcmp(variable, "wpc")) {
-    res = s->set_wpc(s, val);
-  } else if (!strcmp(variable, "raw_gma")) {
-    res = s->set_raw_gma(s, val);
-  } else if (!strcmp(variable, "lenc")) {
-    res = s->set_lenc(s, val);
-  } else if (!strcmp(variable, "special_effect")) {
-    res = s->set_special_effect(s, val);
-  } else if (!strcmp(variable, "wb_mode")) {
-    res = s->set_wb_mode(s, val);
-  } else if (!strcmp(variable, "ae_level")) {
-    res = s->set_ae_level(s, val);
+static void stream_frame_release(stream_frame_t *f) {
+  if (!f) {
+    return;
   }
-#if defined(LED_GPIO_NUM)
-  else if (!strcmp(variable, "led_intensity")) {
-    led_duty = val;
-    if (isStreaming) {
-      enable_led(true);
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  bool last = --f->refs == 0;
+  xSemaphoreGive(stream_lock);
+  if (last) {
+    stream_frame_free(f);
+  }
+}
+
+// Makes f the newest frame; the reference it is created with goes to stream_latest
+static void stream_publish(stream_frame_t *f) {
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  stream_frame_t *old = stream_latest;
+  f->refs = 2;  // The second one keeps f alive through the ring copy
+  f->seq = ++stream_seq;
+  stream_latest = f;
+  for (int i = 0; i < STREAM_SLOTS; i++) {
+    if (stream_clients[i].active && stream_clients[i].rendition < 0) {
+      xSemaphoreGive(stream_clients[i].ready);
     }
   }
-#endif
-  else {
-    log_i("Unknown command: %s", variable);
-    res = -1;
+  bool renditions = false;
+  for (int i = 0; i < STREAM_RENDITIONS; i++) {
+    renditions |= stream_renditions[i].viewers > 0;
   }
-
-  if (res < 0) {
-    return httpd_resp_send_500(req);
+  TaskHandle_t rendition_task = renditions ? stream_rendition_handle : NULL;
+  xSemaphoreGive(stream_lock);
+  if (rendition_task) {
+    xTaskNotifyGive(rendition_task);
   }
-
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  return httpd_resp_send(req, NULL, 0);
+  frame_slot_t meta = {f->seq, fb_timestamp_us_tv(&f->timestamp), f->motion, f->sharpness, f->luma, f->width, f->height, 0, 0};
+  frame_ring_push(&frame_ring, f->buf, f->len, &meta);
+  stream_frame_release(old);
+  stream_frame_release(f);
 }
 
-static int print_reg(char *p, sensor_t *s, uint16_t reg, uint32_t mask) {
-  return sprintf(p, "\"0x%x\":%u,", reg, s->get_reg(s, reg, mask));
+// A free encode buffer of at least size bytes, grown in place when it is smaller; -1 when none
+static int stream_encode_buf_take(size_t size) {
+  int slot = -1;
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  for (int i = 0; i < STREAM_ENCODE_BUFS && slot < 0; i++) {
+    if (!stream_encode_bufs[i].used) {
+      stream_encode_bufs[i].used = true;
+      slot = i;
+    }
+  }
+  xSemaphoreGive(stream_lock);
+  if (slot < 0) {
+    return -1;
+  }
+  stream_encode_buf_t *b = &stream_encode_bufs[slot];
+  if (b->size < size) {
+    free(b->buf);
+    b->buf = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!b->buf) {
+      b->buf = (uint8_t *)malloc(size);
+    }
+    b->size = b->buf ? size : 0;
+  }
+  if (!b->buf) {
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    b->used = false;
+    xSemaphoreGive(stream_lock);
+    return -1;
+  }
+  return slot;
 }
 
-static esp_err_t status_handler(httpd_req_t *req) {
-  static char json_response[1024];
+typedef struct {
+  uint8_t *buf;
+  size_t size;
+  size_t len;
+  bool overflow;
+} stream_encode_out_t;
 
-  sensor_t *s = esp_camera_sensor_get();
-  char *p = json_response;
-  *p++ = '{';
+static size_t stream_encode_write(void *arg, size_t index, const void *data, size_t len) {
+  stream_encode_out_t *o = (stream_encode_out_t *)arg;
+  if (index + len > o->size) {
+    o->overflow = true;
+    return 0;
+  }
+  memcpy(o->buf + index, data, len);
+  o->len = index + len;
+  return len;
+}
 
-  if (s->id.PID == OV5640_PID || s->id.PID == OV3660_PID) {
-    for (int reg = 0x3400; reg < 0x3406; reg += 2) {
-      p += print_reg(p, s, reg, 0xFFF);  //12 bit
+static void stream_encode_task(void *arg) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    stream_frame_t *f = stream_encode_pending;
+    stream_encode_pending = NULL;
+    xSemaphoreGive(stream_lock);
+    if (!f) {
+      continue;
     }
-    p += print_reg(p, s, 0x3406, 0xFF);
+    int64_t t0 = esp_timer_get_time();
+    camera_fb_t *fb = f->fb;
+    int slot = stream_encode_buf_take(((size_t)fb->width * fb->height / 2) << stream_encode_grow);
+    stream_encode_out_t out = {slot >= 0 ? stream_encode_bufs[slot].buf : NULL, slot >= 0 ? stream_encode_bufs[slot].size : 0, 0, false};
+    bool ok = slot >= 0 && frame2jpg_cb(fb, STREAM_ENCODE_QUALITY, stream_encode_write, &out);
+    metrics_observe(&metrics.encode, esp_timer_get_time() - t0);
+    camera_release(fb);
+    f->fb = NULL;
+    f->encode_buf = slot;  // Back to the pool with the frame, even when it failed
+    if (!ok) {
+      if (out.overflow && stream_encode_grow < STREAM_ENCODE_GROW_MAX) {
+        stream_encode_grow++;
+      }
+      log_e("JPEG compression failed%s", out.overflow ? ", buffer too small" : "");
+      stream_frame_free(f);
+      continue;
+    }
+    f->buf = out.buf;
+    f->len = out.len;
+    stream_publish(f);
+  }
+}
 
-    p += print_reg(p, s, 0x3500, 0xFFFF0);  //16 bit
-    p += print_reg(p, s, 0x3503, 0xFF);
-    p += print_reg(p, s, 0x350a, 0x3FF);   //10 bit
-    p += print_reg(p, s, 0x350c, 0xFFFF);  //16 bit
+// Hands a raw frame to the encoder, replacing one it has not started on
+static void stream_encode_submit(stream_frame_t *f) {
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  stream_frame_t *old = stream_encode_pending;
+  stream_encode_pending = f;
+  if (!stream_encode_handle) {
+    xTaskCreatePinnedToCore(stream_encode_task, "stream_enc", STREAM_ENCODE_STACK, NULL, tskIDLE_PRIORITY + 4, &stream_encode_handle, STREAM_ENCODE_CORE);
+  }
+  TaskHandle_t encoder = stream_encode_handle;
+  xSemaphoreGive(stream_lock);
+  if (encoder) {
+    xTaskNotifyGive(encoder);
+  }
+  if (old) {
+    metrics_add(&metrics.frames_overrun, 1);
+    stream_frame_free(old);
+  }
+}
 
-    for (int reg = 0x5480; reg <= 0x5490; reg++) {
-      p += print_reg(p, s, reg, 0xFF);
-    }
+// Newest frame (of its rendition) if this client has not sent it yet, with a reference held
+static stream_frame_t *stream_frame_acquire(stream_client_t *c) {
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  stream_frame_t *f = c->rendition >= 0 ? stream_renditions[c->rendition].latest : stream_latest;
+  if (f && f->seq != c->last_seq) {
+    f->refs++;
+  } else {
+    f = NULL;
+  }
+  xSemaphoreGive(stream_lock);
+  return f;
+}
 
-    for (int reg = 0x5380; reg <= 0x538b; reg++) {
-      p += print_reg(p, s, reg, 0xFF);
-    }
+static size_t jpeg_scaled_read(void *arg, size_t index, uint8_t *buf, size_t len) {
+  jpeg_scaled_t *d = (jpeg_scaled_t *)arg;
+  if (buf) {
+    memcpy(buf, d->src + index, len);
+  }
+  return len;
+}
 
-    for (int reg = 0x5580; reg < 0x558a; reg++) {
-      p += print_reg(p, s, reg, 0xFF);
+// Decoded RGB888 block at x,y, swapped to BGR
+static bool jpeg_scaled_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+  jpeg_scaled_t *d = (jpeg_scaled_t *)arg;
+  if (!data) {
+    if (x || y) {
+      return true;
     }
-    p += print_reg(p, s, 0x558a, 0x1FF);  //9 bit
+    // Start announces the scaled size
+    size_t need = (size_t)w * h * 3;
+    if (d->size < need) {
+      free(d->buf);
+      d->buf = (uint8_t *)heap_caps_malloc(need, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+      if (!d->buf) {
+        d->buf = (uint8_t *)malloc(need);
+      }
+      d->size = d->buf ? need : 0;
+    }
+    d->width = w;
+    d->height = h;
+    return d->buf != NULL;
+  }
+  for (int row = 0; row < h && y + row < d->height; row++) {
+    const uint8_t *s = data + row * w * 3;
+    uint8_t *o = d->buf + ((size_t)(y + row) * d->width + x) * 3;
+    for (int i = 0; i < w * 3 && x + i / 3 < d->width; i += 3) {
+      o[i] = s[i + 2];
+      o[i + 1] = s[i + 1];
+      o[i + 2] = s[i];
+    }
+  }
+  return true;
+}
+
+// Largest JPG_SCALE_* that leaves width at most max_width (or 1/8), JPG_SCALE_NONE for 0
+static int jpeg_scale_for(int width, int max_width) {
+  int scale = JPG_SCALE_NONE;
+  while (max_width && scale < JPG_SCALE_MAX && (width >> scale) > max_width) {
+    scale++;
+  }
+  return scale;
+}
+
+static bool jpeg_scaled_decode(jpeg_scaled_t *d, const uint8_t *src, size_t len, int scale) {
+  d->src = src;
+  return esp_jpg_decode(len, (jpg_scale_t)scale, jpeg_scaled_read, jpeg_scaled_write, d) == ESP_OK;
+}
+
+static bool jpeg_scaled_encode(jpeg_scaled_t *d, int quality, stream_encode_out_t *out) {
+  return fmt2jpg_cb(d->buf, (size_t)d->width * d->height * 3, d->width, d->height, PIXFORMAT_RGB888, quality, stream_encode_write, out);
+}
+
+// Makes f the newest frame of rendition i, or drops it when its viewers left meanwhile
+static void stream_rendition_publish(int i, stream_frame_t *f) {
+  stream_rendition_t *r = &stream_renditions[i];
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  stream_frame_t *old = f;
+  if (r->viewers) {
+    old = r->latest;
+    r->latest = f;
+    for (int k = 0; k < STREAM_SLOTS; k++) {
+      if (stream_clients[k].active && stream_clients[k].rendition == i) {
+        xSemaphoreGive(stream_clients[k].ready);
+      }
+    }
+  }
+  xSemaphoreGive(stream_lock);
+  stream_frame_release(old);
+}
+
+// Rendition i of src: src itself when it needs no change, else decoded at
+// scale and encoded again
+static void stream_rendition_build(int i, stream_frame_t *src, int size, int quality) {
+  stream_rendition_t *r = &stream_renditions[i];
+  int scale = jpeg_scale_for(src->width, size);
+  if (scale == JPG_SCALE_NONE && !quality) {
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    src->refs++;
+    xSemaphoreGive(stream_lock);
+    r->shared++;
+    stream_rendition_publish(i, src);
+    return;
+  }
+  stream_frame_t *f = stream_frame_new();
+  if (!f) {
+    return;
+  }
+  int64_t t0 = esp_timer_get_time();
+  jpeg_scaled_t *d = &r->scaled;
+  bool ok = jpeg_scaled_decode(d, src->buf, src->len, scale);
+  int slot = ok ? stream_encode_buf_take(((size_t)d->width * d->height / 2) << stream_encode_grow) : -1;
+  stream_encode_out_t out = {slot >= 0 ? stream_encode_bufs[slot].buf : NULL, slot >= 0 ? stream_encode_bufs[slot].size : 0, 0, false};
+  ok = slot >= 0 && jpeg_scaled_encode(d, quality ? quality : STREAM_ENCODE_QUALITY, &out);
+  f->encode_buf = slot;
+  if (!ok) {
+    if (out.overflow && stream_encode_grow < STREAM_ENCODE_GROW_MAX) {
+      stream_encode_grow++;
+    }
+    r->failed++;
+    stream_frame_free(f);
+    return;
+  }
+  r->encodes++;
+  r->encode_us += esp_timer_get_time() - t0;
+  f->buf = out.buf;
+  f->len = out.len;
+  f->width = d->width;
+  f->height = d->height;
+  f->timestamp = src->timestamp;
+  f->seq = src->seq;
+  f->motion = src->motion;
+  f->sharpness = src->sharpness;
+  f->luma = src->luma;
+  f->faces = src->faces;
+  for (int k = 0; k < src->faces; k++) {
+    const stream_box_t *b = &src->boxes[k];
+    f->boxes[k] = {(int16_t)(b->x >> scale), (int16_t)(b->y >> scale), (int16_t)(b->w >> scale), (int16_t)(b->h >> scale), b->score, b->id};
+  }
+  f->refs = 1;
+  stream_rendition_publish(i, f);
+}
+
+// Woken by stream_publish; every rendition with viewers gets the newest frame
+static void stream_rendition_task(void *arg) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    int size[STREAM_RENDITIONS], quality[STREAM_RENDITIONS];
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    stream_frame_t *src = stream_latest;
+    if (src) {
+      src->refs++;
+    }
+    for (int i = 0; i < STREAM_RENDITIONS; i++) {
+      stream_rendition_t *r = &stream_renditions[i];
+      bool due = src && r->viewers && (!r->latest || r->latest->seq != src->seq);
+      size[i] = due ? r->size : -1;
+      quality[i] = r->quality;
+    }
+    xSemaphoreGive(stream_lock);
+    for (int i = 0; src && i < STREAM_RENDITIONS; i++) {
+      if (size[i] >= 0) {
+        stream_rendition_build(i, src, size[i], quality[i]);
+      }
+    }
+    stream_frame_release(src);
+  }
+}
+
+// Puts c on the rendition for size and q, sharing a slot with the same
+// request; false when all STREAM_RENDITIONS are taken by other ones
+static bool stream_rendition_join(stream_client_t *c, int size, int quality) {
+  if (!size && !quality) {
+    return true;
+  }
+  int slot = -1;
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  for (int i = 0; i < STREAM_RENDITIONS && slot < 0; i++) {
+    stream_rendition_t *r = &stream_renditions[i];
+    if (r->viewers && r->size == size && r->quality == quality) {
+      slot = i;
+    }
+  }
+  for (int i = 0; i < STREAM_RENDITIONS && slot < 0; i++) {
+    stream_rendition_t *r = &stream_renditions[i];
+    if (!r->viewers) {
+      r->size = size;
+      r->quality = quality;
+      r->encodes = r->shared = r->failed = 0;
+      r->encode_us = 0;
+      slot = i;
+    }
+  }
+  if (slot >= 0) {
+    stream_renditions[slot].viewers++;
+    c->rendition = slot;
+    if (!stream_rendition_handle) {
+      xTaskCreatePinnedToCore(
+        stream_rendition_task, "stream_rend", STREAM_RENDITION_STACK, NULL, tskIDLE_PRIORITY + 4, &stream_rendition_handle, STREAM_ENCODE_CORE
+      );
+    }
+  }
+  xSemaphoreGive(stream_lock);
+  return slot >= 0;
+}
+
+// Caller holds stream_lock. Takes c off its rendition; the frame to release
+// when that was the rendition's last viewer.
+static stream_frame_t *stream_rendition_leave(stream_client_t *c) {
+  stream_frame_t *last = NULL;
+  if (c->rendition >= 0) {
+    stream_rendition_t *r = &stream_renditions[c->rendition];
+    if (!--r->viewers) {
+      last = r->latest;
+      r->latest = NULL;
+    }
+    c->rendition = -1;
+  }
+  return last;
+}
+
+#if defined(ENABLE_FACE_DETECT)
+// Detection costs far more than a frame; only run it for viewers that use it
+static bool stream_faces_wanted() {
+  for (int i = 0; i < STREAM_SLOTS; i++) {
+    if (stream_clients[i].active && stream_clients[i].faces) {
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+static void stream_capture_task(void *arg) {
+  int64_t last_frame = esp_timer_get_time();
+  while (true) {
+    stream_frame_t *f = stream_frame_new();
+    if (!f) {
+      // Every pooled frame is with a sender or the encoder
+      vTaskDelay(10 / portTICK_PERIOD_MS);
+      continue;
+    }
+    xSemaphoreTake(sensor_lock, portMAX_DELAY);
+    int64_t t0 = esp_timer_get_time();
+    camera_fb_t *fb = camera_grab();
+    int64_t t1 = esp_timer_get_time();
+    xSemaphoreGive(sensor_lock);
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
+    uint32_t len = fb ? fb->len : 0;
+#endif
+    uint32_t rejected = stream_motion.blurred + stream_motion.dark;
+    if (!fb) {
+      log_e("Camera capture failed");
+      metrics_add(&metrics.capture_errors, 1);
+      stream_frame_free(f);
+      vTaskDelay(10 / portTICK_PERIOD_MS);
+    } else if (!motion_gate(&stream_motion, fb)) {
+      // Still scene (or a blurred or dark frame, counted by the gate): nothing to publish, and no encode for raw sensors
+      metrics_observe(&metrics.capture, t1 - t0);
+      if (stream_motion.blurred + stream_motion.dark == rejected) {
+        metrics_add(&metrics.frames_still, 1);
+      }
+      camera_release(fb);
+      stream_frame_free(f);
+    } else {
+      metrics_observe(&metrics.capture, t1 - t0);
+      f->fb = fb;
+      f->width = fb->width;
+      f->height = fb->height;
+      f->timestamp = fb->timestamp;
+      f->motion = stream_motion.score;
+      f->sharpness = stream_motion.sharpness;
+      f->luma = stream_motion.luma;
+#if defined(ENABLE_FACE_DETECT)
+      if (detect_faces && stream_faces_wanted()) {
+        face_box_t boxes[STREAM_MAX_FACES];
+        // Full detection every few frames, tracked boxes in between; with the
+        // detector task running, inference never holds up this loop
+        int n = stream_face_async_on ? face_track_async(&stream_face_track, &stream_face_async, fb, boxes, STREAM_MAX_FACES)
+                                     : face_track(&stream_face_track, &stream_face_work, fb, boxes, STREAM_MAX_FACES);
+        for (int i = 0; i < n && i < STREAM_MAX_FACES; i++) {
+          f->boxes[i] = {(int16_t)boxes[i].x, (int16_t)boxes[i].y, (int16_t)boxes[i].w, (int16_t)boxes[i].h, (int16_t)boxes[i].score, (int16_t)boxes[i].id};
+        }
+        f->faces = n < STREAM_MAX_FACES ? n : STREAM_MAX_FACES;
+      }
+#endif
+      if (fb->format != PIXFORMAT_JPEG) {
+        stream_encode_submit(f);  // Published by the encoder
+      } else {
+        f->buf = fb->buf;
+        f->len = fb->len;
+        stream_publish(f);
+      }
+    }
+
+    // Without viewers the task only keeps running to fill the frame ring
+    stream_frame_t *last = NULL;
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    bool idle = stream_client_count == 0 && !frame_ring.buf;
+    if (idle) {
+      last = stream_latest;
+      stream_latest = NULL;
+      stream_capture_handle = NULL;
+    }
+    xSemaphoreGive(stream_lock);
+    if (idle) {
+      stream_frame_release(last);
+      vTaskDelete(NULL);
+    }
+
+    int64_t fr_end = esp_timer_get_time();
+    int64_t frame_time = (fr_end - last_frame) / 1000;
+    last_frame = fr_end;
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
+    uint32_t avg_frame_time = ra_filter_run(&ra_filter, frame_time);
+#endif
+    log_i("MJPG capture: %uB %ums, AVG: %ums (%.1ffps)", len, (uint32_t)frame_time, avg_frame_time, 1000.0 / avg_frame_time);
+  }
+}
+
+// Caller holds stream_lock. The viewer a newcomer may displace, longest
+// without a delivered frame first; NULL when nobody may be displaced.
+static stream_client_t *stream_victim(bool priority, int64_t now) {
+  stream_client_t *v = NULL;
+  for (int i = 0; i < STREAM_SLOTS; i++) {
+    stream_client_t *c = &stream_clients[i];
+    bool stalled = now - c->last_ok > (int64_t)STREAM_STALL_MS * 1000;
+    if (c->active && !c->evicted && (stalled || (priority && !c->priority)) && (!v || c->last_ok < v->last_ok)) {
+      v = c;
+    }
+  }
+  return v;
+}
+
+static stream_client_t *stream_client_add(httpd_req_t *req, int target_fps, bool events, bool priority) {
+  stream_client_t *c = NULL, *victim = NULL;
+  int64_t now = esp_timer_get_time();
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  for (int i = 0; i < STREAM_SLOTS && !c; i++) {
+    if (!stream_clients[i].active) {
+      c = &stream_clients[i];
+    }
+  }
+  if (c && stream_admitted >= STREAM_MAX_CLIENTS) {
+    victim = stream_victim(priority, now);
+    if (victim) {
+      victim->evicted = true;
+      stream_admitted--;
+      xSemaphoreGive(victim->ready);
+    } else {
+      c = NULL;
+    }
+  }
+  if (c) {
+    c->req = req;
+    c->last_seq = 0;
+    c->sent = 0;
+    c->dropped = 0;
+    c->paced = 0;
+    c->target_fps = target_fps;
+    c->bucket_us = 0;
+    c->last_send = now;
+    c->hdr_us = 0;
+    c->send_us = 0;
+    c->faces = events;
+    c->events = events;
+    c->ws_hd = NULL;
+    c->ws_fd = -1;
+    c->credits = 0;
+    c->priority = priority;
+    c->rendition = -1;
+    c->evicted = false;
+    c->last_ok = now;
+    ra_filter_reset(&c->interval);
+    c->active = true;
+    xSemaphoreTake(c->ready, 0);
+    stream_client_count++;
+    stream_admitted++;
+  }
+  if (c) {
+    stream_capture_start();
+  }
+  xSemaphoreGive(stream_lock);
+  if (victim) {
+    log_i("Stream client %d evicted for a %s viewer", (int)(victim - stream_clients), priority ? "priority" : "new");
+    metrics_add(&metrics.sessions_evicted, 1);
+  }
+  if (!c) {
+    metrics_add(&metrics.sessions_rejected, 1);
+  }
+#if defined(LED_GPIO_NUM)
+  if (c) {
+    isStreaming = true;
+    enable_led(true);
+  }
+#endif
+  return c;
+}
+
+static void stream_client_remove(stream_client_t *c) {
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  c->active = false;
+  if (!c->evicted) {
+    stream_admitted--;
+  }
+  int left = --stream_client_count;
+  stream_frame_t *last = stream_rendition_leave(c);
+  xSemaphoreGive(stream_lock);
+  stream_frame_release(last);
+#if defined(LED_GPIO_NUM)
+  if (!left) {
+    isStreaming = false;
+    enable_led(false);
+  }
+#endif
+  log_i(
+    "Stream client %d closed: %u sent, %u dropped, %u paced, header %uus/frame, send %uus/frame", (int)(c - stream_clients), c->sent, c->dropped, c->paced,
+    c->sent ? (uint32_t)(c->hdr_us / c->sent) : 0, c->sent ? (uint32_t)(c->send_us / c->sent) : 0
+  );
+}
+
+// Token bucket for ?fps=: true once a frame may go out, after sleeping
+// until the next token if needed. Refilled by the time spent sending, so a
+// viewer that is already slower than its target is never held back.
+static bool stream_pace(stream_client_t *c) {
+  if (!c->target_fps) {
+    return false;
+  }
+  int64_t cost = 1000000 / c->target_fps;
+  int64_t now = esp_timer_get_time();
+  c->bucket_us += now - c->last_send;
+  c->last_send = now;
+  if (c->bucket_us > STREAM_BURST * cost) {
+    c->bucket_us = STREAM_BURST * cost;
+  }
+  bool waited = c->bucket_us < cost;
+  if (waited) {
+    vTaskDelay((cost - c->bucket_us) / 1000 / portTICK_PERIOD_MS + 1);
+    now = esp_timer_get_time();
+    c->bucket_us += now - c->last_send;
+    c->last_send = now;
+  }
+  c->bucket_us -= cost;
+  return waited;
+}
+
+#if STREAM_RAW_SEND
+// httpd_send may return after part of the buffer
+static esp_err_t stream_send_all(httpd_req_t *req, const char *buf, size_t len) {
+  while (len) {
+    int n = httpd_send(req, buf, len);
+    if (n <= 0) {
+      return ESP_FAIL;
+    }
+    buf += n;
+    len -= n;
+  }
+  return ESP_OK;
+}
+#endif
+
+static esp_err_t stream_send_head(stream_client_t *c, char *buf, size_t size) {
+  httpd_req_t *req = c->req;
+  char fps_hdr[24] = "";
+  if (c->target_fps) {
+    snprintf(fps_hdr, sizeof(fps_hdr), "X-Framerate: %d\r\n", c->target_fps);
+  }
+#if STREAM_RAW_SEND
+  // No Content-Length and no chunking: the stream ends when the socket closes
+  size_t hlen = snprintf(
+    buf, size, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nAccess-Control-Allow-Origin: *\r\n%sConnection: close\r\n\r\n", _STREAM_CONTENT_TYPE, fps_hdr
+  );
+  return stream_send_all(req, buf, hlen);
+#else
+  esp_err_t res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
+  if (res != ESP_OK) {
+    return res;
+  }
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  if (c->target_fps) {
+    snprintf(buf, size, "%d", c->target_fps);
+    httpd_resp_set_hdr(req, "X-Framerate", buf);
+  }
+  return ESP_OK;
+#endif
+}
+
+// One frame: boundary + part header in one buffer, then the JPEG
+static esp_err_t stream_send_frame(stream_client_t *c, const stream_frame_t *f, char *buf, size_t size) {
+  httpd_req_t *req = c->req;
+  int64_t t0 = esp_timer_get_time();
+  size_t hlen = snprintf(buf, size, _STREAM_BOUNDARY_PART, f->len, (int)f->timestamp.tv_sec, (int)f->timestamp.tv_usec, f->seq, f->motion, f->sharpness, f->luma);
+#if STREAM_RAW_SEND
+  esp_err_t res = stream_send_all(req, buf, hlen);
+#else
+  esp_err_t res = httpd_resp_send_chunk(req, buf, hlen);
+#endif
+  int64_t t1 = esp_timer_get_time();
+  if (res == ESP_OK) {
+#if STREAM_RAW_SEND
+    res = stream_send_all(req, (const char *)f->buf, f->len);
+#else
+    res = httpd_resp_send_chunk(req, (const char *)f->buf, f->len);
+#endif
+  }
+  int64_t t2 = esp_timer_get_time();
+  c->hdr_us += t1 - t0;
+  c->send_us += t2 - t0;
+  if (res == ESP_OK) {
+    metrics_observe(&metrics.send, t2 - t0);
+    portENTER_CRITICAL(&metrics_mux);
+    metrics.bytes_sent += hlen + f->len;
+    metrics.frames_sent++;
+    portEXIT_CRITICAL(&metrics_mux);
+  }
+  return res;
+}
+
+// /events: one Server-Sent Event per published frame, keyed like the
+// stream part of the same frame (id and "seq" are its X-Seq, "ts" its
+// X-Timestamp), so a page can draw the boxes onto exactly the frame they
+// were found in. The boxes come from the capture task's own detection run;
+// nothing is captured or detected twice.
+static esp_err_t events_send_head(stream_client_t *c, char *buf, size_t size) {
+  httpd_req_t *req = c->req;
+#if STREAM_RAW_SEND
+  size_t hlen = snprintf(
+    buf, size, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nAccess-Control-Allow-Origin: *\r\nConnection: close\r\n\r\n"
+  );
+  return stream_send_all(req, buf, hlen);
+#else
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_set_type(req, "text/event-stream");
+#endif
+}
+
+static esp_err_t events_send(stream_client_t *c, const stream_frame_t *f, char *buf, size_t size) {
+  size_t n = snprintf(
+    buf, size, "id: %u\ndata: {\"seq\":%u,\"ts\":\"%d.%06d\",\"motion\":%d,\"sharpness\":%d,\"luma\":%d,\"faces\":[", f->seq, f->seq, (int)f->timestamp.tv_sec,
+    (int)f->timestamp.tv_usec, f->motion, f->sharpness, f->luma
+  );
+  for (int i = 0; i < f->faces && n < size; i++) {
+    const stream_box_t *b = &f->boxes[i];
+    n += snprintf(buf + n, size - n, "%s{\"id\":%d,\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d,\"score\":%d}", i ? "," : "", b->id, b->x, b->y, b->w, b->h, b->score);
+  }
+  if (n < size) {
+    n += snprintf(buf + n, size - n, "]}\n\n");
+  }
+  if (n >= size) {
+    // Cut JSON would break the page's parser: skip this event, keep the client
+    log_e("Event of frame %u needs %u bytes, buffer has %u", f->seq, (unsigned)n + 1, (unsigned)size);
+    return ESP_OK;
+  }
+#if STREAM_RAW_SEND
+  return stream_send_all(c->req, buf, n);
+#else
+  return httpd_resp_send_chunk(c->req, buf, n);
+#endif
+}
+
+// Frames published since the client's last one: paced when it held back on
+// purpose (?fps=, no /ws credit), dropped when its socket was still busy
+static void stream_client_account(stream_client_t *c, const stream_frame_t *f, bool paced) {
+  if (c->last_seq && f->seq - c->last_seq > 1) {
+    if (paced) {
+      c->paced += f->seq - c->last_seq - 1;
+      metrics_add(&metrics.frames_paced, f->seq - c->last_seq - 1);
+    } else {
+      c->dropped += f->seq - c->last_seq - 1;
+      metrics_add(&metrics.frames_dropped, f->seq - c->last_seq - 1);
+    }
+  }
+  c->last_seq = f->seq;
+}
+
+// Sends frames (or their results) to one client until its socket fails
+static esp_err_t stream_client_run(stream_client_t *c) {
+  char part_buf[STREAM_PART_BUF];
+  esp_err_t res = c->events ? events_send_head(c, part_buf, sizeof(part_buf)) : stream_send_head(c, part_buf, sizeof(part_buf));
+  if (res != ESP_OK) {
+    return res;
+  }
+
+  int64_t last_frame = esp_timer_get_time();
+  while (res == ESP_OK && !c->evicted) {
+    if (xSemaphoreTake(c->ready, STREAM_WAIT_MS / portTICK_PERIOD_MS) != pdTRUE || c->evicted) {
+      continue;
+    }
+    // Wait for a token first, then take whatever frame is newest by then:
+    // a viewer that is behind gets the latest frame, never a queue
+    bool paced = stream_pace(c);
+    stream_frame_t *f = stream_frame_acquire(c);
+    if (!f) {
+      continue;
+    }
+    stream_client_account(c, f, paced);
+
+    res = c->events ? events_send(c, f, part_buf, sizeof(part_buf)) : stream_send_frame(c, f, part_buf, sizeof(part_buf));
+    stream_frame_release(f);
+    if (res != ESP_OK) {
+      log_e("Send frame failed");
+      break;
+    }
+    c->sent++;
+    int64_t fr_end = esp_timer_get_time();
+    c->last_ok = fr_end;
+    uint32_t avg_frame_time = ra_filter_run(&c->interval, (fr_end - last_frame) / 1000);
+    last_frame = fr_end;
+    log_i("MJPG client %d: AVG %ums (%.1ffps), target %dfps", (int)(c - stream_clients), avg_frame_time, 1000.0 / avg_frame_time, c->target_fps);
+  }
+  // An evicted viewer's socket has to be closed, not just left
+  return c->evicted ? ESP_FAIL : res;
+}
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+static void stream_sender_task(void *arg) {
+  stream_client_t *c = (stream_client_t *)arg;
+  httpd_req_t *req = c->req;
+  if (stream_client_run(c) != ESP_OK && c->evicted) {
+    httpd_sess_trigger_close(req->handle, httpd_req_to_sockfd(req));
+  }
+  stream_client_remove(c);
+  httpd_req_async_handler_complete(req);
+  vTaskDelete(NULL);
+}
+#endif
+
+// Target frame rate from the optional query, e.g. /stream?fps=10
+static int stream_target_fps(httpd_req_t *req) {
+  int fps = query_int(req, "fps", 0);
+  return fps <= 0 ? 0 : fps > STREAM_MAX_FPS ? STREAM_MAX_FPS : fps;
+}
+
+// Rendition from the optional query, e.g. /stream?size=320&q=40; 0, 0: the original
+static void stream_rendition_query(httpd_req_t *req, int *size, int *quality) {
+  *size = query_int(req, "size", 0);
+  *quality = query_int(req, "q", 0);
+  *size = *size < 0 ? 0 : *size;
+  *quality = *quality <= 0 ? 0 : *quality > 100 ? 100 : *quality;
+}
+
+static esp_err_t stream_start(httpd_req_t *req, bool events) {
+  int target_fps = stream_target_fps(req);
+  int size = 0, quality = 0;
+  if (!events) {
+    stream_rendition_query(req, &size, &quality);
+  }
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+  // Hand the socket to a sender task so the httpd task can take the next viewer
+  httpd_req_t *async_req = NULL;
+  if (httpd_req_async_handler_begin(req, &async_req) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  stream_client_t *c = stream_client_add(async_req, target_fps, events, query_int(req, "ingest", 0) != 0);
+  if (!c) {
+    httpd_resp_set_status(async_req, "503 Service Unavailable");
+    httpd_resp_send(async_req, "Too many streams", HTTPD_RESP_USE_STRLEN);
+    httpd_req_async_handler_complete(async_req);
+    return ESP_OK;
+  }
+  if (!stream_rendition_join(c, size, quality)) {
+    stream_client_remove(c);
+    httpd_resp_set_status(async_req, "503 Service Unavailable");
+    httpd_resp_send(async_req, "Too many renditions", HTTPD_RESP_USE_STRLEN);
+    httpd_req_async_handler_complete(async_req);
+    return ESP_OK;
+  }
+  if (xTaskCreatePinnedToCore(stream_sender_task, "stream_tx", STREAM_SENDER_STACK, c, tskIDLE_PRIORITY + 5, NULL, STREAM_SEND_CORE) != pdPASS) {
+    stream_client_remove(c);
+    httpd_req_async_handler_complete(async_req);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+#else
+  // No async requests: the client is served on the httpd task, one at a time
+  stream_client_t *c = stream_client_add(req, target_fps, events, query_int(req, "ingest", 0) != 0);
+  if (!c) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_send(req, "Too many streams", HTTPD_RESP_USE_STRLEN);
+  }
+  if (!stream_rendition_join(c, size, quality)) {
+    stream_client_remove(c);
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_send(req, "Too many renditions", HTTPD_RESP_USE_STRLEN);
+  }
+  esp_err_t res = stream_client_run(c);
+  stream_client_remove(c);
+  return res;
+#endif
+}
+
+static esp_err_t stream_handler(httpd_req_t *req) {
+  return stream_start(req, false);
+}
+
+static esp_err_t events_handler(httpd_req_t *req) {
+  return stream_start(req, true);
+}
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+// /ws: the frames of /stream as binary WebSocket messages, each a
+// ws_frame_hdr_t followed by the JPEG. The viewer grants credit, one per
+// frame it is ready for, as a text message with the count ("3") or a
+// 4-byte little-endian binary one. Nothing is sent without credit, and a
+// grant is answered with the newest frame, so a slow viewer never gets a
+// backlog. ?credits= sets the first grant, ?fps= paces as on /stream and
+// ?faces=1 fills the boxes when detect_faces is linked.
+#define WS_HDR_VERSION     2  // 2: boxes carry a track id
+#define WS_INITIAL_CREDITS 2
+#define WS_MAX_CREDITS     16
+
+typedef struct __attribute__((packed)) {
+  uint8_t version;   // WS_HDR_VERSION
+  uint8_t hdr_len;   // sizeof(ws_frame_hdr_t): offset of the JPEG
+  uint8_t faces;     // Valid entries in boxes
+  int8_t motion;     // motion_score, -1: not scored
+  uint32_t seq;
+  uint32_t size;     // JPEG bytes
+  uint32_t credits;  // Credit left after this frame
+  int64_t timestamp_us;
+  stream_box_t boxes[STREAM_MAX_FACES];
+} ws_frame_hdr_t;
+
+// Caller holds stream_lock
+static stream_client_t *ws_client_find(int fd) {
+  for (int i = 0; i < STREAM_SLOTS; i++) {
+    if (stream_clients[i].active && stream_clients[i].ws_fd == fd) {
+      return &stream_clients[i];
+    }
+  }
+  return NULL;
+}
+
+static void ws_grant(int fd, int n) {
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  stream_client_t *c = ws_client_find(fd);
+  if (c) {
+    c->credits = c->credits + n > WS_MAX_CREDITS ? WS_MAX_CREDITS : c->credits + n;
+    xSemaphoreGive(c->ready);
+  }
+  xSemaphoreGive(stream_lock);
+}
+
+// One message in two fragments, so the JPEG goes out without a copy
+static esp_err_t ws_send_frame(stream_client_t *c, const stream_frame_t *f) {
+  ws_frame_hdr_t h = {};
+  h.version = WS_HDR_VERSION;
+  h.hdr_len = sizeof(h);
+  h.faces = f->faces;
+  h.motion = f->motion;
+  h.seq = f->seq;
+  h.size = f->len;
+  h.credits = c->credits;
+  h.timestamp_us = (int64_t)f->timestamp.tv_sec * 1000000 + f->timestamp.tv_usec;
+  memcpy(h.boxes, f->boxes, sizeof(h.boxes));
+
+  int64_t t0 = esp_timer_get_time();
+  httpd_ws_frame_t part = {};
+  part.fragmented = true;
+  part.final = false;
+  part.type = HTTPD_WS_TYPE_BINARY;
+  part.payload = (uint8_t *)&h;
+  part.len = sizeof(h);
+  esp_err_t res = httpd_ws_send_frame_async(c->ws_hd, c->ws_fd, &part);
+  int64_t t1 = esp_timer_get_time();
+  if (res == ESP_OK) {
+    part.final = true;
+    part.type = HTTPD_WS_TYPE_CONTINUE;
+    part.payload = f->buf;
+    part.len = f->len;
+    res = httpd_ws_send_frame_async(c->ws_hd, c->ws_fd, &part);
+  }
+  int64_t t2 = esp_timer_get_time();
+  c->hdr_us += t1 - t0;
+  c->send_us += t2 - t0;
+  if (res == ESP_OK) {
+    metrics_observe(&metrics.send, t2 - t0);
+    portENTER_CRITICAL(&metrics_mux);
+    metrics.bytes_sent += sizeof(h) + f->len;
+    metrics.frames_sent++;
+    portEXIT_CRITICAL(&metrics_mux);
+  }
+  return res;
+}
+
+static void ws_sender_task(void *arg) {
+  stream_client_t *c = (stream_client_t *)arg;
+  bool starved = false;  // Frames went by while the viewer had no credit
+  int64_t last_frame = esp_timer_get_time();
+  while (!c->evicted && httpd_ws_get_fd_info(c->ws_hd, c->ws_fd) == HTTPD_WS_CLIENT_WEBSOCKET) {
+    if (xSemaphoreTake(c->ready, STREAM_WAIT_MS / portTICK_PERIOD_MS) != pdTRUE || c->evicted) {
+      continue;
+    }
+    if (!c->credits) {
+      starved = true;
+      continue;
+    }
+    bool paced = stream_pace(c) || starved;
+    stream_frame_t *f = stream_frame_acquire(c);
+    if (!f) {
+      continue;
+    }
+    stream_client_account(c, f, paced);
+    starved = false;
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    c->credits--;
+    xSemaphoreGive(stream_lock);
+
+    esp_err_t res = ws_send_frame(c, f);
+    stream_frame_release(f);
+    if (res != ESP_OK) {
+      log_e("WS send frame failed");
+      break;
+    }
+    c->sent++;
+    int64_t fr_end = esp_timer_get_time();
+    c->last_ok = fr_end;
+    uint32_t avg_frame_time = ra_filter_run(&c->interval, (fr_end - last_frame) / 1000);
+    last_frame = fr_end;
+    log_i("WS client %d: AVG %ums (%.1ffps), credits %d", (int)(c - stream_clients), avg_frame_time, 1000.0 / avg_frame_time, c->credits);
+  }
+  if (c->evicted && c->ws_fd >= 0) {
+    httpd_sess_trigger_close(c->ws_hd, c->ws_fd);
+  }
+  stream_client_remove(c);
+  vTaskDelete(NULL);
+}
+
+static esp_err_t ws_handler(httpd_req_t *req) {
+  int fd = httpd_req_to_sockfd(req);
+  if (req->method == HTTP_GET) {
+    // Handshake done: register the viewer and hand it to a sender task.
+    // A client still holding this fd is from a closed socket; retire it.
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    stream_client_t *stale = ws_client_find(fd);
+    if (stale) {
+      stale->ws_fd = -1;
+    }
+    xSemaphoreGive(stream_lock);
+
+    stream_client_t *c = stream_client_add(NULL, stream_target_fps(req), false, query_int(req, "ingest", 0) != 0);
+    if (!c) {
+      log_e("Too many streams");
+      return ESP_FAIL;
+    }
+    int credits = query_int(req, "credits", WS_INITIAL_CREDITS);
+    xSemaphoreTake(stream_lock, portMAX_DELAY);
+    c->ws_hd = req->handle;
+    c->ws_fd = fd;
+    c->faces = query_int(req, "faces", 0) != 0;
+    c->credits = credits < 0 ? 0 : credits > WS_MAX_CREDITS ? WS_MAX_CREDITS : credits;
+    xSemaphoreGive(stream_lock);
+    if (xTaskCreatePinnedToCore(ws_sender_task, "ws_tx", STREAM_SENDER_STACK, c, tskIDLE_PRIORITY + 5, NULL, STREAM_SEND_CORE) != pdPASS) {
+      stream_client_remove(c);
+      return ESP_FAIL;
+    }
+    return ESP_OK;
+  }
+
+  // Credit grant
+  uint8_t buf[16];
+  httpd_ws_frame_t pkt = {};
+  esp_err_t res = httpd_ws_recv_frame(req, &pkt, 0);
+  if (res != ESP_OK || pkt.len >= sizeof(buf)) {
+    return ESP_FAIL;
+  }
+  pkt.payload = buf;
+  res = httpd_ws_recv_frame(req, &pkt, pkt.len);
+  if (res != ESP_OK) {
+    return res;
+  }
+  int n = 0;
+  if (pkt.type == HTTPD_WS_TYPE_TEXT) {
+    buf[pkt.len] = 0;
+    n = atoi((const char *)buf);
+  } else if (pkt.type == HTTPD_WS_TYPE_BINARY && pkt.len == 4) {
+    n = buf[0] | buf[1] << 8 | buf[2] << 16 | buf[3] << 24;
+  }
+  if (n > 0) {
+    ws_grant(fd, n);
+  }
+  return ESP_OK;
+}
+#endif
+
+//
+// Frames from the pre-event ring (frame_ring.h), in the X-Timestamp clock.
+//
+// /capture?at=<sec.usec>: the buffered frame captured closest to that time,
+// ?ago=<ms>: closest to that long before now, ?seq=<n>: frame n of the
+// stream (X-Seq). Sent at once, with X-Offset-Ms the frame's distance from
+// the asked-for time; 404 when the ring has nothing (no PSRAM).
+//
+// /clip?at= or ?ago=, &before=<ms>&after=<ms> (default 1000 each): every
+// buffered frame in that window as multipart/mixed, parts as on /stream.
+// When the window ends in the future the answer waits for it, which holds
+// up the control server as any long request does; ask after the fact.
+//
+// /capture?best=<k>&at= or ?ago=, &before=<ms>&after=<ms> (default
+// BEST_BEFORE_MS, BEST_AFTER_MS), &tap=<n>: one frame for a card tap, the
+// best of the burst the stream captured around it. The k sharpest frames
+// of the window (X-Sharpness, no decode) go through face detection when it
+// is linked; the one with the most confident face wins, sharpness breaks
+// ties and decides alone without a detector. It comes back with
+// X-Face-Score, X-Sharpness, X-Best-Of ("<k scored>/<in window>") and the
+// tap's X-Tap-Seq, so a tap costs one frame on the network however many
+// the ring held. Waits for the window like /clip.
+//
+#define CLIP_DEFAULT_MS 1000
+#define CLIP_MAX_MS     5000
+#define BEST_BEFORE_MS  200
+#define BEST_AFTER_MS   800
+#define BEST_MAX_FRAMES 8
+
+// Capture time asked for by ?at= or ?ago=; false with neither
+static bool query_time(httpd_req_t *req, int64_t *ts) {
+  char query[64];
+  char value[24];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+    return false;
+  }
+  if (httpd_query_key_value(query, "ago", value, sizeof(value)) == ESP_OK) {
+    *ts = esp_timer_get_time() - atoll(value) * 1000;
+    return true;
+  }
+  if (httpd_query_key_value(query, "at", value, sizeof(value)) != ESP_OK) {
+    return false;
+  }
+  char *frac = NULL;
+  *ts = strtoll(value, &frac, 10) * 1000000;
+  if (*frac == '.') {
+    // Fraction to microseconds: pad or cut to 6 digits
+    int64_t us = 0;
+    int digits = 0;
+    for (frac++; *frac >= '0' && *frac <= '9' && digits < 6; frac++, digits++) {
+      us = us * 10 + (*frac - '0');
+    }
+    for (; digits < 6; digits++) {
+      us *= 10;
+    }
+    *ts += us;
+  }
+  return true;
+}
+
+static esp_err_t ring_best(httpd_req_t *req);
+
+static esp_err_t ring_capture(httpd_req_t *req) {
+  if (query_int(req, "best", 0) > 0) {
+    return ring_best(req);
+  }
+  int64_t ts = 0;
+  int seq_q = query_int(req, "seq", 0);
+  uint32_t seq = seq_q > 0 ? (uint32_t)seq_q : query_time(req, &ts) ? frame_ring_nearest(&frame_ring, ts) : 0;
+  frame_slot_t info;
+  uint8_t *jpg = frame_ring_get(&frame_ring, seq, &info);
+  if (!jpg) {
+    return httpd_resp_send_404(req);
+  }
+  httpd_resp_set_type(req, "image/jpeg");
+  httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  char tsbuf[32], seqbuf[12], offbuf[16];
+  snprintf(tsbuf, sizeof(tsbuf), "%lld.%06ld", (long long)(info.ts / 1000000), (long)(info.ts % 1000000));
+  snprintf(seqbuf, sizeof(seqbuf), "%u", info.seq);
+  snprintf(offbuf, sizeof(offbuf), "%d", seq_q > 0 ? 0 : (int)((info.ts - ts) / 1000));
+  httpd_resp_set_hdr(req, "X-Timestamp", tsbuf);
+  httpd_resp_set_hdr(req, "X-Seq", seqbuf);
+  httpd_resp_set_hdr(req, "X-Offset-Ms", offbuf);
+  esp_err_t res = httpd_resp_send(req, (const char *)jpg, info.len);
+  free(jpg);
+  return res;
+}
+
+// Waits until esp_timer reaches to (at most CLIP_MAX_MS)
+static void ring_wait_until(int64_t to) {
+  int64_t wait_ms = (to - esp_timer_get_time()) / 1000;
+  if (wait_ms > CLIP_MAX_MS) {
+    wait_ms = CLIP_MAX_MS;
+  }
+  if (wait_ms > 0) {
+    vTaskDelay(wait_ms / portTICK_PERIOD_MS);
+  }
+}
+
+#if defined(ENABLE_FACE_DETECT)
+// Most confident face in a ring frame; 0 without one, -1 without a detector
+static int ring_face_score(uint32_t seq) {
+  static face_work_t work;
+  if (!detect_faces) {
+    return -1;
+  }
+  frame_slot_t info;
+  uint8_t *jpg = frame_ring_get(&frame_ring, seq, &info);
+  if (!jpg) {
+    return 0;
+  }
+  camera_fb_t fb = {};
+  fb.buf = jpg;
+  fb.len = info.len;
+  fb.width = info.width;
+  fb.height = info.height;
+  fb.format = PIXFORMAT_JPEG;
+  face_box_t boxes[STREAM_MAX_FACES];
+  int n = face_detect_scaled(&work, &fb, boxes, STREAM_MAX_FACES);
+  free(jpg);
+  int best = 0;
+  for (int i = 0; i < n && i < STREAM_MAX_FACES; i++) {
+    best = boxes[i].score > best ? boxes[i].score : best;
+  }
+  return best;
+}
+#endif
+
+static esp_err_t ring_best(httpd_req_t *req) {
+  int64_t at = 0;
+  if (!query_time(req, &at)) {
+    at = esp_timer_get_time();
+  }
+  int k = query_int(req, "best", 1);
+  k = k > BEST_MAX_FRAMES ? BEST_MAX_FRAMES : k;
+  int before = query_int(req, "before", BEST_BEFORE_MS);
+  int after = query_int(req, "after", BEST_AFTER_MS);
+  before = before < 0 ? 0 : before > CLIP_MAX_MS ? CLIP_MAX_MS : before;
+  after = after < 0 ? 0 : after > CLIP_MAX_MS ? CLIP_MAX_MS : after;
+  ring_wait_until(at + after * 1000LL);
+
+  uint32_t seqs[FRAME_RING_SLOTS];
+  int sharp[FRAME_RING_SLOTS];
+  int n = frame_ring_list(&frame_ring, at - before * 1000LL, at + after * 1000LL, seqs, FRAME_RING_SLOTS);
+  // Sharpest first; frames overwritten meanwhile sink to the end
+  for (int i = 0; i < n; i++) {
+    frame_slot_t info;
+    int v = frame_ring_info(&frame_ring, seqs[i], &info) ? info.sharpness : -2;
+    uint32_t seq = seqs[i];
+    int j = i;
+    for (; j > 0 && sharp[j - 1] < v; j--) {
+      sharp[j] = sharp[j - 1];
+      seqs[j] = seqs[j - 1];
+    }
+    sharp[j] = v;
+    seqs[j] = seq;
+  }
+  int scored = n < k ? n : k;
+  int best = -1, best_face = -1;
+  for (int i = 0; i < scored && sharp[i] > -2; i++) {
+    int face = -1;
+#if defined(ENABLE_FACE_DETECT)
+    face = ring_face_score(seqs[i]);
+#endif
+    // Candidates come sharpest first, so on equal faces the earlier one stays
+    if (best < 0 || face > best_face) {
+      best = i;
+      best_face = face;
+    }
+  }
+  frame_slot_t info;
+  uint8_t *jpg = best >= 0 ? frame_ring_get(&frame_ring, seqs[best], &info) : NULL;
+  if (!jpg) {
+    return httpd_resp_send_404(req);
+  }
+  httpd_resp_set_type(req, "image/jpeg");
+  // Nine headers: needs max_resp_headers above the default 8
+  int hdr_failed = 0;
+  hdr_failed += httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg") != ESP_OK;
+  hdr_failed += httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*") != ESP_OK;
+  char tsbuf[32], seqbuf[12], offbuf[16], facebuf[12], sharpbuf[12], ofbuf[16], tapbuf[12];
+  snprintf(tsbuf, sizeof(tsbuf), "%lld.%06ld", (long long)(info.ts / 1000000), (long)(info.ts % 1000000));
+  snprintf(seqbuf, sizeof(seqbuf), "%u", info.seq);
+  snprintf(offbuf, sizeof(offbuf), "%d", (int)((info.ts - at) / 1000));
+  snprintf(facebuf, sizeof(facebuf), "%d", best_face);
+  snprintf(sharpbuf, sizeof(sharpbuf), "%d", info.sharpness);
+  snprintf(ofbuf, sizeof(ofbuf), "%d/%d", scored, n);
+  hdr_failed += httpd_resp_set_hdr(req, "X-Timestamp", tsbuf) != ESP_OK;
+  hdr_failed += httpd_resp_set_hdr(req, "X-Seq", seqbuf) != ESP_OK;
+  hdr_failed += httpd_resp_set_hdr(req, "X-Offset-Ms", offbuf) != ESP_OK;
+  hdr_failed += httpd_resp_set_hdr(req, "X-Face-Score", facebuf) != ESP_OK;
+  hdr_failed += httpd_resp_set_hdr(req, "X-Sharpness", sharpbuf) != ESP_OK;
+  hdr_failed += httpd_resp_set_hdr(req, "X-Best-Of", ofbuf) != ESP_OK;
+  int tap = query_int(req, "tap", 0);
+  if (tap > 0) {
+    snprintf(tapbuf, sizeof(tapbuf), "%d", tap);
+    hdr_failed += httpd_resp_set_hdr(req, "X-Tap-Seq", tapbuf) != ESP_OK;
+  }
+  if (hdr_failed) {
+    log_e("Best frame: %d response header(s) dropped, raise max_resp_headers", hdr_failed);
+  }
+  esp_err_t res = httpd_resp_send(req, (const char *)jpg, info.len);
+  free(jpg);
+  return res;
+}
+
+static esp_err_t clip_handler(httpd_req_t *req) {
+  int64_t at = 0;
+  if (!query_time(req, &at)) {
+    at = esp_timer_get_time();
+  }
+  int before = query_int(req, "before", CLIP_DEFAULT_MS);
+  int after = query_int(req, "after", CLIP_DEFAULT_MS);
+  before = before < 0 ? 0 : before > CLIP_MAX_MS ? CLIP_MAX_MS : before;
+  after = after < 0 ? 0 : after > CLIP_MAX_MS ? CLIP_MAX_MS : after;
+  int64_t from = at - before * 1000LL, to = at + after * 1000LL;
+  ring_wait_until(to);
+
+  uint32_t seqs[FRAME_RING_SLOTS];
+  int n = frame_ring_list(&frame_ring, from, to, seqs, FRAME_RING_SLOTS);
+  if (!n) {
+    return httpd_resp_send_404(req);
+  }
+  httpd_resp_set_type(req, "multipart/mixed;boundary=" PART_BOUNDARY);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  char part[224];
+  esp_err_t res = ESP_OK;
+  for (int i = 0; i < n && res == ESP_OK; i++) {
+    frame_slot_t info;
+    uint8_t *jpg = frame_ring_get(&frame_ring, seqs[i], &info);
+    if (!jpg) {
+      // Overwritten while the window was sent
+      continue;
+    }
+    snprintf(
+      part, sizeof(part), _STREAM_BOUNDARY_PART, info.len, (int)(info.ts / 1000000), (int)(info.ts % 1000000), info.seq, info.motion, info.sharpness, info.luma
+    );
+    res = httpd_resp_send_chunk(req, part, HTTPD_RESP_USE_STRLEN);
+    if (res == ESP_OK) {
+      res = httpd_resp_send_chunk(req, (const char *)jpg, info.len);
+    }
+    free(jpg);
+  }
+  if (res == ESP_OK) {
+    res = httpd_resp_send_chunk(req, "\r\n--" PART_BOUNDARY "--\r\n", HTTPD_RESP_USE_STRLEN);
+  }
+  if (res == ESP_OK) {
+    res = httpd_resp_send_chunk(req, NULL, 0);
+  }
+  return res;
+}
+
+// /thumb?width=<max>&q=<quality>: the newest stream frame as a small JPEG
+// for grid views, decoded at 1/2, 1/4 or 1/8 (the largest scale that is at
+// most width wide, default THUMB_WIDTH; 1/8 decodes DC only) and encoded
+// again. The result is kept until the stream publishes another frame, so a
+// wall of pages polling every camera once a second costs one encode per
+// new frame, and none while the scene is still. ETag is the frame's seq
+// plus the rendering, If-None-Match gets a 304. Without a published frame
+// (no PSRAM, no viewer) a frame is grabbed for it, JPEG sensors only.
+#define THUMB_WIDTH     160
+#define THUMB_QUALITY   40
+#define THUMB_BUF_MIN   2048
+
+static jpeg_scaled_t thumb_scaled;
+static uint8_t *thumb_buf = NULL;
+static size_t thumb_size = 0;
+static size_t thumb_len = 0;
+static uint32_t thumb_seq = 0;  // Frame the thumbnail is of, 0: none or a grabbed frame
+static int thumb_scale = -1;
+static int thumb_quality = 0;
+static struct timeval thumb_timestamp;
+static uint32_t thumb_encodes = 0;
+static uint32_t thumb_hits = 0;
+static uint64_t thumb_encode_us = 0;
+
+// Decodes and encodes into thumb_buf, growing it once when the JPEG did not fit
+static bool thumb_render(const uint8_t *src, size_t len, int scale, int quality) {
+  if (!jpeg_scaled_decode(&thumb_scaled, src, len, scale)) {
+    return false;
+  }
+  size_t want = (size_t)thumb_scaled.width * thumb_scaled.height / 2;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (thumb_size < want) {
+      free(thumb_buf);
+      thumb_buf = (uint8_t *)malloc(want > THUMB_BUF_MIN ? want : THUMB_BUF_MIN);
+      thumb_size = thumb_buf ? (want > THUMB_BUF_MIN ? want : THUMB_BUF_MIN) : 0;
+    }
+    stream_encode_out_t out = {thumb_buf, thumb_size, 0, false};
+    if (thumb_buf && jpeg_scaled_encode(&thumb_scaled, quality, &out)) {
+      thumb_len = out.len;
+      return true;
+    }
+    if (!out.overflow) {
+      break;
+    }
+    want = thumb_size * 2;
+  }
+  return false;
+}
+
+static esp_err_t thumb_handler(httpd_req_t *req) {
+  int width = query_int(req, "width", THUMB_WIDTH);
+  int quality = query_int(req, "q", THUMB_QUALITY);
+  quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  stream_frame_t *f = stream_latest;
+  if (f) {
+    f->refs++;
+  }
+  xSemaphoreGive(stream_lock);
+  camera_fb_t *fb = NULL;
+  if (!f) {
+    xSemaphoreTake(sensor_lock, portMAX_DELAY);
+    fb = camera_grab();
+    xSemaphoreGive(sensor_lock);
+    if (!fb) {
+      metrics_add(&metrics.capture_errors, 1);
+      httpd_resp_send_500(req);
+      return ESP_FAIL;
+    }
+    if (fb->format != PIXFORMAT_JPEG) {
+      camera_release(fb);
+      httpd_resp_set_status(req, "503 Service Unavailable");
+      return httpd_resp_send(req, "No JPEG frame to scale", HTTPD_RESP_USE_STRLEN);
+    }
+  }
+  uint32_t seq = f ? f->seq : 0;
+  int scale = jpeg_scale_for(f ? f->width : fb->width, width < 1 ? 1 : width);
+  if (seq && seq == thumb_seq && scale == thumb_scale && quality == thumb_quality) {
+    thumb_hits++;
+  } else {
+    int64_t t0 = esp_timer_get_time();
+    bool ok = f ? thumb_render(f->buf, f->len, scale, quality) : thumb_render(fb->buf, fb->len, scale, quality);
+    thumb_seq = ok ? seq : 0;
+    thumb_scale = ok ? scale : -1;
+    thumb_quality = quality;
+    thumb_timestamp = f ? f->timestamp : fb->timestamp;
+    if (!ok) {
+      stream_frame_release(f);
+      if (fb) {
+        camera_release(fb);
+      }
+      log_e("Thumbnail failed");
+      httpd_resp_send_500(req);
+      return ESP_FAIL;
+    }
+    thumb_encodes++;
+    thumb_encode_us += esp_timer_get_time() - t0;
+  }
+  stream_frame_release(f);
+  if (fb) {
+    camera_release(fb);
+  }
+
+  char etag[32];
+  if (seq) {
+    snprintf(etag, sizeof(etag), "\"%u-%d-%d\"", seq, scale, quality);
+    httpd_resp_set_hdr(req, "ETag", etag);
+    char match[48];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match)) == ESP_OK && strstr(match, etag)) {
+      httpd_resp_set_status(req, "304 Not Modified");
+      return httpd_resp_send(req, NULL, 0);
+    }
+  }
+  httpd_resp_set_type(req, "image/jpeg");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  char ts[32], seqbuf[12];
+  snprintf(ts, sizeof(ts), "%lld.%06ld", (long long)thumb_timestamp.tv_sec, (long)thumb_timestamp.tv_usec);
+  snprintf(seqbuf, sizeof(seqbuf), "%u", seq);
+  httpd_resp_set_hdr(req, "X-Timestamp", ts);
+  httpd_resp_set_hdr(req, "X-Seq", seqbuf);
+  return httpd_resp_send(req, (const char *)thumb_buf, thumb_len);
+}
+
+// Query string of a camera_httpd request. That server runs one handler at
+// a time on its one task, so they all parse into this one buffer instead of
+// a malloc per request; httpd refuses longer URIs before a handler runs.
+// /stream and friends live on the other server and must not use it.
+static char query_buf[CONFIG_HTTPD_MAX_URI_LEN + 1];
+
+static esp_err_t parse_get(httpd_req_t *req, char **obuf) {
+  size_t len = httpd_req_get_url_query_len(req);
+  if (len && len < sizeof(query_buf) && httpd_req_get_url_query_str(req, query_buf, sizeof(query_buf)) == ESP_OK) {
+    *obuf = query_buf;
+    return ESP_OK;
+  }
+  httpd_resp_send_404(req);
+  return ESP_FAIL;
+}
+
+// /status is served from a cache rebuilt only after a handler changed the
+// sensor; each change bumps status_gen, which is also the ETag
+static portMUX_TYPE status_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t status_gen = 1;
+
+static void status_invalidate() {
+  portENTER_CRITICAL(&status_mux);
+  status_gen++;
+  portEXIT_CRITICAL(&status_mux);
+}
+
+// /control setters. CTRL_SENSOR wraps a sensor_t setter that takes a plain int.
+typedef int (*ctrl_setter_t)(sensor_t *s, int val);
+typedef struct {
+  const char *name;
+  ctrl_setter_t set;
+} ctrl_entry_t;
+
+#define CTRL_SENSOR(name, fn) \
+  static int ctrl_##name(sensor_t *s, int val) { \
+    return s->fn(s, val); \
+  }
+
+CTRL_SENSOR(ae_level, set_ae_level)
+CTRL_SENSOR(aec, set_exposure_ctrl)
+CTRL_SENSOR(aec2, set_aec2)
+CTRL_SENSOR(aec_value, set_aec_value)
+CTRL_SENSOR(agc, set_gain_ctrl)
+CTRL_SENSOR(agc_gain, set_agc_gain)
+CTRL_SENSOR(awb, set_whitebal)
+CTRL_SENSOR(awb_gain, set_awb_gain)
+CTRL_SENSOR(bpc, set_bpc)
+CTRL_SENSOR(brightness, set_brightness)
+CTRL_SENSOR(colorbar, set_colorbar)
+CTRL_SENSOR(contrast, set_contrast)
+CTRL_SENSOR(dcw, set_dcw)
+CTRL_SENSOR(hmirror, set_hmirror)
+CTRL_SENSOR(lenc, set_lenc)
+CTRL_SENSOR(quality, set_quality)
+CTRL_SENSOR(raw_gma, set_raw_gma)
+CTRL_SENSOR(saturation, set_saturation)
+CTRL_SENSOR(special_effect, set_special_effect)
+CTRL_SENSOR(vflip, set_vflip)
+CTRL_SENSOR(wb_mode, set_wb_mode)
+CTRL_SENSOR(wpc, set_wpc)
+
+static int ctrl_framesize(sensor_t *s, int val) {
+  return s->pixformat == PIXFORMAT_JPEG ? s->set_framesize(s, (framesize_t)val) : 0;
+}
+
+static int ctrl_gainceiling(sensor_t *s, int val) {
+  return s->set_gainceiling(s, (gainceiling_t)val);
+}
+
+static int ctrl_motion_hold(sensor_t *s, int val) {
+  stream_motion.hold_ms = val;
+  return 0;
+}
+
+static int ctrl_motion_idle(sensor_t *s, int val) {
+  stream_motion.idle_ms = val;
+  return 0;
+}
+
+static int ctrl_motion_min(sensor_t *s, int val) {
+  stream_motion.min_score = val;
+  return 0;
+}
+
+static int ctrl_motion_thresh(sensor_t *s, int val) {
+  stream_motion.thresh = val;
+  return 0;
+}
+
+static int ctrl_motion_sharpness(sensor_t *s, int val) {
+  stream_motion.min_sharpness = val;
+  return 0;
+}
+
+static int ctrl_motion_luma(sensor_t *s, int val) {
+  stream_motion.min_luma = val;
+  return 0;
+}
+
+#if defined(LED_GPIO_NUM)
+static int ctrl_led_intensity(sensor_t *s, int val) {
+  led_duty = val;
+  if (isStreaming) {
+    enable_led(true);
+  }
+  return 0;
+}
+#endif
+
+// Sorted by strcmp for bsearch
+static const ctrl_entry_t ctrl_table[] = {
+  {"ae_level", ctrl_ae_level},
+  {"aec", ctrl_aec},
+  {"aec2", ctrl_aec2},
+  {"aec_value", ctrl_aec_value},
+  {"agc", ctrl_agc},
+  {"agc_gain", ctrl_agc_gain},
+  {"awb", ctrl_awb},
+  {"awb_gain", ctrl_awb_gain},
+  {"bpc", ctrl_bpc},
+  {"brightness", ctrl_brightness},
+  {"colorbar", ctrl_colorbar},
+  {"contrast", ctrl_contrast},
+  {"dcw", ctrl_dcw},
+  {"framesize", ctrl_framesize},
+  {"gainceiling", ctrl_gainceiling},
+  {"hmirror", ctrl_hmirror},
+#if defined(LED_GPIO_NUM)
+  {"led_intensity", ctrl_led_intensity},
+#endif
+  {"lenc", ctrl_lenc},
+  {"motion_hold", ctrl_motion_hold},
+  {"motion_idle", ctrl_motion_idle},
+  {"motion_luma", ctrl_motion_luma},
+  {"motion_min", ctrl_motion_min},
+  {"motion_sharpness", ctrl_motion_sharpness},
+  {"motion_thresh", ctrl_motion_thresh},
+  {"quality", ctrl_quality},
+  {"raw_gma", ctrl_raw_gma},
+  {"saturation", ctrl_saturation},
+  {"special_effect", ctrl_special_effect},
+  {"vflip", ctrl_vflip},
+  {"wb_mode", ctrl_wb_mode},
+  {"wpc", ctrl_wpc},
+};
+
+static int ctrl_compare(const void *key, const void *entry) {
+  return strcmp((const char *)key, ((const ctrl_entry_t *)entry)->name);
+}
+
+// Checked once at startup: an entry out of order is unreachable through bsearch
+static bool ctrl_table_sorted() {
+  for (size_t i = 1; i < sizeof(ctrl_table) / sizeof(ctrl_table[0]); i++) {
+    if (strcmp(ctrl_table[i - 1].name, ctrl_table[i].name) >= 0) {
+      log_e("ctrl_table not sorted at \"%s\"", ctrl_table[i].name);
+      return false;
+    }
+  }
+  return true;
+}
+
+static const ctrl_entry_t *ctrl_find(const char *name) {
+  return (const ctrl_entry_t *)bsearch(name, ctrl_table, sizeof(ctrl_table) / sizeof(ctrl_table[0]), sizeof(ctrl_entry_t), ctrl_compare);
+}
+
+// Applies one setting; -1 for an unknown name. Caller holds sensor_lock.
+static int ctrl_apply(sensor_t *s, const char *name, int val) {
+  const ctrl_entry_t *e = ctrl_find(name);
+  if (!e) {
+    log_i("Unknown command: %s", name);
+    return -1;
+  }
+  log_i("%s = %d", name, val);
+  return e->set(s, val);
+}
+
+#define CTRL_MAX_KEYS  32
+
+//
+// /control?var=<name>&val=<n>: one setting, empty 200 or 500 as before.
+//
+// /control?<name>=<n>&<name>=<n>...: any number of settings in one request,
+// applied in order in one pass under sensor_lock, so the stream never
+// captures a frame with half a profile applied. Answers 200 with one result
+// per key: 0 when applied, the setter's error, or "unknown".
+//
+static esp_err_t cmd_handler(httpd_req_t *req) {
+  static char json[CTRL_MAX_KEYS * 48 + 32];
+
+  char *query = NULL;
+  if (parse_get(req, &query) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  sensor_t *s = esp_camera_sensor_get();
+
+  char variable[32];
+  char value[32];
+  if (httpd_query_key_value(query, "var", variable, sizeof(variable)) == ESP_OK) {
+    if (httpd_query_key_value(query, "val", value, sizeof(value)) != ESP_OK) {
+      httpd_resp_send_404(req);
+      return ESP_FAIL;
+    }
+    xSemaphoreTake(sensor_lock, portMAX_DELAY);
+    int res = ctrl_apply(s, variable, atoi(value));
+    xSemaphoreGive(sensor_lock);
+    status_invalidate();
+    if (res < 0) {
+      return httpd_resp_send_500(req);
+    }
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, NULL, 0);
+  }
+
+  char *p = json;
+  char *end = json + sizeof(json);
+  *p++ = '{';
+  int keys = 0;
+  xSemaphoreTake(sensor_lock, portMAX_DELAY);
+  for (char *pair = strtok(query, "&"); pair && keys < CTRL_MAX_KEYS; pair = strtok(NULL, "&")) {
+    char *eq = strchr(pair, '=');
+    if (!eq || eq == pair || eq - pair >= (int)sizeof(variable)) {
+      continue;
+    }
+    *eq = 0;
+    const ctrl_entry_t *e = ctrl_find(pair);
+    int res = e ? ctrl_apply(s, pair, atoi(eq + 1)) : 0;
+    if (e) {
+      p += snprintf(p, end - p, "%s\"%s\":%d", keys ? "," : "", pair, res);
+    } else {
+      p += snprintf(p, end - p, "%s\"%s\":\"unknown\"", keys ? "," : "", pair);
+    }
+    keys++;
+  }
+  xSemaphoreGive(sensor_lock);
+  status_invalidate();
+  *p++ = '}';
+  *p = 0;
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json, p - json);
+}
+
+static int print_reg(char *p, sensor_t *s, uint16_t reg, uint32_t mask) {
+  return sprintf(p, "\"0x%x\":%u,", reg, s->get_reg(s, reg, mask));
+}
+
+// Sensor registers and settings; the part of /status that is cached
+static char *status_print_sensor(char *p, sensor_t *s) {
+
+  if (s->id.PID == OV5640_PID || s->id.PID == OV3660_PID) {
+    for (int reg = 0x3400; reg < 0x3406; reg += 2) {
+      p += print_reg(p, s, reg, 0xFFF);  //12 bit
+    }
+    p += print_reg(p, s, 0x3406, 0xFF);
+
+    p += print_reg(p, s, 0x3500, 0xFFFF0);  //16 bit
+    p += print_reg(p, s, 0x3503, 0xFF);
+    p += print_reg(p, s, 0x350a, 0x3FF);   //10 bit
+    p += print_reg(p, s, 0x350c, 0xFFFF);  //16 bit
+
+    for (int reg = 0x5480; reg <= 0x5490; reg++) {
+      p += print_reg(p, s, reg, 0xFF);
+    }
+
+    for (int reg = 0x5380; reg <= 0x538b; reg++) {
+      p += print_reg(p, s, reg, 0xFF);
+    }
+
+    for (int reg = 0x5580; reg < 0x558a; reg++) {
+      p += print_reg(p, s, reg, 0xFF);
+    }
+    p += print_reg(p, s, 0x558a, 0x1FF);  //9 bit
   } else if (s->id.PID == OV2640_PID) {
     p += print_reg(p, s, 0xd3, 0xFF);
     p += print_reg(p, s, 0x111, 0xFF);
     p += print_reg(p, s, 0x132, 0xFF);
   }
 
-  p += sprintf(p, "\"xclk\":%u,", s->xclk_freq_hz / 1000000);
-  p += sprintf(p, "\"pixformat\":%u,", s->pixformat);
-  p += sprintf(p, "\"framesize\":%u,", s->status.framesize);
-  p += sprintf(p, "\"quality\":%u,", s->status.quality);
-  p += sprintf(p, "\"brightness\":%d,", s->status.brightness);
-  p += sprintf(p, "\"contrast\":%d,", s->status.contrast);
-  p += sprintf(p, "\"saturation\":%d,", s->status.saturation);
-  p += sprintf(p, "\"sharpness\":%d,", s->status.sharpness);
-  p += sprintf(p, "\"special_effect\":%u,", s->status.special_effect);
-  p += sprintf(p, "\"wb_mode\":%u,", s->status.wb_mode);
-  p += sprintf(p, "\"awb\":%u,", s->status.awb);
-  p += sprintf(p, "\"awb_gain\":%u,", s->status.awb_gain);
-  p += sprintf(p, "\"aec\":%u,", s->status.aec);
-  p += sprintf(p, "\"aec2\":%u,", s->status.aec2);
-  p += sprintf(p, "\"ae_level\":%d,", s->status.ae_level);
-  p += sprintf(p, "\"aec_value\":%u,", s->status.aec_value);
-  p += sprintf(p, "\"agc\":%u,", s->status.agc);
-  p += sprintf(p, "\"agc_gain\":%u,", s->status.agc_gain);
-  p += sprintf(p, "\"gainceiling\":%u,", s->status.gainceiling);
-  p += sprintf(p, "\"bpc\":%u,", s->status.bpc);
-  p += sprintf(p, "\"wpc\":%u,", s->status.wpc);
-  p += sprintf(p, "\"raw_gma\":%u,", s->status.raw_gma);
-  p += sprintf(p, "\"lenc\":%u,", s->status.lenc);
-  p += sprintf(p, "\"hmirror\":%u,", s->status.hmirror);
-  p += sprintf(p, "\"vflip\":%u,", s->status.vflip);
-  p += sprintf(p, "\"dcw\":%u,", s->status.dcw);
-  p += sprintf(p, "\"colorbar\":%u", s->status.colorbar);
-#if defined(LED_GPIO_NUM)
-  p += sprintf(p, ",\"led_intensity\":%u", led_duty);
-#else
-  p += sprintf(p, ",\"led_intensity\":%d", -1);
-#endif
-  *p++ = '}';
-  *p++ = 0;
-  httpd_resp_set_type(req, "application/json");
+  p += sprintf(p, "\"xclk\":%u,", s->xclk_freq_hz / 1000000);
+  p += sprintf(p, "\"pixformat\":%u,", s->pixformat);
+  p += sprintf(p, "\"framesize\":%u,", s->status.framesize);
+  p += sprintf(p, "\"quality\":%u,", s->status.quality);
+  p += sprintf(p, "\"brightness\":%d,", s->status.brightness);
+  p += sprintf(p, "\"contrast\":%d,", s->status.contrast);
+  p += sprintf(p, "\"saturation\":%d,", s->status.saturation);
+  p += sprintf(p, "\"sharpness\":%d,", s->status.sharpness);
+  p += sprintf(p, "\"special_effect\":%u,", s->status.special_effect);
+  p += sprintf(p, "\"wb_mode\":%u,", s->status.wb_mode);
+  p += sprintf(p, "\"awb\":%u,", s->status.awb);
+  p += sprintf(p, "\"awb_gain\":%u,", s->status.awb_gain);
+  p += sprintf(p, "\"aec\":%u,", s->status.aec);
+  p += sprintf(p, "\"aec2\":%u,", s->status.aec2);
+  p += sprintf(p, "\"ae_level\":%d,", s->status.ae_level);
+  p += sprintf(p, "\"aec_value\":%u,", s->status.aec_value);
+  p += sprintf(p, "\"agc\":%u,", s->status.agc);
+  p += sprintf(p, "\"agc_gain\":%u,", s->status.agc_gain);
+  p += sprintf(p, "\"gainceiling\":%u,", s->status.gainceiling);
+  p += sprintf(p, "\"bpc\":%u,", s->status.bpc);
+  p += sprintf(p, "\"wpc\":%u,", s->status.wpc);
+  p += sprintf(p, "\"raw_gma\":%u,", s->status.raw_gma);
+  p += sprintf(p, "\"lenc\":%u,", s->status.lenc);
+  p += sprintf(p, "\"hmirror\":%u,", s->status.hmirror);
+  p += sprintf(p, "\"vflip\":%u,", s->status.vflip);
+  p += sprintf(p, "\"dcw\":%u,", s->status.dcw);
+  p += sprintf(p, "\"colorbar\":%u", s->status.colorbar);
+#if defined(LED_GPIO_NUM)
+  p += sprintf(p, ",\"led_intensity\":%u", led_duty);
+#else
+  p += sprintf(p, ",\"led_intensity\":%d", -1);
+#endif
+  p += sprintf(
+    p, ",\"motion_thresh\":%d,\"motion_min\":%d,\"motion_hold\":%d,\"motion_idle\":%d,\"motion_sharpness\":%d,\"motion_luma\":%d", stream_motion.thresh,
+    stream_motion.min_score, stream_motion.hold_ms, stream_motion.idle_ms, stream_motion.min_sharpness, stream_motion.min_luma
+  );
+  return p;
+}
+
+static char *capture_mode_print(char *p);
+
+// Counters that change with every frame; only in /status?live=1
+static char *status_print_live(char *p) {
+  p += sprintf(
+    p, ",\"motion_score\":%d,\"sharpness\":%d,\"luma\":%d,\"blurred\":%u,\"dark\":%u", stream_motion.score, stream_motion.sharpness, stream_motion.luma,
+    stream_motion.blurred, stream_motion.dark
+  );
+  p += sprintf(p, ",\"capture_mode\":{");
+  p = capture_mode_print(p);
+  *p++ = '}';
+#if defined(ENABLE_FACE_DETECT)
+  p += sprintf(
+    p, ",\"track\":{\"interval\":%d,\"detections\":%u,\"predictions\":%u", stream_face_track.interval, stream_face_track.detections, stream_face_track.predictions
+  );
+  if (stream_face_async_on) {
+    const face_async_t *a = &stream_face_async;
+    p += sprintf(
+      p, ",\"infer_ms\":%.1f,\"infer_avg_ms\":%.1f,\"infer_max_ms\":%.1f,\"inferences\":%u,\"waited\":%u", a->infer_us / 1000.0, a->infer_avg_us / 1000.0,
+      a->infer_max_us / 1000.0, a->runs, a->waited
+    );
+  }
+  *p++ = '}';
+#endif
+  if (frame_ring.buf) {
+    p += sprintf(p, ",\"ring\":{\"frames\":%u,\"stored\":%u,\"too_big\":%u}", frame_ring.count, frame_ring.stored, frame_ring.too_big);
+  }
+  p += sprintf(
+    p, ",\"thumb\":{\"encodes\":%u,\"hits\":%u,\"encode_us\":%u}", thumb_encodes, thumb_hits, thumb_encodes ? (uint32_t)(thumb_encode_us / thumb_encodes) : 0
+  );
+  // Per-viewer counters: dropped grows when a viewer cannot keep up
+  p += sprintf(p, ",\"rejected\":%u,\"evicted\":%u", metrics.sessions_rejected, metrics.sessions_evicted);
+  p += sprintf(p, ",\"streams\":[");
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  bool first = true;
+  for (int i = 0; i < STREAM_SLOTS; i++) {
+    if (stream_clients[i].active) {
+      stream_client_t *c = &stream_clients[i];
+      int avg = c->interval.count ? c->interval.sum / (int)c->interval.count : 0;
+      p += sprintf(
+        p, "%s{\"id\":%d,\"ws\":%d,\"events\":%d,\"priority\":%d,\"credits\":%d,\"sent\":%u,\"dropped\":%u,\"paced\":%u,\"fps\":%.1f,\"target_fps\":%d,\"hdr_us\":%u,\"send_us\":%u,\"rendition\":%d}", first ? "" : ",", i, !c->req, c->events, c->priority, c->credits, c->sent,
+        c->dropped, c->paced, avg ? 1000.0 / avg : 0.0, c->target_fps, c->sent ? (uint32_t)(c->hdr_us / c->sent) : 0, c->sent ? (uint32_t)(c->send_us / c->sent) : 0, c->rendition
+      );
+      first = false;
+    }
+  }
+  // Renditions in use, by slot (a stream's "rendition"); encode_us is decode + encode per frame
+  p += sprintf(p, "],\"renditions\":[");
+  first = true;
+  for (int i = 0; i < STREAM_RENDITIONS; i++) {
+    const stream_rendition_t *r = &stream_renditions[i];
+    if (r->viewers) {
+      p += sprintf(
+        p, "%s{\"id\":%d,\"size\":%d,\"q\":%d,\"viewers\":%d,\"width\":%u,\"height\":%u,\"encodes\":%u,\"shared\":%u,\"failed\":%u,\"encode_us\":%u}", first ? "" : ",", i, r->size,
+        r->quality, r->viewers, r->scaled.width, r->scaled.height, r->encodes, r->shared, r->failed, r->encodes ? (uint32_t)(r->encode_us / r->encodes) : 0
+      );
+      first = false;
+    }
+  }
+  xSemaphoreGive(stream_lock);
+  *p++ = ']';
+  return p;
+}
+
+//
+// /status: the settings document, rebuilt only after /control, /xclk,
+// /reg, /pll, /resolution or /profile changed something, so polling it
+// costs no SCCB traffic. It carries ETag "<status_gen>"; an If-None-Match
+// that still matches gets a 304. Registers in it are as read at the last
+// rebuild; auto exposure and gain move them in between.
+//
+// /status?live=1: registers re-read now plus the live counters
+// (motion_score, per-viewer streams); never cached.
+//
+static esp_err_t status_handler(httpd_req_t *req) {
+  static char status_doc[1280];
+  static size_t status_len = 0;
+  static uint32_t status_built = 0;
+  static char live_doc[1536 + STREAM_SLOTS * 208 + STREAM_RENDITIONS * 160];
+
+  sensor_t *s = esp_camera_sensor_get();
+  char query[32];
+  char live[4];
+  bool want_live = httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK && httpd_query_key_value(query, "live", live, sizeof(live)) == ESP_OK
+                   && atoi(live);
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  if (want_live) {
+    char *p = live_doc;
+    *p++ = '{';
+    xSemaphoreTake(sensor_lock, portMAX_DELAY);
+    p = status_print_sensor(p, s);
+    xSemaphoreGive(sensor_lock);
+    p = status_print_live(p);
+    *p++ = '}';
+    *p = 0;
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_send(req, live_doc, p - live_doc);
+  }
+
+  portENTER_CRITICAL(&status_mux);
+  uint32_t gen = status_gen;
+  portEXIT_CRITICAL(&status_mux);
+  if (status_built != gen) {
+    // A change racing the rebuild bumps status_gen again and forces another
+    char *p = status_doc;
+    *p++ = '{';
+    xSemaphoreTake(sensor_lock, portMAX_DELAY);
+    p = status_print_sensor(p, s);
+    xSemaphoreGive(sensor_lock);
+    *p++ = '}';
+    *p = 0;
+    status_len = p - status_doc;
+    status_built = gen;
+  }
+
+  char etag[16];
+  snprintf(etag, sizeof(etag), "\"%08x\"", (unsigned)status_built);
+  httpd_resp_set_hdr(req, "ETag", etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  char match[48];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match)) == ESP_OK && strstr(match, etag)) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
+  }
+  return httpd_resp_send(req, status_doc, status_len);
+}
+
+static int metrics_hist_print(char *p, size_t size, const char *name, const char *help, const metrics_hist_t *h) {
+  int n = snprintf(p, size, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  uint32_t cum = 0;
+  for (int i = 0; i <= METRICS_BUCKETS; i++) {
+    cum += h->buckets[i];
+    n += snprintf(p + n, size - n, "%s_bucket{le=\"%s\"} %u\n", name, i < METRICS_BUCKETS ? metrics_bounds_le[i] : "+Inf", cum);
+  }
+  n += snprintf(p + n, size - n, "%s_sum %.6f\n%s_count %u\n", name, h->sum_us / 1e6, name, h->count);
+  return n;
+}
+
+static esp_err_t metrics_handler(httpd_req_t *req) {
+  static char buf[2048];
+  metrics_t m;
+  portENTER_CRITICAL(&metrics_mux);
+  m = metrics;
+  portEXIT_CRITICAL(&metrics_mux);
+
+  httpd_resp_set_type(req, "text/plain; version=0.0.4");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+
+  // One chunk per histogram keeps the buffer small
+  metrics_hist_print(buf, sizeof(buf), "camera_capture_seconds", "Time in esp_camera_fb_get", &m.capture);
+  esp_err_t res = httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+  if (res == ESP_OK) {
+    metrics_hist_print(buf, sizeof(buf), "camera_frame_age_seconds", "Capture start to esp_camera_fb_get handing the frame out", &m.age);
+    res = httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+  }
+  if (res == ESP_OK) {
+    metrics_hist_print(buf, sizeof(buf), "camera_jpeg_encode_seconds", "Time in frame2jpg", &m.encode);
+    res = httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+  }
+  if (res == ESP_OK) {
+    metrics_hist_print(buf, sizeof(buf), "camera_stream_send_seconds", "Time to send one stream frame", &m.send);
+    res = httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+  }
+  if (res == ESP_OK) {
+    wifi_ap_record_t ap;
+    int rssi = esp_wifi_sta_get_ap_info(&ap) == ESP_OK ? ap.rssi : 0;
+    // Block counts of the internal heap: sampled around a burst of /control
+    // or /reg calls they should not move, and free_blocks is fragmentation
+    multi_heap_info_t heap;
+    heap_caps_get_info(&heap, MALLOC_CAP_INTERNAL);
+    snprintf(
+      buf, sizeof(buf),
+      "# TYPE camera_stream_bytes_total counter\ncamera_stream_bytes_total %llu\n"
+      "# TYPE camera_stream_frames_total counter\ncamera_stream_frames_total %u\n"
+      "# TYPE camera_stream_dropped_frames_total counter\ncamera_stream_dropped_frames_total %u\n"
+      "# TYPE camera_stream_paced_frames_total counter\ncamera_stream_paced_frames_total %u\n"
+      "# TYPE camera_stream_still_frames_total counter\ncamera_stream_still_frames_total %u\n"
+      "# TYPE camera_encode_overrun_frames_total counter\ncamera_encode_overrun_frames_total %u\n"
+      "# TYPE camera_motion_score gauge\ncamera_motion_score %d\n"
+      "# TYPE camera_capture_errors_total counter\ncamera_capture_errors_total %u\n"
+      "# TYPE camera_frames_overwritten_total counter\ncamera_frames_overwritten_total %u\n"
+      "# TYPE camera_frames_missed_total counter\ncamera_frames_missed_total %u\n"
+      "# TYPE camera_frames_stale_total counter\ncamera_frames_stale_total %u\n"
+      "# TYPE camera_stream_viewers gauge\ncamera_stream_viewers %d\n"
+      "# TYPE camera_stream_rejected_total counter\ncamera_stream_rejected_total %u\n"
+      "# TYPE camera_stream_evicted_total counter\ncamera_stream_evicted_total %u\n"
+      "# TYPE camera_heap_free_bytes gauge\ncamera_heap_free_bytes %u\n"
+      "# TYPE camera_heap_min_free_bytes gauge\ncamera_heap_min_free_bytes %u\n"
+      "# TYPE camera_heap_allocated_blocks gauge\ncamera_heap_allocated_blocks %u\n"
+      "# TYPE camera_heap_free_blocks gauge\ncamera_heap_free_blocks %u\n"
+      "# TYPE camera_psram_free_bytes gauge\ncamera_psram_free_bytes %u\n"
+      "# TYPE camera_wifi_rssi_dbm gauge\ncamera_wifi_rssi_dbm %d\n",
+      (unsigned long long)m.bytes_sent, m.frames_sent, m.frames_dropped, m.frames_paced, m.frames_still, m.frames_overrun, stream_motion.score, m.capture_errors,
+      m.frames_overwritten, m.frames_missed, m.frames_stale, stream_client_count, m.sessions_rejected, m.sessions_evicted,
+      (uint32_t)heap_caps_get_free_size(MALLOC_CAP_INTERNAL), (uint32_t)heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL), (uint32_t)heap.allocated_blocks,
+      (uint32_t)heap.free_blocks, (uint32_t)heap_caps_get_free_size(MALLOC_CAP_SPIRAM), rssi
+    );
+    res = httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+  }
+  if (res == ESP_OK) {
+    // Frame quality of the motion gate: last frame's values, frames it dropped for them
+    snprintf(
+      buf, sizeof(buf),
+      "# TYPE camera_frame_sharpness gauge\ncamera_frame_sharpness %d\n"
+      "# TYPE camera_frame_luma gauge\ncamera_frame_luma %d\n"
+      "# TYPE camera_frames_blurred_total counter\ncamera_frames_blurred_total %u\n"
+      "# TYPE camera_frames_dark_total counter\ncamera_frames_dark_total %u\n",
+      stream_motion.sharpness, stream_motion.luma, stream_motion.blurred, stream_motion.dark
+    );
+    res = httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+  }
+  if (res == ESP_OK) {
+    res = httpd_resp_send_chunk(req, NULL, 0);
+  }
+  return res;
+}
+
+static esp_err_t xclk_handler(httpd_req_t *req) {
+  char *buf = NULL;
+  char _xclk[32];
+
+  if (parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  if (httpd_query_key_value(buf, "xclk", _xclk, sizeof(_xclk)) != ESP_OK) {
+    httpd_resp_send_404(req);
+    return ESP_FAIL;
+  }
+
+  int xclk = atoi(_xclk);
+  log_i("Set XCLK: %d MHz", xclk);
+
+  sensor_t *s = esp_camera_sensor_get();
+  int res = s->set_xclk(s, LEDC_TIMER_0, xclk);
+  status_invalidate();
+  if (res) {
+    return httpd_resp_send_500(req);
+  }
+
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, NULL, 0);
+}
+
+static esp_err_t reg_handler(httpd_req_t *req) {
+  char *buf = NULL;
+  char _reg[32];
+  char _mask[32];
+  char _val[32];
+
+  if (parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  if (httpd_query_key_value(buf, "reg", _reg, sizeof(_reg)) != ESP_OK || httpd_query_key_value(buf, "mask", _mask, sizeof(_mask)) != ESP_OK
+      || httpd_query_key_value(buf, "val", _val, sizeof(_val)) != ESP_OK) {
+    httpd_resp_send_404(req);
+    return ESP_FAIL;
+  }
+
+  int reg = atoi(_reg);
+  int mask = atoi(_mask);
+  int val = atoi(_val);
+  log_i("Set Register: reg: 0x%02x, mask: 0x%02x, value: 0x%02x", reg, mask, val);
+
+  sensor_t *s = esp_camera_sensor_get();
+  int res = s->set_reg(s, reg, mask, val);
+  status_invalidate();
+  if (res) {
+    return httpd_resp_send_500(req);
+  }
+
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, NULL, 0);
+}
+
+static esp_err_t greg_handler(httpd_req_t *req) {
+  char *buf = NULL;
+  char _reg[32];
+  char _mask[32];
+
+  if (parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  if (httpd_query_key_value(buf, "reg", _reg, sizeof(_reg)) != ESP_OK || httpd_query_key_value(buf, "mask", _mask, sizeof(_mask)) != ESP_OK) {
+    httpd_resp_send_404(req);
+    return ESP_FAIL;
+  }
+
+  int reg = atoi(_reg);
+  int mask = atoi(_mask);
+  sensor_t *s = esp_camera_sensor_get();
+  int res = s->get_reg(s, reg, mask);
+  if (res < 0) {
+    return httpd_resp_send_500(req);
+  }
+  log_i("Get Register: reg: 0x%02x, mask: 0x%02x, value: 0x%02x", reg, mask, res);
+
+  char buffer[20];
+  const char *val = itoa(res, buffer, 10);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, val, strlen(val));
+}
+
+static int parse_get_var(char *buf, const char *key, int def) {
+  char _int[16];
+  if (httpd_query_key_value(buf, key, _int, sizeof(_int)) != ESP_OK) {
+    return def;
+  }
+  return atoi(_int);
+}
+
+static esp_err_t pll_handler(httpd_req_t *req) {
+  char *buf = NULL;
+
+  if (parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+
+  int bypass = parse_get_var(buf, "bypass", 0);
+  int mul = parse_get_var(buf, "mul", 0);
+  int sys = parse_get_var(buf, "sys", 0);
+  int root = parse_get_var(buf, "root", 0);
+  int pre = parse_get_var(buf, "pre", 0);
+  int seld5 = parse_get_var(buf, "seld5", 0);
+  int pclken = parse_get_var(buf, "pclken", 0);
+  int pclk = parse_get_var(buf, "pclk", 0);
+
+  log_i("Set Pll: bypass: %d, mul: %d, sys: %d, root: %d, pre: %d, seld5: %d, pclken: %d, pclk: %d", bypass, mul, sys, root, pre, seld5, pclken, pclk);
+  sensor_t *s = esp_camera_sensor_get();
+  int res = s->set_pll(s, bypass, mul, sys, root, pre, seld5, pclken, pclk);
+  status_invalidate();
+  if (res) {
+    return httpd_resp_send_500(req);
+  }
+
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  return httpd_resp_send(req, json_response, strlen(json_response));
+  return httpd_resp_send(req, NULL, 0);
 }
 
-static esp_err_t xclk_handler(httpd_req_t *req) {
+static esp_err_t win_handler(httpd_req_t *req) {
   char *buf = NULL;
-  char _xclk[32];
 
   if (parse_get(req, &buf) != ESP_OK) {
     return ESP_FAIL;
   }
-  if (httpd_query_key_value(buf, "xclk", _xclk, sizeof(_xclk)) != ESP_OK) {
-    free(buf);
+
+  int startX = parse_get_var(buf, "sx", 0);
+  int startY = parse_get_var(buf, "sy", 0);
+  int endX = parse_get_var(buf, "ex", 0);
+  int endY = parse_get_var(buf, "ey", 0);
+  int offsetX = parse_get_var(buf, "offx", 0);
+  int offsetY = parse_get_var(buf, "offy", 0);
+  int totalX = parse_get_var(buf, "tx", 0);
+  int totalY = parse_get_var(buf, "ty", 0);  // codespell:ignore totaly
+  int outputX = parse_get_var(buf, "ox", 0);
+  int outputY = parse_get_var(buf, "oy", 0);
+  bool scale = parse_get_var(buf, "scale", 0) == 1;
+  bool binning = parse_get_var(buf, "binning", 0) == 1;
+
+  log_i(
+    "Set Window: Start: %d %d, End: %d %d, Offset: %d %d, Total: %d %d, Output: %d %d, Scale: %u, Binning: %u", startX, startY, endX, endY, offsetX, offsetY,
+    totalX, totalY, outputX, outputY, scale, binning  // codespell:ignore totaly
+  );
+  sensor_t *s = esp_camera_sensor_get();
+  int res = s->set_res_raw(s, startX, startY, endX, endY, offsetX, offsetY, totalX, totalY, outputX, outputY, scale, binning);  // codespell:ignore totaly
+  status_invalidate();
+  if (res) {
+    return httpd_resp_send_500(req);
+  }
+
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, NULL, 0);
+}
+
+// OV2640 UXGA array; /roi works in these coordinates
+#define ROI_SENSOR_W     1600
+#define ROI_SENSOR_H     1200
+#define ROI_ALIGN        16    // Window and output registers count in 4 px; JPEG MCUs are 16 px
+#define ROI_SKIP_FRAMES  1     // Frames dropped after a window change while the sensor switches
+#define ROI_TIMEOUT_MS   1000
+
+static int roi_align_down(int v) {
+  return v / ROI_ALIGN * ROI_ALIGN;
+}
+
+// /roi?x=&y=&w=&h=: one JPEG of that part of the sensor at native (UXGA)
+// resolution, then the stream's frame size is restored. The area may not
+// exceed the configured frame size, whose buffers have to hold it.
+static esp_err_t roi_handler(httpd_req_t *req) {
+  char *buf = NULL;
+
+  if (parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  int x = roi_align_down(parse_get_var(buf, "x", 0));
+  int y = roi_align_down(parse_get_var(buf, "y", 0));
+  int w = roi_align_down(parse_get_var(buf, "w", 0) + ROI_ALIGN - 1);
+  int h = roi_align_down(parse_get_var(buf, "h", 0) + ROI_ALIGN - 1);
+
+  sensor_t *s = esp_camera_sensor_get();
+  if (s->id.PID != OV2640_PID) {
+    // OV3660/OV5640 set_res_raw also sets sensor timing (HTS/VTS); not mapped here
+    httpd_resp_set_status(req, "501 Not Implemented");
+    return httpd_resp_send(req, "ROI needs an OV2640", HTTPD_RESP_USE_STRLEN);
+  }
+  framesize_t framesize = s->status.framesize;
+  if (x < 0 || y < 0 || w < ROI_ALIGN || h < ROI_ALIGN || x + w > ROI_SENSOR_W || y + h > ROI_SENSOR_H
+      || w * h > resolution[framesize].width * resolution[framesize].height) {
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "ROI outside the sensor or larger than the frame size");
+  }
+
+  // Keep the stream capture off the sensor until the window is restored
+  xSemaphoreTake(sensor_lock, portMAX_DELAY);
+  int64_t t0 = esp_timer_get_time();
+  int res = s->set_res_raw(s, 0 /* OV2640_MODE_UXGA */, 0, 0, 0, x, y, w, h, w, h, false, false);
+  camera_fb_t *fb = res ? NULL : fb_get_after(esp_timer_get_time(), ROI_SKIP_FRAMES, ROI_TIMEOUT_MS);
+  uint8_t *jpg = NULL;
+  size_t jpg_len = 0;
+  bool ok = false;
+  if (fb) {
+    if (fb->format == PIXFORMAT_JPEG) {
+      jpg = fb->buf;
+      jpg_len = fb->len;
+      ok = true;
+    } else {
+      ok = frame2jpg(fb, 80, &jpg, &jpg_len);
+    }
+  }
+  struct timeval ts = fb ? fb->timestamp : (struct timeval){0, 0};
+
+  if (ok) {
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=roi.jpg");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    char tsbuf[32];
+    snprintf(tsbuf, sizeof(tsbuf), "%lld.%06ld", (long long)ts.tv_sec, (long)ts.tv_usec);
+    httpd_resp_set_hdr(req, "X-Timestamp", tsbuf);
+    res = httpd_resp_send(req, (const char *)jpg, jpg_len);
+  }
+  if (fb && fb->format != PIXFORMAT_JPEG) {
+    free(jpg);
+  }
+  if (fb) {
+    camera_release(fb);
+  }
+
+  // Restore, and drop frames still shot with the ROI window
+  s->set_framesize(s, framesize);
+  camera_fb_t *stale = fb_get_after(esp_timer_get_time(), ROI_SKIP_FRAMES - 1, ROI_TIMEOUT_MS);
+  if (stale) {
+    camera_release(stale);
+  }
+  xSemaphoreGive(sensor_lock);
+  log_i("ROI %dx%d+%d+%d: %uB %ums", w, h, x, y, (uint32_t)jpg_len, (uint32_t)((esp_timer_get_time() - t0) / 1000));
+
+  if (!ok) {
+    log_e("ROI capture failed");
+    return httpd_resp_send_500(req);
+  }
+  return res;
+}
+
+// /profile?name=<n>: applies a stored (or built-in) profile in one pass.
+// &save=1 stores the current sensor settings under that name instead, and
+// &boot=1 makes it the profile applied at the next power-on.
+static esp_err_t profile_handler(httpd_req_t *req) {
+  char *buf = NULL;
+  char name[PROFILE_NAME_MAX + 1];
+
+  if (parse_get(req, &buf) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  if (httpd_query_key_value(buf, "name", name, sizeof(name)) != ESP_OK) {
     httpd_resp_send_404(req);
     return ESP_FAIL;
   }
-  free(buf);
+  bool save = parse_get_var(buf, "save", 0) == 1;
+  bool boot = parse_get_var(buf, "boot", 0) == 1;
 
-  int xclk = atoi(_xclk);
-  log_i("Set XCLK: %d MHz", xclk);
+  sensor_t *s = esp_camera_sensor_get();
+  profile_t p;
+  esp_err_t err;
+  int failed = 0;
+  xSemaphoreTake(sensor_lock, portMAX_DELAY);
+  if (save) {
+    profile_capture(&p, s);
+    err = profile_save(name, &p);
+  } else {
+    err = profile_load(name, &p);
+    if (err == ESP_OK) {
+      failed = profile_apply(s, &p);
+    }
+  }
+  xSemaphoreGive(sensor_lock);
+  if (err == ESP_OK && boot) {
+    err = profile_set_boot(name);
+  }
+  log_i("Profile %s%s%s: 0x%x, %d failed", name, save ? " saved" : "", boot ? " boot" : "", err, failed);
+  if (!save) {
+    status_invalidate();
+  }
+  if (err == ESP_ERR_NOT_FOUND) {
+    httpd_resp_send_404(req);
+    return ESP_FAIL;
+  }
+  if (err != ESP_OK) {
+    return httpd_resp_send_500(req);
+  }
+
+  char json[64];
+  int len = snprintf(json, sizeof(json), "{\"name\":\"%s\",\"failed\":%d}", name, failed);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json, len);
+}
+
+// The driver keeps no copy of its config; the sketch hands over the one it
+// gave esp_camera_init so /capture_mode can restart with it
+static camera_config_t camera_config;
+static bool camera_config_set = false;
+
+void setCameraConfig(const camera_config_t *config) {
+  camera_config = *config;
+  camera_config_set = true;
+  camera_grab_mode = config->grab_mode;
+}
+
+#define CAMERA_MAX_FB_COUNT       4
+#define CAMERA_RESTART_TIMEOUT_MS 2000  // For viewers and /capture to hand their buffers back
+
+static int camera_held_now() {
+  portENTER_CRITICAL(&metrics_mux);
+  int held = camera_held;
+  portEXIT_CRITICAL(&metrics_mux);
+  return held;
+}
+
+// Restarts the driver with another grab mode, buffer count or placement.
+// The sensor settings are carried over with profile_capture/profile_apply;
+// the frame size the buffers are sized for stays the boot one. When the new
+// buffers do not fit, the driver comes back up with the old config.
+static esp_err_t camera_restart(camera_grab_mode_t grab, int fb_count, camera_fb_location_t location) {
+  xSemaphoreTake(sensor_lock, portMAX_DELAY);
+  portENTER_CRITICAL(&metrics_mux);
+  camera_restarting = true;
+  portEXIT_CRITICAL(&metrics_mux);
+  // Viewers are handed the first frame after the restart
+  stream_frame_t *last[1 + STREAM_RENDITIONS];
+  xSemaphoreTake(stream_lock, portMAX_DELAY);
+  last[0] = stream_latest;
+  stream_latest = NULL;
+  for (int i = 0; i < STREAM_RENDITIONS; i++) {
+    last[1 + i] = stream_renditions[i].latest;
+    stream_renditions[i].latest = NULL;
+  }
+  xSemaphoreGive(stream_lock);
+  for (int i = 0; i < 1 + STREAM_RENDITIONS; i++) {
+    stream_frame_release(last[i]);
+  }
+
+  int64_t deadline = esp_timer_get_time() + CAMERA_RESTART_TIMEOUT_MS * 1000LL;
+  while (camera_held_now() > 0 && esp_timer_get_time() < deadline) {
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+  }
+  esp_err_t err = ESP_ERR_TIMEOUT;
+  if (camera_held_now() == 0) {
+    sensor_t *s = esp_camera_sensor_get();
+    profile_t p;
+    profile_capture(&p, s);
+    camera_config_t config = camera_config;
+    config.xclk_freq_hz = s->xclk_freq_hz;  // As /xclk left it
+    config.grab_mode = grab;
+    config.fb_count = fb_count;
+    config.fb_location = location;
+    esp_camera_deinit();
+    err = esp_camera_init(&config);
+    if (err == ESP_OK) {
+      camera_config = config;
+    } else {
+      log_e("Camera restart with %d buffers failed: 0x%x", fb_count, err);
+      config = camera_config;
+      config.xclk_freq_hz = s->xclk_freq_hz;
+      if (esp_camera_init(&config) != ESP_OK) {
+        log_e("Camera restart with the old config failed too");
+      }
+    }
+    s = esp_camera_sensor_get();
+    if (s) {
+      profile_apply(s, &p);
+    }
+  }
+  portENTER_CRITICAL(&metrics_mux);
+  camera_grab_mode = camera_config.grab_mode;
+  camera_last_ts = 0;
+  camera_period_us = 0;
+  camera_restarting = false;
+  portEXIT_CRITICAL(&metrics_mux);
+  xSemaphoreGive(sensor_lock);
+  status_invalidate();
+  return err;
+}
+
+static char *capture_mode_print(char *p) {
+  portENTER_CRITICAL(&metrics_mux);
+  uint32_t age_count = metrics.age.count;
+  uint64_t age_sum = metrics.age.sum_us;
+  uint32_t overwritten = metrics.frames_overwritten;
+  uint32_t missed = metrics.frames_missed;
+  uint32_t stale = metrics.frames_stale;
+  int held = camera_held;
+  uint32_t period = (uint32_t)camera_period_us;
+  portEXIT_CRITICAL(&metrics_mux);
+  return p + sprintf(
+           p, "\"grab\":\"%s\",\"fb_count\":%d,\"psram\":%d,\"held\":%d,\"period_us\":%u,\"age_us\":%u,\"overwritten\":%u,\"missed\":%u,\"stale\":%u",
+           camera_grab_mode == CAMERA_GRAB_LATEST ? "latest" : "empty", camera_config_set ? (int)camera_config.fb_count : -1,
+           camera_config_set ? camera_config.fb_location == CAMERA_FB_IN_PSRAM : -1, held, period, age_count ? (uint32_t)(age_sum / age_count) : 0, overwritten,
+           missed, stale
+         );
+}
+
+//
+// /capture_mode: how the driver hands out frames, and what that costs.
+// age_us is the average capture-to-dequeue age; overwritten counts frames
+// the driver replaced unread (grab=latest), missed frames the sensor shot
+// while every buffer was taken (grab=empty), stale frames /capture?fresh=1,
+// /roi and the flash snapshot threw away as older than the request.
+//
+// /capture_mode?grab=latest|empty&fb_count=<n>&psram=0|1: restarts the
+// driver with that mode (omitted keys keep theirs). grab=latest always
+// hands out the newest frame, lowest latency; grab=empty hands them out in
+// capture order, so with fb_count >= 2 a frame can be a buffer or more old
+// but none is skipped. Viewers see a gap of a few frames around the restart.
+//
+static esp_err_t capture_mode_handler(httpd_req_t *req) {
+  char query[64];
+  char value[8];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    if (!camera_config_set) {
+      httpd_resp_set_status(req, "501 Not Implemented");
+      return httpd_resp_send(req, "No camera config, call setCameraConfig after esp_camera_init", HTTPD_RESP_USE_STRLEN);
+    }
+    camera_grab_mode_t grab = camera_config.grab_mode;
+    int fb_count = (int)camera_config.fb_count;
+    camera_fb_location_t location = camera_config.fb_location;
+    if (httpd_query_key_value(query, "grab", value, sizeof(value)) == ESP_OK) {
+      if (strcmp(value, "latest") && strcmp(value, "empty")) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "grab is latest or empty");
+      }
+      grab = strcmp(value, "latest") ? CAMERA_GRAB_WHEN_EMPTY : CAMERA_GRAB_LATEST;
+    }
+    if (httpd_query_key_value(query, "fb_count", value, sizeof(value)) == ESP_OK) {
+      fb_count = atoi(value);
+    }
+    if (httpd_query_key_value(query, "psram", value, sizeof(value)) == ESP_OK) {
+      location = atoi(value) ? CAMERA_FB_IN_PSRAM : CAMERA_FB_IN_DRAM;
+    }
+    // With one buffer there is nothing to overwrite; the driver falls back to WHEN_EMPTY
+    if (fb_count < 1 || fb_count > CAMERA_MAX_FB_COUNT || (grab == CAMERA_GRAB_LATEST && fb_count < 2)) {
+      return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "fb_count is 1..4, at least 2 for grab=latest");
+    }
+    if (location == CAMERA_FB_IN_PSRAM && !psramFound()) {
+      return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "No PSRAM");
+    }
+    if (grab != camera_config.grab_mode || fb_count != (int)camera_config.fb_count || location != camera_config.fb_location) {
+      int64_t t0 = esp_timer_get_time();
+      esp_err_t err = camera_restart(grab, fb_count, location);
+      log_i("Capture mode %s, %d buffers in %s: 0x%x, %ums", grab == CAMERA_GRAB_LATEST ? "latest" : "empty", fb_count,
+            location == CAMERA_FB_IN_PSRAM ? "PSRAM" : "DRAM", err, (uint32_t)((esp_timer_get_time() - t0) / 1000));
+      if (err == ESP_ERR_TIMEOUT) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_send(req, "Frame buffers still in use", HTTPD_RESP_USE_STRLEN);
+      }
+      if (err != ESP_OK) {
+        return httpd_resp_send_500(req);
+      }
+    }
+  }
+
+  char json[256];
+  char *p = json;
+  *p++ = '{';
+  p = capture_mode_print(p);
+  *p++ = '}';
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, json, p - json);
+}
+
+// /bench: fixed microbenchmark script so boards and sensor settings can be
+// compared from numbers instead of the FPS log lines. Every frame size up to
+// the boot one (the frame buffers were sized for it) and every quality gets
+// `frames` timed frames per mode:
+//   capture  camera_grab only
+//   jpg      capture + frame2jpg (raw sensors; a JPEG sensor encodes itself)
+//   bmp      capture + frame2bmp
+//   send     capture + the frame as captured over a loopback TCP socket,
+//            the lwip path of a stream frame without the radio
+// Rows stream out as they finish. The stream capture task waits on
+// sensor_lock for the whole run, so viewers stall; settings are restored
+// at the end. ?frames=N (1..BENCH_MAX_FRAMES), ?mode=<one mode>.
+#define BENCH_FRAMES      10
+#define BENCH_MAX_FRAMES  50
+#define BENCH_SKIP_FRAMES 2     // Dropped after a size or quality change
+#define BENCH_TIMEOUT_MS  2000
+#define BENCH_SINK_STACK  3072
+
+enum { BENCH_CAPTURE, BENCH_JPG, BENCH_BMP, BENCH_SEND, BENCH_MODES };
+static const char *const bench_modes[BENCH_MODES] = {"capture", "jpg", "bmp", "send"};
+
+static const struct {
+  framesize_t size;
+  const char *name;
+} bench_sizes[] = {
+  {FRAMESIZE_QQVGA, "QQVGA"}, {FRAMESIZE_QVGA, "QVGA"}, {FRAMESIZE_VGA, "VGA"},   {FRAMESIZE_SVGA, "SVGA"},
+  {FRAMESIZE_XGA, "XGA"},     {FRAMESIZE_SXGA, "SXGA"}, {FRAMESIZE_UXGA, "UXGA"},
+};
+static const uint8_t bench_qualities[] = {10, 20, 40};
+
+// One handler runs at a time on camera_httpd
+static uint32_t bench_cap[BENCH_MAX_FRAMES];
+static uint32_t bench_work[BENCH_MAX_FRAMES];
+
+static int bench_cmp(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// "[p50,p95,max]" of n samples, sorting them in place
+static int bench_print_us(char *p, size_t size, uint32_t *v, int n) {
+  if (n == 0) {
+    return snprintf(p, size, "null");
+  }
+  qsort(v, n, sizeof(*v), bench_cmp);
+  return snprintf(p, size, "[%u,%u,%u]", v[(n - 1) / 2], v[(n - 1) * 95 / 100], v[n - 1]);
+}
+
+static void bench_sink_task(void *arg) {
+  int lfd = (int)(intptr_t)arg;
+  int fd = accept(lfd, NULL, NULL);  // SO_RCVTIMEO: gives up if the connect failed
+  close(lfd);
+  if (fd >= 0) {
+    uint8_t buf[1024];
+    while (recv(fd, buf, sizeof(buf), 0) > 0) {
+    }
+    close(fd);
+  }
+  vTaskDelete(NULL);
+}
+
+// Connected loopback socket whose peer a task drains until it is closed; -1 on failure
+static int bench_sink_open() {
+  int lfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (lfd < 0) {
+    return -1;
+  }
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  struct timeval tv = {BENCH_TIMEOUT_MS / 1000, 0};
+  setsockopt(lfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 1) != 0 || getsockname(lfd, (struct sockaddr *)&addr, &addr_len) != 0) {
+    close(lfd);
+    return -1;
+  }
+  if (xTaskCreate(bench_sink_task, "bench_sink", BENCH_SINK_STACK, (void *)(intptr_t)lfd, tskIDLE_PRIORITY + 4, NULL) != pdPASS) {
+    close(lfd);
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+static bool bench_send(int fd, const uint8_t *buf, size_t len) {
+  while (len) {
+    int n = send(fd, buf, len, 0);
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+// One row: `frames` captures through mode; quality is frame2jpg's for jpg on
+// a raw sensor. Heap and PSRAM peaks are sampled while the output is held.
+static int bench_row(char *p, size_t size, int mode, const char *name, int quality, int frames, int sink) {
+  size_t heap0 = heap_caps_get_free_size(MALLOC_CAP_INTERNAL), heap_min = heap0;
+  size_t psram0 = heap_caps_get_free_size(MALLOC_CAP_SPIRAM), psram_min = psram0;
+  uint64_t bytes = 0;
+  int n = 0, failed = 0;
+  int64_t start = esp_timer_get_time();
+  for (int i = 0; i < frames; i++) {
+    int64_t t0 = esp_timer_get_time();
+    camera_fb_t *fb = camera_grab();
+    int64_t t1 = esp_timer_get_time();
+    if (!fb) {
+      failed++;
+      continue;
+    }
+    uint8_t *out = NULL;
+    size_t out_len = fb->len;
+    bool ok = true;
+    if (mode == BENCH_JPG) {
+      ok = frame2jpg(fb, quality, &out, &out_len);
+    } else if (mode == BENCH_BMP) {
+      ok = frame2bmp(fb, &out, &out_len);
+    } else if (mode == BENCH_SEND) {
+      ok = bench_send(sink, fb->buf, fb->len);
+    }
+    int64_t t2 = esp_timer_get_time();
+    size_t heap = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    size_t psram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    heap_min = heap < heap_min ? heap : heap_min;
+    psram_min = psram < psram_min ? psram : psram_min;
+    free(out);
+    camera_release(fb);
+    if (!ok) {
+      failed++;
+      continue;
+    }
+    bench_cap[n] = (uint32_t)(t1 - t0);
+    bench_work[n] = (uint32_t)(t2 - t1);
+    bytes += out_len;
+    n++;
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  int len = snprintf(
+    p, size, "{\"mode\":\"%s\",\"size\":\"%s\",\"quality\":%d,\"frames\":%d,\"failed\":%d,\"fps\":%.2f,\"bytes\":%u,\"capture_us\":", bench_modes[mode], name,
+    quality, n, failed, elapsed > 0 ? n * 1e6 / elapsed : 0.0, n ? (uint32_t)(bytes / n) : 0
+  );
+  len += bench_print_us(p + len, size - len, bench_cap, n);
+  len += snprintf(p + len, size - len, ",\"work_us\":");
+  len += bench_print_us(p + len, size - len, bench_work, mode == BENCH_CAPTURE ? 0 : n);
+  len += snprintf(p + len, size - len, ",\"heap_peak\":%u,\"psram_peak\":%u}", (uint32_t)(heap0 - heap_min), (uint32_t)(psram0 - psram_min));
+  return len;
+}
+
+static esp_err_t bench_handler(httpd_req_t *req) {
+  int frames = query_int(req, "frames", BENCH_FRAMES);
+  if (frames < 1 || frames > BENCH_MAX_FRAMES) {
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "frames is 1..50");
+  }
+  int only = -1;
+  char query[64];
+  char value[12];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK && httpd_query_key_value(query, "mode", value, sizeof(value)) == ESP_OK) {
+    for (int m = 0; m < BENCH_MODES; m++) {
+      if (!strcmp(value, bench_modes[m])) {
+        only = m;
+      }
+    }
+    if (only < 0) {
+      return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "mode is capture, jpg, bmp or send");
+    }
+  }
 
   sensor_t *s = esp_camera_sensor_get();
-  int res = s->set_xclk(s, LEDC_TIMER_0, xclk);
-  if (res) {
+  bool jpeg = s->pixformat == PIXFORMAT_JPEG;
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  char row[320];
+  snprintf(row, sizeof(row), "{\"sensor\":\"0x%x\",\"pixformat\":\"%s\",\"rows\":[", s->id.PID, jpeg ? "jpeg" : "raw");
+  esp_err_t res = httpd_resp_send_chunk(req, row, HTTPD_RESP_USE_STRLEN);
+
+  int sink = -1;
+  if (only < 0 || only == BENCH_SEND) {
+    sink = bench_sink_open();
+    if (sink < 0) {
+      log_e("Loopback sink failed, send rows skipped");
+    }
+  }
+
+  xSemaphoreTake(sensor_lock, portMAX_DELAY);
+  int64_t t0 = esp_timer_get_time();
+  framesize_t framesize = s->status.framesize;
+  int quality = s->status.quality;
+  // The driver only resizes JPEG on the fly (as /control framesize); a raw
+  // sensor runs at its current size
+  framesize_t largest = camera_config_set ? camera_config.frame_size : framesize;
+  int rows = 0;
+  for (size_t si = 0; si < sizeof(bench_sizes) / sizeof(bench_sizes[0]) && res == ESP_OK; si++) {
+    if (jpeg ? bench_sizes[si].size > largest : bench_sizes[si].size != framesize) {
+      continue;
+    }
+    for (size_t qi = 0; qi < sizeof(bench_qualities) && res == ESP_OK; qi++) {
+      int q = bench_qualities[qi];
+      if (jpeg) {
+        s->set_framesize(s, bench_sizes[si].size);
+        s->set_quality(s, q);
+      }
+      if (jpeg || qi == 0) {
+        camera_fb_t *stale = fb_get_after(esp_timer_get_time(), BENCH_SKIP_FRAMES - 1, BENCH_TIMEOUT_MS);
+        if (stale) {
+          camera_release(stale);
+        }
+      }
+      for (int m = 0; m < BENCH_MODES && res == ESP_OK; m++) {
+        // A JPEG sensor has nothing for frame2jpg; a raw one only varies
+        // quality in the encoder
+        if ((only >= 0 && m != only) || (jpeg && m == BENCH_JPG) || (!jpeg && m != BENCH_JPG && qi > 0) || (m == BENCH_SEND && sink < 0)) {
+          continue;
+        }
+        int len = rows ? snprintf(row, sizeof(row), ",") : 0;
+        bench_row(row + len, sizeof(row) - len, m, bench_sizes[si].name, jpeg || m == BENCH_JPG ? q : 0, frames, sink);
+        res = httpd_resp_send_chunk(req, row, HTTPD_RESP_USE_STRLEN);
+        rows++;
+      }
+    }
+  }
+  if (jpeg) {
+    s->set_framesize(s, framesize);
+    s->set_quality(s, quality);
+    camera_fb_t *stale = fb_get_after(esp_timer_get_time(), BENCH_SKIP_FRAMES - 1, BENCH_TIMEOUT_MS);
+    if (stale) {
+      camera_release(stale);
+    }
+  }
+  xSemaphoreGive(sensor_lock);
+  uint32_t ms = (uint32_t)((esp_timer_get_time() - t0) / 1000);
+  if (sink >= 0) {
+    close(sink);
+  }
+  status_invalidate();
+  log_i("Bench: %d rows of %d frames in %ums", rows, frames, ms);
+
+  if (res == ESP_OK) {
+    snprintf(row, sizeof(row), "],\"frames\":%d,\"ms\":%u}", frames, ms);
+    res = httpd_resp_send_chunk(req, row, HTTPD_RESP_USE_STRLEN);
+  }
+  if (res == ESP_OK) {
+    res = httpd_resp_send_chunk(req, NULL, 0);
+  }
+  return res;
+}
+
+// The pages only change with the firmware, so each carries the CRC32 of its
+// blob from camera_index.h as ETag and a browser revalidates with a 304
+static esp_err_t index_send(httpd_req_t *req, const unsigned char *page, size_t len, const char *etag) {
+  httpd_resp_set_hdr(req, "ETag", etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  char match[48];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match)) == ESP_OK && strstr(match, etag)) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
+  }
+  httpd_resp_set_type(req, "text/html");
+  httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+  return httpd_resp_send(req, (const char *)page, len);
+}
+
+static esp_err_t index_handler(httpd_req_t *req) {
+  sensor_t *s = esp_camera_sensor_get();
+  if (s != NULL) {
+    if (s->id.PID == OV3660_PID) {
+      return index_send(req, index_ov3660_html_gz, index_ov3660_html_gz_len, index_ov3660_html_gz_etag);
+    } else if (s->id.PID == OV5640_PID) {
+      return index_send(req, index_ov5640_html_gz, index_ov5640_html_gz_len, index_ov5640_html_gz_etag);
+    } else {
+      return index_send(req, index_ov2640_html_gz, index_ov2640_html_gz_len, index_ov2640_html_gz_etag);
+    }
+  } else {
+    log_e("Camera sensor not found");
     return httpd_resp_send_500(req);
   }
-
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  return httpd_resp_send(req, NULL, 0);
 }
 
-static esp_err_t reg_handler(httpd_req_t *req) {
-  char *buf = NULL;
-  char _reg[32];
-  char _mask[32];
-  char _val[32];
+//
+// Socket policies of the two servers, applied by sock_open (open_fn) to
+// every accepted connection. The control server keeps idle browser tabs
+// alive and finds dead ones with TCP keep-alive; the stream server turns
+// Nagle off, so the tail of a multi-KB MJPEG part is not held back until the
+// viewer's delayed ACK, and asks for a larger send buffer. lwIP builds
+// without SO_SNDBUF support keep their TCP_SND_BUF; the value read back is
+// reported, -1 when the stack refused it.
+//
+// Every session sends through sock_send, which counts bytes and the time
+// spent blocked in send(). Per socket, kbps is over its lifetime and
+// send_kbps over the time send() blocked, which is roughly what the AP
+// takes when the send buffer is full; stalls counts sends that blocked
+// for more than SOCK_STALL_US.
+//
+#define SOCK_SLOTS    16
+#define SOCK_STALL_US 40000  // Around a delayed ACK
 
-  if (parse_get(req, &buf) != ESP_OK) {
-    return ESP_FAIL;
-  }
-  if (httpd_query_key_value(buf, "reg", _reg, sizeof(_reg)) != ESP_OK || httpd_query_key_value(buf, "mask", _mask, sizeof(_mask)) != ESP_OK
-      || httpd_query_key_value(buf, "val", _val, sizeof(_val)) != ESP_OK) {
-    free(buf);
-    httpd_resp_send_404(req);
-    return ESP_FAIL;
-  }
-  free(buf);
+typedef struct {
+  bool nodelay;
+  int sndbuf;     // Bytes; 0: stack default
+  bool keepalive;
+  int idle_s;     // Keep-alive: idle time before the first probe,
+  int interval_s; // time between probes,
+  int count;      // probes before the connection is dropped
+} sock_policy_t;
 
-  int reg = atoi(_reg);
-  int mask = atoi(_mask);
-  int val = atoi(_val);
-  log_i("Set Register: reg: 0x%02x, mask: 0x%02x, value: 0x%02x", reg, mask, val);
+typedef struct {
+  httpd_handle_t hd;  // NULL: free
+  int fd;
+  char peer[16];
+  int sndbuf;         // As read back after sock_open, -1: refused
+  int64_t opened_us;
+  uint64_t bytes;
+  uint64_t send_us;
+  uint32_t sends;
+  uint32_t stalls;
+} sock_stat_t;
 
-  sensor_t *s = esp_camera_sensor_get();
-  int res = s->set_reg(s, reg, mask, val);
-  if (res) {
-    return httpd_resp_send_500(req);
-  }
+typedef struct {
+  uint32_t opened;
+  uint32_t closed;
+  uint64_t bytes;     // Of closed sockets
+  uint64_t send_us;
+  uint32_t stalls;
+} sock_totals_t;
 
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  return httpd_resp_send(req, NULL, 0);
-}
+// [0] control server, [1] stream server
+static sock_policy_t sock_policy[2] = {
+  {false, 0, true, 5, 5, 3},
+  {true, 16384, false, 5, 5, 3},
+};
+static const char *const sock_server_names[2] = {"control", "stream"};
+static sock_stat_t sock_stats[SOCK_SLOTS];
+static sock_totals_t sock_totals[2];
+static portMUX_TYPE sock_mux = portMUX_INITIALIZER_UNLOCKED;
 
-static esp_err_t greg_handler(httpd_req_t *req) {
-  char *buf = NULL;
-  char _reg[32];
-  char _mask[32];
+static int sock_server(httpd_handle_t hd) {
+  return hd == stream_httpd ? 1 : 0;
+}
 
-  if (parse_get(req, &buf) != ESP_OK) {
-    return ESP_FAIL;
+// Applies p to fd; the send buffer size actually granted, -1 when refused
+static int sock_apply(int fd, const sock_policy_t *p) {
+  int on = p->nodelay;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  on = p->keepalive;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+  if (p->keepalive) {
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &p->idle_s, sizeof(p->idle_s));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &p->interval_s, sizeof(p->interval_s));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &p->count, sizeof(p->count));
   }
-  if (httpd_query_key_value(buf, "reg", _reg, sizeof(_reg)) != ESP_OK || httpd_query_key_value(buf, "mask", _mask, sizeof(_mask)) != ESP_OK) {
-    free(buf);
-    httpd_resp_send_404(req);
-    return ESP_FAIL;
+  if (p->sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &p->sndbuf, sizeof(p->sndbuf)) != 0) {
+    return -1;
   }
-  free(buf);
+  int granted = 0;
+  socklen_t len = sizeof(granted);
+  return getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &granted, &len) == 0 ? granted : -1;
+}
 
-  int reg = atoi(_reg);
-  int mask = atoi(_mask);
-  sensor_t *s = esp_camera_sensor_get();
-  int res = s->get_reg(s, reg, mask);
-  if (res < 0) {
-    return httpd_resp_send_500(req);
+static sock_stat_t *sock_find(httpd_handle_t hd, int fd) {
+  for (int i = 0; i < SOCK_SLOTS; i++) {
+    if (sock_stats[i].hd == hd && sock_stats[i].fd == fd) {
+      return &sock_stats[i];
+    }
   }
-  log_i("Get Register: reg: 0x%02x, mask: 0x%02x, value: 0x%02x", reg, mask, res);
-
-  char buffer[20];
-  const char *val = itoa(res, buffer, 10);
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  return httpd_resp_send(req, val, strlen(val));
+  return NULL;
 }
 
-static int parse_get_var(char *buf, const char *key, int def) {
-  char _int[16];
-  if (httpd_query_key_value(buf, key, _int, sizeof(_int)) != ESP_OK) {
-    return def;
+static int sock_send(httpd_handle_t hd, int fd, const char *buf, size_t len, int flags) {
+  int64_t t0 = esp_timer_get_time();
+  int n = send(fd, buf, len, flags);
+  int64_t us = esp_timer_get_time() - t0;
+  if (n < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL;
   }
-  return atoi(_int);
+  portENTER_CRITICAL(&sock_mux);
+  sock_stat_t *st = sock_find(hd, fd);
+  if (st) {
+    st->bytes += n;
+    st->send_us += us;
+    st->sends++;
+    st->stalls += us > SOCK_STALL_US;
+  }
+  portEXIT_CRITICAL(&sock_mux);
+  return n;
 }
 
-static esp_err_t pll_handler(httpd_req_t *req) {
-  char *buf = NULL;
+static esp_err_t sock_open(httpd_handle_t hd, int fd) {
+  int server = sock_server(hd);
+  sock_policy_t policy;
+  portENTER_CRITICAL(&sock_mux);
+  policy = sock_policy[server];
+  portEXIT_CRITICAL(&sock_mux);
+  int sndbuf = sock_apply(fd, &policy);
 
-  if (parse_get(req, &buf) != ESP_OK) {
-    return ESP_FAIL;
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  char peer[16] = "?";
+  if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) == 0) {
+    // Dual-stack listeners report IPv4 clients as mapped addresses
+    const uint8_t *a = addr.ss_family == AF_INET ? (const uint8_t *)&((struct sockaddr_in *)&addr)->sin_addr
+                                                 : (const uint8_t *)&((struct sockaddr_in6 *)&addr)->sin6_addr + 12;
+    snprintf(peer, sizeof(peer), "%u.%u.%u.%u", a[0], a[1], a[2], a[3]);
   }
 
-  int bypass = parse_get_var(buf, "bypass", 0);
-  int mul = parse_get_var(buf, "mul", 0);
-  int sys = parse_get_var(buf, "sys", 0);
-  int root = parse_get_var(buf, "root", 0);
-  int pre = parse_get_var(buf, "pre", 0);
-  int seld5 = parse_get_var(buf, "seld5", 0);
-  int pclken = parse_get_var(buf, "pclken", 0);
-  int pclk = parse_get_var(buf, "pclk", 0);
-  free(buf);
-
-  log_i("Set Pll: bypass: %d, mul: %d, sys: %d, root: %d, pre: %d, seld5: %d, pclken: %d, pclk: %d", bypass, mul, sys, root, pre, seld5, pclken, pclk);
-  sensor_t *s = esp_camera_sensor_get();
-  int res = s->set_pll(s, bypass, mul, sys, root, pre, seld5, pclken, pclk);
-  if (res) {
-    return httpd_resp_send_500(req);
+  portENTER_CRITICAL(&sock_mux);
+  sock_stat_t *st = NULL;
+  for (int i = 0; !st && i < SOCK_SLOTS; i++) {
+    if (!sock_stats[i].hd) {
+      st = &sock_stats[i];
+    }
   }
-
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  return httpd_resp_send(req, NULL, 0);
+  if (st) {
+    memset(st, 0, sizeof(*st));
+    st->hd = hd;
+    st->fd = fd;
+    memcpy(st->peer, peer, sizeof(peer));
+    st->sndbuf = sndbuf;
+    st->opened_us = esp_timer_get_time();
+  }
+  sock_totals[server].opened++;
+  portEXIT_CRITICAL(&sock_mux);
+  return httpd_sess_set_send_override(hd, fd, sock_send);
 }
 
-static esp_err_t win_handler(httpd_req_t *req) {
-  char *buf = NULL;
-
-  if (parse_get(req, &buf) != ESP_OK) {
-    return ESP_FAIL;
+// With a close_fn set the server leaves closing the socket to it
+static void sock_close(httpd_handle_t hd, int fd) {
+  int server = sock_server(hd);
+  portENTER_CRITICAL(&sock_mux);
+  sock_stat_t *st = sock_find(hd, fd);
+  sock_totals[server].closed++;
+  if (st) {
+    sock_totals[server].bytes += st->bytes;
+    sock_totals[server].send_us += st->send_us;
+    sock_totals[server].stalls += st->stalls;
+    st->hd = NULL;
   }
+  portEXIT_CRITICAL(&sock_mux);
+  close(fd);
+}
 
-  int startX = parse_get_var(buf, "sx", 0);
-  int startY = parse_get_var(buf, "sy", 0);
-  int endX = parse_get_var(buf, "ex", 0);
-  int endY = parse_get_var(buf, "ey", 0);
-  int offsetX = parse_get_var(buf, "offx", 0);
-  int offsetY = parse_get_var(buf, "offy", 0);
-  int totalX = parse_get_var(buf, "tx", 0);
-  int totalY = parse_get_var(buf, "ty", 0);  // codespell:ignore totaly
-  int outputX = parse_get_var(buf, "ox", 0);
-  int outputY = parse_get_var(buf, "oy", 0);
-  bool scale = parse_get_var(buf, "scale", 0) == 1;
-  bool binning = parse_get_var(buf, "binning", 0) == 1;
-  free(buf);
+static uint32_t sock_kbps(uint64_t bytes, uint64_t us) {
+  return us ? (uint32_t)(bytes * 8000 / us) : 0;
+}
 
-  log_i(
-    "Set Window: Start: %d %d, End: %d %d, Offset: %d %d, Total: %d %d, Output: %d %d, Scale: %u, Binning: %u", startX, startY, endX, endY, offsetX, offsetY,
-    totalX, totalY, outputX, outputY, scale, binning  // codespell:ignore totaly
-  );
-  sensor_t *s = esp_camera_sensor_get();
-  int res = s->set_res_raw(s, startX, startY, endX, endY, offsetX, offsetY, totalX, totalY, outputX, outputY, scale, binning);  // codespell:ignore totaly
-  if (res) {
-    return httpd_resp_send_500(req);
+//
+// /sockets: the policy and open sockets of each server.
+// /sockets?server=control|stream&nodelay=0|1&sndbuf=<bytes>&keepalive=0|1&idle=<s>&interval=<s>&count=<n>
+// changes that server's policy (omitted keys keep theirs) and applies it to
+// its open sockets as well as to later ones.
+//
+static esp_err_t sockets_handler(httpd_req_t *req) {
+  char query[160];
+  char value[12];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    if (httpd_query_key_value(query, "server", value, sizeof(value)) != ESP_OK || (strcmp(value, "control") && strcmp(value, "stream"))) {
+      return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "server is control or stream");
+    }
+    int server = strcmp(value, "stream") ? 0 : 1;
+    portENTER_CRITICAL(&sock_mux);
+    sock_policy_t p = sock_policy[server];
+    portEXIT_CRITICAL(&sock_mux);
+    if (httpd_query_key_value(query, "nodelay", value, sizeof(value)) == ESP_OK) {
+      p.nodelay = atoi(value) != 0;
+    }
+    if (httpd_query_key_value(query, "sndbuf", value, sizeof(value)) == ESP_OK) {
+      p.sndbuf = atoi(value);
+    }
+    if (httpd_query_key_value(query, "keepalive", value, sizeof(value)) == ESP_OK) {
+      p.keepalive = atoi(value) != 0;
+    }
+    if (httpd_query_key_value(query, "idle", value, sizeof(value)) == ESP_OK) {
+      p.idle_s = atoi(value);
+    }
+    if (httpd_query_key_value(query, "interval", value, sizeof(value)) == ESP_OK) {
+      p.interval_s = atoi(value);
+    }
+    if (httpd_query_key_value(query, "count", value, sizeof(value)) == ESP_OK) {
+      p.count = atoi(value);
+    }
+    if (p.sndbuf < 0 || p.sndbuf > 65535 || p.idle_s < 1 || p.interval_s < 1 || p.count < 1) {
+      return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "sndbuf is 0..65535, idle, interval and count at least 1");
+    }
+    int fds[SOCK_SLOTS];
+    int n = 0;
+    portENTER_CRITICAL(&sock_mux);
+    sock_policy[server] = p;
+    for (int i = 0; i < SOCK_SLOTS; i++) {
+      if (sock_stats[i].hd && sock_server(sock_stats[i].hd) == server) {
+        fds[n++] = sock_stats[i].fd;
+      }
+    }
+    portEXIT_CRITICAL(&sock_mux);
+    // setsockopt outside the lock; a socket that closed meanwhile just fails
+    for (int i = 0; i < n; i++) {
+      int sndbuf = sock_apply(fds[i], &p);
+      portENTER_CRITICAL(&sock_mux);
+      for (int j = 0; j < SOCK_SLOTS; j++) {
+        if (sock_stats[j].hd && sock_stats[j].fd == fds[i] && sock_server(sock_stats[j].hd) == server) {
+          sock_stats[j].sndbuf = sndbuf;
+        }
+      }
+      portEXIT_CRITICAL(&sock_mux);
+    }
+    log_i("Socket policy %s: nodelay %d, sndbuf %d, keepalive %d (%d/%d/%d), applied to %d open", sock_server_names[server], p.nodelay, p.sndbuf,
+          p.keepalive, p.idle_s, p.interval_s, p.count, n);
   }
 
-  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  return httpd_resp_send(req, NULL, 0);
-}
+  sock_stat_t stats[SOCK_SLOTS];
+  sock_policy_t policy[2];
+  sock_totals_t totals[2];
+  portENTER_CRITICAL(&sock_mux);
+  memcpy(stats, sock_stats, sizeof(stats));
+  memcpy(policy, sock_policy, sizeof(policy));
+  memcpy(totals, sock_totals, sizeof(totals));
+  portEXIT_CRITICAL(&sock_mux);
 
-static esp_err_t index_handler(httpd_req_t *req) {
-  httpd_resp_set_type(req, "text/html");
-  httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
-  sensor_t *s = esp_camera_sensor_get();
-  if (s != NULL) {
-    if (s->id.PID == OV3660_PID) {
-      return httpd_resp_send(req, (const char *)index_ov3660_html_gz, index_ov3660_html_gz_len);
-    } else if (s->id.PID == OV5640_PID) {
-      return httpd_resp_send(req, (const char *)index_ov5640_html_gz, index_ov5640_html_gz_len);
-    } else {
-      return httpd_resp_send(req, (const char *)index_ov2640_html_gz, index_ov2640_html_gz_len);
+  static char json[2560];
+  char *p = json;
+  char *end = json + sizeof(json);
+  int64_t now = esp_timer_get_time();
+  *p++ = '{';
+  for (int s = 0; s < 2; s++) {
+    const sock_policy_t *pl = &policy[s];
+    const sock_totals_t *t = &totals[s];
+    p += snprintf(p, end - p,
+                  "%s\"%s\":{\"nodelay\":%d,\"sndbuf\":%d,\"keepalive\":%d,\"idle_s\":%d,\"interval_s\":%d,\"count\":%d,"
+                  "\"opened\":%u,\"closed\":%u,\"closed_mb\":%.1f,\"closed_send_kbps\":%u,\"closed_stalls\":%u,\"sockets\":[",
+                  s ? "," : "", sock_server_names[s], pl->nodelay, pl->sndbuf, pl->keepalive, pl->idle_s, pl->interval_s, pl->count, t->opened, t->closed,
+                  t->bytes / 1e6, sock_kbps(t->bytes, t->send_us), t->stalls);
+    bool first = true;
+    for (int i = 0; i < SOCK_SLOTS && end - p > 256; i++) {
+      const sock_stat_t *st = &stats[i];
+      if (!st->hd || sock_server(st->hd) != s) {
+        continue;
+      }
+      p += snprintf(p, end - p,
+                    "%s{\"fd\":%d,\"peer\":\"%s\",\"sndbuf\":%d,\"age_s\":%u,\"bytes\":%llu,\"kbps\":%u,\"send_kbps\":%u,\"sends\":%u,\"avg_send_us\":%u,"
+                    "\"stalls\":%u}",
+                    first ? "" : ",", st->fd, st->peer, st->sndbuf, (uint32_t)((now - st->opened_us) / 1000000), (unsigned long long)st->bytes,
+                    sock_kbps(st->bytes, now - st->opened_us), sock_kbps(st->bytes, st->send_us), st->sends,
+                    st->sends ? (uint32_t)(st->send_us / st->sends) : 0, st->stalls);
+      first = false;
     }
-  } else {
-    log_e("Camera sensor not found");
-    return httpd_resp_send_500(req);
+    p += snprintf(p, end - p, "]}");
   }
+  p += snprintf(p, end - p, "}");
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, json, p - json);
 }
 
+#if defined(ENABLE_FACE_DETECT)
+static esp_err_t face_handler(httpd_req_t *req);
+#endif
+
 #define HTTPD_CONFIG_1() {                        \
         .task_priority      = tskIDLE_PRIORITY+5,       \
         .stack_size         = 4096,                     \
@@ -696,7 +3772,7 @@ static esp_err_t index_handler(httpd_req_t *req) {
         .ctrl_port          = ESP_HTTPD_DEF_CTRL_PORT,  \
         .max_open_sockets   = 7,                        \
         .max_uri_handlers   = 8,                        \
-        .max_resp_headers   = 8,                        \
+        .max_resp_headers   = 12,                       \
         .backlog_conn       = 5,                        \
         .lru_purge_enable   = false,                    \
         .recv_wait_timeout  = 5,                        \
@@ -711,14 +3787,14 @@ static esp_err_t index_handler(httpd_req_t *req) {
         .keep_alive_idle = 0,                           \
         .keep_alive_interval = 0,                       \
         .keep_alive_count = 0,                          \
-        .open_fn = NULL,                                \
-        .close_fn = NULL,                               \
+        .open_fn = sock_open,                           \
+        .close_fn = sock_close,                         \
         .uri_match_fn = NULL                            \
 }
 
 void startCameraServer() {
   httpd_config_t config = HTTPD_CONFIG_1();
-  config.max_uri_handlers = 16;
+  config.max_uri_handlers = 20;
 
   httpd_uri_t index_uri = {
     .uri = "/",
@@ -785,6 +3861,31 @@ void startCameraServer() {
 #endif
   };
 
+  httpd_uri_t events_uri = {
+    .uri = "/events",
+    .method = HTTP_GET,
+    .handler = events_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+  httpd_uri_t ws_uri = {
+    .uri = "/ws",
+    .method = HTTP_GET,
+    .handler = ws_handler,
+    .user_ctx = NULL,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+  };
+#endif
+
   httpd_uri_t bmp_uri = {
     .uri = "/bmp",
     .method = HTTP_GET,
@@ -878,7 +3979,113 @@ void startCameraServer() {
 #endif
   };
 
+  httpd_uri_t roi_uri = {
+    .uri = "/roi",
+    .method = HTTP_GET,
+    .handler = roi_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t profile_uri = {
+    .uri = "/profile",
+    .method = HTTP_GET,
+    .handler = profile_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t metrics_uri = {
+    .uri = "/metrics",
+    .method = HTTP_GET,
+    .handler = metrics_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t capture_mode_uri = {
+    .uri = "/capture_mode",
+    .method = HTTP_GET,
+    .handler = capture_mode_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t thumb_uri = {
+    .uri = "/thumb",
+    .method = HTTP_GET,
+    .handler = thumb_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t bench_uri = {
+    .uri = "/bench",
+    .method = HTTP_GET,
+    .handler = bench_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t sockets_uri = {
+    .uri = "/sockets",
+    .method = HTTP_GET,
+    .handler = sockets_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t clip_uri = {
+    .uri = "/clip",
+    .method = HTTP_GET,
+    .handler = clip_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
   ra_filter_init(&ra_filter, 20);
+  stream_init();
+  ctrl_table_sorted();
 
   log_i("Starting web server on port: '%d'", config.server_port);
   if (httpd_start(&camera_httpd, &config) == ESP_OK) {
@@ -889,7 +4096,6 @@ void startCameraServer() {
     httpd_register_uri_handler(camera_httpd, &bmp_uri);
 
 #if defined(ENABLE_FACE_DETECT)
-    extern esp_err_t face_handler(httpd_req_t *req);
     face_uri.handler = face_handler;
     httpd_register_uri_handler(camera_httpd, &face_uri);
 #endif
@@ -899,13 +4105,27 @@ void startCameraServer() {
     httpd_register_uri_handler(camera_httpd, &greg_uri);
     httpd_register_uri_handler(camera_httpd, &pll_uri);
     httpd_register_uri_handler(camera_httpd, &win_uri);
+    httpd_register_uri_handler(camera_httpd, &roi_uri);
+    httpd_register_uri_handler(camera_httpd, &profile_uri);
+    httpd_register_uri_handler(camera_httpd, &metrics_uri);
+    httpd_register_uri_handler(camera_httpd, &clip_uri);
+    httpd_register_uri_handler(camera_httpd, &thumb_uri);
+    httpd_register_uri_handler(camera_httpd, &capture_mode_uri);
+    httpd_register_uri_handler(camera_httpd, &bench_uri);
+    httpd_register_uri_handler(camera_httpd, &sockets_uri);
   }
 
   config.server_port += 1;
   config.ctrl_port += 1;
+  // A viewer that vanished without closing must not hold a socket forever
+  config.lru_purge_enable = true;
   log_i("Starting stream server on port: '%d'", config.server_port);
   if (httpd_start(&stream_httpd, &config) == ESP_OK) {
     httpd_register_uri_handler(stream_httpd, &stream_uri);
+    httpd_register_uri_handler(stream_httpd, &events_uri);
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    httpd_register_uri_handler(stream_httpd, &ws_uri);
+#endif
   }
 }
 void setupLedFlash() {
@@ -921,8 +4141,9 @@ void setupLedFlash() {
 #if defined(ENABLE_FACE_DETECT)
 // Simple face handler that calls a weak `detect_faces` symbol if present.
 // Returns JSON array of detected boxes: [{"x":..,"y":..,"w":..,"h":..,"score":..},...]
+// in frame coordinates; detection itself runs on the reduced working image.
 static esp_err_t face_handler(httpd_req_t *req) {
-  camera_fb_t *fb = esp_camera_fb_get();
+  camera_fb_t *fb = camera_grab();
   if (!fb) {
     httpd_resp_send_500(req);
     return ESP_FAIL;
@@ -930,16 +4151,20 @@ static esp_err_t face_handler(httpd_req_t *req) {
 
   // If detect_faces symbol not linked, return informative error
   if (!detect_faces) {
-    esp_camera_fb_return(fb);
+    camera_release(fb);
     httpd_resp_set_type(req, "application/json");
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
     const char *msg = "{\"error\":\"face detection not linked\"}";
     return httpd_resp_send(req, msg, strlen(msg));
   }
 
+  static face_work_t work;
   const int MAX_BOXES = 8;
   face_box_t boxes[MAX_BOXES];
-  int n = detect_faces(fb, boxes, MAX_BOXES);
+  int64_t t0 = esp_timer_get_time();
+  int n = face_detect_scaled(&work, fb, boxes, MAX_BOXES);
+  char detect_ms[16];
+  snprintf(detect_ms, sizeof(detect_ms), "%.1f", (esp_timer_get_time() - t0) / 1000.0);
 
   // build JSON response
   char json[512];
@@ -955,9 +4180,10 @@ static esp_err_t face_handler(httpd_req_t *req) {
   *p++ = ']';
   *p++ = 0;
 
-  esp_camera_fb_return(fb);
+  camera_release(fb);
   httpd_resp_set_type(req, "application/json");
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "X-Detect-Ms", detect_ms);  // Reduction and inference
   return httpd_resp_send(req, json, strlen(json));
 }
 #endif
@@ -1,6 +1,7 @@
 
 //File: index_ov2640.html.gz, Size: 6687
 #define index_ov2640_html_gz_len 6687
+#define index_ov2640_html_gz_etag "\"c1c2e388\""
 const unsigned char index_ov2640_html_gz[] = {
   0x1F, 0x8B, 0x08, 0x08, 0xA5, 0xF6, 0xDA, 0x67, 0x00, 0xFF, 0x69, 0x6E, 0x64, 0x65, 0x78, 0x5F, 0x6F, 0x76, 0x32, 0x36, 0x34, 0x30, 0x2E, 0x68, 0x74, 0x6D,
   0x6C, 0x2E, 0x67, 0x7A, 0x00, 0xED, 0x7D, 0x7B, 0x73, 0xDB, 0x36, 0xD6, 0xF7, 0xFF, 0xFD, 0x14, 0x8C, 0xDA, 0xB5, 0xE4, 0xB1, 0x24, 0xDB, 0xB2, 0xE3, 0x24,
@@ -264,6 +265,7 @@ const unsigned char index_ov2640_html_gz[] = {
 
 //File: index_ov3660.html.gz, Size: 8636
 #define index_ov3660_html_gz_len 8636
+#define index_ov3660_html_gz_etag "\"aad8fc1d\""
 const unsigned char index_ov3660_html_gz[] = {
   0x1F, 0x8B, 0x08, 0x08, 0xD3, 0xA3, 0x7B, 0x67, 0x00, 0x03, 0x69, 0x6E, 0x64, 0x65, 0x78, 0x5F, 0x6F, 0x76, 0x33, 0x36, 0x36, 0x30, 0x2E, 0x68, 0x74, 0x6D,
   0x6C, 0x00, 0xED, 0x3D, 0x69, 0x73, 0xDB, 0x46, 0xB2, 0xDF, 0xFD, 0x2B, 0x60, 0x66, 0xD7, 0xA2, 0xCA, 0x22, 0x45, 0xF0, 0xD2, 0x61, 0x89, 0x7E, 0xB6, 0xAC,
@@ -602,6 +604,7 @@ const unsigned char index_ov3660_html_gz[] = {
 
 //File: index_ov5640.html.gz, Size: 8880
 #define index_ov5640_html_gz_len 8880
+#define index_ov5640_html_gz_etag "\"4c0d9b91\""
 const unsigned char index_ov5640_html_gz[] = {
   0x1F, 0x8B, 0x08, 0x08, 0x5B, 0xA3, 0x7B, 0x67, 0x00, 0x03, 0x69, 0x6E, 0x64, 0x65, 0x78, 0x5F, 0x6F, 0x76, 0x35, 0x36, 0x34, 0x30, 0x2E, 0x68, 0x74, 0x6D,
   0x6C, 0x00, 0xED, 0x3D, 0xDB, 0x72, 0xDB, 0xC6, 0x92, 0xEF, 0xFE, 0x0A, 0x98, 0xC9, 0x9A, 0x64, 0x59, 0xA4, 0x08, 0xDE, 0x74, 0xB1, 0x44, 0xAF, 0x2D, 0x2B,
@@ -0,0 +1,180 @@
+#include "face_detect.h"
+#include "esp_heap_caps.h"
+#include "esp_jpg_decode.h"
+#include "kernels.h"
+#include <string.h>
+
+typedef struct {
+  face_work_t *w;
+  const camera_fb_t *src;
+} face_jpg_t;
+
+static inline uint8_t luma(uint8_t r, uint8_t g, uint8_t b) {
+  // BT.601, weights sum to 256
+  return (77 * r + 150 * g + 29 * b) >> 8;
+}
+
+// Decoded pixels per working pixel so that dec_w x dec_h fits the buffer
+static void work_size(face_work_t *w, uint16_t dec_w, uint16_t dec_h) {
+  int sx = (dec_w + w->max_w - 1) / w->max_w;
+  int sy = (dec_h + w->max_h - 1) / w->max_h;
+  w->dec_w = dec_w;
+  w->dec_h = dec_h;
+  w->step = sx > sy ? sx : sy;
+  if (!w->step) {
+    w->step = 1;
+  }
+  w->fb.width = dec_w / w->step;
+  w->fb.height = dec_h / w->step;
+  w->fb.len = w->fb.width * w->fb.height;
+}
+
+static size_t work_jpg_read(void *arg, size_t index, uint8_t *buf, size_t len) {
+  face_jpg_t *j = (face_jpg_t *)arg;
+  if (buf) {
+    memcpy(buf, j->src->buf + index, len);
+  }
+  return len;
+}
+
+static bool work_jpg_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+  face_work_t *work = ((face_jpg_t *)arg)->w;
+  if (!data) {
+    if (!x && !y) {
+      work_size(work, w, h);
+    }
+    return work->fb.width && work->fb.height;
+  }
+  int step = work->step;
+  for (int r = 0; r < h; r++) {
+    int sy = y + r;
+    if (sy % step || sy / step >= (int)work->fb.height) {
+      continue;
+    }
+    uint8_t *out = work->buf + (sy / step) * work->fb.width;
+    const uint8_t *row = data + r * w * 3;
+    // First column of this block that lands on the working grid
+    for (int c = (step - x % step) % step; c < w; c += step) {
+      int sx = (x + c) / step;
+      if (sx < (int)work->fb.width) {
+        out[sx] = luma(row[c * 3], row[c * 3 + 1], row[c * 3 + 2]);
+      }
+    }
+  }
+  return true;
+}
+
+static bool work_fill_raw(face_work_t *w, const camera_fb_t *fb) {
+  work_size(w, fb->width, fb->height);
+  int step = w->step;
+  // Whole rows (step 1) and the 2x2 box of a grayscale frame have kernels
+  if (step == 1 || (step == 2 && fb->format == PIXFORMAT_GRAYSCALE)) {
+    switch (fb->format) {
+      case PIXFORMAT_GRAYSCALE:
+        if (step == 2) {
+          kernel_downscale2(fb->buf, fb->width, w->buf, w->fb.width, w->fb.height);
+        } else {
+          memcpy(w->buf, fb->buf, w->fb.len);
+        }
+        return true;
+      case PIXFORMAT_YUV422: kernel_yuv422_gray(fb->buf, w->buf, w->fb.len); return true;
+      case PIXFORMAT_RGB565: kernel_rgb565_gray(fb->buf, w->buf, w->fb.len); return true;
+      default: return false;
+    }
+  }
+  for (size_t y = 0; y < w->fb.height; y++) {
+    uint8_t *out = w->buf + y * w->fb.width;
+    size_t row = y * step * fb->width;
+    for (size_t x = 0; x < w->fb.width; x++) {
+      size_t i = row + x * step;
+      switch (fb->format) {
+        case PIXFORMAT_GRAYSCALE: out[x] = fb->buf[i]; break;
+        // Y0 U Y1 V: luma is every other byte
+        case PIXFORMAT_YUV422: out[x] = fb->buf[i * 2]; break;
+        case PIXFORMAT_RGB565:
+        {
+          // Big endian RGB565 as the sensor sends it
+          uint16_t px = fb->buf[i * 2] << 8 | fb->buf[i * 2 + 1];
+          out[x] = luma((px >> 8) & 0xF8, (px >> 3) & 0xFC, (px << 3) & 0xF8);
+          break;
+        }
+        default: return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool face_work_fill(face_work_t *w, const camera_fb_t *fb) {
+  if (!w->buf) {
+    bool psram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) > 0;
+    w->max_w = psram ? FACE_WORK_W : FACE_WORK_SMALL_W;
+    w->max_h = psram ? FACE_WORK_H : FACE_WORK_SMALL_H;
+    w->buf = (uint8_t *)heap_caps_malloc(w->max_w * w->max_h, psram ? MALLOC_CAP_SPIRAM : MALLOC_CAP_8BIT);
+    if (!w->buf) {
+      return false;
+    }
+  }
+  w->fb.buf = w->buf;
+  w->fb.format = PIXFORMAT_GRAYSCALE;
+  w->fb.timestamp = fb->timestamp;
+  w->fb.width = 0;
+  w->fb.height = 0;
+
+  if (fb->format != PIXFORMAT_JPEG) {
+    if (!work_fill_raw(w, fb)) {
+      return false;
+    }
+    w->factor = w->step;
+    return true;
+  }
+  // Smallest decode still covering the working size; the rest is subsampling
+  int scale = JPG_SCALE_NONE;
+  while (scale < JPG_SCALE_8X && ((fb->width >> scale) > w->max_w || (fb->height >> scale) > w->max_h)) {
+    scale++;
+  }
+  face_jpg_t j = {w, fb};
+  if (esp_jpg_decode(fb->len, (jpg_scale_t)scale, work_jpg_read, work_jpg_write, &j) != ESP_OK) {
+    return false;
+  }
+  w->factor = (1 << scale) * w->step;
+  return true;
+}
+
+static int scale_clamp(int v, int factor, int limit) {
+  v *= factor;
+  return v < 0 ? 0 : v > limit ? limit : v;
+}
+
+int face_work_detect(const face_work_t *w, int width, int height, face_box_t *boxes, int max_boxes) {
+  if (!detect_faces) {
+    return -1;
+  }
+  int n = detect_faces(&w->fb, boxes, max_boxes);
+  for (int i = 0; i < n && i < max_boxes; i++) {
+    face_box_t *b = &boxes[i];
+    b->id = 0;
+    int x = scale_clamp(b->x, w->factor, width);
+    int y = scale_clamp(b->y, w->factor, height);
+    b->w = scale_clamp(b->x + b->w, w->factor, width) - x;
+    b->h = scale_clamp(b->y + b->h, w->factor, height) - y;
+    b->x = x;
+    b->y = y;
+  }
+  return n;
+}
+
+int face_detect_scaled(face_work_t *w, const camera_fb_t *fb, face_box_t *boxes, int max_boxes) {
+  if (!detect_faces) {
+    return -1;
+  }
+  if (!face_work_fill(w, fb)) {
+    // No buffer or a format we cannot reduce: the detector gets the frame itself
+    int n = detect_faces(fb, boxes, max_boxes);
+    for (int i = 0; i < n && i < max_boxes; i++) {
+      boxes[i].id = 0;
+    }
+    return n;
+  }
+  return face_work_detect(w, fb->width, fb->height, boxes, max_boxes);
+}
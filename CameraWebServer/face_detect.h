@@ -0,0 +1,62 @@
+#ifndef FACE_DETECT_H
+#define FACE_DETECT_H
+
+#include "esp_camera.h"
+
+// Face detection integration point (optional)
+typedef struct {
+  int x;
+  int y;
+  int w;
+  int h;
+  int score;
+  int id;  // Track id from face_track; 0 from detect_faces alone
+} face_box_t;
+
+// Weak symbol: if your build links an ESP-WHO based implementation providing
+// `detect_faces`, it will be used. The function should return the number of
+// faces detected and fill the provided `face_box_t` array. Check the symbol
+// for NULL before calling.
+extern "C" int detect_faces(const camera_fb_t *fb, face_box_t *boxes, int max_boxes) __attribute__((weak));
+
+//
+// Detection at working resolution.
+//
+// A detector needs far fewer pixels than the sensor delivers, so
+// face_detect_scaled hands detect_faces a grayscale copy of the frame no
+// larger than FACE_WORK_W x FACE_WORK_H (FACE_WORK_SMALL_W x _H without
+// PSRAM). JPEG frames are decoded at 1/2, 1/4 or 1/8 scale, which skips
+// most of the IDCT work, and then subsampled; raw frames are subsampled
+// directly. The boxes come back in the coordinates of the original frame,
+// ready for cropping it. Detection cost follows the working size, not the
+// capture size.
+//
+#ifndef FACE_WORK_W
+#define FACE_WORK_W 320  // QVGA
+#define FACE_WORK_H 240
+#endif
+#define FACE_WORK_SMALL_W 160  // QQVGA
+#define FACE_WORK_SMALL_H 120
+
+typedef struct {
+  camera_fb_t fb;  // Working image handed to detect_faces
+  uint8_t *buf;    // Allocated on first use and kept
+  uint16_t max_w, max_h;
+  uint16_t dec_w, dec_h;  // Size of the (possibly scaled) decode
+  uint8_t step;           // Decoded pixels per working pixel, both ways
+  uint8_t factor;         // Frame pixels per working pixel
+} face_work_t;
+
+// detect_faces on the working image of fb, boxes in fb coordinates; -1 when
+// detect_faces is not linked. w is one zero-initialised face_work_t per
+// calling task; frames it cannot reduce go to detect_faces unchanged.
+int face_detect_scaled(face_work_t *w, const camera_fb_t *fb, face_box_t *boxes, int max_boxes);
+
+// face_detect_scaled in its two halves, so the reduction can stay on the
+// capturing task while another one detects: fill w from fb (false when fb
+// cannot be reduced), later detect on w.fb with boxes scaled back to the
+// width x height frame it was filled from.
+bool face_work_fill(face_work_t *w, const camera_fb_t *fb);
+int face_work_detect(const face_work_t *w, int width, int height, face_box_t *boxes, int max_boxes);
+
+#endif  // FACE_DETECT_H
@@ -0,0 +1,124 @@
+//
+// detect_faces on ESP-DL.
+//
+// The int8-quantized two-stage human face detector of ESP-WHO, as the
+// upstream CameraWebServer used it: MSR01 proposes candidates on a copy
+// it scales down itself, MNP01 refines every candidate on a 48x48 crop.
+// Built with ENABLE_FACE_DETECT when the core ships the esp-dl headers
+// (esp32 Arduino core 2.x for ESP32 and ESP32-S3); without them the weak
+// symbol stays unresolved and callers see "not linked" as before.
+//
+// The models want 3-channel pixels. The grayscale working image from
+// face_detect_scaled is replicated into an input of at most
+// FACE_DL_W x FACE_DL_H, subsampled further if larger, which keeps that
+// scratch in internal RAM; the detector objects go to PSRAM when there is
+// one. Their coefficients are constant data in flash. The esp-dl layers
+// are not reentrant, so one inference runs at a time.
+//
+// Boxes are in the coordinates of the image passed in; score is the MNP01
+// confidence in percent.
+//
+#if defined(ENABLE_FACE_DETECT) && __has_include("human_face_detect_msr01.hpp")
+#include "face_detect.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "human_face_detect_msr01.hpp"
+#include "human_face_detect_mnp01.hpp"
+#include <new>
+
+#define FACE_DL_W 160
+#define FACE_DL_H 120
+// MSR01 works on the input scaled by this; 64 pixels wide as upstream at QVGA
+#define FACE_DL_RESIZE (64.0F / FACE_DL_W)
+
+static HumanFaceDetectMSR01 *face_dl_s1;
+static HumanFaceDetectMNP01 *face_dl_s2;
+static uint8_t *face_dl_input;
+
+template <typename T, typename... Args> static T *face_dl_new(Args... args) {
+  void *mem = heap_caps_malloc(sizeof(T), MALLOC_CAP_SPIRAM);
+  if (!mem) {
+    mem = heap_caps_malloc(sizeof(T), MALLOC_CAP_8BIT);
+  }
+  return mem ? new (mem) T(args...) : NULL;
+}
+
+static bool face_dl_init() {
+  if (!face_dl_input) {
+    face_dl_input = (uint8_t *)heap_caps_malloc(FACE_DL_W * FACE_DL_H * 3, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  }
+  if (!face_dl_s1) {
+    face_dl_s1 = face_dl_new<HumanFaceDetectMSR01>(0.1F, 0.5F, 10, FACE_DL_RESIZE);
+  }
+  if (!face_dl_s2) {
+    face_dl_s2 = face_dl_new<HumanFaceDetectMNP01>(0.5F, 0.3F, 5);
+  }
+  return face_dl_input && face_dl_s1 && face_dl_s2;
+}
+
+static inline uint8_t face_dl_luma(const camera_fb_t *fb, size_t x, size_t y) {
+  size_t i = y * fb->width + x;
+  switch (fb->format) {
+    case PIXFORMAT_GRAYSCALE: return fb->buf[i];
+    case PIXFORMAT_YUV422:    return fb->buf[i * 2];
+    case PIXFORMAT_RGB565:
+    {
+      uint16_t px = fb->buf[i * 2] << 8 | fb->buf[i * 2 + 1];
+      return (77 * ((px >> 8) & 0xF8) + 150 * ((px >> 3) & 0xFC) + 29 * ((px << 3) & 0xF8)) >> 8;
+    }
+    default:
+    {
+      const uint8_t *p = fb->buf + i * 3;
+      return (77 * p[2] + 150 * p[1] + 29 * p[0]) >> 8;
+    }
+  }
+}
+
+// Subsampled copy of fb into face_dl_input; the step or 0 when fb has no pixels to read
+static int face_dl_fill(const camera_fb_t *fb, int *w, int *h) {
+  if (fb->format != PIXFORMAT_GRAYSCALE && fb->format != PIXFORMAT_YUV422 && fb->format != PIXFORMAT_RGB565 && fb->format != PIXFORMAT_RGB888) {
+    return 0;
+  }
+  int sx = (fb->width + FACE_DL_W - 1) / FACE_DL_W;
+  int sy = (fb->height + FACE_DL_H - 1) / FACE_DL_H;
+  int step = sx > sy ? sx : sy;
+  step = step ? step : 1;
+  *w = fb->width / step;
+  *h = fb->height / step;
+  uint8_t *out = face_dl_input;
+  for (int y = 0; y < *h; y++) {
+    for (int x = 0; x < *w; x++) {
+      uint8_t v = face_dl_luma(fb, x * step, y * step);
+      *out++ = v;
+      *out++ = v;
+      *out++ = v;
+    }
+  }
+  return *w && *h ? step : 0;
+}
+
+extern "C" int detect_faces(const camera_fb_t *fb, face_box_t *boxes, int max_boxes) {
+  static SemaphoreHandle_t lock = xSemaphoreCreateMutex();
+  xSemaphoreTake(lock, portMAX_DELAY);
+  int n = 0, w = 0, h = 0;
+  int step = face_dl_init() ? face_dl_fill(fb, &w, &h) : 0;
+  if (step) {
+    std::list<dl::detect::result_t> &candidates = face_dl_s1->infer(face_dl_input, {h, w, 3});
+    std::list<dl::detect::result_t> &results = face_dl_s2->infer(face_dl_input, {h, w, 3}, candidates);
+    for (const dl::detect::result_t &r : results) {
+      if (n >= max_boxes) {
+        break;
+      }
+      int x0 = r.box[0] < 0 ? 0 : r.box[0], y0 = r.box[1] < 0 ? 0 : r.box[1];
+      int x1 = r.box[2] > w ? w : r.box[2], y1 = r.box[3] > h ? h : r.box[3];
+      if (x1 <= x0 || y1 <= y0) {
+        continue;
+      }
+      boxes[n++] = {x0 * step, y0 * step, (x1 - x0) * step, (y1 - y0) * step, (int)(r.score * 100), 0};
+    }
+  }
+  xSemaphoreGive(lock);
+  return n;
+}
+#endif
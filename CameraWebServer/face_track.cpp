@@ -0,0 +1,281 @@
+#include "face_track.h"
+#include "esp_timer.h"
+#include <string.h>
+
+#define FP(v)   ((v) << FACE_TRACK_FP)
+#define UNFP(v) ((v) >> FACE_TRACK_FP)
+
+static inline int iabs(int v) {
+  return v < 0 ? -v : v;
+}
+
+// Percent overlap of a track (fixed point) and a detection (pixels)
+static int iou(const face_track_t *tr, const face_box_t *b) {
+  int x0 = UNFP(tr->x), y0 = UNFP(tr->y), w0 = UNFP(tr->w), h0 = UNFP(tr->h);
+  int ix = (x0 + w0 < b->x + b->w ? x0 + w0 : b->x + b->w) - (x0 > b->x ? x0 : b->x);
+  int iy = (y0 + h0 < b->y + b->h ? y0 + h0 : b->y + b->h) - (y0 > b->y ? y0 : b->y);
+  if (ix <= 0 || iy <= 0) {
+    return 0;
+  }
+  int inter = ix * iy;
+  int uni = w0 * h0 + b->w * b->h - inter;
+  return uni > 0 ? inter * 100 / uni : 0;
+}
+
+static bool track_stable(const face_tracker_t *t, const face_track_t *tr) {
+  int still = tr->w / FACE_TRACK_STILL;
+  return tr->hits >= t->stable_hits && iabs(tr->vx) <= still && iabs(tr->vy) <= still;
+}
+
+static void track_start(face_tracker_t *t, const face_box_t *b, uint32_t frame) {
+  for (int i = 0; i < FACE_TRACK_MAX; i++) {
+    face_track_t *tr = &t->tracks[i];
+    if (!tr->active) {
+      memset(tr, 0, sizeof(*tr));
+      tr->id = t->next_id++;
+      tr->x = tr->det_x = FP(b->x);
+      tr->y = tr->det_y = FP(b->y);
+      tr->w = FP(b->w);
+      tr->h = FP(b->h);
+      tr->det_frame = frame;
+      tr->score = b->score;
+      tr->hits = 1;
+      tr->active = true;
+      return;
+    }
+  }
+}
+
+static void track_match(face_track_t *tr, const face_box_t *b, uint32_t frame) {
+  int frames = frame - tr->det_frame;
+  if (frames > 0) {
+    // Velocity from detection to detection, smoothed by half
+    tr->vx += ((FP(b->x) - tr->det_x) / frames - tr->vx) / 2;
+    tr->vy += ((FP(b->y) - tr->det_y) / frames - tr->vy) / 2;
+  }
+  tr->x = tr->det_x = FP(b->x);
+  tr->y = tr->det_y = FP(b->y);
+  tr->w = FP(b->w);
+  tr->h = FP(b->h);
+  tr->det_frame = frame;
+  tr->score = b->score;
+  tr->hits++;
+  tr->misses = 0;
+}
+
+// Detections found on tracker frame `frame`. Returns whether every track
+// was found again and is stable.
+static bool tracker_update(face_tracker_t *t, const face_box_t *boxes, int n, uint32_t frame) {
+  bool matched[FACE_TRACK_MAX] = {};
+  bool steady = true;
+  for (int d = 0; d < n; d++) {
+    int best = -1, best_iou = FACE_TRACK_IOU - 1;
+    for (int i = 0; i < FACE_TRACK_MAX; i++) {
+      int o = t->tracks[i].active && !matched[i] ? iou(&t->tracks[i], &boxes[d]) : 0;
+      if (o > best_iou) {
+        best = i;
+        best_iou = o;
+      }
+    }
+    if (best < 0) {
+      track_start(t, &boxes[d], frame);
+      steady = false;
+    } else {
+      track_match(&t->tracks[best], &boxes[d], frame);
+      matched[best] = true;
+      steady = steady && track_stable(t, &t->tracks[best]);
+    }
+  }
+  for (int i = 0; i < FACE_TRACK_MAX; i++) {
+    face_track_t *tr = &t->tracks[i];
+    if (tr->active && !matched[i] && tr->det_frame != frame) {
+      steady = false;
+      tr->hits = 0;
+      tr->active = ++tr->misses <= FACE_TRACK_MISSES;
+    }
+  }
+  return steady;
+}
+
+static void tracker_predict(face_tracker_t *t, const camera_fb_t *fb) {
+  for (int i = 0; i < FACE_TRACK_MAX; i++) {
+    face_track_t *tr = &t->tracks[i];
+    if (!tr->active) {
+      continue;
+    }
+    tr->x += tr->vx;
+    tr->y += tr->vy;
+    // Moved out of the frame: nothing left to follow until the next detection
+    if (tr->x + tr->w <= 0 || tr->y + tr->h <= 0 || UNFP(tr->x) >= (int)fb->width || UNFP(tr->y) >= (int)fb->height) {
+      tr->active = false;
+    }
+  }
+}
+
+void face_tracker_init(face_tracker_t *t) {
+  memset(t, 0, sizeof(*t));
+  t->min_interval = 1;
+  t->max_interval = 8;
+  t->stable_hits = 3;
+  t->next_id = 1;
+  t->interval = 1;
+}
+
+// Counts a frame; tracks left over from before a gap are dropped
+static void tracker_frame(face_tracker_t *t) {
+  int64_t now = esp_timer_get_time();
+  if (t->last_us && now - t->last_us > (int64_t)FACE_TRACK_GAP_MS * 1000) {
+    for (int i = 0; i < FACE_TRACK_MAX; i++) {
+      t->tracks[i].active = false;
+    }
+    t->interval = t->min_interval;
+    t->last_detect = 0;
+  }
+  t->last_us = now;
+  t->frame++;
+}
+
+static bool tracker_due(const face_tracker_t *t) {
+  return !t->last_detect || (int)(t->frame - t->last_detect) >= t->interval;
+}
+
+// Merges a detection taken on `frame`; tracks it placed are carried
+// forward to the current frame
+static void tracker_detected(face_tracker_t *t, const face_box_t *found, int n, uint32_t frame) {
+  bool steady = tracker_update(t, found, n < 0 ? 0 : n, frame);
+  bool any = false;
+  int lag = t->frame - frame;
+  for (int i = 0; i < FACE_TRACK_MAX; i++) {
+    face_track_t *tr = &t->tracks[i];
+    any = any || tr->active;
+    if (tr->active && lag > 0 && tr->det_frame == frame) {
+      tr->x += tr->vx * lag;
+      tr->y += tr->vy * lag;
+    }
+  }
+  int next = t->interval * 2 > t->max_interval ? t->max_interval : t->interval * 2;
+  t->interval = steady && any ? next : t->min_interval;
+  t->detections++;
+}
+
+static int tracker_boxes(const face_tracker_t *t, const camera_fb_t *fb, face_box_t *boxes, int max_boxes) {
+  int n = 0;
+  for (int i = 0; i < FACE_TRACK_MAX && n < max_boxes; i++) {
+    const face_track_t *tr = &t->tracks[i];
+    // Tracks that just missed a detection are kept but not reported
+    if (!tr->active || tr->misses) {
+      continue;
+    }
+    int x = UNFP(tr->x), y = UNFP(tr->y), bw = UNFP(tr->w), bh = UNFP(tr->h);
+    int x1 = x + bw > (int)fb->width ? fb->width : x + bw;
+    int y1 = y + bh > (int)fb->height ? fb->height : y + bh;
+    x = x < 0 ? 0 : x;
+    y = y < 0 ? 0 : y;
+    boxes[n] = {x, y, x1 - x, y1 - y, tr->score, tr->id};
+    n++;
+  }
+  return n;
+}
+
+int face_track(face_tracker_t *t, face_work_t *w, const camera_fb_t *fb, face_box_t *boxes, int max_boxes) {
+  if (!detect_faces) {
+    return -1;
+  }
+  tracker_frame(t);
+  if (tracker_due(t)) {
+    face_box_t found[FACE_TRACK_MAX];
+    int n = face_detect_scaled(w, fb, found, FACE_TRACK_MAX);
+    tracker_detected(t, found, n, t->frame);
+    t->last_detect = t->frame;
+  } else {
+    tracker_predict(t, fb);
+    t->predictions++;
+  }
+  return tracker_boxes(t, fb, boxes, max_boxes);
+}
+
+static void face_async_task(void *arg) {
+  face_async_t *a = (face_async_t *)arg;
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    while (true) {
+      portENTER_CRITICAL(&a->mux);
+      int i = a->running = a->pending;
+      a->pending = -1;
+      portEXIT_CRITICAL(&a->mux);
+      if (i < 0) {
+        break;
+      }
+      face_box_t found[FACE_TRACK_MAX];
+      int64_t t0 = esp_timer_get_time();
+      int n = face_work_detect(&a->work[i], a->width[i], a->height[i], found, FACE_TRACK_MAX);
+      uint32_t us = (uint32_t)(esp_timer_get_time() - t0);
+      portENTER_CRITICAL(&a->mux);
+      // An unmerged older result is simply replaced
+      memcpy(a->found, found, sizeof(found));
+      a->found_n = n;
+      a->found_frame = a->frame[i];
+      a->done = true;
+      a->running = -1;
+      a->infer_us = us;
+      a->infer_avg_us = a->runs ? a->infer_avg_us + ((int32_t)us - (int32_t)a->infer_avg_us) / 8 : us;
+      a->infer_max_us = us > a->infer_max_us ? us : a->infer_max_us;
+      a->runs++;
+      portEXIT_CRITICAL(&a->mux);
+    }
+  }
+}
+
+bool face_async_start(face_async_t *a, BaseType_t core, UBaseType_t priority, uint32_t stack) {
+  if (!detect_faces) {
+    return false;
+  }
+  portMUX_INITIALIZE(&a->mux);
+  a->pending = -1;
+  a->running = -1;
+  return xTaskCreatePinnedToCore(face_async_task, "face_det", stack, a, priority, &a->task, core) == pdPASS;
+}
+
+int face_track_async(face_tracker_t *t, face_async_t *a, const camera_fb_t *fb, face_box_t *boxes, int max_boxes) {
+  if (!detect_faces) {
+    return -1;
+  }
+  tracker_frame(t);
+  face_box_t found[FACE_TRACK_MAX];
+  int n = 0;
+  uint32_t frame = 0;
+  portENTER_CRITICAL(&a->mux);
+  bool done = a->done;
+  if (done) {
+    memcpy(found, a->found, sizeof(found));
+    n = a->found_n;
+    frame = a->found_frame;
+    a->done = false;
+  }
+  // The image not being detected, unless it already waits its turn
+  int spare = a->pending < 0 ? (a->running == 0 ? 1 : 0) : -1;
+  portEXIT_CRITICAL(&a->mux);
+
+  if (done) {
+    tracker_detected(t, found, n, frame);
+  } else {
+    tracker_predict(t, fb);
+    t->predictions++;
+  }
+  if (tracker_due(t)) {
+    if (spare < 0) {
+      a->waited++;
+    } else if (face_work_fill(&a->work[spare], fb)) {
+      // The detector never touches this image until it is pending
+      a->width[spare] = fb->width;
+      a->height[spare] = fb->height;
+      a->frame[spare] = t->frame;
+      t->last_detect = t->frame;
+      portENTER_CRITICAL(&a->mux);
+      a->pending = spare;
+      portEXIT_CRITICAL(&a->mux);
+      xTaskNotifyGive(a->task);
+    }
+  }
+  return tracker_boxes(t, fb, boxes, max_boxes);
+}
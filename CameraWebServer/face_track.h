@@ -0,0 +1,106 @@
+#ifndef FACE_TRACK_H
+#define FACE_TRACK_H
+
+#include "face_detect.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+//
+// Detect-every-N face tracking.
+//
+// Full detections run on one frame in `interval`; in between every track
+// is moved by its constant-velocity estimate. A detection continues the
+// track it overlaps best (IoU of at least FACE_TRACK_IOU percent) and
+// keeps its id, otherwise it starts a new one; a track that misses more
+// than FACE_TRACK_MISSES detections in a row is dropped.
+//
+// The interval starts at min_interval and doubles after each detection in
+// which every track was found again, has been seen stable_hits times and
+// moves less than 1/FACE_TRACK_STILL of its width per frame, up to
+// max_interval. Anything else (a new face, a lost one, a fast one) sends
+// it straight back to min_interval. Faces at a door move slowly, so a
+// visitor standing there is detected every 8 frames instead of every one.
+//
+// Positions and velocities are in 1/2^FACE_TRACK_FP pixels.
+//
+#define FACE_TRACK_MAX    4
+#define FACE_TRACK_IOU    30
+#define FACE_TRACK_MISSES 1
+#define FACE_TRACK_STILL  32
+#define FACE_TRACK_GAP_MS 1000  // Longer without frames: tracks are stale, start over
+#define FACE_TRACK_FP     4
+
+typedef struct {
+  int id;  // > 0, given out in order
+  int x, y, w, h;
+  int vx, vy;         // Per frame
+  int det_x, det_y;   // At the last detection that matched
+  uint32_t det_frame;
+  int score;
+  int hits;    // Detections matched in a row
+  int misses;  // Detections missed in a row
+  bool active;
+} face_track_t;
+
+typedef struct {
+  // Settings, may be changed at any time
+  int min_interval;  // Frames per detection while something changes
+  int max_interval;  // ... while every track is stable
+  int stable_hits;
+  // State
+  face_track_t tracks[FACE_TRACK_MAX];
+  int next_id;
+  int interval;
+  uint32_t frame;
+  uint32_t last_detect;
+  int64_t last_us;  // esp_timer time of the last frame
+  uint32_t detections;
+  uint32_t predictions;
+} face_tracker_t;
+
+void face_tracker_init(face_tracker_t *t);
+// Boxes for fb with their track ids: a full detection (through w) when one
+// is due, the predicted tracks otherwise; -1 when detect_faces is not linked
+int face_track(face_tracker_t *t, face_work_t *w, const camera_fb_t *fb, face_box_t *boxes, int max_boxes);
+
+//
+// Detection on its own task.
+//
+// face_track_async returns the same boxes as face_track without waiting
+// for inference. A due detection only reduces fb into one of two working
+// images on the caller's task and wakes the detector task; the call
+// returns the predicted boxes at once. The first call after the detector
+// finishes merges what it found: velocities are measured from the frame
+// the image came from, positions carried forward to the current one.
+// While the detector is busy, the second image holds the next due frame,
+// so it starts again without waiting for a capture. The caller keeps its
+// frame rate, and detection runs as often as inference allows (the
+// interval still applies on top).
+//
+typedef struct {
+  face_work_t work[2];
+  int width[2], height[2];  // Frame each working image was filled from
+  uint32_t frame[2];        // ... and its tracker frame
+  int pending;              // Filled, waiting for the detector; -1 none
+  int running;              // Being detected; -1 none
+  bool done;                // found holds a result not merged yet
+  face_box_t found[FACE_TRACK_MAX];
+  int found_n;
+  uint32_t found_frame;
+  TaskHandle_t task;
+  portMUX_TYPE mux;
+  // Statistics
+  uint32_t infer_us;      // Last detect_faces
+  uint32_t infer_avg_us;  // Moving average over 8
+  uint32_t infer_max_us;
+  uint32_t runs;
+  uint32_t waited;  // Due detections held back with both images in use
+} face_async_t;
+
+// Starts the detector task pinned to core; false when detect_faces is not
+// linked or the task cannot be created. Zero-initialise a before.
+bool face_async_start(face_async_t *a, BaseType_t core, UBaseType_t priority, uint32_t stack);
+// face_track with detection on a's task; -1 when detect_faces is not linked
+int face_track_async(face_tracker_t *t, face_async_t *a, const camera_fb_t *fb, face_box_t *boxes, int max_boxes);
+
+#endif  // FACE_TRACK_H
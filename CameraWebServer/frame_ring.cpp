@@ -0,0 +1,143 @@
+#include "frame_ring.h"
+#include "esp_heap_caps.h"
+#include <stdlib.h>
+#include <string.h>
+
+static inline frame_slot_t *slot_at(frame_ring_t *r, uint32_t n) {
+  return &r->slots[n % FRAME_RING_SLOTS];
+}
+
+static inline frame_slot_t *ring_oldest(frame_ring_t *r) {
+  return slot_at(r, r->head - r->count);
+}
+
+static void ring_drop_oldest(frame_ring_t *r) {
+  ring_oldest(r)->seq = 0;
+  r->count--;
+}
+
+// Caller holds the lock
+static frame_slot_t *ring_find(frame_ring_t *r, uint32_t seq) {
+  for (uint32_t i = 0; i < r->count; i++) {
+    frame_slot_t *s = slot_at(r, r->head - 1 - i);
+    if (s->seq == seq) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+bool frame_ring_init(frame_ring_t *r, size_t bytes) {
+  memset(r, 0, sizeof(*r));
+  if (heap_caps_get_free_size(MALLOC_CAP_SPIRAM) < bytes) {
+    return false;
+  }
+  r->buf = (uint8_t *)heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM);
+  r->lock = r->buf ? xSemaphoreCreateMutex() : NULL;
+  if (!r->lock) {
+    free(r->buf);
+    r->buf = NULL;
+    return false;
+  }
+  r->size = bytes;
+  return true;
+}
+
+bool frame_ring_push(frame_ring_t *r, const uint8_t *buf, size_t len, const frame_slot_t *meta) {
+  if (!r->buf) {
+    return false;
+  }
+  xSemaphoreTake(r->lock, portMAX_DELAY);
+  if (len > r->size) {
+    r->too_big++;
+    xSemaphoreGive(r->lock);
+    return false;
+  }
+  if (r->wr + len > r->size) {
+    // Frames past the write point are the previous lap's, the oldest of all
+    while (r->count && ring_oldest(r)->off >= r->wr) {
+      ring_drop_oldest(r);
+    }
+    r->wr = 0;
+  }
+  while (r->count && (r->count == FRAME_RING_SLOTS || (ring_oldest(r)->off < r->wr + len && r->wr < ring_oldest(r)->off + ring_oldest(r)->len))) {
+    ring_drop_oldest(r);
+  }
+  memcpy(r->buf + r->wr, buf, len);
+  frame_slot_t *s = slot_at(r, r->head);
+  *s = *meta;
+  s->off = r->wr;
+  s->len = len;
+  r->head++;
+  r->count++;
+  r->wr += len;
+  r->stored++;
+  xSemaphoreGive(r->lock);
+  return true;
+}
+
+uint32_t frame_ring_nearest(frame_ring_t *r, int64_t ts) {
+  if (!r->buf) {
+    return 0;
+  }
+  uint32_t seq = 0;
+  int64_t best = INT64_MAX;
+  xSemaphoreTake(r->lock, portMAX_DELAY);
+  for (uint32_t i = 0; i < r->count; i++) {
+    const frame_slot_t *s = slot_at(r, r->head - 1 - i);
+    int64_t d = s->ts > ts ? s->ts - ts : ts - s->ts;
+    if (d < best) {
+      best = d;
+      seq = s->seq;
+    }
+  }
+  xSemaphoreGive(r->lock);
+  return seq;
+}
+
+int frame_ring_list(frame_ring_t *r, int64_t from, int64_t to, uint32_t *seqs, int max) {
+  if (!r->buf) {
+    return 0;
+  }
+  int n = 0;
+  xSemaphoreTake(r->lock, portMAX_DELAY);
+  for (uint32_t i = 0; i < r->count && n < max; i++) {
+    const frame_slot_t *s = slot_at(r, r->head - r->count + i);
+    if (s->ts >= from && s->ts <= to) {
+      seqs[n++] = s->seq;
+    }
+  }
+  xSemaphoreGive(r->lock);
+  return n;
+}
+
+bool frame_ring_info(frame_ring_t *r, uint32_t seq, frame_slot_t *info) {
+  if (!r->buf || !seq) {
+    return false;
+  }
+  xSemaphoreTake(r->lock, portMAX_DELAY);
+  const frame_slot_t *s = ring_find(r, seq);
+  if (s) {
+    *info = *s;
+  }
+  xSemaphoreGive(r->lock);
+  return s != NULL;
+}
+
+uint8_t *frame_ring_get(frame_ring_t *r, uint32_t seq, frame_slot_t *info) {
+  if (!r->buf || !seq) {
+    return NULL;
+  }
+  uint8_t *copy = NULL;
+  xSemaphoreTake(r->lock, portMAX_DELAY);
+  const frame_slot_t *s = ring_find(r, seq);
+  if (s) {
+    copy = (uint8_t *)heap_caps_malloc(s->len, MALLOC_CAP_SPIRAM);
+    if (copy) {
+      memcpy(copy, r->buf + s->off, s->len);
+      *info = *s;
+    }
+  }
+  xSemaphoreGive(r->lock);
+  return copy;
+}
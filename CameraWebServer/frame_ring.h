@@ -0,0 +1,66 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+//
+// Pre-event ring of recent JPEG frames in PSRAM.
+//
+// The stream capture task pushes every frame it publishes, so the frame
+// from the instant of a card tap is still there when the server asks for
+// it a few hundred milliseconds later, instead of a new capture (plus the
+// flash settle) taken after the student has moved on. A still scene
+// publishes almost nothing (motion.h), so the ring then reaches further
+// back.
+//
+// The JPEGs are packed one after another into one arena; a frame that does
+// not fit before the end starts over at 0, and whatever it overlaps, always
+// the oldest frames, is dropped. At most FRAME_RING_SLOTS frames are kept.
+// Frames are keyed by the stream seq (X-Seq) and stamped with the capture
+// time in esp_timer microseconds (X-Timestamp).
+//
+#define FRAME_RING_SLOTS 32
+#define FRAME_RING_BYTES (1024 * 1024)
+
+typedef struct {
+  uint32_t seq;  // 0: empty
+  int64_t ts;    // Capture time, esp_timer us
+  int motion;    // X-Motion of the frame
+  int sharpness;  // X-Sharpness
+  int luma;       // X-Luma
+  uint16_t width, height;
+  size_t off;
+  size_t len;
+} frame_slot_t;
+
+typedef struct {
+  uint8_t *buf;  // NULL: no PSRAM, the ring is off
+  size_t size;
+  frame_slot_t slots[FRAME_RING_SLOTS];
+  uint32_t head;   // Slots ever written; the newest is slots[(head - 1) % SLOTS]
+  uint32_t count;  // Frames held
+  size_t wr;       // Arena offset of the next frame
+  SemaphoreHandle_t lock;
+  uint32_t stored;
+  uint32_t too_big;  // Frames larger than the arena
+} frame_ring_t;
+
+// Allocates the arena in PSRAM; false (and the ring stays off) without it
+bool frame_ring_init(frame_ring_t *r, size_t bytes);
+// Copies one JPEG in, dropping the oldest frames to make room; meta is
+// everything of the slot but off and len
+bool frame_ring_push(frame_ring_t *r, const uint8_t *buf, size_t len, const frame_slot_t *meta);
+// seq of the frame captured closest to ts; 0 when the ring is empty
+uint32_t frame_ring_nearest(frame_ring_t *r, int64_t ts);
+// seqs of the frames captured in [from, to], oldest first; the count
+int frame_ring_list(frame_ring_t *r, int64_t from, int64_t to, uint32_t *seqs, int max);
+// The slot of frame seq without copying the JPEG; false when it is gone
+bool frame_ring_info(frame_ring_t *r, uint32_t seq, frame_slot_t *info);
+// A PSRAM copy of frame seq for the caller to free(); NULL when it has been
+// overwritten meanwhile (or out of memory)
+uint8_t *frame_ring_get(frame_ring_t *r, uint32_t seq, frame_slot_t *info);
+
+#endif  // FRAME_RING_H
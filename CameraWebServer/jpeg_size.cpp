@@ -0,0 +1,192 @@
+#include <string.h>
+#include "nvs.h"
+#include "jpeg_size.h"
+
+#define JPEG_SIZE_NAMESPACE "jpegsize"
+#define JPEG_SIZE_KEY       "need"
+
+size_t jpeg_size_capacity(framesize_t size) {
+  return (size_t)resolution[size].width * resolution[size].height / 5;
+}
+
+framesize_t jpeg_size_buffer(size_t need, framesize_t max_size) {
+  // Frame sizes are not sorted by area in the enum: take the smallest buffer that fits
+  framesize_t best = max_size;
+  for (int i = 0; i <= (int)max_size; i++) {
+    size_t cap = jpeg_size_capacity((framesize_t)i);
+    if (cap >= need && cap < jpeg_size_capacity(best)) {
+      best = (framesize_t)i;
+    }
+  }
+  return best;
+}
+
+// Bin 0 holds everything up to JPEG_SIZE_MIN; above, four bins per doubling
+static int bin_of(size_t bytes) {
+  if (bytes < JPEG_SIZE_MIN) {
+    return 0;
+  }
+  uint32_t v = bytes / JPEG_SIZE_MIN;
+  int e = 31 - __builtin_clz(v);
+  int quarter = (bytes * 4 / ((size_t)JPEG_SIZE_MIN << e)) - 4;
+  int bin = 1 + e * 4 + quarter;
+  return bin < JPEG_SIZE_BINS ? bin : JPEG_SIZE_BINS - 1;
+}
+
+static size_t bin_top(int bin) {
+  if (bin == 0) {
+    return JPEG_SIZE_MIN;
+  }
+  int e = (bin - 1) / 4;
+  return ((size_t)JPEG_SIZE_MIN << e) * (5 + (bin - 1) % 4) / 4;
+}
+
+static framesize_t framesize_of(const camera_fb_t *fb) {
+  for (int i = 0; i < FRAMESIZE_INVALID; i++) {
+    if (resolution[i].width == fb->width && resolution[i].height == fb->height) {
+      return (framesize_t)i;
+    }
+  }
+  return FRAMESIZE_INVALID;
+}
+
+// The driver trims after the last EOI it finds; a few bytes of padding may remain
+static bool has_eoi(const camera_fb_t *fb) {
+  size_t n = fb->len < 16 ? fb->len : 16;
+  for (size_t i = fb->len - n; i + 1 < fb->len; i++) {
+    if (fb->buf[i] == 0xFF && fb->buf[i + 1] == 0xD9) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static const jpeg_size_slot_t *find(const jpeg_size_t *js, framesize_t size, int quality) {
+  for (int i = 0; i < JPEG_SIZE_SLOTS; i++) {
+    const jpeg_size_slot_t *sl = &js->slot[i];
+    if (sl->total && sl->framesize == size && sl->quality == quality) {
+      return sl;
+    }
+  }
+  return NULL;
+}
+
+void jpeg_size_init(jpeg_size_t *js, size_t capacity, size_t saved) {
+  memset(js, 0, sizeof(*js));
+  js->capacity = capacity;
+  js->saved = saved;
+}
+
+bool jpeg_size_frame(jpeg_size_t *js, const camera_fb_t *fb, int quality) {
+  if (fb->format != PIXFORMAT_JPEG) {
+    return true;
+  }
+  js->frames++;
+  bool truncated = (js->capacity && fb->len >= js->capacity) || !has_eoi(fb);
+  size_t bytes = fb->len;
+  if (truncated) {
+    js->truncated++;
+    // The real size is unknown, but not below what was filled
+    bytes = js->capacity > bytes ? js->capacity : bytes;
+  }
+  framesize_t size = framesize_of(fb);
+  if (size == FRAMESIZE_INVALID) {
+    return !truncated;
+  }
+  jpeg_size_slot_t *sl = (jpeg_size_slot_t *)find(js, size, quality);
+  if (!sl) {
+    // Free slot, otherwise the one seen least recently
+    sl = &js->slot[0];
+    for (int i = 0; i < JPEG_SIZE_SLOTS && sl->total; i++) {
+      if (!js->slot[i].total || js->slot[i].used < sl->used) {
+        sl = &js->slot[i];
+      }
+    }
+    memset(sl, 0, sizeof(*sl));
+    sl->framesize = size;
+    sl->quality = quality;
+  }
+  if (sl->total >= JPEG_SIZE_DECAY) {
+    sl->total = 0;
+    for (int i = 0; i < JPEG_SIZE_BINS; i++) {
+      sl->bins[i] >>= 1;
+      sl->total += sl->bins[i];
+    }
+  }
+  sl->bins[bin_of(bytes)]++;
+  sl->total++;
+  sl->largest = bytes > sl->largest ? bytes : sl->largest;
+  sl->used = ++js->clock;
+  return !truncated;
+}
+
+static size_t percentile(const jpeg_size_slot_t *sl) {
+  uint32_t want = ((uint32_t)sl->total * JPEG_SIZE_PCT + 99) / 100;
+  uint32_t seen = 0;
+  for (int i = 0; i < JPEG_SIZE_BINS; i++) {
+    seen += sl->bins[i];
+    if (seen >= want) {
+      return bin_top(i);
+    }
+  }
+  return bin_top(JPEG_SIZE_BINS - 1);
+}
+
+size_t jpeg_size_predict(const jpeg_size_t *js, framesize_t size, int quality) {
+  const jpeg_size_slot_t *sl = find(js, size, quality);
+  return sl && sl->total >= JPEG_SIZE_MIN_SAMPLES ? percentile(sl) : 0;
+}
+
+size_t jpeg_size_need(const jpeg_size_t *js) {
+  size_t need = 0;
+  for (int i = 0; i < JPEG_SIZE_SLOTS; i++) {
+    const jpeg_size_slot_t *sl = &js->slot[i];
+    if (sl->total >= JPEG_SIZE_MIN_SAMPLES) {
+      size_t p = percentile(sl);
+      need = p > need ? p : need;
+    }
+  }
+  // Rounded up to 4 KB so small wobbles do not rewrite NVS
+  need = need * (100 + JPEG_SIZE_MARGIN_PCT) / 100;
+  return (need + 4095) & ~(size_t)4095;
+}
+
+esp_err_t jpeg_size_load(size_t *need) {
+  nvs_handle_t nvs;
+  *need = 0;
+  esp_err_t err = nvs_open(JPEG_SIZE_NAMESPACE, NVS_READONLY, &nvs);
+  if (err != ESP_OK) {
+    return err;
+  }
+  uint32_t v = 0;
+  err = nvs_get_u32(nvs, JPEG_SIZE_KEY, &v);
+  nvs_close(nvs);
+  if (err == ESP_OK) {
+    *need = v;
+  }
+  return err;
+}
+
+bool jpeg_size_persist(jpeg_size_t *js) {
+  if (js->frames % JPEG_SIZE_SAVE_FRAMES) {
+    return false;
+  }
+  size_t need = jpeg_size_need(js);
+  size_t diff = need > js->saved ? need - js->saved : js->saved - need;
+  if (!need || (js->saved && diff * 100 <= js->saved * JPEG_SIZE_SAVE_PCT)) {
+    return false;
+  }
+  nvs_handle_t nvs;
+  if (nvs_open(JPEG_SIZE_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+    return false;
+  }
+  esp_err_t err = nvs_set_u32(nvs, JPEG_SIZE_KEY, need);
+  if (err == ESP_OK) {
+    err = nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+  if (err == ESP_OK) {
+    js->saved = need;
+  }
+  return err == ESP_OK;
+}
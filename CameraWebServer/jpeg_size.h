@@ -0,0 +1,71 @@
+#ifndef JPEG_SIZE_H
+#define JPEG_SIZE_H
+
+#include "esp_camera.h"
+
+//
+// JPEG size statistics and the frame buffer size they call for.
+//
+// In JPEG mode the camera driver gives every frame buffer width*height/5
+// bytes of the frame size passed to esp_camera_init, whatever the quality.
+// A busy scene at a sharp quality can need more; the driver then hands out
+// a frame cut at the buffer end. Initialising at a larger frame size than
+// is captured was the usual fix, at the price of RAM on every board.
+//
+// Instead every frame's size is counted in a histogram per frame size and
+// JPEG quality (quarter-octave bins, halved every JPEG_SIZE_DECAY frames
+// so old scenes fade out). jpeg_size_need turns their JPEG_SIZE_PCT
+// percentile plus JPEG_SIZE_MARGIN_PCT into the bytes the buffers should
+// hold. It is kept in NVS: the next esp_camera_init takes the smallest
+// frame size whose buffers hold that many bytes (jpeg_size_buffer) and the
+// capture size is set right after.
+//
+// A frame that fills its buffer or lacks the JPEG end marker is counted as
+// truncated and must not be sent; it enters the histogram at the buffer
+// size, so the need rises above what was allocated.
+//
+#define JPEG_SIZE_SLOTS       8      // Frame size / quality pairs tracked, least recently seen replaced
+#define JPEG_SIZE_BINS        40
+#define JPEG_SIZE_MIN         2048   // Upper edge of bin 0
+#define JPEG_SIZE_DECAY       2048   // Frames per pair before its counts are halved
+#define JPEG_SIZE_MIN_SAMPLES 64     // Frames per pair before its percentile counts
+#define JPEG_SIZE_PCT         99
+#define JPEG_SIZE_MARGIN_PCT  25
+#define JPEG_SIZE_SAVE_FRAMES 1024   // Need compared with NVS this often
+#define JPEG_SIZE_SAVE_PCT    12     // Written when it moved by more than this
+
+typedef struct {
+  uint8_t framesize;
+  uint8_t quality;
+  uint16_t total;
+  uint16_t bins[JPEG_SIZE_BINS];
+  uint32_t largest;   // Largest frame since the slot was taken
+  uint32_t used;      // Clock of the last frame
+} jpeg_size_slot_t;
+
+typedef struct {
+  jpeg_size_slot_t slot[JPEG_SIZE_SLOTS];
+  uint32_t clock;
+  size_t capacity;             // Bytes of one frame buffer
+  size_t saved;                // Need stored in NVS, 0: none
+  uint32_t frames;
+  volatile uint32_t truncated;
+} jpeg_size_t;
+
+// Bytes the driver gives a JPEG frame buffer when initialised at size
+size_t jpeg_size_capacity(framesize_t size);
+// Smallest frame size up to max_size whose buffers hold need bytes; max_size if none does
+framesize_t jpeg_size_buffer(size_t need, framesize_t max_size);
+// saved: the need read with jpeg_size_load, 0 if none
+void jpeg_size_init(jpeg_size_t *js, size_t capacity, size_t saved);
+// Counts one frame taken at quality; false when it was truncated
+bool jpeg_size_frame(jpeg_size_t *js, const camera_fb_t *fb, int quality);
+// JPEG_SIZE_PCT percentile of one pair in bytes, 0 before JPEG_SIZE_MIN_SAMPLES frames
+size_t jpeg_size_predict(const jpeg_size_t *js, framesize_t size, int quality);
+// Buffer bytes covering every pair seen, margin included; 0 before any has enough frames
+size_t jpeg_size_need(const jpeg_size_t *js);
+esp_err_t jpeg_size_load(size_t *need);
+// Every JPEG_SIZE_SAVE_FRAMES frames: stores the need when it moved; true when written
+bool jpeg_size_persist(jpeg_size_t *js);
+
+#endif  // JPEG_SIZE_H
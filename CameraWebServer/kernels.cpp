@@ -0,0 +1,200 @@
+#include "kernels.h"
+#include "esp_idf_version.h"
+#include <stdlib.h>
+#include <string.h>
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include "esp_cpu.h"
+#define kernels_cycles() esp_cpu_get_cycle_count()
+#else
+#include "xtensa/core-macros.h"
+#define kernels_cycles() xthal_get_ccount()
+#endif
+
+static inline bool aligned4(const void *p) {
+  return ((uintptr_t)p & 3) == 0;
+}
+
+// Bytes 0 and 2 of a and of b, in that order
+static inline uint32_t pack_even(uint32_t a, uint32_t b) {
+  return (a & 0xFF) | (a >> 8 & 0xFF00) | (b & 0xFF) << 16 | (b << 8 & 0xFF000000);
+}
+
+void kernel_yuv422_gray_scalar(const uint8_t *src, uint8_t *dst, size_t pixels) {
+  for (size_t i = 0; i < pixels; i++) {
+    dst[i] = src[i * 2];
+  }
+}
+
+void kernel_yuv422_gray(const uint8_t *src, uint8_t *dst, size_t pixels) {
+#if KERNELS_SWAR
+  if (aligned4(src) && aligned4(dst)) {
+    const uint32_t *s = (const uint32_t *)src;
+    uint32_t *d = (uint32_t *)dst;
+    size_t words = pixels / 4;
+    for (size_t i = 0; i < words; i++, s += 2) {
+      // Y0 U Y1 V | Y2 U Y3 V -> Y0 Y1 Y2 Y3
+      d[i] = pack_even(s[0], s[1]);
+    }
+    kernel_yuv422_gray_scalar(src + words * 8, dst + words * 4, pixels - words * 4);
+    return;
+  }
+#endif
+  kernel_yuv422_gray_scalar(src, dst, pixels);
+}
+
+void kernel_rgb565_gray_scalar(const uint8_t *src, uint8_t *dst, size_t pixels) {
+  for (size_t i = 0; i < pixels; i++) {
+    uint16_t px = src[i * 2] << 8 | src[i * 2 + 1];
+    int r = (px >> 8) & 0xF8, g = (px >> 3) & 0xFC, b = (px << 3) & 0xF8;
+    // BT.601, weights sum to 256
+    dst[i] = (77 * r + 150 * g + 29 * b) >> 8;
+  }
+}
+
+// Luma is linear in R, G and B, so it splits into a part from each byte:
+// the high one holds R and the top of G, the low one the rest of G and B
+static uint16_t rgb565_hi[256];
+static uint16_t rgb565_lo[256];
+static bool rgb565_ready = false;
+
+void kernel_rgb565_gray(const uint8_t *src, uint8_t *dst, size_t pixels) {
+#if KERNELS_SWAR
+  if (!rgb565_ready) {
+    for (int v = 0; v < 256; v++) {
+      rgb565_hi[v] = 77 * (v & 0xF8) + 150 * ((v & 0x07) << 5);
+      rgb565_lo[v] = 150 * ((v >> 5) << 2) + 29 * ((v & 0x1F) << 3);
+    }
+    rgb565_ready = true;
+  }
+  if (aligned4(src) && aligned4(dst)) {
+    const uint32_t *s = (const uint32_t *)src;
+    uint32_t *d = (uint32_t *)dst;
+    size_t words = pixels / 4;
+    for (size_t i = 0; i < words; i++, s += 2) {
+      uint32_t a = s[0], b = s[1];
+      d[i] = ((rgb565_hi[a & 0xFF] + rgb565_lo[a >> 8 & 0xFF]) >> 8) | ((rgb565_hi[a >> 16 & 0xFF] + rgb565_lo[a >> 24]) >> 8) << 8
+             | ((rgb565_hi[b & 0xFF] + rgb565_lo[b >> 8 & 0xFF]) >> 8) << 16 | ((rgb565_hi[b >> 16 & 0xFF] + rgb565_lo[b >> 24]) >> 8) << 24;
+    }
+    kernel_rgb565_gray_scalar(src + words * 8, dst + words * 4, pixels - words * 4);
+    return;
+  }
+#endif
+  kernel_rgb565_gray_scalar(src, dst, pixels);
+}
+
+void kernel_downscale2_scalar(const uint8_t *src, size_t stride, uint8_t *dst, size_t w, size_t h) {
+  for (size_t y = 0; y < h; y++) {
+    const uint8_t *r0 = src + y * 2 * stride;
+    const uint8_t *r1 = r0 + stride;
+    for (size_t x = 0; x < w; x++) {
+      dst[y * w + x] = (r0[x * 2] + r0[x * 2 + 1] + r1[x * 2] + r1[x * 2 + 1] + 2) >> 2;
+    }
+  }
+}
+
+// Four 2x2 averages from row words 0..1 (a) and the next row (b), two per
+// lane pair: even and odd bytes are added in 16-bit lanes that cannot carry
+static inline uint32_t box2(uint32_t a, uint32_t b) {
+  uint32_t s = (a & 0x00FF00FF) + (a >> 8 & 0x00FF00FF) + (b & 0x00FF00FF) + (b >> 8 & 0x00FF00FF);
+  return (s + 0x00020002) >> 2 & 0x00FF00FF;
+}
+
+void kernel_downscale2(const uint8_t *src, size_t stride, uint8_t *dst, size_t w, size_t h) {
+#if KERNELS_SWAR
+  if (aligned4(src) && aligned4(dst) && !(stride & 3) && !(w & 3)) {
+    for (size_t y = 0; y < h; y++) {
+      const uint32_t *r0 = (const uint32_t *)(src + y * 2 * stride);
+      const uint32_t *r1 = (const uint32_t *)(src + (y * 2 + 1) * stride);
+      uint32_t *d = (uint32_t *)(dst + y * w);
+      for (size_t i = 0; i < w / 4; i++, r0 += 2, r1 += 2) {
+        d[i] = pack_even(box2(r0[0], r1[0]), box2(r0[1], r1[1]));
+      }
+    }
+    return;
+  }
+#endif
+  kernel_downscale2_scalar(src, stride, dst, w, h);
+}
+
+void kernel_integral(const uint8_t *src, uint32_t *dst, size_t w, size_t h) {
+  uint32_t row = 0;
+  for (size_t x = 0; x < w; x++) {
+    row += src[x];
+    dst[x] = row;
+  }
+  for (size_t y = 1; y < h; y++) {
+    const uint8_t *s = src + y * w;
+    const uint32_t *above = dst + (y - 1) * w;
+    uint32_t *d = dst + y * w;
+    row = 0;
+    for (size_t x = 0; x < w; x++) {
+      row += s[x];
+      d[x] = above[x] + row;
+    }
+  }
+}
+
+void kernel_normalize(uint8_t *buf, size_t pixels) {
+  uint8_t lo = 255, hi = 0;
+  for (size_t i = 0; i < pixels; i++) {
+    lo = buf[i] < lo ? buf[i] : lo;
+    hi = buf[i] > hi ? buf[i] : hi;
+  }
+  if (hi <= lo || (lo == 0 && hi == 255)) {
+    return;
+  }
+  uint8_t map[256];
+  for (int v = 0; v < 256; v++) {
+    map[v] = v <= lo ? 0 : v >= hi ? 255 : (v - lo) * 255 / (hi - lo);
+  }
+  for (size_t i = 0; i < pixels; i++) {
+    buf[i] = map[buf[i]];
+  }
+}
+
+// Best of a few runs, in cycles per pixel x 100
+#define BENCH_RUNS 5
+
+template <typename F> static uint32_t bench(F run, size_t pixels) {
+  uint32_t best = UINT32_MAX;
+  for (int i = 0; i < BENCH_RUNS; i++) {
+    uint32_t c0 = kernels_cycles();
+    run();
+    uint32_t c = kernels_cycles() - c0;
+    best = c < best ? c : best;
+  }
+  return (uint64_t)best * 100 / pixels;
+}
+
+int kernels_bench(kernel_bench_t *out, int max) {
+  const size_t w = KERNELS_BENCH_W, h = KERNELS_BENCH_H, n = w * h;
+  uint8_t *raw = (uint8_t *)malloc(n * 2);
+  uint8_t *gray = (uint8_t *)malloc(n);
+  uint8_t *half = (uint8_t *)malloc(n / 4);
+  uint32_t *sums = (uint32_t *)malloc(n * sizeof(uint32_t));
+  int count = 0;
+  if (raw && gray && half && sums) {
+    for (size_t i = 0; i < n * 2; i++) {
+      raw[i] = (uint8_t)(i * 7 + (i >> 9));
+    }
+    kernel_yuv422_gray_scalar(raw, gray, n);
+    uint32_t integral = bench([&] { kernel_integral(gray, sums, w, h); }, n);
+    uint32_t normalize = bench([&] { kernel_normalize(gray, n); }, n);
+    kernel_bench_t r[] = {
+      {"yuv422_gray", bench([&] { kernel_yuv422_gray_scalar(raw, gray, n); }, n), bench([&] { kernel_yuv422_gray(raw, gray, n); }, n)},
+      {"rgb565_gray", bench([&] { kernel_rgb565_gray_scalar(raw, gray, n); }, n), bench([&] { kernel_rgb565_gray(raw, gray, n); }, n)},
+      {"downscale2", bench([&] { kernel_downscale2_scalar(gray, w, half, w / 2, h / 2); }, n / 4),
+       bench([&] { kernel_downscale2(gray, w, half, w / 2, h / 2); }, n / 4)},
+      {"integral", integral, integral},
+      {"normalize", normalize, normalize},
+    };
+    for (; count < max && count < (int)(sizeof(r) / sizeof(r[0])); count++) {
+      out[count] = r[count];
+    }
+  }
+  free(raw);
+  free(gray);
+  free(half);
+  free(sums);
+  return count;
+}
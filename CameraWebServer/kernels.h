@@ -0,0 +1,53 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Grayscale kernels for the detection working image (face_detect.h).
+//
+// Each kernel has a plain per-pixel reference version (_scalar) and the
+// one the firmware uses, picked at compile time. With KERNELS_SWAR (the
+// default) those work on four pixels per 32-bit load and store: YUV422
+// luma is gathered with shifts and masks, the 2x2 box filter adds even
+// and odd bytes in 16-bit lanes. RGB565 goes through two 256-entry tables
+// whose sum is the BT.601 luma, since the weights are linear in the two
+// bytes. The integral image and the normalisation are serial or table
+// driven and have a single version.
+//
+// Buffers that are not 32-bit aligned fall back to the scalar loop.
+// kernels_bench runs every kernel on a QQVGA frame and reports CPU cycles
+// per output pixel, to compare the two versions on a given board.
+//
+#ifndef KERNELS_SWAR
+#define KERNELS_SWAR 1
+#endif
+
+#define KERNELS_BENCH_W 160
+#define KERNELS_BENCH_H 120
+
+// YUYV to its Y plane
+void kernel_yuv422_gray(const uint8_t *src, uint8_t *dst, size_t pixels);
+void kernel_yuv422_gray_scalar(const uint8_t *src, uint8_t *dst, size_t pixels);
+// Big endian RGB565, as the sensors send it, to BT.601 luma
+void kernel_rgb565_gray(const uint8_t *src, uint8_t *dst, size_t pixels);
+void kernel_rgb565_gray_scalar(const uint8_t *src, uint8_t *dst, size_t pixels);
+// 2x2 box average; the source is (2 * w) x (2 * h) with the given stride
+void kernel_downscale2(const uint8_t *src, size_t stride, uint8_t *dst, size_t w, size_t h);
+void kernel_downscale2_scalar(const uint8_t *src, size_t stride, uint8_t *dst, size_t w, size_t h);
+// dst[y * w + x]: sum of src over [0, x] x [0, y]
+void kernel_integral(const uint8_t *src, uint32_t *dst, size_t w, size_t h);
+// Stretches the used range to 0..255 in place
+void kernel_normalize(uint8_t *buf, size_t pixels);
+
+typedef struct {
+  const char *name;
+  uint32_t scalar_cpp100;  // Cycles per pixel x 100, reference version
+  uint32_t fast_cpp100;    // The version in use; same as scalar without one
+} kernel_bench_t;
+
+// Fills up to max results; the count, 0 when the buffers could not be allocated
+int kernels_bench(kernel_bench_t *out, int max);
+
+#endif  // KERNELS_H
@@ -0,0 +1,177 @@
+#include "motion.h"
+#include "esp_timer.h"
+#include "esp_jpg_decode.h"
+#include <string.h>
+
+#define MOTION_BLOCKS_W (MOTION_GRID_W / MOTION_BLOCK)
+#define MOTION_BLOCKS_H (MOTION_GRID_H / MOTION_BLOCK)
+
+static inline void thumb_add(motion_thumb_t *t, int x, int y, uint8_t luma) {
+  int i = (y * MOTION_GRID_H / t->h) * MOTION_GRID_W + x * MOTION_GRID_W / t->w;
+  t->sum[i] += luma;
+  t->count[i]++;
+  t->luma += luma;
+  t->pixels++;
+}
+
+// Neighbour differences of pixel gx,gy of the scored image. Pixels come
+// block by block, rows in order within a block and blocks left to right,
+// so the one above is always in above[] and the one to the left is either
+// the previous pixel or the previous block's right column in edge[].
+static inline void grad_add(motion_thumb_t *t, int gx, int gy, bool block_start, bool block_end, uint8_t luma) {
+  if (gx >= MOTION_GRAD_W) {
+    return;
+  }
+  if (gx > 0) {
+    int d = luma - (block_start ? t->edge[gy & 15] : t->left);
+    t->grad += d * d;
+    t->grads++;
+  }
+  if (gy > 0) {
+    int d = luma - t->above[gx];
+    t->grad += d * d;
+    t->grads++;
+  }
+  t->above[gx] = luma;
+  t->left = luma;
+  if (block_end) {
+    t->edge[gy & 15] = luma;
+  }
+}
+
+static size_t thumb_jpg_read(void *arg, size_t index, uint8_t *buf, size_t len) {
+  motion_thumb_t *t = (motion_thumb_t *)arg;
+  if (buf) {
+    memcpy(buf, t->fb->buf + index, len);
+  }
+  return len;
+}
+
+static bool thumb_jpg_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+  motion_thumb_t *t = (motion_thumb_t *)arg;
+  if (!data) {
+    if (!x && !y) {
+      t->w = w;
+      t->h = h;
+    }
+    return t->w && t->h;
+  }
+  for (int r = 0; r < h; r++) {
+    for (int c = 0; c < w; c++, data += 3) {
+      // BT.601 luma, weights sum to 256
+      uint8_t luma = (77 * data[0] + 150 * data[1] + 29 * data[2]) >> 8;
+      thumb_add(t, x + c, y + r, luma);
+      grad_add(t, x + c, y + r, c == 0, c == w - 1, luma);
+    }
+  }
+  return true;
+}
+
+static bool thumb_fill(motion_thumb_t *t) {
+  const camera_fb_t *fb = t->fb;
+  if (fb->format == PIXFORMAT_JPEG) {
+    return esp_jpg_decode(fb->len, JPG_SCALE_8X, thumb_jpg_read, thumb_jpg_write, t) == ESP_OK;
+  }
+  if (fb->format != PIXFORMAT_GRAYSCALE || fb->width < MOTION_GRID_W || fb->height < MOTION_GRID_H) {
+    return false;
+  }
+  // Every 8th pixel both ways, the same density as a 1/8 JPEG decode
+  t->w = fb->width;
+  t->h = fb->height;
+  for (size_t y = 0; y < fb->height; y += 8) {
+    for (size_t x = 0; x < fb->width; x += 8) {
+      uint8_t luma = fb->buf[y * fb->width + x];
+      thumb_add(t, x, y, luma);
+      grad_add(t, x / 8, y / 8, false, false, luma);
+    }
+  }
+  return true;
+}
+
+void motion_init(motion_t *m) {
+  m->thresh = 12;
+  m->min_score = 2;
+  m->hold_ms = 2000;
+  m->idle_ms = 10000;
+  m->min_sharpness = 0;
+  m->min_luma = 0;
+  m->primed = false;
+  m->score = -1;
+  m->sharpness = -1;
+  m->luma = -1;
+  m->last_motion = 0;
+  m->last_pass = 0;
+  m->passed = 0;
+  m->suppressed = 0;
+  m->blurred = 0;
+  m->dark = 0;
+}
+
+int motion_score(motion_t *m, const camera_fb_t *fb) {
+  motion_thumb_t &t = m->thumb;
+  memset(&t, 0, sizeof(t));
+  t.fb = fb;
+  if (!thumb_fill(&t)) {
+    m->sharpness = m->luma = -1;
+    return m->score = -1;
+  }
+  m->sharpness = t.grads ? (int)(t.grad / t.grads) : 0;
+  m->luma = t.pixels ? (int)(t.luma / t.pixels) : 0;
+
+  uint8_t luma[MOTION_GRID_W * MOTION_GRID_H];
+  for (int i = 0; i < MOTION_GRID_W * MOTION_GRID_H; i++) {
+    luma[i] = t.count[i] ? t.sum[i] / t.count[i] : 0;
+  }
+  if (!m->primed) {
+    for (int i = 0; i < MOTION_GRID_W * MOTION_GRID_H; i++) {
+      m->bg[i] = luma[i] << 8;
+    }
+    m->primed = true;
+    return m->score = 100;
+  }
+
+  int changed = 0;
+  for (int by = 0; by < MOTION_BLOCKS_H; by++) {
+    for (int bx = 0; bx < MOTION_BLOCKS_W; bx++) {
+      int sad = 0;
+      for (int y = by * MOTION_BLOCK; y < (by + 1) * MOTION_BLOCK; y++) {
+        for (int x = bx * MOTION_BLOCK; x < (bx + 1) * MOTION_BLOCK; x++) {
+          int d = luma[y * MOTION_GRID_W + x] - (m->bg[y * MOTION_GRID_W + x] >> 8);
+          sad += d < 0 ? -d : d;
+        }
+      }
+      if (sad > m->thresh * MOTION_BLOCK * MOTION_BLOCK) {
+        changed++;
+      }
+    }
+  }
+  for (int i = 0; i < MOTION_GRID_W * MOTION_GRID_H; i++) {
+    m->bg[i] += ((luma[i] << 8) - m->bg[i]) >> MOTION_BG_SHIFT;
+  }
+  return m->score = changed * 100 / (MOTION_BLOCKS_W * MOTION_BLOCKS_H);
+}
+
+bool motion_gate(motion_t *m, const camera_fb_t *fb) {
+  int score = motion_score(m, fb);
+  int64_t now = esp_timer_get_time();
+  if (score < 0 || score >= m->min_score) {
+    m->last_motion = now;
+  }
+  // Not worth sending even when due; the next good frame goes in its place
+  if (score >= 0 && m->min_luma && m->luma < m->min_luma) {
+    m->dark++;
+    return false;
+  }
+  if (score >= 0 && m->min_sharpness && m->sharpness < m->min_sharpness) {
+    m->blurred++;
+    return false;
+  }
+  bool pass = !m->min_score || now - m->last_motion < (int64_t)m->hold_ms * 1000 || (m->idle_ms && now - m->last_pass >= (int64_t)m->idle_ms * 1000);
+  if (pass) {
+    m->last_pass = now;
+    m->passed++;
+  } else {
+    m->suppressed++;
+  }
+  return pass;
+}
@@ -0,0 +1,76 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include "esp_camera.h"
+
+//
+// Cheap motion gate for the stream and the uploader.
+//
+// Each frame is reduced to a MOTION_GRID_W x MOTION_GRID_H luma thumbnail:
+// JPEG frames are decoded at 1/8 scale, which only uses the DC coefficient
+// of every 8x8 block, grayscale frames are sampled directly. The thumbnail
+// is split into 4x4-cell blocks, and a block counts as changed when the
+// mean absolute difference (SAD / 16) against the running background is
+// above thresh. The score is the percentage of changed blocks.
+//
+// The background follows the scene with weight 1/2^MOTION_BG_SHIFT per
+// frame, so slow light changes fade in instead of triggering.
+//
+// The same pass scores the frame itself: luma is the mean brightness and
+// sharpness the gradient energy, the mean squared difference between
+// neighbouring pixels of the 1/8 image (both directions, across block
+// edges). A motion-blurred or defocused frame loses most of it; it is
+// relative to the scene, so min_sharpness is set from a sharp frame of the
+// same camera. Frames below min_sharpness or min_luma are dropped by the
+// gate before anything else looks at them.
+//
+#define MOTION_GRID_W   32
+#define MOTION_GRID_H   24
+#define MOTION_BLOCK    4
+#define MOTION_BG_SHIFT 3
+#define MOTION_GRAD_W   256  // Widest 1/8 image scored for sharpness (QXGA)
+
+typedef struct {
+  const camera_fb_t *fb;
+  uint16_t w, h;  // Size of the image being binned into the grid
+  uint32_t sum[MOTION_GRID_W * MOTION_GRID_H];
+  uint16_t count[MOTION_GRID_W * MOTION_GRID_H];
+  uint8_t above[MOTION_GRAD_W];  // Last pixel seen in each column
+  uint8_t edge[16];              // Right column of the previous block, by row & 15
+  uint8_t left;
+  uint64_t grad;   // Sum of squared neighbour differences
+  uint32_t grads;
+  uint32_t luma;   // Sum over all pixels
+  uint32_t pixels;
+} motion_thumb_t;
+
+typedef struct {
+  // Settings, may be changed at any time
+  int thresh;     // Mean abs luma difference for a changed block, 0..255
+  int min_score;  // Percent of changed blocks that counts as motion; 0: gate off
+  int hold_ms;    // Keep sending this long after the last motion
+  int idle_ms;    // Still send one frame this often without motion; 0: none
+  int min_sharpness;  // Drop frames less sharp than this; 0: off
+  int min_luma;       // Drop frames darker than this mean, 0..255; 0: off
+  // State
+  uint16_t bg[MOTION_GRID_W * MOTION_GRID_H];  // Background, 8.8 fixed point
+  bool primed;
+  int score;            // Last score, -1: frame could not be scored
+  int sharpness;        // Of the last frame, -1 with score
+  int luma;
+  int64_t last_motion;  // esp_timer time of the last frame with motion
+  int64_t last_pass;    // esp_timer time of the last frame let through
+  uint32_t passed;
+  uint32_t suppressed;
+  uint32_t blurred;  // Dropped for min_sharpness
+  uint32_t dark;     // Dropped for min_luma
+  motion_thumb_t thumb;  // Scratch for motion_score
+} motion_t;
+
+void motion_init(motion_t *m);
+// Scores fb against the background and updates it; -1 for formats it cannot read
+int motion_score(motion_t *m, const camera_fb_t *fb);
+// Scores fb and decides whether it should be sent: moving (or due), sharp and bright enough
+bool motion_gate(motion_t *m, const camera_fb_t *fb);
+
+#endif  // MOTION_H
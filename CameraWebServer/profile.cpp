@@ -0,0 +1,211 @@
+#include <string.h>
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "profile.h"
+
+#define PROFILE_NAMESPACE "camprof"
+#define PROFILE_BOOT_KEY  "boot"  // Name of the boot profile; not usable as a profile name
+
+typedef struct {
+  const char *name;
+  profile_t profile;
+} profile_builtin_t;
+
+static const profile_builtin_t builtins[] = {
+  // Door camera: sharp faces, exposure biased up for backlit entrances
+  {"face-door",
+   {
+     .version = PROFILE_VERSION, .framesize = FRAMESIZE_VGA, .quality = 10, .brightness = 0, .contrast = 1, .saturation = 0, .sharpness = 0,
+     .special_effect = 0, .wb_mode = 0, .awb = 1, .awb_gain = 1, .aec = 1, .aec2 = 1, .ae_level = 1, .aec_value = 300, .agc = 1, .agc_gain = 0,
+     .gainceiling = GAINCEILING_8X, .bpc = 1, .wpc = 1, .raw_gma = 1, .lenc = 1, .hmirror = 0, .vflip = 0, .dcw = 1,
+   }},
+  // Small and cheap, for watching in a browser
+  {"preview",
+   {
+     .version = PROFILE_VERSION, .framesize = FRAMESIZE_QVGA, .quality = 20, .brightness = 0, .contrast = 0, .saturation = 0, .sharpness = 0,
+     .special_effect = 0, .wb_mode = 0, .awb = 1, .awb_gain = 1, .aec = 1, .aec2 = 0, .ae_level = 0, .aec_value = 300, .agc = 1, .agc_gain = 0,
+     .gainceiling = GAINCEILING_2X, .bpc = 0, .wpc = 1, .raw_gma = 1, .lenc = 1, .hmirror = 0, .vflip = 0, .dcw = 1,
+   }},
+  // Low light: long exposure and high gain, noise hidden by a lower quality
+  {"night",
+   {
+     .version = PROFILE_VERSION, .framesize = FRAMESIZE_VGA, .quality = 14, .brightness = 1, .contrast = 0, .saturation = -1, .sharpness = 0,
+     .special_effect = 0, .wb_mode = 0, .awb = 1, .awb_gain = 1, .aec = 1, .aec2 = 1, .ae_level = 2, .aec_value = 1200, .agc = 1, .agc_gain = 0,
+     .gainceiling = GAINCEILING_128X, .bpc = 1, .wpc = 1, .raw_gma = 1, .lenc = 1, .hmirror = 0, .vflip = 0, .dcw = 1,
+   }},
+};
+
+// Frame size at profile_boot; the frame buffers hold nothing larger
+static bool have_ceiling = false;
+static framesize_t ceiling;
+
+static bool name_ok(const char *name) {
+  size_t len = strlen(name);
+  return len && len <= PROFILE_NAME_MAX && strcmp(name, PROFILE_BOOT_KEY) != 0;
+}
+
+void profile_capture(profile_t *p, const sensor_t *s) {
+  const camera_status_t *st = &s->status;
+  p->version = PROFILE_VERSION;
+  p->framesize = st->framesize;
+  p->quality = st->quality;
+  p->brightness = st->brightness;
+  p->contrast = st->contrast;
+  p->saturation = st->saturation;
+  p->sharpness = st->sharpness;
+  p->special_effect = st->special_effect;
+  p->wb_mode = st->wb_mode;
+  p->awb = st->awb;
+  p->awb_gain = st->awb_gain;
+  p->aec = st->aec;
+  p->aec2 = st->aec2;
+  p->ae_level = st->ae_level;
+  p->aec_value = st->aec_value;
+  p->agc = st->agc;
+  p->agc_gain = st->agc_gain;
+  p->gainceiling = st->gainceiling;
+  p->bpc = st->bpc;
+  p->wpc = st->wpc;
+  p->raw_gma = st->raw_gma;
+  p->lenc = st->lenc;
+  p->hmirror = st->hmirror;
+  p->vflip = st->vflip;
+  p->dcw = st->dcw;
+}
+
+#define PROFILE_SET(field, fn) \
+  do { \
+    if (p->field != s->status.field) { \
+      failed += s->fn(s, p->field) != 0; \
+    } \
+  } while (0)
+
+int profile_apply(sensor_t *s, const profile_t *p) {
+  int failed = 0;
+  framesize_t size = (framesize_t)p->framesize;
+  if (have_ceiling && size > ceiling) {
+    size = ceiling;
+  }
+  // Frame size first: on some sensors it rewrites the window and timing registers
+  if (s->pixformat == PIXFORMAT_JPEG && size != s->status.framesize) {
+    failed += s->set_framesize(s, size) != 0;
+  }
+  PROFILE_SET(quality, set_quality);
+  // Automatic modes before the manual values they override
+  PROFILE_SET(awb, set_whitebal);
+  PROFILE_SET(aec, set_exposure_ctrl);
+  PROFILE_SET(agc, set_gain_ctrl);
+  PROFILE_SET(awb_gain, set_awb_gain);
+  PROFILE_SET(wb_mode, set_wb_mode);
+  PROFILE_SET(aec2, set_aec2);
+  PROFILE_SET(ae_level, set_ae_level);
+  PROFILE_SET(aec_value, set_aec_value);
+  PROFILE_SET(agc_gain, set_agc_gain);
+  if (p->gainceiling != s->status.gainceiling) {
+    failed += s->set_gainceiling(s, (gainceiling_t)p->gainceiling) != 0;
+  }
+  PROFILE_SET(brightness, set_brightness);
+  PROFILE_SET(contrast, set_contrast);
+  PROFILE_SET(saturation, set_saturation);
+  PROFILE_SET(sharpness, set_sharpness);
+  PROFILE_SET(special_effect, set_special_effect);
+  PROFILE_SET(bpc, set_bpc);
+  PROFILE_SET(wpc, set_wpc);
+  PROFILE_SET(raw_gma, set_raw_gma);
+  PROFILE_SET(lenc, set_lenc);
+  PROFILE_SET(hmirror, set_hmirror);
+  PROFILE_SET(vflip, set_vflip);
+  PROFILE_SET(dcw, set_dcw);
+  return failed;
+}
+
+esp_err_t profile_load(const char *name, profile_t *p) {
+  if (!name_ok(name)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  nvs_handle_t nvs;
+  if (nvs_open(PROFILE_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+    size_t len = sizeof(*p);
+    esp_err_t err = nvs_get_blob(nvs, name, p, &len);
+    nvs_close(nvs);
+    // A blob from another layout is ignored rather than misread
+    if (err == ESP_OK && len == sizeof(*p) && p->version == PROFILE_VERSION) {
+      return ESP_OK;
+    }
+  }
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    if (!strcmp(builtins[i].name, name)) {
+      *p = builtins[i].profile;
+      return ESP_OK;
+    }
+  }
+  return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t profile_save(const char *name, const profile_t *p) {
+  if (!name_ok(name)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(PROFILE_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = nvs_set_blob(nvs, name, p, sizeof(*p));
+  if (err == ESP_OK) {
+    err = nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+  return err;
+}
+
+esp_err_t profile_set_boot(const char *name) {
+  profile_t p;
+  esp_err_t err = profile_load(name, &p);
+  if (err != ESP_OK) {
+    return err;
+  }
+  nvs_handle_t nvs;
+  err = nvs_open(PROFILE_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = nvs_set_str(nvs, PROFILE_BOOT_KEY, name);
+  if (err == ESP_OK) {
+    err = nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+  return err;
+}
+
+esp_err_t profile_boot(sensor_t *s, char *name, size_t size) {
+  ceiling = s->status.framesize;
+  have_ceiling = true;
+
+  // The Arduino core has normally done this already; a second call is a no-op
+  nvs_flash_init();
+  char boot[PROFILE_NAME_MAX + 1] = PROFILE_DEFAULT;
+  nvs_handle_t nvs;
+  if (nvs_open(PROFILE_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+    size_t len = sizeof(boot);
+    if (nvs_get_str(nvs, PROFILE_BOOT_KEY, boot, &len) != ESP_OK) {
+      strcpy(boot, PROFILE_DEFAULT);
+    }
+    nvs_close(nvs);
+  }
+
+  profile_t p;
+  esp_err_t err = profile_load(boot, &p);
+  if (err != ESP_OK) {
+    strcpy(boot, PROFILE_DEFAULT);
+    err = profile_load(boot, &p);
+  }
+  if (name && size) {
+    strncpy(name, boot, size - 1);
+    name[size - 1] = 0;
+  }
+  if (err != ESP_OK) {
+    return err;
+  }
+  return profile_apply(s, &p) ? ESP_FAIL : ESP_OK;
+}
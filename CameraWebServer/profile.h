@@ -0,0 +1,66 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "esp_camera.h"
+
+//
+// Named sensor profiles kept in NVS.
+//
+// A profile is every setting /control knows about, packed into one blob
+// per name in the "camprof" namespace; "face-door", "preview" and "night"
+// are built in and used until a profile of that name has been saved.
+// profile_apply only calls the setters whose value differs from the
+// sensor's current status, so a switch between similar profiles costs a
+// handful of SCCB writes instead of the full set.
+//
+// profile_boot is meant to run directly after esp_camera_init, before
+// Wi-Fi is up: the first frame is then already taken with the stored
+// settings instead of waiting for a controller to replay them over HTTP.
+// The frame size at that point is what the frame buffers were sized for,
+// and later profiles are clamped to it.
+//
+#define PROFILE_VERSION  1
+#define PROFILE_NAME_MAX 15  // NVS key length
+#define PROFILE_DEFAULT  "face-door"
+
+typedef struct __attribute__((packed)) {
+  uint8_t version;
+  uint8_t framesize;
+  uint8_t quality;
+  int8_t brightness;
+  int8_t contrast;
+  int8_t saturation;
+  int8_t sharpness;
+  uint8_t special_effect;
+  uint8_t wb_mode;
+  uint8_t awb;
+  uint8_t awb_gain;
+  uint8_t aec;
+  uint8_t aec2;
+  int8_t ae_level;
+  uint16_t aec_value;
+  uint8_t agc;
+  uint8_t agc_gain;
+  uint8_t gainceiling;
+  uint8_t bpc;
+  uint8_t wpc;
+  uint8_t raw_gma;
+  uint8_t lenc;
+  uint8_t hmirror;
+  uint8_t vflip;
+  uint8_t dcw;
+} profile_t;
+
+// Current sensor settings as a profile
+void profile_capture(profile_t *p, const sensor_t *s);
+// Applies the settings that differ from the sensor's; number of setters that failed
+int profile_apply(sensor_t *s, const profile_t *p);
+// NVS first, then the built-ins; ESP_ERR_NOT_FOUND when neither has it
+esp_err_t profile_load(const char *name, profile_t *p);
+esp_err_t profile_save(const char *name, const profile_t *p);
+// Profile profile_boot applies from the next power-on
+esp_err_t profile_set_boot(const char *name);
+// Applies the boot profile (PROFILE_DEFAULT when none is set); its name goes to name
+esp_err_t profile_boot(sensor_t *s, char *name, size_t size);
+
+#endif  // PROFILE_H
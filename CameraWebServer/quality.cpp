@@ -0,0 +1,142 @@
+#include "quality.h"
+
+// Frame sizes the controller steps through, smallest first
+static const framesize_t ladder[] = {
+  FRAMESIZE_QQVGA, FRAMESIZE_QVGA, FRAMESIZE_CIF, FRAMESIZE_VGA, FRAMESIZE_SVGA, FRAMESIZE_XGA, FRAMESIZE_HD, FRAMESIZE_SXGA, FRAMESIZE_UXGA,
+};
+#define LADDER_LEN (sizeof(ladder) / sizeof(ladder[0]))
+
+static uint32_t pixels(framesize_t size) {
+  return (uint32_t)resolution[size].width * resolution[size].height;
+}
+
+// Ladder step of a size; sizes off the ladder map to the largest one not above them
+static int ladder_index(framesize_t size) {
+  int i = 0;
+  while (i + 1 < (int)LADDER_LEN && pixels(ladder[i + 1]) <= pixels(size)) {
+    i++;
+  }
+  return i;
+}
+
+static inline int smooth(int avg, int sample, bool first) {
+  return first ? sample : avg + ((sample - avg) >> QUALITY_EWMA_SHIFT);
+}
+
+void quality_init(quality_t *q, sensor_t *s) {
+  q->target_ms = 1500;
+  q->band_pct = 25;
+  q->best_quality = 8;
+  q->worst_quality = 40;
+  q->min_size = FRAMESIZE_QVGA;
+  q->max_size = s->status.framesize;
+  q->hold_samples = 4;
+  q->quality = s->status.quality;
+  q->size = s->status.framesize;
+  q->latency_ms = 0;
+  q->server_ms = 0;
+  q->bytes_per_ms = 0;
+  q->bytes = 0;
+  q->since_change = 0;
+  q->samples = 0;
+  q->steps_down = 0;
+  q->steps_up = 0;
+  q->overflows = 0;
+  q->overflow_size = q->size;
+  q->overflow_quality = -1;
+}
+
+// Whether size / quality is at or beyond a setting that overflowed
+static bool overflows_at(const quality_t *q, framesize_t size, int quality) {
+  return quality <= q->overflow_quality && pixels(size) >= pixels(q->overflow_size);
+}
+
+static bool step_to(quality_t *q, sensor_t *s, framesize_t size, int quality) {
+  if (size != q->size && s->set_framesize(s, size) != 0) {
+    return false;
+  }
+  if (quality != q->quality && s->set_quality(s, quality) != 0) {
+    return false;
+  }
+  if (pixels(size) < pixels(q->size) || quality > q->quality) {
+    q->steps_down++;
+  } else {
+    q->steps_up++;
+  }
+  q->size = size;
+  q->quality = quality;
+  q->since_change = 0;
+  return true;
+}
+
+void quality_sample(quality_t *q, size_t bytes, int64_t latency_us, int64_t rtt_us, int server_ms) {
+  bool first = !q->samples;
+  if (server_ms < 0) {
+    server_ms = q->server_ms;
+  }
+  int64_t wire_ms = rtt_us / 1000 - server_ms;
+  q->latency_ms = smooth(q->latency_ms, latency_us / 1000, first);
+  q->server_ms = smooth(q->server_ms, server_ms, first);
+  q->bytes = smooth(q->bytes, bytes, first);
+  q->bytes_per_ms = smooth(q->bytes_per_ms, bytes / (wire_ms > 1 ? wire_ms : 1), first);
+  q->samples++;
+  q->since_change++;
+}
+
+bool quality_adjust(quality_t *q, sensor_t *s) {
+  if (!q->target_ms || !q->samples || q->since_change < q->hold_samples) {
+    return false;
+  }
+  int hi = q->target_ms * (100 + q->band_pct) / 100;
+  int lo = q->target_ms * (100 - q->band_pct) / 100;
+  int idx = ladder_index(q->size);
+  int quality = q->quality;
+  framesize_t size = q->size;
+
+  if (q->latency_ms > hi) {
+    // Too slow: cheaper JPEG first, smaller frames once quality is at its floor
+    if (quality + QUALITY_STEP <= q->worst_quality) {
+      quality += QUALITY_STEP;
+    } else if (idx > ladder_index(q->min_size)) {
+      size = ladder[idx - 1];
+    } else {
+      return false;
+    }
+  } else if (q->latency_ms < lo && q->bytes_per_ms) {
+    // Headroom: undo in reverse order, only if the estimate still fits
+    uint32_t bytes;
+    int server_ms = q->server_ms;
+    if (idx < ladder_index(q->max_size) && !overflows_at(q, ladder[idx + 1], quality)) {
+      size = ladder[idx + 1];
+      bytes = (uint64_t)q->bytes * pixels(size) / pixels(q->size);
+      server_ms = (int64_t)server_ms * pixels(size) / pixels(q->size);
+    } else if (quality - QUALITY_STEP >= q->best_quality && !overflows_at(q, size, quality - QUALITY_STEP)) {
+      quality -= QUALITY_STEP;
+      bytes = q->bytes * q->quality / (quality > 0 ? quality : 1);
+    } else {
+      return false;
+    }
+    int predicted = q->latency_ms + (int)((bytes - q->bytes) / q->bytes_per_ms) + server_ms - q->server_ms;
+    if (predicted >= lo) {
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  return step_to(q, s, size, quality);
+}
+
+bool quality_overflow(quality_t *q, sensor_t *s) {
+  q->overflows++;
+  q->overflow_size = q->size;
+  q->overflow_quality = q->quality;
+  int idx = ladder_index(q->size);
+  if (q->quality + QUALITY_STEP <= q->worst_quality) {
+    return step_to(q, s, q->size, q->quality + QUALITY_STEP);
+  }
+  if (idx > ladder_index(q->min_size)) {
+    return step_to(q, s, ladder[idx - 1], q->quality);
+  }
+  return false;
+}
@@ -0,0 +1,63 @@
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#include "esp_camera.h"
+
+//
+// Closed-loop JPEG quality / frame size control for the uploader.
+//
+// Every upload reports its bytes, the end-to-end latency (capture to
+// server answer), the wire round trip and the server's own processing
+// time. Latency is smoothed with weight 1/2^QUALITY_EWMA_SHIFT; while it
+// is above target by more than band_pct the controller steps down, first
+// the JPEG quality (larger number) and then the frame size.
+//
+// Stepping up is predictive rather than reactive: the smoothed throughput
+// and server time say what the next larger step would cost, and the step
+// is only taken when that estimate is still below target minus the band.
+// After any change hold_samples uploads are waited out before the next
+// one, so a step is judged on frames that were actually taken with it.
+//
+// A frame cut off at the end of its buffer (jpeg_size.h) steps down at
+// once, target or not, and the setting it happened at is remembered: the
+// controller does not step back up to it, nor to a larger frame at that
+// quality or sharper.
+//
+#define QUALITY_EWMA_SHIFT 2
+#define QUALITY_STEP       4   // JPEG quality change per step
+
+typedef struct {
+  // Settings, may be changed at any time
+  int target_ms;      // End-to-end latency to hold; 0: controller off
+  int band_pct;       // No change while within target +- this percent
+  int best_quality;   // Lowest (sharpest) JPEG quality number allowed
+  int worst_quality;  // Highest allowed
+  framesize_t min_size;
+  framesize_t max_size;  // At most the size the camera was initialised with
+  int hold_samples;
+  // State
+  int quality;
+  framesize_t size;
+  int latency_ms;       // Smoothed
+  int server_ms;        // Smoothed server processing time
+  uint32_t bytes_per_ms;  // Smoothed wire throughput
+  uint32_t bytes;         // Smoothed frame size
+  int since_change;
+  uint32_t samples;
+  uint32_t steps_down;
+  uint32_t steps_up;
+  uint32_t overflows;
+  framesize_t overflow_size;  // Setting of the last truncated frame; overflow_quality -1: none
+  int overflow_quality;
+} quality_t;
+
+// Takes the starting point from the sensor's current settings
+void quality_init(quality_t *q, sensor_t *s);
+// Records one finished upload; server_ms < 0 when the answer had none
+void quality_sample(quality_t *q, size_t bytes, int64_t latency_us, int64_t rtt_us, int server_ms);
+// Steps the sensor if the samples call for it; true when it changed
+bool quality_adjust(quality_t *q, sensor_t *s);
+// A frame did not fit its buffer: one step down; true when the sensor changed
+bool quality_overflow(quality_t *q, sensor_t *s);
+
+#endif  // QUALITY_H
@@ -0,0 +1,176 @@
+#include <string.h>
+#include <WiFi.h>
+#include "esp_timer.h"
+#include "nvs.h"
+#include "wifi_link.h"
+
+#define WIFI_LINK_NAMESPACE "wifilink"
+#define WIFI_LINK_AP_KEY    "ap"
+
+// What the event task saw since the last poll
+static portMUX_TYPE link_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool event_up = false;
+static bool event_down = false;
+static uint8_t event_reason = 0;
+
+// Last AP, keyed by the SSID so a changed sketch does not try a stale BSSID
+typedef struct {
+  char ssid[33];
+  uint8_t bssid[6];
+  int32_t channel;
+} wifi_link_ap_t;
+
+static void ap_load(wifi_link_t *w) {
+  nvs_handle_t h;
+  wifi_link_ap_t ap;
+  size_t len = sizeof(ap);
+  if (nvs_open(WIFI_LINK_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+    return;
+  }
+  if (nvs_get_blob(h, WIFI_LINK_AP_KEY, &ap, &len) == ESP_OK && len == sizeof(ap) && !strncmp(ap.ssid, w->ssid, sizeof(ap.ssid))) {
+    memcpy(w->bssid, ap.bssid, sizeof(w->bssid));
+    w->channel = ap.channel;
+    w->have_ap = true;
+  }
+  nvs_close(h);
+}
+
+// Only written when the AP changed, not on every reconnect
+static void ap_save(wifi_link_t *w, const uint8_t *bssid, int32_t channel) {
+  if (w->have_ap && !memcmp(w->bssid, bssid, sizeof(w->bssid)) && w->channel == channel) {
+    return;
+  }
+  memcpy(w->bssid, bssid, sizeof(w->bssid));
+  w->channel = channel;
+  w->have_ap = true;
+  wifi_link_ap_t ap = {};
+  strncpy(ap.ssid, w->ssid, sizeof(ap.ssid) - 1);
+  memcpy(ap.bssid, bssid, sizeof(ap.bssid));
+  ap.channel = channel;
+  nvs_handle_t h;
+  if (nvs_open(WIFI_LINK_NAMESPACE, NVS_READWRITE, &h) == ESP_OK) {
+    if (nvs_set_blob(h, WIFI_LINK_AP_KEY, &ap, sizeof(ap)) == ESP_OK) {
+      nvs_commit(h);
+    }
+    nvs_close(h);
+  }
+}
+
+static void on_event(arduino_event_id_t event, arduino_event_info_t info) {
+  portENTER_CRITICAL(&link_mux);
+  if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+    event_up = true;
+  } else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) {
+    // ASSOC_LEAVE is WiFi.begin dropping our own attempt to start another
+    if (info.wifi_sta_disconnected.reason != WIFI_REASON_ASSOC_LEAVE) {
+      event_down = true;
+      event_reason = info.wifi_sta_disconnected.reason;
+    }
+  }
+  portEXIT_CRITICAL(&link_mux);
+}
+
+static void attempt(wifi_link_t *w) {
+  w->attempts++;
+  w->attempt_us = esp_timer_get_time();
+  w->fast = w->have_ap;
+  if (w->fast) {
+    WiFi.begin(w->ssid, w->password, w->channel, w->bssid, true);
+  } else {
+    WiFi.begin(w->ssid, w->password);
+  }
+}
+
+// Next attempt after a failed one; a failed fast attempt rescans at once
+static void retry_later(wifi_link_t *w) {
+  if (w->fast) {
+    w->have_ap = false;
+    w->next_ms = millis();
+    return;
+  }
+  w->next_ms = millis() + w->backoff_ms;
+  w->backoff_ms = w->backoff_ms * 2 > w->backoff_max_ms ? w->backoff_max_ms : w->backoff_ms * 2;
+}
+
+void wifi_link_init(wifi_link_t *w, const char *ssid, const char *password) {
+  memset(w, 0, sizeof(*w));
+  w->ssid = ssid;
+  w->password = password;
+  w->backoff_min_ms = WIFI_LINK_BACKOFF_MIN;
+  w->backoff_max_ms = WIFI_LINK_BACKOFF_MAX;
+}
+
+void wifi_link_begin(wifi_link_t *w) {
+  w->backoff_ms = w->backoff_min_ms;
+  w->down_us = esp_timer_get_time();
+  ap_load(w);
+  WiFi.persistent(false);  // Credentials come from the sketch; no flash write per begin
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false);  // Retries are ours, with backoff
+  if (w->ip) {
+    WiFi.config(IPAddress(w->ip), IPAddress(w->gateway), IPAddress(w->subnet), IPAddress(w->dns ? w->dns : w->gateway));
+  }
+  WiFi.onEvent(on_event);
+  attempt(w);
+}
+
+wifi_link_event_t wifi_link_poll(wifi_link_t *w) {
+  portENTER_CRITICAL(&link_mux);
+  bool up = event_up;
+  bool down = event_down;
+  uint8_t reason = event_reason;
+  event_up = event_down = false;
+  portEXIT_CRITICAL(&link_mux);
+
+  int64_t now = esp_timer_get_time();
+  if (down) {
+    w->last_reason = reason;
+  }
+  if (w->up && down) {
+    // Dropped: straight back to the same AP, backoff only if that fails
+    w->up = false;
+    w->drops++;
+    w->down_us = now;
+    w->backoff_ms = w->backoff_min_ms;
+    w->next_ms = millis();
+    w->attempt_us = 0;
+    return WIFI_LINK_DOWN;
+  }
+  if (up && !w->up) {
+    if (!w->attempt_us) {
+      w->attempt_us = now;  // Address from an attempt given up on; no connect time to report
+    }
+    w->up = true;
+    w->connects++;
+    w->fast_connects += w->fast;
+    w->last_connect_ms = (uint32_t)((now - w->attempt_us) / 1000);
+    if (!w->best_connect_ms || w->last_connect_ms < w->best_connect_ms) {
+      w->best_connect_ms = w->last_connect_ms;
+    }
+    if (w->last_connect_ms > w->worst_connect_ms) {
+      w->worst_connect_ms = w->last_connect_ms;
+    }
+    w->connect_ms_sum += w->last_connect_ms;
+    w->down_ms_sum += (now - w->down_us) / 1000;
+    w->attempt_us = 0;
+    w->backoff_ms = w->backoff_min_ms;
+    ap_save(w, WiFi.BSSID(), WiFi.channel());
+    return WIFI_LINK_UP;
+  }
+  if (w->up) {
+    return WIFI_LINK_NONE;
+  }
+  if (w->attempt_us && (down || now - w->attempt_us > WIFI_LINK_ATTEMPT_MS * 1000LL)) {
+    w->attempt_us = 0;
+    WiFi.disconnect();
+    retry_later(w);
+  }
+  if (!w->attempt_us && (int32_t)(millis() - w->next_ms) >= 0) {
+    attempt(w);
+  }
+  return WIFI_LINK_NONE;
+}
+
+bool wifi_link_up(const wifi_link_t *w) {
+  return w->up;
+}
@@ -0,0 +1,71 @@
+#ifndef WIFI_LINK_H
+#define WIFI_LINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//
+// Wi-Fi station that connects and reconnects in the background.
+//
+// wifi_link_begin only starts the first attempt and returns; the sketch
+// brings the camera up meanwhile and checks wifi_link_up before it sends.
+// Connect and drop are picked up from the Wi-Fi events, wifi_link_poll
+// (called from any loop that runs every few hundred ms) starts the next
+// attempt once its backoff is over: the first retry after a drop goes out
+// at once, later ones back off from backoff_min_ms doubling to
+// backoff_max_ms. Nothing here waits, so a dead AP never stalls capture.
+//
+// The BSSID and channel of the last AP are kept in NVS. An attempt with
+// them skips the scan of every channel (a few hundred ms to seconds);
+// when that AP is gone the next attempt scans again. A static address
+// (ip != 0) skips DHCP as well.
+//
+#define WIFI_LINK_ATTEMPT_MS   10000  // An attempt with no address by then is abandoned
+#define WIFI_LINK_BACKOFF_MIN  500
+#define WIFI_LINK_BACKOFF_MAX  30000
+
+typedef enum {
+  WIFI_LINK_NONE,
+  WIFI_LINK_UP,    // Got an address; last_connect_ms says how long it took
+  WIFI_LINK_DOWN,  // Lost the AP after being up
+} wifi_link_event_t;
+
+typedef struct {
+  // Settings, before wifi_link_begin
+  const char *ssid;
+  const char *password;
+  uint32_t ip, gateway, subnet, dns;  // Network byte order as IPAddress holds it; ip 0: DHCP
+  uint32_t backoff_min_ms;
+  uint32_t backoff_max_ms;
+  // State
+  bool up;
+  bool fast;               // Current or last attempt used the cached BSSID
+  bool have_ap;            // bssid/channel are valid
+  uint8_t bssid[6];
+  int32_t channel;
+  int64_t attempt_us;      // esp_timer at the start of the current attempt, 0: none running
+  int64_t down_us;         // esp_timer when the link went down (or wifi_link_begin)
+  uint32_t backoff_ms;
+  uint32_t next_ms;        // millis() of the next attempt
+  uint8_t last_reason;     // wifi_err_reason_t of the last disconnect
+  // Counters
+  uint32_t attempts;
+  uint32_t connects;
+  uint32_t fast_connects;  // Of connects, without a scan
+  uint32_t drops;
+  uint32_t last_connect_ms;  // Attempt start to address
+  uint32_t best_connect_ms;
+  uint32_t worst_connect_ms;
+  uint64_t connect_ms_sum;
+  uint64_t down_ms_sum;      // Link lost to link back, all outages
+} wifi_link_t;
+
+// Fills in the defaults; ssid and password must outlive the link
+void wifi_link_init(wifi_link_t *w, const char *ssid, const char *password);
+// Registers the event handler and starts the first attempt. One link per device.
+void wifi_link_begin(wifi_link_t *w);
+// Starts a due attempt, abandons one that ran out of time; reports UP/DOWN once each
+wifi_link_event_t wifi_link_poll(wifi_link_t *w);
+bool wifi_link_up(const wifi_link_t *w);
+
+#endif  // WIFI_LINK_H
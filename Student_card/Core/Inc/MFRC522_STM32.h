@@ -22,14 +22,23 @@
 
 // Essential registers
 #define PCD_CommandReg     0x01
+#define PCD_ComIEnReg      0x02
+#define PCD_DivIEnReg      0x03
 #define PCD_ComIrqReg      0x04
+#define PCD_DivIrqReg      0x05
 #define PCD_ErrorReg       0x06
 #define PCD_Status2Reg     0x08
 #define PCD_FIFODataReg    0x09
 #define PCD_FIFOLevelReg   0x0A
 #define PCD_BitFramingReg  0x0D
+#define PCD_CollReg        0x0E
+#define PCD_ModeReg        0x11
+#define PCD_TxModeReg      0x12
+#define PCD_RxModeReg      0x13
 #define PCD_TxControlReg   0x14
 #define PCD_TxAutoReg      0x15
+#define PCD_CRCResultRegH  0x21
+#define PCD_CRCResultRegL  0x22
 #define PCD_RFCfgReg       0x26
 #define PCD_TModeReg       0x2A
 #define PCD_TPrescalerReg  0x2B
@@ -38,40 +47,264 @@
 #define PCD_DemodReg       0x19
 #define PCD_VersionReg     0x37
 
+// ComIrqReg / ComIEnReg bits
+#define PCD_IRQ_RX         0x20
+#define PCD_IRQ_IDLE       0x10
+#define PCD_IRQ_ERR        0x02
+#define PCD_IRQ_TIMER      0x01
+#define PCD_IRQ_WAIT       (PCD_IRQ_RX | PCD_IRQ_IDLE | PCD_IRQ_ERR | PCD_IRQ_TIMER)
+#define PCD_DIVIRQ_CRC     0x04  // DivIrqReg: CalcCRC done
+#define PCD_STATUS2_CRYPTO1 0x08 // Status2Reg: MFCrypto1On after MFAuthent
+
 // Commands
 #define PCD_Idle           0x00
+#define PCD_CalcCRC        0x03
+#define PCD_MFAuthent      0x0E
 #define PCD_Transceive     0x0C
 #define PCD_SoftReset      0x0F
+#define PCD_PowerDown      0x10  // CommandReg bit, not a command
 
 // PICC commands
 #define PICC_REQA          0x26
+#define PICC_WUPA          0x52
+#define PICC_HLTA          0x50
 #define PICC_SEL_CL1       0x93
+#define PICC_SEL_CL2       0x95
+#define PICC_SEL_CL3       0x97
+#define PICC_CASCADE_TAG   0x88
+
+// MIFARE Classic
+#define PICC_MF_AUTH_KEY_A 0x60
+#define PICC_MF_AUTH_KEY_B 0x61
+#define PICC_MF_READ       0x30
+#define PICC_MF_WRITE      0xA0
+#define PICC_MF_ACK        0x0A  // 4-bit answer
+#define MFRC522_BLOCK_SIZE 16
+#define MFRC522_KEY_SIZE   6
+
+// Burst limits
+#define MFRC522_FIFO_SIZE  64
+#define MFRC522_BURST_MAX  16  // Registers per ReadRegs burst
+
+#define MFRC522_MAX_IRQ_DEVICES 4
+#define MFRC522_DMA_MIN_LEN     8   // Shorter frames are cheaper in polled mode
 
 // Status
 #define STATUS_OK          0
 #define STATUS_ERROR       1
 #define STATUS_TIMEOUT     2
+#define STATUS_BUSY        3
+#define STATUS_COLLISION   4
+
+// Transceive timeouts, measured by the RC522 timer from end of Tx.
+// A PICC answers REQA within ~100us; anticollision frames are longer.
+#define MFRC522_TIMER_TICK_US        25    // TPrescaler 0xA9 -> 40kHz
+#define MFRC522_REQA_TIMEOUT_US      1000
+#define MFRC522_ANTICOLL_TIMEOUT_US  5000
+#define MFRC522_SELECT_TIMEOUT_US    5000
+#define MFRC522_HLTA_TIMEOUT_US      1000  // Card must stay silent this long
+#define MFRC522_AUTH_TIMEOUT_US      5000  // Per MFAuthent pass
+#define MFRC522_MF_READ_TIMEOUT_US   5000
+#define MFRC522_MF_WRITE_TIMEOUT_US  10000 // Card commits the block to EEPROM first
+#define MFRC522_CRC_TIMEOUT_US       1000  // CalcCRC, host-side wait
+#define MFRC522_TIMEOUT_MARGIN_MS    2     // Software backstop on top
+
+// MFRC522_Poll timing. The idle probe interval adapts: MFRC522_POLL_FAST_MS
+// for MFRC522_POLL_BUSY_MS after any card activity, then doubling with every
+// empty probe up to the ceiling. waitcardDetect/waitcardRemoval follow the
+// same schedule.
+#define MFRC522_POLL_FAST_MS     15     // After activity
+#define MFRC522_POLL_BUSY_MS     30000  // How long "after activity" lasts
+#define MFRC522_POLL_MAX_MS      200    // Idle ceiling
+#define MFRC522_POLL_MISSES      2    // Failed probes before a card counts as removed
+#define MFRC522_PRESENCE_INTERVAL_MS 5 // Between WUPA probes of a tracked card
+#define MFRC522_PRESENCE_RETRY_MS    1 // After a missed WUPA, to confirm removal sooner
+
+// Low-power idle: ceiling of the probe interval with the RC522 in soft
+// power-down between probes
+#define MFRC522_LOWPOWER_INTERVAL_MS 500
+
+#define MFRC522_RESET_PULSE_US    10  // NRSTPD low time (datasheet: >100ns)
+
+#define MFRC522_INVENTORY_RETRIES 3   // Failed REQA/SELECT rounds before giving up
+
+// Guard times around RC522 accesses, in us (delay_us). A genuine chip needs
+// none between SPI accesses; some clones lose writes or return stale FIFO
+// data without a gap. dev->timing == NULL picks the profile from
+// VersionReg at Init.
+typedef struct {
+    uint32_t resetUs;         // Upper bound for the chip to answer after NRSTPD
+    uint32_t softResetUs;     // Upper bound for SoftReset to finish
+    uint16_t regGuardUs;      // After every register access
+    uint16_t cmdGuardUs;      // Before starting / after finishing a command
+    uint16_t rfOffUs;         // Field off to reset cards (blocking RequestA)
+    uint16_t rfOnUs;          // Field on before the first REQA
+} MFRC522_Timing_t;
+
+extern const MFRC522_Timing_t MFRC522_TimingGenuine;
+extern const MFRC522_Timing_t MFRC522_TimingClone;
 
+// Clone guard times tuned on the running chip; dev->timing then points at
+// dev->cal.timing. MFRC522_Calibrate picks the shortest register guard
+// whose writes all read back. cmdGuardUs is tuned from the detect -> UID
+// success rate: halved after a clean window, and put back to the last
+// good value (for good) once a window sees too many failed reads.
+#define MFRC522_AUTO_CALIBRATE  1
+#define MFRC522_CAL_TRIALS      64  // Write/read-back pairs per register guard candidate
+#define MFRC522_CAL_WINDOW      16  // Detects per cmdGuard step
+#define MFRC522_CAL_MAX_FAILS   1   // Failed UID reads tolerated per window
+
+typedef struct {
+    MFRC522_Timing_t timing;        // Working copy
+    const MFRC522_Timing_t *base;   // Profile it started from, the upper bound
+    uint16_t lastGoodCmdUs;         // cmdGuardUs before the last halving
+    uint8_t attempts;
+    uint8_t fails;
+    uint8_t settled;                // Backed off once, stop lowering
+} MFRC522_Cal_t;
+
+// SPI clock negotiation in MFRC522_BusInit. CubeMX sets the bus up slow
+// enough for any clone and wire length; the prescaler is then stepped down
+// to the fastest rate at which every reader passes write/read-back patterns
+// on TReloadReg, and the bus runs MFRC522_SPI_MARGIN steps below that,
+// never slower than the CubeMX rate. A reader whose received frames keep
+// failing CRC/BCC or coming back with a wrong FIFO level (more than
+// MFRC522_SPI_MAX_ERRORS in MFRC522_SPI_WINDOW) makes BusPoll probe again,
+// strictly below the rate in use.
+#define MFRC522_SPI_NEGOTIATE   1
+#define MFRC522_SPI_MAX_HZ      10000000  // RC522 SPI limit (datasheet)
+#define MFRC522_SPI_MARGIN      1         // Prescaler steps below the fastest passing rate
+#define MFRC522_SPI_ROUNDS      4         // Passes over the pattern table per reader and rate
+#define MFRC522_SPI_WINDOW      64        // Received frames per error-rate check
+#define MFRC522_SPI_MAX_ERRORS  4
+
+// Card UID as collected over the cascade levels (4, 7 or 10 bytes)
+typedef struct {
+    uint8_t size;
+    uint8_t bytes[10];
+    uint8_t sak;          // SAK of the last cascade level
+} MFRC522_Uid_t;
+
+typedef enum {
+    MFRC522_EVT_IDLE = 0,      // Nothing new, call again
+    MFRC522_EVT_DETECTED,      // A card answered REQA
+    MFRC522_EVT_UID_READY,     // dev->uid holds the new card's UID
+    MFRC522_EVT_REMOVED,       // The card left the field
+} MFRC522_Event_t;
+
+// Low-power idle accounting, all in ms. Multiply rfOnMs/probes by the RF
+// current of the board to get charge per probe.
 typedef struct {
+    uint32_t probes;          // REQA probes with the field on
+    uint32_t rfOnMs;          // Total time the field was on for idle probes
+    uint32_t rfOnStart;
+    uint32_t wakeups;         // Exits from soft power-down
+    uint32_t wakeMs;          // Total oscillator restart time
+    uint32_t wakeStart;
+    uint32_t wakeToDetectMs;  // Last wake-up to DETECTED latency
+} MFRC522_PowerStats_t;
+
+typedef struct MFRC522_s MFRC522_t;
+
+// Completion callback for asynchronous FIFO bursts, called from the DMA ISR
+typedef void (*MFRC522_Callback_t)(MFRC522_t *dev, uint8_t status, void *ctx);
+
+struct MFRC522_s {
     SPI_HandleTypeDef *hspi;
     GPIO_TypeDef *csPort;
     uint16_t csPin;
     GPIO_TypeDef *rstPort;
     uint16_t rstPin;
-} MFRC522_t;
+    GPIO_TypeDef *irqPort;          // NULL: no IRQ line, poll Status2Reg
+    uint16_t irqPin;
+    volatile uint8_t irqPending;    // Set from the EXTI callback
+    uint8_t useDma;                 // 1: bursts go through the SPI DMA channels
+    // Transceive in flight
+    uint8_t bitFraming;
+    uint32_t cmdStart;
+    uint32_t cmdTimeoutMs;
+    // MFRC522_Poll state
+    uint8_t pollState;
+    uint8_t pollMisses;
+    uint8_t cardPresent;
+    uint8_t pollBusy;               // Within MFRC522_POLL_BUSY_MS of card activity
+    uint16_t pollIntervalMs;        // Current idle probe interval
+    uint32_t pollBusyUntil;
+    uint32_t pollDeadline;
+    uint32_t lastEmptyUs;           // now_us() of the last REQA nobody answered, 0: none since a card
+    uint8_t atqa[2];                // Last ATQA from RequestA/Poll
+    MFRC522_Uid_t uid;              // Last card read by ReadUid/Poll
+    // Low-power idle
+    uint8_t lowPower;               // 1: soft power-down between idle probes
+    MFRC522_PowerStats_t power;
+    const MFRC522_Timing_t *timing; // NULL: chosen by MFRC522_Init
+    uint32_t profStartUs;           // now_us() when the detecting REQA went out
+    uint32_t initUs;                // MFRC522_Init duration (reset to ready)
+    MFRC522_Cal_t cal;
+    // Last value written to each configuration register the chip never
+    // changes on its own; Set/ClearBitMask write from it without a read
+    uint8_t shadow[0x40];
+    uint64_t shadowValid;           // Bit n: shadow[n] holds the register value
+    // Link quality since the last MFRC522_SPI_WINDOW check
+    uint16_t linkFrames;            // Frames received
+    uint16_t linkErrors;            // CRC, BCC or FIFO level errors
+};
+
+// Readers sharing one SPI bus, polled in turn by MFRC522_BusPoll
+typedef struct {
+    MFRC522_t **readers;
+    uint8_t count;
+    uint8_t next;       // Round-robin cursor
+    // SPI clock negotiation, SCK in Hz
+    uint32_t spiBootHz; // Set up by CubeMX, the floor
+    uint32_t spiCeilHz; // Upper bound for the next probe
+    uint32_t spiHz;     // In use
+    uint8_t spiReprobe; // Error rate climbed: probe once no reader is mid-command
+    uint16_t spiProbes;
+} MFRC522_Bus_t;
 
 // Prototypes
 void MFRC522_Init(MFRC522_t *dev);
+const MFRC522_Timing_t *MFRC522_TimingFor(uint8_t version);
+void MFRC522_Calibrate(MFRC522_t *dev);
+void MFRC522_IrqNotify(MFRC522_t *dev);
 void MFRC522_AntennaOff(MFRC522_t *dev);
 void MFRC522_AntennaOn(MFRC522_t *dev);
 uint8_t MFRC522_ReadReg(MFRC522_t *dev, uint8_t reg);
 void MFRC522_WriteReg(MFRC522_t *dev, uint8_t reg, uint8_t value);
+void MFRC522_ReadRegs(MFRC522_t *dev, const uint8_t *regs, uint8_t *values, uint8_t n);
+void MFRC522_WriteRegs(MFRC522_t *dev, const uint8_t *regVals, uint8_t n);
+void MFRC522_ReadFIFO(MFRC522_t *dev, uint8_t *buf, uint8_t n);
+void MFRC522_WriteFIFO(MFRC522_t *dev, const uint8_t *buf, uint8_t n);
+uint8_t MFRC522_ReadFIFOAsync(MFRC522_t *dev, uint8_t *buf, uint8_t n, MFRC522_Callback_t cb, void *ctx);
+uint8_t MFRC522_WriteFIFOAsync(MFRC522_t *dev, const uint8_t *buf, uint8_t n, MFRC522_Callback_t cb, void *ctx);
+uint8_t MFRC522_IsBusy(MFRC522_t *dev);
 void MFRC522_SetBitMask(MFRC522_t *dev, uint8_t reg, uint8_t mask);
 void MFRC522_ClearBitMask(MFRC522_t *dev, uint8_t reg, uint8_t mask);
 uint8_t MFRC522_RequestA(MFRC522_t *dev, uint8_t *atqa);
 uint8_t MFRC522_Anticoll(MFRC522_t *dev, uint8_t *uid);
 uint8_t MFRC522_ReadUid(MFRC522_t *dev, uint8_t *uid);
+uint8_t MFRC522_HaltA(MFRC522_t *dev);
+uint8_t MFRC522_Select(MFRC522_t *dev, MFRC522_Uid_t *uid);
+uint8_t MFRC522_SelectHalt(MFRC522_t *dev, const MFRC522_Uid_t *uid);
+uint8_t MFRC522_IsPresent(MFRC522_t *dev, const MFRC522_Uid_t *uid);
+uint8_t MFRC522_Inventory(MFRC522_t *dev, MFRC522_Uid_t *uids, uint8_t max, uint8_t *count);
+uint8_t MFRC522_CalcCRC(MFRC522_t *dev, const uint8_t *data, uint8_t len, uint8_t *out);
+// MIFARE Classic on the card selected last (Select/Poll UID_READY)
+uint8_t MFRC522_Authenticate(MFRC522_t *dev, uint8_t keyType, uint8_t block,
+                             const uint8_t *key, const MFRC522_Uid_t *uid);
+uint8_t MFRC522_ReadBlock(MFRC522_t *dev, uint8_t block, uint8_t *data);
+uint8_t MFRC522_WriteBlock(MFRC522_t *dev, uint8_t block, const uint8_t *data);
+void MFRC522_StopCrypto1(MFRC522_t *dev);
 uint8_t waitcardRemoval (MFRC522_t *dev);
 uint8_t waitcardDetect (MFRC522_t *dev);
+MFRC522_Event_t MFRC522_Poll(MFRC522_t *dev);
+void MFRC522_PowerDown(MFRC522_t *dev);
+uint8_t MFRC522_PowerUp(MFRC522_t *dev);
+void MFRC522_SetLowPower(MFRC522_t *dev, uint8_t enable);
+void MFRC522_BusInit(MFRC522_Bus_t *bus);
+void MFRC522_SpiNegotiate(MFRC522_Bus_t *bus);
+void MFRC522_SpiRateChanged(SPI_HandleTypeDef *hspi);
+int8_t MFRC522_BusPoll(MFRC522_Bus_t *bus, MFRC522_Event_t *evt);
 
 #endif
@@ -4,17 +4,36 @@
 #include "stdint.h"
 
 #define MaxTIMER 20
+#define TIM_WHEEL_SLOTS 32						//Power of two
 
-typedef struct
+#define TIM_ONESHOT  0
+#define TIM_PERIODIC 1
+
+typedef void (*timer_Cb_t)(void *ctx);
+
+typedef struct timer_s
 {
 	uint32_t En;
 	uint32_t SV;
-	uint32_t PV;
+	uint32_t PV;								//Tick the timer expires on next
 	uint32_t Output;
+	uint32_t Missed;							//Expiries while Output was still set
+	struct timer_s *next;						//Wheel slot list
+	struct timer_s *prev;
+	// Callback timers (timer_start); Cb == NULL keeps the Output flag API
+	timer_Cb_t Cb;
+	void *Ctx;
+	uint8_t Mode;								//TIM_ONESHOT / TIM_PERIODIC
+	uint32_t Late;								//Ticks late on the last dispatch
+	uint32_t MaxLate;
+	struct timer_s *due;						//Dispatch list for the current tick
 }timer_Objt;
 
-void startTim(timer_Objt *pTim, uint32_t SV);	//Start timer 10ms
-void stopTim(timer_Objt *pTim);								//Reset timer 10ms
+void startTim(timer_Objt *pTim, uint32_t SV);	//Start timer 1ms
+void stopTim(timer_Objt *pTim);								//Reset timer 1ms
 void scanTimer(void);
+uint32_t timGetTick(void);
+void timer_start(timer_Objt *pTim, uint32_t period, uint8_t mode, timer_Cb_t cb, void *ctx);
+void timer_stop(timer_Objt *pTim);
 void Timer_IT_Init(void);
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,27 @@
+#ifndef __actuator_h
+#define __actuator_h
+
+#include "stdint.h"
+
+// Gate feedback outputs (LEDs now, buzzer/relay on the same pins later)
+// driven by soft timers: a pattern is started and the call returns at
+// once, scanTimer switches the pin on and off. Starting a new pattern on a
+// busy channel replaces the old one.
+#define ACT_GREEN   0               // PA8, access granted
+#define ACT_RED     1               // PB15, access denied
+#define ACT_STATUS  2               // PC13 onboard LED (active low: "on" is dark)
+#define ACT_CAMERA  3               // PB14, capture trigger to the ESP32-CAM (rising edge)
+#define ACT_COUNT   4
+
+#define ACT_GRANT_MS    1000
+#define ACT_DENY_MS     1000
+#define ACT_UNKNOWN_MS  200
+#define ACT_TRIGGER_MS  10
+
+void Actuator_Init(void);
+// count pulses of onMs, separated by offMs
+void Actuator_Pulse(uint8_t ch, uint16_t onMs, uint16_t offMs, uint8_t count);
+void Actuator_On(uint8_t ch, uint16_t ms);
+void Actuator_Off(uint8_t ch);
+uint8_t Actuator_Busy(uint8_t ch);
+#endif
@@ -0,0 +1,46 @@
+#ifndef __app_rtos_h
+#define __app_rtos_h
+
+#include "stdint.h"
+
+// CMSIS-RTOS2 (FreeRTOS) variant of the superloop in main.c. Needs the
+// FREERTOS middleware (CMSIS_V2 interface) enabled in CubeMX and the HAL
+// timebase moved off SysTick (e.g. TIM4); then build with APP_RTOS=1.
+//
+//   reader   osPriorityHigh          MFRC522_BusPoll, woken by the RC522 IRQ
+//   actuator osPriorityAboveNormal   LEDs/buzzer/relay via the soft timers
+//   comms    osPriorityBelowNormal   owns USART1: printf, trace, proto, sync
+//
+// Tasks only talk through static message queues, so logging or a whitelist
+// sync can never hold up a card read.
+#ifndef APP_RTOS
+#define APP_RTOS 0
+#endif
+
+#define APP_READER_STACK    512     // Bytes
+#define APP_ACTUATOR_STACK  256
+#define APP_COMMS_STACK     768     // printf needs the most
+#define APP_QUEUE_DEPTH     8
+#define APP_STATS_MS        10000   // Stack high-water report period
+
+typedef struct {
+    uint8_t reader;
+    uint8_t event;                  // MFRC522_EVT_UID_READY / _REMOVED
+    uint8_t decision;               // PROTO_GRANTED / _DENIED / _UNKNOWN
+    uint8_t uidLen;
+    uint8_t uid[10];
+    uint32_t atUs;                  // now_us() of the detection
+} App_CardMsg_t;
+
+typedef struct {
+    uint16_t reader;                // Free stack bytes at the low point
+    uint16_t actuator;
+    uint16_t comms;
+} App_StackStats_t;
+
+// Creates the tasks and queues and starts the scheduler; does not return.
+// Peripherals, the readers (MFRC522_BusInit) and the whitelist must be
+// initialised before.
+void App_RtosStart(void);
+void App_GetStackStats(App_StackStats_t *st);
+#endif
@@ -0,0 +1,41 @@
+#ifndef __clock_h
+#define __clock_h
+
+#include "stdint.h"
+
+// Bus clock scaling between idle polling and card handling. SYSCLK stays
+// on the PLL (72 MHz) in both modes; idle only raises the AHB divider, so
+// ramping back up needs no PLL relock and costs a few microseconds.
+// Every switch re-derives the clocks that depend on HCLK/PCLK: SysTick
+// (inside HAL_RCC_ClockConfig), TIM2 prescaler (1 us count, 1 ms update),
+// SPI1 baud prescaler (same SCK as at boot or after MFRC522 negotiation,
+// or slower), USART1 BRR and the
+// DWT cycles-per-us. A switch waits for USART1 and SPI1 to be idle.
+// Bare-metal loop only: under APP_RTOS the kernel owns SysTick.
+#define ENABLE_CLOCK_SCALING 1
+
+#define CLOCK_FAST          0       // HCLK 72 MHz, PCLK1 36, PCLK2 72
+#define CLOCK_IDLE          1       // HCLK 9 MHz, PCLK1 9, PCLK2 9
+
+#define CLOCK_IDLE_DELAY_MS 2000    // Readers idle this long -> CLOCK_IDLE
+
+typedef struct {
+    uint32_t toFast;                // Completed switches per direction
+    uint32_t toIdle;
+    uint32_t lastUs;                // Register reprogramming of the last switch
+    uint32_t maxUs;
+    uint32_t lastWaitUs;            // Request to switch, waiting for idle buses
+    uint32_t maxWaitUs;
+} Clock_Stats_t;
+
+void Clock_Init(void);
+// SPI1 prescaler changed outside this module (MFRC522 rate negotiation):
+// its SCK now is the bound kept across later switches
+void Clock_SpiChanged(void);
+// Ask for a mode; applied at once if the buses are idle, else by Clock_Task
+void Clock_Request(uint8_t mode);
+// Call from the main loop; idle = nothing for the CPU to hurry about
+void Clock_Task(uint8_t idle);
+uint8_t Clock_Mode(void);
+const Clock_Stats_t *Clock_GetStats(void);
+#endif
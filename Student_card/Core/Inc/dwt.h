@@ -0,0 +1,18 @@
+#ifndef __dwt_h
+#define __dwt_h
+
+#include "stdint.h"
+
+// Microsecond delays and timestamps from the Cortex-M3 cycle counter
+// (DWT->CYCCNT, one count per HCLK). HAL_Delay/HAL_GetTick stay the 1 ms
+// base; use these where 1 ms is far too coarse (RC522 guard times, command
+// latency). CYCCNT wraps every 2^32 cycles (~59 s at 72 MHz): delay_us
+// is limited to that, and now_us must be called at least once per wrap
+// (the 1 s heartbeat does) to extend it to a 32-bit us count.
+// After an HCLK change call DWT_SetClock right away: cycles counted so
+// far are converted at the old rate, later ones at the new one.
+void DWT_Init(void);
+void DWT_SetClock(uint32_t hz);
+void delay_us(uint32_t us);
+uint32_t now_us(void);
+#endif
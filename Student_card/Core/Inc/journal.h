@@ -0,0 +1,58 @@
+#ifndef __journal_h
+#define __journal_h
+
+#include "stdint.h"
+#include "whitelist.h"
+
+// Append-only card event journal in the JOURNAL flash region, so events
+// survive while the host link is down. Records are written in sequence
+// order, circular over the pages. The page after the head is erased ahead
+// of time, when the readers are idle, so an append never waits for an
+// erase; one page's worth of capacity is always kept free for this. The
+// host replays with JRN_SYNC and confirms with JRN_ACK by sequence number.
+// The acknowledged point is journaled too, so after a reset only
+// unacknowledged records are sent again.
+#define JRN_PAGE_SIZE   1024
+#define JRN_PAGES       4
+#define JRN_QUEUE       8           // Appends waiting in RAM for the flash
+#define JRN_BATCH       8           // Records per replay batch
+#define JRN_RESEND_MS   1000        // Replay batch not acknowledged: send again
+
+// Record types
+#define JRN_CARD        0x01
+#define JRN_REMOVED     0x02
+#define JRN_ACKED       0xFE        // ts holds the acknowledged sequence number
+
+typedef struct {
+    uint32_t seq;                   // Programmed last; 0xFFFFFFFF = free slot
+    uint32_t ts;                    // HAL tick
+    uint8_t type;
+    uint8_t reader;
+    uint8_t decision;
+    uint8_t uidLen;
+    uint8_t uid[WL_UID_MAX];        // Every UID the whitelist can match
+    uint8_t reserved;               // 0xFF; keeps check the last of 24 bytes
+    uint8_t check;                  // Sum of the other bytes, catches torn writes
+} Journal_Rec_t;
+
+#define JRN_SLOTS       (JRN_PAGE_SIZE / sizeof(Journal_Rec_t))  // 42
+
+typedef struct {
+    uint32_t appended;
+    uint32_t lost;                  // Unacknowledged records erased or dropped
+    uint32_t acked;                 // Host has everything up to this seq
+    uint32_t head;                  // Last seq written
+} Journal_Stats_t;
+
+void journal_init(void);
+// Returns the record's sequence number (the tap seq carried in CARD frames)
+uint32_t journal_append(uint8_t type, uint8_t reader, uint8_t decision,
+                        const uint8_t *uid, uint8_t uidLen);
+// One flash step per call. idle: no card in any field, erases may run now
+void journal_task(uint8_t idle);
+uint8_t journal_busy(void);
+// Host side (from Proto_Poll)
+void journal_sync(uint32_t hostSeq);
+void journal_ack(uint32_t seq);
+const Journal_Stats_t *journal_stats(void);
+#endif
@@ -61,6 +61,15 @@ void Error_Handler(void);
 #define SDA_GPIO_Port GPIOA
 #define RESET_Pin GPIO_PIN_0
 #define RESET_GPIO_Port GPIOB
+#define RC522_IRQ_Pin GPIO_PIN_1
+#define RC522_IRQ_GPIO_Port GPIOB
+#define RC522_IRQ_EXTI_IRQn EXTI1_IRQn
+#define EXIT_SDA_Pin GPIO_PIN_12
+#define EXIT_SDA_GPIO_Port GPIOB
+#define EXIT_RESET_Pin GPIO_PIN_13
+#define EXIT_RESET_GPIO_Port GPIOB
+#define CAM_TRIG_Pin GPIO_PIN_14
+#define CAM_TRIG_GPIO_Port GPIOB
 #define LED_RED_Pin GPIO_PIN_15
 #define LED_RED_GPIO_Port GPIOB
 #define LED_GREEN_Pin GPIO_PIN_8
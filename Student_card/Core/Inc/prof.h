@@ -0,0 +1,59 @@
+#ifndef __prof_h
+#define __prof_h
+
+#include "stdint.h"
+
+// Latency profiling in RAM: per-phase histograms of now_us() durations
+// plus RC522 error counters. Read (and optionally cleared) with the
+// PROF_GET host command; tools/trace_decode.py prints the result.
+#define ENABLE_PROF     1
+
+#define PROF_BUCKETS    16
+#define PROF_MIN_SHIFT  4           // Bucket 0: < 32 us; bucket i: [2^(i+4), 2^(i+5)) us
+
+// Phases
+enum {
+    PROF_REQA = 0,                  // REQA sent -> ATQA in
+    PROF_ANTICOLL,                  // Full anticollision/select cascade
+    PROF_READUID,                   // REQA sent -> UID ready
+    PROF_DECISION,                  // Whitelist lookup
+    PROF_ACTUATOR,                  // Actuator start
+    PROF_TOTAL,                     // REQA sent -> actuator on
+    PROF_TAP,                       // Last empty REQA -> detected (tap-to-detect upper bound)
+    PROF_POLL_INTERVAL,             // Idle probe interval chosen, one sample per probe
+    PROF_PHASES
+};
+
+// Counters
+enum {
+    PROF_CNT_TIMEOUT = 0,           // No answer before the RC522 timer/backstop
+    PROF_CNT_BCC,                   // Bad BCC in an anticollision answer
+    PROF_CNT_FIFO,                  // Unexpected FIFO level
+    PROF_CNT_PROTOCOL,              // Protocol/parity/buffer error bits
+    PROF_CNT_COLLISION,
+    PROF_COUNTERS
+};
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint32_t sumUs;                 // Wraps after ~71 min of accumulated time
+    uint16_t hist[PROF_BUCKETS];    // Saturates at 0xFFFF
+} Prof_Hist_t;
+
+#if ENABLE_PROF
+void Prof_Record(uint8_t phase, uint32_t us);
+void Prof_Count(uint8_t counter);
+#define PROF_RECORD(phase, us)  Prof_Record(phase, us)
+#define PROF_COUNT(counter)     Prof_Count(counter)
+#else
+#define PROF_RECORD(phase, us)
+#define PROF_COUNT(counter)
+#endif
+
+const Prof_Hist_t *Prof_Get(uint8_t phase);
+uint32_t Prof_Counter(uint8_t counter);
+void Prof_Reset(void);
+void Prof_Send(void);               // One PROF frame per phase + a counters frame
+#endif
@@ -0,0 +1,57 @@
+#ifndef __proto_h
+#define __proto_h
+
+#include "stdint.h"
+
+// Framed binary events on USART1, sharing the port with printf text and
+// trace records (SOF is >= 0x80, text never is):
+//
+//   SOF | LEN | TYPE | SEQ | TS (u32 ms) | payload | CRC (u32)
+//
+// LEN counts TYPE..payload. CRC is the F103 CRC unit (CRC-32/MPEG-2,
+// 32-bit words, big-endian word order) over LEN..payload zero-padded to a
+// multiple of 4; the padding is not sent. Multi-byte fields are little
+// endian. SEQ increments per frame, so the host can spot lost or repeated
+// events; a BOOT frame marks a restart.
+#define PROTO_SOF          0xC5
+#define PROTO_MAX_PAYLOAD  49
+
+// Frame types
+#define PROTO_EVT_BOOT     0x01    // payload: none
+#define PROTO_EVT_CARD     0x02    // payload: reader, UID length, UID, decision, tap seq u32, epoch us u64
+#define PROTO_EVT_REMOVED  0x03    // payload: reader, epoch us u64
+#define PROTO_EVT_JOURNAL  0x04    // payload: seq u32, ts u32, type, reader, decision, UID length, UID
+#define PROTO_EVT_PROF     0x05    // payload: phase, count, min, max, sum (u32 us), 16 x u16 buckets
+                                   //       or 0xFF, counters u32 (see prof.h)
+#define PROTO_EVT_TIME     0x06    // payload: local us u64, epoch us u64, drift ppb i32, last error us i32
+// Event epoch times are 0 until the host has run a time sync (timesync.h)
+
+// Host commands (same framing, host -> board on PA10). Each command is
+// answered with one ACK; the host waits for it before sending the next.
+#define PROTO_CMD_WL_BEGIN   0x10  // payload: base version u16, new version u16
+#define PROTO_CMD_WL_ADD     0x11  // payload: allow, UID length, UID
+#define PROTO_CMD_WL_REMOVE  0x12  // payload: UID length, UID
+#define PROTO_CMD_WL_COMMIT  0x13  // payload: none; ACK once the flash is written
+#define PROTO_CMD_WL_QUERY   0x14  // payload: none
+#define PROTO_CMD_JRN_SYNC   0x15  // payload: last journal seq the host has u32 (0: none)
+#define PROTO_CMD_JRN_ACK    0x16  // payload: host has every record up to seq u32
+#define PROTO_CMD_PROF_GET   0x17  // payload: clear afterwards (0/1); answered with PROF frames
+#define PROTO_CMD_TIME_GET   0x18  // payload: none; answered with TIME (local = last Rx byte)
+#define PROTO_CMD_TIME_SET   0x19  // payload: local us u64, epoch us u64 at that instant
+#define PROTO_EVT_ACK        0x80  // payload: cmd type, cmd seq, status, version u16, count u16
+
+#define PROTO_RX_SIZE      256     // Power of two
+
+// Access decisions
+#define PROTO_DENIED       0x00
+#define PROTO_GRANTED      0x01
+#define PROTO_UNKNOWN      0x02
+
+void Proto_Init(void);
+uint32_t Proto_Crc(const uint8_t *data, uint16_t len);
+void Proto_Send(uint8_t type, const uint8_t *payload, uint8_t len);
+void Proto_SendCard(uint8_t reader, const uint8_t *uid, uint8_t uidLen, uint8_t decision,
+                    uint32_t tapSeq, uint32_t atUs);
+void Proto_SendRemoved(uint8_t reader);
+void Proto_Poll(void);
+#endif
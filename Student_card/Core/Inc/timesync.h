@@ -0,0 +1,38 @@
+#ifndef __timesync_h
+#define __timesync_h
+
+#include "stdint.h"
+
+// Board time on the server's epoch (us since 1970, UTC). The server is the
+// master: tools/timesync.py reads the board's 64-bit local us count with
+// PROTO_CMD_TIME_GET, picks the exchange with the lowest round trip and
+// sends back PROTO_CMD_TIME_SET {local, epoch} for that instant.
+//
+// Each SET re-anchors the offset. Once two SETs are TS_DRIFT_SPAN_US
+// apart their slope gives the local clock's drift (HSE crystal, tens of
+// ppm), smoothed over later spans, so events between syncs still land
+// within a few hundred us instead of drifting ~1 ms per minute.
+#define TS_DRIFT_SPAN_US    60000000ULL     // Shortest baseline for a drift sample
+#define TS_DRIFT_SHIFT      2               // Drift smoothing: new sample weighs 1/4
+#define TS_DRIFT_MAX_PPB    500000          // Reject samples beyond +-500 ppm (bad SET)
+
+typedef struct {
+    uint64_t refLocal;              // Last SET
+    uint64_t refEpoch;
+    int32_t driftPpb;               // Local clock runs fast by this much
+    int32_t lastErrUs;              // Last SET vs what the model predicted
+    uint32_t sets;
+    uint8_t synced;
+} TimeSync_Stats_t;
+
+void TimeSync_Init(void);
+// Extends now_us() past its 71 min wrap; call at least once per wrap
+// (the 1 s heartbeat does)
+uint64_t TimeSync_Local(void);
+// 64-bit local time of a recent now_us() stamp (less than one wrap old)
+uint64_t TimeSync_LocalAt(uint32_t us);
+// Epoch us of a local time; 0 until the first SET
+uint64_t TimeSync_Epoch(uint64_t local);
+void TimeSync_Set(uint64_t local, uint64_t epoch);
+void TimeSync_GetStats(TimeSync_Stats_t *st);
+#endif
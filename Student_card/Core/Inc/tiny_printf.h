@@ -0,0 +1,19 @@
+#ifndef __tiny_printf_h
+#define __tiny_printf_h
+
+#include <stdarg.h>
+#include <stddef.h>
+
+// Small non-allocating formatter for the log lines. Handles %d %u %x %X
+// %s %c %% with an optional '0' flag, a width and an 'l' length modifier
+// (ignored, int and long are both 32 bits here); no floats. With
+// TINY_PRINTF set this file also provides printf/puts/putchar, so newlib's
+// stdio (FILE buffers, malloc, locks) is no longer linked and the heap in
+// the linker script can stay empty. Output goes straight to uart_tx.
+// Bulk data still belongs in the binary trace (trace.h).
+#define TINY_PRINTF       1
+#define TINY_PRINTF_BENCH 0     // 1: print the cycle count of one log line at boot
+
+int tp_vsnprintf(char *buf, size_t size, const char *fmt, va_list ap);
+int tp_snprintf(char *buf, size_t size, const char *fmt, ...);
+#endif
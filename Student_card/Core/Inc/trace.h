@@ -0,0 +1,51 @@
+#ifndef __trace_h
+#define __trace_h
+
+#include "stdint.h"
+
+// Binary trace: an event ID and two small args go into a RAM ring with IRQs
+// masked for a few cycles; Trace_Drain hands them to the uart_tx ring in
+// the background. Each record goes on the wire as TRACE_SYNC followed by the
+// 8-byte Trace_Rec_t (little endian), so it can share the port with
+// printf text (always < 0x80). Decode with tools/trace_decode.py.
+#define ENABLE_TRACE  1
+
+#define TRACE_DEPTH   64        // Records, power of two
+#define TRACE_SYNC    0xA5
+#define TRACE_BATCH   8         // Records per Trace_Drain call
+
+// Event IDs. Keep tools/trace_decode.py in sync.
+enum {
+    TRACE_OVERFLOW = 0,         // b: records dropped while the ring was full
+    TRACE_RC522_INIT,           // a: version, b: init time, us
+    TRACE_RC522_WAIT_CARD,      // Blocking wait for a card started
+    TRACE_RC522_WAIT_REMOVAL,   // Blocking wait for removal started
+    TRACE_RC522_DETECTED,       // a: ATQA[0], b: ATQA[1]
+    TRACE_RC522_UID,            // a: UID size, b: UID[0..1]
+    TRACE_RC522_REMOVED,
+    TRACE_RC522_TIMEOUT,        // a: ComIrqReg
+    TRACE_RC522_ERROR,          // a: ErrorReg, b: FIFO level
+    TRACE_RC522_COLLISION,      // a: bit position, b: cascade level
+    TRACE_RC522_SAK,            // a: SAK
+    TRACE_RC522_POWERDOWN,
+    TRACE_RC522_WAKE,           // b: oscillator restart, ms
+    TRACE_CLOCK,                // a: new HCLK, MHz, b: switch time, us
+    TRACE_RC522_SPI,            // a: SPI baud prescaler bits, b: SCK, kHz
+};
+
+typedef struct {
+    uint32_t ts;                // HAL tick, ms
+    uint8_t id;
+    uint8_t a;
+    uint16_t b;
+} Trace_Rec_t;
+
+#if ENABLE_TRACE
+  #define TRACE(id, a, b) Trace_Put((id), (uint8_t)(a), (uint16_t)(b))
+#else
+  #define TRACE(id, a, b)
+#endif
+
+void Trace_Put(uint8_t id, uint8_t a, uint16_t b);
+void Trace_Drain(void);
+#endif
@@ -0,0 +1,32 @@
+#ifndef __uart_tx_h
+#define __uart_tx_h
+
+#include "stdint.h"
+
+// Non-blocking USART1 transmit: writers copy into a RAM ring and return,
+// DMA1 Channel4 drains it in chunks. One writer context (main loop) and
+// the DMA ISR share the ring without locks; only drop-oldest takes a short
+// critical section because it moves the reader index.
+#define UART_TX_RING_SIZE   512     // Power of two
+#define UART_TX_CHUNK       64      // Bytes per DMA transfer
+
+#define UART_TX_DROP_OLDEST 0       // Full ring: discard the oldest unsent bytes
+#define UART_TX_BLOCK       1       // Full ring: wait for the DMA to make room
+
+typedef struct {
+    uint32_t written;               // Bytes accepted
+    uint32_t dropped;               // Bytes discarded by drop-oldest
+    uint32_t overflows;             // Writes that found the ring full
+    uint16_t peak;                  // Highest ring fill level
+} UartTx_Stats_t;
+
+void UartTx_SetPolicy(uint8_t policy);
+uint16_t UartTx_Write(const uint8_t *buf, uint16_t len);
+uint16_t UartTx_Free(void);
+void UartTx_Flush(void);
+// Stop starting new DMA chunks (the running one completes), e.g. while the
+// bus clock and BRR change; UartTx_Idle reports when the line is quiet
+void UartTx_Hold(uint8_t on);
+uint8_t UartTx_Idle(void);
+const UartTx_Stats_t *UartTx_GetStats(void);
+#endif
@@ -0,0 +1,21 @@
+#ifndef __uid_cache_h
+#define __uid_cache_h
+
+#include "stdint.h"
+
+// Recently seen cards, so a card that lingers or is tapped again within
+// the suppression window is reported once. Keyed by reader + UID; a
+// small hash table gives O(1) lookups, an LRU list picks the entry to
+// reuse when the table is full.
+#define UID_CACHE_SIZE      16          // Entries
+#define UID_CACHE_BUCKETS   32          // Power of two
+#define UID_CACHE_WINDOW_MS 3000        // Default suppression window
+
+void UidCache_Init(uint32_t windowMs);
+void UidCache_SetWindow(uint32_t windowMs);
+// Record a sighting at nowMs; returns 1 if the same card was seen on this
+// reader within the window (do not report it again)
+uint8_t UidCache_Seen(uint8_t reader, const uint8_t *uid, uint8_t len, uint32_t nowMs);
+// Refresh last-seen without a decision, e.g. when the card leaves the field
+void UidCache_Touch(uint8_t reader, const uint8_t *uid, uint8_t len, uint32_t nowMs);
+#endif
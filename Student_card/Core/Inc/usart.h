@@ -35,6 +35,9 @@ extern "C" {
 extern UART_HandleTypeDef huart1;
 
 /* USER CODE BEGIN Private defines */
+// Link speed for printf/trace/proto frames; the host side must match.
+// 115200 keeps the CubeMX setting, e.g. 921600 for the binary protocol.
+#define LINK_BAUDRATE 115200U
 
 /* USER CODE END Private defines */
 
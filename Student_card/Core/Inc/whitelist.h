@@ -0,0 +1,91 @@
+#ifndef __whitelist_h
+#define __whitelist_h
+
+#include "stdint.h"
+
+// UID whitelist in its own flash region (WHITELIST in the linker script).
+//
+// The region is 16 x 1 KB pages. Cards are hashed into WL_BUCKETS buckets;
+// each bucket is one logical page holding two sorted arrays, 5-byte entries
+// for 4-byte UIDs followed by 11-byte entries for 7- and 10-byte UIDs, so a
+// lookup is a hash plus a binary search inside one page (at most 8 probes).
+// One more logical page holds the committed table version and one physical
+// page stays spare. A logical page is never rewritten in place: the new copy
+// goes to a free physical page with the next generation number and the old
+// one is erased only after the new header is programmed, so a power cut
+// leaves either copy intact.
+//
+// Capacity: a page holds WL_SHORT_MAX 4-byte or WL_LONG_MAX longer UIDs.
+// Buckets fill unevenly, so expect WL_ERR_FULL from about 2400 cards when
+// nearly all UIDs are 4 bytes (MIFARE Classic), about 900 when they are
+// 7 or 10 bytes. The region is what the 64 KB part leaves after the
+// firmware and the journal; more needs a larger part and WL_PAGES.
+#define WL_UID_MAX      10          // 4-, 7- and 10-byte UIDs
+#define WL_PAGE_SIZE    1024
+#define WL_PAGES        16          // Physical pages in the region
+#define WL_BUCKETS      14
+#define WL_META         WL_BUCKETS  // Logical page holding the version
+#define WL_LOGICAL      (WL_BUCKETS + 1)
+#define WL_PAGE_MAGIC   0x32504C57  // "WLP2"; pages of the 7-byte layout are ignored
+
+// Entry flags
+#define WL_FLAG_ALLOW   0x01        // Clear: explicitly denied (lost/blocked card)
+#define WL_FLAG_UID10   0x40        // Long entry holding a 10-byte UID
+#define WL_FLAG_UID7    0x80        // Long entry holding a 7-byte UID, zero-padded
+
+typedef struct {
+    uint32_t magic;                 // Programmed last: page is valid once set
+    uint8_t logical;                // Bucket index or WL_META
+    uint8_t count;                  // Short entries
+    uint16_t gen;                   // Newer copy of the same logical page wins
+    uint32_t crc;                   // Proto_Crc over both arrays
+    uint16_t version;               // Table version that wrote the page
+    uint16_t total;                 // Meta page: entries in all buckets
+    uint8_t longCount;              // Long entries, stored after the short ones
+    uint8_t reserved[3];
+} WL_PageHdr_t;
+
+typedef struct {
+    uint8_t uid[4];
+    uint8_t flags;
+} WL_Short_t;
+
+typedef struct {
+    uint8_t uid[WL_UID_MAX];
+    uint8_t flags;
+} WL_Long_t;
+
+#define WL_BODY_SIZE    (WL_PAGE_SIZE - sizeof(WL_PageHdr_t))
+#define WL_SHORT_MAX    (WL_BODY_SIZE / sizeof(WL_Short_t))
+#define WL_LONG_MAX     (WL_BODY_SIZE / sizeof(WL_Long_t))
+
+// Lookup results
+#define WL_NOT_FOUND    0
+#define WL_ALLOW        1
+#define WL_DENY         2
+
+// Sync command status (sent back in the ACK frame)
+#define WL_OK           0
+#define WL_ERR_STATE    1           // No sync open / already open
+#define WL_ERR_VERSION  2           // Base version is not the current one
+#define WL_ERR_FULL     3           // Bucket page has no room
+#define WL_ERR_ARG      4
+#define WL_ERR_FLASH    5           // Erase/program failed, sync aborted
+#define WL_BUSY         0xFF        // Flash step pending: retry the same delta later
+
+uint8_t whitelist_init(void);
+uint8_t whitelist_lookup(const uint8_t *uid, uint8_t uidLen);
+uint16_t whitelist_count(void);
+uint16_t whitelist_version(void);
+
+// Incremental sync: begin, any number of add/remove deltas, commit. Flash
+// work is done a step at a time from whitelist_task, so cards keep being
+// served; whitelist_busy() is set while a step is still pending.
+uint8_t whitelist_begin(uint16_t baseVersion, uint16_t newVersion);
+uint8_t whitelist_add(const uint8_t *uid, uint8_t uidLen, uint8_t allow);
+uint8_t whitelist_remove(const uint8_t *uid, uint8_t uidLen);
+uint8_t whitelist_commit(void);
+uint8_t whitelist_busy(void);
+uint8_t whitelist_error(void);     // WL_ERR_FLASH once after an aborted sync
+void whitelist_task(void);
+#endif
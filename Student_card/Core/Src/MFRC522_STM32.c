@@ -1,49 +1,218 @@
 #include "MFRC522_STM32.h"
 #include "main.h"
+#include "trace.h"
+#include "dwt.h"
+#include "prof.h"
+#include <string.h>
 
-uint8_t atqa[2];
+
+// Devices with a wired IRQ line, looked up from the EXTI callback
+static MFRC522_t *irqDevices[MFRC522_MAX_IRQ_DEVICES];
+
+// DMA transfer in flight on the bus. Async bursts stage their frames in the
+// static buffers; a read destination must stay valid until the callback.
+static struct {
+    MFRC522_t *dev;
+    volatile uint8_t busy;
+    uint8_t status;
+    uint8_t *dst;                   // Read burst destination, NULL for writes
+    uint8_t n;
+    MFRC522_Callback_t cb;
+    void *ctx;
+    uint8_t tx[MFRC522_FIFO_SIZE + 1];
+    uint8_t rx[MFRC522_FIFO_SIZE + 1];
+} dmaXfer;
+
+const MFRC522_Timing_t MFRC522_TimingGenuine = {
+    .resetUs = 1000, .softResetUs = 1000,
+    .regGuardUs = 0, .cmdGuardUs = 0,
+    .rfOffUs = 1000, .rfOnUs = 1000,
+};
+
+// Measured on the FM17522/"0x12" clones: short gaps, slow oscillator start
+const MFRC522_Timing_t MFRC522_TimingClone = {
+    .resetUs = 50000, .softResetUs = 50000,
+    .regGuardUs = 10, .cmdGuardUs = 200,
+    .rfOffUs = 5000, .rfOnUs = 5000,
+};
+
+// Timing profile by VersionReg; anything not listed is treated as a clone
+static const struct {
+    uint8_t version;
+    const MFRC522_Timing_t *timing;
+} chipProfiles[] = {
+    {0x91, &MFRC522_TimingGenuine},  // NXP MFRC522 v1.0
+    {0x92, &MFRC522_TimingGenuine},  // NXP MFRC522 v2.0
+    {0x88, &MFRC522_TimingClone},    // FM17522
+    {0x12, &MFRC522_TimingClone},    // Unbranded clone
+};
+
+const MFRC522_Timing_t *MFRC522_TimingFor(uint8_t version) {
+    for (uint8_t i = 0; i < sizeof(chipProfiles) / sizeof(chipProfiles[0]); i++) {
+        if (chipProfiles[i].version == version) return chipProfiles[i].timing;
+    }
+    return &MFRC522_TimingClone;
+}
+
+static inline void MFRC522_Guard(uint32_t us) {
+    if (us) delay_us(us);
+}
+
+static void MFRC522_RegisterIrq(MFRC522_t *dev) {
+    for (int i = 0; i < MFRC522_MAX_IRQ_DEVICES; i++) {
+        if (irqDevices[i] == dev) return;
+        if (irqDevices[i] == NULL) {
+            irqDevices[i] = dev;
+            return;
+        }
+    }
+    USER_LOG("No IRQ slot left, polling instead");
+    dev->irqPort = NULL;
+}
+
+// Called from the EXTI ISR after irqPending is set; an RTOS build
+// overrides it to wake the reader task
+__weak void MFRC522_IrqNotify(MFRC522_t *dev) {
+    (void)dev;
+}
+
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin) {
+    for (int i = 0; i < MFRC522_MAX_IRQ_DEVICES; i++) {
+        if (irqDevices[i] != NULL && irqDevices[i]->irqPin == GPIO_Pin) {
+            irqDevices[i]->irqPending = 1;
+            MFRC522_IrqNotify(irqDevices[i]);
+        }
+    }
+}
+
+// Configuration written in one WriteRegs pass, then read back in one burst.
+// initMask leaves out reserved bits whose read-back value is undefined.
+static const uint8_t initRegs[] = {
+    PCD_ModeReg,       0x3D,  // CRC coprocessor preset 0x6363 (CRC_A); reset value gives 0xFFFF
+    PCD_TModeReg,      0x80,  // TAuto: start when Tx ends
+    PCD_TPrescalerReg, 0xA9,  // 40kHz clock, 25us/tick
+    PCD_TReloadRegH,   0x03,  // 1000 ticks = 25ms default; set per command in MFRC522_Kick
+    PCD_TReloadRegL,   0xE8,
+    PCD_TxAutoReg,     0x40,  // 100% ASK modulation
+    PCD_RFCfgReg,      0x7F,  // Max gain (48dB)
+    PCD_DemodReg,      0x4D,  // Sensitivity for clones
+};
+static const uint8_t initMask[] = {0xAB, 0xFF, 0xFF, 0xFF, 0xFF, 0x40, 0x70, 0xFF};
+#define INIT_REGS (sizeof(initMask))
+
+// Wait until the RC522 answers over SPI with its oscillator running:
+// PowerDown clear in CommandReg and a VersionReg that is not a floating bus.
+// Returns the version, or 0 if it did not come up within timeoutUs.
+static uint8_t MFRC522_WaitReady(MFRC522_t *dev, uint32_t timeoutUs) {
+    static const uint8_t regs[] = {PCD_CommandReg, PCD_VersionReg};
+    uint8_t v[2];
+    uint32_t start = now_us();
+    do {
+        MFRC522_ReadRegs(dev, regs, v, 2);
+        if (v[0] != 0xFF && !(v[0] & PCD_PowerDown) && v[1] != 0x00 && v[1] != 0xFF) {
+            return v[1];
+        }
+    } while (now_us() - start < timeoutUs);
+    return 0;
+}
+
+// 0 if every initRegs value reads back
+static uint8_t MFRC522_VerifyInit(MFRC522_t *dev) {
+    uint8_t regs[INIT_REGS];
+    uint8_t vals[INIT_REGS];
+    for (uint8_t i = 0; i < INIT_REGS; i++) regs[i] = initRegs[2 * i];
+    MFRC522_ReadRegs(dev, regs, vals, INIT_REGS);
+    for (uint8_t i = 0; i < INIT_REGS; i++) {
+        if ((vals[i] ^ initRegs[2 * i + 1]) & initMask[i]) return regs[i];
+    }
+    return 0;
+}
+
+// Registers only the driver writes: no status bits the chip updates and no
+// self-clearing bits, so the last written value is what a read would return.
+// CommandReg, Status2Reg, the IRQ and FIFO registers, BitFramingReg
+// (StartSend) and CollReg (CollPos is status) are always read from the chip.
+#define REG_BIT(reg) (1ULL << (reg))
+static const uint64_t shadowRegs =
+    REG_BIT(PCD_ComIEnReg) | REG_BIT(PCD_DivIEnReg) |
+    REG_BIT(PCD_ModeReg) | REG_BIT(PCD_TxModeReg) | REG_BIT(PCD_RxModeReg) |
+    REG_BIT(PCD_TxControlReg) | REG_BIT(PCD_TxAutoReg) | REG_BIT(PCD_DemodReg) |
+    REG_BIT(PCD_RFCfgReg) | REG_BIT(PCD_TModeReg) | REG_BIT(PCD_TPrescalerReg);
+
+static inline void MFRC522_Shadow(MFRC522_t *dev, uint8_t reg, uint8_t value) {
+    if (shadowRegs & REG_BIT(reg)) {
+        dev->shadow[reg] = value;
+        dev->shadowValid |= REG_BIT(reg);
+    }
+}
 
 void MFRC522_Init(MFRC522_t *dev) {
+    static const uint8_t flush[] = {
+        PCD_ComIrqReg,    0x7F,         // Clear interrupts
+        PCD_FIFOLevelReg, 0x80,         // Flush FIFO
+    };
+    uint32_t t0 = now_us();
     USER_LOG("MFRC522 Min Init started");
-    // Hardware reset
+    // Chip unknown until VersionReg is read: the slow profile bounds the waits
+    uint8_t autoTiming = (dev->timing == NULL);
+    if (autoTiming) dev->timing = &MFRC522_TimingClone;
+    const MFRC522_Timing_t *t = dev->timing;
+
+    // Hardware reset: short NRSTPD pulse, then poll until the chip answers
+    // instead of sleeping for the worst-case oscillator start. Every
+    // register is back at its reset value, the shadow with them.
+    dev->shadowValid = 0;
     HAL_GPIO_WritePin(dev->rstPort, dev->rstPin, GPIO_PIN_RESET);
-    HAL_Delay(50);
+    delay_us(MFRC522_RESET_PULSE_US);
     HAL_GPIO_WritePin(dev->rstPort, dev->rstPin, GPIO_PIN_SET);
-    HAL_Delay(50);
+    uint8_t version = MFRC522_WaitReady(dev, t->resetUs);
 
-    // Soft reset
+    // Soft reset; done once the oscillator runs again (PowerDown clears)
     MFRC522_WriteReg(dev, PCD_CommandReg, PCD_SoftReset);
-    HAL_Delay(50);
-
-    // Clear interrupts
-    MFRC522_WriteReg(dev, PCD_ComIrqReg, 0x7F);
+    if (MFRC522_WaitReady(dev, t->softResetUs) == 0) {
+        USER_LOG("No answer after reset");
+    }
 
-    // Flush FIFO
-    MFRC522_WriteReg(dev, PCD_FIFOLevelReg, 0x80);
+    // Genuine chips need no guard times, so the table below goes out at full speed
+    if (autoTiming) dev->timing = MFRC522_TimingFor(version);
+    if (MFRC522_TimingFor(version) == &MFRC522_TimingGenuine) {
+        USER_LOG("Version: 0x%02X", version);
+    } else {
+        USER_LOG("Version: 0x%02X (counterfeit OK for UID)", version);
+    }
 
-    // Timer: ~25ms timeout
-    MFRC522_WriteReg(dev, PCD_TModeReg, 0x80);      // Timer starts immediately
-    MFRC522_WriteReg(dev, PCD_TPrescalerReg, 0xA9); // 80kHz clock
-    MFRC522_WriteReg(dev, PCD_TReloadRegH, 0x03);   // 1000 ticks = ~12.5ms
-    MFRC522_WriteReg(dev, PCD_TReloadRegL, 0xE8);
+    MFRC522_WriteRegs(dev, flush, 2);
+    MFRC522_WriteRegs(dev, initRegs, INIT_REGS);
+    uint8_t bad = MFRC522_VerifyInit(dev);
+    if (bad) {
+        // Some clones drop back-to-back writes: redo with per-register guards
+        DEBUG_LOG("Init read-back mismatch at 0x%02X, rewriting", bad);
+        for (uint8_t i = 0; i < INIT_REGS; i++) {
+            MFRC522_WriteReg(dev, initRegs[2 * i], initRegs[2 * i + 1]);
+            delay_us(MFRC522_TimingClone.regGuardUs);
+        }
+        bad = MFRC522_VerifyInit(dev);
+        if (bad) {
+            USER_LOG("Init read-back failed at reg 0x%02X", bad);
+            TRACE(TRACE_RC522_ERROR, bad, 0);
+            dev->shadowValid = 0;  // Written values did not all stick
+        }
+    }
 
-    // RF settings
-    MFRC522_WriteReg(dev, PCD_TxAutoReg, 0x40);     // 100% ASK modulation
-    MFRC522_WriteReg(dev, PCD_RFCfgReg, 0x7F);      // Max gain (48dB)
-    MFRC522_WriteReg(dev, PCD_DemodReg, 0x4D);      // Sensitivity for clones
+    // IRQ pin: push-pull, active low, raised on Rx/Idle/Err/Timer
+    if (dev->irqPort != NULL) {
+        MFRC522_WriteReg(dev, PCD_DivIEnReg, 0x80);
+        MFRC522_WriteReg(dev, PCD_ComIEnReg, 0x80 | PCD_IRQ_WAIT);
+        MFRC522_RegisterIrq(dev);
+    }
 
-    // Enable antenna
+    // Enable antenna. No settle wait here: Poll waits before its first REQA
+    // and the blocking RequestA waits rfOnUs itself.
     MFRC522_AntennaOn(dev);
-    HAL_Delay(10);  // Let RF stabilize
 
-    uint8_t version = MFRC522_ReadReg(dev, PCD_VersionReg);
-    if ((version != 0x91)||(version != 0x92)){
-    	USER_LOG("Version: 0x%02X (counterfeit OK for UID)", version);
-    }
-    else USER_LOG("Version: 0x%02X", version);
-    uint8_t txCtrl = MFRC522_ReadReg(dev, PCD_TxControlReg);
-    DEBUG_LOG("TxControlReg: 0x%02X (expect >= 0x03)", txCtrl);
-    USER_LOG("MFRC522 Min Init complete");
+    dev->initUs = now_us() - t0;
+    TRACE(TRACE_RC522_INIT, version, dev->initUs > 0xFFFF ? 0xFFFF : dev->initUs);
+    USER_LOG("MFRC522 ready in %lu us", (unsigned long)dev->initUs);
 }
 
 void MFRC522_AntennaOff(MFRC522_t *dev) {
@@ -59,182 +228,1310 @@ void MFRC522_AntennaOn(MFRC522_t *dev) {
 uint8_t MFRC522_ReadReg(MFRC522_t *dev, uint8_t reg) {
     uint8_t addr = ((reg << 1) & 0x7E) | 0x80;
     uint8_t val = 0;
+    while (dmaXfer.busy) {}
     HAL_GPIO_WritePin(dev->csPort, dev->csPin, GPIO_PIN_RESET);
     HAL_SPI_Transmit(dev->hspi, &addr, 1, HAL_MAX_DELAY);
     HAL_SPI_Receive(dev->hspi, &val, 1, HAL_MAX_DELAY);
     HAL_GPIO_WritePin(dev->csPort, dev->csPin, GPIO_PIN_SET);
-    HAL_Delay(1);
+    MFRC522_Guard(dev->timing->regGuardUs);
     DEBUG_LOG("ReadReg: 0x%02X -> 0x%02X", reg, val);
     return val;
 }
 
 void MFRC522_WriteReg(MFRC522_t *dev, uint8_t reg, uint8_t value) {
     uint8_t addr = (reg << 1) & 0x7E;
+    while (dmaXfer.busy) {}
     HAL_GPIO_WritePin(dev->csPort, dev->csPin, GPIO_PIN_RESET);
     HAL_SPI_Transmit(dev->hspi, &addr, 1, HAL_MAX_DELAY);
     HAL_SPI_Transmit(dev->hspi, &value, 1, HAL_MAX_DELAY);
     HAL_GPIO_WritePin(dev->csPort, dev->csPin, GPIO_PIN_SET);
-    HAL_Delay(1);
+    MFRC522_Guard(dev->timing->regGuardUs);
+    MFRC522_Shadow(dev, reg, value);
     DEBUG_LOG("WriteReg: 0x%02X = 0x%02X", reg, value);
 }
 
+static uint8_t MFRC522_StartDma(MFRC522_t *dev, uint8_t *tx, uint8_t *rx, uint16_t len) {
+    if (dmaXfer.busy) return STATUS_ERROR;
+    dmaXfer.dev = dev;
+    dmaXfer.busy = 1;
+    dmaXfer.status = STATUS_OK;
+    HAL_GPIO_WritePin(dev->csPort, dev->csPin, GPIO_PIN_RESET);
+    if (HAL_SPI_TransmitReceive_DMA(dev->hspi, tx, rx, len) != HAL_OK) {
+        HAL_GPIO_WritePin(dev->csPort, dev->csPin, GPIO_PIN_SET);
+        dmaXfer.busy = 0;
+        return STATUS_ERROR;
+    }
+    return STATUS_OK;
+}
+
+// One CS-framed full-duplex transfer; the RC522 shifts out the answer to
+// byte i while byte i+1 is being clocked in.
+static void MFRC522_Transfer(MFRC522_t *dev, uint8_t *tx, uint8_t *rx, uint16_t len) {
+    while (dmaXfer.busy) {}  // Never interleave with an async burst
+    if (dev->useDma && len >= MFRC522_DMA_MIN_LEN) {
+        dmaXfer.cb = NULL;
+        dmaXfer.dst = NULL;
+        if (MFRC522_StartDma(dev, tx, rx, len) == STATUS_OK) {
+            while (dmaXfer.busy) {
+                __WFI();
+            }
+            return;
+        }
+    }
+    HAL_GPIO_WritePin(dev->csPort, dev->csPin, GPIO_PIN_RESET);
+    HAL_SPI_TransmitReceive(dev->hspi, tx, rx, len, HAL_MAX_DELAY);
+    HAL_GPIO_WritePin(dev->csPort, dev->csPin, GPIO_PIN_SET);
+}
+
+static void MFRC522_DmaDone(SPI_HandleTypeDef *hspi, uint8_t status) {
+    MFRC522_t *dev = dmaXfer.dev;
+    if (!dmaXfer.busy || dev == NULL || dev->hspi != hspi) return;
+    HAL_GPIO_WritePin(dev->csPort, dev->csPin, GPIO_PIN_SET);
+    if (dmaXfer.dst != NULL && status == STATUS_OK) {
+        for (uint8_t i = 0; i < dmaXfer.n; i++) {
+            dmaXfer.dst[i] = dmaXfer.rx[i + 1];
+        }
+    }
+    dmaXfer.status = status;
+    dmaXfer.busy = 0;
+    if (dmaXfer.cb != NULL) {
+        MFRC522_Callback_t cb = dmaXfer.cb;
+        dmaXfer.cb = NULL;
+        cb(dev, status, dmaXfer.ctx);
+    }
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi) {
+    MFRC522_DmaDone(hspi, STATUS_OK);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi) {
+    MFRC522_DmaDone(hspi, STATUS_ERROR);
+}
+
+void MFRC522_ReadRegs(MFRC522_t *dev, const uint8_t *regs, uint8_t *values, uint8_t n) {
+    uint8_t tx[MFRC522_BURST_MAX + 1];
+    uint8_t rx[MFRC522_BURST_MAX + 1];
+    if (n == 0 || n > MFRC522_BURST_MAX) return;
+    for (uint8_t i = 0; i < n; i++) {
+        tx[i] = ((regs[i] << 1) & 0x7E) | 0x80;
+    }
+    tx[n] = 0x00;  // Terminates the read sequence
+    MFRC522_Transfer(dev, tx, rx, n + 1);
+    for (uint8_t i = 0; i < n; i++) {
+        values[i] = rx[i + 1];
+    }
+    DEBUG_LOG("ReadRegs: %d regs from 0x%02X", n, regs[0]);
+}
+
+void MFRC522_WriteRegs(MFRC522_t *dev, const uint8_t *regVals, uint8_t n) {  // regVals: {reg, val} pairs
+    uint8_t tx[2];
+    uint8_t rx[2];
+    // The RC522 keeps the address latched for the whole CS frame, so each
+    // register still needs its own frame, but no settle delay in between.
+    for (uint8_t i = 0; i < n; i++) {
+        tx[0] = (regVals[2 * i] << 1) & 0x7E;
+        tx[1] = regVals[2 * i + 1];
+        MFRC522_Transfer(dev, tx, rx, 2);
+        MFRC522_Shadow(dev, regVals[2 * i], regVals[2 * i + 1]);
+    }
+    DEBUG_LOG("WriteRegs: %d regs", n);
+}
+
+void MFRC522_ReadFIFO(MFRC522_t *dev, uint8_t *buf, uint8_t n) {
+    uint8_t tx[MFRC522_FIFO_SIZE + 1];
+    uint8_t rx[MFRC522_FIFO_SIZE + 1];
+    if (n == 0 || n > MFRC522_FIFO_SIZE) return;
+    for (uint8_t i = 0; i < n; i++) {
+        tx[i] = ((PCD_FIFODataReg << 1) & 0x7E) | 0x80;
+    }
+    tx[n] = 0x00;
+    MFRC522_Transfer(dev, tx, rx, n + 1);
+    for (uint8_t i = 0; i < n; i++) {
+        buf[i] = rx[i + 1];
+    }
+    DEBUG_LOG("ReadFIFO: %d bytes", n);
+}
+
+void MFRC522_WriteFIFO(MFRC522_t *dev, const uint8_t *buf, uint8_t n) {
+    uint8_t tx[MFRC522_FIFO_SIZE + 1];
+    uint8_t rx[MFRC522_FIFO_SIZE + 1];
+    if (n == 0 || n > MFRC522_FIFO_SIZE) return;
+    tx[0] = (PCD_FIFODataReg << 1) & 0x7E;
+    for (uint8_t i = 0; i < n; i++) {
+        tx[i + 1] = buf[i];
+    }
+    MFRC522_Transfer(dev, tx, rx, n + 1);
+    DEBUG_LOG("WriteFIFO: %d bytes", n);
+}
+
+// Asynchronous FIFO bursts: return as soon as the DMA is armed. The callback
+// runs in interrupt context once CS is released; keep it short.
+uint8_t MFRC522_ReadFIFOAsync(MFRC522_t *dev, uint8_t *buf, uint8_t n, MFRC522_Callback_t cb, void *ctx) {
+    if (n == 0 || n > MFRC522_FIFO_SIZE || dmaXfer.busy) return STATUS_ERROR;
+    for (uint8_t i = 0; i < n; i++) {
+        dmaXfer.tx[i] = ((PCD_FIFODataReg << 1) & 0x7E) | 0x80;
+    }
+    dmaXfer.tx[n] = 0x00;
+    dmaXfer.dst = buf;
+    dmaXfer.n = n;
+    dmaXfer.cb = cb;
+    dmaXfer.ctx = ctx;
+    return MFRC522_StartDma(dev, dmaXfer.tx, dmaXfer.rx, n + 1);
+}
+
+uint8_t MFRC522_WriteFIFOAsync(MFRC522_t *dev, const uint8_t *buf, uint8_t n, MFRC522_Callback_t cb, void *ctx) {
+    if (n == 0 || n > MFRC522_FIFO_SIZE || dmaXfer.busy) return STATUS_ERROR;
+    dmaXfer.tx[0] = (PCD_FIFODataReg << 1) & 0x7E;
+    for (uint8_t i = 0; i < n; i++) {
+        dmaXfer.tx[i + 1] = buf[i];
+    }
+    dmaXfer.dst = NULL;
+    dmaXfer.n = n;
+    dmaXfer.cb = cb;
+    dmaXfer.ctx = ctx;
+    return MFRC522_StartDma(dev, dmaXfer.tx, dmaXfer.rx, n + 1);
+}
+
+uint8_t MFRC522_IsBusy(MFRC522_t *dev) {
+    return dmaXfer.busy && dmaXfer.dev == dev;
+}
+
+// Current value for a read-modify-write: from the shadow when the register
+// has one and was written since reset, else over SPI
+static uint8_t MFRC522_RegValue(MFRC522_t *dev, uint8_t reg) {
+    if (dev->shadowValid & REG_BIT(reg)) return dev->shadow[reg];
+    return MFRC522_ReadReg(dev, reg);
+}
+
 void MFRC522_SetBitMask(MFRC522_t *dev, uint8_t reg, uint8_t mask) {
-    uint8_t tmp = MFRC522_ReadReg(dev, reg);
+    uint8_t tmp = MFRC522_RegValue(dev, reg);
     MFRC522_WriteReg(dev, reg, tmp | mask);
     DEBUG_LOG("SetBitMask: 0x%02X |= 0x%02X", reg, mask);
 }
 
 void MFRC522_ClearBitMask(MFRC522_t *dev, uint8_t reg, uint8_t mask) {
-    uint8_t tmp = MFRC522_ReadReg(dev, reg);
+    uint8_t tmp = MFRC522_RegValue(dev, reg);
     MFRC522_WriteReg(dev, reg, tmp & (~mask));
     DEBUG_LOG("ClearBitMask: 0x%02X &= ~0x%02X", reg, mask);
 }
 
+// Load a frame into the FIFO without starting it. framing is BitFramingReg:
+// TxLastBits (bits 2..0) is the number of valid bits in the last byte
+// (0 = whole byte, 7 for REQA); RxAlign (bits 6..4) is where the first
+// received bit lands during bit-oriented anticollision. With crc
+// set the RC522 appends CRC_A on Tx and checks/strips it on Rx.
+static void MFRC522_LoadFrame(MFRC522_t *dev, const uint8_t *data, uint8_t len, uint8_t framing, uint8_t crc) {
+    uint8_t setup[] = {
+        PCD_ComIrqReg,     0x7F,        // Clear IRQs
+        PCD_FIFOLevelReg,  0x80,        // Flush FIFO
+        PCD_BitFramingReg, framing,
+        PCD_TxModeReg,     crc ? 0x80 : 0x00,  // TxCRCEn, 106 kBd
+        PCD_RxModeReg,     crc ? 0x80 : 0x00,  // RxCRCEn, 106 kBd
+    };
+    MFRC522_WriteRegs(dev, setup, 5);
+    MFRC522_WriteFIFO(dev, data, len);
+    dev->bitFraming = framing;
+}
+
+// Start the loaded FIFO contents with cmd (Transceive or MFAuthent); the
+// RC522 switches to receive after sending. TAuto starts the RC522 timer when
+// transmission ends, so timeoutUs bounds the wait for the card's answer and
+// TimerIRq ends an unanswered command.
+static void MFRC522_KickCommand(MFRC522_t *dev, uint8_t cmd, uint32_t timeoutUs) {
+    uint32_t reload = timeoutUs / MFRC522_TIMER_TICK_US;
+    if (reload == 0) reload = 1;
+    if (reload > 0xFFFF) reload = 0xFFFF;
+    uint8_t start[] = {
+        PCD_TReloadRegH,   (uint8_t)(reload >> 8),
+        PCD_TReloadRegL,   (uint8_t)reload,
+        PCD_CommandReg,    cmd,
+        PCD_BitFramingReg, 0x80 | dev->bitFraming,  // StartSend
+    };
+    dev->irqPending = 0;
+    dev->cmdStart = HAL_GetTick();
+    // Software backstop in case the IRQ line or timer never fires
+    dev->cmdTimeoutMs = timeoutUs / 1000 + MFRC522_TIMEOUT_MARGIN_MS;
+    // StartSend only matters to Transceive; MFAuthent sends on its own
+    MFRC522_WriteRegs(dev, start, (cmd == PCD_Transceive) ? 4 : 3);
+}
+
+static void MFRC522_Kick(MFRC522_t *dev, uint32_t timeoutUs) {
+    MFRC522_KickCommand(dev, PCD_Transceive, timeoutUs);
+}
+
+// Check once whether the running transceive finished and fetch
+// Status2/Error/FIFOLevel. Returns STATUS_BUSY while it is still running.
+// Completion is taken from ComIrqReg: RxIRq/ErrIRq mean an answer (or a
+// broken one) is in, TimerIRq means the card never answered. With the IRQ
+// line wired nothing is read over SPI until the RC522 signals one of them.
+static uint8_t MFRC522_CheckComplete(MFRC522_t *dev, uint8_t *status) {
+    static const uint8_t statusRegs[] = {PCD_Status2Reg, PCD_ErrorReg, PCD_FIFOLevelReg};
+
+    uint8_t expired = (HAL_GetTick() - dev->cmdStart >= dev->cmdTimeoutMs);
+    if (dev->irqPort != NULL) {
+        if (!dev->irqPending) {
+            return expired ? STATUS_TIMEOUT : STATUS_BUSY;
+        }
+        dev->irqPending = 0;
+    }
+
+    uint8_t irq = MFRC522_ReadReg(dev, PCD_ComIrqReg);
+    if (irq & (PCD_IRQ_RX | PCD_IRQ_ERR)) {
+        MFRC522_ReadRegs(dev, statusRegs, status, 3);
+        dev->linkFrames++;
+        return STATUS_OK;
+    }
+    if (irq & PCD_IRQ_TIMER) {  // No answer within timeoutUs
+        TRACE(TRACE_RC522_TIMEOUT, irq, 0);
+        return STATUS_TIMEOUT;
+    }
+    return expired ? STATUS_TIMEOUT : STATUS_BUSY;
+}
+
+// Blocking wrapper around CheckComplete for the synchronous API
+static uint8_t MFRC522_WaitComplete(MFRC522_t *dev, uint8_t *status) {
+    uint8_t res;
+    while ((res = MFRC522_CheckComplete(dev, status)) == STATUS_BUSY) {
+        if (dev->irqPort != NULL) {
+            __WFI();  // RC522 IRQ or SysTick wakes us
+        }
+    }
+    return res;
+}
+
+// Validate a finished REQA and fetch the ATQA; leaves the RC522 idle
+static uint8_t MFRC522_FinishRequestA(MFRC522_t *dev, const uint8_t *status, uint8_t *atqa) {
+    uint8_t err = status[1];
+    uint8_t fifoLvl = status[2] & 0x7F;
+    if (err & 0x1D) {  // Protocol/parity/buffer errors
+        DEBUG_LOG("RequestA error: 0x%02X", err);
+        PROF_COUNT(PROF_CNT_PROTOCOL);
+        MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle); // Stop command
+        return STATUS_ERROR;
+    }
+    if (fifoLvl < 2) {  // ATQA is 2 bytes
+        DEBUG_LOG("RequestA bad FIFO level: %d", fifoLvl);
+        PROF_COUNT(PROF_CNT_FIFO);
+        dev->linkErrors++;
+        MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+        return STATUS_ERROR;
+    }
+    MFRC522_ReadFIFO(dev, atqa, 2);
+    DEBUG_LOG("RequestA ATQA: 0x%02X 0x%02X", atqa[0], atqa[1]);
+    MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle); // Stop command
+    return STATUS_OK;
+}
+
+// Validate a finished CL1 anticollision and fetch UID + BCC
+static uint8_t MFRC522_FinishAnticoll(MFRC522_t *dev, const uint8_t *status, uint8_t *uid) {
+    uint8_t err = status[1];
+    uint8_t fifoLvl = status[2] & 0x7F;
+    if (err & 0x1D) {
+        DEBUG_LOG("Anticoll error: 0x%02X", err);
+        PROF_COUNT(PROF_CNT_PROTOCOL);
+        MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+        return STATUS_ERROR;
+    }
+    if (fifoLvl != 5) {  // 4-byte UID + BCC
+        DEBUG_LOG("Anticoll bad FIFO level: %d", fifoLvl);
+        PROF_COUNT(PROF_CNT_FIFO);
+        dev->linkErrors++;
+        MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+        return STATUS_ERROR;
+    }
+    MFRC522_ReadFIFO(dev, uid, 5);
+    MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+    // Validate BCC
+    uint8_t calcBcc = uid[0] ^ uid[1] ^ uid[2] ^ uid[3];
+    if (uid[4] != calcBcc) {
+        DEBUG_LOG("Anticoll bad BCC: calc=0x%02X, got=0x%02X", calcBcc, uid[4]);
+        PROF_COUNT(PROF_CNT_BCC);
+        dev->linkErrors++;
+        return STATUS_ERROR;
+    }
+    DEBUG_LOG("Anticoll UID: %02X %02X %02X %02X %02X", uid[0], uid[1], uid[2], uid[3], uid[4]);
+    return STATUS_OK;
+}
+
 uint8_t MFRC522_RequestA(MFRC522_t *dev, uint8_t *atqa) {
     DEBUG_LOG("RequestA");
     MFRC522_AntennaOff(dev);  // Reset RF
-    HAL_Delay(5);  // Allow chip to stabilize
+    delay_us(dev->timing->rfOffUs);  // Cards drop to IDLE
     MFRC522_AntennaOn(dev);
-    HAL_Delay(5);  // Ensure RF is ready
-    MFRC522_WriteReg(dev, PCD_ComIrqReg, 0x7F);      // Clear IRQs
-    MFRC522_WriteReg(dev, PCD_FIFOLevelReg, 0x80);   // Flush FIFO
-    MFRC522_WriteReg(dev, PCD_BitFramingReg, 0x07);  // 7 bits for REQA
-    MFRC522_WriteReg(dev, PCD_FIFODataReg, PICC_REQA);
-    HAL_Delay(2);  // Increased for counterfeit chip stability
-    MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Transceive);
-    MFRC522_SetBitMask(dev, PCD_BitFramingReg, 0x80);
-
-    // Poll for completion (25ms timeout)
-    uint32_t timeout = HAL_GetTick() + 25;
-    while (HAL_GetTick() < timeout) {
-        uint8_t status2 = MFRC522_ReadReg(dev, PCD_Status2Reg);
-        if (status2 & 0x01) {  // Command complete
-            uint8_t err = MFRC522_ReadReg(dev, PCD_ErrorReg);
-            if (err & 0x1D) {  // Protocol/parity/buffer errors
-                DEBUG_LOG("RequestA error: 0x%02X", err);
-                MFRC522_AntennaOff(dev);
-                HAL_Delay(5);
-                MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle); // Stop command
-                return STATUS_ERROR;
-            }
-            uint8_t fifoLvl = MFRC522_ReadReg(dev, PCD_FIFOLevelReg);
-            if (fifoLvl >= 2) {  // ATQA is 2 bytes
-                atqa[0] = MFRC522_ReadReg(dev, PCD_FIFODataReg);
-                atqa[1] = MFRC522_ReadReg(dev, PCD_FIFODataReg);
-                DEBUG_LOG("RequestA ATQA: 0x%02X 0x%02X", atqa[0], atqa[1]);
-                MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle); // Stop command
-                HAL_Delay(2);  // Post-command delay
-                return STATUS_OK;
-            }
-            DEBUG_LOG("RequestA bad FIFO level: %d", fifoLvl);
-            MFRC522_AntennaOff(dev);
-            HAL_Delay(5);
-            MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
-            return STATUS_ERROR;
+    delay_us(dev->timing->rfOnUs);   // Cards power up
+    uint8_t cmd = PICC_REQA;
+    uint8_t status[3];
+    uint8_t res;
+
+    MFRC522_LoadFrame(dev, &cmd, 1, 7, 0);  // 7 bits for REQA
+    MFRC522_Guard(dev->timing->cmdGuardUs);
+    MFRC522_Kick(dev, MFRC522_REQA_TIMEOUT_US);
+    res = MFRC522_WaitComplete(dev, status);
+    if (res == STATUS_OK) {
+        res = MFRC522_FinishRequestA(dev, status, atqa);
+        if (res == STATUS_OK) {
+            MFRC522_Guard(dev->timing->cmdGuardUs);
+            return STATUS_OK;
         }
-        HAL_Delay(1);  // Mimic debug log timing
+    } else {
+        DEBUG_LOG("RequestA timeout");
+        MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
     }
-    DEBUG_LOG("RequestA timeout");
     MFRC522_AntennaOff(dev);
-    HAL_Delay(5);
-    MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
-    return STATUS_TIMEOUT;
+    delay_us(dev->timing->rfOffUs);
+    return res;
 }
 
 uint8_t MFRC522_Anticoll(MFRC522_t *dev, uint8_t *uid) {  // Returns 4-byte UID + BCC
     DEBUG_LOG("Anticoll");
-    MFRC522_WriteReg(dev, PCD_ComIrqReg, 0x7F);      // Clear IRQs
-    MFRC522_WriteReg(dev, PCD_FIFOLevelReg, 0x80);   // Flush FIFO
-    MFRC522_WriteReg(dev, PCD_BitFramingReg, 0x00);  // Full frame
-    MFRC522_WriteReg(dev, PCD_FIFODataReg, PICC_SEL_CL1);  // 0x93
-    MFRC522_WriteReg(dev, PCD_FIFODataReg, 0x20);    // Fixed CRC
-    HAL_Delay(2);  // Delay for stability
-    MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Transceive);
-    MFRC522_SetBitMask(dev, PCD_BitFramingReg, 0x80);
-
-    uint32_t timeout = HAL_GetTick() + 25;
-    while (HAL_GetTick() < timeout) {
-        uint8_t status2 = MFRC522_ReadReg(dev, PCD_Status2Reg);
-        if (status2 & 0x01) {  // Command complete
-            uint8_t err = MFRC522_ReadReg(dev, PCD_ErrorReg);
-            if (err & 0x1D) {
-                DEBUG_LOG("Anticoll error: 0x%02X", err);
-                MFRC522_AntennaOff(dev);
-                HAL_Delay(5);
-                MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+    uint8_t cmd[2] = {PICC_SEL_CL1, 0x20};  // SEL CL1, NVB: no UID bits known
+    uint8_t status[3];
+    uint8_t res;
+
+    MFRC522_LoadFrame(dev, cmd, 2, 0, 0);  // Full frame
+    MFRC522_Guard(dev->timing->cmdGuardUs);
+    MFRC522_Kick(dev, MFRC522_ANTICOLL_TIMEOUT_US);
+    res = MFRC522_WaitComplete(dev, status);
+    if (res == STATUS_OK) {
+        res = MFRC522_FinishAnticoll(dev, status, uid);
+        if (res == STATUS_OK) {
+            MFRC522_Guard(dev->timing->cmdGuardUs);
+            return STATUS_OK;
+        }
+    } else {
+        DEBUG_LOG("Anticoll timeout");
+        MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+    }
+    MFRC522_AntennaOff(dev);
+    delay_us(dev->timing->rfOffUs);
+    return res;
+}
+
+// Load, start and wait for one frame; leaves the RC522 idle
+static uint8_t MFRC522_Transceive(MFRC522_t *dev, const uint8_t *data, uint8_t len,
+                                  uint8_t framing, uint8_t crc, uint32_t timeoutUs,
+                                  uint8_t *status) {
+    MFRC522_LoadFrame(dev, data, len, framing, crc);
+    MFRC522_Kick(dev, timeoutUs);
+    uint8_t res = MFRC522_WaitComplete(dev, status);
+    if (res != STATUS_OK) {
+        MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+    }
+    return res;
+}
+
+// Transceive and copy the answer to back (up to *backLen bytes). With
+// rxAlign set the first FIFO byte only carries bits rxAlign..7, which are
+// merged into back[0] so the known low bits survive. Returns
+// STATUS_COLLISION when CollErr was raised; the data up to the collision
+// is still copied and CollReg tells where it happened.
+static uint8_t MFRC522_TransceiveData(MFRC522_t *dev, const uint8_t *data, uint8_t len,
+                                      uint8_t *back, uint8_t *backLen, uint8_t rxAlign,
+                                      uint8_t txLastBits, uint8_t crc, uint32_t timeoutUs) {
+    uint8_t status[3];
+    uint8_t res = MFRC522_Transceive(dev, data, len, (uint8_t)((rxAlign << 4) | txLastBits),
+                                     crc, timeoutUs, status);
+    if (res != STATUS_OK) {
+        if (res == STATUS_TIMEOUT) PROF_COUNT(PROF_CNT_TIMEOUT);
+        return res;
+    }
+    uint8_t err = status[1];
+    if (err & 0x13) {  // BufferOvfl, ParityErr, ProtocolErr
+        TRACE(TRACE_RC522_ERROR, err, status[2]);
+        PROF_COUNT(PROF_CNT_PROTOCOL);
+        MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+        return STATUS_ERROR;
+    }
+    if (crc && (err & 0x04)) {  // CRCErr
+        PROF_COUNT(PROF_CNT_PROTOCOL);
+        dev->linkErrors++;
+        MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+        return STATUS_ERROR;
+    }
+    uint8_t n = status[2] & 0x7F;
+    if (n > *backLen) {
+        PROF_COUNT(PROF_CNT_FIFO);
+        dev->linkErrors++;
+        MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+        return STATUS_ERROR;
+    }
+    if (n > 0) {
+        uint8_t first = back[0];
+        MFRC522_ReadFIFO(dev, back, n);
+        if (rxAlign) {
+            uint8_t mask = (uint8_t)(0xFF << rxAlign);
+            back[0] = (first & ~mask) | (back[0] & mask);
+        }
+    }
+    *backLen = n;
+    MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+    return (err & 0x08) ? STATUS_COLLISION : STATUS_OK;
+}
+
+// A SELECT answer is a single SAK byte once the RC522 has stripped CRC_A
+static uint8_t MFRC522_SendSelect(MFRC522_t *dev, uint8_t *frame, uint8_t *sak) {
+    uint8_t backLen = 1;
+    frame[1] = 0x70;  // NVB: all 40 bits known
+    frame[6] = frame[2] ^ frame[3] ^ frame[4] ^ frame[5];  // BCC
+    if (MFRC522_TransceiveData(dev, frame, 7, sak, &backLen, 0, 0, 1,
+                               MFRC522_SELECT_TIMEOUT_US) != STATUS_OK || backLen != 1) {
+        DEBUG_LOG("Select failed");
+        return STATUS_ERROR;
+    }
+    TRACE(TRACE_RC522_SAK, *sak, 0);
+    return STATUS_OK;
+}
+
+// Store one cascade level's UID bytes, skipping the cascade tag
+static void MFRC522_StoreLevel(MFRC522_Uid_t *uid, const uint8_t *frame, uint8_t sak) {
+    if (sak & 0x04) {  // UID not complete: CT + 3 bytes
+        for (int i = 0; i < 3; i++) uid->bytes[uid->size++] = frame[3 + i];
+    } else {
+        for (int i = 0; i < 4; i++) uid->bytes[uid->size++] = frame[2 + i];
+    }
+    uid->sak = sak;
+}
+
+// A card still in the field answers WUPA from HALT (or IDLE); a collision
+// also means someone is there
+static uint8_t MFRC522_FinishWakeupA(MFRC522_t *dev, const uint8_t *status) {
+    uint8_t err = status[1];
+    uint8_t fifoLvl = status[2] & 0x7F;
+    MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+    if ((err & 0x08) || (!(err & 0x1D) && fifoLvl >= 2)) {  // CollErr or ATQA
+        return STATUS_OK;
+    }
+    return STATUS_ERROR;
+}
+
+uint8_t MFRC522_Select(MFRC522_t *dev, MFRC522_Uid_t *uid) {
+    static const uint8_t selCmd[3] = {PICC_SEL_CL1, PICC_SEL_CL2, PICC_SEL_CL3};
+    uint8_t frame[9];   // SEL, NVB, 4 UID/CT bytes, BCC (+ CRC added by RC522)
+    uint8_t sak = 0;
+
+    uid->size = 0;
+    MFRC522_ClearBitMask(dev, PCD_CollReg, 0x80);  // Clear bits received after a collision
+
+    for (uint8_t level = 0; level < 3; level++) {
+        uint8_t knownBits = 0;
+        uint8_t rounds = 0;
+        for (int i = 0; i < 9; i++) frame[i] = 0;
+        frame[0] = selCmd[level];
+
+        // Anticollision: send the known prefix, let the cards fill in the rest
+        while (knownBits < 32) {
+            if (++rounds > 32) {  // Each round fixes at least one bit
                 return STATUS_ERROR;
             }
-            uint8_t fifoLvl = MFRC522_ReadReg(dev, PCD_FIFOLevelReg);
-            if (fifoLvl == 5) {  // 4-byte UID + BCC
-                for (int i = 0; i < 5; i++) {
-                    uid[i] = MFRC522_ReadReg(dev, PCD_FIFODataReg);
+            uint8_t txLastBits = knownBits % 8;
+            uint8_t index = 2 + knownBits / 8;
+            uint8_t txLen = index + (txLastBits ? 1 : 0);
+            uint8_t backLen = 7 - index;  // Up to UID/CT + BCC
+            frame[1] = (uint8_t)((index << 4) | txLastBits);  // NVB
+
+            uint8_t res = MFRC522_TransceiveData(dev, frame, txLen, &frame[index], &backLen,
+                                                 txLastBits, txLastBits, 0,
+                                                 MFRC522_ANTICOLL_TIMEOUT_US);
+            if (res == STATUS_COLLISION) {
+                PROF_COUNT(PROF_CNT_COLLISION);
+                uint8_t coll = MFRC522_ReadReg(dev, PCD_CollReg);
+                if (coll & 0x20) {  // CollPosNotValid
+                    return STATUS_ERROR;
                 }
-                // Validate BCC
-                uint8_t calcBcc = uid[0] ^ uid[1] ^ uid[2] ^ uid[3];
-                if (uid[4] != calcBcc) {
-                    DEBUG_LOG("Anticoll bad BCC: calc=0x%02X, got=0x%02X", calcBcc, uid[4]);
-                    MFRC522_AntennaOff(dev);
-                    HAL_Delay(5);
-                    MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+                uint8_t pos = coll & 0x1F;
+                if (pos == 0) pos = 32;
+                if (pos <= knownBits) {  // No progress
                     return STATUS_ERROR;
                 }
-                DEBUG_LOG("Anticoll UID: %02X %02X %02X %02X %02X", uid[0], uid[1], uid[2], uid[3], uid[4]);
-                MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
-                HAL_Delay(2);  // Post-command delay
-                return STATUS_OK;
+                // Take the branch with a 1 at the colliding bit
+                knownBits = pos;
+                uint8_t bit = (knownBits - 1) % 8;
+                frame[2 + (knownBits - 1) / 8] |= (uint8_t)(1 << bit);
+                TRACE(TRACE_RC522_COLLISION, pos, level + 1);
+            } else if (res == STATUS_OK) {
+                if ((uint8_t)(frame[2] ^ frame[3] ^ frame[4] ^ frame[5]) != frame[6]) {
+                    DEBUG_LOG("Anticoll bad BCC at level %d", level + 1);
+                    PROF_COUNT(PROF_CNT_BCC);
+                    dev->linkErrors++;
+                    return STATUS_ERROR;
+                }
+                knownBits = 32;
+            } else {
+                return res;
             }
-            DEBUG_LOG("Anticoll bad FIFO level: %d", fifoLvl);
-            MFRC522_AntennaOff(dev);
-            HAL_Delay(5);
-            MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+        }
+
+        if (MFRC522_SendSelect(dev, frame, &sak) != STATUS_OK) {
             return STATUS_ERROR;
         }
-        HAL_Delay(1);  // Mimic debug log timing
+        MFRC522_StoreLevel(uid, frame, sak);
+        if (!(sak & 0x04)) {  // Cascade bit clear: UID complete
+            return STATUS_OK;
+        }
+    }
+    return STATUS_ERROR;  // Cascade bit still set after CL3
+}
+
+// Re-select a card whose UID is already known, level by level
+static uint8_t MFRC522_SelectUid(MFRC522_t *dev, const MFRC522_Uid_t *uid) {
+    static const uint8_t selCmd[3] = {PICC_SEL_CL1, PICC_SEL_CL2, PICC_SEL_CL3};
+    uint8_t levels = (uid->size == 10) ? 3 : (uid->size == 7) ? 2 : 1;
+    uint8_t frame[9];
+    uint8_t sak;
+    uint8_t idx = 0;
+
+    for (uint8_t level = 0; level < levels; level++) {
+        frame[0] = selCmd[level];
+        if (level + 1 < levels) {
+            frame[2] = PICC_CASCADE_TAG;
+            for (int i = 0; i < 3; i++) frame[3 + i] = uid->bytes[idx++];
+        } else {
+            for (int i = 0; i < 4; i++) frame[2 + i] = uid->bytes[idx++];
+        }
+        if (MFRC522_SendSelect(dev, frame, &sak) != STATUS_OK) {
+            return STATUS_ERROR;
+        }
+    }
+    return STATUS_OK;
+}
+
+uint8_t MFRC522_HaltA(MFRC522_t *dev) {
+    static const uint8_t hlta[2] = {PICC_HLTA, 0x00};
+    uint8_t status[3];
+    // A halted card stays silent, so a timeout is the expected outcome
+    if (MFRC522_Transceive(dev, hlta, 2, 0, 1, MFRC522_HLTA_TIMEOUT_US, status) == STATUS_TIMEOUT) {
+        return STATUS_OK;
     }
-    DEBUG_LOG("Anticoll timeout");
-    MFRC522_AntennaOff(dev);
-    HAL_Delay(5);
     MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
-    return STATUS_TIMEOUT;
+    return STATUS_ERROR;
+}
+
+uint8_t MFRC522_SelectHalt(MFRC522_t *dev, const MFRC522_Uid_t *uid) {
+    if (MFRC522_SelectUid(dev, uid) != STATUS_OK) {
+        return STATUS_ERROR;
+    }
+    return MFRC522_HaltA(dev);
+}
+
+uint8_t MFRC522_IsPresent(MFRC522_t *dev, const MFRC522_Uid_t *uid) {
+    uint8_t cmd = PICC_WUPA;
+    uint8_t status[3];
+    if (MFRC522_Transceive(dev, &cmd, 1, 7, 0, MFRC522_REQA_TIMEOUT_US, status) != STATUS_OK ||
+        MFRC522_FinishWakeupA(dev, status) != STATUS_OK) {
+        return STATUS_ERROR;
+    }
+    // Put the card back to sleep so the next probe finds it in HALT
+    MFRC522_SelectHalt(dev, uid);
+    return STATUS_OK;
+}
+
+uint8_t MFRC522_Inventory(MFRC522_t *dev, MFRC522_Uid_t *uids, uint8_t max, uint8_t *count) {
+    uint8_t cmd = PICC_REQA;
+    uint8_t status[3];
+    uint8_t failures = 0;
+
+    *count = 0;
+    // Every selected card is halted, so the next REQA only wakes the rest.
+    // The field stays up for the whole session.
+    while (*count < max && failures < MFRC522_INVENTORY_RETRIES) {
+        uint8_t res = MFRC522_Transceive(dev, &cmd, 1, 7, 0, MFRC522_REQA_TIMEOUT_US, status);
+        if (res == STATUS_TIMEOUT) {
+            break;  // Nobody left in IDLE
+        }
+        if (res != STATUS_OK || MFRC522_FinishWakeupA(dev, status) != STATUS_OK) {
+            failures++;
+            continue;
+        }
+        if (MFRC522_Select(dev, &uids[*count]) != STATUS_OK) {
+            failures++;
+            continue;
+        }
+        MFRC522_HaltA(dev);
+        (*count)++;
+    }
+    DEBUG_LOG("Inventory: %d card(s)", *count);
+    return STATUS_OK;
+}
+
+// CRC_A over data from the RC522 coprocessor (CalcCRC + CRCResultReg);
+// out[0] is the low byte, the one sent first
+uint8_t MFRC522_CalcCRC(MFRC522_t *dev, const uint8_t *data, uint8_t len, uint8_t *out) {
+    static const uint8_t resultRegs[] = {PCD_CRCResultRegL, PCD_CRCResultRegH};
+    uint8_t setup[] = {
+        PCD_CommandReg,   PCD_Idle,     // Stop whatever runs
+        PCD_DivIrqReg,    PCD_DIVIRQ_CRC,  // Set2 = 0: clear CRCIRq
+        PCD_FIFOLevelReg, 0x80,         // Flush FIFO
+    };
+    MFRC522_WriteRegs(dev, setup, 3);
+    MFRC522_WriteFIFO(dev, data, len);
+    MFRC522_WriteReg(dev, PCD_CommandReg, PCD_CalcCRC);
+
+    uint32_t start = now_us();
+    while (!(MFRC522_ReadReg(dev, PCD_DivIrqReg) & PCD_DIVIRQ_CRC)) {
+        if (now_us() - start >= MFRC522_CRC_TIMEOUT_US) {
+            MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+            return STATUS_TIMEOUT;
+        }
+    }
+    MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+    MFRC522_ReadRegs(dev, resultRegs, out, 2);
+    return STATUS_OK;
+}
+
+// MIFARE Classic three-pass authentication for block's sector. The card must
+// be ACTIVE (just selected). Crypto1 is keyed with the last 4 UID bytes, the
+// ones of the final cascade level. MFAuthent ends with IdleIRq rather than
+// RxIRq, so it gets its own wait; a wrong key leaves the card silent and
+// the RC522 timer ends the command.
+uint8_t MFRC522_Authenticate(MFRC522_t *dev, uint8_t keyType, uint8_t block,
+                             const uint8_t *key, const MFRC522_Uid_t *uid) {
+    uint8_t frame[2 + MFRC522_KEY_SIZE + 4];
+    uint8_t status[3];
+    static const uint8_t statusRegs[] = {PCD_Status2Reg, PCD_ErrorReg, PCD_FIFOLevelReg};
+
+    if (uid->size < 4) return STATUS_ERROR;
+    frame[0] = keyType;
+    frame[1] = block;
+    memcpy(&frame[2], key, MFRC522_KEY_SIZE);
+    memcpy(&frame[2 + MFRC522_KEY_SIZE], &uid->bytes[uid->size - 4], 4);
+
+    MFRC522_LoadFrame(dev, frame, sizeof(frame), 0, 0);
+    MFRC522_Guard(dev->timing->cmdGuardUs);
+    MFRC522_KickCommand(dev, PCD_MFAuthent, MFRC522_AUTH_TIMEOUT_US);
+
+    uint8_t irq = 0;
+    do {
+        if (HAL_GetTick() - dev->cmdStart >= dev->cmdTimeoutMs) {
+            irq = PCD_IRQ_TIMER;
+        } else if (dev->irqPort != NULL && !dev->irqPending) {
+            __WFI();  // IdleIRq/TimerIRq on the IRQ line or SysTick wakes us
+        } else {
+            dev->irqPending = 0;
+            irq = MFRC522_ReadReg(dev, PCD_ComIrqReg);
+        }
+    } while (!(irq & (PCD_IRQ_IDLE | PCD_IRQ_ERR | PCD_IRQ_TIMER)));
+    dev->irqPending = 0;
+    MFRC522_ReadRegs(dev, statusRegs, status, 3);
+    MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+
+    if (!(irq & (PCD_IRQ_IDLE | PCD_IRQ_ERR))) {
+        DEBUG_LOG("Auth timeout, block %d", block);
+        PROF_COUNT(PROF_CNT_TIMEOUT);
+        return STATUS_TIMEOUT;
+    }
+    if ((status[1] & 0x13) || !(status[0] & PCD_STATUS2_CRYPTO1)) {
+        DEBUG_LOG("Auth failed: Error 0x%02X, Status2 0x%02X", status[1], status[0]);
+        PROF_COUNT(PROF_CNT_PROTOCOL);
+        return STATUS_ERROR;
+    }
+    return STATUS_OK;
+}
+
+// Leave the authenticated state; later frames go out in plain again
+void MFRC522_StopCrypto1(MFRC522_t *dev) {
+    MFRC522_ClearBitMask(dev, PCD_Status2Reg, PCD_STATUS2_CRYPTO1);
+}
+
+uint8_t MFRC522_ReadBlock(MFRC522_t *dev, uint8_t block, uint8_t *data) {
+    uint8_t cmd[4] = {PICC_MF_READ, block};
+    uint8_t back[MFRC522_BLOCK_SIZE + 2];   // Data + CRC_A
+    uint8_t backLen = sizeof(back);
+    uint8_t crc[2];
+
+    if (MFRC522_CalcCRC(dev, cmd, 2, &cmd[2]) != STATUS_OK) {
+        return STATUS_ERROR;
+    }
+    // CRC is handled by CalcCRC on both sides: a NAK is a bare 4-bit frame
+    // that RxCRCEn would reject before we could see it
+    uint8_t res = MFRC522_TransceiveData(dev, cmd, 4, back, &backLen, 0, 0, 0,
+                                         MFRC522_MF_READ_TIMEOUT_US);
+    if (res != STATUS_OK) {
+        return (res == STATUS_TIMEOUT) ? res : STATUS_ERROR;
+    }
+    if (backLen != sizeof(back)) {
+        DEBUG_LOG("Read block %d: %d bytes (NAK 0x%X?)", block, backLen, back[0] & 0x0F);
+        return STATUS_ERROR;
+    }
+    if (MFRC522_CalcCRC(dev, back, MFRC522_BLOCK_SIZE, crc) != STATUS_OK ||
+        crc[0] != back[MFRC522_BLOCK_SIZE] || crc[1] != back[MFRC522_BLOCK_SIZE + 1]) {
+        PROF_COUNT(PROF_CNT_PROTOCOL);
+        return STATUS_ERROR;
+    }
+    memcpy(data, back, MFRC522_BLOCK_SIZE);
+    return STATUS_OK;
+}
+
+// Send data + CRC_A and expect the 4-bit MIFARE ACK
+static uint8_t MFRC522_MifareSend(MFRC522_t *dev, const uint8_t *data, uint8_t len, uint32_t timeoutUs) {
+    uint8_t frame[MFRC522_BLOCK_SIZE + 2];
+    uint8_t ack = 0;
+    uint8_t backLen = 1;
+
+    memcpy(frame, data, len);
+    if (MFRC522_CalcCRC(dev, data, len, &frame[len]) != STATUS_OK) {
+        return STATUS_ERROR;
+    }
+    uint8_t res = MFRC522_TransceiveData(dev, frame, len + 2, &ack, &backLen, 0, 0, 0, timeoutUs);
+    if (res != STATUS_OK) {
+        return (res == STATUS_TIMEOUT) ? res : STATUS_ERROR;
+    }
+    if (backLen != 1 || (ack & 0x0F) != PICC_MF_ACK) {
+        DEBUG_LOG("MIFARE NAK 0x%X", ack & 0x0F);
+        return STATUS_ERROR;
+    }
+    return STATUS_OK;
+}
+
+uint8_t MFRC522_WriteBlock(MFRC522_t *dev, uint8_t block, const uint8_t *data) {
+    uint8_t cmd[2] = {PICC_MF_WRITE, block};
+    if (MFRC522_MifareSend(dev, cmd, 2, MFRC522_MF_READ_TIMEOUT_US) != STATUS_OK) {
+        return STATUS_ERROR;
+    }
+    return MFRC522_MifareSend(dev, data, MFRC522_BLOCK_SIZE, MFRC522_MF_WRITE_TIMEOUT_US);
 }
 
 uint8_t MFRC522_ReadUid(MFRC522_t *dev, uint8_t *uid) {  // Output: uid[4]
     DEBUG_LOG("Reading UID...");
-    // Card detected, read UID
-    uint8_t rawUid[5];
-    if (MFRC522_Anticoll(dev, rawUid) != STATUS_OK) {
+    // Card detected, run the full cascade; dev->uid keeps all 4/7/10 bytes
+    if (MFRC522_Select(dev, &dev->uid) != STATUS_OK) {
     	DEBUG_LOG("Anticollision failed");
         return STATUS_ERROR;
     }
-    // Copy UID (drop BCC)
     for (int i = 0; i < 4; i++) {
-        uid[i] = rawUid[i];
+        uid[i] = dev->uid.bytes[i];
     }
-    DEBUG_LOG("Card UID: %02X %02X %02X %02X", uid[0], uid[1], uid[2], uid[3]);
+    TRACE(TRACE_RC522_UID, dev->uid.size, (uid[0] << 8) | uid[1]);
     return STATUS_OK;
 }
 
+// Sleep between polls; any interrupt (SysTick, EXTI, UART) wakes the core
+static void MFRC522_Sleep(uint32_t ms) {
+    uint32_t start = HAL_GetTick();
+    while (HAL_GetTick() - start < ms) {
+        __WFI();
+    }
+}
+
+// Card detected, read or removed: probe fast for MFRC522_POLL_BUSY_MS
+static void MFRC522_PollActive(MFRC522_t *dev) {
+    dev->pollBusy = 1;
+    dev->pollBusyUntil = HAL_GetTick() + MFRC522_POLL_BUSY_MS;
+    dev->pollIntervalMs = MFRC522_POLL_FAST_MS;
+}
+
+// Wait before the next idle probe: fast while the busy window lasts, then
+// doubled by every empty probe up to the ceiling
+static uint32_t MFRC522_IdleInterval(MFRC522_t *dev) {
+    uint16_t ceiling = dev->lowPower ? MFRC522_LOWPOWER_INTERVAL_MS : MFRC522_POLL_MAX_MS;
+    if (dev->pollBusy && (int32_t)(HAL_GetTick() - dev->pollBusyUntil) >= 0) {
+        dev->pollBusy = 0;
+    }
+    if (dev->pollBusy || dev->pollIntervalMs == 0) {
+        dev->pollIntervalMs = MFRC522_POLL_FAST_MS;
+    } else {
+        dev->pollIntervalMs = (dev->pollIntervalMs * 2 < ceiling) ? dev->pollIntervalMs * 2 : ceiling;
+    }
+    PROF_RECORD(PROF_POLL_INTERVAL, dev->pollIntervalMs * 1000U);
+    return dev->pollIntervalMs;
+}
+
+// A card answered REQA: it was tapped after the last REQA that found none
+static void MFRC522_Detected(MFRC522_t *dev) {
+    if (dev->lastEmptyUs != 0) {
+        PROF_RECORD(PROF_TAP, now_us() - dev->lastEmptyUs);
+        dev->lastEmptyUs = 0;
+    }
+    MFRC522_PollActive(dev);
+}
+
 uint8_t waitcardRemoval (MFRC522_t *dev){
-    USER_LOG("Waiting for card removal...");
+    TRACE(TRACE_RC522_WAIT_REMOVAL, 0, 0);
+    uint8_t misses = 0;
+    MFRC522_HaltA(dev);  // Card selected by ReadUid is ACTIVE
     while (1) {
-        if (MFRC522_RequestA(dev, atqa) != STATUS_OK) {
-        	USER_LOG("Card removed");
-            return STATUS_OK; // Card removed, return success
+        // WUPA + re-select keeps the RF field up between probes
+        if (MFRC522_IsPresent(dev, &dev->uid) != STATUS_OK) {
+            if (++misses >= MFRC522_POLL_MISSES) {
+                TRACE(TRACE_RC522_REMOVED, 0, 0);
+                MFRC522_PollActive(dev);
+                return STATUS_OK; // Card removed, return success
+            }
+        } else {
+            misses = 0;
         }
-        HAL_Delay(100); // Poll every 100ms to check if card is still present
+        MFRC522_Sleep(misses ? MFRC522_PRESENCE_RETRY_MS : MFRC522_PRESENCE_INTERVAL_MS);
     }
 }
 
 uint8_t waitcardDetect (MFRC522_t *dev){
-	atqa[0] = atqa[1] = 0;
-	USER_LOG("Waiting for the card...");
+	dev->atqa[0] = dev->atqa[1] = 0;
+	TRACE(TRACE_RC522_WAIT_CARD, 0, 0);
 	while (1){
-	    if (MFRC522_RequestA(dev, atqa) == STATUS_OK) {
-	    	USER_LOG("Card detected");
+	    uint32_t probeUs = now_us();
+	    if (MFRC522_RequestA(dev, dev->atqa) == STATUS_OK) {
+	    	TRACE(TRACE_RC522_DETECTED, dev->atqa[0], dev->atqa[1]);
+	    	MFRC522_Detected(dev);
 	        return STATUS_OK;
 	    }
-	    HAL_Delay(100);	// Poll every 100ms to check if card is  present
+	    dev->lastEmptyUs = probeUs;
+	    MFRC522_Sleep(MFRC522_IdleInterval(dev));	// Fast after activity, slower while idle
 	}
 }
 
 
+
+void MFRC522_PowerDown(MFRC522_t *dev) {
+    // Soft power-down: analog part and oscillator off, registers kept
+    MFRC522_SetBitMask(dev, PCD_CommandReg, PCD_PowerDown);
+    TRACE(TRACE_RC522_POWERDOWN, 0, 0);
+}
+
+uint8_t MFRC522_PowerUp(MFRC522_t *dev) {
+    uint32_t start = HAL_GetTick();
+    MFRC522_ClearBitMask(dev, PCD_CommandReg, PCD_PowerDown);
+    while (MFRC522_ReadReg(dev, PCD_CommandReg) & PCD_PowerDown) {
+        if (HAL_GetTick() - start > 10) {
+            return STATUS_TIMEOUT;
+        }
+    }
+    TRACE(TRACE_RC522_WAKE, 0, HAL_GetTick() - start);
+    return STATUS_OK;
+}
+
+void MFRC522_SetLowPower(MFRC522_t *dev, uint8_t enable) {
+    dev->lowPower = enable;
+    if (!enable && (MFRC522_ReadReg(dev, PCD_CommandReg) & PCD_PowerDown)) {
+        MFRC522_PowerUp(dev);
+        dev->pollState = 0;  // Restart from a field reset
+    }
+}
+
+// Cooperative reader state machine. Each call does at most one short SPI
+// step and returns immediately; waits are tracked as tick deadlines, so the
+// caller can drive it from a 1 ms soft timer next to its other tasks.
+enum {
+    POLL_FIELD_RESET = 0,   // Antenna off so the card drops back to IDLE
+    POLL_FIELD_UP,          // Antenna on, let the card power up
+    POLL_WAKE,              // Leave soft power-down (low-power idle)
+    POLL_WAKE_WAIT,         // Oscillator restarting
+    POLL_REQA_LOAD,
+    POLL_REQA_SEND,
+    POLL_REQA_WAIT,
+    POLL_ANTICOLL,
+    // Removal tracking: the card is parked in HALT and woken by WUPA, with
+    // the RF field left on
+    POLL_TRACK_SELECT,
+    POLL_TRACK_HALT,
+    POLL_TRACK_HALT_WAIT,
+    POLL_TRACK_WUPA,
+    POLL_TRACK_WUPA_WAIT,
+};
+
+// Write/read back a scratch register (TReloadRegL, reloaded by every Kick)
+// MFRC522_CAL_TRIALS times with the current register guard
+static uint8_t MFRC522_CalRegTest(MFRC522_t *dev) {
+    uint8_t ok = 1;
+    for (uint8_t i = 0; i < MFRC522_CAL_TRIALS && ok; i++) {
+        uint8_t v = (uint8_t)(i * 37 + 0x5A);
+        MFRC522_WriteReg(dev, PCD_TReloadRegL, v);
+        ok = (MFRC522_ReadReg(dev, PCD_TReloadRegL) == v);
+    }
+    MFRC522_WriteReg(dev, PCD_TReloadRegL, 0xE8);
+    return ok;
+}
+
+void MFRC522_Calibrate(MFRC522_t *dev) {
+    static const uint16_t guards[] = {0, 2, 5};
+    MFRC522_Cal_t *c = &dev->cal;
+    if (dev->timing != &c->timing) c->base = dev->timing;
+    if (c->base == &MFRC522_TimingGenuine) return;  // Nothing to shorten
+
+    c->timing = *c->base;
+    dev->timing = &c->timing;
+    for (uint8_t i = 0; i < sizeof(guards) / sizeof(guards[0]); i++) {
+        if (guards[i] >= c->base->regGuardUs) break;
+        c->timing.regGuardUs = guards[i];
+        if (MFRC522_CalRegTest(dev)) break;
+        c->timing.regGuardUs = c->base->regGuardUs;
+    }
+    c->lastGoodCmdUs = c->timing.cmdGuardUs;
+    c->attempts = 0;
+    c->fails = 0;
+    c->settled = 0;
+    USER_LOG("Calibrated: reg guard %u us (profile %u us)", c->timing.regGuardUs, c->base->regGuardUs);
+}
+
+// Detect -> UID outcome for the run-time cmdGuardUs search
+static void MFRC522_CalResult(MFRC522_t *dev, uint8_t ok) {
+#if MFRC522_AUTO_CALIBRATE
+    MFRC522_Cal_t *c = &dev->cal;
+    if (dev->timing != &c->timing) return;
+    c->attempts++;
+    if (!ok) c->fails++;
+    if (c->fails > MFRC522_CAL_MAX_FAILS) {  // Too short for this chip
+        c->timing.cmdGuardUs = c->lastGoodCmdUs;
+        c->settled = 1;
+    } else if (c->attempts < MFRC522_CAL_WINDOW) {
+        return;
+    } else if (!c->settled && c->timing.cmdGuardUs > 0) {
+        c->lastGoodCmdUs = c->timing.cmdGuardUs;
+        c->timing.cmdGuardUs = (c->timing.cmdGuardUs > 20) ? c->timing.cmdGuardUs / 2 : 0;
+    }
+    c->attempts = 0;
+    c->fails = 0;
+#else
+    (void)dev;
+    (void)ok;
+#endif
+}
+
+static void MFRC522_PollNext(MFRC522_t *dev, uint8_t state, uint32_t waitMs) {
+    dev->pollState = state;
+    dev->pollDeadline = HAL_GetTick() + waitMs;
+}
+
+// Poll waits come from the chip's timing profile. The 1 ms tick may be
+// about to roll over when the deadline is set, so a non-zero guard gets
+// one extra tick to be at least as long as asked for.
+static uint32_t MFRC522_GuardMs(uint32_t us) {
+    return us ? (us + 999) / 1000 + 1 : 0;
+}
+
+// A probe cycle found no card (or a broken frame). While idle the next
+// cycle power-cycles the field; while tracking a card the miss counts
+// against it and the field stays up.
+static MFRC522_Event_t MFRC522_PollMiss(MFRC522_t *dev) {
+    if (!dev->cardPresent) {
+        MFRC522_AntennaOff(dev);
+        dev->power.rfOnMs += HAL_GetTick() - dev->power.rfOnStart;
+        dev->lastEmptyUs = dev->profStartUs;
+        if (dev->lowPower) {  // Park the chip until the next probe
+            MFRC522_PowerDown(dev);
+            MFRC522_PollNext(dev, POLL_WAKE, MFRC522_IdleInterval(dev));
+        } else {
+            MFRC522_PollNext(dev, POLL_FIELD_UP, MFRC522_IdleInterval(dev));
+        }
+        return MFRC522_EVT_IDLE;
+    }
+    if (++dev->pollMisses < MFRC522_POLL_MISSES) {
+        MFRC522_PollNext(dev, POLL_TRACK_WUPA, MFRC522_PRESENCE_RETRY_MS);
+        return MFRC522_EVT_IDLE;
+    }
+    dev->cardPresent = 0;
+    dev->pollMisses = 0;
+    MFRC522_PollActive(dev);
+    // Field is already up; the next card can be picked up straight away
+    MFRC522_PollNext(dev, POLL_REQA_LOAD, 0);
+    TRACE(TRACE_RC522_REMOVED, 0, 0);
+    return MFRC522_EVT_REMOVED;
+}
+
+MFRC522_Event_t MFRC522_Poll(MFRC522_t *dev) {
+    uint8_t status[3];
+    uint8_t buf[5];
+    uint8_t res;
+
+    if ((int32_t)(HAL_GetTick() - dev->pollDeadline) < 0) {
+        return MFRC522_EVT_IDLE;
+    }
+
+    switch (dev->pollState) {
+    case POLL_FIELD_RESET:
+        MFRC522_AntennaOff(dev);  // Reset RF
+        MFRC522_PollNext(dev, POLL_FIELD_UP, MFRC522_GuardMs(dev->timing->rfOffUs));
+        break;
+
+    case POLL_FIELD_UP:
+        MFRC522_AntennaOn(dev);
+        dev->power.probes++;
+        dev->power.rfOnStart = HAL_GetTick();
+        MFRC522_PollNext(dev, POLL_REQA_LOAD, MFRC522_GuardMs(dev->timing->rfOnUs));  // Cards power up
+        break;
+
+    case POLL_WAKE:
+        MFRC522_ClearBitMask(dev, PCD_CommandReg, PCD_PowerDown);
+        dev->power.wakeups++;
+        dev->power.wakeStart = HAL_GetTick();
+        MFRC522_PollNext(dev, POLL_WAKE_WAIT, 1);
+        break;
+
+    case POLL_WAKE_WAIT:
+        // PowerDown reads back set until the oscillator is stable again
+        if (MFRC522_ReadReg(dev, PCD_CommandReg) & PCD_PowerDown) {
+            MFRC522_PollNext(dev, POLL_WAKE_WAIT, 1);
+            break;
+        }
+        dev->power.wakeMs += HAL_GetTick() - dev->power.wakeStart;
+        TRACE(TRACE_RC522_WAKE, 0, HAL_GetTick() - dev->power.wakeStart);
+        MFRC522_PollNext(dev, POLL_FIELD_UP, 0);
+        break;
+
+    case POLL_REQA_LOAD:
+        buf[0] = PICC_REQA;
+        MFRC522_LoadFrame(dev, buf, 1, 7, 0);
+        MFRC522_PollNext(dev, POLL_REQA_SEND, MFRC522_GuardMs(dev->timing->cmdGuardUs));
+        break;
+
+    case POLL_REQA_SEND:
+        dev->profStartUs = now_us();
+        MFRC522_Kick(dev, MFRC522_REQA_TIMEOUT_US);
+        MFRC522_PollNext(dev, POLL_REQA_WAIT, 0);
+        break;
+
+    case POLL_REQA_WAIT:
+        res = MFRC522_CheckComplete(dev, status);
+        if (res == STATUS_BUSY) break;
+        if (res == STATUS_OK) {
+            res = MFRC522_FinishRequestA(dev, status, dev->atqa);
+        } else {
+            MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+        }
+        if (res != STATUS_OK) {
+            return MFRC522_PollMiss(dev);
+        }
+        PROF_RECORD(PROF_REQA, now_us() - dev->profStartUs);
+        MFRC522_PollNext(dev, POLL_ANTICOLL, MFRC522_GuardMs(dev->timing->cmdGuardUs));
+        if (dev->lowPower) {
+            dev->power.wakeToDetectMs = HAL_GetTick() - dev->power.wakeStart;
+        }
+        TRACE(TRACE_RC522_DETECTED, dev->atqa[0], dev->atqa[1]);
+        MFRC522_Detected(dev);
+        return MFRC522_EVT_DETECTED;
+
+    case POLL_ANTICOLL: {
+        // Full cascade runs in one step: a handful of short frames, each
+        // bounded by the RC522 timer
+        uint32_t t0 = now_us();
+        res = MFRC522_Select(dev, &dev->uid);
+        PROF_RECORD(PROF_ANTICOLL, now_us() - t0);
+        if (res != STATUS_OK) {  // Retry from REQA
+            MFRC522_AntennaOff(dev);
+            MFRC522_CalResult(dev, 0);
+            MFRC522_PollNext(dev, POLL_FIELD_UP, MFRC522_GuardMs(dev->timing->rfOffUs));
+            break;
+        }
+        PROF_RECORD(PROF_READUID, now_us() - dev->profStartUs);
+        MFRC522_CalResult(dev, 1);
+        dev->cardPresent = 1;
+        dev->pollMisses = 0;
+        TRACE(TRACE_RC522_UID, dev->uid.size, (dev->uid.bytes[0] << 8) | dev->uid.bytes[1]);
+        MFRC522_PollNext(dev, POLL_TRACK_HALT, 0);  // Card is ACTIVE
+        return MFRC522_EVT_UID_READY;
+    }
+
+    case POLL_TRACK_SELECT:
+        if (MFRC522_SelectUid(dev, &dev->uid) != STATUS_OK) {
+            return MFRC522_PollMiss(dev);
+        }
+        MFRC522_PollNext(dev, POLL_TRACK_HALT, 0);
+        break;
+
+    case POLL_TRACK_HALT:
+        buf[0] = PICC_HLTA;
+        buf[1] = 0x00;
+        MFRC522_LoadFrame(dev, buf, 2, 0, 1);
+        MFRC522_Kick(dev, MFRC522_HLTA_TIMEOUT_US);
+        MFRC522_PollNext(dev, POLL_TRACK_HALT_WAIT, 0);
+        break;
+
+    case POLL_TRACK_HALT_WAIT:
+        res = MFRC522_CheckComplete(dev, status);
+        if (res == STATUS_BUSY) break;
+        MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);  // No answer expected
+        dev->pollMisses = 0;
+        MFRC522_PollNext(dev, POLL_TRACK_WUPA, MFRC522_PRESENCE_INTERVAL_MS);
+        break;
+
+    case POLL_TRACK_WUPA:
+        buf[0] = PICC_WUPA;
+        MFRC522_LoadFrame(dev, buf, 1, 7, 0);
+        MFRC522_Kick(dev, MFRC522_REQA_TIMEOUT_US);
+        MFRC522_PollNext(dev, POLL_TRACK_WUPA_WAIT, 0);
+        break;
+
+    case POLL_TRACK_WUPA_WAIT:
+        res = MFRC522_CheckComplete(dev, status);
+        if (res == STATUS_BUSY) break;
+        if (res == STATUS_OK) {
+            res = MFRC522_FinishWakeupA(dev, status);
+        } else {
+            MFRC522_WriteReg(dev, PCD_CommandReg, PCD_Idle);
+        }
+        if (res != STATUS_OK) {
+            return MFRC522_PollMiss(dev);
+        }
+        MFRC522_PollNext(dev, POLL_TRACK_SELECT, 0);  // Still here, park it again
+        break;
+
+    default:
+        MFRC522_PollNext(dev, POLL_FIELD_RESET, 0);
+        break;
+    }
+    return MFRC522_EVT_IDLE;
+}
+
+// Called after MFRC522_SpiNegotiate changed the prescaler, with the bus
+// idle; the clock scaling code overrides it to pick up the new SCK
+__weak void MFRC522_SpiRateChanged(SPI_HandleTypeDef *hspi) {
+    (void)hspi;
+}
+
+#if MFRC522_SPI_NEGOTIATE
+// SCK for baud prescaler bits br (PCLK / 2^(br+1)); SPI1 is on APB2
+static uint32_t MFRC522_SpiHz(SPI_HandleTypeDef *hspi, uint32_t br) {
+    uint32_t pclk = (hspi->Instance == SPI1) ? HAL_RCC_GetPCLK2Freq() : HAL_RCC_GetPCLK1Freq();
+    return pclk >> (br + 1);
+}
+
+static void MFRC522_SpiSetBr(SPI_HandleTypeDef *hspi, uint32_t br) {
+    while (dmaXfer.busy) {}
+    __HAL_SPI_DISABLE(hspi);  // BR must not change while enabled
+    MODIFY_REG(hspi->Instance->CR1, SPI_CR1_BR, br << SPI_CR1_BR_Pos);
+    hspi->Init.BaudRatePrescaler = br << SPI_CR1_BR_Pos;  // HAL re-enables SPE on the next transfer
+}
+
+// Write/read-back on TReloadReg through both the single-register and the
+// burst path: all zeros/ones, alternating bits, walking one and zero.
+// Puts the Init reload value back; every Kick rewrites it anyway.
+static uint8_t MFRC522_SpiTest(MFRC522_t *dev) {
+    static const uint8_t regs[] = {PCD_TReloadRegH, PCD_TReloadRegL};
+    static const uint8_t patterns[] = {
+        0x00, 0xFF, 0x55, 0xAA,
+        0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+        0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F,
+    };
+    static const uint8_t restore[] = {PCD_TReloadRegH, 0x03, PCD_TReloadRegL, 0xE8};
+    uint8_t ok = 1;
+    for (uint8_t r = 0; r < MFRC522_SPI_ROUNDS && ok; r++) {
+        for (uint8_t i = 0; i < sizeof(patterns) && ok; i++) {
+            uint8_t p = patterns[i];
+            uint8_t np = (uint8_t)~p;   // ~p alone is an int
+            uint8_t w[] = {PCD_TReloadRegH, p, PCD_TReloadRegL, np};
+            uint8_t v[2];
+            MFRC522_WriteRegs(dev, w, 2);
+            MFRC522_ReadRegs(dev, regs, v, 2);
+            ok = (v[0] == p && v[1] == np && MFRC522_ReadReg(dev, PCD_TReloadRegL) == np);
+        }
+    }
+    MFRC522_WriteRegs(dev, restore, 2);
+    return ok;
+}
+
+void MFRC522_SpiNegotiate(MFRC522_Bus_t *bus) {
+    if (bus->count == 0) return;
+    SPI_HandleTypeDef *hspi = bus->readers[0]->hspi;
+    // Slowest prescaler not below the CubeMX rate: the fallback, not probed
+    uint32_t floorBr = 7;
+    while (floorBr > 0 && MFRC522_SpiHz(hspi, floorBr) < bus->spiBootHz) floorBr--;
+    uint32_t pass = floorBr;
+    for (uint32_t br = 0; br < floorBr; br++) {
+        if (MFRC522_SpiHz(hspi, br) > bus->spiCeilHz) continue;
+        MFRC522_SpiSetBr(hspi, br);
+        uint8_t ok = 1;
+        for (uint8_t i = 0; i < bus->count && ok; i++) {
+            ok = MFRC522_SpiTest(bus->readers[i]);
+        }
+        if (ok) {
+            pass = br;
+            break;
+        }
+    }
+    uint32_t br = (pass + MFRC522_SPI_MARGIN < floorBr) ? pass + MFRC522_SPI_MARGIN : floorBr;
+    MFRC522_SpiSetBr(hspi, br);
+    bus->spiHz = MFRC522_SpiHz(hspi, br);
+    bus->spiProbes++;
+    for (uint8_t i = 0; i < bus->count; i++) {
+        bus->readers[i]->linkFrames = 0;
+        bus->readers[i]->linkErrors = 0;
+    }
+    MFRC522_SpiRateChanged(hspi);
+    TRACE(TRACE_RC522_SPI, br, bus->spiHz / 1000);
+    USER_LOG("SPI %lu kHz (fastest pass %lu kHz)", (unsigned long)(bus->spiHz / 1000),
+             (unsigned long)(MFRC522_SpiHz(hspi, pass) / 1000));
+}
+
+// FIFO loaded, a command running or the oscillator restarting: a probe
+// must not touch this reader now
+static uint8_t MFRC522_InCommand(const MFRC522_t *dev) {
+    switch (dev->pollState) {
+    case POLL_WAKE:
+    case POLL_WAKE_WAIT:
+    case POLL_REQA_SEND:
+    case POLL_REQA_WAIT:
+    case POLL_TRACK_HALT_WAIT:
+    case POLL_TRACK_WUPA_WAIT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Error-rate window of the reader just polled. A bad one puts the ceiling
+// below the rate in use; the probe runs once no reader is mid-command.
+static void MFRC522_SpiCheck(MFRC522_Bus_t *bus, MFRC522_t *dev) {
+    if (dev->linkFrames >= MFRC522_SPI_WINDOW) {
+        if (dev->linkErrors > MFRC522_SPI_MAX_ERRORS && bus->spiHz > bus->spiBootHz) {
+            USER_LOG("%u CRC/BCC/FIFO errors in %u frames, probing SPI again", dev->linkErrors, dev->linkFrames);
+            bus->spiCeilHz = bus->spiHz - 1;
+            bus->spiReprobe = 1;
+        }
+        dev->linkFrames = 0;
+        dev->linkErrors = 0;
+    }
+    if (!bus->spiReprobe) return;
+    for (uint8_t i = 0; i < bus->count; i++) {
+        if (MFRC522_InCommand(bus->readers[i])) return;
+    }
+    bus->spiReprobe = 0;
+    MFRC522_SpiNegotiate(bus);
+}
+#endif
+
+void MFRC522_BusInit(MFRC522_Bus_t *bus) {
+    // Deselect every reader first so nobody else answers while one is set up
+    for (uint8_t i = 0; i < bus->count; i++) {
+        HAL_GPIO_WritePin(bus->readers[i]->csPort, bus->readers[i]->csPin, GPIO_PIN_SET);
+    }
+    for (uint8_t i = 0; i < bus->count; i++) {
+        MFRC522_Init(bus->readers[i]);
+    }
+#if MFRC522_SPI_NEGOTIATE
+    // Probed with the chip profiles' guard times; Calibrate below then
+    // shortens them at the rate the bus keeps
+    if (bus->count > 0) {
+        SPI_HandleTypeDef *hspi = bus->readers[0]->hspi;
+        bus->spiBootHz = MFRC522_SpiHz(hspi, (hspi->Instance->CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos);
+        bus->spiCeilHz = MFRC522_SPI_MAX_HZ;
+        MFRC522_SpiNegotiate(bus);
+    }
+#endif
+#if MFRC522_AUTO_CALIBRATE
+    for (uint8_t i = 0; i < bus->count; i++) {
+        MFRC522_Calibrate(bus->readers[i]);
+    }
+#endif
+    bus->next = 0;
+}
+
+// Give every reader on the bus one MFRC522_Poll step, starting after the
+// one that reported last so a busy reader cannot starve the others. A
+// reader waiting on its card (RC522 timer or IRQ) does not touch the bus,
+// so the others keep their full rate. Returns the index of the first reader
+// with an event (written to *evt), or -1 once all of them were idle.
+int8_t MFRC522_BusPoll(MFRC522_Bus_t *bus, MFRC522_Event_t *evt) {
+    for (uint8_t n = 0; n < bus->count; n++) {
+        uint8_t i = bus->next;
+        bus->next = (uint8_t)((i + 1) % bus->count);
+        MFRC522_Event_t e = MFRC522_Poll(bus->readers[i]);
+#if MFRC522_SPI_NEGOTIATE
+        MFRC522_SpiCheck(bus, bus->readers[i]);
+#endif
+        if (e != MFRC522_EVT_IDLE) {
+            *evt = e;
+            return (int8_t)i;
+        }
+    }
+    *evt = MFRC522_EVT_IDLE;
+    return -1;
+}
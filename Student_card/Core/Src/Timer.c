@@ -3,44 +3,127 @@
 #include "stdlib.h"
 
 timer_Objt Tim_1ms[MaxTIMER];
-uint32_t tim1msTick;
+volatile uint32_t tim1msTick;				//Counted in the TIM2 ISR, never cleared
+static uint32_t timNow;						//Last tick handled by scanTimer
+
+// Hashed timer wheel: a running timer sits in slot (PV % TIM_WHEEL_SLOTS),
+// so each tick only walks the timers hashed to that slot.
+static timer_Objt *timWheel[TIM_WHEEL_SLOTS];
+
+static void wheelInsert(timer_Objt *pTim)
+{
+	timer_Objt **slot = &timWheel[pTim->PV & (TIM_WHEEL_SLOTS - 1)];
+	pTim->prev = NULL;
+	pTim->next = *slot;
+	if(*slot) (*slot)->prev = pTim;
+	*slot = pTim;
+}
+
+static void wheelRemove(timer_Objt *pTim)
+{
+	if(pTim->prev) pTim->prev->next = pTim->next;
+	else timWheel[pTim->PV & (TIM_WHEEL_SLOTS - 1)] = pTim->next;
+	if(pTim->next) pTim->next->prev = pTim->prev;
+	pTim->next = pTim->prev = NULL;
+}
+
 void startTim(timer_Objt *pTim, uint32_t SV)
 {
 	if(pTim->En == 0)
 	{
 		pTim->En = 1;
 		if(SV<1) SV = 1;
-		pTim->SV = SV-1;
-		pTim->PV = 0;
+		pTim->SV = SV;
+		pTim->PV = timNow + SV;
 		pTim->Output = 0;
+		pTim->Missed = 0;
+		pTim->Cb = NULL;
+		pTim->Mode = TIM_PERIODIC;
+		wheelInsert(pTim);
 	}
 }
 
+// Callback timer: cb(ctx) runs from scanTimer in the main loop, in deadline
+// order. Restarting a running handle re-arms it with the new settings.
+void timer_start(timer_Objt *pTim, uint32_t period, uint8_t mode, timer_Cb_t cb, void *ctx)
+{
+	stopTim(pTim);
+	startTim(pTim, period);
+	pTim->Cb = cb;
+	pTim->Ctx = ctx;
+	pTim->Mode = mode;
+	pTim->Late = 0;
+	pTim->MaxLate = 0;
+}
+
+void timer_stop(timer_Objt *pTim)
+{
+	stopTim(pTim);
+	pTim->Cb = NULL;
+}
+
 void stopTim(timer_Objt *pTim)
 {
+	if(pTim->En) wheelRemove(pTim);
 	pTim->En = 0;
 	pTim->SV = 0;
 	pTim->PV = 0;
 	pTim->Output = 0;
 }
 
+uint32_t timGetTick(void)
+{
+	return tim1msTick;
+}
+
 /**********************************************************************************************/
 //void scanTime1ms(void)
 void scanTimer(void)
 {
-	if(tim1msTick == 1){
-		tim1msTick = 0;
-		int i = 0;
-		for(i=0; i<MaxTIMER; i++)									//Scan all declared timers
+	// Catch up on every tick since the last call, so a blocked main loop
+	// delays timers but never loses ticks
+	while(timNow != tim1msTick){
+		timNow++;
+		timer_Objt *due = NULL, **dueTail = &due;
+		timer_Objt *pTim = timWheel[timNow & (TIM_WHEEL_SLOTS - 1)];
+		while(pTim)
 		{
-			if(Tim_1ms[i].En == 1)
+			timer_Objt *next = pTim->next;
+			if(pTim->PV == timNow)						//Expired (others in the slot are later laps)
 			{
-				if(++Tim_1ms[i].PV > Tim_1ms[i].SV)	//Overflow
-				{
-					Tim_1ms[i].PV = 0;
-					Tim_1ms[i].Output = 1;						//Turn On the Timer Output
+				if(pTim->Output) pTim->Missed++;
+				pTim->Output = 1;						//Turn On the Timer Output
+				wheelRemove(pTim);
+				if(pTim->Cb && pTim->Mode == TIM_ONESHOT){
+					pTim->En = 0;
+				}else{
+					pTim->PV += pTim->SV;				//Periodic: re-arm from the nominal deadline
+					if(pTim->Cb && (int32_t)(tim1msTick - pTim->PV) >= 0){
+						// Callback fell a whole period behind: run it once, skip the rest
+						uint32_t skip = (tim1msTick - pTim->PV) / pTim->SV + 1;
+						pTim->Missed += skip;
+						pTim->PV += skip * pTim->SV;
+					}
+					wheelInsert(pTim);
+				}
+				if(pTim->Cb){							//Queue in FIFO order for dispatch
+					pTim->due = NULL;
+					*dueTail = pTim;
+					dueTail = &pTim->due;
 				}
 			}
+			pTim = next;
+		}
+		// Callbacks run after the slot walk, so they may start/stop any timer
+		while(due)
+		{
+			pTim = due;
+			due = pTim->due;
+			if(pTim->Cb == NULL) continue;				//Stopped by an earlier callback
+			pTim->Output = 0;
+			pTim->Late = tim1msTick - timNow;
+			if(pTim->Late > pTim->MaxLate) pTim->MaxLate = pTim->Late;
+			pTim->Cb(pTim->Ctx);
 		}
 	}
 }
@@ -53,8 +136,8 @@ void Timer_IT_Init(void)
 
 void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
 {
-  if(htim->Instance == TIM2)		//Timer 2 interrupt every 10ms
+  if(htim->Instance == TIM2)		//Timer 2 interrupt every 1ms
 	{
-		tim1msTick = 1; 
+		tim1msTick++;
 	}
-}
\ No newline at end of file
+}
@@ -0,0 +1,71 @@
+#include "actuator.h"
+#include "Timer.h"
+#include "main.h"
+
+typedef struct {
+    GPIO_TypeDef *port;
+    uint16_t pin;
+    timer_Objt tim;
+    uint16_t onMs;
+    uint16_t offMs;
+    uint8_t left;                   // Pulses still to start after the current one
+    uint8_t on;
+} Actuator_t;
+
+static Actuator_t act[ACT_COUNT] = {
+    [ACT_GREEN]  = {LED_GREEN_GPIO_Port, LED_GREEN_Pin},
+    [ACT_RED]    = {LED_RED_GPIO_Port, LED_RED_Pin},
+    [ACT_STATUS] = {GPIOC, GPIO_PIN_13},
+    [ACT_CAMERA] = {CAM_TRIG_GPIO_Port, CAM_TRIG_Pin},
+};
+
+static void setPin(Actuator_t *a, uint8_t on) {
+    a->on = on;
+    HAL_GPIO_WritePin(a->port, a->pin, on ? GPIO_PIN_SET : GPIO_PIN_RESET);
+}
+
+// One-shot timer per phase: end of "on" -> off gap or done, end of gap -> next pulse
+static void actStep(void *ctx) {
+    Actuator_t *a = ctx;
+    if (a->on) {
+        setPin(a, 0);
+        if (a->left) {
+            timer_start(&a->tim, a->offMs, TIM_ONESHOT, actStep, a);
+        }
+    } else if (a->left) {
+        a->left--;
+        setPin(a, 1);
+        timer_start(&a->tim, a->onMs, TIM_ONESHOT, actStep, a);
+    }
+}
+
+void Actuator_Init(void) {
+    for (uint8_t i = 0; i < ACT_COUNT; i++) {
+        Actuator_Off(i);
+    }
+}
+
+void Actuator_Pulse(uint8_t ch, uint16_t onMs, uint16_t offMs, uint8_t count) {
+    if (ch >= ACT_COUNT || count == 0) return;
+    Actuator_t *a = &act[ch];
+    a->onMs = onMs;
+    a->offMs = offMs;
+    a->left = count - 1;
+    setPin(a, 1);
+    timer_start(&a->tim, onMs, TIM_ONESHOT, actStep, a);
+}
+
+void Actuator_On(uint8_t ch, uint16_t ms) {
+    Actuator_Pulse(ch, ms, 0, 1);
+}
+
+void Actuator_Off(uint8_t ch) {
+    if (ch >= ACT_COUNT) return;
+    timer_stop(&act[ch].tim);
+    act[ch].left = 0;
+    setPin(&act[ch], 0);
+}
+
+uint8_t Actuator_Busy(uint8_t ch) {
+    return ch < ACT_COUNT && act[ch].tim.En;
+}
@@ -0,0 +1,194 @@
+#include "app_rtos.h"
+
+#if APP_RTOS
+#include "main.h"
+#include "cmsis_os2.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include <stdio.h>
+#include <string.h>
+#include "MFRC522_STM32.h"
+#include "Timer.h"
+#include "actuator.h"
+#include "trace.h"
+#include "proto.h"
+#include "whitelist.h"
+#include "journal.h"
+#include "uid_cache.h"
+#include "timesync.h"
+
+#define FLAG_RC522_IRQ  0x0001
+
+extern MFRC522_Bus_t rfBus;
+
+typedef struct {
+    uint8_t ch;
+    uint16_t ms;
+} App_ActMsg_t;
+
+static osThreadId_t readerId, actuatorId, commsId;
+static osMessageQueueId_t cardQ, actQ;
+
+// Everything statically allocated: no FreeRTOS heap needed for the app
+static StaticTask_t readerTcb, actuatorTcb, commsTcb;
+static uint64_t readerStack[APP_READER_STACK / 8];
+static uint64_t actuatorStack[APP_ACTUATOR_STACK / 8];
+static uint64_t commsStack[APP_COMMS_STACK / 8];
+static StaticQueue_t cardQcb, actQcb;
+static uint8_t cardQbuf[APP_QUEUE_DEPTH * sizeof(App_CardMsg_t)];
+static uint8_t actQbuf[APP_QUEUE_DEPTH * sizeof(App_ActMsg_t)];
+
+static const char *readerName[] = {"ENTRY", "EXIT"};
+
+// EXTI ISR -> reader task
+void MFRC522_IrqNotify(MFRC522_t *dev) {
+    (void)dev;
+    if (readerId) osThreadFlagsSet(readerId, FLAG_RC522_IRQ);
+}
+
+static void readerTask(void *arg) {
+    (void)arg;
+    MFRC522_Event_t evt;
+    int8_t idx;
+    static uint8_t suppressed[8];   // Per reader: last card was a repeat
+
+    for (;;) {
+        // IRQ wakes it at once; the 1 tick timeout keeps the poll deadlines
+        // and the IRQ-less exit reader going
+        osThreadFlagsWait(FLAG_RC522_IRQ, osFlagsWaitAny, 1);
+        while ((idx = MFRC522_BusPoll(&rfBus, &evt)) >= 0) {
+            App_CardMsg_t msg = {.reader = idx, .event = evt};
+            MFRC522_t *rd = rfBus.readers[idx];
+            if (evt == MFRC522_EVT_REMOVED) {
+                UidCache_Touch(idx, rd->uid.bytes, rd->uid.size, osKernelGetTickCount());
+                if (suppressed[idx]) continue;
+            } else if (evt == MFRC522_EVT_UID_READY) {
+                suppressed[idx] = UidCache_Seen(idx, rd->uid.bytes, rd->uid.size,
+                                                osKernelGetTickCount());
+                if (suppressed[idx]) continue;
+                uint8_t access = whitelist_lookup(rd->uid.bytes, rd->uid.size);
+                App_ActMsg_t act;
+                if (access == WL_ALLOW) {
+                    msg.decision = PROTO_GRANTED;
+                    act = (App_ActMsg_t){ACT_GREEN, ACT_GRANT_MS};
+                } else if (access == WL_DENY) {
+                    msg.decision = PROTO_DENIED;
+                    act = (App_ActMsg_t){ACT_RED, ACT_DENY_MS};
+                } else {
+                    msg.decision = PROTO_UNKNOWN;
+                    act = (App_ActMsg_t){ACT_STATUS, ACT_UNKNOWN_MS};
+                }
+                msg.uidLen = rd->uid.size;
+                msg.atUs = rd->profStartUs;
+                memcpy(msg.uid, rd->uid.bytes, rd->uid.size);
+                osMessageQueuePut(actQ, &act, 0, 0);
+                act = (App_ActMsg_t){ACT_CAMERA, ACT_TRIGGER_MS};
+                osMessageQueuePut(actQ, &act, 0, 0);
+            } else {
+                continue;
+            }
+            // Never wait on the comms side: a full queue drops the report,
+            // the decision has already gone to the actuator
+            if (osMessageQueuePut(cardQ, &msg, 0, 0) != osOK) {
+                TRACE(TRACE_OVERFLOW, 1, 1);
+            }
+        }
+    }
+}
+
+// The soft-timer wheel only drives the actuator patterns in this build
+static void actuatorTask(void *arg) {
+    (void)arg;
+    App_ActMsg_t act;
+    for (;;) {
+        if (osMessageQueueGet(actQ, &act, NULL, 1) == osOK) {
+            Actuator_On(act.ch, act.ms);
+        }
+        scanTimer();
+    }
+}
+
+static void reportCard(const App_CardMsg_t *msg) {
+    if (msg->event == MFRC522_EVT_REMOVED) {
+        Proto_SendRemoved(msg->reader);
+        journal_append(JRN_REMOVED, msg->reader, 0, NULL, 0);
+        return;
+    }
+    uint32_t seq = journal_append(JRN_CARD, msg->reader, msg->decision,
+                                  msg->uid, msg->uidLen);
+    Proto_SendCard(msg->reader, msg->uid, msg->uidLen, msg->decision, seq, msg->atUs);
+    printf("[%s] CARD ID:", readerName[msg->reader]);
+    for (int i = 0; i < msg->uidLen; i++) {
+        printf(" %02X", msg->uid[i]);
+    }
+    printf(msg->decision == PROTO_GRANTED ? " - Access Granted\n" :
+           msg->decision == PROTO_DENIED ? " - Access Denied\n" : " - Unknown\n");
+}
+
+// Sole writer of USART1 (uart_tx is single-writer) and of the whitelist flash
+static void commsTask(void *arg) {
+    (void)arg;
+    App_CardMsg_t msg;
+    uint32_t lastStats = osKernelGetTickCount();
+
+    for (;;) {
+        if (osMessageQueueGet(cardQ, &msg, NULL, 5) == osOK) {
+            reportCard(&msg);
+        }
+        Trace_Drain();
+        TimeSync_Local();           // Keep the 64-bit us count across now_us wraps
+        Proto_Poll();
+        whitelist_task();
+        journal_task(!whitelist_busy());
+        if (osKernelGetTickCount() - lastStats >= APP_STATS_MS) {
+            App_StackStats_t st;
+            lastStats = osKernelGetTickCount();
+            App_GetStackStats(&st);
+            printf("Stack free: reader %u, actuator %u, comms %u bytes\n",
+                   st.reader, st.actuator, st.comms);
+        }
+    }
+}
+
+void App_GetStackStats(App_StackStats_t *st) {
+    st->reader = osThreadGetStackSpace(readerId);
+    st->actuator = osThreadGetStackSpace(actuatorId);
+    st->comms = osThreadGetStackSpace(commsId);
+}
+
+void App_RtosStart(void) {
+    const osMessageQueueAttr_t cardAttr = {
+        .name = "card", .cb_mem = &cardQcb, .cb_size = sizeof(cardQcb),
+        .mq_mem = cardQbuf, .mq_size = sizeof(cardQbuf),
+    };
+    const osMessageQueueAttr_t actAttr = {
+        .name = "act", .cb_mem = &actQcb, .cb_size = sizeof(actQcb),
+        .mq_mem = actQbuf, .mq_size = sizeof(actQbuf),
+    };
+    const osThreadAttr_t readerAttr = {
+        .name = "reader", .priority = osPriorityHigh,
+        .cb_mem = &readerTcb, .cb_size = sizeof(readerTcb),
+        .stack_mem = readerStack, .stack_size = sizeof(readerStack),
+    };
+    const osThreadAttr_t actuatorAttr = {
+        .name = "actuator", .priority = osPriorityAboveNormal,
+        .cb_mem = &actuatorTcb, .cb_size = sizeof(actuatorTcb),
+        .stack_mem = actuatorStack, .stack_size = sizeof(actuatorStack),
+    };
+    const osThreadAttr_t commsAttr = {
+        .name = "comms", .priority = osPriorityBelowNormal,
+        .cb_mem = &commsTcb, .cb_size = sizeof(commsTcb),
+        .stack_mem = commsStack, .stack_size = sizeof(commsStack),
+    };
+
+    osKernelInitialize();
+    cardQ = osMessageQueueNew(APP_QUEUE_DEPTH, sizeof(App_CardMsg_t), &cardAttr);
+    actQ = osMessageQueueNew(APP_QUEUE_DEPTH, sizeof(App_ActMsg_t), &actAttr);
+    commsId = osThreadNew(commsTask, NULL, &commsAttr);
+    actuatorId = osThreadNew(actuatorTask, NULL, &actuatorAttr);
+    readerId = osThreadNew(readerTask, NULL, &readerAttr);
+    osKernelStart();
+    for (;;) {}
+}
+#endif
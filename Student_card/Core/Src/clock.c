@@ -0,0 +1,140 @@
+#include "clock.h"
+#include "main.h"
+#include "spi.h"
+#include "tim.h"
+#include "usart.h"
+#include "dwt.h"
+#include "trace.h"
+#include "uart_tx.h"
+
+static uint8_t mode = CLOCK_FAST;
+static uint8_t want = CLOCK_FAST;
+static uint32_t reqUs;              // When the pending request was made
+static uint32_t busyMs;             // Last time Clock_Task saw work
+static uint32_t timTickHz;          // TIM2 count rate set up by CubeMX
+static uint32_t spiMaxHz;           // SPI1 SCK set up by CubeMX
+static Clock_Stats_t stats;
+
+// TIM2 sits on APB1; its kernel clock is doubled when APB1 is divided
+static uint32_t tim2Clock(void) {
+    uint32_t pclk1 = HAL_RCC_GetPCLK1Freq();
+    return ((RCC->CFGR & RCC_CFGR_PPRE1) == RCC_HCLK_DIV1) ? pclk1 : 2U * pclk1;
+}
+
+// Smallest BR[2:0] whose SCK (PCLK2 / 2^(BR+1)) does not exceed spiMaxHz
+static uint32_t spiBaudBits(uint32_t pclk2) {
+    uint32_t br = 0;
+    while (br < 7 && (pclk2 >> (br + 1)) > spiMaxHz) br++;
+    return br << SPI_CR1_BR_Pos;
+}
+
+static void retime(void) {
+    // TIM2: keep the 1 us count so the 1 ms update (soft timers) holds. UG
+    // loads the new prescaler now instead of at the next update; URS keeps
+    // it from firing an extra tick. The partial tick in flight is lost.
+    uint32_t psc = tim2Clock() / timTickHz - 1U;
+    TIM2->PSC = psc;
+    htim2.Init.Prescaler = psc;
+    TIM2->CR1 |= TIM_CR1_URS;
+    TIM2->EGR = TIM_EGR_UG;
+    TIM2->CR1 &= ~TIM_CR1_URS;
+
+    uint32_t pclk2 = HAL_RCC_GetPCLK2Freq();
+    uint32_t br = spiBaudBits(pclk2);
+    __HAL_SPI_DISABLE(&hspi1);      // BR must not change while enabled
+    MODIFY_REG(hspi1.Instance->CR1, SPI_CR1_BR, br);
+    hspi1.Init.BaudRatePrescaler = br;  // HAL re-enables SPE on the next transfer
+
+    huart1.Instance->BRR = UART_BRR_SAMPLING16(pclk2, huart1.Init.BaudRate);
+}
+
+// Reprogram the bus dividers; 0 if USART1 or SPI1 are mid-transfer. A byte
+// arriving on RX during the switch may be lost; proto frames are CRC-checked
+// and the host resends.
+static uint8_t apply(uint8_t m) {
+    UartTx_Hold(1);
+    if (!UartTx_Idle() || hspi1.State != HAL_SPI_STATE_READY) return 0;
+
+    RCC_ClkInitTypeDef clk = {0};
+    clk.ClockType = RCC_CLOCKTYPE_HCLK | RCC_CLOCKTYPE_PCLK1 | RCC_CLOCKTYPE_PCLK2;
+    clk.AHBCLKDivider = (m == CLOCK_IDLE) ? RCC_SYSCLK_DIV8 : RCC_SYSCLK_DIV1;
+    clk.APB1CLKDivider = (m == CLOCK_IDLE) ? RCC_HCLK_DIV1 : RCC_HCLK_DIV2;  // PCLK1 <= 36 MHz
+    clk.APB2CLKDivider = RCC_HCLK_DIV1;
+
+    uint32_t t0 = now_us();
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    // Also updates SystemCoreClock and reloads SysTick for the new HCLK
+    HAL_StatusTypeDef st = HAL_RCC_ClockConfig(&clk, FLASH_LATENCY_2);
+    DWT_SetClock(SystemCoreClock);
+    if (st == HAL_OK) {
+        retime();
+    }
+    __set_PRIMASK(primask);
+    uint32_t us = now_us() - t0;
+    UartTx_Hold(0);
+    if (st != HAL_OK) {
+        want = mode;                // Keep the old mode, do not retry forever
+        return 1;
+    }
+
+    mode = m;
+    if (m == CLOCK_IDLE) stats.toIdle++;
+    else stats.toFast++;
+    stats.lastUs = us;
+    if (us > stats.maxUs) stats.maxUs = us;
+    stats.lastWaitUs = now_us() - reqUs;
+    if (stats.lastWaitUs > stats.maxWaitUs) stats.maxWaitUs = stats.lastWaitUs;
+    TRACE(TRACE_CLOCK, SystemCoreClock / 1000000U, us);
+    return 1;
+}
+
+void Clock_Init(void) {
+    timTickHz = tim2Clock() / (TIM2->PSC + 1U);
+    Clock_SpiChanged();
+    mode = want = CLOCK_FAST;
+    busyMs = HAL_GetTick();
+}
+
+void Clock_SpiChanged(void) {
+    spiMaxHz = HAL_RCC_GetPCLK2Freq() >> (((hspi1.Instance->CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos) + 1U);
+}
+
+void Clock_Request(uint8_t m) {
+#if ENABLE_CLOCK_SCALING
+    if (m == CLOCK_FAST) busyMs = HAL_GetTick();  // Restart the idle delay
+    if (m == want) return;
+    want = m;
+    reqUs = now_us();
+    if (want != mode) {
+        apply(want);
+    } else {
+        UartTx_Hold(0);             // Request withdrawn before it was applied
+    }
+#else
+    (void)m;
+#endif
+}
+
+void Clock_Task(uint8_t idle) {
+#if ENABLE_CLOCK_SCALING
+    if (!idle) {
+        Clock_Request(CLOCK_FAST);
+    } else if (HAL_GetTick() - busyMs >= CLOCK_IDLE_DELAY_MS) {
+        Clock_Request(CLOCK_IDLE);
+    }
+    if (want != mode) {
+        apply(want);
+    }
+#else
+    (void)idle;
+#endif
+}
+
+uint8_t Clock_Mode(void) {
+    return mode;
+}
+
+const Clock_Stats_t *Clock_GetStats(void) {
+    return &stats;
+}
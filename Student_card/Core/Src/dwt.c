@@ -0,0 +1,45 @@
+#include "dwt.h"
+#include "main.h"
+
+static uint32_t cyclesPerUs;
+static uint32_t lastCyc;
+static uint32_t cycRem;             // Cycles not yet counted as a whole us
+static uint32_t usNow;
+
+void DWT_Init(void) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    cyclesPerUs = SystemCoreClock / 1000000U;
+    lastCyc = 0;
+    cycRem = 0;
+    usNow = 0;
+}
+
+void DWT_SetClock(uint32_t hz) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    now_us();                       // Count elapsed cycles at the old rate
+    cyclesPerUs = hz / 1000000U;
+    cycRem = 0;
+    __set_PRIMASK(primask);
+}
+
+void delay_us(uint32_t us) {
+    uint32_t start = DWT->CYCCNT;
+    uint32_t cycles = us * cyclesPerUs;
+    while (DWT->CYCCNT - start < cycles) {}
+}
+
+uint32_t now_us(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t cyc = DWT->CYCCNT;
+    cycRem += cyc - lastCyc;
+    lastCyc = cyc;
+    usNow += cycRem / cyclesPerUs;
+    cycRem %= cyclesPerUs;
+    uint32_t us = usNow;
+    __set_PRIMASK(primask);
+    return us;
+}
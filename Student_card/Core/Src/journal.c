@@ -0,0 +1,228 @@
+#include "journal.h"
+#include "proto.h"
+#include "main.h"
+#include <string.h>
+
+extern const uint8_t _sjournal[];
+
+#define JRN_TOTAL   (JRN_PAGES * JRN_SLOTS)
+#define JRN_FREE    0xFFFFFFFFu
+
+static struct {
+    uint16_t head;                  // Next slot to program
+    uint32_t nextSeq;
+    uint8_t clean;                  // Bit per page: fully erased
+    Journal_Rec_t queue[JRN_QUEUE];
+    uint8_t qHead, qCount;
+    // Replay to the host
+    uint8_t replay;                 // Host connected (JRN_SYNC seen)
+    uint8_t retries;
+    uint32_t cursor;                // Next seq to send
+    uint32_t inFlight;              // Last seq of the batch awaiting JRN_ACK, 0: none
+    uint32_t sentAt;
+    Journal_Stats_t stats;
+} jrn;
+
+static const Journal_Rec_t *slotAt(uint16_t i) {
+    return (const Journal_Rec_t *)(_sjournal + (i / JRN_SLOTS) * JRN_PAGE_SIZE +
+                                   (i % JRN_SLOTS) * sizeof(Journal_Rec_t));
+}
+
+static uint8_t recCheck(const Journal_Rec_t *r) {
+    const uint8_t *b = (const uint8_t *)r;
+    uint8_t sum = 0;
+    for (uint8_t i = 0; i < sizeof(Journal_Rec_t) - 1; i++) sum += b[i];
+    return sum;
+}
+
+// reserved and uidLen also reject records of the older 20-byte layout
+static uint8_t recValid(const Journal_Rec_t *r) {
+    return r->seq != JRN_FREE && r->reserved == 0xFF && r->uidLen <= sizeof(r->uid) &&
+           r->check == recCheck(r);
+}
+
+static uint8_t isErased(const uint8_t *p, uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) {
+        if (p[i] != 0xFF) return 0;
+    }
+    return 1;
+}
+
+void journal_init(void) {
+    uint32_t maxSeq = 0;
+    int32_t maxIdx = -1;
+
+    memset(&jrn, 0, sizeof(jrn));
+    for (uint16_t i = 0; i < JRN_TOTAL; i++) {
+        const Journal_Rec_t *r = slotAt(i);
+        if (!recValid(r)) continue;
+        if (maxIdx < 0 || (int32_t)(r->seq - maxSeq) > 0) {
+            maxSeq = r->seq;
+            maxIdx = i;
+        }
+        if (r->type == JRN_ACKED && (int32_t)(r->ts - jrn.stats.acked) > 0) {
+            jrn.stats.acked = r->ts;
+        }
+    }
+    for (uint8_t p = 0; p < JRN_PAGES; p++) {
+        if (isErased(_sjournal + p * JRN_PAGE_SIZE, JRN_PAGE_SIZE)) jrn.clean |= 1 << p;
+    }
+    jrn.nextSeq = maxSeq + 1;
+    jrn.stats.head = maxSeq;
+    jrn.head = (uint16_t)((maxIdx + 1) % JRN_TOTAL);
+    // Skip slots left half-programmed by a reset; a page start is handled
+    // by the erase-ahead logic
+    while (jrn.head % JRN_SLOTS &&
+           !isErased((const uint8_t *)slotAt(jrn.head), sizeof(Journal_Rec_t))) {
+        jrn.head = (jrn.head + 1) % JRN_TOTAL;
+    }
+}
+
+uint32_t journal_append(uint8_t type, uint8_t reader, uint8_t decision,
+                        const uint8_t *uid, uint8_t uidLen) {
+    uint32_t seq = jrn.nextSeq++;   // A lost record still uses up its number
+    if (jrn.qCount >= JRN_QUEUE) {
+        jrn.stats.lost++;           // Flash could not keep up (erase pending)
+        return seq;
+    }
+    Journal_Rec_t *r = &jrn.queue[(jrn.qHead + jrn.qCount) % JRN_QUEUE];
+    memset(r, 0xFF, sizeof(*r));
+    r->seq = seq;
+    r->ts = (type == JRN_ACKED) ? jrn.stats.acked : HAL_GetTick();
+    r->type = type;
+    r->reader = reader;
+    r->decision = decision;
+    if (uidLen > sizeof(r->uid)) uidLen = sizeof(r->uid);  // Readers deliver at most 10
+    r->uidLen = uidLen;
+    if (uid) memcpy(r->uid, uid, uidLen);
+    r->check = recCheck(r);
+    jrn.qCount++;
+    return seq;
+}
+
+uint8_t journal_busy(void) {
+    return jrn.qCount != 0;
+}
+
+static void erasePage(uint8_t p) {
+    FLASH_EraseInitTypeDef erase;
+    uint32_t pageErr;
+
+    for (uint16_t i = p * JRN_SLOTS; i < (p + 1) * JRN_SLOTS; i++) {
+        const Journal_Rec_t *r = slotAt(i);
+        if (recValid(r) && r->type != JRN_ACKED && (int32_t)(r->seq - jrn.stats.acked) > 0) {
+            jrn.stats.lost++;       // Overwritten before the host fetched it
+        }
+    }
+    erase.TypeErase = FLASH_TYPEERASE_PAGES;
+    erase.PageAddress = (uint32_t)_sjournal + p * JRN_PAGE_SIZE;
+    erase.NbPages = 1;
+    HAL_FLASH_Unlock();
+    if (HAL_FLASHEx_Erase(&erase, &pageErr) == HAL_OK) jrn.clean |= 1 << p;
+    HAL_FLASH_Lock();
+}
+
+// Seq is programmed last, so a record torn by a reset never looks valid
+static void programRec(uint16_t slot, const Journal_Rec_t *r) {
+    uint32_t addr = (uint32_t)slotAt(slot);
+    const uint16_t *hw = (const uint16_t *)r;
+    HAL_FLASH_Unlock();
+    for (uint8_t i = 2; i < sizeof(*r) / 2; i++) {
+        HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, addr + 2 * i, hw[i]);
+    }
+    HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, addr, hw[0]);
+    HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, addr + 2, hw[1]);
+    HAL_FLASH_Lock();
+}
+
+// Next record with seq >= from, in order; NULL when caught up
+static const Journal_Rec_t *findFrom(uint32_t from) {
+    const Journal_Rec_t *best = NULL;
+    for (uint16_t i = 0; i < JRN_TOTAL; i++) {
+        const Journal_Rec_t *r = slotAt(i);
+        if (!recValid(r) || r->type == JRN_ACKED || (int32_t)(r->seq - from) < 0) continue;
+        if (!best || (int32_t)(r->seq - best->seq) < 0) best = r;
+    }
+    return best;
+}
+
+static void sendBatch(void) {
+    uint32_t seq = jrn.cursor;
+    uint8_t n = 0;
+    const Journal_Rec_t *r;
+
+    while (n < JRN_BATCH && (r = findFrom(seq)) != NULL) {
+        uint8_t p[12 + sizeof(r->uid)];
+        memcpy(p, &r->seq, 4);
+        memcpy(p + 4, &r->ts, 4);
+        p[8] = r->type;
+        p[9] = r->reader;
+        p[10] = r->decision;
+        p[11] = r->uidLen;
+        memcpy(p + 12, r->uid, r->uidLen);
+        Proto_Send(PROTO_EVT_JOURNAL, p, 12 + r->uidLen);
+        jrn.inFlight = r->seq;
+        seq = r->seq + 1;
+        n++;
+    }
+    if (n) jrn.sentAt = HAL_GetTick();
+    else jrn.cursor = jrn.stats.head + 1;   // Only JRN_ACKED records left
+}
+
+void journal_task(uint8_t idle) {
+    uint8_t headPage = jrn.head / JRN_SLOTS;
+    uint8_t aheadPage = (headPage + 1) % JRN_PAGES;
+    uint8_t atPageStart = (jrn.head % JRN_SLOTS) == 0;
+
+    // Writing into a fresh page needs it erased; the page after the head
+    // is erased early, only while no card is being read, so that this
+    // case normally never waits.
+    if (atPageStart && !(jrn.clean & (1 << headPage))) {
+        if (jrn.qCount) erasePage(headPage);
+    } else if (!(jrn.clean & (1 << aheadPage)) && idle && aheadPage != headPage) {
+        erasePage(aheadPage);
+    } else if (jrn.qCount) {
+        Journal_Rec_t *r = &jrn.queue[jrn.qHead];
+        if (atPageStart) jrn.clean &= ~(1 << headPage);
+        programRec(jrn.head, r);
+        jrn.stats.head = r->seq;
+        jrn.stats.appended++;
+        jrn.head = (jrn.head + 1) % JRN_TOTAL;
+        jrn.qHead = (jrn.qHead + 1) % JRN_QUEUE;
+        jrn.qCount--;
+    }
+
+    if (!jrn.replay) return;
+    if (jrn.inFlight) {
+        if (HAL_GetTick() - jrn.sentAt < JRN_RESEND_MS) return;
+        if (++jrn.retries > 3) {    // Host gone again, wait for the next JRN_SYNC
+            jrn.replay = 0;
+            jrn.inFlight = 0;
+            return;
+        }
+    }
+    jrn.inFlight = 0;
+    if ((int32_t)(jrn.stats.head - jrn.cursor) >= 0) sendBatch();
+}
+
+void journal_sync(uint32_t hostSeq) {
+    // 0: host has nothing of its own, send what it has not acknowledged
+    jrn.cursor = (hostSeq ? hostSeq : jrn.stats.acked) + 1;
+    jrn.replay = 1;
+    jrn.retries = 0;
+    jrn.inFlight = 0;
+}
+
+void journal_ack(uint32_t seq) {
+    jrn.retries = 0;
+    if (jrn.inFlight && (int32_t)(seq - jrn.inFlight) >= 0) jrn.inFlight = 0;
+    if ((int32_t)(seq + 1 - jrn.cursor) > 0) jrn.cursor = seq + 1;
+    if ((int32_t)(seq - jrn.stats.acked) > 0) {
+        jrn.stats.acked = seq;
+        journal_append(JRN_ACKED, 0, 0, NULL, 0);
+    }
+}
+
+const Journal_Stats_t *journal_stats(void) {
+    return &jrn.stats;
+}
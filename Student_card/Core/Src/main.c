@@ -8,6 +8,7 @@
 /* USER CODE END Header */
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
+#include "dma.h"
 #include "spi.h"
 #include "tim.h"
 #include "usart.h"
@@ -16,8 +17,22 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include <stdio.h> // Thu vien cho printf
+#include <string.h> // memcpy
 #include "Timer.h"
 #include "MFRC522_STM32.h" // Thu vien ban dang dung
+#include "trace.h"
+#include "uart_tx.h"
+#include "proto.h"
+#include "whitelist.h"
+#include "actuator.h"
+#include "dwt.h"
+#include "app_rtos.h"
+#include "journal.h"
+#include "prof.h"
+#include "uid_cache.h"
+#include "clock.h"
+#include "tiny_printf.h"
+#include "timesync.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -27,6 +42,16 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+// 1: RC522 soft power-down giua cac lan quet, CPU ngu (Sleep) khi ranh
+#define RFID_LOW_POWER 1
+// 1: co them dau doc cho cong ra (CS PB12, RESET PB13, khong dung IRQ).
+// Mac dinh 0: board hien tai chi co 1 dau doc; dau doc thu 2 khong lap ma bat
+// thi MFRC522_SpiTest luon loi, SPI khong duoc tang toc va ton 1 luot poll moi vong.
+// Chi dat 1 khi da han RC522 thu 2 vao SPI chung, CS PB12 va RESET PB13.
+#define RFID_EXIT_READER 0
+// 1: doc ma so sinh vien (ASCII) tu block RFID_STUDENT_BLOCK cua the MIFARE Classic
+#define RFID_READ_STUDENT 1
+#define RFID_STUDENT_BLOCK 4  // Sector 1, block dau
 
 /* USER CODE END PD */
 
@@ -47,7 +72,19 @@ uint8_t uid[4]; // Mang luu ID the doc duoc
 // SPI: hspi1
 // CS (SDA): PA4
 // RESET: PB0
-MFRC522_t rfID = {&hspi1, GPIOA, GPIO_PIN_4, GPIOB, GPIO_PIN_0};
+// IRQ: PB1 (EXTI1)
+// DMA: SPI1 RX/TX tren DMA1 Channel2/3
+MFRC522_t rfID = {&hspi1, GPIOA, GPIO_PIN_4, GPIOB, GPIO_PIN_0, RC522_IRQ_GPIO_Port, RC522_IRQ_Pin, 0, 1};
+
+#if RFID_EXIT_READER
+// Dau doc cong ra, chung SPI1: CS PB12, RESET PB13, IRQ khong noi (poll)
+MFRC522_t rfExit = {&hspi1, EXIT_SDA_GPIO_Port, EXIT_SDA_Pin, EXIT_RESET_GPIO_Port, EXIT_RESET_Pin, NULL, 0, 0, 1};
+MFRC522_t *readers[] = {&rfID, &rfExit};
+#else
+MFRC522_t *readers[] = {&rfID};
+#endif
+static const char *readerName[] = {"ENTRY", "EXIT"};
+MFRC522_Bus_t rfBus = {readers, sizeof(readers) / sizeof(readers[0]), 0};
 
 /* USER CODE END PV */
 
@@ -60,14 +97,149 @@ void SystemClock_Config(void);
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
 
+// Driver MFRC522 vua doi toc do SPI1 (do toc do luc khoi dong / khi loi
+// CRC/BCC tang): clock.c giu SCK moi khi doi HCLK
+void MFRC522_SpiRateChanged(SPI_HandleTypeDef *hspi) {
+  if (hspi == &hspi1) {
+    Clock_SpiChanged();
+  }
+}
+
 // Ham nay giup printf() day du lieu ra cong UART1
 int _write(int fd, unsigned char *buf, int len) {
   if (fd == 1 || fd == 2) {
-    HAL_UART_Transmit(&huart1, buf, len, 1000);
+    // Chep vao vong dem, DMA gui nen -> printf tra ve ngay
+    UartTx_Write(buf, len);
   }
   return len;
 }
 
+#if RFID_READ_STUDENT
+// Khoa A cua sector chua ma so sinh vien (mac dinh nha san xuat)
+static const uint8_t studentKey[MFRC522_KEY_SIZE] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// The vua SELECT (ACTIVE): xac thuc sector roi doc block, chi the MIFARE Classic
+static void readStudentNo(MFRC522_t *rd) {
+  uint8_t block[MFRC522_BLOCK_SIZE + 1];
+  if (!(rd->uid.sak & 0x08)) return;
+
+  uint32_t t0 = now_us();
+  uint8_t res = MFRC522_Authenticate(rd, PICC_MF_AUTH_KEY_A, RFID_STUDENT_BLOCK, studentKey, &rd->uid);
+  if (res == STATUS_OK) {
+    res = MFRC522_ReadBlock(rd, RFID_STUDENT_BLOCK, block);
+  }
+  MFRC522_StopCrypto1(rd);
+  uint32_t us = now_us() - t0;
+  if (res != STATUS_OK) {
+    printf("Student No: read failed (%u)\n", res);
+    return;
+  }
+  // Bo dem cuoi bang ky tu khong in duoc (0x00/0xFF)
+  block[MFRC522_BLOCK_SIZE] = 0;
+  for (int i = 0; i < MFRC522_BLOCK_SIZE; i++) {
+    if (block[i] < 0x20 || block[i] > 0x7E) {
+      block[i] = 0;
+      break;
+    }
+  }
+  printf("Student No: %s (auth+read %lu us)\n", (char *)block, us);
+}
+#endif
+
+// Moi 1ms chay mot buoc cho tung dau doc (lan luot)
+static void rfidPollTask(void *ctx) {
+  (void)ctx;
+  MFRC522_Event_t evt;
+  int8_t idx;
+
+  static uint8_t suppressed[sizeof(readers) / sizeof(readers[0])];
+
+  while ((idx = MFRC522_BusPoll(&rfBus, &evt)) >= 0) {
+    MFRC522_t *rd = readers[idx];
+    if (evt == MFRC522_EVT_DETECTED) {
+      // Co the -> len 72MHz ngay, doc UID/tra flash/bat den nhanh hon
+      Clock_Request(CLOCK_FAST);
+      continue;
+    }
+    if (evt == MFRC522_EVT_REMOVED) {
+      // Lan thay cuoi = luc the roi khoi vung doc
+      UidCache_Touch(idx, rd->uid.bytes, rd->uid.size, HAL_GetTick());
+      if (suppressed[idx]) continue;
+      Proto_SendRemoved(idx);
+      journal_append(JRN_REMOVED, idx, 0, NULL, 0);
+      continue;
+    }
+    if (evt != MFRC522_EVT_UID_READY) continue;
+    // Cung the vua quet lai trong cua so chong lap -> khong bao lai
+    suppressed[idx] = UidCache_Seen(idx, rd->uid.bytes, rd->uid.size, HAL_GetTick());
+    if (suppressed[idx]) continue;
+    memcpy(uid, rd->uid.bytes, 4);
+
+    // Tra danh sach trang trong flash (tim kiem nhi phan)
+    uint32_t t0 = now_us();
+    uint8_t access = whitelist_lookup(rd->uid.bytes, rd->uid.size);
+    PROF_RECORD(PROF_DECISION, now_us() - t0);
+    uint8_t act = (access == WL_ALLOW) ? ACT_GREEN : (access == WL_DENY) ? ACT_RED : ACT_STATUS;
+    uint16_t actMs = (access == WL_ALLOW) ? ACT_GRANT_MS : (access == WL_DENY) ? ACT_DENY_MS : ACT_UNKNOWN_MS;
+    // Bat den ngay sau khi co quyet dinh, truoc moi printf
+    t0 = now_us();
+    Actuator_On(act, actMs);
+    Actuator_On(ACT_CAMERA, ACT_TRIGGER_MS);  // Xung kich chup anh cho ESP32-CAM
+    PROF_RECORD(PROF_ACTUATOR, now_us() - t0);
+    PROF_RECORD(PROF_TOTAL, now_us() - rd->profStartUs);
+
+    // In ID ra man hinh Serial (4, 7 hoac 10 byte)
+    printf("[%s] CARD ID:", readerName[idx]);
+    for (int i = 0; i < rd->uid.size; i++) {
+      printf(" %02X", rd->uid.bytes[i]);
+    }
+    printf("\n");
+#if RFID_LOW_POWER
+    printf("RF: %lu probes, %lu ms on; wake->detect %lu ms\n",
+           rd->power.probes, rd->power.rfOnMs, rd->power.wakeToDetectMs);
+#endif
+#if RFID_READ_STUDENT
+    readStudentNo(rd);  // Sau khi bat den: khong lam cham quyet dinh
+#endif
+
+    // Den chay theo soft timer -> RequestA tiep theo bat dau ngay
+    // seq cua ban ghi nhat ky = ma lan quet, ESP32 gan vao anh chup
+    uint32_t seq;
+    if (access == WL_ALLOW) {
+        seq = journal_append(JRN_CARD, idx, PROTO_GRANTED, rd->uid.bytes, rd->uid.size);
+        Proto_SendCard(idx, rd->uid.bytes, rd->uid.size, PROTO_GRANTED, seq, rd->profStartUs);
+        printf("Access Granted - GREEN LED ON\n");
+    }
+    // The bi chan -> Bat den Do (PB15)
+    else if (access == WL_DENY) {
+        seq = journal_append(JRN_CARD, idx, PROTO_DENIED, rd->uid.bytes, rd->uid.size);
+        Proto_SendCard(idx, rd->uid.bytes, rd->uid.size, PROTO_DENIED, seq, rd->profStartUs);
+        printf("Access Denied - RED LED ON\n");
+    }
+    else {
+        seq = journal_append(JRN_CARD, idx, PROTO_UNKNOWN, rd->uid.bytes, rd->uid.size);
+        Proto_SendCard(idx, rd->uid.bytes, rd->uid.size, PROTO_UNKNOWN, seq, rd->profStartUs);
+        // The la -> Nhay den PC13 (Onboard)
+    }
+  }
+}
+
+// Khong co the nao trong vung doc -> duoc phep xoa trang flash (~20ms)
+static uint8_t readersIdle(void) {
+  for (int i = 0; i < rfBus.count; i++) {
+    if (readers[i]->cardPresent) return 0;
+  }
+  return !whitelist_busy();
+}
+
+// Nhip 1s (chua dung)
+static void heartbeatTask(void *ctx) {
+  (void)ctx;
+  TimeSync_Local();  // Moi 1s doc CYCCNT: now_us khong lo vong tran (~59s), dem 64 bit khong lo 71 phut
+  // Chi blink LED PC13 neu khong dang xu ly the
+  // HAL_GPIO_TogglePin(GPIOC, GPIO_PIN_13);
+}
+
 /* USER CODE END 0 */
 
 /**
@@ -99,20 +271,55 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_TIM2_Init();
   MX_SPI1_Init();
   MX_USART1_UART_Init();
   /* USER CODE BEGIN 2 */
 
+  DWT_Init();  // delay_us/now_us cho driver MFRC522
+  Clock_Init();  // Ghi nho SCK cua SPI1 va nhip TIM2 luc 72MHz
+  TimeSync_Init();  // Gio chung voi may chu (epoch us), dong bo qua UART
+
+  // Khung nhi phan su kien (CRC phan cung), gui BOOT
+  Proto_Init();
+  whitelist_init();
+  journal_init();  // Nhat ky su kien khi mat ket noi may chu
+  UidCache_Init(UID_CACHE_WINDOW_MS);
+  Actuator_Init();
+
   // Khoi dong Timer ngat (cho logic cu cua ban)
   HAL_TIM_Base_Start_IT(&htim2);
-  startTim(&Tim_1ms[0], 1000);
+  timer_start(&Tim_1ms[0], 1000, TIM_PERIODIC, heartbeatTask, NULL);
 
   // --- KHOI TAO RC522 ---
-  // Truyen dia chi bien struct da khai bao o tren
-  MFRC522_Init(&rfID);
+  // Khoi tao tat ca dau doc tren SPI1 (nha CS het truoc), roi do toc do
+  // SPI nhanh nhat ca bus chay on dinh
+  MFRC522_BusInit(&rfBus);
+  for (int i = 0; i < rfBus.count; i++) {
+    MFRC522_SetLowPower(readers[i], RFID_LOW_POWER);
+  }
 
-  printf("System Init Done. Waiting for Card...\n");
+  timer_start(&Tim_1ms[1], 1, TIM_PERIODIC, rfidPollTask, NULL);  // Nhip 1ms cho MFRC522_Poll
+
+#if TINY_PRINTF_BENCH
+  // Do so chu ky CPU cho mot dong log dien hinh (tp_snprintf, khong gui UART)
+  {
+    char line[48];
+    uint32_t c0 = DWT->CYCCNT;
+    tp_snprintf(line, sizeof(line), "[%s] CARD ID: %02X %02X %02X %02X\n", "ID", 0x20, 0x00, 0x01, 0xE4);
+    uint32_t cycles = DWT->CYCCNT - c0;
+    printf("tp_snprintf: %lu cycles for \"%s\"", cycles, line);
+  }
+#endif
+
+  printf("System Init Done. %u cards in whitelist v%u. Waiting for Card...\n", whitelist_count(), whitelist_version());
+
+#if APP_RTOS
+  // Ban RTOS: cac task doc the / den / UART thay cho vong lap ben duoi
+  timer_stop(&Tim_1ms[1]);
+  App_RtosStart();
+#endif
 
   /* USER CODE END 2 */
 
@@ -120,49 +327,19 @@ int main(void)
   /* USER CODE BEGIN WHILE */
   while (1)
   {
-    // --- LOGIC 1: QUET THE RFID (High Level) ---
-    // 1. Cho den khi co the quet
-    if (waitcardDetect(&rfID) == STATUS_OK) {
-
-      // 2. Doc UID cua the
-      if (MFRC522_ReadUid(&rfID, uid) == STATUS_OK) {
-
-        // In ID ra man hinh Serial
-        printf("CARD ID: %02X %02X %02X %02X\n", uid[0], uid[1], uid[2], uid[3]);
-
-        // Vi du 1: The Master -> Bat den Xanh (PA8)
-        if ((uid[0] == 0x20) && (uid[1] == 0x00) && (uid[2] == 0x01) && (uid[3] == 0xE4)) {
-            printf("Access Granted - GREEN LED ON\n");
-            HAL_GPIO_WritePin(GPIOA, GPIO_PIN_8, GPIO_PIN_SET);   // Bat LED PA8
-            HAL_Delay(1000);
-            HAL_GPIO_WritePin(GPIOA, GPIO_PIN_8, GPIO_PIN_RESET); // Tat LED PA8
-        }
-        // Vi du 2: The khac -> Bat den Do (PB15)
-        else if ((uid[0] == 0x1D) && (uid[1] == 0x7D) && (uid[2] == 0xCD) && (uid[3] == 0x73)) {
-            printf("Access Denied - RED LED ON\n");
-            HAL_GPIO_WritePin(GPIOB, GPIO_PIN_15, GPIO_PIN_SET);  // Bat LED PB15
-            HAL_Delay(1000);
-            HAL_GPIO_WritePin(GPIOB, GPIO_PIN_15, GPIO_PIN_RESET);// Tat LED PB15
-        }
-        else {
-            // The la -> Nhay den PC13 (Onboard)
-            HAL_GPIO_TogglePin(GPIOC, GPIO_PIN_13);
-            HAL_Delay(200);
-            HAL_GPIO_TogglePin(GPIOC, GPIO_PIN_13);
-        }
-      }
-
-      // 4. Doi nhat the ra moi tiep tuc
-      waitcardRemoval(&rfID);
-    }
-
-    // --- LOGIC 2: TIMER CUA BAN ---
+    // Chay cac tac vu den han (quet the, nhip 1s...) theo thu tu deadline
     scanTimer();
-    if(Tim_1ms[0].En && Tim_1ms[0].Output){
-        Tim_1ms[0].Output = 0;
-        // Chi blink LED PC13 neu khong dang xu ly the
-        // HAL_GPIO_TogglePin(GPIOC, GPIO_PIN_13);
-    }
+    Trace_Drain();  // Gui trace nhi phan qua UART (nen)
+    Proto_Poll();      // Lenh dong bo whitelist tu may chu (PA10)
+    whitelist_task();  // Moi vong chi 1 buoc xoa/ghi flash, the van duoc quet
+    journal_task(readersIdle());
+    Clock_Task(readersIdle());  // Ranh > 2s -> HCLK 9MHz, co viec -> 72MHz
+
+#if RFID_LOW_POWER
+    // Ngu den ngat tiep theo (TIM2 1ms, SysTick, UART). Stop mode khong dung
+    // duoc vi TIM2/SysTick dung theo va chua co RTC de danh thuc.
+    HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+#endif
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
@@ -0,0 +1,67 @@
+#include "prof.h"
+#include "proto.h"
+#include <string.h>
+
+static Prof_Hist_t profHist[PROF_PHASES];
+static uint32_t profCnt[PROF_COUNTERS];
+
+void Prof_Record(uint8_t phase, uint32_t us) {
+    if (phase >= PROF_PHASES) return;
+    Prof_Hist_t *h = &profHist[phase];
+    uint8_t b = 0;
+    for (uint32_t v = us >> (PROF_MIN_SHIFT + 1); v && b < PROF_BUCKETS - 1; v >>= 1) b++;
+    if (h->hist[b] != 0xFFFF) h->hist[b]++;
+    if (h->count == 0 || us < h->min) h->min = us;
+    if (us > h->max) h->max = us;
+    h->sumUs += us;
+    h->count++;
+}
+
+void Prof_Count(uint8_t counter) {
+    if (counter < PROF_COUNTERS) profCnt[counter]++;
+}
+
+const Prof_Hist_t *Prof_Get(uint8_t phase) {
+    return (phase < PROF_PHASES) ? &profHist[phase] : NULL;
+}
+
+uint32_t Prof_Counter(uint8_t counter) {
+    return (counter < PROF_COUNTERS) ? profCnt[counter] : 0;
+}
+
+void Prof_Reset(void) {
+    memset(profHist, 0, sizeof(profHist));
+    memset(profCnt, 0, sizeof(profCnt));
+}
+
+static uint8_t put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+    return 4;
+}
+
+void Prof_Send(void) {
+    uint8_t p[1 + 16 + 2 * PROF_BUCKETS];
+    for (uint8_t ph = 0; ph < PROF_PHASES; ph++) {
+        const Prof_Hist_t *h = &profHist[ph];
+        uint8_t n = 0;
+        p[n++] = ph;
+        n += put32(&p[n], h->count);
+        n += put32(&p[n], h->min);
+        n += put32(&p[n], h->max);
+        n += put32(&p[n], h->sumUs);
+        for (uint8_t b = 0; b < PROF_BUCKETS; b++) {
+            p[n++] = (uint8_t)h->hist[b];
+            p[n++] = (uint8_t)(h->hist[b] >> 8);
+        }
+        Proto_Send(PROTO_EVT_PROF, p, n);
+    }
+    uint8_t n = 0;
+    p[n++] = 0xFF;                  // Counters frame
+    for (uint8_t c = 0; c < PROF_COUNTERS; c++) {
+        n += put32(&p[n], profCnt[c]);
+    }
+    Proto_Send(PROTO_EVT_PROF, p, n);
+}
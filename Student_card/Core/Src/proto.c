@@ -0,0 +1,286 @@
+#include "proto.h"
+#include "main.h"
+#include "uart_tx.h"
+#include "usart.h"
+#include "whitelist.h"
+#include "journal.h"
+#include "prof.h"
+#include "dwt.h"
+#include "timesync.h"
+
+static uint8_t protoSeq;
+
+// Host -> board bytes, filled one at a time by the USART1 Rx interrupt
+static uint8_t rxRing[PROTO_RX_SIZE];
+static volatile uint16_t rxHead;
+static uint16_t rxTail;
+static uint8_t rxByte;
+static volatile uint32_t rxStampUs; // now_us() of the latest Rx byte, for TIME_GET
+
+// Parsed command waiting for the whitelist to be free
+static uint8_t cmdFrame[2 + 6 + PROTO_MAX_PAYLOAD + 4];
+static uint8_t cmdPending;
+static uint8_t cmdCommit;           // COMMIT accepted, ACK when the flash is written
+static uint8_t cmdLen;
+
+void Proto_Init(void) {
+    __HAL_RCC_CRC_CLK_ENABLE();
+    protoSeq = 0;
+    rxHead = rxTail = 0;
+    cmdPending = cmdCommit = 0;
+    HAL_UART_Receive_IT(&huart1, &rxByte, 1);
+    Proto_Send(PROTO_EVT_BOOT, NULL, 0);
+}
+
+// Hardware CRC over whole words; the tail is zero-padded
+uint32_t Proto_Crc(const uint8_t *data, uint16_t len) {
+    CRC->CR = CRC_CR_RESET;
+    for (uint16_t i = 0; i < len; i += 4) {
+        uint32_t w = 0;
+        for (uint16_t k = 0; k < 4; k++) {
+            w = (w << 8) | ((i + k < len) ? data[i + k] : 0);
+        }
+        CRC->DR = w;
+    }
+    return CRC->DR;
+}
+
+void Proto_Send(uint8_t type, const uint8_t *payload, uint8_t len) {
+    uint8_t frame[2 + 6 + PROTO_MAX_PAYLOAD + 4];
+    uint32_t ts = HAL_GetTick();
+    uint8_t n = 0;
+
+    if (len > PROTO_MAX_PAYLOAD) {
+        return;
+    }
+    frame[n++] = PROTO_SOF;
+    frame[n++] = 6 + len;
+    frame[n++] = type;
+    frame[n++] = protoSeq++;
+    frame[n++] = (uint8_t)ts;
+    frame[n++] = (uint8_t)(ts >> 8);
+    frame[n++] = (uint8_t)(ts >> 16);
+    frame[n++] = (uint8_t)(ts >> 24);
+    for (uint8_t i = 0; i < len; i++) {
+        frame[n++] = payload[i];
+    }
+    uint32_t crc = Proto_Crc(&frame[1], n - 1);
+    frame[n++] = (uint8_t)crc;
+    frame[n++] = (uint8_t)(crc >> 8);
+    frame[n++] = (uint8_t)(crc >> 16);
+    frame[n++] = (uint8_t)(crc >> 24);
+    UartTx_Write(frame, n);
+}
+
+static uint8_t putU32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+    return 4;
+}
+
+static uint8_t putU64(uint8_t *p, uint64_t v) {
+    putU32(p, (uint32_t)v);
+    return 4 + putU32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t getU32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t getU64(const uint8_t *p) {
+    return getU32(p) | ((uint64_t)getU32(p + 4) << 32);
+}
+
+// tapSeq is the journal seq of the tap; the camera node tags its photo with
+// it. atUs is the now_us() stamp of the detection, sent as epoch us.
+void Proto_SendCard(uint8_t reader, const uint8_t *uid, uint8_t uidLen, uint8_t decision,
+                    uint32_t tapSeq, uint32_t atUs) {
+    uint8_t p[3 + 10 + 4 + 8];
+    uint8_t n = 0;
+    if (uidLen > 10) uidLen = 10;
+    p[n++] = reader;
+    p[n++] = uidLen;
+    for (uint8_t i = 0; i < uidLen; i++) {
+        p[n++] = uid[i];
+    }
+    p[n++] = decision;
+    n += putU32(&p[n], tapSeq);
+    n += putU64(&p[n], TimeSync_Epoch(TimeSync_LocalAt(atUs)));
+    Proto_Send(PROTO_EVT_CARD, p, n);
+}
+
+void Proto_SendRemoved(uint8_t reader) {
+    uint8_t p[1 + 8];
+    p[0] = reader;
+    putU64(&p[1], TimeSync_Epoch(TimeSync_Local()));
+    Proto_Send(PROTO_EVT_REMOVED, p, sizeof(p));
+}
+
+static void sendTime(uint64_t local) {
+    TimeSync_Stats_t st;
+    TimeSync_GetStats(&st);
+    uint8_t p[24];
+    uint8_t n = putU64(p, local);
+    n += putU64(&p[n], TimeSync_Epoch(local));
+    n += putU32(&p[n], (uint32_t)st.driftPpb);
+    n += putU32(&p[n], (uint32_t)st.lastErrUs);
+    Proto_Send(PROTO_EVT_TIME, p, n);
+}
+
+/*************************** Host commands ***************************/
+
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
+    if (huart != &huart1) return;
+    uint16_t next = (rxHead + 1) & (PROTO_RX_SIZE - 1);
+    if (next != rxTail) {           // Full: drop, the host resends on a missing ACK
+        rxRing[rxHead] = rxByte;
+        rxHead = next;
+    }
+    rxStampUs = now_us();
+    HAL_UART_Receive_IT(&huart1, &rxByte, 1);
+}
+
+// Overrun/framing errors stop the Rx interrupt; re-arm it
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
+    if (huart != &huart1) return;
+    HAL_UART_Receive_IT(&huart1, &rxByte, 1);
+}
+
+static uint16_t rxCount(void) {
+    return (rxHead - rxTail) & (PROTO_RX_SIZE - 1);
+}
+
+static uint8_t rxPeek(uint16_t i) {
+    return rxRing[(rxTail + i) & (PROTO_RX_SIZE - 1)];
+}
+
+// Pull one complete, CRC-checked frame into cmdFrame. Bad bytes are
+// skipped one at a time so the parser resyncs on the next SOF.
+static uint8_t rxFrame(void) {
+    while (rxCount() >= 2) {
+        uint8_t len = rxPeek(1);
+        if (rxPeek(0) != PROTO_SOF || len < 6 || len > 6 + PROTO_MAX_PAYLOAD) {
+            rxTail = (rxTail + 1) & (PROTO_RX_SIZE - 1);
+            continue;
+        }
+        uint8_t n = 2 + len + 4;
+        if (rxCount() < n) return 0;
+        for (uint8_t i = 0; i < n; i++) {
+            cmdFrame[i] = rxPeek(i);
+        }
+        uint32_t crc = cmdFrame[n - 4] | (cmdFrame[n - 3] << 8) |
+                       (cmdFrame[n - 2] << 16) | ((uint32_t)cmdFrame[n - 1] << 24);
+        if (Proto_Crc(&cmdFrame[1], n - 5) != crc) {
+            rxTail = (rxTail + 1) & (PROTO_RX_SIZE - 1);
+            continue;
+        }
+        rxTail = (rxTail + n) & (PROTO_RX_SIZE - 1);
+        cmdLen = len - 6;
+        return 1;
+    }
+    return 0;
+}
+
+static void sendAck(uint8_t type, uint8_t seq, uint8_t status) {
+    uint16_t ver = whitelist_version();
+    uint16_t cnt = whitelist_count();
+    uint8_t p[7] = {type, seq, status, (uint8_t)ver, (uint8_t)(ver >> 8),
+                    (uint8_t)cnt, (uint8_t)(cnt >> 8)};
+    Proto_Send(PROTO_EVT_ACK, p, sizeof(p));
+}
+
+// Run the pending command; returns 0 to keep it pending
+static uint8_t runCommand(void) {
+    uint8_t type = cmdFrame[2], seq = cmdFrame[3];
+    const uint8_t *p = &cmdFrame[8];
+    uint8_t st;
+
+    switch (type) {
+    case PROTO_CMD_WL_BEGIN:
+        st = (cmdLen == 4) ? whitelist_begin(p[0] | (p[1] << 8), p[2] | (p[3] << 8)) : WL_ERR_ARG;
+        break;
+    case PROTO_CMD_WL_ADD:
+        st = (cmdLen >= 2 && cmdLen == 2 + p[1]) ? whitelist_add(&p[2], p[1], p[0]) : WL_ERR_ARG;
+        break;
+    case PROTO_CMD_WL_REMOVE:
+        st = (cmdLen >= 1 && cmdLen == 1 + p[0]) ? whitelist_remove(&p[1], p[0]) : WL_ERR_ARG;
+        break;
+    case PROTO_CMD_WL_COMMIT:
+        if (cmdLen == 0 && whitelist_commit() == WL_OK) {
+            cmdCommit = 1;
+            return 0;
+        }
+        st = (cmdLen == 0) ? WL_ERR_STATE : WL_ERR_ARG;
+        break;
+    case PROTO_CMD_WL_QUERY:
+        st = WL_OK;
+        break;
+    case PROTO_CMD_PROF_GET:
+        if (cmdLen != 1) {
+            st = WL_ERR_ARG;
+            break;
+        }
+        sendAck(type, seq, WL_OK);
+        Prof_Send();
+        if (p[0]) Prof_Reset();
+        return 1;
+    case PROTO_CMD_JRN_SYNC:
+    case PROTO_CMD_JRN_ACK:
+        if (cmdLen != 4) {
+            st = WL_ERR_ARG;
+            break;
+        }
+        {
+            uint32_t seq = getU32(p);
+            if (type == PROTO_CMD_JRN_SYNC) journal_sync(seq);
+            else journal_ack(seq);
+        }
+        st = WL_OK;
+        break;
+    case PROTO_CMD_TIME_GET:
+        if (cmdLen != 0) {
+            st = WL_ERR_ARG;
+            break;
+        }
+        // The host sends nothing else until it has the answer, so the
+        // last Rx byte is the end of this frame
+        sendTime(TimeSync_LocalAt(rxStampUs));
+        st = WL_OK;
+        break;
+    case PROTO_CMD_TIME_SET:
+        if (cmdLen != 16) {
+            st = WL_ERR_ARG;
+            break;
+        }
+        TimeSync_Set(getU64(p), getU64(&p[8]));
+        st = WL_OK;
+        break;
+    default:
+        st = WL_ERR_ARG;
+        break;
+    }
+    if (st == WL_BUSY) return 0;
+    sendAck(type, seq, st);
+    return 1;
+}
+
+// Main loop: handle at most one host command per pass. While the whitelist
+// has flash work queued the command stays pending, which also holds off
+// the host (it waits for the ACK), so the Rx ring never has to buffer
+// more than one frame.
+void Proto_Poll(void) {
+    if (!cmdPending) {
+        cmdPending = rxFrame();
+        if (!cmdPending) return;
+    }
+    if (whitelist_busy()) return;
+    if (cmdCommit) {
+        cmdCommit = 0;
+        cmdPending = 0;
+        sendAck(PROTO_CMD_WL_COMMIT, cmdFrame[3], whitelist_error());
+        return;
+    }
+    cmdPending = !runCommand();
+}
@@ -0,0 +1,74 @@
+#include "timesync.h"
+#include "dwt.h"
+#include "main.h"
+
+static struct {
+    uint32_t lastUs;                // now_us() at the previous extension
+    uint32_t wraps;
+    uint64_t driftLocal;            // Start of the current drift baseline
+    uint64_t driftEpoch;
+    uint8_t driftState;             // 0: no baseline, 1: baseline, 2: drift estimated
+    TimeSync_Stats_t st;
+} ts;
+
+void TimeSync_Init(void) {
+    ts.lastUs = now_us();
+    ts.wraps = 0;
+    ts.driftState = 0;
+    ts.st = (TimeSync_Stats_t){0};
+}
+
+uint64_t TimeSync_Local(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t us = now_us();
+    if (us < ts.lastUs) ts.wraps++;
+    ts.lastUs = us;
+    uint64_t local = ((uint64_t)ts.wraps << 32) | us;
+    __set_PRIMASK(primask);
+    return local;
+}
+
+uint64_t TimeSync_LocalAt(uint32_t us) {
+    uint64_t now = TimeSync_Local();
+    return now - (uint32_t)((uint32_t)now - us);
+}
+
+uint64_t TimeSync_Epoch(uint64_t local) {
+    if (!ts.st.synced) return 0;
+    int64_t d = (int64_t)(local - ts.st.refLocal);
+    return ts.st.refEpoch + d - d * ts.st.driftPpb / 1000000000LL;
+}
+
+void TimeSync_Set(uint64_t local, uint64_t epoch) {
+    if (ts.st.synced) {
+        ts.st.lastErrUs = (int32_t)(int64_t)(epoch - TimeSync_Epoch(local));
+    }
+    if (ts.driftState == 0) {
+        ts.driftLocal = local;
+        ts.driftEpoch = epoch;
+        ts.driftState = 1;
+    } else if (local - ts.driftLocal >= TS_DRIFT_SPAN_US) {
+        int64_t dl = (int64_t)(local - ts.driftLocal);
+        int64_t de = (int64_t)(epoch - ts.driftEpoch);
+        int64_t ppb = (dl - de) * 1000000000LL / dl;
+        if (ppb > -TS_DRIFT_MAX_PPB && ppb < TS_DRIFT_MAX_PPB) {
+            if (ts.driftState == 2) {
+                ts.st.driftPpb += (int32_t)((ppb - ts.st.driftPpb) >> TS_DRIFT_SHIFT);
+            } else {
+                ts.st.driftPpb = (int32_t)ppb;
+                ts.driftState = 2;
+            }
+        }
+        ts.driftLocal = local;
+        ts.driftEpoch = epoch;
+    }
+    ts.st.refLocal = local;
+    ts.st.refEpoch = epoch;
+    ts.st.sets++;
+    ts.st.synced = 1;
+}
+
+void TimeSync_GetStats(TimeSync_Stats_t *st) {
+    *st = ts.st;
+}
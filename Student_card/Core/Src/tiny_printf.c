@@ -0,0 +1,149 @@
+#include "tiny_printf.h"
+#include "uart_tx.h"
+#include <stdint.h>
+
+#define TP_CHUNK 48                 // Stack buffer between flushes to uart_tx
+
+typedef struct {
+    char *buf;
+    size_t size;                    // Capacity, 0 for the UART sink
+    size_t pos;                     // Characters stored in buf
+    int total;                      // Characters produced
+} tp_out_t;
+
+static void tpFlush(tp_out_t *o) {
+    if (o->size == 0 && o->pos) {
+        UartTx_Write((const uint8_t *)o->buf, (uint16_t)o->pos);
+        o->pos = 0;
+    }
+}
+
+static void tpPut(tp_out_t *o, char c) {
+    o->total++;
+    if (o->size == 0) {             // UART: flush when the chunk is full
+        o->buf[o->pos++] = c;
+        if (o->pos == TP_CHUNK) tpFlush(o);
+    } else if (o->pos + 1 < o->size) {
+        o->buf[o->pos++] = c;
+    }
+}
+
+static void tpPad(tp_out_t *o, char c, int n) {
+    while (n-- > 0) tpPut(o, c);
+}
+
+static void tpFormat(tp_out_t *o, const char *fmt, va_list ap) {
+    static const char hexLower[] = "0123456789abcdef";
+    static const char hexUpper[] = "0123456789ABCDEF";
+    char digits[10];                // 2^32 - 1 has 10 decimal digits
+
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            tpPut(o, *fmt);
+            continue;
+        }
+        fmt++;
+        char pad = ' ';
+        int width = 0;
+        if (*fmt == '0') {
+            pad = '0';
+            fmt++;
+        }
+        while (*fmt >= '0' && *fmt <= '9') width = width * 10 + (*fmt++ - '0');
+        while (*fmt == 'l') fmt++;
+
+        uint32_t v;
+        uint8_t neg = 0;
+        const char *hex = hexLower;
+        int n = 0;
+        switch (*fmt) {
+        case 'd': {
+            int32_t i = va_arg(ap, int32_t);
+            neg = (i < 0);
+            v = neg ? (uint32_t)-i : (uint32_t)i;
+            do { digits[n++] = (char)('0' + v % 10); v /= 10; } while (v);
+            break;
+        }
+        case 'u':
+            v = va_arg(ap, uint32_t);
+            do { digits[n++] = (char)('0' + v % 10); v /= 10; } while (v);
+            break;
+        case 'X':
+            hex = hexUpper;
+            /* fall through */
+        case 'x':
+            v = va_arg(ap, uint32_t);
+            do { digits[n++] = hex[v & 0xF]; v >>= 4; } while (v);
+            break;
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            if (!s) s = "(null)";
+            int len = 0;
+            while (s[len]) len++;
+            tpPad(o, ' ', width - len);
+            while (*s) tpPut(o, *s++);
+            continue;
+        }
+        case 'c':
+            tpPad(o, ' ', width - 1);
+            tpPut(o, (char)va_arg(ap, int));
+            continue;
+        case '\0':
+            return;
+        default:                    // %% and anything unsupported
+            tpPut(o, *fmt);
+            continue;
+        }
+        width -= n + neg;
+        if (neg && pad == '0') tpPut(o, '-');
+        if (pad == ' ') tpPad(o, ' ', width);
+        if (neg && pad == ' ') tpPut(o, '-');
+        if (pad == '0') tpPad(o, '0', width);
+        while (n) tpPut(o, digits[--n]);
+    }
+}
+
+int tp_vsnprintf(char *buf, size_t size, const char *fmt, va_list ap) {
+    tp_out_t o = {buf, size, 0, 0};
+    if (size == 0) return 0;        // Nowhere to put even the terminator
+    tpFormat(&o, fmt, ap);
+    buf[o.pos] = '\0';
+    return o.total;
+}
+
+int tp_snprintf(char *buf, size_t size, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = tp_vsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+#if TINY_PRINTF
+// Replace newlib's printf family; GCC also turns printf("..\n") into puts
+// and printf("\n") into putchar
+int printf(const char *fmt, ...) {
+    char chunk[TP_CHUNK];
+    tp_out_t o = {chunk, 0, 0, 0};
+    va_list ap;
+    va_start(ap, fmt);
+    tpFormat(&o, fmt, ap);
+    va_end(ap);
+    tpFlush(&o);
+    return o.total;
+}
+
+int puts(const char *s) {
+    uint16_t n = 0;
+    while (s[n]) n++;
+    UartTx_Write((const uint8_t *)s, n);
+    UartTx_Write((const uint8_t *)"\n", 1);
+    return n + 1;
+}
+
+int putchar(int c) {
+    uint8_t b = (uint8_t)c;
+    UartTx_Write(&b, 1);
+    return c;
+}
+#endif
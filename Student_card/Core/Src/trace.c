@@ -0,0 +1,52 @@
+#include "trace.h"
+#include "main.h"
+#include "uart_tx.h"
+
+static struct {
+    Trace_Rec_t buf[TRACE_DEPTH];
+    volatile uint16_t head;     // Written by Trace_Put
+    volatile uint16_t tail;     // Advanced when a record is handed to uart_tx
+    uint16_t dropped;
+} trace;
+
+void Trace_Put(uint8_t id, uint8_t a, uint16_t b) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint16_t head = trace.head;
+    if ((uint16_t)(head - trace.tail) >= TRACE_DEPTH) {
+        trace.dropped++;
+    } else {
+        Trace_Rec_t *r = &trace.buf[head & (TRACE_DEPTH - 1)];
+        r->ts = uwTick;
+        r->id = id;
+        r->a = a;
+        r->b = b;
+        trace.head = head + 1;
+    }
+    __set_PRIMASK(primask);
+}
+
+// Move up to TRACE_BATCH records into the UART Tx ring; call from the
+// superloop. Records are only queued whole and while there is room, so
+// they never split a printf line.
+void Trace_Drain(void) {
+    uint8_t wire[1 + sizeof(Trace_Rec_t)];
+
+    if (trace.dropped && (uint16_t)(trace.head - trace.tail) < TRACE_DEPTH) {
+        uint16_t lost = trace.dropped;
+        trace.dropped = 0;
+        Trace_Put(TRACE_OVERFLOW, 0, lost);
+    }
+    for (uint16_t n = 0; n < TRACE_BATCH && trace.tail != trace.head; n++) {
+        if (UartTx_Free() < sizeof(wire)) {
+            break;              // Leave it in the trace ring for next time
+        }
+        const uint8_t *rec = (const uint8_t *)&trace.buf[trace.tail & (TRACE_DEPTH - 1)];
+        wire[0] = TRACE_SYNC;
+        for (uint16_t k = 0; k < sizeof(Trace_Rec_t); k++) {
+            wire[1 + k] = rec[k];
+        }
+        UartTx_Write(wire, sizeof(wire));
+        trace.tail++;
+    }
+}
@@ -0,0 +1,112 @@
+#include "uart_tx.h"
+#include "usart.h"
+
+static struct {
+    uint8_t ring[UART_TX_RING_SIZE];
+    volatile uint16_t head;         // Next free byte, moved by the writer
+    volatile uint16_t tail;         // Next unsent byte, moved when a chunk starts
+    volatile uint8_t busy;          // DMA transfer running
+    volatile uint8_t hold;          // Finish the current chunk, start no new one
+    uint8_t policy;
+    uint8_t chunk[UART_TX_CHUNK];   // DMA source, so the ring can be reused at once
+    UartTx_Stats_t stats;
+} tx;
+
+// Copy the next chunk out of the ring and hand it to the DMA. Called from
+// the writer when idle and from the Tx-complete ISR.
+static void UartTx_Kick(void) {
+    uint16_t tail = tx.tail;
+    uint16_t n = (uint16_t)(tx.head - tail);
+    if (n == 0 || tx.hold) {
+        tx.busy = 0;
+        return;
+    }
+    if (n > UART_TX_CHUNK) n = UART_TX_CHUNK;
+    for (uint16_t i = 0; i < n; i++) {
+        tx.chunk[i] = tx.ring[(uint16_t)(tail + i) & (UART_TX_RING_SIZE - 1)];
+    }
+    tx.tail = tail + n;
+    tx.busy = 1;
+    if (HAL_UART_Transmit_DMA(&huart1, tx.chunk, n) != HAL_OK) {
+        tx.busy = 0;
+    }
+}
+
+static void UartTx_Start(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (!tx.busy) {
+        UartTx_Kick();
+    }
+    __set_PRIMASK(primask);
+}
+
+void UartTx_SetPolicy(uint8_t policy) {
+    tx.policy = policy;
+}
+
+uint16_t UartTx_Free(void) {
+    return (uint16_t)(UART_TX_RING_SIZE - (uint16_t)(tx.head - tx.tail));
+}
+
+uint16_t UartTx_Write(const uint8_t *buf, uint16_t len) {
+    if (len > UART_TX_RING_SIZE) {  // Keep the newest part of a huge write
+        tx.stats.dropped += len - UART_TX_RING_SIZE;
+        buf += len - UART_TX_RING_SIZE;
+        len = UART_TX_RING_SIZE;
+    }
+    if (UartTx_Free() < len) {
+        tx.stats.overflows++;
+        if (tx.policy == UART_TX_BLOCK) {
+            tx.hold = 0;            // Waiting on a held ring would never return
+            UartTx_Start();
+            while (UartTx_Free() < len) {}  // Tx-complete ISR makes room
+        } else {
+            uint32_t primask = __get_PRIMASK();
+            __disable_irq();
+            uint16_t need = len - UartTx_Free();
+            tx.tail += need;
+            tx.stats.dropped += need;
+            __set_PRIMASK(primask);
+        }
+    }
+    uint16_t head = tx.head;
+    for (uint16_t i = 0; i < len; i++) {
+        tx.ring[(uint16_t)(head + i) & (UART_TX_RING_SIZE - 1)] = buf[i];
+    }
+    tx.head = head + len;           // Publish after the data is in place
+    tx.stats.written += len;
+    uint16_t used = (uint16_t)(tx.head - tx.tail);
+    if (used > tx.stats.peak) tx.stats.peak = used;
+    UartTx_Start();
+    return len;
+}
+
+// Wait until everything queued has left the UART (e.g. before a reset)
+void UartTx_Flush(void) {
+    UartTx_Start();
+    while (tx.busy || tx.head != tx.tail) {}
+    while (huart1.gState != HAL_UART_STATE_READY) {}
+}
+
+void UartTx_Hold(uint8_t on) {
+    tx.hold = on;
+    if (!on) {
+        UartTx_Start();
+    }
+}
+
+uint8_t UartTx_Idle(void) {
+    return !tx.busy && huart1.gState == HAL_UART_STATE_READY
+        && __HAL_UART_GET_FLAG(&huart1, UART_FLAG_TC);
+}
+
+const UartTx_Stats_t *UartTx_GetStats(void) {
+    return &tx.stats;
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
+    if (huart->Instance == USART1) {
+        UartTx_Kick();
+    }
+}
@@ -0,0 +1,110 @@
+#include "uid_cache.h"
+#include <string.h>
+
+#define NIL 0xFF
+
+typedef struct {
+    uint8_t reader;
+    uint8_t len;                    // 0: unused
+    uint8_t uid[10];
+    uint32_t lastMs;
+    uint8_t chain;                  // Next entry in the same bucket
+    uint8_t newer, older;           // LRU list
+} UidEntry_t;
+
+static UidEntry_t entries[UID_CACHE_SIZE];
+static uint8_t buckets[UID_CACHE_BUCKETS];
+static uint8_t mru, lru;
+static uint32_t window;
+
+static uint8_t hashKey(uint8_t reader, const uint8_t *uid, uint8_t len) {
+    uint32_t h = 2166136261u ^ reader;
+    for (uint8_t i = 0; i < len; i++) {
+        h = (h ^ uid[i]) * 16777619u;
+    }
+    return (uint8_t)(h & (UID_CACHE_BUCKETS - 1));
+}
+
+static void lruUnlink(uint8_t i) {
+    UidEntry_t *e = &entries[i];
+    if (e->newer != NIL) entries[e->newer].older = e->older;
+    else mru = e->older;
+    if (e->older != NIL) entries[e->older].newer = e->newer;
+    else lru = e->newer;
+}
+
+static void lruPushFront(uint8_t i) {
+    entries[i].newer = NIL;
+    entries[i].older = mru;
+    if (mru != NIL) entries[mru].newer = i;
+    mru = i;
+    if (lru == NIL) lru = i;
+}
+
+void UidCache_Init(uint32_t windowMs) {
+    memset(entries, 0, sizeof(entries));
+    memset(buckets, NIL, sizeof(buckets));
+    mru = lru = NIL;
+    // Every entry starts on the LRU list, unused, chained nowhere
+    for (uint8_t i = 0; i < UID_CACHE_SIZE; i++) {
+        entries[i].chain = NIL;
+        lruPushFront(i);
+    }
+    window = windowMs;
+}
+
+void UidCache_SetWindow(uint32_t windowMs) {
+    window = windowMs;
+}
+
+static UidEntry_t *find(uint8_t reader, const uint8_t *uid, uint8_t len, uint8_t b) {
+    for (uint8_t i = buckets[b]; i != NIL; i = entries[i].chain) {
+        UidEntry_t *e = &entries[i];
+        if (e->reader == reader && e->len == len && memcmp(e->uid, uid, len) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Reuse the least recently used entry for a new key
+static UidEntry_t *insert(uint8_t reader, const uint8_t *uid, uint8_t len, uint8_t b) {
+    uint8_t i = lru;
+    UidEntry_t *e = &entries[i];
+    if (e->len) {                   // Drop it from its old chain
+        uint8_t *p = &buckets[hashKey(e->reader, e->uid, e->len)];
+        while (*p != i) p = &entries[*p].chain;
+        *p = e->chain;
+    }
+    e->reader = reader;
+    e->len = len;
+    memcpy(e->uid, uid, len);
+    e->chain = buckets[b];
+    buckets[b] = i;
+    return e;
+}
+
+static UidEntry_t *upsert(uint8_t reader, const uint8_t *uid, uint8_t len, uint8_t *hit) {
+    if (len > sizeof(entries[0].uid)) len = sizeof(entries[0].uid);
+    uint8_t b = hashKey(reader, uid, len);
+    UidEntry_t *e = find(reader, uid, len, b);
+    *hit = (e != NULL);
+    if (!e) e = insert(reader, uid, len, b);
+    uint8_t i = (uint8_t)(e - entries);
+    lruUnlink(i);
+    lruPushFront(i);
+    return e;
+}
+
+uint8_t UidCache_Seen(uint8_t reader, const uint8_t *uid, uint8_t len, uint32_t nowMs) {
+    uint8_t hit;
+    UidEntry_t *e = upsert(reader, uid, len, &hit);
+    uint8_t recent = hit && (nowMs - e->lastMs) < window;
+    e->lastMs = nowMs;
+    return recent;
+}
+
+void UidCache_Touch(uint8_t reader, const uint8_t *uid, uint8_t len, uint32_t nowMs) {
+    uint8_t hit;
+    upsert(reader, uid, len, &hit)->lastMs = nowMs;
+}
@@ -0,0 +1,412 @@
+#include "whitelist.h"
+#include "proto.h"
+#include "main.h"
+#include <string.h>
+
+extern const uint8_t _swhitelist[];
+
+#define WL_NONE         0xFF
+#define WL_PROG_CHUNK   64          // Half-words programmed per whitelist_task step
+#define WL_FLAG_LEN     (WL_FLAG_UID7 | WL_FLAG_UID10)
+
+typedef struct {
+    WL_PageHdr_t hdr;
+    uint8_t body[WL_BODY_SIZE];     // WL_Short_t[count], then WL_Long_t[longCount]
+} WL_Page_t;
+
+// One of the two arrays of a page
+typedef struct {
+    uint8_t *base;
+    uint16_t count;
+    uint8_t size;                   // Entry size
+    uint8_t keyLen;                 // UID bytes before the flags byte
+} WL_Array_t;
+
+// Cards seeded into an empty region on first boot
+static const WL_Short_t wlDefault[] = {
+    {{0x20, 0x00, 0x01, 0xE4}, WL_FLAG_ALLOW},      // Master card
+    {{0x1D, 0x7D, 0xCD, 0x73}, 0},                  // Red LED card
+};
+
+static uint8_t wlMap[WL_LOGICAL];   // Logical page -> physical page
+static uint16_t wlVersion;
+static uint16_t wlTotal;
+
+// Sync session and the page rewrite in progress
+enum { FL_IDLE = 0, FL_ERASE, FL_PROGRAM, FL_HEADER, FL_RECLAIM };
+static struct {
+    uint8_t open;
+    uint16_t newVersion;
+    uint8_t bucket;                 // Bucket held in page, WL_NONE if none
+    uint8_t dirty;
+    uint8_t commitPending;
+    int16_t totalDelta;
+    WL_Page_t page;                 // RAM copy being edited / written
+    uint8_t state;
+    uint8_t dst;                    // Physical page being written
+    uint8_t old;                    // Physical page it replaces
+    uint16_t off;                   // Half-word offset into the body
+    uint8_t error;                  // Last flash failure, see whitelist_error
+} wl;
+
+static const WL_Page_t *wlPhys(uint8_t p) {
+    return (const WL_Page_t *)(_swhitelist + (uint32_t)p * WL_PAGE_SIZE);
+}
+
+static uint16_t wlBodyLen(const WL_PageHdr_t *hdr) {
+    return hdr->count * sizeof(WL_Short_t) + hdr->longCount * sizeof(WL_Long_t);
+}
+
+static uint8_t wlPageValid(const WL_Page_t *pg) {
+    if (pg->hdr.magic != WL_PAGE_MAGIC || pg->hdr.logical >= WL_LOGICAL ||
+        wlBodyLen(&pg->hdr) > WL_BODY_SIZE) {
+        return 0;
+    }
+    return Proto_Crc(pg->body, wlBodyLen(&pg->hdr)) == pg->hdr.crc;
+}
+
+// FNV-1a over the UID bytes and their count; tools/whitelist_build.py
+// must hash the same way
+static uint8_t wlBucket(const uint8_t *uid, uint8_t uidLen) {
+    uint32_t h = 2166136261u;
+    for (uint8_t i = 0; i < uidLen; i++) {
+        h = (h ^ uid[i]) * 16777619u;
+    }
+    h = (h ^ uidLen) * 16777619u;
+    return (uint8_t)(h % WL_BUCKETS);
+}
+
+// Build the key padded to its entry width; returns 0 for unsupported UID lengths
+static uint8_t wlKey(const uint8_t *uid, uint8_t uidLen, uint8_t *key, uint8_t *flags) {
+    if (uidLen != 4 && uidLen != 7 && uidLen != 10) {
+        return 0;
+    }
+    memset(key, 0, WL_UID_MAX);
+    memcpy(key, uid, uidLen);
+    *flags = (uidLen == 7) ? WL_FLAG_UID7 : (uidLen == 10) ? WL_FLAG_UID10 : 0;
+    return 1;
+}
+
+// The array of pg that holds UIDs of this length flag
+static WL_Array_t wlArray(const WL_Page_t *pg, uint8_t lenFlag) {
+    WL_Array_t a;
+    if (lenFlag) {
+        a.base = (uint8_t *)pg->body + pg->hdr.count * sizeof(WL_Short_t);
+        a.count = pg->hdr.longCount;
+        a.size = sizeof(WL_Long_t);
+        a.keyLen = WL_UID_MAX;
+    } else {
+        a.base = (uint8_t *)pg->body;
+        a.count = pg->hdr.count;
+        a.size = sizeof(WL_Short_t);
+        a.keyLen = 4;
+    }
+    return a;
+}
+
+// Binary search ordered by padded UID bytes, then length flag (10-byte first);
+// returns the match index or -(insert position) - 1
+static int wlSearch(const WL_Array_t *a, const uint8_t *key, uint8_t lenFlag) {
+    uint16_t lo = 0, hi = a->count;
+    while (lo < hi) {
+        uint16_t mid = lo + (hi - lo) / 2;
+        const uint8_t *e = a->base + mid * a->size;
+        int c = memcmp(key, e, a->keyLen);
+        if (c == 0) c = (int)lenFlag - (int)(e[a->keyLen] & WL_FLAG_LEN);
+        if (c == 0) return mid;
+        if (c < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    return -(int)lo - 1;
+}
+
+uint8_t whitelist_init(void) {
+    memset(wlMap, WL_NONE, sizeof(wlMap));
+    wlVersion = 0;
+    wlTotal = 0;
+    wl.bucket = WL_NONE;
+
+    for (uint8_t p = 0; p < WL_PAGES; p++) {
+        const WL_Page_t *pg = wlPhys(p);
+        if (!wlPageValid(pg)) continue;
+        uint8_t l = pg->hdr.logical;
+        if (wlMap[l] == WL_NONE || (int16_t)(pg->hdr.gen - wlPhys(wlMap[l])->hdr.gen) > 0) {
+            wlMap[l] = p;           // Stale copies are reclaimed when a page is needed
+        }
+    }
+    if (wlMap[WL_META] != WL_NONE) {
+        wlVersion = wlPhys(wlMap[WL_META])->hdr.version;
+        wlTotal = wlPhys(wlMap[WL_META])->hdr.total;
+        return 1;
+    }
+
+    // Empty region: seed the built-in cards (blocking, first boot only)
+    whitelist_begin(0, 1);
+    for (uint8_t i = 0; i < sizeof(wlDefault) / sizeof(wlDefault[0]); i++) {
+        while (whitelist_add(wlDefault[i].uid, 4, wlDefault[i].flags & WL_FLAG_ALLOW) == WL_BUSY) {
+            while (whitelist_busy()) whitelist_task();
+        }
+    }
+    while (whitelist_busy()) whitelist_task();
+    whitelist_commit();
+    while (whitelist_busy()) whitelist_task();
+    return 0;
+}
+
+uint16_t whitelist_count(void) {
+    return wlTotal;
+}
+
+uint16_t whitelist_version(void) {
+    return wlVersion;
+}
+
+uint8_t whitelist_lookup(const uint8_t *uid, uint8_t uidLen) {
+    uint8_t key[WL_UID_MAX], flags;
+    if (!wlKey(uid, uidLen, key, &flags)) {
+        return WL_NOT_FOUND;
+    }
+    uint8_t p = wlMap[wlBucket(uid, uidLen)];
+    if (p == WL_NONE) {
+        return WL_NOT_FOUND;
+    }
+    WL_Array_t a = wlArray(wlPhys(p), flags);
+    int i = wlSearch(&a, key, flags);
+    if (i < 0) {
+        return WL_NOT_FOUND;
+    }
+    return (a.base[i * a.size + a.keyLen] & WL_FLAG_ALLOW) ? WL_ALLOW : WL_DENY;
+}
+
+/********************************** Sync **********************************/
+
+uint8_t whitelist_busy(void) {
+    return wl.state != FL_IDLE || wl.commitPending;
+}
+
+// Drop the session; the committed mapping is untouched, so the host
+// restarts the sync from whitelist_version()
+static void wlAbort(void) {
+    HAL_FLASH_Lock();
+    wl.state = FL_IDLE;
+    wl.open = wl.commitPending = 0;
+    wl.bucket = WL_NONE;
+    wl.dirty = 0;
+    wl.error = WL_ERR_FLASH;
+}
+
+// Pick a physical page no logical page maps to
+static uint8_t wlFreePage(void) {
+    for (uint8_t p = 0; p < WL_PAGES; p++) {
+        uint8_t used = 0;
+        for (uint8_t l = 0; l < WL_LOGICAL; l++) {
+            if (wlMap[l] == p) used = 1;
+        }
+        if (!used) return p;
+    }
+    return WL_NONE;
+}
+
+// Queue the RAM page for writing as logical page l
+static void wlStartFlush(uint8_t l) {
+    const WL_Page_t *cur = (wlMap[l] != WL_NONE) ? wlPhys(wlMap[l]) : NULL;
+    wl.page.hdr.logical = l;
+    wl.page.hdr.gen = cur ? (uint16_t)(cur->hdr.gen + 1) : 0;
+    wl.page.hdr.version = wl.newVersion;
+    wl.page.hdr.crc = Proto_Crc(wl.page.body, wlBodyLen(&wl.page.hdr));
+    wl.page.hdr.magic = WL_PAGE_MAGIC;
+    wl.old = wlMap[l];
+    wl.dst = wlFreePage();
+    wl.off = 0;
+    wl.state = FL_ERASE;
+}
+
+// Make sure the RAM page holds bucket b, writing the previous one out first.
+// Returns 0 while a write is still pending (call again later).
+static uint8_t wlLoadBucket(uint8_t b) {
+    if (wl.bucket == b) return 1;
+    if (wl.state != FL_IDLE) return 0;
+    if (wl.bucket != WL_NONE && wl.dirty) {
+        wl.dirty = 0;
+        wlStartFlush(wl.bucket);
+        return 0;
+    }
+    if (wlMap[b] != WL_NONE) {
+        memcpy(&wl.page, wlPhys(wlMap[b]), sizeof(WL_Page_t));
+    } else {
+        memset(&wl.page, 0, sizeof(WL_Page_t));
+    }
+    wl.bucket = b;
+    return 1;
+}
+
+uint8_t whitelist_begin(uint16_t baseVersion, uint16_t newVersion) {
+    if (wl.open) return WL_ERR_STATE;
+    if (baseVersion != wlVersion) return WL_ERR_VERSION;
+    wl.open = 1;
+    wl.error = WL_OK;
+    wl.newVersion = newVersion;
+    wl.bucket = WL_NONE;
+    wl.dirty = 0;
+    wl.totalDelta = 0;
+    return WL_OK;
+}
+
+// Deltas are idempotent, so a sync cut short by a reset can simply be
+// replayed from the last committed version.
+static uint8_t wlApply(const uint8_t *uid, uint8_t uidLen, uint8_t add, uint8_t allow) {
+    uint8_t key[WL_UID_MAX], flags;
+    if (!wl.open) return WL_ERR_STATE;
+    if (!wlKey(uid, uidLen, key, &flags)) return WL_ERR_ARG;
+    if (!wlLoadBucket(wlBucket(uid, uidLen))) return WL_BUSY;
+
+    WL_Array_t a = wlArray(&wl.page, flags);
+    uint8_t *end = wl.page.body + wlBodyLen(&wl.page.hdr);
+    uint8_t *count = flags ? &wl.page.hdr.longCount : &wl.page.hdr.count;
+    int i = wlSearch(&a, key, flags);
+    if (add) {
+        flags |= allow ? WL_FLAG_ALLOW : 0;
+        if (i >= 0) {                       // Update flags in place
+            uint8_t *f = &a.base[i * a.size + a.keyLen];
+            if (*f != flags) {
+                *f = flags;
+                wl.dirty = 1;
+            }
+            return WL_OK;
+        }
+        if (wlBodyLen(&wl.page.hdr) + a.size > WL_BODY_SIZE) return WL_ERR_FULL;
+        // Everything after the insert point shifts, the long array too when a short entry goes in
+        uint8_t *e = a.base + (-i - 1) * a.size;
+        memmove(e + a.size, e, end - e);
+        memcpy(e, key, a.keyLen);
+        e[a.keyLen] = flags;
+        (*count)++;
+        wl.totalDelta++;
+    } else {
+        if (i < 0) return WL_OK;
+        uint8_t *e = a.base + i * a.size;
+        memmove(e, e + a.size, end - e - a.size);
+        (*count)--;
+        wl.totalDelta--;
+    }
+    wl.dirty = 1;
+    return WL_OK;
+}
+
+uint8_t whitelist_add(const uint8_t *uid, uint8_t uidLen, uint8_t allow) {
+    return wlApply(uid, uidLen, 1, allow);
+}
+
+uint8_t whitelist_remove(const uint8_t *uid, uint8_t uidLen) {
+    return wlApply(uid, uidLen, 0, 0);
+}
+
+uint8_t whitelist_error(void) {
+    uint8_t e = wl.error;
+    wl.error = WL_OK;
+    return e;
+}
+
+uint8_t whitelist_commit(void) {
+    if (!wl.open) return WL_ERR_STATE;
+    wl.commitPending = 1;           // Finished by whitelist_task
+    return WL_OK;
+}
+
+static uint8_t wlProgram(uint32_t addr, const uint8_t *src, uint16_t halfwords) {
+    for (uint16_t i = 0; i < halfwords; i++) {
+        uint16_t hw = src[2 * i] | (src[2 * i + 1] << 8);
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, addr + 2 * i, hw) != HAL_OK) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// One bounded flash step per call: an erase (~20 ms CPU stall on the F1,
+// flash cannot be read meanwhile) or WL_PROG_CHUNK half-words.
+void whitelist_task(void) {
+    uint32_t base = (uint32_t)_swhitelist + (uint32_t)wl.dst * WL_PAGE_SIZE;
+    FLASH_EraseInitTypeDef erase;
+    uint32_t pageErr;
+
+    switch (wl.state) {
+    case FL_IDLE:
+        if (!wl.commitPending) return;
+        if (wl.bucket != WL_NONE && wl.dirty) {     // Last bucket first
+            wl.dirty = 0;
+            wlStartFlush(wl.bucket);
+            return;
+        }
+        // Meta page last: the sync counts as applied once it is written
+        memset(&wl.page, 0, sizeof(WL_PageHdr_t));
+        wl.page.hdr.total = (uint16_t)(wlTotal + wl.totalDelta);
+        wl.bucket = WL_NONE;
+        wlStartFlush(WL_META);
+        return;
+
+    case FL_ERASE:
+        if (wl.dst == WL_NONE) {
+            wlAbort();
+            return;
+        }
+        HAL_FLASH_Unlock();
+        erase.TypeErase = FLASH_TYPEERASE_PAGES;
+        erase.PageAddress = base;
+        erase.NbPages = 1;
+        if (HAL_FLASHEx_Erase(&erase, &pageErr) != HAL_OK) {
+            wlAbort();
+            return;
+        }
+        HAL_FLASH_Lock();
+        wl.state = FL_PROGRAM;
+        return;
+
+    case FL_PROGRAM: {
+        uint16_t total = (uint16_t)((wlBodyLen(&wl.page.hdr) + 1) / 2);
+        uint16_t n = total - wl.off;
+        if (n > WL_PROG_CHUNK) n = WL_PROG_CHUNK;
+        HAL_FLASH_Unlock();
+        if (!wlProgram(base + sizeof(WL_PageHdr_t) + 2 * wl.off,
+                       wl.page.body + 2 * wl.off, n)) {
+            wlAbort();
+            return;
+        }
+        HAL_FLASH_Lock();
+        wl.off += n;
+        if (wl.off >= total) wl.state = FL_HEADER;
+        return;
+    }
+
+    case FL_HEADER:
+        // Everything but the magic, then the magic as the commit point
+        HAL_FLASH_Unlock();
+        wlProgram(base + 4, (const uint8_t *)&wl.page.hdr + 4, (sizeof(WL_PageHdr_t) - 4) / 2);
+        wlProgram(base, (const uint8_t *)&wl.page.hdr, 2);
+        HAL_FLASH_Lock();
+        if (!wlPageValid(wlPhys(wl.dst))) {         // Verify before switching over
+            wlAbort();
+            return;
+        }
+        wlMap[wl.page.hdr.logical] = wl.dst;
+        wl.state = FL_RECLAIM;
+        return;
+
+    case FL_RECLAIM:
+        if (wl.old != WL_NONE) {
+            HAL_FLASH_Unlock();
+            erase.TypeErase = FLASH_TYPEERASE_PAGES;
+            erase.PageAddress = (uint32_t)_swhitelist + (uint32_t)wl.old * WL_PAGE_SIZE;
+            erase.NbPages = 1;
+            HAL_FLASHEx_Erase(&erase, &pageErr);
+            HAL_FLASH_Lock();
+        }
+        wl.state = FL_IDLE;
+        if (wl.page.hdr.logical == WL_META) {
+            wlVersion = wl.page.hdr.version;
+            wlTotal = wl.page.hdr.total;
+            wl.open = wl.commitPending = 0;
+        }
+        return;
+    }
+}
@@ -0,0 +1,151 @@
+// Host benchmark for Core/Src/MFRC522_STM32.c: runs MFRC522_Poll against
+// the emulated RC522 (rc522_emu.c) and reports SPI transactions, bytes and
+// simulated time per detect/read/remove cycle, plus MIFARE authenticate +
+// block read on the 4-byte (Classic 1K) card. Compare the numbers before
+// and after a driver change to keep the bus traffic from creeping up.
+//
+//   cd Student_card
+//   gcc -O2 -std=gnu11 -Itools/host_bench -ICore/Inc -o /tmp/rc522_bench
+//       tools/host_bench/*.c Core/Src/MFRC522_STM32.c      (one line)
+//   /tmp/rc522_bench [--dma] [--lowpower] [--cycles N] [--negotiate [--spi-limit HZ]]
+//
+// --negotiate brings the reader up through MFRC522_BusInit, which steps the
+// SPI clock up from the CubeMX /64; --spi-limit makes the emulated link
+// corrupt reads above HZ, as a clone on long wires would.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mock_hal.h"
+#include "MFRC522_STM32.h"
+
+static SPI_HandleTypeDef hspi1 = {SPI1};
+
+typedef struct {
+    const char *name;
+    Mock_SpiStats_t spi;
+    uint64_t ns;
+} Phase_t;
+
+static Mock_SpiStats_t spiMark;
+static uint64_t nsMark;
+
+static void mark(void) {
+    spiMark = mockSpi;
+    nsMark = mockNs;
+}
+
+static void endPhase(Phase_t *p) {
+    p->spi.transactions += mockSpi.transactions - spiMark.transactions;
+    p->spi.bytes += mockSpi.bytes - spiMark.bytes;
+    p->ns += mockNs - nsMark;
+    mark();
+}
+
+// One 1 ms soft-timer tick of rfidPollTask
+static MFRC522_Event_t pollTick(MFRC522_t *dev) {
+    uint64_t next = (mockNs / 1000000 + 1) * 1000000;
+    MFRC522_Event_t evt = MFRC522_Poll(dev);
+    if (mockNs < next) mockNs = next;
+    return evt;
+}
+
+static int pollUntil(MFRC522_t *dev, MFRC522_Event_t want, uint32_t maxMs) {
+    for (uint32_t i = 0; i < maxMs; i++) {
+        if (pollTick(dev) == want) return 1;
+    }
+    return 0;
+}
+
+static void report(const Phase_t *p, int cycles) {
+    printf("%-8s %8.1f txn %8.1f bytes %9.2f ms\n", p->name,
+           (double)p->spi.transactions / cycles, (double)p->spi.bytes / cycles,
+           p->ns / 1e6 / cycles);
+}
+
+int main(int argc, char **argv) {
+    static const uint8_t uid4[4] = {0x20, 0x00, 0x01, 0xE4};
+    static const uint8_t uid7[7] = {0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+    static const uint8_t key[MFRC522_KEY_SIZE] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    static const uint8_t studentNo[MFRC522_BLOCK_SIZE] = "20210001";
+    int cycles = 10, dma = 0, lowPower = 0, negotiate = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--dma")) dma = 1;
+        else if (!strcmp(argv[i], "--lowpower")) lowPower = 1;
+        else if (!strcmp(argv[i], "--cycles") && i + 1 < argc) cycles = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--negotiate")) negotiate = 1;
+        else if (!strcmp(argv[i], "--spi-limit") && i + 1 < argc) Mock_SetSpiLimit(atoi(argv[++i]));
+    }
+
+    MFRC522_t dev = {&hspi1, GPIOA, GPIO_PIN_4, GPIOB, GPIO_PIN_0, NULL, 0, 0, (uint8_t)dma};
+    Mock_Attach(GPIOA, GPIO_PIN_4);
+    Emu_SetPresent(0);
+    Emu_SetBlock(4, studentNo);
+
+    Phase_t init = {"init"};
+    mark();
+    MFRC522_t *readers[] = {&dev};
+    MFRC522_Bus_t bus = {readers, 1, 0};
+    if (negotiate) {
+        MFRC522_BusInit(&bus);
+    } else {
+        MFRC522_Init(&dev);
+    }
+    MFRC522_SetLowPower(&dev, lowPower);
+    endPhase(&init);
+
+    for (int u = 0; u < 2; u++) {
+        Phase_t idle = {"idle/s"}, detect = {"detect"}, read = {"read"},
+                block = {"auth+rd"}, hold = {"hold/s"}, removal = {"remove"};
+        Emu_SetCard(u ? uid7 : uid4, u ? 7 : 4);
+        for (int c = 0; c < cycles; c++) {
+            mark();
+            for (int i = 0; i < 1000; i++) pollTick(&dev);   // 1 s, empty field
+            endPhase(&idle);
+
+            Emu_SetPresent(1);
+            if (!pollUntil(&dev, MFRC522_EVT_DETECTED, 2000)) {
+                printf("card not detected\n");
+                return 1;
+            }
+            endPhase(&detect);
+            if (!pollUntil(&dev, MFRC522_EVT_UID_READY, 100) || dev.uid.size != (u ? 7 : 4)) {
+                printf("UID not read\n");
+                return 1;
+            }
+            endPhase(&read);
+            if (u == 0) {
+                uint8_t data[MFRC522_BLOCK_SIZE];
+                uint8_t res = MFRC522_Authenticate(&dev, PICC_MF_AUTH_KEY_A, 4, key, &dev.uid);
+                if (res == STATUS_OK) res = MFRC522_ReadBlock(&dev, 4, data);
+                MFRC522_StopCrypto1(&dev);
+                if (res != STATUS_OK || memcmp(data, studentNo, MFRC522_BLOCK_SIZE) != 0) {
+                    printf("block read failed (%u)\n", res);
+                    return 1;
+                }
+                endPhase(&block);
+            }
+            for (int i = 0; i < 1000; i++) pollTick(&dev);   // 1 s held on the reader
+            endPhase(&hold);
+
+            Emu_SetPresent(0);
+            if (!pollUntil(&dev, MFRC522_EVT_REMOVED, 1000)) {
+                printf("removal not seen\n");
+                return 1;
+            }
+            endPhase(&removal);
+        }
+        printf("\n%d-byte UID, %d cycles, %s%s (per cycle):\n", u ? 7 : 4, cycles,
+               dma ? "DMA" : "polled SPI", lowPower ? ", low power" : "");
+        report(&idle, cycles);
+        report(&detect, cycles);
+        report(&read, cycles);
+        if (u == 0) report(&block, cycles);
+        report(&hold, cycles);
+        report(&removal, cycles);
+    }
+    printf("\n");
+    report(&init, 1);
+    printf("SPI %u kHz\n", (unsigned)(Mock_SpiHz() / 1000));
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include "mock_hal.h"
+
+// SPI1 on PCLK2 72 MHz, CubeMX prescaler /64 = 1.125 MHz: 8 bits per
+// 7.1 us, plus HAL call overhead. A byte takes as long as CR1 BR says.
+#define PCLK2_HZ        72000000U
+#define SPI_CALL_NS     2000
+#define GPIO_NS         100
+
+GPIO_TypeDef mockGpioA = {0}, mockGpioB = {1}, mockGpioC = {2};
+SPI_TypeDef mockSpi1 = {5U << SPI_CR1_BR_Pos};
+uint64_t mockNs;
+Mock_SpiStats_t mockSpi;
+
+static uint32_t spiLimitHz;
+static uint32_t rxCount;
+
+static GPIO_TypeDef *csPort;
+static uint16_t csPin;
+
+void Mock_Attach(GPIO_TypeDef *port, uint16_t pin) {
+    csPort = port;
+    csPin = pin;
+}
+
+void Mock_AdvanceUs(uint32_t us) {
+    mockNs += (uint64_t)us * 1000;
+}
+
+void Mock_SetSpiLimit(uint32_t hz) {
+    spiLimitHz = hz;
+}
+
+uint32_t Mock_SpiHz(void) {
+    return PCLK2_HZ >> (((mockSpi1.CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos) + 1);
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void) {
+    return PCLK2_HZ / 2;
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq(void) {
+    return PCLK2_HZ;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state) {
+    mockNs += GPIO_NS;
+    if (port == csPort && pin == csPin) {
+        if (state == GPIO_PIN_RESET) mockSpi.transactions++;
+        Emu_Select(state == GPIO_PIN_RESET);
+    }
+}
+
+static void xfer(const uint8_t *tx, uint8_t *rx, uint16_t len) {
+    uint32_t hz = Mock_SpiHz();
+    uint8_t corrupt = (spiLimitHz && hz > spiLimitHz);
+    mockNs += SPI_CALL_NS;
+    for (uint16_t i = 0; i < len; i++) {
+        uint8_t r = Emu_Xfer(tx ? tx[i] : 0x00);
+        if (corrupt && ++rxCount % 7 == 0) r ^= (uint8_t)(1 << (rxCount % 8));  // Late sample on MISO
+        if (rx) rx[i] = r;
+        mockNs += 8000000000ULL / hz;
+    }
+    mockSpi.bytes += len;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t len, uint32_t timeout) {
+    (void)hspi; (void)timeout;
+    xfer(data, NULL, len);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t len, uint32_t timeout) {
+    (void)hspi; (void)timeout;
+    xfer(NULL, data, len);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, uint8_t *tx, uint8_t *rx,
+                                          uint16_t len, uint32_t timeout) {
+    (void)hspi; (void)timeout;
+    xfer(tx, rx, len);
+    return HAL_OK;
+}
+
+// DMA completes at once; the driver's completion callback runs before return
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, uint8_t *tx, uint8_t *rx,
+                                              uint16_t len) {
+    xfer(tx, rx, len);
+    HAL_SPI_TxRxCpltCallback(hspi);
+    return HAL_OK;
+}
+
+uint32_t HAL_GetTick(void) {
+    return (uint32_t)(mockNs / 1000000);
+}
+
+void HAL_Delay(uint32_t ms) {
+    mockNs += (uint64_t)ms * 1000000;
+}
+
+// Sleep until the next SysTick
+void __WFI(void) {
+    mockNs = (mockNs / 1000000 + 1) * 1000000;
+}
+
+void Error_Handler(void) {}
+
+/* dwt.h */
+void delay_us(uint32_t us) {
+    Mock_AdvanceUs(us);
+}
+
+uint32_t now_us(void) {
+    return (uint32_t)(mockNs / 1000);
+}
+
+/* trace.h / prof.h: not measured here */
+void Trace_Put(uint8_t id, uint8_t a, uint16_t b) {
+    (void)id; (void)a; (void)b;
+}
+
+void Prof_Record(uint8_t phase, uint32_t us) {
+    (void)phase; (void)us;
+}
+
+void Prof_Count(uint8_t counter) {
+    (void)counter;
+}
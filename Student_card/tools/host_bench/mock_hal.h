@@ -0,0 +1,28 @@
+// Simulated time, SPI accounting and the emulated RC522 + card
+#ifndef __mock_hal_h
+#define __mock_hal_h
+
+#include <stdint.h>
+#include "stm32f1xx_hal.h"
+
+typedef struct {
+    uint32_t transactions;          // CS frames
+    uint32_t bytes;
+} Mock_SpiStats_t;
+
+extern uint64_t mockNs;             // Simulated time since start
+extern Mock_SpiStats_t mockSpi;
+
+void Mock_Attach(GPIO_TypeDef *csPort, uint16_t csPin);
+void Mock_AdvanceUs(uint32_t us);
+// SCK above hz corrupts received bytes (0: never), as a long-wired clone would
+void Mock_SetSpiLimit(uint32_t hz);
+uint32_t Mock_SpiHz(void);
+// Scripted card: UID of 4 or 7 bytes; present toggles it in and out of the field
+void Emu_SetCard(const uint8_t *uid, uint8_t len);
+void Emu_SetPresent(uint8_t present);
+void Emu_SetBlock(uint8_t block, const uint8_t *data);
+// SPI byte exchange with the emulated RC522 (CS frame start/stop)
+void Emu_Select(uint8_t active);
+uint8_t Emu_Xfer(uint8_t tx);
+#endif
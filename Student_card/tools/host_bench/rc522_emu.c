@@ -0,0 +1,301 @@
+// Register-level RC522 model with one scripted ISO14443A card. Covers
+// what the driver uses: FIFO, ComIrq, BitFraming/StartSend, Transceive,
+// CalcCRC, MFAuthent, the TReload timer and the REQA/WUPA/anticoll/SELECT/
+// HLTA exchanges. A 4-byte UID card is a MIFARE Classic 1K with key A
+// FF..FF; a 7-byte one does not support authentication.
+#include <string.h>
+#include "mock_hal.h"
+#include "MFRC522_STM32.h"
+
+#define FRAME_US        100         // Card answer incl. Tx/Rx at 106 kbit/s
+#define AUTH_US         1200        // Three authentication passes
+#define READ_US         1700        // 4-byte READ out, 18 bytes back
+#define MF_BLOCKS       64
+
+enum { CARD_IDLE, CARD_READY, CARD_ACTIVE, CARD_HALT };
+
+static struct {
+    uint8_t reg[64];
+    uint8_t fifo[MFRC522_FIFO_SIZE];
+    uint8_t fifoLen;
+    uint8_t irqBits;                // Raised at irqAt
+    uint64_t irqAt;
+    // SPI frame
+    uint8_t first;
+    uint8_t read;
+    uint8_t addr;
+    // Card
+    uint8_t uid[7];
+    uint8_t uidLen;
+    uint8_t present;
+    uint8_t state;
+    uint8_t level;                  // Cascade level being selected
+    uint8_t authed;                 // Crypto1 session with the card
+    uint8_t writeBlock;             // 0xFF: no WRITE part 1 pending
+    uint8_t mem[MF_BLOCKS][16];
+} emu;
+
+static const uint8_t mfKey[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// ISO 14443-3 CRC_A (reflected 0x1021) from the ModeReg preset
+static uint16_t crcA(const uint8_t *data, uint8_t len) {
+    static const uint16_t preset[4] = {0x0000, 0x6363, 0xA671, 0xFFFF};
+    uint16_t crc = preset[emu.reg[PCD_ModeReg] & 0x03];
+    for (uint8_t i = 0; i < len; i++) {
+        uint8_t b = data[i] ^ (uint8_t)crc;
+        b ^= b << 4;
+        crc = (crc >> 8) ^ ((uint16_t)b << 8) ^ ((uint16_t)b << 3) ^ (b >> 4);
+    }
+    return crc;
+}
+
+static uint8_t crcOk(const uint8_t *f, uint8_t n) {
+    if (n < 3) return 0;
+    uint16_t c = crcA(f, n - 2);
+    return f[n - 2] == (uint8_t)c && f[n - 1] == (uint8_t)(c >> 8);
+}
+
+void Emu_SetBlock(uint8_t block, const uint8_t *data) {
+    memcpy(emu.mem[block % MF_BLOCKS], data, 16);
+}
+
+void Emu_SetCard(const uint8_t *uid, uint8_t len) {
+    memcpy(emu.uid, uid, len);
+    emu.uidLen = len;
+    emu.state = CARD_IDLE;
+}
+
+void Emu_SetPresent(uint8_t present) {
+    emu.present = present;
+    emu.state = CARD_IDLE;
+    emu.authed = 0;
+}
+
+static uint8_t fieldOn(void) {
+    return (emu.reg[PCD_TxControlReg] & 0x03) && !(emu.reg[PCD_CommandReg] & PCD_PowerDown);
+}
+
+// 4 bytes a card sends for the given cascade level
+static void levelBytes(uint8_t level, uint8_t *out) {
+    if (emu.uidLen == 7 && level == 0) {
+        out[0] = PICC_CASCADE_TAG;
+        memcpy(&out[1], emu.uid, 3);
+    } else {
+        memcpy(out, &emu.uid[emu.uidLen == 7 ? 3 : 0], 4);
+    }
+}
+
+static void respond(const uint8_t *data, uint8_t len) {
+    memcpy(emu.fifo, data, len);
+    emu.fifoLen = len;
+    emu.irqBits = PCD_IRQ_RX | PCD_IRQ_IDLE;
+    emu.irqAt = mockNs + FRAME_US * 1000;
+}
+
+static void respondAfter(const uint8_t *data, uint8_t len, uint32_t us) {
+    respond(data, len);
+    emu.irqAt = mockNs + (uint64_t)us * 1000;
+}
+
+static void noAnswer(void) {
+    uint32_t reload = (emu.reg[PCD_TReloadRegH] << 8) | emu.reg[PCD_TReloadRegL];
+    emu.fifoLen = 0;
+    emu.irqBits = PCD_IRQ_TIMER;
+    emu.irqAt = mockNs + (uint64_t)(reload + 1) * MFRC522_TIMER_TICK_US * 1000 + FRAME_US * 1000;
+}
+
+// MFAuthent: key, block and UID from the FIFO; success sets MFCrypto1On
+static void authenticate(void) {
+    uint8_t n = emu.fifoLen;
+    emu.fifoLen = 0;
+    if (!fieldOn() || !emu.present || emu.state != CARD_ACTIVE || emu.uidLen != 4 || n != 12 ||
+        (emu.fifo[0] != PICC_MF_AUTH_KEY_A && emu.fifo[0] != PICC_MF_AUTH_KEY_B) ||
+        memcmp(&emu.fifo[2], mfKey, 6) != 0 || memcmp(&emu.fifo[8], emu.uid, 4) != 0) {
+        emu.state = CARD_IDLE;
+        noAnswer();
+        return;
+    }
+    emu.authed = 1;
+    emu.writeBlock = 0xFF;
+    emu.reg[PCD_Status2Reg] |= PCD_STATUS2_CRYPTO1;
+    emu.irqBits = PCD_IRQ_IDLE;
+    emu.irqAt = mockNs + AUTH_US * 1000;
+}
+
+static void calcCrc(void) {
+    uint16_t c = crcA(emu.fifo, emu.fifoLen);
+    emu.fifoLen = 0;
+    emu.reg[PCD_CRCResultRegL] = (uint8_t)c;
+    emu.reg[PCD_CRCResultRegH] = (uint8_t)(c >> 8);
+    emu.reg[PCD_DivIrqReg] |= PCD_DIVIRQ_CRC;
+}
+
+// StartSend with Transceive: decide what the card answers
+static void transceive(void) {
+    uint8_t f[MFRC522_FIFO_SIZE];
+    uint8_t n = emu.fifoLen;
+    memcpy(f, emu.fifo, n);
+    emu.fifoLen = 0;
+
+    if (!fieldOn() || !emu.present || n == 0) {
+        noAnswer();
+        return;
+    }
+    uint8_t cmd = f[0];
+    if (emu.authed && emu.state == CARD_ACTIVE) {
+        uint8_t ack = PICC_MF_ACK;
+        if (!(emu.reg[PCD_Status2Reg] & PCD_STATUS2_CRYPTO1)) {
+            emu.authed = 0;             // Plain frame in an encrypted session
+            emu.state = CARD_IDLE;
+            noAnswer();
+        } else if (emu.writeBlock != 0xFF) {
+            if (n == 18 && crcOk(f, n)) {
+                memcpy(emu.mem[emu.writeBlock], f, 16);
+                respondAfter(&ack, 1, READ_US);
+            } else {
+                noAnswer();
+            }
+            emu.writeBlock = 0xFF;
+        } else if (cmd == PICC_MF_READ && n == 4 && crcOk(f, n)) {
+            uint8_t out[18];
+            memcpy(out, emu.mem[f[1] % MF_BLOCKS], 16);
+            uint16_t c = crcA(out, 16);
+            out[16] = (uint8_t)c;
+            out[17] = (uint8_t)(c >> 8);
+            respondAfter(out, 18, READ_US);
+        } else if (cmd == PICC_MF_WRITE && n == 4 && crcOk(f, n)) {
+            emu.writeBlock = f[1] % MF_BLOCKS;
+            respond(&ack, 1);
+        } else {
+            noAnswer();
+        }
+        return;
+    }
+    if ((cmd == PICC_REQA && emu.state == CARD_IDLE) ||
+        (cmd == PICC_WUPA && (emu.state == CARD_IDLE || emu.state == CARD_HALT))) {
+        uint8_t atqa[2] = {emu.uidLen == 7 ? 0x44 : 0x04, 0x00};
+        emu.state = CARD_READY;
+        emu.level = 0;
+        respond(atqa, 2);
+        return;
+    }
+    if (cmd == PICC_HLTA && n >= 2) {
+        if (emu.state == CARD_ACTIVE) emu.state = CARD_HALT;
+        noAnswer();
+        return;
+    }
+    uint8_t level = (cmd == PICC_SEL_CL1) ? 0 : (cmd == PICC_SEL_CL2) ? 1 : (cmd == PICC_SEL_CL3) ? 2 : 0xFF;
+    if (level == 0xFF || emu.state != CARD_READY || n < 2) {
+        emu.state = (emu.state == CARD_HALT) ? CARD_HALT : CARD_IDLE;   // Unknown frame
+        noAnswer();
+        return;
+    }
+    uint8_t lb[5];
+    levelBytes(level, lb);
+    lb[4] = lb[0] ^ lb[1] ^ lb[2] ^ lb[3];
+    if (f[1] == 0x70 && n >= 7) {   // SELECT
+        if (memcmp(&f[2], lb, 4) != 0) {
+            noAnswer();
+            return;
+        }
+        uint8_t last = (emu.uidLen == 4 && level == 0) || (emu.uidLen == 7 && level == 1);
+        uint8_t sak = last ? (emu.uidLen == 7 ? 0x00 : 0x08) : 0x04;
+        if (last) emu.state = CARD_ACTIVE;
+        respond(&sak, 1);
+        return;
+    }
+    // ANTICOLLISION: send the bytes after the known prefix (single card,
+    // so the prefix is always whole bytes)
+    uint8_t known = (f[1] >> 4) - 2;
+    if (known > 4) known = 4;
+    respond(&lb[known], 5 - known);
+}
+
+static uint8_t readReg(uint8_t r) {
+    switch (r) {
+    case PCD_ComIrqReg:
+        return (emu.irqBits && mockNs >= emu.irqAt) ? emu.irqBits : 0;
+    case PCD_FIFOLevelReg:
+        return (mockNs >= emu.irqAt) ? emu.fifoLen : 0;
+    case PCD_FIFODataReg: {
+        if (emu.fifoLen == 0) return 0;
+        uint8_t v = emu.fifo[0];
+        memmove(emu.fifo, emu.fifo + 1, --emu.fifoLen);
+        return v;
+    }
+    case PCD_ErrorReg:
+    case PCD_CollReg:
+        return 0;
+    case PCD_VersionReg:
+        return 0x92;
+    default:
+        return emu.reg[r];
+    }
+}
+
+static void writeReg(uint8_t r, uint8_t v) {
+    switch (r) {
+    case PCD_FIFODataReg:
+        if (emu.fifoLen < MFRC522_FIFO_SIZE) emu.fifo[emu.fifoLen++] = v;
+        return;
+    case PCD_FIFOLevelReg:
+        if (v & 0x80) emu.fifoLen = 0;
+        return;
+    case PCD_ComIrqReg:
+        if (!(v & 0x80)) emu.irqBits &= ~v;
+        return;
+    case PCD_CommandReg:
+        if ((v & 0x0F) == PCD_SoftReset) {
+            memset(emu.reg, 0, sizeof(emu.reg));
+            emu.reg[PCD_ModeReg] = 0x3F;    // CRC preset 0xFFFF until set
+            emu.fifoLen = 0;
+            emu.irqBits = 0;
+            return;
+        }
+        emu.reg[r] = v;
+        if ((v & 0x0F) == PCD_MFAuthent) authenticate();
+        else if ((v & 0x0F) == PCD_CalcCRC) calcCrc();
+        return;
+    case PCD_DivIrqReg:
+        if (v & 0x80) emu.reg[r] |= v & 0x7F;
+        else emu.reg[r] &= ~v;
+        return;
+    case PCD_TxControlReg:
+        if ((emu.reg[r] & 0x03) && !(v & 0x03)) {  // Field off resets the card
+            emu.state = CARD_IDLE;
+            emu.authed = 0;
+        }
+        emu.reg[r] = v;
+        return;
+    case PCD_BitFramingReg:
+        emu.reg[r] = v & 0x7F;
+        if ((v & 0x80) && (emu.reg[PCD_CommandReg] & 0x0F) == PCD_Transceive) {
+            emu.irqBits = 0;
+            transceive();
+        }
+        return;
+    default:
+        emu.reg[r] = v;
+    }
+}
+
+void Emu_Select(uint8_t active) {
+    emu.first = active;
+}
+
+uint8_t Emu_Xfer(uint8_t tx) {
+    uint8_t rx = 0;
+    if (emu.first) {
+        emu.first = 0;
+        emu.read = (tx & 0x80) != 0;
+        emu.addr = (tx >> 1) & 0x3F;
+        return 0;
+    }
+    if (emu.read) {
+        rx = readReg(emu.addr);
+        emu.addr = (tx >> 1) & 0x3F;    // Next address of a burst read
+    } else {
+        writeReg(emu.addr, tx);
+    }
+    return rx;
+}
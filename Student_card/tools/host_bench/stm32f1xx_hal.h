@@ -0,0 +1,59 @@
+// Host stand-in for the STM32F1 HAL, just enough for MFRC522_STM32.c.
+// Picked up instead of the real header because host_bench comes first on
+// the include path (see bench.c for the build line).
+#ifndef __STM32F1xx_HAL_H
+#define __STM32F1xx_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define __weak          __attribute__((weak))
+#define UNUSED(x)       ((void)(x))
+#define HAL_MAX_DELAY   0xFFFFFFFFU
+
+typedef enum { HAL_OK = 0, HAL_ERROR, HAL_BUSY, HAL_TIMEOUT } HAL_StatusTypeDef;
+typedef enum { GPIO_PIN_RESET = 0, GPIO_PIN_SET } GPIO_PinState;
+
+typedef struct { int id; } GPIO_TypeDef;
+typedef struct { volatile uint32_t CR1; } SPI_TypeDef;
+typedef struct {
+    SPI_TypeDef *Instance;
+    struct { uint32_t BaudRatePrescaler; } Init;
+} SPI_HandleTypeDef;
+
+extern SPI_TypeDef mockSpi1;
+#define SPI1            (&mockSpi1)
+#define SPI_CR1_SPE     0x0040U
+#define SPI_CR1_BR_Pos  3U
+#define SPI_CR1_BR      (0x7U << SPI_CR1_BR_Pos)
+#define MODIFY_REG(reg, clear, set) ((reg) = ((reg) & ~(clear)) | (set))
+#define __HAL_SPI_DISABLE(h) ((h)->Instance->CR1 &= ~SPI_CR1_SPE)
+
+extern GPIO_TypeDef mockGpioA, mockGpioB, mockGpioC;
+#define GPIOA (&mockGpioA)
+#define GPIOB (&mockGpioB)
+#define GPIOC (&mockGpioC)
+
+#define GPIO_PIN_0   0x0001U
+#define GPIO_PIN_1   0x0002U
+#define GPIO_PIN_4   0x0010U
+#define GPIO_PIN_8   0x0100U
+#define GPIO_PIN_12  0x1000U
+#define GPIO_PIN_13  0x2000U
+#define GPIO_PIN_15  0x8000U
+#define EXTI1_IRQn   7
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state);
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t len, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t len, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, uint8_t *tx, uint8_t *rx,
+                                          uint16_t len, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, uint8_t *tx, uint8_t *rx,
+                                              uint16_t len);
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi);
+uint32_t HAL_RCC_GetPCLK1Freq(void);
+uint32_t HAL_RCC_GetPCLK2Freq(void);
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t ms);
+void __WFI(void);
+#endif
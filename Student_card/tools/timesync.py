@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""Set the board's clock to this host's epoch over its UART.
+
+Run it on the server (the time master). Each round asks the board for its
+local us count a few times (TIME_GET), keeps the exchange with the lowest
+round trip and sends back the epoch us of that instant (TIME_SET). From the
+second round on the board also learns its crystal drift, so CARD/REMOVED
+events carry epoch timestamps that stay close between syncs.
+
+    python3 timesync.py --port /dev/ttyUSB0                  # once
+    python3 timesync.py --port /dev/ttyUSB0 --interval 60    # keep synced
+
+The estimate assumes the USB-serial latency is the same both ways; the
+printed +- bound is half of what is left of the round trip after the
+frames' own wire time.
+"""
+import argparse
+import struct
+import sys
+import time
+
+from trace_decode import PROTO_SOF, stm32_crc
+from whitelist_sync import Link, check
+
+# Keep in sync with Core/Inc/proto.h
+CMD_TIME_GET, CMD_TIME_SET = 0x18, 0x19
+EVT_TIME = 0x06
+TIME_LEN = 24
+
+
+def now_us():
+    return time.time_ns() // 1000
+
+
+def wire_us(nbytes, baud):
+    return nbytes * 10 * 1000000 // baud
+
+
+class TimeLink(Link):
+    def read_time(self):
+        """Next TIME frame as (local, epoch, drift ppb, last error us, t4 us).
+
+        Reads a byte at a time so t4 is taken when the frame's last byte
+        arrives, not when a larger read times out."""
+        deadline = time.time() + self.timeout
+        buf = bytearray()
+        while time.time() < deadline:
+            c = self.ser.read(1)
+            if not c:
+                continue
+            t4 = now_us()
+            buf += c
+            i = buf.find(bytes([PROTO_SOF]))
+            if i < 0:
+                buf.clear()
+                continue
+            del buf[:i]
+            if len(buf) < 2 or len(buf) < 2 + buf[1] + 4:
+                continue
+            n = buf[1]
+            hdr, body = bytes(buf[1:2]), bytes(buf[2:2 + n])
+            crc = int.from_bytes(buf[2 + n:6 + n], "little")
+            del buf[:6 + n]
+            if crc != stm32_crc(hdr + body) or body[0] != EVT_TIME or n != 6 + TIME_LEN:
+                continue
+            return struct.unpack("<QQii", body[6:]) + (t4,)
+        return None
+
+    def sample(self, baud):
+        """One TIME_GET exchange: (rtt us, local, epoch estimate, board's view)."""
+        seq = self.seq
+        req = self.frame(CMD_TIME_GET)
+        t1 = now_us()
+        self.ser.write(req)
+        self.ser.flush()
+        got = self.read_time()
+        self.read_ack(CMD_TIME_GET, seq)
+        self.seq = (self.seq + 1) & 0xFF
+        if not got:
+            return None
+        local, board_epoch, drift, err, t4 = got
+        req_wire = wire_us(len(req), baud)
+        rsp_wire = wire_us(2 + 6 + TIME_LEN + 4, baud)
+        # Board stamped the end of the request; it reaches us rsp_wire later
+        est = (t1 + req_wire + t4 - rsp_wire) // 2
+        return t4 - t1 - req_wire - rsp_wire, local, est, (board_epoch, drift, err)
+
+
+def sync(link, baud, samples):
+    best = None
+    for _ in range(samples):
+        s = link.sample(baud)
+        if s and (best is None or s[0] < best[0]):
+            best = s
+    if best is None:
+        sys.exit("no TIME answer from the board")
+    rtt, local, est, (board_epoch, drift, err) = best
+    check(link.command(CMD_TIME_SET, struct.pack("<QQ", local, est)), "time set")
+    off = "unsynced" if not board_epoch else "%+d us" % (board_epoch - est)
+    print("%s  board was %s, drift %.3f ppm, last error %+d us; set +-%d us" %
+          (time.strftime("%H:%M:%S"), off, drift / 1000.0, err, max(rtt, 0) // 2))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--port", required=True)
+    ap.add_argument("--baud", type=int, default=115200)
+    ap.add_argument("--timeout", type=float, default=1.0, help="seconds per answer")
+    ap.add_argument("--samples", type=int, default=8, help="exchanges per sync, lowest RTT wins")
+    ap.add_argument("--interval", type=float, default=0, help="seconds between syncs (0: once)")
+    args = ap.parse_args()
+
+    link = TimeLink(args.port, args.baud, args.timeout)
+    while True:
+        sync(link, args.baud, args.samples)
+        if not args.interval:
+            break
+        time.sleep(args.interval)
+
+
+if __name__ == "__main__":
+    main()
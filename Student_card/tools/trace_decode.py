@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+"""Decode the Student_card binary trace (Core/Src/trace.c).
+
+USART1 carries printf text mixed with trace records. A record is the sync
+byte 0xA5 followed by 8 bytes: uint32 tick (ms), uint8 id, uint8 a,
+uint16 b, little endian. Text bytes are always < 0x80.
+
+Event frames (Core/Src/proto.c) start with 0xC5 and are checked against
+the CRC from the F103 CRC unit; sequence gaps are reported.
+
+    python3 trace_decode.py capture.bin
+    python3 trace_decode.py --port /dev/ttyUSB0      # needs pyserial
+"""
+import argparse
+import struct
+import sys
+import time
+
+SYNC = 0xA5
+REC = struct.Struct("<IBBH")
+
+PROTO_SOF = 0xC5
+PROTO_TYPES = {1: "BOOT", 2: "CARD", 3: "REMOVED", 4: "JOURNAL", 5: "PROF", 6: "TIME", 0x80: "ACK"}
+# Keep in sync with Core/Inc/prof.h
+PROF_PHASES = ["REQA", "ANTICOLL", "READUID", "DECISION", "ACTUATOR", "TOTAL", "TAP", "INTERVAL"]
+PROF_COUNTERS = ["timeout", "bcc", "fifo", "protocol", "collision"]
+JOURNAL_TYPES = {1: "CARD", 2: "REMOVED"}
+DECISIONS = {0: "DENIED", 1: "GRANTED", 2: "UNKNOWN"}
+READERS = ["ENTRY", "EXIT"]
+
+
+def format_epoch(us):
+    """Epoch us from a synced board as local wall time, '-' before the first sync."""
+    if not us:
+        return "-"
+    return time.strftime("%H:%M:%S", time.localtime(us // 1000000)) + ".%06d" % (us % 1000000)
+
+
+def stm32_crc(data):
+    """CRC-32/MPEG-2 as the F103 CRC unit computes it over zero-padded words."""
+    data = bytes(data) + b"\0" * (-len(data) % 4)
+    crc = 0xFFFFFFFF
+    for i in range(0, len(data), 4):
+        crc ^= int.from_bytes(data[i:i + 4], "big")
+        for _ in range(32):
+            crc = ((crc << 1) ^ 0x04C11DB7) if crc & 0x80000000 else (crc << 1)
+            crc &= 0xFFFFFFFF
+    return crc
+
+# Keep in sync with the enum in Core/Inc/trace.h
+EVENTS = [
+    ("OVERFLOW", lambda a, b: "%d dropped" % b),
+    ("RC522_INIT", lambda a, b: "version 0x%02X, ready in %d us" % (a, b)),
+    ("RC522_WAIT_CARD", None),
+    ("RC522_WAIT_REMOVAL", None),
+    ("RC522_DETECTED", lambda a, b: "ATQA %02X %02X" % (a, b)),
+    ("RC522_UID", lambda a, b: "%d bytes, %02X %02X .." % (a, b >> 8, b & 0xFF)),
+    ("RC522_REMOVED", None),
+    ("RC522_TIMEOUT", lambda a, b: "ComIrq 0x%02X" % a),
+    ("RC522_ERROR", lambda a, b: "Error 0x%02X, FIFO %d" % (a, b & 0x7F)),
+    ("RC522_COLLISION", lambda a, b: "bit %d, level %d" % (a, b)),
+    ("RC522_SAK", lambda a, b: "SAK 0x%02X" % a),
+    ("RC522_POWERDOWN", None),
+    ("RC522_WAKE", lambda a, b: "%d ms" % b),
+    ("CLOCK", lambda a, b: "HCLK %d MHz, %d us" % (a, b)),
+    ("RC522_SPI", lambda a, b: "SCK %d kHz (BR %d)" % (b, a)),
+]
+
+
+def format_record(ts, ev, a, b):
+    if ev < len(EVENTS):
+        name, fmt = EVENTS[ev]
+        args = fmt(a, b) if fmt else ""
+    else:
+        name, args = "EVT_%d" % ev, "a=%d b=%d" % (a, b)
+    return "%10d ms  %-20s %s" % (ts, name, args)
+
+
+def format_frame(ftype, seq, ts, payload):
+    name = PROTO_TYPES.get(ftype, "TYPE_%d" % ftype)
+    args = ""
+    if ftype in (2, 3) and payload:
+        reader = READERS[payload[0]] if payload[0] < len(READERS) else str(payload[0])
+        args = reader
+        if ftype == 2 and len(payload) >= 2:
+            n = payload[1]
+            uid = " ".join("%02X" % b for b in payload[2:2 + n])
+            decision = payload[2 + n] if len(payload) > 2 + n else None
+            args += " UID %s -> %s" % (uid, DECISIONS.get(decision, decision))
+            if len(payload) >= 7 + n:
+                args += " tap #%d" % struct.unpack("<I", payload[3 + n:7 + n])[0]
+            if len(payload) >= 15 + n:
+                args += " @" + format_epoch(struct.unpack("<Q", payload[7 + n:15 + n])[0])
+        elif ftype == 3 and len(payload) >= 9:
+            args += " @" + format_epoch(struct.unpack("<Q", payload[1:9])[0])
+    elif ftype == 4 and len(payload) >= 12:
+        jseq, jts, jtype, reader, decision, n = struct.unpack("<IIBBBB", payload[:12])
+        args = "#%d @%d ms %s %s" % (jseq, jts, JOURNAL_TYPES.get(jtype, jtype),
+                                    READERS[reader] if reader < len(READERS) else reader)
+        if jtype == 1:
+            args += " UID %s -> %s" % (" ".join("%02X" % b for b in payload[12:12 + n]),
+                                       DECISIONS.get(decision, decision))
+    elif ftype == 5 and payload and payload[0] == 0xFF:
+        vals = struct.unpack("<%dI" % ((len(payload) - 1) // 4), payload[1:])
+        args = "counters " + ", ".join("%s %d" % kv for kv in zip(PROF_COUNTERS, vals))
+    elif ftype == 5 and len(payload) >= 17:
+        count, lo, hi, total = struct.unpack("<IIII", payload[1:17])
+        hist = struct.unpack("<%dH" % ((len(payload) - 17) // 2), payload[17:])
+        name = PROF_PHASES[payload[0]] if payload[0] < len(PROF_PHASES) else str(payload[0])
+        args = "%-9s n=%d" % (name, count)
+        if count:
+            args += " min %d max %d avg %d us |" % (lo, hi, total // count)
+            # Bucket i holds [2^(i+4), 2^(i+5)) us, bucket 0 everything below 32 us
+            args += " ".join("<%d:%d" % (32 << i, c) for i, c in enumerate(hist) if c)
+    elif ftype == 6 and len(payload) >= 24:
+        local, epoch, drift, err = struct.unpack("<QQii", payload[:24])
+        args = "local %d us = %s, drift %.3f ppm, last error %+d us" % (
+            local, format_epoch(epoch), drift / 1000.0, err)
+    elif ftype == 0x80 and len(payload) >= 7:
+        cmd, cseq, status, version, count = struct.unpack("<BBBHH", payload[:7])
+        args = "cmd 0x%02X #%d status %d, version %d, %d cards" % (cmd, cseq, status, version, count)
+    return "%10d ms  #%-3d %-16s %s" % (ts, seq, name, args)
+
+
+def decode(read, out):
+    text = bytearray()
+    last_seq = None
+    while True:
+        c = read(1)
+        if not c:
+            break
+        if c[0] == PROTO_SOF:
+            hdr = read(1)
+            if not hdr:
+                break
+            body = read(hdr[0])
+            crc = read(4)
+            if len(body) < hdr[0] or len(crc) < 4 or hdr[0] < 6:
+                break
+            if int.from_bytes(crc, "little") != stm32_crc(hdr + body):
+                out.write("        frame CRC error, dropped\n")
+                continue
+            ftype, seq, ts = body[0], body[1], int.from_bytes(body[2:6], "little")
+            if ftype == 1:
+                last_seq = None
+            elif last_seq is not None and seq != (last_seq + 1) & 0xFF:
+                out.write("        frame seq gap: %d -> %d\n" % (last_seq, seq))
+            last_seq = seq
+            out.write(format_frame(ftype, seq, ts, body[6:]) + "\n")
+            out.flush()
+            continue
+        if c[0] != SYNC:
+            text += c
+            if c == b"\n":
+                out.write("        text  " + text.decode("ascii", "replace").rstrip() + "\n")
+                text.clear()
+            continue
+        raw = read(REC.size)
+        if len(raw) < REC.size:
+            break
+        out.write(format_record(*REC.unpack(raw)) + "\n")
+        out.flush()
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("capture", nargs="?", help="raw capture file (default: stdin)")
+    ap.add_argument("--port", help="serial port to read live")
+    ap.add_argument("--baud", type=int, default=115200)
+    args = ap.parse_args()
+
+    if args.port:
+        import serial  # pyserial
+        src = serial.Serial(args.port, args.baud)
+    elif args.capture:
+        src = open(args.capture, "rb")
+    else:
+        src = sys.stdin.buffer
+    try:
+        decode(src.read, sys.stdout)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""Build the flash whitelist image for Core/Src/whitelist.c.
+
+Input is a text/CSV file, one card per line: UID in hex (":"/space
+separated or not), optionally followed by "allow" (default) or "deny".
+Lines starting with # are ignored.
+
+    python3 whitelist_build.py students.csv -o whitelist.bin --version 3
+    st-flash write whitelist.bin 0x800C000
+
+For a board already in service use whitelist_sync.py instead; it only
+rewrites the pages that change.
+"""
+import argparse
+import re
+import struct
+import sys
+
+from trace_decode import stm32_crc
+
+# Keep in sync with Core/Inc/whitelist.h
+PAGE_MAGIC = 0x32504C57
+PAGE_SIZE = 1024
+PAGES = 16
+BUCKETS = 14
+META = BUCKETS
+UID_MAX = 10
+FLAG_ALLOW = 0x01
+FLAG_UID10 = 0x40
+FLAG_UID7 = 0x80
+FLAG_LEN = FLAG_UID7 | FLAG_UID10
+HEADER = struct.Struct("<IBBHIHHB3x")
+BODY_SIZE = PAGE_SIZE - HEADER.size
+SHORT_SIZE = 4 + 1
+LONG_SIZE = UID_MAX + 1
+UID_LENS = {0: 4, FLAG_UID7: 7, FLAG_UID10: 10}
+LEN_FLAGS = {n: f for f, n in UID_LENS.items()}
+
+
+def uid_of(key, len_flag):
+    """The UID bytes of a (key, length flag) entry key."""
+    return key[:UID_LENS[len_flag]]
+
+
+def parse(path):
+    """Return {(key, length flag): flags} for the cards in the list."""
+    entries = {}
+    with open(path) as f:
+        for n, line in enumerate(f, 1):
+            line = line.split("#", 1)[0].strip()
+            if not line:
+                continue
+            parts = line.split(",") if "," in line else [line]
+            uid = bytes.fromhex(re.sub(r"[\s:\-]", "", parts[0]))
+            action = parts[1].strip().lower() if len(parts) > 1 else "allow"
+            len_flag = LEN_FLAGS.get(len(uid))
+            if len_flag is None:
+                sys.exit("line %d: only 4-, 7- and 10-byte UIDs are supported" % n)
+            flags = len_flag | (FLAG_ALLOW if action != "deny" else 0)
+            entries[(uid.ljust(UID_MAX, b"\0"), len_flag)] = flags
+    return entries
+
+
+def bucket(key, len_flag):
+    """FNV-1a over the UID bytes and their count, as wlBucket() computes it."""
+    uid = uid_of(key, len_flag)
+    h = 2166136261
+    for b in uid + bytes([len(uid)]):
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h % BUCKETS
+
+
+def page(logical, body, count, version, total=0, long_count=0):
+    hdr = HEADER.pack(PAGE_MAGIC, logical, count, 0, stm32_crc(body), version & 0xFFFF, total,
+                      long_count)
+    return (hdr + body).ljust(PAGE_SIZE, b"\xff")
+
+
+def build(entries, version):
+    buckets = [[] for _ in range(BUCKETS)]
+    for key, len_flag in entries:
+        buckets[bucket(key, len_flag)].append((key, len_flag))
+    image = b""
+    for i, keys in enumerate(buckets):
+        short = sorted(k for k in keys if not k[1])
+        # Same order as wlSearch: padded UID bytes, then length flag (10-byte first)
+        long = sorted(k for k in keys if k[1])
+        size = len(short) * SHORT_SIZE + len(long) * LONG_SIZE
+        if size > BODY_SIZE or len(short) > 0xFF or len(long) > 0xFF:
+            sys.exit("bucket %d has %d short and %d long cards, %d bytes; a page holds %d"
+                     % (i, len(short), len(long), size, BODY_SIZE))
+        body = b"".join(k[0][:4] + bytes([entries[k]]) for k in short)
+        body += b"".join(k[0] + bytes([entries[k]]) for k in long)
+        image += page(i, body, len(short), version, long_count=len(long))
+    image += page(META, b"", 0, version, len(entries))
+    # The remaining pages stay erased as spares for copy-on-write
+    return image.ljust(PAGES * PAGE_SIZE, b"\xff")
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("list")
+    ap.add_argument("-o", "--output", default="whitelist.bin")
+    ap.add_argument("--version", type=int, default=1)
+    args = ap.parse_args()
+
+    entries = parse(args.list)
+    image = build(entries, args.version)
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print("%d entries, %d bytes -> %s" % (len(entries), len(image), args.output))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+"""Push whitelist changes to a running board over its UART.
+
+Sends only the difference between the list the board has (OLD) and the
+new one (NEW) as add/remove commands, then commits them under a new
+version. Each command waits for its ACK; the board keeps serving cards
+while it rewrites the affected flash pages.
+
+    python3 whitelist_sync.py --port /dev/ttyUSB0 old.csv new.csv
+
+A delta already compiled from the roster (tools/roster_compile.py) is
+replayed as is, to as many readers as there are --port options, in
+parallel; a board already at the delta's target version is left alone:
+
+    python3 whitelist_sync.py --port /dev/ttyUSB0 --port /dev/ttyUSB1 --delta whitelist.delta
+
+If the link or power drops mid-sync the board keeps its last committed
+version; run the same command again (deltas are idempotent).
+"""
+import argparse
+import struct
+import sys
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+from trace_decode import PROTO_SOF, stm32_crc
+from whitelist_build import FLAG_ALLOW, parse, uid_of
+
+# Keep in sync with Core/Inc/proto.h
+CMD_BEGIN, CMD_ADD, CMD_REMOVE, CMD_COMMIT, CMD_QUERY = 0x10, 0x11, 0x12, 0x13, 0x14
+EVT_ACK = 0x80
+STATUS = ["OK", "BAD_STATE", "VERSION", "FULL", "BAD_ARG", "FLASH"]
+
+# Delta file: header, then (command, payload length, payload) records
+# covering the REMOVE / ADD commands of one BEGIN..COMMIT session
+DELTA_MAGIC = b"WLDS"
+DELTA_HEADER = struct.Struct("<4sHHHI")     # magic, base version, target version, records, CRC
+
+
+class Link:
+    def __init__(self, port, baud, timeout):
+        import serial  # pyserial
+        self.ser = serial.Serial(port, baud, timeout=0.1)
+        self.timeout = timeout
+        self.seq = 0
+
+    def frame(self, ftype, payload=b""):
+        body = bytes([ftype, self.seq]) + struct.pack("<I", int(time.time() * 1000) & 0xFFFFFFFF) + payload
+        hdr = bytes([len(body)])
+        return bytes([PROTO_SOF]) + hdr + body + struct.pack("<I", stm32_crc(hdr + body))
+
+    def read_ack(self, ftype, seq):
+        """Skip text, trace and event traffic until the matching ACK."""
+        deadline = time.time() + self.timeout
+        buf = bytearray()
+        while time.time() < deadline:
+            buf += self.ser.read(64)
+            while True:
+                i = buf.find(bytes([PROTO_SOF]))
+                if i < 0 or len(buf) < i + 2:
+                    break
+                n = buf[i + 1]
+                if len(buf) < i + 2 + n + 4:
+                    break
+                hdr, body = buf[i + 1:i + 2], bytes(buf[i + 2:i + 2 + n])
+                crc = int.from_bytes(buf[i + 2 + n:i + 6 + n], "little")
+                del buf[:i + 6 + n]
+                if crc != stm32_crc(hdr + body) or body[0] != EVT_ACK or len(body) < 13:
+                    continue
+                cmd, cseq, status, version, count = struct.unpack("<BBBHH", body[6:13])
+                if cmd == ftype and cseq == seq:
+                    return status, version, count
+        return None
+
+    def command(self, ftype, payload=b"", retries=3):
+        seq = self.seq
+        for _ in range(retries):
+            self.ser.write(self.frame(ftype, payload))
+            ack = self.read_ack(ftype, seq)
+            if ack:
+                self.seq = (self.seq + 1) & 0xFF
+                return ack
+        sys.exit("no ACK for command 0x%02X" % ftype)
+
+
+def check(ack, what):
+    status = ack[0]
+    if status:
+        sys.exit("%s: %s" % (what, STATUS[status] if status < len(STATUS) else status))
+
+
+def delta_commands(old, new):
+    """(command, payload) list turning list OLD into NEW, as parse() returns them."""
+    removed = [k for k in old if k not in new]
+    changed = [k for k in new if old.get(k) != new[k]]
+    commands = []
+    # Sorted so consecutive deltas mostly hit the bucket already in RAM
+    for key, len_flag in sorted(removed):
+        uid = uid_of(key, len_flag)
+        commands.append((CMD_REMOVE, bytes([len(uid)]) + uid))
+    for key, len_flag in sorted(changed):
+        uid = uid_of(key, len_flag)
+        allow = 1 if new[(key, len_flag)] & FLAG_ALLOW else 0
+        commands.append((CMD_ADD, bytes([allow, len(uid)]) + uid))
+    return commands
+
+
+def write_delta(path, base, target, commands):
+    body = b"".join(bytes([cmd, len(payload)]) + payload for cmd, payload in commands)
+    with open(path, "wb") as f:
+        f.write(DELTA_HEADER.pack(DELTA_MAGIC, base, target, len(commands), stm32_crc(body)) + body)
+
+
+def read_delta(path):
+    """(base version, target version, commands) of a delta file."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) < DELTA_HEADER.size:
+        sys.exit("%s: not a whitelist delta" % path)
+    magic, base, target, records, crc = DELTA_HEADER.unpack_from(data)
+    body = data[DELTA_HEADER.size:]
+    if magic != DELTA_MAGIC or crc != stm32_crc(body):
+        sys.exit("%s: bad magic or CRC" % path)
+    commands, i = [], 0
+    while i < len(body):
+        if i + 2 > len(body) or i + 2 + body[i + 1] > len(body):
+            sys.exit("%s: truncated record" % path)
+        commands.append((body[i], body[i + 2:i + 2 + body[i + 1]]))
+        i += 2 + body[i + 1]
+    if len(commands) != records or any(cmd not in (CMD_ADD, CMD_REMOVE) for cmd, _ in commands):
+        sys.exit("%s: unexpected records" % path)
+    return base, target, commands
+
+
+def push(port, args, commands, base=None, target=None):
+    """One board: BEGIN, the commands, COMMIT. base/target None: from the board's version."""
+    link = Link(port, args.baud, args.timeout)
+    _, version, count = link.command(CMD_QUERY)
+    if target is not None and version == target:
+        return "%s: already at version %d, %d cards" % (port, version, count)
+    if base is not None and version != base:
+        sys.exit("%s: board is at version %d, the delta applies to %d" % (port, version, base))
+    if target is None:
+        target = (version + 1) & 0xFFFF
+    check(link.command(CMD_BEGIN, struct.pack("<HH", version, target)), "%s: begin" % port)
+    for cmd, payload in commands:
+        what, uid = ("add", payload[2:]) if cmd == CMD_ADD else ("remove", payload[1:])
+        check(link.command(cmd, payload), "%s: %s %s" % (port, what, uid.hex()))
+
+    link.timeout = max(args.timeout, 10.0)   # Flushes the last bucket and the meta page
+    status, version, count = link.command(CMD_COMMIT)
+    check((status,), "%s: commit" % port)
+    return "%s: %d change(s) -> version %d, %d cards" % (port, len(commands), version, count)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("old", nargs="?", help="list currently on the board ('-' for empty)")
+    ap.add_argument("new", nargs="?")
+    ap.add_argument("--delta", help="delta file from tools/roster_compile.py instead of OLD NEW")
+    ap.add_argument("--port", action="append", required=True, help="repeat for several readers")
+    ap.add_argument("--baud", type=int, default=115200)
+    ap.add_argument("--timeout", type=float, default=2.0, help="seconds per ACK")
+    args = ap.parse_args()
+
+    base = target = None
+    if args.delta:
+        base, target, commands = read_delta(args.delta)
+    elif args.new:
+        commands = delta_commands(parse(args.old) if args.old != "-" else {}, parse(args.new))
+    else:
+        ap.error("give OLD NEW or --delta")
+
+    def run(port):
+        try:
+            return True, push(port, args, commands, base, target)
+        except (SystemExit, OSError) as e:
+            return False, "%s: %s" % (port, e) if isinstance(e, OSError) else str(e)
+
+    with ThreadPoolExecutor(len(args.port)) as pool:
+        results = list(pool.map(run, args.port))
+    for _, line in results:
+        print(line)
+    sys.exit(0 if all(ok for ok, _ in results) else 1)
+
+
+if __name__ == "__main__":
+    main()
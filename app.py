@@ -7,10 +7,25 @@ from flask import Flask, request, jsonify, render_template, Response
 import cv2
 import numpy as np
 import base64
+import collections
 from PIL import Image
 import io
+import json
+import math
 import os
+import re
+import socket
+import socketserver
+import struct
+import threading
+import time
 from datetime import datetime
+from werkzeug.datastructures import Headers
+
+import face_index
+import face_pool
+import frame_archive
+import ingest_gw
 
 app = Flask(__name__)
 
@@ -20,6 +35,20 @@ DETECTED_IMAGE_PATH = os.path.join(STATIC_DIR, 'face_detected.jpg')
 
 # Tạo thư mục static nếu chưa có
 os.makedirs(STATIC_DIR, exist_ok=True)
+# Ghi ảnh mới nhất ra DETECTED_IMAGE_PATH mỗi chừng này giây (0: không ghi);
+# /latest luôn trả từ bộ nhớ, file chỉ để lần chạy sau có ảnh hiện ngay
+SNAPSHOT_SECONDS = float(os.environ.get('SNAPSHOT_SECONDS', 0))
+# Lưu JPEG gốc của mọi frame vào segment theo giờ để xem lại quanh lần quẹt
+# thẻ (frame_archive.py, /archive); rỗng: không lưu. Giữ ARCHIVE_HOURS giờ gần nhất
+ARCHIVE_DIR = os.environ.get('ARCHIVE_DIR', '')
+ARCHIVE_HOURS = int(os.environ.get('ARCHIVE_HOURS', 72))
+# Ảnh lần chạy trước, đọc 1 lần lúc khởi động cho /latest khi chưa có frame
+previous_jpeg = None
+if os.path.exists(DETECTED_IMAGE_PATH):
+    with open(DETECTED_IMAGE_PATH, 'rb') as f:
+        previous_jpeg = f.read()
+# ETag của /latest = boot:camera:seq; boot đổi mỗi lần chạy để seq đếm lại từ 1 không trùng ETag cũ
+BOOT_ID = '%x' % time.time_ns()
 
 # Load Haar Cascade cho nhận diện khuôn mặt
 # Xử lý nhiều trường hợp để tương thích với các phiên bản OpenCV khác nhau
@@ -57,50 +86,1674 @@ except AttributeError:
 if face_cascade is None or face_cascade.empty():
     raise Exception("❌ Failed to load Haar Cascade classifier!")
 
-# Biến toàn cục lưu frame mới nhất
-latest_frame = None
-latest_detected_frame = None
+# Pool worker C++ (face_pool.py) cho Haar nếu đã build detector/libface_pool.so
+detector_pool = face_pool.load(cascade_path, scale=1.1, neighbors=5, min_size=30)
+if detector_pool:
+    print(f"✅ Native detector pool: {detector_pool.workers} workers")
 
+# Cổng TCP nhận luồng frame liên tục từ ESP32-CAM (xem IngestHandler)
+INGEST_PORT = 5001
+# Gateway C++ (ingest_gw.py, khi đã build detector/libingest_gw.so): POST /upload
+# JPEG thô ở cổng này và luồng ingest ở INGEST_PORT, thay server dev của Flask
+# và IngestServer; 0: chỉ luồng ingest. Flask vẫn giữ giao diện web, REST và
+# /upload dạng JSON/form ở cổng 5000
+GATEWAY_PORT = int(os.environ.get('GATEWAY_PORT', 5005))
+GATEWAY_QUEUE = int(os.environ.get('GATEWAY_QUEUE', 256))   # Frame chờ dispatcher; đầy thì gateway tự trả 503
+# Cổng TCP ESP32-CAM giữ kết nối để nhận lệnh chụp (xem TriggerHub)
+TRIGGER_PORT = 5004
+# Cổng UDP nhận mảnh frame (USE_UDP_TRANSPORT, xem UdpReceiver)
+UDP_PORT = 5002
+UDP_NACK_MS = 20        # Frame còn thiếu mảnh chừng này sau mảnh đầu: xin lại 1 lần
+UDP_DEADLINE_MS = 100   # Quá hạn vẫn thiếu: bỏ cả frame
+# Ảnh nền (context) cũ hơn chừng này thì ACK xin ESP32 gửi ảnh mới
+CONTEXT_MAX_AGE = 10.0
+# 1: /stream và /latest chuyển nguyên JPEG của ESP32, không vẽ và encode lại;
+# khung mặt đi riêng qua /events để trang web tự vẽ
+STREAM_PASSTHROUGH = os.environ.get('STREAM_PASSTHROUGH', '0') == '1'
+# Nhận diện trên ảnh thu về rộng chừng này (px) rồi phóng khung về frame gốc;
+# 0: chạy trên cả frame với minSize 30 như trước (để so thời gian)
+DETECT_WIDTH = int(os.environ.get('DETECT_WIDTH', 320))
+# minSize suy từ khoảng cách xa nhất cần bắt mặt: mặt rộng FACE_WIDTH_M đứng
+# cách FACE_MAX_DISTANCE_M qua ống kính góc ngang CAMERA_HFOV_DEG (OV2640)
+FACE_MAX_DISTANCE_M = float(os.environ.get('FACE_MAX_DISTANCE_M', 1.5))
+FACE_WIDTH_M = 0.15
+CAMERA_HFOV_DEG = 66
+CASCADE_MIN_PX = 24     # Cửa sổ của haarcascade_frontalface_default, nhỏ hơn vô nghĩa
+# Mỗi camera (X-Camera-Id) giữ tối đa chừng này frame chờ nhận diện; đầy thì
+# bỏ frame cũ nhất (ACK 'dropped') chứ không để camera đó làm trễ camera khác
+CHANNEL_QUEUE = int(os.environ.get('CHANNEL_QUEUE', 2))
+# Luồng nhận diện dùng chung cho mọi camera (xem Scheduler)
+DETECT_WORKERS = int(os.environ.get('DETECT_WORKERS', 0)) or (detector_pool.workers if detector_pool else os.cpu_count() or 1)
+UPLOAD_WAIT = 10.0      # Giây /upload chờ tới lượt xử lý
+# Nhận dạng: embedding SFace (cv2.FaceRecognizerSF, file ONNX tải riêng từ
+# opencv_zoo) so với chỉ mục sinh viên đã đăng ký qua /enroll
+FACE_MODEL = os.environ.get('FACE_MODEL', 'face_recognition_sface_2021dec.onnx')
+FACE_MATCH_SCORE = float(os.environ.get('FACE_MATCH_SCORE', 0.363))  # Ngưỡng cosine khuyến nghị của SFace
+ENROLL_PATH = os.environ.get('ENROLL_PATH', 'enrolled.npz')
+# Danh sách lớn dựng trước bằng tools/enroll_build.py: mmap lúc khởi động, tìm tại chỗ
+ENROLL_INDEX = os.environ.get('ENROLL_INDEX', 'enrolled.idx')
+# Có quẹt thẻ: chỉ so mặt với ảnh đăng ký của UID đó (1:1), trả grant/deny
+# trong chừng này ms (đo từ lúc có khung mặt tới lúc có quyết định)
+VERIFY_BUDGET_MS = float(os.environ.get('VERIFY_BUDGET_MS', 100))
+# Cache verify 1:1 trên ESP32 (USE_EDGE_VERIFY trong arduino/esp32_cam_upload.ino):
+# ảnh quẹt thẻ kèm embedding int8 của model trên thiết bị (khác không gian SFace),
+# server grant thì giữ làm template của UID đó và đẩy xuống các cửa qua kết nối
+# TRIGGER_PORT. Giữ tối đa chừng này UID, lâu không thấy bị bỏ trước
+EDGE_TEMPLATES = int(os.environ.get('EDGE_TEMPLATES', 4096))
+# Gom mặt của mọi camera thành 1 lượt forward SFace: tối đa EMBED_BATCH mặt
+# hoặc chờ tối đa EMBED_WAIT_MS từ mặt đầu tiên (EMBED_BATCH=1: mỗi mặt 1 lượt như trước)
+EMBED_BATCH = int(os.environ.get('EMBED_BATCH', 8))
+EMBED_WAIT_MS = float(os.environ.get('EMBED_WAIT_MS', 10))
+# Số span gần nhất giữ cho /trace và phân vị trong /status
+TRACE_WINDOW = int(os.environ.get('TRACE_WINDOW', 512))
 
-def detect_faces(image):
+class Frame:
     """
-    Nhận diện khuôn mặt trong ảnh và vẽ khung hình chữ nhật
-    
-    Args:
-        image: numpy array của ảnh (BGR format)
-    
-    Returns:
-        image: ảnh đã vẽ khung hình
-        faces_count: số khuôn mặt phát hiện được
+    1 frame đã xử lý: JPEG gốc từ ESP32 (None với frame ghép từ ô cắt), ảnh
+    decode, ảnh đã vẽ khung và JPEG của ảnh đó. Publish xong thì không đổi
+    nữa (mảng numpy bị khoá ghi), nên /stream, /latest và /status chỉ giữ
+    tham chiếu thay vì copy. Frame từ JPEG thường không có ảnh đã vẽ: lần
+    đầu có viewer cần mới decode màu (hoặc dùng ảnh đã decode để cắt mặt),
+    vẽ khung và encode.
     """
-    # Chuyển sang grayscale để nhận diện
-    gray = cv2.cvtColor(image, cv2.COLOR_BGR2GRAY)
-    
-    # Nhận diện khuôn mặt
-    faces = face_cascade.detectMultiScale(
+    __slots__ = ('seq', 'cam', 'jpeg', 'image', 'detected', 'faces', 'size', 'time', 'span', '_detected_jpeg', '_encode_lock', '_store')
+
+    def __init__(self, seq, cam, jpeg, image, detected, faces, size, store=None, span=None):
+        self.seq = seq              # Đếm riêng theo camera
+        self.cam = cam
+        self.jpeg = jpeg
+        self.image = image          # None khi chưa ai cần ảnh màu đủ cỡ
+        self.detected = detected    # None: vẽ từ image / jpeg lúc encode
+        self.faces = faces
+        self.size = size            # (w, h) của frame gốc
+        self.time = time.time()
+        self.span = span            # Trễ từng đoạn tới lúc publish (Tracer), None nếu không đo
+        self._detected_jpeg = None
+        self._encode_lock = threading.Lock()
+        self._store = store
+
+    def detected_jpeg(self):
+        """JPEG ảnh đã vẽ khung, decode / vẽ / encode đúng 1 lần cho mọi client"""
+        if self.detected is None and self.image is None and not self.jpeg:
+            return b''
+        if self._detected_jpeg is None:
+            # notify_all đánh thức mọi viewer cùng lúc: 1 luồng encode, các luồng kia chờ nó
+            with self._encode_lock:
+                if self._detected_jpeg is None:
+                    detected = self.detected
+                    if detected is None:
+                        image = self.image if self.image is not None else decode_jpeg(self.jpeg)
+                        if image is None:
+                            return self.jpeg
+                        detected = draw_faces(image.copy(), self.faces, self.time)
+                    ok, buf = cv2.imencode('.jpg', detected)
+                    self._detected_jpeg = buf.tobytes() if ok else b''
+                    if self._store is not None:
+                        self._store.encodes += 1
+        return self._detected_jpeg
+
+    def stream_jpeg(self, raw=False):
+        """JPEG cho /stream và /latest: bản gốc ở chế độ pass-through (hoặc raw)"""
+        if (raw or STREAM_PASSTHROUGH) and self.jpeg is not None:
+            return self.jpeg
+        return self.detected_jpeg()
+
+    def meta(self):
+        """Khung mặt và kích thước frame, gửi qua /events"""
+        w, h = self.size
+        return {
+            'seq': self.seq,
+            'cam': self.cam,
+            'time': self.time,
+            'width': w,
+            'height': h,
+            'count': len(self.faces),
+            'faces': [{'x': int(x), 'y': int(y), 'w': int(fw), 'h': int(fh)} for (x, y, fw, fh) in self.faces],
+            'span': self.span,
+        }
+
+
+class FrameStore:
+    """
+    Frame mới nhất, phát cho các viewer /stream: seq là số thế hệ, mỗi frame
+    mới tăng 1 và notify_all; viewer chặn trong wait() tới khi có thế hệ
+    mới, nên CPU tốn theo số frame chứ không theo số viewer.
+    """
+
+    def __init__(self, cam=None):
+        self.cam = cam      # None: feed chung, nhận lại frame của mọi camera (relay)
+        self.cond = threading.Condition()
+        self.latest = None
+        self.seq = 0
+        self.viewers = 0
+        self.encodes = 0    # Số lần encode JPEG ảnh đã vẽ khung, tối đa 1/frame
+
+    def publish(self, jpeg, image, detected, faces, size, span=None):
+        for a in (image, detected):
+            if a is not None:
+                a.flags.writeable = False
+        with self.cond:
+            self.seq += 1
+            self.latest = Frame(self.seq, self.cam, jpeg, image, detected, faces, size, self, span)
+            self.cond.notify_all()
+        return self.latest
+
+    def relay(self, frame):
+        """Phát frame của 1 camera trên feed chung (cùng object, không encode thêm)"""
+        with self.cond:
+            self.seq += 1
+            self.latest = frame
+            self.cond.notify_all()
+
+    def subscribe(self, delta):
+        with self.cond:
+            self.viewers += delta
+
+    def stats(self):
+        return {'seq': self.seq, 'viewers': self.viewers, 'encodes': self.encodes}
+
+    def wait(self, after, timeout=None):
+        """
+        Frame khác frame after (lần wait trước trả về), None khi hết timeout.
+        So object chứ không so seq: feed chung có seq của nhiều camera
+        """
+        with self.cond:
+            self.cond.wait_for(lambda: self.latest is not None and self.latest is not after, timeout)
+            f = self.latest
+        return f if f is not after else None
+
+
+class Job:
+    """1 frame trong hàng đợi của 1 camera; done(result) gọi khi xử lý xong hoặc bị bỏ"""
+    __slots__ = ('fn', 'done', 'queued', 'result', 'error', 'finished')
+
+    def __init__(self, fn, done=None):
+        self.fn = fn
+        self.done = done
+        self.queued = time.monotonic()
+        self.result = None
+        self.error = None
+        self.finished = threading.Event()
+
+    def finish(self, result):
+        self.result = result
+        self.finished.set()
+        if self.done is not None:
+            try:
+                self.done(result)
+            except (OSError, ValueError):
+                # Kết nối của camera đã đóng trong lúc frame chờ
+                pass
+
+
+class Channel:
+    """
+    1 camera: hàng đợi frame chờ nhận diện (tối đa CHANNEL_QUEUE), frame
+    mới nhất cho /stream/<cam>, /latest/<cam>, /events/<cam>, lần quẹt thẻ
+    và ảnh nền ô cắt riêng, cùng số liệu cho /status
+    """
+
+    def __init__(self, cam):
+        self.cam = cam
+        self.store = FrameStore(cam)
+        self.queue = collections.deque()
+        self.scheduled = False  # Đang trong hàng ready hoặc đang có frame được xử lý
+        self.tap = None
+        self.context = None     # Ảnh nền phóng về cỡ frame, các ô mặt dán lên đó
+        self.context_time = 0
+        self.received = 0
+        self.processed = 0
+        self.dropped = 0
+        self.errors = 0
+        self.wait_s = 0.0
+        self.busy_s = 0.0
+        self.last_seen = 0
+
+    def publish(self, jpeg, image, detected, faces, size, span=None):
+        frame = self.store.publish(jpeg, image, detected, faces, size, span)
+        frame_store.relay(frame)
+        return frame
+
+    def stats(self):
+        done = max(self.processed, 1)
+        return {
+            'received': self.received,
+            'processed': self.processed,
+            'dropped': self.dropped,
+            'errors': self.errors,
+            'queued': len(self.queue),
+            'avg_wait_ms': round(self.wait_s * 1000 / done, 1),
+            'avg_process_ms': round(self.busy_s * 1000 / done, 1),
+            'idle_s': round(time.time() - self.last_seen, 1),
+            'frames': self.store.stats(),
+            'tap': self.tap,
+        }
+
+
+def camera_key(cam):
+    """X-Camera-Id dùng được trong URL /stream/<cam>"""
+    return re.sub(r'[^\w.-]', '_', cam)[:32]
+
+
+class Scheduler:
+    """
+    Luồng nhận diện dùng chung cho mọi camera. Camera có frame chờ xếp vòng
+    trong ready; worker lấy 1 frame của camera đầu hàng, xong thì đưa camera
+    đó về cuối hàng nếu còn frame. Mỗi camera nhiều nhất 1 frame đang xử lý
+    (frame ra đúng thứ tự), nên camera gửi dồn cũng chỉ được 1 lượt mỗi vòng
+    như các camera khác; phần dư bị bỏ ở hàng đợi riêng của nó.
+    """
+
+    def __init__(self, workers):
+        self.cond = threading.Condition()
+        self.channels = {}
+        self.aliases = {}       # IP -> camera id đã khai qua header, cho gói UDP (không có header)
+        self.ready = collections.deque()
+        self.workers = workers
+        for i in range(workers):
+            threading.Thread(target=self.run, name=f'detect-{i}', daemon=True).start()
+
+    def channel(self, headers, ip):
+        """Channel của frame theo X-Camera-Id; ESP32 không gửi thì theo IP"""
+        cam = headers.get('X-Camera-Id') if headers is not None else None
+        with self.cond:
+            if cam:
+                cam = camera_key(cam)
+                if ip:
+                    self.aliases[ip] = cam
+            else:
+                cam = self.aliases.get(ip) or ip or 'default'
+            ch = self.channels.get(cam)
+            if ch is None:
+                ch = self.channels[cam] = Channel(cam)
+                print(f"📷 New camera channel: {cam}")
+        return ch
+
+    def get(self, cam):
+        return self.channels.get(cam)
+
+    def submit(self, ch, fn, done=None):
+        """Xếp fn() vào hàng đợi của ch; đầy thì frame cũ nhất bị bỏ"""
+        return self.enqueue(ch, Job(fn, done))
+
+    def enqueue(self, ch, job):
+        """submit cho Job dựng sẵn, khi done cần chính job đó (xem GatewayDispatcher)"""
+        dropped = None
+        with self.cond:
+            ch.received += 1
+            ch.last_seen = time.time()
+            if len(ch.queue) >= CHANNEL_QUEUE:
+                dropped = ch.queue.popleft()
+                ch.dropped += 1
+            ch.queue.append(job)
+            if not ch.scheduled:
+                ch.scheduled = True
+                self.ready.append(ch)
+                self.cond.notify()
+        if dropped is not None:
+            dropped.finish({'status': 'dropped', 'message': f'Camera {ch.cam} queue full'})
+        return job
+
+    def run(self):
+        while True:
+            with self.cond:
+                while not self.ready:
+                    self.cond.wait()
+                ch = self.ready.popleft()
+                job = ch.queue.popleft()
+            # ch không nằm trong ready khi đang xử lý: không worker nào khác đụng tới số liệu của nó
+            t0 = time.monotonic()
+            ch.wait_s += t0 - job.queued
+            try:
+                result = job.fn()
+            except Exception as e:
+                job.error = e
+                ch.errors += 1
+                result = {'status': 'error', 'message': str(e)}
+            ch.busy_s += time.monotonic() - t0
+            ch.processed += 1
+            job.finish(result)
+            with self.cond:
+                if ch.queue:
+                    self.ready.append(ch)
+                    self.cond.notify()
+                else:
+                    ch.scheduled = False
+
+    def stats(self):
+        with self.cond:
+            channels = list(self.channels.values())
+            ready = len(self.ready)
+        return {'workers': self.workers, 'ready': ready, 'queue': CHANNEL_QUEUE,
+                'cameras': {ch.cam: ch.stats() for ch in channels}}
+
+
+class Tracer:
+    """
+    Trễ từng đoạn của mỗi frame, từ lúc cảm biến chụp tới lúc publish cho
+    trình duyệt (ms):
+
+        device_ms   chụp -> bắt đầu gửi, trên ESP32 (X-Timestamp -> X-Send-Time,
+                    cùng đồng hồ esp_timer): lọc mặt, hàng đợi upload, gửi lại
+        wifi_ms     gửi -> server nhận, so với frame nhanh nhất gần đây
+        queue_ms    nhận -> tới lượt nhận diện (Scheduler)
+        detect_ms   decode thẳng ra gray thu nhỏ (DCT 1/2..1/8) + Haar
+        decode_ms   decode màu đủ cỡ, chỉ frame có mặt cần cắt cho embedding
+        identify_ms
+        total_ms    nhận -> publish trên server
+
+    Đồng hồ ESP32 và server không đồng bộ: recv_us - X-Send-Time là độ lệch
+    hai đồng hồ cộng thời gian truyền. Lấy min của độ lệch đó trên các frame
+    gần đây làm mốc (frame truyền nhanh nhất ~ 0 ms), wifi_ms là phần vượt
+    mốc; nên nó đo được trễ thêm do Wi-Fi chứ không phải trễ tuyệt đối.
+    Lệch vọt lên hơn RESET_S giây là ESP32 khởi động lại (esp_timer về 0):
+    đặt lại mốc. Frame có X-Frame-Time (arduino/esp32_cam_upload.ino,
+    tools/loadgen: epoch lúc chụp) thì có thêm capture_to_server_ms tuyệt đối.
+
+    Span đóng lại (finish) trước khi publish: /events và kết quả /upload
+    đọc cùng dict đó, sau publish không ai ghi vào nữa.
+    """
+    STAGES = ('device_ms', 'wifi_ms', 'queue_ms', 'detect_ms', 'decode_ms', 'identify_ms', 'total_ms')
+    OFFSET_WINDOW = 256
+    RESET_S = 60
+
+    def __init__(self, window=TRACE_WINDOW):
+        self.lock = threading.Lock()
+        self.spans = collections.deque(maxlen=window)
+        self.offsets = {}   # camera -> độ lệch recv - send (us) của các frame gần đây
+
+    def start(self, channel, headers, recv_us):
+        """Span mới lúc frame tới lượt xử lý; stage() đánh dấu từng đoạn sau đó"""
+        now = time.perf_counter()
+        span = {
+            'cam': channel.cam,
+            'seq': headers.get('X-Seq', type=int),
+            'recv_us': recv_us,
+            'queue_ms': round((time.time_ns() // 1000 - recv_us) / 1000, 2),
+        }
+        capture_us, send_us = self.device_times(headers)
+        if send_us is not None:
+            if capture_us is not None:
+                span['device_ms'] = round((send_us - capture_us) / 1000, 2)
+            span['wifi_ms'] = self.wifi_ms(channel.cam, recv_us - send_us)
+        frame_us = headers.get('X-Frame-Time', type=int)
+        if frame_us:
+            span['capture_to_server_ms'] = round((recv_us - frame_us) / 1000, 2)
+        span['_mark'] = now
+        return span
+
+    @staticmethod
+    def device_times(headers):
+        """(X-Timestamp, X-Send-Time) theo us của esp_timer; None khi thiếu"""
+        capture = headers.get('X-Timestamp', type=float)
+        send = headers.get('X-Send-Time', type=int)
+        return (round(capture * 1e6) if capture is not None else None), send
+
+    def wifi_ms(self, cam, offset):
+        with self.lock:
+            recent = self.offsets.get(cam)
+            if recent is None or offset - min(recent) > self.RESET_S * 1e6:
+                recent = self.offsets[cam] = collections.deque(maxlen=self.OFFSET_WINDOW)
+            recent.append(offset)
+            return round((offset - min(recent)) / 1000, 2)
+
+    @staticmethod
+    def stage(span, name):
+        """Thời gian từ lần đánh dấu trước tới giờ vào span[name]"""
+        now = time.perf_counter()
+        span[name] = round((now - span['_mark']) * 1000, 2)
+        span['_mark'] = now
+
+    def finish(self, span):
+        del span['_mark']
+        span['total_ms'] = round((time.time_ns() // 1000 - span['recv_us']) / 1000, 2)
+        with self.lock:
+            self.spans.append(span)
+        return span
+
+    def recent(self, cam=None, n=50):
+        with self.lock:
+            spans = [s for s in self.spans if cam is None or s['cam'] == cam]
+        return spans[-n:]
+
+    def percentiles(self, cam=None):
+        """p50 / p95 / p99 của từng đoạn trên TRACE_WINDOW span gần nhất"""
+        spans = self.recent(cam, len(self.spans))
+        out = {'spans': len(spans)}
+        for stage in self.STAGES + ('capture_to_server_ms',):
+            values = sorted(s[stage] for s in spans if stage in s)
+            if values:
+                out[stage] = {f'p{q}': values[min(len(values) - 1, len(values) * q // 100)] for q in (50, 95, 99)}
+        return out
+
+
+# Feed chung: frame mới nhất của bất kỳ camera nào (/stream, /latest, /events không cam)
+frame_store = FrameStore()
+scheduler = Scheduler(DETECT_WORKERS)
+tracer = Tracer()
+latest_tap = None  # Lần quẹt thẻ gắn với ảnh mới nhất (header từ ESP32-CAM)
+
+
+def find_faces(gray, min_size=30):
+    """Khung khuôn mặt (x, y, w, h) trong ảnh grayscale"""
+    if detector_pool is not None:
+        faces = detector_pool.detect(gray, min_size=min_size)
+        # Hàng đợi đầy (quá tải): tự chạy trong luồng này như khi chưa có pool
+        if faces is not None:
+            return faces
+    return face_cascade.detectMultiScale(
         gray,
         scaleFactor=1.1,
         minNeighbors=5,
-        minSize=(30, 30)
+        minSize=(min_size, min_size)
     )
-    
+
+
+def jpeg_size(jpeg):
+    """(w, h) đọc từ marker SOF của JPEG, None nếu không tìm thấy"""
+    i = 2
+    while i + 9 < len(jpeg):
+        if jpeg[i] != 0xFF:
+            return None
+        marker = jpeg[i + 1]
+        # SOF0..SOF15 trừ DHT (C4), JPG (C8), DAC (CC)
+        if 0xC0 <= marker <= 0xCF and marker not in (0xC4, 0xC8, 0xCC):
+            h, w = struct.unpack('>HH', jpeg[i + 5:i + 9])
+            return w, h
+        i += 2 + struct.unpack('>H', jpeg[i + 2:i + 4])[0]
+    return None
+
+
+def decode_jpeg(jpeg):
+    """Ảnh BGR đủ cỡ, None nếu JPEG hỏng; chỉ gọi khi thật sự cần màu (cắt mặt, vẽ khung)"""
+    return cv2.imdecode(np.frombuffer(jpeg, np.uint8), cv2.IMREAD_COLOR)
+
+
+def min_face_px(work_w):
+    """Cạnh mặt nhỏ nhất (px ở ảnh rộng work_w) của người đứng ở FACE_MAX_DISTANCE_M"""
+    focal = work_w / 2 / math.tan(math.radians(CAMERA_HFOV_DEG / 2))
+    return max(CASCADE_MIN_PX, int(focal * FACE_WIDTH_M / FACE_MAX_DISTANCE_M))
+
+
+def detection_gray(image, jpeg):
+    """
+    Ảnh gray để nhận diện, rộng tối đa DETECT_WIDTH.
+
+    Có sẵn ảnh BGR thì chuyển gray rồi thu nhỏ; không có (frame từ JPEG)
+    thì decode thẳng từ JPEG ra gray ở 1/2, 1/4 hoặc 1/8 bằng DCT của
+    libjpeg (IMREAD_REDUCED_GRAYSCALE_*): bỏ IDCT của phần lớn hệ số và cả
+    bước đổi màu, rẻ hơn nhiều so với decode BGR đủ cỡ.
+
+    Returns:
+        (gray, hệ số phóng về frame gốc, (w, h) frame gốc); gray None khi JPEG hỏng
+    """
+    if image is not None:
+        h, w = image.shape[:2]
+        gray = cv2.cvtColor(image, cv2.COLOR_BGR2GRAY)
+    else:
+        size = jpeg_size(jpeg) if jpeg else None
+        if size is None:
+            return None, 1, None
+        w, h = size
+        flag = cv2.IMREAD_GRAYSCALE
+        for factor, reduced in ((8, cv2.IMREAD_REDUCED_GRAYSCALE_8), (4, cv2.IMREAD_REDUCED_GRAYSCALE_4), (2, cv2.IMREAD_REDUCED_GRAYSCALE_2)):
+            if DETECT_WIDTH and w // factor >= DETECT_WIDTH:
+                flag = reduced
+                break
+        gray = cv2.imdecode(np.frombuffer(jpeg, np.uint8), flag)
+        if gray is None:
+            return None, 1, None
+    if DETECT_WIDTH and gray.shape[1] > DETECT_WIDTH:
+        work_h = max(1, gray.shape[0] * DETECT_WIDTH // gray.shape[1])
+        gray = cv2.resize(gray, (DETECT_WIDTH, work_h), interpolation=cv2.INTER_AREA)
+    return gray, w / gray.shape[1], (w, h)
+
+
+# Thời gian nhận diện (gray + thu nhỏ + Haar) cộng dồn, cho /status
+detect_stats = {'frames': 0, 'total_ms': 0.0}
+
+
+def draw_faces(image, faces, when=None):
+    """Vẽ khung hình chữ nhật, số khuôn mặt và timestamp (when, mặc định bây giờ) lên ảnh"""
     # Vẽ khung hình chữ nhật xung quanh mỗi khuôn mặt
     for (x, y, w, h) in faces:
         cv2.rectangle(image, (x, y), (x+w, y+h), (0, 255, 0), 2)
         cv2.putText(image, 'Face', (x, y-10), cv2.FONT_HERSHEY_SIMPLEX, 0.5, (0, 255, 0), 2)
     
     # Thêm thông tin số khuôn mặt và timestamp
-    timestamp = datetime.now().strftime("%Y-%m-%d %H:%M:%S")
+    timestamp = (datetime.fromtimestamp(when) if when else datetime.now()).strftime("%Y-%m-%d %H:%M:%S")
     cv2.putText(image, f'Faces: {len(faces)} | {timestamp}', (10, 30), 
                 cv2.FONT_HERSHEY_SIMPLEX, 0.7, (0, 255, 255), 2)
+    return image
+
+
+def detect_faces(image, jpeg=None, draw=True):
+    """
+    Nhận diện khuôn mặt trong ảnh và vẽ khung hình chữ nhật
+    
+    Args:
+        image: numpy array của ảnh (BGR format); None thì decode thu nhỏ từ jpeg
+        draw: False thì không vẽ (pass-through: trang web tự vẽ khung)
+    
+    Returns:
+        image: ảnh đã vẽ khung hình (chính image khi draw=False)
+        faces: danh sách khung (x, y, w, h) trên frame gốc
+        detect_ms: thời gian ra gray, thu nhỏ và chạy Haar
+        size: (w, h) frame gốc
+    """
+    t0 = time.perf_counter()
+    # Chuyển sang grayscale (cỡ làm việc) để nhận diện
+    gray, scale, size = detection_gray(image, jpeg)
+    if gray is None:
+        raise ValueError('Could not decode image')
+    
+    # Nhận diện khuôn mặt rồi phóng khung về frame gốc
+    min_size = min_face_px(gray.shape[1]) if DETECT_WIDTH else 30
+    faces = [(int(x * scale), int(y * scale), int(w * scale), int(h * scale)) for (x, y, w, h) in find_faces(gray, min_size)]
+    detect_ms = (time.perf_counter() - t0) * 1000
+    detect_stats['frames'] += 1
+    detect_stats['total_ms'] += detect_ms
     
-    return image, len(faces)
+    if not draw or image is None:
+        return image, faces, detect_ms, size
+    # Vẽ lên bản sao: ảnh gốc vẫn được giữ trong frame_store
+    return draw_faces(image.copy(), faces), faces, detect_ms, size
+
+
+class EmbedRequest:
+    """Các ô mặt 112x112 của 1 frame chờ lượt forward; out (số mặt, DIM) khi done"""
+    __slots__ = ('crops', 'urgent', 'queued', 'out', 'error', 'done')
+
+    def __init__(self, crops, urgent):
+        self.crops = crops
+        self.urgent = urgent
+        self.queued = time.monotonic()
+        self.out = None
+        self.error = None
+        self.done = threading.Event()
+
+
+class EmbedBatcher:
+    """
+    Embedding SFace theo lô cho mọi camera. Luồng nhận diện của từng camera
+    gửi ô mặt vào đây rồi chờ; 1 luồng riêng gom các ô tới khi đủ max_batch
+    mặt hoặc mặt đầu tiên đã chờ max_wait_ms, chạy 1 lần net.forward cho cả
+    lô rồi trả từng phần về đúng frame. Nhiều camera cùng có mặt thì chi
+    phí mỗi mặt giảm (1 lần setInput / forward, GEMM to hơn); 1 camera lẻ
+    chỉ tốn thêm tối đa max_wait_ms. Yêu cầu urgent (verify 1:1 theo lần
+    quẹt thẻ, có VERIFY_BUDGET_MS) thì chạy lô ngay, không chờ.
+
+    Model ONNX cố định batch 1 thì forward từng ô trong luồng này (vẫn chung
+    1 Net), probe() kiểm tra lúc khởi động.
+    """
+    WAIT_BUCKETS_MS = (1, 2, 5, 10, 20, 50)
+
+    def __init__(self, model_path, dim, max_batch, max_wait_ms):
+        self.net = cv2.dnn.readNet(model_path)
+        self.dim = dim
+        self.max_batch = max_batch
+        self.max_wait = max_wait_ms / 1000
+        self.cond = threading.Condition()
+        self.pending = collections.deque()
+        self.pending_faces = 0
+        self.batched = self.probe()
+        self.sizes = collections.Counter()                   # số mặt mỗi lượt forward -> số lượt
+        self.waits = [0] * (len(self.WAIT_BUCKETS_MS) + 1)   # thời gian chờ tới lượt, theo frame
+        self.forwards = 0
+        self.forward_ms = 0.0
+        threading.Thread(target=self.run, name='embed-batch', daemon=True).start()
+
+    def probe(self):
+        """Model nhận được batch > 1 không"""
+        try:
+            return self.forward_batch([np.zeros((112, 112, 3), np.uint8)] * 2).shape[0] == 2
+        except cv2.error:
+            print("⚠️ SFace model has a fixed batch size: embedding one face per forward")
+            return False
+
+    def forward_batch(self, crops):
+        # Giống FaceRecognizerSF.feature: BGR -> RGB, không trừ mean, không scale
+        self.net.setInput(cv2.dnn.blobFromImages(crops, 1.0, (112, 112), (0, 0, 0), swapRB=True, crop=False))
+        return self.net.forward().reshape(len(crops), -1)[:, :self.dim]
+
+    def forward(self, crops):
+        if self.batched:
+            return self.forward_batch(crops)
+        return np.vstack([self.forward_batch([c]) for c in crops])
+
+    def embed(self, crops, urgent=False):
+        """Embedding (len(crops), dim), chặn tới khi lô chứa crops chạy xong"""
+        req = EmbedRequest(crops, urgent)
+        with self.cond:
+            self.pending.append(req)
+            self.pending_faces += len(crops)
+            self.cond.notify()
+        req.done.wait()
+        if req.error is not None:
+            raise req.error
+        return req.out
+
+    def take(self):
+        """Lô kế tiếp: chờ đủ mặt, hết hạn của yêu cầu đầu, hoặc có yêu cầu urgent"""
+        with self.cond:
+            while not self.pending:
+                self.cond.wait()
+            deadline = self.pending[0].queued + self.max_wait
+            while self.pending_faces < self.max_batch and not any(r.urgent for r in self.pending):
+                left = deadline - time.monotonic()
+                if left <= 0:
+                    break
+                self.cond.wait(left)
+            batch, faces = [], 0
+            # 1 frame nhiều mặt hơn max_batch vẫn đi trọn 1 lô
+            while self.pending and (not batch or faces + len(self.pending[0].crops) <= self.max_batch):
+                req = self.pending.popleft()
+                batch.append(req)
+                faces += len(req.crops)
+            self.pending_faces -= faces
+        return batch
+
+    def run(self):
+        while True:
+            batch = self.take()
+            t0 = time.monotonic()
+            for req in batch:
+                wait_ms = (t0 - req.queued) * 1000
+                self.waits[next((i for i, b in enumerate(self.WAIT_BUCKETS_MS) if wait_ms < b), len(self.WAIT_BUCKETS_MS))] += 1
+            crops = [c for req in batch for c in req.crops]
+            try:
+                out = self.forward(crops)
+                i = 0
+                for req in batch:
+                    req.out = out[i:i + len(req.crops)]
+                    i += len(req.crops)
+            except Exception as e:
+                for req in batch:
+                    req.error = e
+            self.forward_ms += (time.monotonic() - t0) * 1000
+            self.forwards += 1
+            self.sizes[len(crops)] += 1
+            for req in batch:
+                req.done.set()
+
+    def stats(self):
+        """Histogram số mặt mỗi lô và thời gian chờ lô, để chỉnh EMBED_BATCH / EMBED_WAIT_MS"""
+        labels = [f'<{b}ms' for b in self.WAIT_BUCKETS_MS] + [f'>={self.WAIT_BUCKETS_MS[-1]}ms']
+        return {
+            'max_batch': self.max_batch,
+            'max_wait_ms': self.max_wait * 1000,
+            'batched': self.batched,
+            'forwards': self.forwards,
+            'avg_forward_ms': round(self.forward_ms / max(self.forwards, 1), 2),
+            'batch_sizes': {str(n): c for n, c in sorted(self.sizes.items())},
+            'wait_ms': dict(zip(labels, self.waits)),
+        }
+
+
+class FaceIdentifier:
+    """
+    Embedding SFace cho từng khung mặt và chỉ mục embedding của sinh viên đã
+    đăng ký (face_index.py). 1 sinh viên (thường là UID thẻ) có thể đăng ký
+    nhiều ảnh: các dòng cùng label trong chỉ mục. Đăng ký ghi lại ENROLL_PATH
+    để lần chạy sau nạp lại.
+
+    Cả trường đăng ký trước bằng tools/enroll_build.py nằm ở mapped (file
+    ENROLL_INDEX mmap chỉ đọc, label riêng của nó); index chỉ giữ các lần
+    /enroll lúc chạy. Tìm / verify xét cả hai.
+    """
+    DIM = 128
+
+    def __init__(self, model_path, enroll_path, mapped_path=None):
+        self.model_path = model_path
+        self.path = enroll_path
+        self.mapped = face_index.open_mapped(mapped_path, self.DIM) if mapped_path and os.path.exists(mapped_path) else None
+        self.index = face_index.load(self.DIM)
+        self.local = threading.local()     # 1 mạng DNN mỗi luồng: cv2.dnn không chạy song song trên 1 Net
+        # Gom lô thì chỉ luồng của EmbedBatcher chạy mạng, các luồng khác không tạo Net riêng
+        self.batcher = EmbedBatcher(model_path, self.DIM, EMBED_BATCH, EMBED_WAIT_MS) if EMBED_BATCH > 1 else None
+        self.lock = threading.Lock()
+        self.students = []                 # label -> sinh viên
+        self.labels = {}                   # sinh viên -> label
+        self.samples = []                  # (label, embedding), để ghi ra file
+        self.templates = {}                # label -> ma trận embedding đã chuẩn hoá, cho verify 1:1
+        self.searches = 0
+        self.search_ms = 0.0
+        self.verifies = 0
+        self.verify_ms = 0.0
+        self.over_budget = 0
+        if os.path.exists(enroll_path):
+            data = np.load(enroll_path)
+            for label, vec in zip(data['labels'], data['vectors']):
+                self.add(str(data['students'][label]), vec, save=False)
+
+    def recognizer(self):
+        if getattr(self.local, 'net', None) is None:
+            self.local.net = cv2.FaceRecognizerSF.create(self.model_path, '')
+        return self.local.net
+
+    def embed(self, image, faces, urgent=False):
+        """Embedding (số mặt, DIM) của các khung trên ảnh BGR; urgent: không chờ gom lô"""
+        h, w = image.shape[:2]
+        crops = []
+        for (x, y, fw, fh) in faces:
+            x0, y0 = max(0, int(x)), max(0, int(y))
+            # Khung Haar không có 5 điểm mốc để alignCrop: đưa thẳng về cỡ 112x112 của SFace
+            crops.append(cv2.resize(image[y0:min(h, int(y + fh)), x0:min(w, int(x + fw))], (112, 112)))
+        if self.batcher is not None:
+            return self.batcher.embed(crops, urgent)
+        net = self.recognizer()
+        out = np.empty((len(faces), self.DIM), np.float32)
+        for i, crop in enumerate(crops):
+            out[i] = net.feature(crop).reshape(-1)[:self.DIM]
+        return out
+
+    def search(self, vectors):
+        """Mỗi vector 1 (sinh viên, score) giống nhất trong file mmap lẫn các lần /enroll"""
+        best = [(None, -1.0)] * len(vectors)
+        for index, student in ((self.mapped, lambda l: self.mapped.student(l)[0]), (self.index, lambda l: self.students[l])):
+            if index is None or not len(index):
+                continue
+            labels, scores = index.search(vectors, k=1)
+            best = [(student(label[0]), float(score[0])) if label[0] >= 0 and score[0] > b[1] else b
+                    for label, score, b in zip(labels, scores, best)]
+        return best
+
+    def student_id(self, student):
+        """Mã sinh viên của UID trong file đăng ký, None nếu không có"""
+        label = self.mapped.find(student) if self.mapped is not None else None
+        if label is None:
+            return None
+        return self.mapped.student(label)[1] or None
+
+    def identify(self, image, faces):
+        """Mỗi khung 1 {'student', 'score'[, 'student_id']} (None khi không ai đủ giống), cùng 1 lượt tìm"""
+        if not faces or not (len(self.index) or (self.mapped is not None and len(self.mapped))):
+            return [None] * len(faces)
+        vectors = self.embed(image, faces)
+        t0 = time.perf_counter()
+        best = self.search(vectors)
+        self.search_ms += (time.perf_counter() - t0) * 1000
+        self.searches += 1
+        out = []
+        for student, score in best:
+            if student is None or score < FACE_MATCH_SCORE:
+                out.append(None)
+                continue
+            match = {'student': student, 'score': round(score, 3)}
+            sid = self.student_id(student)
+            if sid:
+                match['student_id'] = sid
+            out.append(match)
+        return out
+
+    def templates_of(self, student):
+        """Các embedding đăng ký (đã chuẩn hoá) của 1 sinh viên trong file mmap và /enroll, None nếu chưa đăng ký"""
+        parts = [self.templates.get(self.labels.get(student))]
+        label = self.mapped.find(student) if self.mapped is not None else None
+        if label is not None:
+            parts.append(self.mapped.templates(label))
+        parts = [p for p in parts if p is not None and len(p)]
+        return np.vstack(parts) if parts else None
+
+    def verify(self, image, faces, student, t0):
+        """
+        1:1: mặt lớn nhất (người vừa quẹt đứng gần camera nhất) so với các ảnh
+        đăng ký của student; t0 (perf_counter) là mốc tính VERIFY_BUDGET_MS
+        """
+        templates = self.templates_of(student)
+        if templates is None:
+            decision, score = 'not_enrolled', None
+        elif not faces:
+            decision, score = 'no_face', None
+        else:
+            face = max(faces, key=lambda f: f[2] * f[3])
+            vec = self.embed(image, [face], urgent=True)[0]
+            score = float(np.max(templates @ (vec / max(np.linalg.norm(vec), 1e-12))))
+            decision = 'grant' if score >= FACE_MATCH_SCORE else 'deny'
+        ms = (time.perf_counter() - t0) * 1000
+        self.verifies += 1
+        self.verify_ms += ms
+        if ms > VERIFY_BUDGET_MS:
+            self.over_budget += 1
+            print(f"⚠️ Verify {student}: {ms:.1f} ms > {VERIFY_BUDGET_MS:.0f} ms budget")
+        return {'student': student, 'decision': decision, 'score': None if score is None else round(score, 3),
+                'verify_ms': round(ms, 1), 'over_budget': ms > VERIFY_BUDGET_MS}
+
+    def add(self, student, vec, save=True):
+        with self.lock:
+            label = self.labels.get(student)
+            if label is None:
+                label = self.labels[student] = len(self.students)
+                self.students.append(student)
+            self.index.add(label, vec)
+            vec = np.asarray(vec, np.float32).reshape(self.DIM)
+            self.samples.append((label, vec))
+            unit = (vec / np.linalg.norm(vec))[np.newaxis]
+            # Thay cả mảng (không sửa tại chỗ): verify đang chạy vẫn đọc bản cũ trọn vẹn
+            old = self.templates.get(label)
+            self.templates[label] = unit if old is None else np.vstack([old, unit])
+            if save:
+                np.savez(self.path, students=np.array(self.students), labels=np.array([l for l, _ in self.samples]),
+                         vectors=np.stack([v for _, v in self.samples]))
+            return sum(1 for l, _ in self.samples if l == label)
+
+    def stats(self):
+        mapped = self.mapped
+        return {
+            'mapped': {'path': mapped.path, 'kind': mapped.kind, 'students': len(mapped.students), 'samples': len(mapped),
+                       'bytes': mapped.memory()} if mapped is not None else None,
+            'kind': self.index.kind,
+            'students': len(self.students),
+            'samples': len(self.index),
+            'memory': self.index.memory(),
+            'searches': self.searches,
+            'avg_search_ms': round(self.search_ms / max(self.searches, 1), 3),
+            'verifies': self.verifies,
+            'avg_verify_ms': round(self.verify_ms / max(self.verifies, 1), 1),
+            'verify_budget_ms': VERIFY_BUDGET_MS,
+            'over_budget': self.over_budget,
+            'batch': self.batcher.stats() if self.batcher else None,
+        }
+
+
+# Chưa có file model SFace (hoặc OpenCV < 4.5.4) thì chỉ đếm mặt như trước
+identifier = None
+if os.path.exists(FACE_MODEL) and hasattr(cv2, 'FaceRecognizerSF'):
+    identifier = FaceIdentifier(FACE_MODEL, ENROLL_PATH, ENROLL_INDEX)
+    print(f"✅ Face identification: {identifier.stats()['students']} enrolled student(s), {identifier.index.kind} index")
+    if identifier.mapped is not None:
+        print(f"✅ Enrolment index {ENROLL_INDEX}: {len(identifier.mapped.students)} student(s) mapped ({identifier.mapped.kind})")
+
+
+def identify_faces(image, jpeg, faces, tap):
+    """
+    (identities, verification). Frame gắn lần quẹt thẻ: server đã biết người
+    đó nhận là ai, nên chỉ verify 1:1 với UID thẻ (grant/deny, xem
+    FaceIdentifier.verify). Không quẹt: tìm 1:N, mỗi khung mặt 1 sinh viên
+    nhận ra được hoặc None. (None, None) khi không nhận dạng
+    """
+    t0 = time.perf_counter()
+    uid = tap['uid'] if tap is not None else None
+    if identifier is None or not (len(faces) or uid):
+        return None, None
+    if image is None and len(faces):
+        # Chỉ frame có mặt mới decode đủ cỡ để cắt
+        image = decode_jpeg(jpeg)
+        if image is None:
+            return None, None
+    if uid:
+        return None, identifier.verify(image, faces, uid, t0)
+    return identifier.identify(image, faces), None
+
+
+def read_tap(headers, recv_us):
+    """Lần quẹt thẻ gắn với frame (header X-Card-UID...), None nếu không có"""
+    global latest_tap
+
+    # Ảnh chụp theo lần quẹt thẻ: STM32 -> ESP32-CAM -> header
+    tap = None
+    if 'X-Card-UID' in headers:
+        tap = {
+            'uid': headers.get('X-Card-UID'),
+            'seq': headers.get('X-Tap-Seq', type=int),
+            'reader': headers.get('X-Reader'),
+            'decision': headers.get('X-Decision'),
+            'tap_us': headers.get('X-Tap-Time', type=int),
+            'frame_us': headers.get('X-Frame-Time', type=int),
+            'recv_us': recv_us,
+        }
+        # Cùng mốc epoch: độ trễ quẹt -> chụp và chụp -> server
+        if tap['tap_us'] and tap['frame_us']:
+            tap['tap_to_frame_ms'] = (tap['frame_us'] - tap['tap_us']) / 1000
+        if tap['frame_us']:
+            tap['frame_to_server_ms'] = (recv_us - tap['frame_us']) / 1000
+        print(f"🪪 Tap #{tap['seq']} {tap['reader']} UID {tap['uid']} -> {tap['decision']}"
+              f" (tap->frame {tap.get('tap_to_frame_ms')} ms, frame->server {tap.get('frame_to_server_ms')} ms)")
+    latest_tap = tap
+    return tap
+
+
+def read_trigger(headers, recv_us):
+    """Lý do ảnh được chụp (X-Trigger...), None với ảnh không có header này"""
+    source = headers.get('X-Trigger')
+    if not source:
+        return None
+    trigger = {
+        'source': source,
+        'id': headers.get('X-Trigger-Id', type=int),
+        'burst': headers.get('X-Burst'),
+        'burst_score': headers.get('X-Burst-Score', type=int),   # Có khi ESP32 chỉ gửi ảnh tốt nhất của loạt
+        'trigger_us': headers.get('X-Trigger-Time', type=int),
+    }
+    if trigger['trigger_us']:
+        trigger['trigger_to_server_ms'] = (recv_us - trigger['trigger_us']) / 1000
+    # Lệnh chụp từ server: đo cả vòng POST /trigger -> ảnh tới
+    sent_us = trigger_hub.sent.get(trigger['id']) if source == 'server' and trigger_hub else None
+    if sent_us:
+        trigger['push_to_server_ms'] = (recv_us - sent_us) / 1000
+    return trigger
+
+
+def read_device_faces(headers):
+    """(X-Face-Count, danh sách khung X-Faces); (None, None) khi ESP32 không nhận diện"""
+    # ESP32 đã nhận diện trên thiết bị (X-Face-Count, khung trong X-Faces
+    # "x,y,w,h,score[,id];..."): frame không có mặt thì khỏi chạy Haar
+    device_faces = headers.get('X-Face-Count', type=int)
+    device_boxes = None
+    if device_faces is not None:
+        device_boxes = []
+        for box in (headers.get('X-Faces') or '').split(';'):
+            v = box.split(',')
+            if len(v) in (5, 6):
+                x, y, w, h, score = (int(n) for n in v[:5])
+                face = {'x': x, 'y': y, 'w': w, 'h': h, 'score': score}
+                # Trường thứ 6: id bám theo của ESP32, cùng 1 mặt qua các frame
+                if len(v) == 6:
+                    face['id'] = int(v[5])
+                device_boxes.append(face)
+    return device_faces, device_boxes
+
+
+def process_frame(channel, image, headers, recv_us, jpeg=None, span=None):
+    """
+    Xử lý 1 frame đã decode: lưu frame, gắn lần quẹt thẻ (header X-*),
+    nhận diện khuôn mặt. Dùng chung cho /upload và luồng ingest TCP.
+
+    Args:
+        channel: camera gửi frame (Scheduler.channel)
+        image: ảnh đã decode; None thì nhận diện trên gray decode thu nhỏ từ
+            jpeg, ảnh màu chỉ decode khi cần cắt mặt hoặc có viewer cần ảnh đã vẽ
+        jpeg: bytes JPEG gốc của frame, giữ kèm trong frame_store (/latest?raw=1)
+        span: Tracer.start() của frame, None thì bắt đầu đo từ đây
+
+    Returns:
+        dict kết quả, giống JSON trả về của /upload
+    """
+    if span is None:
+        span = tracer.start(channel, headers, recv_us)
+    tap = channel.tap = read_tap(headers, recv_us)
+    trigger = read_trigger(headers, recv_us)
+    device_faces, device_boxes = read_device_faces(headers)
+
+    # Nhận diện khuôn mặt
+    if device_faces == 0:
+        faces, detect_ms = [], 0
+        size = (image.shape[1], image.shape[0]) if image is not None else jpeg_size(jpeg)
+        if size is None:
+            raise ValueError('Could not decode image')
+    else:
+        # Không vẽ ở đây: Frame vẽ lúc có viewer cần (pass-through thì không bao giờ)
+        _, faces, detect_ms, size = detect_faces(image, jpeg, draw=False)
+    faces_count = len(faces)
+    tracer.stage(span, 'detect_ms')
+    if image is None and identifier is not None and faces_count:
+        # Màu đủ cỡ chỉ để cắt mặt cho embedding; Frame dùng lại ảnh này để vẽ
+        image = decode_jpeg(jpeg)
+        if image is None:
+            raise ValueError('Could not decode image')
+        tracer.stage(span, 'decode_ms')
+    # ESP32 đã grant từ cache của nó: khỏi verify lại; miss / deny thì server verify
+    edge = edge_templates.report(headers) if tap else None
+    verification = edge_verify(channel, tap, edge)
+    if verification is not None:
+        identities = None
+    else:
+        identities, verification = identify_faces(image, jpeg, faces, tap)
+        if tap:
+            edge_learn(channel, tap, headers, verification)
+    tracer.stage(span, 'identify_ms')
+    tracer.finish(span)
+    channel.publish(jpeg, image, None, faces, size, span)
+    if archive is not None:
+        # Frame ghép từ ô cắt (process_tiles) không có JPEG đủ khung: không lưu
+        archive.append(channel.cam, jpeg, recv_us, tap['seq'] if tap else None, faces_count)
+
+    return {
+        'status': 'success',
+        'camera': channel.cam,
+        'faces_detected': faces_count,
+        'faces': [{'x': int(x), 'y': int(y), 'w': int(w), 'h': int(h)} for (x, y, w, h) in faces],
+        'device_faces': device_boxes,
+        'identities': identities,
+        'verification': verification,
+        'edge': edge,
+        'haar_skipped': device_faces == 0,
+        'detect_ms': round(detect_ms, 1),
+        'tap': tap,
+        'trigger': trigger,
+        'trace': span,
+        'server_ms': (time.time_ns() // 1000 - recv_us) // 1000,
+        'message': f'Detected {faces_count} face(s)'
+    }
+
+
+def process_jpeg(channel, jpeg, headers, recv_us):
+    """
+    process_frame cho 1 JPEG: nhận diện trên gray decode thu nhỏ (detection_gray),
+    không decode màu đủ cỡ trước; ValueError khi JPEG hỏng
+    """
+    return process_frame(channel, None, headers, recv_us, jpeg)
+
+
+def process_tiles(channel, tiles, headers, recv_us):
+    """
+    Xử lý 1 frame gửi dạng ô cắt (USE_FACE_TILES trong CameraWebServer.ino):
+    mỗi ô mặt là 1 vùng (X-Crop) của frame X-Frame-Size, Haar chạy trên từng
+    ô rồi cộng thêm toạ độ cắt để ra khung trên frame gốc. Ảnh hiển thị là
+    ảnh nền mới nhất với các ô mặt dán đè lên.
+
+    Args:
+        tiles: danh sách (kind, (x, y, w, h), JPEG) theo thứ tự X-Tile
+    """
+    frame_w, _, frame_h = (headers.get('X-Frame-Size') or '').partition('x')
+    size = (int(frame_w), int(frame_h))
+    span = tracer.start(channel, headers, recv_us)
+    tiles = [(kind, crop, cv2.imdecode(np.frombuffer(data, np.uint8), cv2.IMREAD_COLOR)) for kind, crop, data in tiles]
+    tiles = [t for t in tiles if t[2] is not None]
+    canvas = channel.context
+    for kind, crop, tile in tiles:
+        if kind == 'context':
+            canvas = cv2.resize(tile, size)
+            channel.context, channel.context_time = canvas.copy(), time.time()
+    if canvas is None or (canvas.shape[1], canvas.shape[0]) != size:
+        canvas = np.zeros((size[1], size[0], 3), np.uint8)
+    else:
+        canvas = canvas.copy()
+    tracer.stage(span, 'decode_ms')
+
+    tap = channel.tap = read_tap(headers, recv_us)
+    device_faces, device_boxes = read_device_faces(headers)
+
+    faces = []
+    for kind, (x, y, w, h), tile in tiles:
+        if kind != 'face':
+            continue
+        tile = tile[:h, :w]
+        canvas[y:y + tile.shape[0], x:x + tile.shape[1]] = tile
+        for (fx, fy, fw, fh) in find_faces(cv2.cvtColor(tile, cv2.COLOR_BGR2GRAY)):
+            faces.append((x + int(fx), y + int(fy), int(fw), int(fh)))
+    tracer.stage(span, 'detect_ms')
+
+    identities, verification = identify_faces(canvas, None, faces, tap)
+    detected_image = draw_faces(canvas.copy(), faces)
+    tracer.stage(span, 'identify_ms')
+    tracer.finish(span)
+    channel.publish(None, canvas, detected_image, faces, size, span)
+
+    return {
+        'status': 'success',
+        'camera': channel.cam,
+        'faces_detected': len(faces),
+        'faces': [{'x': x, 'y': y, 'w': w, 'h': h} for (x, y, w, h) in faces],
+        'device_faces': device_boxes,
+        'identities': identities,
+        'verification': verification,
+        'haar_skipped': False,
+        'tiles': len(tiles),
+        'want_context': channel.context is None or time.time() - channel.context_time > CONTEXT_MAX_AGE,
+        'tap': tap,
+        'trace': span,
+        'server_ms': (time.time_ns() // 1000 - recv_us) // 1000,
+        'message': f'Detected {len(faces)} face(s) in {len(tiles)} tile(s)'
+    }
+
+
+class IngestHandler(socketserver.StreamRequestHandler):
+    """
+    Luồng ingest: ESP32-CAM giữ 1 kết nối TCP và gửi frame nối tiếp nhau,
+    mỗi frame có header kiểu part của multipart (như _STREAM_PART trong
+    CameraWebServer/app_httpd.cpp):
+
+        --frame\r\n
+        Content-Type: image/jpeg\r\n
+        Content-Length: N\r\n
+        X-Seq: S\r\n
+        X-...: (cùng header X-* như /upload)\r\n
+        \r\n
+        <N byte JPEG>
+
+    Frame gửi dạng ô cắt thì mỗi ô là 1 part cùng X-Seq, thêm X-Tile: i/n,
+    X-Tile-Kind: face|context, X-Crop: x,y,w,h và X-Frame-Size: WxH; server
+    gom đủ n ô rồi xử lý 1 lần (process_tiles).
+
+    Mỗi frame xử lý xong server ghi lại 1 dòng JSON (kết quả như /upload,
+    thêm 'seq'). ESP32 không chờ ACK mới gửi frame sau, nên mỗi frame bớt
+    được 1 round trip so với POST.
+
+    Frame không xử lý ngay trong luồng này mà vào hàng đợi của camera
+    (X-Camera-Id, xem Scheduler); luồng này đọc tiếp, ACK do worker ghi khi
+    xong. Hàng đợi đầy thì frame cũ nhất ACK 'dropped': ESP32 gửi nhanh hơn
+    server xử lý chỉ mất frame của chính nó.
+    """
+
+    def ack(self, seq, result):
+        result['seq'] = seq
+        with self.ack_lock:
+            self.wfile.write((json.dumps(result) + '\n').encode())
+
+    def read_part_headers(self):
+        """Header của part tiếp theo, None khi kết nối đóng"""
+        line = self.rfile.readline()
+        while line in (b'\r\n', b'\n'):
+            line = self.rfile.readline()
+        if not line:
+            return None
+        if not line.startswith(b'--'):
+            raise ValueError(f'expected boundary, got {line[:40]!r}')
+        headers = Headers()
+        while True:
+            line = self.rfile.readline()
+            if not line:
+                return None
+            line = line.strip()
+            if not line:
+                return headers
+            key, _, value = line.decode('latin-1').partition(':')
+            headers.add(key.strip(), value.strip())
+
+    def handle(self):
+        peer = '%s:%d' % self.client_address
+        print(f"📥 Ingest stream from {peer}")
+        self.ack_lock = threading.Lock()
+        frames = 0
+        tiles_seq, tiles = None, []
+        try:
+            while True:
+                headers = self.read_part_headers()
+                if headers is None:
+                    break
+                length = headers.get('Content-Length', type=int)
+                if length is None:
+                    raise ValueError('part without Content-Length')
+                data = self.rfile.read(length)
+                if len(data) < length:
+                    break
+                recv_us = time.time_ns() // 1000
+                seq = headers.get('X-Seq', type=int)
+                channel = scheduler.channel(headers, self.client_address[0])
+                tile = headers.get('X-Tile')
+                if tile:
+                    # Ô cắt: gom theo X-Seq, đủ ô cuối mới xử lý và ACK
+                    if seq != tiles_seq:
+                        tiles_seq, tiles = seq, []
+                    crop = tuple(int(n) for n in headers.get('X-Crop', '0,0,0,0').split(','))
+                    tiles.append((headers.get('X-Tile-Kind'), crop, data))
+                    i, _, n = tile.partition('/')
+                    if int(i) < int(n) - 1:
+                        continue
+                    tiles_seq = None
+                    fn = lambda c=channel, t=tiles, h=headers, r=recv_us: process_tiles(c, t, h, r)
+                else:
+                    fn = lambda c=channel, d=data, h=headers, r=recv_us: process_jpeg(c, d, h, r)
+                scheduler.submit(channel, fn, lambda result, s=seq: self.ack(s, result))
+                frames += 1
+        except (ValueError, OSError) as e:
+            print(f"❌ Ingest {peer}: {e}")
+        print(f"📥 Ingest stream from {peer} closed after {frames} frame(s)")
+
+
+class IngestServer(socketserver.ThreadingTCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+def start_ingest_server(port=INGEST_PORT):
+    server = IngestServer(('0.0.0.0', port), IngestHandler)
+    threading.Thread(target=server.serve_forever, name='ingest', daemon=True).start()
+    return server
+
+
+def upload_status(job):
+    """Mã HTTP của /upload cho 1 job đã xong"""
+    if job.result['status'] == 'dropped':
+        return 503
+    if job.error is not None:
+        return 400 if isinstance(job.error, ValueError) else 500
+    return 200
+
+
+class GatewayDispatcher:
+    """
+    Frame từ gateway C++ (ingest_gw.py) vào Scheduler. Luồng này chỉ dựng
+    Headers, gom ô cắt theo kết nối rồi submit; decode và nhận diện vẫn ở
+    worker của Scheduler như frame của Flask và IngestHandler. Worker xong
+    thì trả lời qua gateway: /upload cùng mã HTTP với upload_image (không có
+    504: hàng đợi mỗi camera chỉ CHANNEL_QUEUE frame, frame chờ lâu bị bỏ
+    thành 503), luồng ingest cùng dòng ACK có 'seq' như IngestHandler.
+
+    1 luồng là đủ: mỗi frame ở đây chỉ mất vài chục µs, và ô cắt của 1 kết
+    nối phải đi đúng thứ tự.
+    """
+
+    def __init__(self, gateway):
+        self.gateway = gateway
+        self.tiles = {}     # kết nối -> (X-Seq, [(kind, crop, JPEG)])
+
+    def run(self):
+        while True:
+            frame = self.gateway.next(1000)
+            if frame is None:
+                continue
+            try:
+                self.dispatch(frame)
+            except Exception as e:
+                # ValueError: X-Tile / X-Crop / X-Seq hỏng; lỗi khác không được làm chết luồng này
+                self.tiles.pop(frame.conn, None)
+                self.gateway.reply(frame, 400 if isinstance(e, ValueError) else 500, {'status': 'error', 'message': str(e)})
+
+    def dispatch(self, frame):
+        headers = Headers(frame.headers)
+        channel = scheduler.channel(headers, frame.peer)
+        if frame.kind == ingest_gw.IG_UPLOAD:
+            if not frame.body:
+                self.gateway.reply(frame, 400, {'status': 'error', 'message': 'Could not decode image'})
+                return
+            job = Job(lambda c=channel, d=frame.body, h=headers, r=frame.recv_us: process_jpeg(c, d, h, r))
+            job.done = lambda result, j=job: self.gateway.reply(frame, upload_status(j), result)
+            scheduler.enqueue(channel, job)
+            return
+        seq = headers.get('X-Seq', type=int)
+        tile = headers.get('X-Tile')
+        if tile:
+            # Ô cắt: gom theo X-Seq như IngestHandler, ô chưa phải ô cuối không ACK
+            tiles_seq, tiles = self.tiles.get(frame.conn, (None, []))
+            if seq != tiles_seq:
+                tiles = []
+            crop = tuple(int(n) for n in headers.get('X-Crop', '0,0,0,0').split(','))
+            tiles.append((headers.get('X-Tile-Kind'), crop, frame.body))
+            i, _, n = tile.partition('/')
+            if int(i) < int(n) - 1:
+                self.tiles[frame.conn] = (seq, tiles)
+                if len(self.tiles) > 64:
+                    # Bộ ô của kết nối đã đóng giữa chừng: bỏ bộ cũ nhất
+                    self.tiles.pop(next(iter(self.tiles)))
+                self.gateway.release(frame)
+                return
+            self.tiles.pop(frame.conn, None)
+            fn = lambda c=channel, t=tiles, h=headers, r=frame.recv_us: process_tiles(c, t, h, r)
+        else:
+            fn = lambda c=channel, d=frame.body, h=headers, r=frame.recv_us: process_jpeg(c, d, h, r)
+        scheduler.submit(channel, fn, lambda result: self.gateway.reply(frame, 200, dict(result, seq=seq)))
+
+
+gateway = None
+
+
+def start_gateway():
+    """Gateway C++ cho /upload (GATEWAY_PORT) và luồng ingest; None khi chưa build thư viện"""
+    global gateway
+    gateway = ingest_gw.load(GATEWAY_PORT, INGEST_PORT, queue=GATEWAY_QUEUE)
+    if gateway is not None:
+        threading.Thread(target=GatewayDispatcher(gateway).run, name='gateway', daemon=True).start()
+        print(f"✅ Native ingest gateway: /upload on {GATEWAY_PORT or 'off'}, stream on {INGEST_PORT}")
+    return gateway
+
+
+# Gói UDP, khớp UdpFragHdr / UdpStats trong CameraWebServer.ino
+UDP_MAGIC = 0xCF
+UDP_FRAG_HDR = struct.Struct('<BBHHHIIbbBB')  # magic, type, frag, frags, len, frame id, frame len, motion, faces, version, -
+UDP_STATS_PKT = struct.Struct('<BBHIII')      # magic, type, server_ms, frame id, complete, dropped
+UDP_NACK_HDR = struct.Struct('<BBIH')         # magic, type, frame id, số mảnh; tiếp theo là chỉ số mảnh u16
+
+
+class EdgeTemplates:
+    """
+    Template cho cache verify ở cửa. ESP32 tự verify lần quẹt có UID trong cache
+    của nó (LRU trong PSRAM) và báo kết quả qua header X-Edge-*; UID chưa có
+    (miss) hoặc mặt không khớp thì server verify như thường. Lần đó server
+    grant thì embedding ESP32 gửi kèm (X-Edge-Embedding, base64 int8 đã chuẩn
+    hoá) thành template mới của UID, đẩy xuống mọi cửa đang nối. Cửa vừa nối
+    (HELLO) nhận trước các UID hay quẹt ở chính nó, rồi tới UID quẹt gần đây
+    ở cửa khác.
+    """
+
+    def __init__(self, limit=EDGE_TEMPLATES):
+        self.limit = limit
+        self.lock = threading.Lock()
+        self.entries = collections.OrderedDict()   # uid -> {'vec': base64, 'dim', 'seen': {cam: epoch s}}, cũ trước
+        self.learned = 0
+        self.pushed = 0
+        self.reports = collections.Counter()       # hit / miss / no_face
+        self.decisions = collections.Counter()     # grant / deny của lần hit
+        self.local_ms = 0.0
+        self.hit_ms = 0.0
+
+    def learn(self, uid, cam, b64):
+        """Template mới của uid (sau khi server grant); số chiều, None nếu embedding hỏng"""
+        try:
+            dim = len(base64.b64decode(b64, validate=True))
+        except ValueError:
+            return None
+        if not dim:
+            return None
+        with self.lock:
+            e = self.entries.pop(uid, None) or {'seen': {}}
+            e['vec'], e['dim'] = b64, dim
+            e['seen'][cam] = time.time()
+            self.entries[uid] = e
+            while len(self.entries) > self.limit:
+                self.entries.popitem(last=False)
+            self.learned += 1
+        return dim
+
+    def seen(self, uid, cam):
+        """Lần quẹt ESP32 tự verify: giữ uid trong danh sách của cửa này"""
+        with self.lock:
+            e = self.entries.get(uid)
+            if e is not None:
+                e['seen'][cam] = time.time()
+                self.entries.move_to_end(uid)
+
+    def expected(self, cam, n, dim):
+        """n template (uid, base64) nên có ở cửa cam: quẹt ở đó gần nhất trước"""
+        with self.lock:
+            items = [(uid, e) for uid, e in self.entries.items() if e['dim'] == dim]
+        items.sort(key=lambda it: (it[1]['seen'].get(cam, 0), max(it[1]['seen'].values())), reverse=True)
+        return [(uid, e['vec']) for uid, e in items[:n]]
+
+    def report(self, headers):
+        """Kết quả verify tại ESP32 (X-Edge-*), None khi ảnh không có"""
+        state = headers.get('X-Edge-Verify')
+        if state not in ('hit', 'miss', 'no_face'):
+            return None
+        ms = headers.get('X-Edge-Ms', type=float)
+        out = {'state': state, 'local_ms': ms}
+        decision = headers.get('X-Edge-Decision') if state == 'hit' else None
+        if decision in ('grant', 'deny'):
+            out['decision'] = decision
+            out['score'] = headers.get('X-Edge-Score', type=float)
+        with self.lock:
+            self.reports[state] += 1
+            self.local_ms += ms or 0
+            if 'decision' in out:
+                self.decisions[decision] += 1
+                self.hit_ms += ms or 0
+        return out
+
+    def stats(self):
+        with self.lock:
+            reports = dict(self.reports)
+            total = sum(reports.values())
+            hits = reports.get('hit', 0)
+            return {
+                'templates': len(self.entries),
+                'learned': self.learned,
+                'pushed': self.pushed,
+                'reports': reports,
+                'decisions': dict(self.decisions),
+                'hit_rate': round(hits / total, 3) if total else None,
+                'avg_local_ms': round(self.local_ms / total, 1) if total else None,
+                'avg_hit_ms': round(self.hit_ms / hits, 1) if hits else None,
+            }
+
+
+edge_templates = EdgeTemplates()
+
+
+def edge_verify(channel, tap, edge):
+    """
+    verification cho lần quẹt ESP32 đã tự verify (grant tại cửa là quyết định
+    cuối), None thì server verify như thường
+    """
+    if edge is None or edge.get('decision') != 'grant':
+        return None
+    edge_templates.seen(tap['uid'], channel.cam)
+    return {'student': tap['uid'], 'decision': 'grant', 'score': edge.get('score'),
+            'verify_ms': edge.get('local_ms'), 'over_budget': False, 'source': 'edge'}
+
+
+def edge_learn(channel, tap, headers, verification):
+    """Server vừa grant lần quẹt: embedding ESP32 gửi kèm thành template, đẩy xuống các cửa"""
+    b64 = headers.get('X-Edge-Embedding')
+    if not b64 or not verification or verification.get('decision') != 'grant':
+        return
+    dim = edge_templates.learn(tap['uid'], channel.cam, b64)
+    if dim and trigger_hub is not None:
+        trigger_hub.push_edge([(tap['uid'], b64)], dim)
+
+
+class TriggerHub(socketserver.ThreadingTCPServer):
+    """
+    Lệnh chụp đẩy xuống ESP32-CAM: mỗi camera giữ 1 kết nối TCP tới
+    TRIGGER_PORT, POST /trigger ghi "TRIGGER <id> <lý do>\n" cho tất cả.
+    Ảnh chụp theo lệnh mang X-Trigger: server, X-Trigger-Id: <id>.
+
+    Cùng kết nối đó chở template cho cache verify ở cửa (EdgeTemplates):
+    ESP32 có cache gửi "HELLO edge <số ô> <số chiều>\n", server trả các dòng
+    "EDGE <UID hex> <base64>\n", rồi đẩy thêm mỗi khi học được template mới.
+    """
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, port=TRIGGER_PORT):
+        self.clients = set()
+        self.lock = threading.Lock()
+        self.next_id = 0
+        self.sent = {}          # id -> lúc gửi (epoch us), giữ 64 lệnh gần nhất
+        self.edge = {}          # wfile -> số chiều embedding, kết nối đã HELLO edge
+        super().__init__(('0.0.0.0', port), TriggerHandler)
+
+    def push(self, reason):
+        with self.lock:
+            self.next_id += 1
+            tid = self.next_id
+            self.sent[tid] = time.time_ns() // 1000
+            self.sent.pop(tid - 64, None)
+            line = f"TRIGGER {tid} {reason}\n".encode()
+            delivered = 0
+            for wfile in list(self.clients):
+                try:
+                    wfile.write(line)
+                    wfile.flush()
+                    delivered += 1
+                except OSError:
+                    self.clients.discard(wfile)
+        return tid, delivered
+
+    def push_edge(self, templates, dim, wfile=None):
+        """Dòng EDGE cho mọi kết nối có cache cùng số chiều (hoặc chỉ wfile); số dòng đã ghi"""
+        data = b''.join(f"EDGE {uid} {b64}\n".encode() for uid, b64 in templates)
+        written = 0
+        with self.lock:
+            targets = [wfile] if wfile is not None else [w for w, d in self.edge.items() if d == dim]
+            for w in targets:
+                try:
+                    w.write(data)
+                    w.flush()
+                    written += len(templates)
+                except OSError:
+                    self.clients.discard(w)
+                    self.edge.pop(w, None)
+        with edge_templates.lock:
+            edge_templates.pushed += written
+        return written
+
+
+class TriggerHandler(socketserver.StreamRequestHandler):
+    def handle(self):
+        peer = '%s:%d' % self.client_address
+        print(f"🔔 Trigger link from {peer}")
+        with self.server.lock:
+            self.server.clients.add(self.wfile)
+        try:
+            while True:
+                line = self.rfile.readline()
+                if not line:
+                    break
+                parts = line.split()
+                if len(parts) == 4 and parts[:2] == [b'HELLO', b'edge']:
+                    self.hello_edge(peer, int(parts[2]), int(parts[3]))
+        except (OSError, ValueError):
+            pass
+        with self.server.lock:
+            self.server.clients.discard(self.wfile)
+            self.server.edge.pop(self.wfile, None)
+        print(f"🔔 Trigger link from {peer} closed")
+
+    def hello_edge(self, peer, slots, dim):
+        # Camera của kết nối này: cùng cách đặt tên channel như ảnh từ IP đó
+        cam = scheduler.channel(None, self.client_address[0]).cam
+        with self.server.lock:
+            self.server.edge[self.wfile] = dim
+        sent = self.server.push_edge(edge_templates.expected(cam, slots, dim), dim, self.wfile)
+        print(f"🔔 Edge cache on {peer} ({cam}): {slots} slots, dim {dim}, {sent} template(s) pushed")
+
+
+archive = None
+
+
+def start_archive():
+    global archive
+    if ARCHIVE_DIR:
+        archive = frame_archive.FrameArchive(ARCHIVE_DIR, ARCHIVE_HOURS).start()
+        print(f"🗄️  Frame archive: {ARCHIVE_DIR} ({ARCHIVE_HOURS} h)")
+    return archive
+
+
+trigger_hub = None
+
+
+def start_trigger_hub(port=TRIGGER_PORT):
+    global trigger_hub
+    trigger_hub = TriggerHub(port)
+    threading.Thread(target=trigger_hub.serve_forever, name='trigger', daemon=True).start()
+    return trigger_hub
+
+
+class UdpReceiver:
+    """
+    Luồng UDP cho màn hình cửa trực tiếp: ESP32-CAM cắt mỗi JPEG thành gói
+    vừa MTU, không chờ gì từ server. Mảnh ghép theo frame id; frame thiếu
+    mảnh UDP_NACK_MS thì xin lại những mảnh thiếu đúng 1 lần, quá
+    UDP_DEADLINE_MS thì bỏ. Frame mới hơn ghép xong thì các frame cũ còn dở
+    bị bỏ luôn: không bao giờ hiện ảnh cũ hơn ảnh đang có.
+
+    Frame ghép xong vào hàng đợi của camera (Scheduler; gói UDP không có
+    X-Camera-Id nên theo IP, hoặc id IP đó đã khai qua ingest / /upload);
+    hàng đợi đầy thì frame cũ nhất bị bỏ. Xử lý xong gửi lại gói thống kê
+    (server_ms, số frame đủ / bị bỏ) cho ESP32.
+    """
+
+    def __init__(self, port=UDP_PORT):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 20)
+        self.sock.bind(('0.0.0.0', port))
+        self.sock.settimeout(UDP_NACK_MS / 2000)
+        self.pending = {}       # frame id -> frame đang ghép
+        self.last_done = 0
+        self.complete = 0
+        self.dropped = 0
+        self.nacks = 0
+
+    def stats(self):
+        return {'complete': self.complete, 'dropped': self.dropped, 'nacks': self.nacks, 'pending': len(self.pending)}
+
+    def run(self):
+        while True:
+            try:
+                data, addr = self.sock.recvfrom(2048)
+            except socket.timeout:
+                data = None
+            now = time.monotonic()
+            if data:
+                self.on_packet(data, addr, now)
+            self.expire(now)
+
+    def on_packet(self, data, addr, now):
+        if len(data) < UDP_FRAG_HDR.size:
+            return
+        magic, kind, frag, frags, length, fid, flen, motion, faces, _, _ = UDP_FRAG_HDR.unpack_from(data)
+        if magic != UDP_MAGIC or kind != ord('F') or fid <= self.last_done or frag >= frags:
+            return
+        f = self.pending.setdefault(fid, {'parts': {}, 'frags': frags, 'start': now, 'addr': addr,
+                                          'nacked': False, 'motion': motion, 'faces': faces})
+        f['parts'][frag] = data[UDP_FRAG_HDR.size:UDP_FRAG_HDR.size + length]
+        if len(f['parts']) < f['frags']:
+            return
+        del self.pending[fid]
+        jpg = b''.join(f['parts'][i] for i in range(f['frags']))
+        for old in [k for k in self.pending if k < fid]:
+            del self.pending[old]
+            self.dropped += 1
+        self.last_done = fid
+        self.complete += 1
+        headers = Headers()
+        headers.add('X-Seq', str(fid))
+        headers.add('X-Motion-Score', str(f['motion']))
+        if f['faces'] >= 0:
+            headers.add('X-Face-Count', str(f['faces']))
+        channel = scheduler.channel(None, addr[0])
+        recv_us = time.time_ns() // 1000
+        scheduler.submit(channel, lambda: process_jpeg(channel, jpg, headers, recv_us),
+                         lambda result: self.sent(fid, addr, result))
+
+    def expire(self, now):
+        for fid, f in list(self.pending.items()):
+            age_ms = (now - f['start']) * 1000
+            if age_ms > UDP_DEADLINE_MS:
+                del self.pending[fid]
+                self.dropped += 1
+            elif age_ms > UDP_NACK_MS and not f['nacked']:
+                missing = [i for i in range(f['frags']) if i not in f['parts']][:256]
+                pkt = UDP_NACK_HDR.pack(UDP_MAGIC, ord('N'), fid, len(missing)) + struct.pack(f'<{len(missing)}H', *missing)
+                self.sock.sendto(pkt, f['addr'])
+                f['nacked'] = True
+                self.nacks += 1
+
+    def sent(self, fid, addr, result):
+        """Kết quả của 1 frame (từ worker của Scheduler): gói thống kê cho ESP32"""
+        if 'server_ms' not in result:
+            if result['status'] == 'error':
+                print(f"❌ UDP frame #{fid}: {result['message']}")
+            return
+        pkt = UDP_STATS_PKT.pack(UDP_MAGIC, ord('S'), min(result['server_ms'], 0xFFFF), fid, self.complete, self.dropped)
+        self.sock.sendto(pkt, addr)
+
+
+udp_receiver = None
+
+
+def start_udp_receiver(port=UDP_PORT):
+    global udp_receiver
+    udp_receiver = UdpReceiver(port)
+    threading.Thread(target=udp_receiver.run, name='udp', daemon=True).start()
+    return udp_receiver
+
+
+def feed(cam):
+    """FrameStore của camera cam, feed chung khi cam None; None khi chưa có camera đó"""
+    if cam is None:
+        return frame_store
+    ch = scheduler.get(cam)
+    return ch.store if ch else None
 
 
 @app.route('/')
 def index():
-    """Trang chủ hiển thị video stream"""
-    return render_template('index.html')
+    """Trang chủ hiển thị video stream; ?cam=<id>: stream của 1 camera"""
+    cam = request.args.get('cam')
+    suffix = '/' + camera_key(cam) if cam else ''
+    return render_template('index.html', passthrough=STREAM_PASSTHROUGH, feed=suffix)
+
+
+@app.route('/time')
+def server_time():
+    """
+    Giờ gốc cho ESP32-CAM (ping kiểu NTP): epoch micro giây của server.
+    STM32 đồng bộ qua UART bằng Student_card/tools/timesync.py chạy trên máy này.
+    """
+    return jsonify({'server_us': time.time_ns() // 1000})
+
+
+@app.route('/trigger', methods=['POST'])
+def push_trigger():
+    """Bắt các ESP32-CAM đang kết nối chụp ngay 1 loạt ảnh"""
+    if trigger_hub is None:
+        return jsonify({'status': 'error', 'message': 'Trigger hub not running'}), 503
+    data = request.get_json(silent=True) or {}
+    reason = str(data.get('reason', 'manual')).replace('\n', ' ')[:32]
+    tid, delivered = trigger_hub.push(reason)
+    return jsonify({'status': 'success', 'id': tid, 'cameras': delivered})
 
 
 @app.route('/upload', methods=['POST'])
@@ -111,98 +1764,255 @@ def upload_image():
     1. Base64: {'image': 'base64_encoded_string'}
     2. Binary: gửi trực tiếp file trong form-data hoặc raw body
     """
-    global latest_frame, latest_detected_frame
+    recv_us = time.time_ns() // 1000
     
     try:
-        image = None
+        image_bytes = None
         
         # Cách 1: Nhận ảnh dưới dạng base64 từ JSON
         if request.is_json:
             data = request.get_json()
             if 'image' in data:
                 # Decode base64
-                image_data = base64.b64decode(data['image'])
-                nparr = np.frombuffer(image_data, np.uint8)
-                image = cv2.imdecode(nparr, cv2.IMREAD_COLOR)
+                image_bytes = base64.b64decode(data['image'])
         
         # Cách 2: Nhận ảnh dưới dạng file upload
         elif 'file' in request.files:
             file = request.files['file']
             image_bytes = file.read()
-            nparr = np.frombuffer(image_bytes, np.uint8)
-            image = cv2.imdecode(nparr, cv2.IMREAD_COLOR)
         
         # Cách 3: Nhận ảnh dưới dạng raw binary data
         else:
             image_bytes = request.data
-            nparr = np.frombuffer(image_bytes, np.uint8)
-            image = cv2.imdecode(nparr, cv2.IMREAD_COLOR)
         
-        if image is None:
+        if not image_bytes:
             return jsonify({'status': 'error', 'message': 'Could not decode image'}), 400
-        
-        # Lưu frame gốc
-        latest_frame = image.copy()
-        
-        # Nhận diện khuôn mặt
-        detected_image, faces_count = detect_faces(image)
-        latest_detected_frame = detected_image.copy()
-        
-        # Lưu ảnh đã nhận diện vào static folder
-        cv2.imwrite(DETECTED_IMAGE_PATH, detected_image)
-        
-        return jsonify({
-            'status': 'success',
-            'faces_detected': faces_count,
-            'message': f'Detected {faces_count} face(s)'
-        })
+
+        # Chờ tới lượt trong hàng đợi của camera này (Scheduler)
+        channel = scheduler.channel(request.headers, request.remote_addr)
+        # Worker của Scheduler chạy ngoài request context: chép header trước khi submit
+        headers = Headers(request.headers)
+        job = scheduler.submit(channel, lambda: process_jpeg(channel, image_bytes, headers, recv_us))
+        if not job.finished.wait(UPLOAD_WAIT):
+            return jsonify({'status': 'error', 'message': 'Timed out waiting for detection'}), 504
+        return jsonify(job.result), upload_status(job)
     
     except Exception as e:
         return jsonify({'status': 'error', 'message': str(e)}), 500
 
 
+@app.route('/enroll', methods=['POST'])
+def enroll_face():
+    """
+    Đăng ký mặt 1 sinh viên: body JPEG có đúng 1 mặt (lấy mặt lớn nhất),
+    ?student=<UID thẻ>. Gọi nhiều lần với nhiều ảnh cho cùng sinh viên thì
+    nhận dạng ổn định hơn
+    """
+    if identifier is None:
+        return jsonify({'status': 'error', 'message': f'No face model ({FACE_MODEL})'}), 503
+    student = request.args.get('student') or request.headers.get('X-Student')
+    if not student:
+        return jsonify({'status': 'error', 'message': 'Missing student'}), 400
+    image = cv2.imdecode(np.frombuffer(request.get_data(), np.uint8), cv2.IMREAD_COLOR)
+    if image is None:
+        return jsonify({'status': 'error', 'message': 'Could not decode image'}), 400
+    _, faces, _, _ = detect_faces(image, draw=False)
+    if not len(faces):
+        return jsonify({'status': 'error', 'message': 'No face found'}), 422
+    face = max(faces, key=lambda f: f[2] * f[3])
+    samples = identifier.add(student, identifier.embed(image, [face])[0])
+    return jsonify({'status': 'success', 'student': student, 'samples': samples, 'face': dict(zip('xywh', map(int, face)))})
+
+
 @app.route('/latest')
-def get_latest_image():
-    """API trả về ảnh mới nhất đã nhận diện"""
-    if os.path.exists(DETECTED_IMAGE_PATH):
-        with open(DETECTED_IMAGE_PATH, 'rb') as f:
-            image_data = f.read()
-        return Response(image_data, mimetype='image/jpeg')
+@app.route('/latest/<cam>')
+def get_latest_image(cam=None):
+    """
+    API trả về ảnh mới nhất đã nhận diện (của camera cam, hoặc camera bất kỳ);
+    ?raw=1: JPEG gốc ESP32 gửi lên, không decode/encode lại
+    """
+    store = feed(cam)
+    if store is None:
+        return jsonify({'status': 'error', 'message': f'Unknown camera {cam}'}), 404
+    raw = request.args.get('raw') == '1'
+    frame = store.latest
+    if frame is not None:
+        etag = f'{BOOT_ID}:{frame.cam}:{frame.seq}' + (':raw' if raw else '')
+        jpeg = None
+    elif cam is None and previous_jpeg is not None:
+        # Chưa nhận frame nào từ lúc chạy: ảnh lần chạy trước
+        etag, jpeg = f'{BOOT_ID}:previous', previous_jpeg
     else:
         return jsonify({'status': 'error', 'message': 'No image available'}), 404
+    # Dashboard poll lại cùng frame: 304 trước khi encode hay gửi gì
+    if request.if_none_match.contains(etag):
+        response = Response(status=304)
+    else:
+        response = Response(jpeg if jpeg is not None else frame.stream_jpeg(raw), mimetype='image/jpeg')
+    response.set_etag(etag)
+    response.headers['Cache-Control'] = 'no-cache'
+    return response
+
+
+def snapshot_writer():
+    """Mỗi SNAPSHOT_SECONDS ghi ảnh mới nhất (nếu đã đổi) ra DETECTED_IMAGE_PATH"""
+    last = None
+    while True:
+        time.sleep(SNAPSHOT_SECONDS)
+        frame = frame_store.latest
+        if frame is None or frame is last:
+            continue
+        last = frame
+        # Ghi file tạm rồi đổi tên: không ai đọc phải file ghi dở
+        tmp = DETECTED_IMAGE_PATH + '.tmp'
+        with open(tmp, 'wb') as f:
+            f.write(frame.stream_jpeg())
+        os.replace(tmp, DETECTED_IMAGE_PATH)
 
 
 @app.route('/stream')
-def video_stream():
+@app.route('/stream/<cam>')
+def video_stream(cam=None):
     """
     Endpoint stream video theo định dạng MJPEG
-    Trả về ảnh mới nhất liên tục
+    Trả về ảnh mới nhất liên tục (/stream/<cam>: của 1 camera, /stream: của
+    camera nào gửi sau cùng); ?raw=1 (hoặc STREAM_PASSTHROUGH): JPEG gốc
+    của ESP32, khung mặt lấy từ /events theo X-Camera + X-Seq
     """
+    raw = request.args.get('raw') == '1'
+    store = feed(cam)
+    if store is None:
+        return jsonify({'status': 'error', 'message': f'Unknown camera {cam}'}), 404
+
     def generate():
-        while True:
-            if latest_detected_frame is not None:
-                # Encode frame thành JPEG
-                ret, buffer = cv2.imencode('.jpg', latest_detected_frame)
-                frame = buffer.tobytes()
+        last = None
+        store.subscribe(1)
+        try:
+            while True:
+                # Chờ thế hệ mới; JPEG của frame được encode 1 lần cho mọi client
+                frame = store.wait(last, timeout=1.0)
+                if frame is None:
+                    continue
+                last = frame
                 
                 # Trả về frame theo định dạng MJPEG
                 yield (b'--frame\r\n'
-                       b'Content-Type: image/jpeg\r\n\r\n' + frame + b'\r\n')
-            else:
-                # Nếu chưa có frame nào, tạm dừng
-                import time
-                time.sleep(0.1)
+                       b'Content-Type: image/jpeg\r\n' + f'X-Camera: {frame.cam}\r\nX-Seq: {frame.seq}\r\n\r\n'.encode() + frame.stream_jpeg(raw) + b'\r\n')
+        finally:
+            # Client đóng kết nối: Flask đóng generator (GeneratorExit)
+            store.subscribe(-1)
     
     return Response(generate(), mimetype='multipart/x-mixed-replace; boundary=frame')
 
 
+@app.route('/events')
+@app.route('/events/<cam>')
+def face_events(cam=None):
+    """
+    Server-Sent Events: mỗi frame mới 1 event JSON (camera, seq, kích thước
+    frame, khung mặt, số mặt) để trang web vẽ khung lên JPEG gốc của /stream
+    """
+    store = feed(cam)
+    if store is None:
+        return jsonify({'status': 'error', 'message': f'Unknown camera {cam}'}), 404
+
+    def generate():
+        last = None
+        store.subscribe(1)
+        try:
+            while True:
+                frame = store.wait(last, timeout=15.0)
+                if frame is None:
+                    # Comment SSE giữ kết nối qua proxy khi lâu không có frame
+                    yield ': ping\n\n'
+                    continue
+                last = frame
+                yield f'id: {frame.seq}\ndata: {json.dumps(frame.meta())}\n\n'
+        finally:
+            store.subscribe(-1)
+
+    return Response(generate(), mimetype='text/event-stream', headers={'Cache-Control': 'no-cache'})
+
+
+@app.route('/trace')
+@app.route('/trace/<cam>')
+def latency_trace(cam=None):
+    """
+    Span của các frame gần nhất (mới nhất sau cùng, ?n= số span, mặc định 50)
+    và phân vị p50/p95/p99 từng đoạn, cho 1 camera hoặc mọi camera
+    """
+    if cam is not None and scheduler.get(cam) is None:
+        return jsonify({'status': 'error', 'message': f'Unknown camera {cam}'}), 404
+    n = max(1, min(request.args.get('n', 50, type=int), TRACE_WINDOW))
+    return jsonify({'camera': cam, 'percentiles': tracer.percentiles(cam), 'spans': tracer.recent(cam, n)})
+
+
+@app.route('/archive')
+def archive_frames():
+    """
+    Frame đã lưu trong 1 khoảng thời gian, cũ trước: ?tap=<X-Tap-Seq> (kèm
+    ?cam= nếu nhiều cổng) lấy quanh lần quẹt đó từ ?before= tới ?after= giây
+    (mặc định 5), hoặc ?from=&to= giây epoch. ?n= tối đa số frame (500).
+    Mỗi frame có 'url' tới JPEG gốc
+    """
+    if archive is None:
+        return jsonify({'status': 'error', 'message': 'Archive disabled (ARCHIVE_DIR)'}), 503
+    cam = request.args.get('cam')
+    seq = request.args.get('tap', type=int)
+    if seq is not None:
+        ts = archive.tap_time(seq, cam)
+        if ts is None:
+            return jsonify({'status': 'error', 'message': f'Tap {seq} not in archive'}), 404
+        t0 = ts - int(request.args.get('before', 5, type=float) * 1e6)
+        t1 = ts + int(request.args.get('after', 5, type=float) * 1e6)
+    else:
+        t0 = request.args.get('from', type=float)
+        t1 = request.args.get('to', type=float)
+        if t0 is None or t1 is None:
+            return jsonify({'status': 'error', 'message': 'Need ?tap= or ?from=&to='}), 400
+        t0, t1, ts = int(t0 * 1e6), int(t1 * 1e6), None
+    frames = archive.frames(t0, t1, cam, max(1, min(request.args.get('n', 500, type=int), 5000)))
+    for f in frames:
+        f['url'] = f"/archive/{f['segment']}/{f['n']}"
+    return jsonify({'tap_us': ts, 'from_us': t0, 'to_us': t1, 'frames': frames})
+
+
+@app.route('/archive/<segment>/<int:n>')
+def archive_jpeg(segment, n):
+    """JPEG gốc của 1 frame đã lưu (url trong /archive)"""
+    jpeg = archive.read(segment, n) if archive is not None else None
+    if jpeg is None:
+        return jsonify({'status': 'error', 'message': 'Frame not in archive'}), 404
+    response = Response(jpeg, mimetype='image/jpeg')
+    # Segment chỉ ghi thêm: bản ghi đã có thì không bao giờ đổi
+    response.headers['Cache-Control'] = 'max-age=86400, immutable'
+    return response
+
+
 @app.route('/status')
 def status():
     """Kiểm tra trạng thái server"""
     return jsonify({
         'status': 'running',
-        'has_frame': latest_frame is not None,
-        'detected_image_exists': os.path.exists(DETECTED_IMAGE_PATH)
+        'has_frame': frame_store.latest is not None,
+        'frames': frame_store.stats(),
+        'passthrough': STREAM_PASSTHROUGH,
+        'detect': {
+            'width': DETECT_WIDTH,
+            'frames': detect_stats['frames'],
+            'avg_ms': round(detect_stats['total_ms'] / max(detect_stats['frames'], 1), 2),
+        },
+        'latest_tap': latest_tap,
+        'channels': scheduler.stats(),
+        'udp': udp_receiver.stats() if udp_receiver else None,
+        'detector': detector_pool.stats() if detector_pool else None,
+        'gateway': gateway.stats() if gateway else None,
+        'archive': archive.stats() if archive else None,
+        'identification': identifier.stats() if identifier else None,
+        'edge': edge_templates.stats(),
+        'latency': tracer.percentiles(),
+        'detected_image_exists': os.path.exists(DETECTED_IMAGE_PATH),
+        'snapshot_seconds': SNAPSHOT_SECONDS
     })
 
 
@@ -213,7 +2023,11 @@ if __name__ == '__main__':
     print(f"📡 Server URL: http://192.168.1.25:5000/")
     print(f"🌐 Web Interface: http://192.168.1.25:5000/")
     print(f"📤 Upload Endpoint: http://192.168.1.25:5000/upload")
-    print(f"📺 Video Stream: http://192.168.1.25:5000/stream")
+    print(f"📺 Video Stream: http://192.168.1.25:5000/stream (1 camera: /stream/<X-Camera-Id>)")
+    print(f"📥 Ingest Stream: tcp://192.168.1.25:{INGEST_PORT}")
+    if os.path.exists(ingest_gw.LIB_PATH) and GATEWAY_PORT:
+        print(f"📤 Gateway Upload: http://192.168.1.25:{GATEWAY_PORT}/upload (JPEG binary)")
+    print(f"📥 UDP Stream: udp://192.168.1.25:{UDP_PORT}")
     print("=" * 60)
     print("\n⚙️  ESP32-CAM Configuration:")
     print("   - POST images to: http://192.168.1.25:5000/upload")
@@ -221,5 +2035,16 @@ if __name__ == '__main__':
     print(f"   - ESP32 IP: Kiểm tra Serial Monitor")
     print("=" * 60)
     
+    # debug=True chạy app 2 lần (reloader): chỉ tiến trình con mở cổng ingest
+    if os.environ.get('WERKZEUG_RUN_MAIN') == 'true':
+        # Gateway C++ giữ cổng ingest khi có; không thì IngestServer như cũ
+        if start_gateway() is None:
+            start_ingest_server()
+        start_udp_receiver()
+        start_trigger_hub()
+        start_archive()
+        if SNAPSHOT_SECONDS > 0:
+            threading.Thread(target=snapshot_writer, name='snapshot', daemon=True).start()
+
     # Chạy server trên tất cả network interfaces
     app.run(host='0.0.0.0', port=5000, debug=True, threaded=True)
@@ -2,24 +2,135 @@
  * ESP32-CAM Code để gửi ảnh lên Flask Server
  * 
  * Cách hoạt động:
- * 1. ESP32-CAM chụp ảnh
- * 2. Chuyển ảnh thành JPEG buffer
- * 3. POST ảnh binary đến http://192.168.1.28:5000/upload
+ * 1. STM32 phát xung CAM_TRIG (PB14) khi quẹt thẻ -> ESP32-CAM chụp ảnh
+ * 2. Đọc frame CARD từ UART của STM32 (UID + số thứ tự lần quẹt)
+ * 3. POST ảnh JPEG đến http://192.168.1.28:5000/upload kèm header
+ *    X-Card-UID, X-Tap-Seq, X-Reader, X-Decision
  * 4. Nhận response JSON từ server
+ *
+ * Đồng bộ giờ: server là gốc. ESP32 hỏi GET /time vài lần, lấy lần có
+ * round trip nhỏ nhất -> offset giữa esp_timer và epoch của server.
+ * STM32 được tools/timesync.py đồng bộ qua UART, nên X-Tap-Time (lúc quẹt)
+ * và X-Frame-Time (lúc chụp) cùng một mốc epoch (us).
+ *
+ * Kích chụp (trigger): xung GPIO từ STM32, frame CARD qua UART, hoặc lệnh
+ * "TRIGGER <id>" server đẩy xuống qua kết nối TCP giữ sẵn (POST /trigger
+ * của app.py). Mỗi trigger chụp ngay 1 loạt BURST_FRAMES ảnh; không có
+ * trigger thì chỉ chụp 1 ảnh mỗi HEARTBEAT_MS làm nhịp tim. Ảnh mang header
+ * X-Trigger / X-Trigger-Id / X-Trigger-Time / X-Burst, log in thời gian từ
+ * trigger tới lúc upload xong.
+ *
+ * BURST_BEST 1 (cần PSRAM, fb_count 2): cả loạt chỉ gửi 1 ảnh nét nhất,
+ * mỗi lần quẹt tốn đúng 1 ảnh trên mạng. Cùng cảnh, cùng jpeg_quality thì
+ * ảnh nhoè nén nhỏ hơn hẳn, nên điểm là số byte JPEG, không phải decode;
+ * giữ ảnh tốt nhất tới giờ, trả ngay ảnh kém hơn cho camera. Header
+ * X-Burst là ảnh được chọn / cả loạt, X-Burst-Score là điểm của nó.
+ * (CameraWebServer làm việc này trên vòng đệm ảnh: /capture?best=.)
+ *
+ * Upload dùng chung 1 kết nối keep-alive (setReuse): chỉ lần đầu, hoặc khi
+ * server đã đóng kết nối, mới tốn bắt tay TCP. Mỗi request in latency và
+ * tỉ lệ dùng lại kết nối.
+ *
+ * Mất WiFi hoặc server không trả lời: ảnh không bị bỏ mà chép vào vòng đệm
+ * trong PSRAM (BACKLOG_SLOTS ảnh, tối đa BACKLOG_BYTES), kèm giờ chụp và
+ * lần quẹt. Đầy thì bỏ ảnh không gắn thẻ cũ nhất trước, ảnh quẹt thẻ giữ
+ * lâu nhất. Có mạng lại thì gửi dần từng đợt BACKLOG_BURST ảnh, cách nhau
+ * BACKLOG_GAP_MS, dừng ngay khi có lần quẹt mới để ảnh mới đi trước.
+ *
+ * WiFi chạy nền: setup() không chờ kết nối, camera sẵn sàng chụp ngay lần
+ * quẹt đầu (chưa có mạng thì ảnh vào backlog). Mất mạng thì thử lại ngay
+ * 1 lần rồi giãn dần WIFI_BACKOFF_MIN..WIFI_BACKOFF_MAX. BSSID/kênh của AP
+ * lần trước lưu trong NVS: kết nối lại không phải quét mọi kênh. staticIp
+ * khác 0.0.0.0 thì bỏ luôn DHCP. Mỗi lần có mạng in thời gian kết nối.
+ *
+ * Camera khởi tạo, chụp sẵn 1 frame trong lúc WiFi còn kết nối; ảnh đầu
+ * gửi xong thì in "Boot timeline" (camera sẵn sàng -> có IP -> ảnh đầu đã
+ * gửi, ms từ lúc app chạy) để theo dõi thời gian mù sau khi mất điện.
+ *
+ * USE_EDGE_VERIFY 1 (cần PSRAM, esp32 Arduino core 2.x có esp-dl): verify
+ * 1:1 ngay tại cửa, khỏi chờ WiFi tới server. Server đẩy xuống (qua kết nối
+ * lệnh chụp, dòng "EDGE <UID> <base64>") template của sinh viên hay qua cửa
+ * này; ESP32 giữ EDGE_SLOTS template trong PSRAM, đầy thì bỏ cái lâu không
+ * dùng nhất (LRU). Lần quẹt có UID trong cache: tìm mặt, tính embedding
+ * bằng model ESP-DL (FaceRecognition112V1S8, int8) và so với template, kết
+ * quả gửi kèm ảnh (X-Edge-Verify / X-Edge-Decision / X-Edge-Score /
+ * X-Edge-Ms); server nhận grant đó luôn. UID chưa có (miss) hoặc không khớp
+ * thì server verify như cũ, embedding đi kèm (X-Edge-Embedding) để server
+ * học template mới khi nó grant. Log mỗi lần verify in tỉ lệ hit và thời
+ * gian verify tại chỗ.
  */
 
 #include <WiFi.h>
 #include <HTTPClient.h>
+#include <Preferences.h>
 #include "esp_camera.h"
 
 // WiFi credentials
 const char* ssid = "YOUR_WIFI_SSID";
 const char* password = "YOUR_WIFI_PASSWORD";
+// Địa chỉ tĩnh: kết nối lại không chờ DHCP. 0.0.0.0: dùng DHCP
+IPAddress staticIp(0, 0, 0, 0);
+IPAddress gatewayIp(192, 168, 1, 1);
+IPAddress subnetMask(255, 255, 255, 0);
+#define WIFI_ATTEMPT_MS   10000   // Quá chừng này chưa có IP thì bỏ lần thử
+#define WIFI_BACKOFF_MIN    500
+#define WIFI_BACKOFF_MAX  30000
 
 // Flask Server URL
 // ⚠️ QUAN TRỌNG: Sử dụng IP WiFi vì ESP32-CAM kết nối qua WiFi
 // IP WiFi của máy: 192.168.1.25 (kiểm tra bằng: ipconfig)
 const char* serverUrl = "http://192.168.1.25:5000/upload";
+const char* timeUrl = "http://192.168.1.25:5000/time";
+const char* triggerHost = "192.168.1.25";   // app.py TRIGGER_PORT
+const uint16_t triggerPort = 5004;
+#define TIME_SYNC_MS   60000   // Đồng bộ lại mỗi phút (thạch anh lệch ~1 ms/phút)
+#define TIME_SAMPLES       5
+
+// Kích chụp từ STM32
+// TRIGGER_PIN nối PB14 (CAM_TRIG), CARD_RX_PIN nối PA9 (USART1 TX, chỉ nghe)
+// USE_TRIGGER_PIN 0: không đi dây trigger, chụp khi nhận frame CARD
+#define USE_TRIGGER_PIN    1
+#define TRIGGER_PIN       13
+#define CARD_RX_PIN       14
+#define CARD_BAUD     115200
+#define CARD_WAIT_MS     300   // Chờ frame CARD sau xung trigger
+#define USE_SERVER_TRIGGER 1     // Nhận lệnh chụp từ server
+#define TRIGGER_RECONNECT_MS 10000
+#define BURST_FRAMES       3     // Ảnh mỗi lần trigger
+#define BURST_GAP_MS     200
+#define BURST_BEST         1     // Chỉ gửi ảnh nét nhất của loạt
+#define HEARTBEAT_MS   60000     // Không có trigger: 1 ảnh mỗi chừng này; 0: tắt
+
+// Cache verify tại cửa (cần USE_SERVER_TRIGGER: template đi trên kết nối đó)
+#define USE_EDGE_VERIFY    0
+#define EDGE_SLOTS      1024     // Template trong PSRAM, ~530 B mỗi cái
+#define EDGE_DIM         512     // Embedding của FaceRecognition112V1S8
+#define EDGE_MATCH     0.55f     // Cosine tối thiểu để grant tại chỗ
+
+// Sau các define ở trên: #if đọc giá trị của chúng
+#if USE_EDGE_VERIFY
+#if !USE_SERVER_TRIGGER
+#error "USE_EDGE_VERIFY needs USE_SERVER_TRIGGER"
+#endif
+#include "esp_jpg_decode.h"
+#include "mbedtls/base64.h"
+#include "human_face_detect_msr01.hpp"
+#include "human_face_detect_mnp01.hpp"
+#include "face_recognition_112_v1_s8.hpp"
+#endif
+
+// Giao thức USART1 của STM32 (Core/Inc/proto.h)
+#define PROTO_SOF       0xC5
+#define TRACE_SOF       0xA5   // Bản ghi trace nhị phân: 0xA5 + 8 byte
+#define TRACE_LEN          8
+#define PROTO_EVT_CARD  0x02
+#define PROTO_MAX_LEN     64
+
+// Vòng đệm ảnh chưa gửi được
+#define BACKLOG_SLOTS       16
+#define BACKLOG_BYTES  (2u << 20)   // Tổng dung lượng JPEG tối đa trong PSRAM
+#define BACKLOG_BURST        3      // Ảnh gửi bù mỗi đợt
+#define BACKLOG_GAP_MS     500      // Nghỉ giữa 2 đợt, chừa đường cho ảnh mới
 
 // Camera pins cho ESP32-CAM AI-Thinker
 #define PWDN_GPIO_NUM     32
@@ -39,19 +150,802 @@ const char* serverUrl = "http://192.168.1.25:5000/upload";
 #define HREF_GPIO_NUM     23
 #define PCLK_GPIO_NUM     22
 
+struct CardTap {
+  uint8_t reader;
+  uint8_t uidLen;
+  uint8_t uid[10];
+  uint8_t decision;
+  uint32_t seq;
+  uint64_t epochUs;    // Lúc quẹt theo giờ server, 0 nếu STM32 chưa đồng bộ
+};
+
+static const char* const readerNames[] = {"ENTRY", "EXIT"};
+static const char* const decisionNames[] = {"DENIED", "GRANTED", "UNKNOWN"};
+
+static volatile bool triggered = false;
+static volatile int64_t triggerUs = 0;  // esp_timer lúc có xung, ghi trong ISR
+
+enum TriggerSource : uint8_t { TRIG_GPIO, TRIG_UART, TRIG_SERVER, TRIG_HEARTBEAT };
+static const char* const triggerNames[] = {"gpio", "uart", "server", "heartbeat"};
+
+struct Trigger {
+  uint8_t source;
+  uint8_t frame;       // Ảnh thứ mấy trong loạt
+  uint8_t frames;
+  uint32_t score;      // Điểm của ảnh chọn từ loạt (byte JPEG), 0: gửi cả loạt
+  uint32_t id;         // TRIG_SERVER: id server gửi, còn lại: đếm tăng dần
+  int64_t localUs;     // Lúc có trigger theo esp_timer
+};
+
+static uint32_t triggerCount = 0;
+static uint32_t lastCapture = 0;
+static struct {
+  uint32_t bursts;
+  uint64_t firstUploadUs;  // Tổng trigger -> ảnh đầu upload xong
+} trigStats;
+
+static WiFiClient pushClient;          // Kết nối nhận lệnh TRIGGER từ server
+// Dòng EDGE chở 1 template base64
+static char pushLine[USE_EDGE_VERIFY ? 32 + 4 * ((EDGE_DIM + 2) / 3) : 48];
+static uint16_t pushLen = 0;
+static uint32_t lastPushConnect = 0;
+
+// Trạng thái WiFi: event đặt cờ, loop() (wifiPoll) xử lý
+static struct {
+  volatile bool gotIp;
+  volatile bool lost;
+  volatile uint8_t reason;
+  bool up;
+  bool fast;           // Lần thử dùng BSSID/kênh đã lưu, không quét
+  bool haveAp;
+  uint8_t bssid[6];
+  int32_t channel;
+  int64_t attemptUs;   // 0: không có lần thử nào đang chạy
+  uint32_t backoffMs;
+  uint32_t nextMs;
+  uint32_t attempts, connects, fastConnects, drops;
+  uint32_t lastMs;     // Bắt đầu thử -> có IP
+  uint64_t totalMs;
+} wifi;
+
+// Mốc khởi động, us từ lúc app chạy (sau bootloader); 0: chưa tới
+static struct {
+  int64_t cameraUs;
+  int64_t ipUs;
+  int64_t firstSentUs;
+} bootTimeline;
+static Preferences wifiPrefs;
+
+static void onWifiEvent(arduino_event_id_t event, arduino_event_info_t info) {
+  if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+    wifi.gotIp = true;
+  } else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED && info.wifi_sta_disconnected.reason != WIFI_REASON_ASSOC_LEAVE) {
+    // ASSOC_LEAVE: chính WiFi.begin bỏ lần thử cũ
+    wifi.reason = info.wifi_sta_disconnected.reason;
+    wifi.lost = true;
+  }
+}
+
+static void wifiAttempt() {
+  wifi.attempts++;
+  wifi.attemptUs = esp_timer_get_time();
+  wifi.fast = wifi.haveAp;
+  if (wifi.fast) {
+    WiFi.begin(ssid, password, wifi.channel, wifi.bssid);
+  } else {
+    WiFi.begin(ssid, password);
+  }
+}
+
+static void wifiBegin() {
+  wifiPrefs.begin("wifilink");
+  wifi.haveAp = wifiPrefs.getBytes("bssid", wifi.bssid, 6) == 6 && wifiPrefs.getString("ssid") == ssid;
+  wifi.channel = wifiPrefs.getInt("channel", 0);
+  wifi.backoffMs = WIFI_BACKOFF_MIN;
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false);   // Tự thử lại, có backoff
+  if (staticIp != IPAddress(0, 0, 0, 0)) {
+    WiFi.config(staticIp, gatewayIp, subnetMask, gatewayIp);
+  }
+  WiFi.onEvent(onWifiEvent);
+  wifiAttempt();
+}
+
+// true đúng 1 lần mỗi khi vừa có mạng
+static bool wifiPoll() {
+  bool gotIp = wifi.gotIp, lost = wifi.lost;
+  wifi.gotIp = wifi.lost = false;
+  if (wifi.up && lost) {
+    // Rớt mạng: thử lại ngay AP cũ, thất bại mới giãn
+    wifi.up = false;
+    wifi.drops++;
+    wifi.attemptUs = 0;
+    wifi.backoffMs = WIFI_BACKOFF_MIN;
+    wifi.nextMs = millis();
+    Serial.printf("WiFi lost (reason %u), reconnecting\n", wifi.reason);
+    return false;
+  }
+  if (gotIp && !wifi.up) {
+    wifi.up = true;
+    if (!bootTimeline.ipUs) bootTimeline.ipUs = esp_timer_get_time();
+    wifi.connects++;
+    wifi.fastConnects += wifi.fast;
+    wifi.lastMs = wifi.attemptUs ? (esp_timer_get_time() - wifi.attemptUs) / 1000 : 0;
+    wifi.totalMs += wifi.lastMs;
+    wifi.attemptUs = 0;
+    wifi.backoffMs = WIFI_BACKOFF_MIN;
+    // Chỉ ghi NVS khi đổi AP
+    if (!wifi.haveAp || memcmp(wifi.bssid, WiFi.BSSID(), 6) || wifi.channel != WiFi.channel()) {
+      memcpy(wifi.bssid, WiFi.BSSID(), 6);
+      wifi.channel = WiFi.channel();
+      wifi.haveAp = true;
+      wifiPrefs.putBytes("bssid", wifi.bssid, 6);
+      wifiPrefs.putInt("channel", wifi.channel);
+      wifiPrefs.putString("ssid", ssid);
+    }
+    Serial.printf("WiFi up in %u ms (%s, attempt %u), IP %s, avg %u ms, %u drop(s)\n", (unsigned)wifi.lastMs, wifi.fast ? "cached AP" : "scan",
+                  (unsigned)wifi.attempts, WiFi.localIP().toString().c_str(), (unsigned)(wifi.totalMs / wifi.connects), (unsigned)wifi.drops);
+    return true;
+  }
+  if (wifi.up) return false;
+  if (wifi.attemptUs && (lost || esp_timer_get_time() - wifi.attemptUs > WIFI_ATTEMPT_MS * 1000LL)) {
+    wifi.attemptUs = 0;
+    WiFi.disconnect();
+    if (wifi.fast) {
+      wifi.haveAp = false;   // AP cũ không còn: quét lại ngay
+      wifi.nextMs = millis();
+    } else {
+      wifi.nextMs = millis() + wifi.backoffMs;
+      wifi.backoffMs = min(wifi.backoffMs * 2, (uint32_t)WIFI_BACKOFF_MAX);
+    }
+  }
+  if (!wifi.attemptUs && (int32_t)(millis() - wifi.nextMs) >= 0) wifiAttempt();
+  return false;
+}
+
+// 1 ảnh chờ gửi lại, JPEG chép ra PSRAM (frame buffer đã trả camera)
+struct Backlogged {
+  uint8_t* jpg;
+  size_t len;
+  int64_t localUs;     // Giờ chụp theo esp_timer, đổi sang epoch lúc gửi
+  bool haveTap;
+  CardTap tap;
+  Trigger trig;
+};
+
+static Backlogged backlog[BACKLOG_SLOTS];
+static uint8_t backlogCount = 0;        // backlog[0] cũ nhất
+static size_t backlogBytes = 0;
+static uint32_t backlogDropped = 0;
+static uint32_t lastDrain = 0;
+
+// Uploader sống suốt chương trình, giữ kết nối TCP giữa các lần POST
+static HTTPClient uploader;
+static struct {
+  uint32_t requests;   // POST đã gửi (kể cả lần thử lại)
+  uint32_t reused;     // ... đi trên kết nối có sẵn
+  uint32_t retries;    // Kết nối cũ đã bị server đóng, mở lại và gửi lại
+  uint32_t failures;
+  uint64_t totalUs;    // Tổng latency các POST thành công
+  uint32_t ok;
+} upStats;
+
+static int64_t epochOffsetUs = 0;  // epoch server = esp_timer_get_time() + offset
+static bool timeSynced = false;
+static uint32_t lastTimeSync = 0;
+
+// Ping kiểu NTP qua HTTP: server trả {"server_us": N}, giả sử N ứng với
+// điểm giữa round trip. Giữ kết nối (keep-alive) để RTT không có bắt tay TCP.
+static void syncTime() {
+  HTTPClient http;
+  http.setReuse(true);
+  if (!http.begin(timeUrl)) return;
+  int64_t bestRtt = INT64_MAX;
+  for (int i = 0; i < TIME_SAMPLES + 1; i++) {
+    int64_t t1 = esp_timer_get_time();
+    int code = http.GET();
+    int64_t t4 = esp_timer_get_time();
+    if (code != 200) break;
+    String body = http.getString();
+    int k = body.indexOf("\"server_us\":");
+    if (i == 0 || k < 0) continue;   // Lần đầu còn mở kết nối TCP: bỏ
+    int64_t serverUs = atoll(body.c_str() + k + 12);
+    if (t4 - t1 < bestRtt) {
+      bestRtt = t4 - t1;
+      epochOffsetUs = serverUs - (t1 + t4) / 2;
+      timeSynced = true;
+    }
+  }
+  http.end();
+  lastTimeSync = millis();
+  if (bestRtt != INT64_MAX) {
+    Serial.printf("Time synced: +-%lld us\n", (long long)(bestRtt / 2));
+  }
+}
+
+static int64_t frameLocalUs(const camera_fb_t* fb) {
+  return (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+}
+
+static uint64_t epochUs(int64_t localUs) {
+  if (!timeSynced) return 0;
+  return localUs + epochOffsetUs;
+}
+
+static void IRAM_ATTR onTrigger() {
+  triggerUs = esp_timer_get_time();
+  triggered = true;
+}
+
+// CRC của khối CRC STM32: poly 0x04C11DB7, init 0xFFFFFFFF,
+// tính trên từng word big-endian, word cuối đệm 0
+static uint32_t stm32Crc(const uint8_t* data, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i += 4) {
+    uint32_t w = 0;
+    for (size_t j = 0; j < 4; j++) {
+      w = (w << 8) | (i + j < len ? data[i + j] : 0);
+    }
+    crc ^= w;
+    for (int b = 0; b < 32; b++) {
+      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+// Tách frame SOF | LEN | TYPE | SEQ | TS | payload | CRC32 từ luồng UART
+// (chữ ASCII và bản ghi trace xen kẽ thì bỏ qua). Trả về true khi có frame CARD.
+static bool pollCardFrame(CardTap* tap) {
+  static uint8_t buf[PROTO_MAX_LEN + 6];
+  static uint8_t n = 0, need = 0, skip = 0;
+  while (Serial2.available()) {
+    uint8_t c = Serial2.read();
+    if (skip) { skip--; continue; }
+    if (n == 0) {
+      if (c == TRACE_SOF) skip = TRACE_LEN;
+      else if (c == PROTO_SOF) buf[n++] = c;
+      continue;
+    }
+    buf[n++] = c;
+    if (n == 2) {
+      if (c < 6 || c > PROTO_MAX_LEN) { n = 0; continue; }
+      need = 2 + c + 4;
+    }
+    if (n < 2 || n < need) continue;
+    n = 0;
+    uint8_t len = buf[1];
+    uint32_t crc = buf[2 + len] | (buf[3 + len] << 8) | (buf[4 + len] << 16) | ((uint32_t)buf[5 + len] << 24);
+    if (stm32Crc(&buf[1], 1 + len) != crc) continue;
+    const uint8_t* p = &buf[8];
+    uint8_t plen = len - 6;
+    if (buf[2] != PROTO_EVT_CARD || plen < 2 || plen < 2 + p[1] + 5 || p[1] > sizeof(tap->uid)) continue;
+    tap->reader = p[0];
+    tap->uidLen = p[1];
+    memcpy(tap->uid, &p[2], tap->uidLen);
+    tap->decision = p[2 + tap->uidLen];
+    const uint8_t* s = &p[3 + tap->uidLen];
+    tap->seq = s[0] | (s[1] << 8) | (s[2] << 16) | ((uint32_t)s[3] << 24);
+    tap->epochUs = 0;
+    if (plen >= 2 + tap->uidLen + 13) {
+      for (int b = 7; b >= 0; b--) tap->epochUs = (tap->epochUs << 8) | s[4 + b];
+    }
+    return true;
+  }
+  return false;
+}
+
+#if USE_EDGE_VERIFY
+struct EdgeTemplate {
+  uint8_t uidLen;          // 0: ô trống
+  uint8_t uid[10];
+  uint32_t used;           // Đồng hồ LRU lúc được đẩy xuống / dùng gần nhất
+  int8_t vec[EDGE_DIM];    // Đã chuẩn hoá, x127
+};
+
+enum EdgeState : uint8_t { EDGE_NONE, EDGE_HIT, EDGE_MISS, EDGE_NO_FACE };
+static const char* const edgeStateNames[] = {"", "hit", "miss", "no_face"};
+
+// Kết quả verify của lần quẹt gần nhất, gắn vào header khi gửi ảnh của nó
+struct EdgeResult {
+  uint32_t seq;
+  uint8_t state;
+  bool grant;
+  float score;
+  uint32_t us;             // Decode + tìm mặt + embedding + so khớp
+  int8_t vec[EDGE_DIM];    // Embedding vừa tính (state HIT / MISS)
+};
+
+static EdgeTemplate* edgeCache = NULL;   // EDGE_SLOTS ô trong PSRAM
+static uint32_t edgeClock = 0;
+static EdgeResult edgeLast;
+static uint8_t* edgeRgb = NULL;          // Ảnh decode 1/2 cho model, PSRAM
+static size_t edgeRgbSize = 0;
+static HumanFaceDetectMSR01* edgeS1 = NULL;
+static HumanFaceDetectMNP01* edgeS2 = NULL;
+static FaceRecognition112V1S8* edgeRec = NULL;
+static struct {
+  uint32_t lookups, hits, misses, noFace, grants;
+  uint32_t stored, evicted;
+  uint64_t hitUs;
+} edgeStats;
+
+static void edgeBegin() {
+  edgeCache = (EdgeTemplate*)ps_calloc(EDGE_SLOTS, sizeof(EdgeTemplate));
+  if (!edgeCache) {
+    Serial.println("Edge cache: no PSRAM, verifying on the server only");
+    return;
+  }
+  edgeS1 = new HumanFaceDetectMSR01(0.1F, 0.5F, 10, 0.2F);
+  edgeS2 = new HumanFaceDetectMNP01(0.5F, 0.3F, 5);
+  edgeRec = new FaceRecognition112V1S8();
+  Serial.printf("Edge cache: %u slots (%u KB PSRAM)\n", EDGE_SLOTS, (unsigned)(EDGE_SLOTS * sizeof(EdgeTemplate) >> 10));
+}
+
+static int edgeFind(const uint8_t* uid, uint8_t len) {
+  for (int i = 0; i < EDGE_SLOTS; i++) {
+    if (edgeCache[i].uidLen == len && !memcmp(edgeCache[i].uid, uid, len)) return i;
+  }
+  return -1;
+}
+
+static int hexNibble(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Dòng "EDGE <UID hex> <base64>" từ server: thêm / thay template, đầy thì bỏ ô LRU
+static void edgeStore(char* line) {
+  if (!edgeCache) return;
+  char* hex = line + 5;
+  char* b64 = strchr(hex, ' ');
+  if (!b64) return;
+  *b64++ = 0;
+  uint8_t uid[10];
+  size_t n = strlen(hex);
+  if (n == 0 || n % 2 || n / 2 > sizeof(uid)) return;
+  for (size_t i = 0; i < n / 2; i++) {
+    int hi = hexNibble(hex[2 * i]), lo = hexNibble(hex[2 * i + 1]);
+    if (hi < 0 || lo < 0) return;
+    uid[i] = hi << 4 | lo;
+  }
+  static int8_t vec[EDGE_DIM];
+  size_t len = 0;
+  if (mbedtls_base64_decode((unsigned char*)vec, sizeof(vec), &len, (const unsigned char*)b64, strlen(b64)) || len != EDGE_DIM) return;
+  int slot = edgeFind(uid, n / 2);
+  if (slot < 0) {
+    // Ô trống, không thì ô lâu không dùng nhất
+    slot = 0;
+    for (int i = 0; i < EDGE_SLOTS && edgeCache[slot].uidLen; i++) {
+      if (!edgeCache[i].uidLen || edgeCache[i].used < edgeCache[slot].used) slot = i;
+    }
+    if (edgeCache[slot].uidLen) edgeStats.evicted++;
+  }
+  EdgeTemplate& t = edgeCache[slot];
+  t.uidLen = n / 2;
+  memcpy(t.uid, uid, t.uidLen);
+  memcpy(t.vec, vec, EDGE_DIM);
+  t.used = ++edgeClock;
+  edgeStats.stored++;
+}
+
+static size_t edgeJpgRead(void* arg, size_t index, uint8_t* buf, size_t len) {
+  if (buf) memcpy(buf, (const uint8_t*)arg + index, len);
+  return len;
+}
+
+static bool edgeJpgWrite(void* arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t* data) {
+  uint16_t* size = (uint16_t*)arg;
+  if (!data) {
+    if (!x && !y) {
+      size[0] = w;
+      size[1] = h;
+    }
+    return (size_t)w * h * 3 <= edgeRgbSize;
+  }
+  // Thứ tự byte của fmt2rgb888 (B, G, R), như model ESP-WHO được huấn luyện
+  for (int r = 0; r < h; r++) {
+    const uint8_t* in = data + r * w * 3;
+    uint8_t* out = edgeRgb + ((size_t)(y + r) * size[0] + x) * 3;
+    for (int c = 0; c < w; c++, in += 3, out += 3) {
+      out[0] = in[2];
+      out[1] = in[1];
+      out[2] = in[0];
+    }
+  }
+  return true;
+}
+
+// Embedding (chuẩn hoá, x127) của mặt lớn nhất trong ảnh; false khi không thấy mặt
+static bool edgeEmbed(const camera_fb_t* fb, int8_t* vec) {
+  // Decode 1/2: SVGA còn 400x300, đủ cho mặt ở cửa, decode nhanh gấp mấy lần
+  size_t need = (size_t)(fb->width / 2) * (fb->height / 2) * 3;
+  if (need > edgeRgbSize) {
+    free(edgeRgb);
+    edgeRgb = (uint8_t*)ps_malloc(need);
+    edgeRgbSize = edgeRgb ? need : 0;
+    if (!edgeRgb) return false;
+  }
+  uint16_t size[2] = {0, 0};
+  if (esp_jpg_decode(fb->len, JPG_SCALE_2X, edgeJpgRead, edgeJpgWrite, size) != ESP_OK || !size[0]) return false;
+  std::vector<int> shape = {size[1], size[0], 3};
+  std::list<dl::detect::result_t>& candidates = edgeS1->infer(edgeRgb, shape);
+  std::list<dl::detect::result_t>& results = edgeS2->infer(edgeRgb, shape, candidates);
+  const dl::detect::result_t* best = NULL;
+  int bestArea = 0;
+  for (const dl::detect::result_t& r : results) {
+    int area = (r.box[2] - r.box[0]) * (r.box[3] - r.box[1]);
+    if (r.keypoint.size() == 10 && area > bestArea) {
+      best = &r;
+      bestArea = area;
+    }
+  }
+  if (!best) return false;
+  dl::Tensor<uint8_t> image;
+  image.set_element(edgeRgb).set_shape(shape).set_auto_free(false);
+  std::vector<int> landmarks = best->keypoint;
+  // Căn mặt theo 5 điểm rồi chạy model; get_face_emb() không id là embedding của ảnh vừa đưa vào
+  edgeRec->recognize(image, landmarks);
+  dl::Tensor<float>& emb = edgeRec->get_face_emb();
+  float norm = 0;
+  for (int i = 0; i < EDGE_DIM; i++) norm += emb.element[i] * emb.element[i];
+  norm = norm > 0 ? 127.0f / sqrtf(norm) : 0;
+  for (int i = 0; i < EDGE_DIM; i++) vec[i] = (int8_t)lrintf(emb.element[i] * norm);
+  return true;
+}
+
+// Verify 1:1 lần quẹt tap trên ảnh fb (1 lần mỗi lần quẹt, thử lại nếu ảnh trước không có mặt)
+static void edgeVerify(const camera_fb_t* fb, const CardTap* tap) {
+  if (!edgeCache || (edgeLast.seq == tap->seq && edgeLast.state != EDGE_NONE && edgeLast.state != EDGE_NO_FACE)) return;
+  int64_t t0 = esp_timer_get_time();
+  edgeLast.seq = tap->seq;
+  edgeLast.grant = false;
+  edgeLast.score = 0;
+  edgeStats.lookups++;
+  int slot = edgeFind(tap->uid, tap->uidLen);
+  if (!edgeEmbed(fb, edgeLast.vec)) {
+    edgeLast.state = EDGE_NO_FACE;
+    edgeStats.noFace++;
+  } else if (slot < 0) {
+    edgeLast.state = EDGE_MISS;
+    edgeStats.misses++;
+  } else {
+    int32_t dot = 0;
+    for (int i = 0; i < EDGE_DIM; i++) dot += edgeLast.vec[i] * edgeCache[slot].vec[i];
+    edgeLast.state = EDGE_HIT;
+    edgeLast.score = dot / (127.0f * 127.0f);
+    edgeLast.grant = edgeLast.score >= EDGE_MATCH;
+    edgeCache[slot].used = ++edgeClock;
+    edgeStats.hits++;
+    edgeStats.grants += edgeLast.grant;
+  }
+  edgeLast.us = esp_timer_get_time() - t0;
+  if (edgeLast.state == EDGE_HIT) edgeStats.hitUs += edgeLast.us;
+  Serial.printf("Edge verify #%u: %s%s %.2f in %u ms, hit rate %u/%u, avg hit %llu ms, %u cached\n", (unsigned)tap->seq,
+                edgeStateNames[edgeLast.state], edgeLast.state != EDGE_HIT ? "" : edgeLast.grant ? " grant" : " deny", edgeLast.score,
+                (unsigned)(edgeLast.us / 1000), (unsigned)edgeStats.hits, (unsigned)edgeStats.lookups,
+                (unsigned long long)(edgeStats.hits ? edgeStats.hitUs / edgeStats.hits / 1000 : 0), (unsigned)(edgeStats.stored - edgeStats.evicted));
+}
+
+static void addEdgeHeaders(const CardTap* tap) {
+  if (!edgeCache || edgeLast.seq != tap->seq || edgeLast.state == EDGE_NONE) return;
+  uploader.addHeader("X-Edge-Verify", edgeStateNames[edgeLast.state]);
+  uploader.addHeader("X-Edge-Ms", String(edgeLast.us / 1000.0f, 1));
+  if (edgeLast.state == EDGE_HIT) {
+    uploader.addHeader("X-Edge-Decision", edgeLast.grant ? "grant" : "deny");
+    uploader.addHeader("X-Edge-Score", String(edgeLast.score, 3));
+  }
+  // Server cần embedding để học template khi chính nó grant
+  if (edgeLast.state == EDGE_MISS || (edgeLast.state == EDGE_HIT && !edgeLast.grant)) {
+    static char b64[4 * ((EDGE_DIM + 2) / 3) + 1];
+    size_t len = 0;
+    if (!mbedtls_base64_encode((unsigned char*)b64, sizeof(b64), &len, (const unsigned char*)edgeLast.vec, EDGE_DIM)) {
+      uploader.addHeader("X-Edge-Embedding", b64);
+    }
+  }
+}
+#endif
+
+// Header của 1 lần upload (begin() xoá header cũ nên mỗi lần thử phải thêm lại)
+static void addUploadHeaders(int64_t localUs, const CardTap* tap, const Trigger* trig) {
+  uploader.addHeader("Content-Type", "image/jpeg");
+  uint64_t frameUs = epochUs(localUs);
+  if (frameUs) uploader.addHeader("X-Frame-Time", String(frameUs));
+  uploader.addHeader("X-Trigger", triggerNames[trig->source]);
+  uploader.addHeader("X-Trigger-Id", String(trig->id));
+  uint64_t trigUs = epochUs(trig->localUs);
+  if (trigUs) uploader.addHeader("X-Trigger-Time", String(trigUs));
+  uploader.addHeader("X-Burst", String(trig->frame) + "/" + String(trig->frames));
+  if (trig->score) uploader.addHeader("X-Burst-Score", String(trig->score));
+  if (!tap) {
+    if (trig->source == TRIG_GPIO) Serial.println("No CARD frame after trigger, uploading untagged");
+    return;
+  }
+  char uidHex[2 * sizeof(tap->uid) + 1];
+  for (uint8_t i = 0; i < tap->uidLen; i++) {
+    sprintf(&uidHex[2 * i], "%02X", tap->uid[i]);
+  }
+  uidHex[2 * tap->uidLen] = 0;
+  uploader.addHeader("X-Card-UID", uidHex);
+  uploader.addHeader("X-Tap-Seq", String(tap->seq));
+  uploader.addHeader("X-Reader", tap->reader < 2 ? String(readerNames[tap->reader]) : String(tap->reader));
+  uploader.addHeader("X-Decision", tap->decision < 3 ? String(decisionNames[tap->decision]) : String(tap->decision));
+  if (tap->epochUs) uploader.addHeader("X-Tap-Time", String(tap->epochUs));
+#if USE_EDGE_VERIFY
+  addEdgeHeaders(tap);
+#endif
+  Serial.printf("Tap #%u UID %s\n", (unsigned)tap->seq, uidHex);
+}
+
+// POST ảnh trên kết nối keep-alive. Nếu kết nối cũ đã chết (server đóng
+// khi rảnh), mở kết nối mới và gửi lại đúng 1 lần.
+static int uploadFrame(const uint8_t* buf, size_t len, int64_t localUs, const CardTap* tap, const Trigger* trig) {
+  int code = -1;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (!uploader.begin(serverUrl)) {
+      Serial.println("✗ Unable to connect to server!");
+      Serial.println("  Check server URL: " + String(serverUrl));
+      break;
+    }
+    bool reused = uploader.connected();
+    addUploadHeaders(localUs, tap, trig);
+    int64_t t0 = esp_timer_get_time();
+    code = uploader.POST((uint8_t*)buf, len);
+    String response = code > 0 ? uploader.getString() : String();  // Đọc hết body thì mới dùng lại được kết nối
+    int64_t us = esp_timer_get_time() - t0;
+    uploader.end();
+    upStats.requests++;
+    if (reused) upStats.reused++;
+    if (code > 0) {
+      upStats.ok++;
+      upStats.totalUs += us;
+      Serial.printf("✓ %d in %lld ms (%s), reuse %u/%u, avg %llu ms\n", code, (long long)(us / 1000), reused ? "reused" : "new conn",
+                    (unsigned)upStats.reused, (unsigned)upStats.requests, (unsigned long long)(upStats.totalUs / upStats.ok / 1000));
+      Serial.println("✓ Response: " + response);
+      return code;
+    }
+    if (!reused) break;
+    upStats.retries++;
+    Serial.println("  Keep-alive connection was closed, reconnecting");
+  }
+  upStats.failures++;
+  Serial.println("✗ Error code: " + String(code));
+  if (code == -1) {
+    Serial.println("  → Connection failed. Check:");
+    Serial.println("    1. Flask server is running (python app.py)");
+    Serial.println("    2. Server IP is correct: " + String(serverUrl));
+    Serial.println("    3. Firewall allows port 5000");
+    Serial.println("    4. ESP32 and server on same network");
+  }
+  return code;
+}
+
+static void backlogRemove(int i) {
+  free(backlog[i].jpg);
+  backlogBytes -= backlog[i].len;
+  backlogCount--;
+  memmove(&backlog[i], &backlog[i + 1], (backlogCount - i) * sizeof(Backlogged));
+}
+
+// Chỗ nhường cho ảnh mới: ảnh không gắn thẻ cũ nhất, hết thì ảnh quẹt thẻ
+// cũ nhất. -1 nếu ảnh mới không gắn thẻ mà vòng đệm toàn ảnh quẹt thẻ.
+static int backlogVictim(bool haveTap) {
+  for (int i = 0; i < backlogCount; i++) {
+    if (!backlog[i].haveTap) return i;
+  }
+  return haveTap && backlogCount ? 0 : -1;
+}
+
+// Chép ảnh chưa gửi được vào vòng đệm
+static void backlogPush(const camera_fb_t* fb, const CardTap* tap, const Trigger* trig) {
+  if (fb->len > BACKLOG_BYTES) return;
+  while (backlogCount == BACKLOG_SLOTS || backlogBytes + fb->len > BACKLOG_BYTES) {
+    int i = backlogVictim(tap != NULL);
+    if (i < 0) {
+      backlogDropped++;
+      Serial.println("✗ Backlog full of tap frames, dropping this one");
+      return;
+    }
+    backlogRemove(i);
+    backlogDropped++;
+  }
+  uint8_t* jpg = (uint8_t*)ps_malloc(fb->len);
+  if (!jpg) {
+    backlogDropped++;
+    return;
+  }
+  memcpy(jpg, fb->buf, fb->len);
+  Backlogged& b = backlog[backlogCount++];
+  b.jpg = jpg;
+  b.len = fb->len;
+  b.localUs = frameLocalUs(fb);
+  b.haveTap = tap != NULL;
+  if (tap) b.tap = *tap;
+  b.trig = *trig;
+  backlogBytes += fb->len;
+  Serial.printf("Backlogged frame, %u waiting (%u KB), %u dropped\n", (unsigned)backlogCount, (unsigned)(backlogBytes >> 10),
+                (unsigned)backlogDropped);
+}
+
+// Gửi bù 1 đợt: ảnh quẹt thẻ trước, cũ trước. Lỗi thì dừng, giữ ảnh lại.
+static void backlogDrain() {
+  if (!backlogCount || !wifi.up || millis() - lastDrain < BACKLOG_GAP_MS) return;
+  lastDrain = millis();
+  for (int n = 0; n < BACKLOG_BURST && backlogCount && !triggered; n++) {
+    int i = 0;
+    while (i < backlogCount && !backlog[i].haveTap) i++;
+    if (i == backlogCount) i = 0;
+    const Backlogged& b = backlog[i];
+    Serial.printf("Resending frame from %lld ms ago\n", (long long)((esp_timer_get_time() - b.localUs) / 1000));
+    int code = uploadFrame(b.jpg, b.len, b.localUs, b.haveTap ? &b.tap : NULL, &b.trig);
+    if (code <= 0 || code >= 500) return;
+    backlogRemove(i);
+  }
+}
+
+// Lệnh "TRIGGER <id>\n" từ server; kết nối mất thì mở lại mỗi TRIGGER_RECONNECT_MS
+static bool pollServerTrigger(uint32_t* id) {
+  if (!pushClient.connected()) {
+    if (!wifi.up || millis() - lastPushConnect < TRIGGER_RECONNECT_MS) return false;
+    lastPushConnect = millis();
+    pushClient.stop();
+    if (!pushClient.connect(triggerHost, triggerPort, 500)) return false;
+    pushClient.setNoDelay(true);
+    pushLen = 0;
+#if USE_EDGE_VERIFY
+    // Server trả template của các UID nên có ở cửa này
+    if (edgeCache) pushClient.printf("HELLO edge %u %u\n", EDGE_SLOTS, EDGE_DIM);
+#endif
+    Serial.printf("Trigger push connected to %s:%u\n", triggerHost, triggerPort);
+  }
+  while (pushClient.available()) {
+    int c = pushClient.read();
+    if (c < 0) break;
+    if (c != '\n') {
+      if (pushLen + 1u < sizeof(pushLine)) pushLine[pushLen++] = c;
+      continue;
+    }
+    pushLine[pushLen] = 0;
+    pushLen = 0;
+    if (!strncmp(pushLine, "TRIGGER ", 8)) {
+      *id = strtoul(pushLine + 8, NULL, 10);
+      return true;
+    }
+#if USE_EDGE_VERIFY
+    if (!strncmp(pushLine, "EDGE ", 5)) edgeStore(pushLine);
+#endif
+  }
+  return false;
+}
+
+static bool fire(Trigger* t, uint8_t source, int64_t us) {
+  t->source = source;
+  t->score = 0;
+  t->localUs = us;
+  t->id = ++triggerCount;
+  return true;
+}
+
+// Trigger tiếp theo, false khi chưa có gì
+static bool pollTrigger(Trigger* t, CardTap* tap, bool* haveTap) {
+  *haveTap = false;
+#if USE_TRIGGER_PIN
+  if (triggered) {
+    triggered = false;
+    return fire(t, TRIG_GPIO, triggerUs);
+  }
+  pollCardFrame(tap);  // Đọc hết byte UART, frame lẻ (không có xung) bỏ qua
+#else
+  if (pollCardFrame(tap)) {
+    *haveTap = true;
+    return fire(t, TRIG_UART, esp_timer_get_time());
+  }
+#endif
+#if USE_SERVER_TRIGGER
+  uint32_t id;
+  if (pollServerTrigger(&id)) {
+    fire(t, TRIG_SERVER, esp_timer_get_time());
+    t->id = id;
+    return true;
+  }
+#endif
+  if (HEARTBEAT_MS && millis() - lastCapture >= HEARTBEAT_MS) {
+    return fire(t, TRIG_HEARTBEAT, esp_timer_get_time());
+  }
+  return false;
+}
+
+// Gửi 1 ảnh của loạt, không được thì giữ lại gửi sau
+static void sendFrame(camera_fb_t* fb, Trigger& t, CardTap* tap, bool haveTap, bool first) {
+  int code = -1;
+#if USE_EDGE_VERIFY
+  // Trước khi gửi: kết quả tại chỗ đi kèm chính ảnh này
+  if (haveTap) edgeVerify(fb, tap);
+#endif
+  if(wifi.up) {
+    code = uploadFrame(fb->buf, fb->len, frameLocalUs(fb), haveTap ? tap : NULL, &t);
+    if (code > 0 && code < 300 && !bootTimeline.firstSentUs) {
+      bootTimeline.firstSentUs = esp_timer_get_time();
+      Serial.printf("Boot timeline: camera %lld ms, IP %lld ms, first frame sent %lld ms\n", (long long)(bootTimeline.cameraUs / 1000),
+                    (long long)(bootTimeline.ipUs / 1000), (long long)(bootTimeline.firstSentUs / 1000));
+    }
+  } else {
+    Serial.println("WiFi not connected");
+  }
+  if (code <= 0 || code >= 500) {
+    backlogPush(fb, haveTap ? tap : NULL, &t);
+  } else if (first) {
+    int64_t us = esp_timer_get_time() - t.localUs;
+    trigStats.bursts++;
+    trigStats.firstUploadUs += us;
+    Serial.printf("Trigger -> upload %lld ms, avg %llu ms over %u\n", (long long)(us / 1000),
+                  (unsigned long long)(trigStats.firstUploadUs / trigStats.bursts / 1000), (unsigned)trigStats.bursts);
+  }
+}
+
+// Chụp và gửi 1 loạt ảnh cho 1 trigger (heartbeat: 1 ảnh). BURST_BEST:
+// chụp hết loạt rồi chỉ gửi ảnh tốt nhất.
+static void captureBurst(Trigger& t, CardTap* tap, bool haveTap) {
+  t.frames = t.source == TRIG_HEARTBEAT ? 1 : BURST_FRAMES;
+  bool pickBest = BURST_BEST && t.frames > 1 && psramFound();
+  camera_fb_t* best = NULL;
+  uint8_t bestFrame = 0;
+  for (t.frame = 0; t.frame < t.frames; t.frame++) {
+    if (t.frame) delay(BURST_GAP_MS);
+    camera_fb_t * fb = esp_camera_fb_get();
+    if(!fb) {
+      Serial.println("Camera capture failed");
+      break;
+    }
+
+    // Frame CARD tới sau xung trigger vài ms (STM32 ghi nhật ký rồi mới gửi)
+    uint32_t t0 = millis();
+    while (t.source == TRIG_GPIO && !haveTap && millis() - t0 < CARD_WAIT_MS) {
+      haveTap = pollCardFrame(tap);
+      if (!haveTap) delay(1);
+    }
+
+    Serial.printf("Picture taken! Size: %u bytes, %s #%u %u/%u, +%lld ms after trigger\n", (unsigned)fb->len, triggerNames[t.source],
+                  (unsigned)t.id, t.frame + 1, t.frames, (long long)((frameLocalUs(fb) - t.localUs) / 1000));
+
+    if (!pickBest) {
+      sendFrame(fb, t, tap, haveTap, !t.frame);
+      esp_camera_fb_return(fb);
+      continue;
+    }
+    // Giữ ảnh tốt nhất tới giờ, trả ảnh còn lại để camera chụp tiếp
+    if (!best || fb->len > best->len) {
+      if (best) esp_camera_fb_return(best);
+      best = fb;
+      bestFrame = t.frame;
+    } else {
+      esp_camera_fb_return(fb);
+    }
+  }
+  if (best) {
+    t.frames = t.frame;  // Loạt có thể dừng sớm khi chụp lỗi
+    t.frame = bestFrame;
+    t.score = best->len;
+    Serial.printf("Best of burst: %u/%u, %u bytes\n", bestFrame + 1, (unsigned)t.frames, (unsigned)best->len);
+    sendFrame(best, t, tap, haveTap, true);
+    esp_camera_fb_return(best);
+  }
+  lastCapture = millis();
+}
+
 void setup() {
   Serial.begin(115200);
+  Serial2.begin(CARD_BAUD, SERIAL_8N1, CARD_RX_PIN, -1);
+#if USE_TRIGGER_PIN
+  pinMode(TRIGGER_PIN, INPUT_PULLDOWN);
+  attachInterrupt(digitalPinToInterrupt(TRIGGER_PIN), onTrigger, RISING);
+#endif
   
-  // Kết nối WiFi
-  WiFi.begin(ssid, password);
-  Serial.print("Connecting to WiFi");
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-  }
-  Serial.println("\nWiFi connected!");
-  Serial.print("IP: ");
-  Serial.println(WiFi.localIP());
+  // Kết nối WiFi chạy nền trong lúc khởi tạo camera, không chờ
+  wifiBegin();
   
   // Cấu hình camera
   camera_config_t config;
@@ -75,6 +969,7 @@ void setup() {
   config.pin_reset = RESET_GPIO_NUM;
   config.xclk_freq_hz = 20000000;
   config.pixel_format = PIXFORMAT_JPEG;
+  config.grab_mode = CAMERA_GRAB_LATEST;  // Ảnh chụp sau xung, không lấy frame cũ
   
   // Cấu hình chất lượng ảnh
   if(psramFound()){
@@ -94,68 +989,31 @@ void setup() {
     return;
   }
   
-  Serial.println("Camera initialized successfully!");
+  // Frame đầu sau init chậm hơn (sensor khởi động, AEC đo sáng lần đầu): chụp bỏ ngay,
+  // lần quẹt đầu tiên không phải chờ
+  camera_fb_t* warm = esp_camera_fb_get();
+  if (warm) esp_camera_fb_return(warm);
+  bootTimeline.cameraUs = esp_timer_get_time();
+  Serial.printf("Camera ready in %lld ms\n", (long long)(bootTimeline.cameraUs / 1000));
+  uploader.setReuse(true);
+  uploader.setTimeout(10000); // 10 giây
+#if USE_EDGE_VERIFY
+  edgeBegin();
+#endif
 }
 
 void loop() {
-  // Chụp ảnh
-  camera_fb_t * fb = esp_camera_fb_get();
-  if(!fb) {
-    Serial.println("Camera capture failed");
-    delay(1000);
+  Trigger t;
+  CardTap tap;
+  bool haveTap;
+  // Vừa có mạng: đồng bộ giờ trước khi gửi
+  if (wifiPoll() || (wifi.up && millis() - lastTimeSync > TIME_SYNC_MS)) syncTime();
+  if (!pollTrigger(&t, &tap, &haveTap)) {
+    backlogDrain();
+    delay(1);
     return;
   }
-  
-  Serial.println("Picture taken! Size: " + String(fb->len) + " bytes");
-  
-  // Gửi ảnh lên server
-  if(WiFi.status() == WL_CONNECTED) {
-    HTTPClient http;
-    
-    // Tăng timeout cho kết nối
-    http.setTimeout(10000); // 10 giây
-    
-    // Kết nối đến server
-    Serial.println("Connecting to: " + String(serverUrl));
-    
-    if(http.begin(serverUrl)) {
-      http.addHeader("Content-Type", "image/jpeg");
-      
-      // POST ảnh binary
-      Serial.println("Sending image...");
-      int httpResponseCode = http.POST(fb->buf, fb->len);
-      
-      if (httpResponseCode > 0) {
-        String response = http.getString();
-        Serial.println("✓ Response code: " + String(httpResponseCode));
-        Serial.println("✓ Response: " + response);
-      } else {
-        Serial.println("✗ Error code: " + String(httpResponseCode));
-        
-        // In chi tiết lỗi
-        if(httpResponseCode == -1) {
-          Serial.println("  → Connection failed. Check:");
-          Serial.println("    1. Flask server is running (python app.py)");
-          Serial.println("    2. Server IP is correct: " + String(serverUrl));
-          Serial.println("    3. Firewall allows port 5000");
-          Serial.println("    4. ESP32 and server on same network");
-        }
-      }
-      
-      http.end();
-    } else {
-      Serial.println("✗ Unable to connect to server!");
-      Serial.println("  Check server URL: " + String(serverUrl));
-    }
-  } else {
-    Serial.println("WiFi not connected");
-  }
-  
-  // Giải phóng bộ nhớ
-  esp_camera_fb_return(fb);
-  
-  // Chờ 3 giây trước khi chụp ảnh tiếp theo
-  delay(3000);
+  captureBurst(t, &tap, haveTap);
 }
 
 /*
@@ -166,12 +1024,15 @@ void loop() {
  * 3. Kiểm tra serverUrl khớp với IP của máy chạy Flask (192.168.1.28:5000)
  * 4. Upload code lên ESP32-CAM
  * 5. Mở Serial Monitor để xem log
- * 6. ESP32-CAM sẽ tự động chụp và gửi ảnh mỗi 2 giây
+ * 6. Nối GPIO13 <- PB14 (CAM_TRIG), GPIO14 <- PA9 (USART1 TX), chung GND
+ * 7. Mỗi lần quẹt thẻ ESP32-CAM chụp và gửi 1 ảnh gắn UID + số lần quẹt
  * 
  * GIẢI THÍCH CÁCH GỬI ẢNH:
  * - ESP32-CAM chụp ảnh và lưu vào frame buffer (fb)
  * - Ảnh được encode thành JPEG tự động bởi camera
- * - HTTPClient POST ảnh binary trực tiếp (fb->buf, fb->len)
+ * - HTTPClient POST ảnh binary trực tiếp (fb->buf, fb->len), trên 1 kết
+ *   nối keep-alive giữ từ lần upload trước (Flask phải chạy threaded=True
+ *   để trả lời HTTP/1.1)
  * - Flask nhận binary data qua request.data
  * - OpenCV decode và nhận diện khuôn mặt
  * - Server trả về JSON với số khuôn mặt phát hiện được
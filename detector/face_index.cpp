@@ -0,0 +1,518 @@
+#include "face_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// Rows are padded to this many elements so the kernels need no tail loop
+constexpr int kPad = 32;
+// Rows scored against a whole query batch at a time (int8: 32 KB at 128-d)
+constexpr size_t kBlock = 256;
+
+int32_t dot_i8(const int8_t *a, const int8_t *b, int n) {
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < n; i += 16) {
+        __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a + i)));
+        __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_hadd_epi32(s, s);
+    s = _mm_hadd_epi32(s, s);
+    return _mm_cvtsi128_si32(s);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (int i = 0; i < n; i += 16) {
+        int8x16_t va = vld1q_s8(a + i);
+        int8x16_t vb = vld1q_s8(b + i);
+        acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+        acc = vpadalq_s16(acc, vmull_s8(vget_high_s8(va), vget_high_s8(vb)));
+    }
+    return vaddvq_s32(acc);
+#else
+    int32_t s = 0;
+    for (int i = 0; i < n; i++) {
+        s += a[i] * b[i];
+    }
+    return s;
+#endif
+}
+
+float dot_f32(const float *a, const float *b, int n) {
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 acc = _mm256_setzero_ps();
+    for (int i = 0; i < n; i += 8) {
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+    }
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_hadd_ps(s, s);
+    s = _mm_hadd_ps(s, s);
+    return _mm_cvtss_f32(s);
+#else
+    float s = 0;
+    for (int i = 0; i < n; i++) {
+        s += a[i] * b[i];
+    }
+    return s;
+#endif
+}
+
+// IEEE half <-> float, round to nearest even; rows are normalised, so no
+// infinities or NaNs to care about beyond keeping the exponent in range
+uint16_t to_half(float f) {
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exp = ((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+    if (exp <= 0) {
+        if (exp < -10) {
+            return sign;
+        }
+        mant |= 0x800000;
+        uint32_t shift = 14 - exp;
+        uint32_t h = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1))) {
+            h++;
+        }
+        return sign | h;
+    }
+    if (exp >= 31) {
+        return sign | 0x7bff;
+    }
+    uint32_t h = (exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+        h++;
+    }
+    return sign | h;
+}
+
+[[maybe_unused]] float from_half(uint16_t h) {
+    uint32_t sign = (h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if (exp == 0) {
+        if (!mant) {
+            x = sign;
+        } else {
+            exp = 127 - 15 + 1;
+            while (!(mant & 0x400)) {
+                mant <<= 1;
+                exp--;
+            }
+            x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else {
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &x, 4);
+    return f;
+}
+
+float dot_f16(const float *a, const uint16_t *b, int n) {
+#if defined(__AVX2__) && defined(__F16C__) && defined(__FMA__)
+    __m256 acc = _mm256_setzero_ps();
+    for (int i = 0; i < n; i += 8) {
+        __m256 vb = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(b + i)));
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), vb, acc);
+    }
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_hadd_ps(s, s);
+    s = _mm_hadd_ps(s, s);
+    return _mm_cvtss_f32(s);
+#else
+    float s = 0;
+    for (int i = 0; i < n; i++) {
+        s += a[i] * from_half(b[i]);
+    }
+    return s;
+#endif
+}
+
+// Normalised copy padded with zeros; false for a zero vector
+bool normalise(const float *v, int dim, int padded, float *out) {
+    double norm = 0;
+    for (int i = 0; i < dim; i++) {
+        norm += (double)v[i] * v[i];
+    }
+    if (norm <= 0) {
+        return false;
+    }
+    float inv = 1.0 / std::sqrt(norm);
+    for (int i = 0; i < dim; i++) {
+        out[i] = v[i] * inv;
+    }
+    std::fill(out + dim, out + padded, 0.0f);
+    return true;
+}
+
+// Symmetric per-vector quantisation; the dot of two rows is
+// dot_i8 * scale_a * scale_b
+float quantise(const float *v, int n, int8_t *out) {
+    float peak = 0;
+    for (int i = 0; i < n; i++) {
+        peak = std::max(peak, std::fabs(v[i]));
+    }
+    float scale = peak > 0 ? peak / 127 : 1;
+    for (int i = 0; i < n; i++) {
+        out[i] = (int8_t)std::lrint(v[i] / scale);
+    }
+    return scale;
+}
+
+// The k best (score, row) of one query, best first
+struct TopK {
+    int k;
+    int n = 0;
+    float *scores;
+    int64_t *rows;
+
+    void push(float score, int64_t row) {
+        if (n == k && score <= scores[k - 1]) {
+            return;
+        }
+        int i = n < k ? n++ : k - 1;
+        while (i > 0 && scores[i - 1] < score) {
+            scores[i] = scores[i - 1];
+            rows[i] = rows[i - 1];
+            i--;
+        }
+        scores[i] = score;
+        rows[i] = row;
+    }
+};
+
+using Scored = std::pair<float, uint32_t>;  // (distance 1 - cos, row)
+
+}  // namespace
+
+struct fi_index {
+    int dim;
+    int padded;
+    int kind;
+    std::shared_mutex lock;
+    std::vector<int64_t> labels;
+
+    std::vector<int8_t> rows_i8;
+    std::vector<float> scales;
+    std::vector<uint16_t> rows_f16;
+    std::vector<float> rows_f32;
+
+    // fi_attach_int8: rows, scales and labels live in the caller's memory
+    const int8_t *ext_rows = nullptr;
+    const float *ext_scales = nullptr;
+    const int64_t *ext_labels = nullptr;
+    size_t ext_n = 0;
+
+    // HNSW: links[row][level] are the row's neighbours on that level
+    int m = 16;
+    int ef_construction = 100;
+    double level_mult;
+    int entry = -1;
+    int top_level = -1;
+    std::vector<std::vector<std::vector<uint32_t>>> links;
+    std::mt19937 rng{12345};
+
+    size_t size() const { return ext_rows ? ext_n : labels.size(); }
+    int64_t label(size_t r) const { return ext_rows ? ext_labels[r] : labels[r]; }
+    const float *row_f32(uint32_t r) const { return &rows_f32[(size_t)r * padded]; }
+    float distance(const float *q, uint32_t r) const { return 1.0f - dot_f32(q, row_f32(r), padded); }
+
+    // Best ef rows for q on one level, nearest first, starting from eps
+    std::vector<Scored> search_level(const float *q, const std::vector<Scored> &eps, int ef, int level, std::vector<uint8_t> &seen) const {
+        std::priority_queue<Scored, std::vector<Scored>, std::greater<Scored>> candidates;
+        std::priority_queue<Scored> best;
+        for (const Scored &e : eps) {
+            seen[e.second] = 1;
+            candidates.push(e);
+            best.push(e);
+        }
+        while (!candidates.empty()) {
+            Scored c = candidates.top();
+            if (c.first > best.top().first && (int)best.size() >= ef) {
+                break;
+            }
+            candidates.pop();
+            for (uint32_t nb : links[c.second][level]) {
+                if (seen[nb]) {
+                    continue;
+                }
+                seen[nb] = 1;
+                float d = distance(q, nb);
+                if ((int)best.size() < ef || d < best.top().first) {
+                    candidates.push({d, nb});
+                    best.push({d, nb});
+                    if ((int)best.size() > ef) {
+                        best.pop();
+                    }
+                }
+            }
+        }
+        std::vector<Scored> out(best.size());
+        for (size_t i = out.size(); i-- > 0; best.pop()) {
+            out[i] = best.top();
+        }
+        return out;
+    }
+
+    // Greedy descent from the entry point down to level 1
+    std::vector<Scored> descend(const float *q, int to_level) const {
+        uint32_t cur = entry;
+        float d = distance(q, cur);
+        for (int level = top_level; level > to_level; level--) {
+            for (bool moved = true; moved;) {
+                moved = false;
+                for (uint32_t nb : links[cur][level]) {
+                    float nd = distance(q, nb);
+                    if (nd < d) {
+                        d = nd;
+                        cur = nb;
+                        moved = true;
+                    }
+                }
+            }
+        }
+        return {{d, cur}};
+    }
+
+    void shrink(uint32_t r, int level, size_t cap) {
+        std::vector<uint32_t> &nbs = links[r][level];
+        if (nbs.size() <= cap) {
+            return;
+        }
+        std::vector<Scored> scored;
+        for (uint32_t nb : nbs) {
+            scored.push_back({distance(row_f32(r), nb), nb});
+        }
+        std::partial_sort(scored.begin(), scored.begin() + cap, scored.end());
+        nbs.clear();
+        for (size_t i = 0; i < cap; i++) {
+            nbs.push_back(scored[i].second);
+        }
+    }
+
+    void hnsw_insert(uint32_t r) {
+        int level = (int)(-std::log(std::uniform_real_distribution<double>(1e-12, 1.0)(rng)) * level_mult);
+        links.emplace_back(level + 1);
+        if (entry < 0) {
+            entry = r;
+            top_level = level;
+            return;
+        }
+        const float *q = row_f32(r);
+        std::vector<Scored> eps = descend(q, level);
+        std::vector<uint8_t> seen(size());
+        for (int l = std::min(level, top_level); l >= 0; l--) {
+            std::fill(seen.begin(), seen.end(), 0);
+            std::vector<Scored> found = search_level(q, eps, ef_construction, l, seen);
+            size_t cap = l ? m : 2 * m;
+            for (size_t i = 0; i < found.size() && i < (size_t)m; i++) {
+                uint32_t nb = found[i].second;
+                links[r][l].push_back(nb);
+                links[nb][l].push_back(r);
+                shrink(nb, l, cap);
+            }
+            eps = found;
+        }
+        if (level > top_level) {
+            entry = r;
+            top_level = level;
+        }
+    }
+};
+
+fi_index_t *fi_create(int dim, int kind, int hnsw_m, int ef_construction) {
+    if (dim <= 0 || kind < FI_FLAT_INT8 || kind > FI_HNSW) {
+        return nullptr;
+    }
+    fi_index_t *index = new fi_index;
+    index->dim = dim;
+    index->padded = fi_padded(dim);
+    index->kind = kind;
+    if (hnsw_m > 1) {
+        index->m = hnsw_m;
+    }
+    if (ef_construction > 0) {
+        index->ef_construction = ef_construction;
+    }
+    index->level_mult = 1 / std::log((double)index->m);
+    return index;
+}
+
+fi_index_t *fi_attach_int8(int dim, int padded, int n, const int8_t *rows, const float *scales, const int64_t *labels) {
+    if (dim <= 0 || padded != fi_padded(dim) || n < 0 || (n > 0 && (!rows || !scales || !labels))) {
+        return nullptr;
+    }
+    fi_index_t *index = fi_create(dim, FI_FLAT_INT8, 0, 0);
+    index->ext_rows = rows;
+    index->ext_scales = scales;
+    index->ext_labels = labels;
+    index->ext_n = n;
+    return index;
+}
+
+int fi_padded(int dim) {
+    return (dim + kPad - 1) / kPad * kPad;
+}
+
+void fi_destroy(fi_index_t *index) {
+    delete index;
+}
+
+int fi_add(fi_index_t *index, int64_t label, const float *vec) {
+    if (!index || !vec || index->ext_rows) {
+        return FI_BAD_ARG;
+    }
+    std::vector<float> v(index->padded);
+    if (!normalise(vec, index->dim, index->padded, v.data())) {
+        return FI_BAD_ARG;
+    }
+    std::unique_lock<std::shared_mutex> guard(index->lock);
+    uint32_t r = index->size();
+    switch (index->kind) {
+    case FI_FLAT_INT8:
+        index->rows_i8.resize((size_t)(r + 1) * index->padded);
+        index->scales.push_back(quantise(v.data(), index->padded, &index->rows_i8[(size_t)r * index->padded]));
+        break;
+    case FI_FLAT_F16:
+        for (float f : v) {
+            index->rows_f16.push_back(to_half(f));
+        }
+        break;
+    case FI_HNSW:
+        index->rows_f32.insert(index->rows_f32.end(), v.begin(), v.end());
+        break;
+    }
+    index->labels.push_back(label);
+    if (index->kind == FI_HNSW) {
+        index->hnsw_insert(r);
+    }
+    return r;
+}
+
+int fi_search(fi_index_t *index, const float *queries, int nq, int k, int ef, int64_t *labels, float *scores) {
+    if (!index || !queries || nq < 0 || k <= 0 || !labels || !scores) {
+        return FI_BAD_ARG;
+    }
+    const int padded = index->padded;
+    std::vector<float> q((size_t)nq * padded);
+    std::vector<uint8_t> valid(nq);
+    for (int i = 0; i < nq; i++) {
+        valid[i] = normalise(queries + (size_t)i * index->dim, index->dim, padded, &q[(size_t)i * padded]);
+    }
+    std::vector<int64_t> rows((size_t)nq * k);
+    std::vector<TopK> top;
+    for (int i = 0; i < nq; i++) {
+        top.push_back({k, 0, scores + (size_t)i * k, rows.data() + (size_t)i * k});
+    }
+
+    std::shared_lock<std::shared_mutex> guard(index->lock);
+    const size_t n = index->size();
+    switch (index->kind) {
+    case FI_FLAT_INT8: {
+        std::vector<int8_t> qi((size_t)nq * padded);
+        std::vector<float> qs(nq);
+        for (int i = 0; i < nq; i++) {
+            qs[i] = quantise(&q[(size_t)i * padded], padded, &qi[(size_t)i * padded]);
+        }
+        const int8_t *rows_i8 = index->ext_rows ? index->ext_rows : index->rows_i8.data();
+        const float *row_scales = index->ext_rows ? index->ext_scales : index->scales.data();
+        for (size_t r0 = 0; r0 < n; r0 += kBlock) {
+            size_t r1 = std::min(n, r0 + kBlock);
+            for (int i = 0; i < nq; i++) {
+                if (!valid[i]) {
+                    continue;
+                }
+                for (size_t r = r0; r < r1; r++) {
+                    int32_t d = dot_i8(&qi[(size_t)i * padded], &rows_i8[r * padded], padded);
+                    top[i].push(d * qs[i] * row_scales[r], r);
+                }
+            }
+        }
+        break;
+    }
+    case FI_FLAT_F16:
+        for (size_t r0 = 0; r0 < n; r0 += kBlock) {
+            size_t r1 = std::min(n, r0 + kBlock);
+            for (int i = 0; i < nq; i++) {
+                if (!valid[i]) {
+                    continue;
+                }
+                for (size_t r = r0; r < r1; r++) {
+                    top[i].push(dot_f16(&q[(size_t)i * padded], &index->rows_f16[r * padded], padded), r);
+                }
+            }
+        }
+        break;
+    case FI_HNSW:
+        if (index->entry >= 0) {
+            ef = std::max(ef > 0 ? ef : 64, k);
+            std::vector<uint8_t> seen(n);
+            for (int i = 0; i < nq; i++) {
+                if (!valid[i]) {
+                    continue;
+                }
+                std::fill(seen.begin(), seen.end(), 0);
+                const float *qv = &q[(size_t)i * padded];
+                for (const Scored &s : index->search_level(qv, index->descend(qv, 0), ef, 0, seen)) {
+                    top[i].push(1.0f - s.first, s.second);
+                }
+            }
+        }
+        break;
+    }
+
+    for (int i = 0; i < nq; i++) {
+        for (int j = 0; j < k; j++) {
+            bool hit = j < top[i].n;
+            labels[(size_t)i * k + j] = hit ? index->label(rows[(size_t)i * k + j]) : -1;
+            if (!hit) {
+                scores[(size_t)i * k + j] = -1;
+            }
+        }
+    }
+    return (int)std::min<size_t>(k, n);
+}
+
+int fi_size(fi_index_t *index) {
+    if (!index) {
+        return 0;
+    }
+    std::shared_lock<std::shared_mutex> guard(index->lock);
+    return index->size();
+}
+
+uint64_t fi_memory(fi_index_t *index) {
+    if (!index) {
+        return 0;
+    }
+    std::shared_lock<std::shared_mutex> guard(index->lock);
+    uint64_t bytes = index->rows_i8.size() + index->scales.size() * sizeof(float) + index->rows_f16.size() * sizeof(uint16_t) +
+                     index->rows_f32.size() * sizeof(float) + index->labels.size() * sizeof(int64_t);
+    for (const auto &levels : index->links) {
+        for (const auto &nbs : levels) {
+            bytes += nbs.size() * sizeof(uint32_t);
+        }
+    }
+    return bytes;
+}
@@ -0,0 +1,74 @@
+// In-memory index of enrolled face embeddings for app.py (loaded through
+// face_index.py).
+//
+// Vectors are L2-normalised on the way in, and a search returns the k rows
+// with the highest cosine similarity to each query. Three layouts:
+//
+//   FI_FLAT_INT8  every row quantised to int8 with its own scale; a query
+//                 is one pass over the rows with an int8 dot product
+//                 (AVX2 / NEON when built for them). 128-d SFace rows take
+//                 128 bytes, so a few thousand students fit in L2.
+//   FI_FLAT_F16   the same scan over float16 rows (F16C), for when int8
+//                 rounding moves scores near the match threshold.
+//   FI_HNSW       float rows in a hierarchical navigable small-world graph;
+//                 a query visits O(log n) rows instead of all of them, for
+//                 campuses where the flat scan stops being cheap.
+//
+// Queries are batched: the flat scan walks the rows in blocks and scores
+// the whole batch against a block while it is still in cache, so a batch of
+// faces from one frame costs little more than one face. Searches take a
+// shared lock and may run from several threads; fi_add is exclusive.
+//
+// fi_attach_int8 wraps FI_FLAT_INT8 rows that already sit in memory the
+// caller owns (the mmap'd enrolment file of tools/enroll_build.py): nothing
+// is copied, so opening a large roster costs no time and every server
+// process mapping the file shares the same pages.
+//
+//   g++ -O3 -march=native -std=c++17 -shared -fPIC -o detector/libface_index.so
+//       detector/face_index.cpp -pthread                          (one line)
+#ifndef FACE_INDEX_H
+#define FACE_INDEX_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FI_FLAT_INT8 0
+#define FI_FLAT_F16  1
+#define FI_HNSW      2
+
+#define FI_BAD_ARG -2
+
+typedef struct fi_index fi_index_t;
+
+// hnsw_m (links per node) and ef_construction only matter for FI_HNSW;
+// <= 0 picks 16 and 100. NULL on a bad dim or kind.
+fi_index_t *fi_create(int dim, int kind, int hnsw_m, int ef_construction);
+// Read-only FI_FLAT_INT8 index over n caller-owned rows of padded int8
+// (fi_padded(dim) bytes each, as fi_add would quantise them), one scale and
+// one label per row. The arrays must outlive the index; fi_add on it
+// returns FI_BAD_ARG. NULL when padded is not fi_padded(dim).
+fi_index_t *fi_attach_int8(int dim, int padded, int n, const int8_t *rows, const float *scales, const int64_t *labels);
+void fi_destroy(fi_index_t *index);
+// Row length the layouts pad dim to
+int fi_padded(int dim);
+// Adds one dim-float vector under label (several rows may share a label,
+// e.g. more than one enrolment photo); the row number, or FI_BAD_ARG for a
+// zero vector
+int fi_add(fi_index_t *index, int64_t label, const float *vec);
+// nq queries of dim floats, k results each into labels / scores (nq * k,
+// best first, label -1 past the end of a small index). ef is the HNSW
+// search breadth (<= 0: 64, raised to k); ignored by the flat layouts.
+// Returns the results per query, min(k, rows).
+int fi_search(fi_index_t *index, const float *queries, int nq, int k, int ef, int64_t *labels, float *scores);
+int fi_size(fi_index_t *index);
+// Bytes held by rows and graph links, for /status (0 for attached rows)
+uint64_t fi_memory(fi_index_t *index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
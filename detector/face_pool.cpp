@@ -0,0 +1,187 @@
+#include "face_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/objdetect.hpp>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+uint64_t us_since(Clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t).count();
+}
+
+struct Job {
+    cv::Mat gray;               // Wraps the caller's buffer
+    int min_size;
+    fp_box_t *boxes;
+    int max_boxes;
+    Clock::time_point queued;
+    std::promise<int> done;
+};
+
+struct Worker {
+    cv::CascadeClassifier cascade;
+    std::thread thread;
+    std::atomic<uint64_t> jobs{0};
+    std::atomic<uint64_t> busy_us{0};
+};
+
+}  // namespace
+
+struct fp_pool {
+    // Bounded ring of waiting jobs, shared by all producers and workers
+    std::mutex lock;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::vector<Job *> ring;
+    size_t head = 0;
+    size_t count = 0;
+    bool stopping = false;
+
+    std::vector<Worker> workers;
+    double scale;
+    int neighbors;
+    int min_size;
+    Clock::time_point started;
+
+    uint32_t peak = 0;
+    uint64_t submitted = 0;
+    uint64_t completed = 0;
+    uint64_t rejected = 0;
+    uint64_t wait_us = 0;
+
+    fp_pool(size_t n, size_t capacity) : ring(capacity), workers(n), started(Clock::now()) {}
+};
+
+static void worker_run(fp_pool_t *pool, Worker *w) {
+    while (true) {
+        Job *job;
+        {
+            std::unique_lock<std::mutex> guard(pool->lock);
+            pool->not_empty.wait(guard, [pool] { return pool->count || pool->stopping; });
+            if (!pool->count) {
+                return;
+            }
+            job = pool->ring[pool->head];
+            pool->head = (pool->head + 1) % pool->ring.size();
+            pool->count--;
+            pool->wait_us += us_since(job->queued);
+        }
+        pool->not_full.notify_one();
+
+        Clock::time_point t0 = Clock::now();
+        std::vector<cv::Rect> faces;
+        w->cascade.detectMultiScale(job->gray, faces, pool->scale, pool->neighbors, 0, cv::Size(job->min_size, job->min_size));
+        for (size_t i = 0; i < faces.size() && (int)i < job->max_boxes; i++) {
+            job->boxes[i] = {faces[i].x, faces[i].y, faces[i].width, faces[i].height};
+        }
+        w->busy_us += us_since(t0);
+        w->jobs++;
+        {
+            std::lock_guard<std::mutex> guard(pool->lock);
+            pool->completed++;
+        }
+        job->done.set_value((int)faces.size());
+    }
+}
+
+fp_pool_t *fp_create(const char *cascade_path, int workers, int queue_capacity, double scale, int neighbors, int min_size) {
+    if (!cascade_path || workers < 1 || queue_capacity < 1) {
+        return nullptr;
+    }
+    fp_pool_t *pool = new fp_pool(workers, queue_capacity);
+    pool->scale = scale;
+    pool->neighbors = neighbors;
+    pool->min_size = min_size;
+    for (Worker &w : pool->workers) {
+        if (!w.cascade.load(cascade_path)) {
+            delete pool;
+            return nullptr;
+        }
+    }
+    // Parallelism comes from the workers; OpenCV's own threads would only
+    // compete with them for the same cores
+    cv::setNumThreads(1);
+    for (Worker &w : pool->workers) {
+        w.thread = std::thread(worker_run, pool, &w);
+    }
+    return pool;
+}
+
+void fp_destroy(fp_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->stopping = true;
+    }
+    pool->not_empty.notify_all();
+    for (Worker &w : pool->workers) {
+        w.thread.join();
+    }
+    delete pool;
+}
+
+int fp_detect_gray(fp_pool_t *pool, const uint8_t *gray, int width, int height, int stride, int min_size, int wait_ms, fp_box_t *boxes, int max_boxes) {
+    if (!pool || !gray || width <= 0 || height <= 0 || stride < width || (max_boxes > 0 && !boxes)) {
+        return FP_BAD_ARG;
+    }
+    Job job;
+    job.gray = cv::Mat(height, width, CV_8UC1, const_cast<uint8_t *>(gray), stride);
+    job.min_size = min_size > 0 ? min_size : pool->min_size;
+    job.boxes = boxes;
+    job.max_boxes = max_boxes;
+    std::future<int> result = job.done.get_future();
+    {
+        std::unique_lock<std::mutex> guard(pool->lock);
+        size_t cap = pool->ring.size();
+        if (!pool->not_full.wait_for(guard, std::chrono::milliseconds(wait_ms), [pool, cap] { return pool->count < cap || pool->stopping; })
+            || pool->stopping) {
+            pool->rejected++;
+            return FP_BUSY;
+        }
+        job.queued = Clock::now();
+        pool->ring[(pool->head + pool->count) % cap] = &job;
+        pool->count++;
+        pool->submitted++;
+        if (pool->count > pool->peak) {
+            pool->peak = pool->count;
+        }
+    }
+    pool->not_empty.notify_one();
+    // The job lives on this stack until the worker has answered
+    return result.get();
+}
+
+int fp_stats(fp_pool_t *pool, fp_stats_t *stats, fp_worker_stats_t *workers, int max_workers) {
+    if (!pool) {
+        return 0;
+    }
+    if (stats) {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        stats->workers = pool->workers.size();
+        stats->queue_capacity = pool->ring.size();
+        stats->queue_depth = pool->count;
+        stats->queue_peak = pool->peak;
+        stats->submitted = pool->submitted;
+        stats->completed = pool->completed;
+        stats->rejected = pool->rejected;
+        stats->wait_us = pool->wait_us;
+        stats->uptime_us = us_since(pool->started);
+    }
+    for (int i = 0; workers && i < max_workers && i < (int)pool->workers.size(); i++) {
+        workers[i].jobs = pool->workers[i].jobs;
+        workers[i].busy_us = pool->workers[i].busy_us;
+    }
+    return pool->workers.size();
+}
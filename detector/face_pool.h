@@ -0,0 +1,65 @@
+// Face detection worker pool for app.py (loaded through face_pool.py).
+//
+// Every worker thread owns its own cv::CascadeClassifier, so detections run
+// in parallel without sharing classifier state, and the calling Python
+// thread waits with the GIL released (ctypes drops it for the call). Jobs
+// go through one bounded MPMC queue: any number of request threads push,
+// the workers pop. When it stays full for wait_ms the call returns
+// FP_BUSY and the caller decides what to do with the frame.
+//
+//   g++ -O2 -std=c++17 -shared -fPIC -o detector/libface_pool.so
+//       detector/face_pool.cpp $(pkg-config --cflags --libs opencv4) -pthread
+//                                                            (one line)
+#ifndef FACE_POOL_H
+#define FACE_POOL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FP_BUSY    -1   // Queue full for wait_ms
+#define FP_BAD_ARG -2
+
+typedef struct fp_pool fp_pool_t;
+
+typedef struct {
+    int32_t x, y, w, h;
+} fp_box_t;
+
+typedef struct {
+    uint32_t workers;
+    uint32_t queue_capacity;
+    uint32_t queue_depth;       // Jobs waiting now
+    uint32_t queue_peak;        // Most jobs ever waiting at once
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t rejected;          // FP_BUSY answers
+    uint64_t wait_us;           // Time jobs spent queued, all jobs
+    uint64_t uptime_us;
+} fp_stats_t;
+
+typedef struct {
+    uint64_t jobs;
+    uint64_t busy_us;           // Utilisation is busy_us / uptime_us
+} fp_worker_stats_t;
+
+// Loads one classifier per worker; NULL when the cascade cannot be read.
+// scale, neighbors and min_size are detectMultiScale's parameters.
+fp_pool_t *fp_create(const char *cascade_path, int workers, int queue_capacity, double scale, int neighbors, int min_size);
+// Waits for the queued jobs, then stops the workers
+void fp_destroy(fp_pool_t *pool);
+// Faces in an 8-bit grayscale image of width x height (row stride in
+// bytes), none smaller than min_size (<= 0: the pool's). Blocks until a
+// worker is done with it; the image is not copied. Returns the face count,
+// of which at most max_boxes are stored.
+int fp_detect_gray(fp_pool_t *pool, const uint8_t *gray, int width, int height, int stride, int min_size, int wait_ms, fp_box_t *boxes, int max_boxes);
+// Fills up to max_workers per-worker entries; returns the worker count
+int fp_stats(fp_pool_t *pool, fp_stats_t *stats, fp_worker_stats_t *workers, int max_workers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
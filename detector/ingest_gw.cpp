@@ -0,0 +1,841 @@
+#include "ingest_gw.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t MAX_HEADER = 16 * 1024;    // Request line or boundary plus header lines
+constexpr size_t READ_CHUNK = 64 * 1024;
+constexpr int READS_PER_EVENT = 4;          // Then the next ready connection gets its turn
+constexpr int IDLE_S = 120;                 // Connection with nothing in flight closed after this
+constexpr int MAX_EVENTS = 256;
+
+// epoll_event.data of the fds that are not connections
+constexpr uint64_t ID_LISTEN_UPLOAD = 1;
+constexpr uint64_t ID_LISTEN_INGEST = 2;
+constexpr uint64_t ID_WAKE = 3;
+constexpr uint64_t ID_FIRST_CONN = 16;
+
+uint64_t us_since(Clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t).count();
+}
+
+int64_t epoch_us() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// ig_frame_t first and plain members only, so ig_reply can turn the pointer
+// it gets back into the Frame. Header lines and body share one allocation.
+struct Frame {
+    ig_frame_t pub;
+    char *data;
+    bool keep_alive;
+};
+
+struct Reply {
+    uint64_t conn;
+    bool keep_alive;
+    std::string bytes;
+};
+
+struct Conn {
+    int fd;
+    uint64_t id;
+    int kind;
+    uint32_t peer;
+    std::string in;
+    std::string out;
+    size_t out_off = 0;
+    uint32_t events = 0;        // Registered with epoll
+    // Part being received: header block parsed, body not yet complete
+    size_t head_len = 0;        // Up to and including the blank line, 0: not parsed
+    size_t hdr_off = 0;         // Header lines within in
+    size_t hdr_len = 0;
+    size_t body_len = 0;
+    long long seq = -1;         // X-Seq of a stream part, for a "dropped" answer
+    bool keep_alive = true;
+    bool awaiting = false;      // /upload handed on, response not written yet
+    bool closing = false;       // Close once out is written
+    bool eof = false;           // Peer shut down its side
+    uint32_t in_flight = 0;     // Frames handed on and not answered
+    Clock::time_point last;
+};
+
+// What the loop needs from a header block
+struct Head {
+    long long length = -1;
+    long long seq = -1;
+    bool conn_close = false;
+    bool conn_keep_alive = false;
+    bool expect_continue = false;
+    bool chunked = false;
+    bool form = false;          // JSON or multipart: Flask's /upload handles those
+};
+
+bool iequals(std::string_view a, const char *b) {
+    return a.size() == strlen(b) && !strncasecmp(a.data(), b, a.size());
+}
+
+bool icontains(std::string_view a, const char *b) {
+    size_t n = strlen(b);
+    for (size_t i = 0; i + n <= a.size(); i++) {
+        if (!strncasecmp(a.data() + i, b, n)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_number(std::string_view v, long long *out) {
+    if (v.empty() || v.size() > 15) {
+        return false;
+    }
+    long long n = 0;
+    for (char c : v) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        n = n * 10 + (c - '0');
+    }
+    *out = n;
+    return true;
+}
+
+// "Name: value\r\n" lines; false on a line without a colon or a bad number
+bool parse_head(std::string_view lines, Head *h) {
+    while (!lines.empty()) {
+        size_t eol = lines.find("\r\n");
+        std::string_view line = lines.substr(0, eol);
+        lines = eol == std::string_view::npos ? std::string_view() : lines.substr(eol + 2);
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos) {
+            return false;
+        }
+        std::string_view name = line.substr(0, colon);
+        std::string_view value = line.substr(colon + 1);
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+            value.remove_prefix(1);
+        }
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+            value.remove_suffix(1);
+        }
+        if (iequals(name, "Content-Length")) {
+            if (!parse_number(value, &h->length)) {
+                return false;
+            }
+        } else if (iequals(name, "X-Seq")) {
+            parse_number(value, &h->seq);
+        } else if (iequals(name, "Transfer-Encoding")) {
+            h->chunked = true;
+        } else if (iequals(name, "Connection")) {
+            h->conn_close |= icontains(value, "close");
+            h->conn_keep_alive |= icontains(value, "keep-alive");
+        } else if (iequals(name, "Expect")) {
+            h->expect_continue |= icontains(value, "100-continue");
+        } else if (iequals(name, "Content-Type")) {
+            h->form = icontains(value, "application/json") || icontains(value, "multipart/");
+        }
+    }
+    return true;
+}
+
+const char *reason(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 415: return "Unsupported Media Type";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "Unknown";
+    }
+}
+
+std::string http_response(int status, const char *body, size_t len, bool keep_alive) {
+    char head[192];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n",
+                     status, reason(status), len, keep_alive ? "keep-alive" : "close");
+    std::string out(head, n);
+    out.append(body, len);
+    return out;
+}
+
+std::string error_json(const char *message) {
+    return std::string("{\"status\": \"error\", \"message\": \"") + message + "\"}";
+}
+
+int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in sa = {};
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(port);
+    if (bind(fd, (sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+}  // namespace
+
+struct ig_gateway {
+    int ep = -1;
+    int wake = -1;
+    int listen_fd[2] = {-1, -1};    // IG_UPLOAD, IG_INGEST
+    int spare_fd = -1;              // Given up to accept and drop a connection when out of fds
+    size_t max_body;
+    size_t max_conns;
+    std::thread thread;
+    std::atomic<bool> stopping{false};
+    Clock::time_point started;
+
+    // Loop thread only
+    std::unordered_map<uint64_t, Conn *> conns;
+    uint64_t next_id = ID_FIRST_CONN;
+    std::vector<char> scratch;
+
+    // Complete frames for ig_next
+    std::mutex lock;
+    std::condition_variable not_empty;
+    std::condition_variable no_waiters;
+    std::deque<Frame *> queue;
+    size_t capacity;
+    uint32_t peak = 0;
+    int waiters = 0;
+
+    // Answers from ig_reply, written by the loop
+    std::mutex reply_lock;
+    std::vector<Reply> replies;
+
+    std::atomic<uint32_t> connections{0};
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> refused{0};
+    std::atomic<uint64_t> uploads{0};
+    std::atomic<uint64_t> parts{0};
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> bad_requests{0};
+    std::atomic<uint64_t> replied{0};
+    std::atomic<uint64_t> orphaned{0};
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+
+    void run();
+    void accept_all(int kind);
+    void close_conn(Conn *c);
+    bool flush(Conn *c);
+    void update_events(Conn *c);
+    void on_readable(Conn *c);
+    void parse(Conn *c);
+    void parse_upload(Conn *c);
+    void parse_ingest(Conn *c);
+    void hand_on(Conn *c, long long seq);
+    void deliver();
+    void sweep();
+};
+
+void ig_gateway::close_conn(Conn *c) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, nullptr);
+    close(c->fd);
+    conns.erase(c->id);
+    connections--;
+    delete c;
+}
+
+void ig_gateway::update_events(Conn *c) {
+    // Stop reading while an /upload waits for Python with a request's worth
+    // buffered behind it; EOF would keep a level-triggered fd ready forever
+    size_t limit = c->kind == IG_UPLOAD && c->awaiting ? MAX_HEADER + max_body : SIZE_MAX;
+    uint32_t events = 0;
+    if (!c->eof && !c->closing && c->in.size() < limit) {
+        events |= EPOLLIN;
+    }
+    if (c->out_off < c->out.size()) {
+        events |= EPOLLOUT;
+    }
+    if (events != c->events) {
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.u64 = c->id;
+        epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+}
+
+// Writes what it can of out; false when the connection is gone
+bool ig_gateway::flush(Conn *c) {
+    while (c->out_off < c->out.size()) {
+        ssize_t n = send(c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off, MSG_NOSIGNAL);
+        if (n > 0) {
+            c->out_off += n;
+            bytes_out += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            close_conn(c);
+            return false;
+        }
+    }
+    if (c->out_off == c->out.size()) {
+        c->out.clear();
+        c->out_off = 0;
+        if (c->closing || (c->eof && !c->in_flight)) {
+            close_conn(c);
+            return false;
+        }
+    }
+    update_events(c);
+    return true;
+}
+
+void ig_gateway::accept_all(int kind) {
+    for (;;) {
+        sockaddr_in sa;
+        socklen_t len = sizeof(sa);
+        int fd = accept4(listen_fd[kind], (sockaddr *)&sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if ((errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+                // Take the pending connection off the backlog, else the
+                // listener stays ready and the loop spins on it
+                close(spare_fd);
+                fd = accept(listen_fd[kind], nullptr, nullptr);
+                if (fd >= 0) {
+                    close(fd);
+                }
+                spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                refused++;
+                continue;
+            }
+            return;
+        }
+        if (conns.size() >= max_conns) {
+            close(fd);
+            refused++;
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        Conn *c = new Conn;
+        c->fd = fd;
+        c->id = next_id++;
+        c->kind = kind;
+        c->peer = sa.sin_addr.s_addr;
+        c->last = Clock::now();
+        c->events = EPOLLIN;
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = c->id;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            delete c;
+            refused++;
+            continue;
+        }
+        conns[c->id] = c;
+        connections++;
+        accepted++;
+    }
+}
+
+// Queues the part whose header block is parsed and whose body is complete,
+// or answers it here when the queue is full
+void ig_gateway::hand_on(Conn *c, long long seq) {
+    size_t total = c->head_len + c->body_len;
+    Frame *f = new Frame;
+    f->data = (char *)malloc(c->hdr_len + c->body_len + 1);
+    memcpy(f->data, c->in.data() + c->hdr_off, c->hdr_len);
+    memcpy(f->data + c->hdr_len, c->in.data() + c->head_len, c->body_len);
+    f->keep_alive = c->keep_alive;
+    f->pub.conn = c->id;
+    f->pub.kind = c->kind;
+    f->pub.peer = c->peer;
+    f->pub.recv_us = epoch_us();
+    f->pub.headers = f->data;
+    f->pub.headers_len = c->hdr_len;
+    f->pub.body = (const uint8_t *)f->data + c->hdr_len;
+    f->pub.body_len = c->body_len;
+    c->in.erase(0, total);
+    c->head_len = 0;
+
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> g(lock);
+        if (queue.size() < capacity) {
+            queue.push_back(f);
+            if (queue.size() > peak) {
+                peak = queue.size();
+            }
+            queued = true;
+        }
+    }
+    if (queued) {
+        not_empty.notify_one();
+        c->in_flight++;
+        if (c->kind == IG_UPLOAD) {
+            c->awaiting = true;
+            uploads++;
+        } else {
+            parts++;
+        }
+        return;
+    }
+    rejected++;
+    free(f->data);
+    delete f;
+    if (c->kind == IG_UPLOAD) {
+        std::string body = "{\"status\": \"dropped\", \"message\": \"Gateway queue full\"}";
+        c->out += http_response(503, body.data(), body.size(), c->keep_alive);
+        c->closing |= !c->keep_alive;
+    } else {
+        char line[128];
+        int n = seq >= 0 ? snprintf(line, sizeof(line), "{\"status\": \"dropped\", \"message\": \"Gateway queue full\", \"seq\": %lld}\n", seq)
+                         : snprintf(line, sizeof(line), "{\"status\": \"dropped\", \"message\": \"Gateway queue full\", \"seq\": null}\n");
+        c->out.append(line, n);
+    }
+}
+
+void ig_gateway::parse_upload(Conn *c) {
+    while (!c->awaiting && !c->closing) {
+        if (!c->head_len) {
+            // Stray CRLFs between requests are allowed
+            size_t skip = 0;
+            while (skip + 1 < c->in.size() && c->in[skip] == '\r' && c->in[skip + 1] == '\n') {
+                skip += 2;
+            }
+            c->in.erase(0, skip);
+            size_t end = c->in.find("\r\n\r\n");
+            auto fail = [&](int status, const char *message) {
+                std::string body = error_json(message);
+                c->out += http_response(status, body.data(), body.size(), false);
+                c->closing = true;
+                bad_requests++;
+            };
+            if (end == std::string::npos) {
+                if (c->in.size() > MAX_HEADER) {
+                    fail(431, "Request header too large");
+                }
+                return;
+            }
+            if (end > MAX_HEADER) {
+                fail(431, "Request header too large");
+                return;
+            }
+            std::string_view block(c->in.data(), end + 2);
+            size_t eol = block.find("\r\n");
+            std::string_view line = block.substr(0, eol);
+            size_t sp1 = line.find(' ');
+            size_t sp2 = sp1 == std::string_view::npos ? sp1 : line.find(' ', sp1 + 1);
+            if (sp2 == std::string_view::npos) {
+                fail(400, "Bad request line");
+                return;
+            }
+            std::string_view method = line.substr(0, sp1);
+            std::string_view target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+            std::string_view version = line.substr(sp2 + 1);
+            target = target.substr(0, target.find('?'));
+            Head h;
+            if (!parse_head(block.substr(eol + 2), &h)) {
+                fail(400, "Bad header line");
+                return;
+            }
+            c->keep_alive = version == "HTTP/1.1" ? !h.conn_close : h.conn_keep_alive && !h.conn_close;
+            if (target != "/upload") {
+                fail(404, "Only POST /upload is served on this port");
+                return;
+            }
+            if (method != "POST") {
+                fail(405, "Method not allowed");
+                return;
+            }
+            if (h.chunked || h.length < 0) {
+                fail(411, "Content-Length required");
+                return;
+            }
+            if ((size_t)h.length > max_body) {
+                fail(413, "Image too large");
+                return;
+            }
+            if (h.form) {
+                fail(415, "JSON and form uploads go to the Flask /upload");
+                return;
+            }
+            c->hdr_off = eol + 2;
+            c->hdr_len = end + 2 - c->hdr_off;
+            c->head_len = end + 4;
+            c->body_len = h.length;
+            if (h.expect_continue && c->in.size() < c->head_len + c->body_len) {
+                static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                c->out.append(cont, sizeof(cont) - 1);
+            }
+        }
+        if (c->in.size() < c->head_len + c->body_len) {
+            return;
+        }
+        hand_on(c, -1);
+    }
+}
+
+void ig_gateway::parse_ingest(Conn *c) {
+    while (!c->closing) {
+        if (!c->head_len) {
+            // Parts are separated by the CRLF after each body
+            size_t skip = 0;
+            while (skip < c->in.size() && (c->in[skip] == '\r' || c->in[skip] == '\n')) {
+                skip++;
+            }
+            c->in.erase(0, skip);
+            size_t end = c->in.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                if (c->in.size() > MAX_HEADER) {
+                    c->closing = true;
+                    bad_requests++;
+                }
+                return;
+            }
+            std::string_view block(c->in.data(), end + 2);
+            size_t eol = block.find("\r\n");
+            Head h;
+            if (end > MAX_HEADER || block.substr(0, 2) != "--" || !parse_head(block.substr(eol + 2), &h) || h.length < 0 ||
+                (size_t)h.length > max_body) {
+                // Same as IngestHandler: a stream out of step is closed
+                c->closing = true;
+                bad_requests++;
+                return;
+            }
+            c->hdr_off = eol + 2;
+            c->hdr_len = end + 2 - c->hdr_off;
+            c->head_len = end + 4;
+            c->body_len = h.length;
+            c->seq = h.seq;
+        }
+        if (c->in.size() < c->head_len + c->body_len) {
+            return;
+        }
+        hand_on(c, c->seq);
+    }
+}
+
+void ig_gateway::parse(Conn *c) {
+    if (c->kind == IG_UPLOAD) {
+        parse_upload(c);
+    } else {
+        parse_ingest(c);
+    }
+}
+
+void ig_gateway::on_readable(Conn *c) {
+    for (int i = 0; i < READS_PER_EVENT; i++) {
+        ssize_t n = recv(c->fd, scratch.data(), scratch.size(), 0);
+        if (n > 0) {
+            c->in.append(scratch.data(), n);
+            bytes_in += n;
+            if ((size_t)n < scratch.size()) {
+                break;
+            }
+        } else if (n == 0) {
+            c->eof = true;
+            break;
+        } else if (errno == EINTR) {
+            i--;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            close_conn(c);
+            return;
+        }
+    }
+    c->last = Clock::now();
+    parse(c);
+    flush(c);
+}
+
+void ig_gateway::deliver() {
+    std::vector<Reply> batch;
+    {
+        std::lock_guard<std::mutex> g(reply_lock);
+        batch.swap(replies);
+    }
+    for (Reply &r : batch) {
+        auto it = conns.find(r.conn);
+        if (it == conns.end()) {
+            orphaned += !r.bytes.empty();
+            continue;
+        }
+        Conn *c = it->second;
+        c->in_flight--;
+        c->out += r.bytes;
+        c->last = Clock::now();
+        replied += !r.bytes.empty();
+        if (c->kind == IG_UPLOAD) {
+            c->awaiting = false;
+            if (!r.keep_alive) {
+                c->closing = true;
+            } else {
+                parse(c);   // Next request may already be buffered
+            }
+        }
+        flush(c);
+    }
+}
+
+void ig_gateway::sweep() {
+    std::vector<Conn *> idle;
+    for (auto &it : conns) {
+        Conn *c = it.second;
+        if (!c->in_flight && c->out.empty() && std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - c->last).count() >= IDLE_S) {
+            idle.push_back(c);
+        }
+    }
+    for (Conn *c : idle) {
+        close_conn(c);
+    }
+}
+
+void ig_gateway::run() {
+    epoll_event events[MAX_EVENTS];
+    Clock::time_point swept = Clock::now();
+    while (!stopping) {
+        int n = epoll_wait(ep, events, MAX_EVENTS, 1000);
+        for (int i = 0; i < n; i++) {
+            uint64_t id = events[i].data.u64;
+            if (id == ID_WAKE) {
+                uint64_t v;
+                ssize_t r = read(wake, &v, sizeof(v));
+                (void)r;
+                deliver();
+                continue;
+            }
+            if (id == ID_LISTEN_UPLOAD || id == ID_LISTEN_INGEST) {
+                accept_all(id == ID_LISTEN_UPLOAD ? IG_UPLOAD : IG_INGEST);
+                continue;
+            }
+            // Closed earlier in this batch
+            auto it = conns.find(id);
+            if (it == conns.end()) {
+                continue;
+            }
+            Conn *c = it->second;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                on_readable(c);
+                // on_readable may have closed it
+                if (!conns.count(id)) {
+                    continue;
+                }
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush(c);
+            }
+        }
+        if (Clock::now() - swept >= std::chrono::seconds(1)) {
+            swept = Clock::now();
+            sweep();
+        }
+    }
+}
+
+extern "C" {
+
+ig_gateway_t *ig_create(int upload_port, int ingest_port, int queue_capacity, int max_body, int max_conns) {
+    if (queue_capacity < 1 || max_body < 1 || max_conns < 1 || (upload_port <= 0 && ingest_port <= 0)) {
+        return nullptr;
+    }
+    ig_gateway *gw = new ig_gateway;
+    gw->capacity = queue_capacity;
+    gw->max_body = max_body;
+    gw->max_conns = max_conns;
+    gw->scratch.resize(READ_CHUNK);
+    gw->started = Clock::now();
+    gw->ep = epoll_create1(EPOLL_CLOEXEC);
+    gw->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    gw->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    bool ok = gw->ep >= 0 && gw->wake >= 0;
+    int ports[2] = {upload_port, ingest_port};
+    uint64_t ids[2] = {ID_LISTEN_UPLOAD, ID_LISTEN_INGEST};
+    for (int k = 0; k < 2 && ok; k++) {
+        if (ports[k] <= 0) {
+            continue;
+        }
+        gw->listen_fd[k] = listen_on(ports[k]);
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = ids[k];
+        ok = gw->listen_fd[k] >= 0 && epoll_ctl(gw->ep, EPOLL_CTL_ADD, gw->listen_fd[k], &ev) == 0;
+    }
+    if (ok) {
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = ID_WAKE;
+        ok = epoll_ctl(gw->ep, EPOLL_CTL_ADD, gw->wake, &ev) == 0;
+    }
+    if (!ok) {
+        for (int fd : {gw->ep, gw->wake, gw->spare_fd, gw->listen_fd[0], gw->listen_fd[1]}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        delete gw;
+        return nullptr;
+    }
+    gw->thread = std::thread([gw] { gw->run(); });
+    return gw;
+}
+
+void ig_destroy(ig_gateway_t *gw) {
+    if (!gw) {
+        return;
+    }
+    gw->stopping = true;
+    uint64_t one = 1;
+    ssize_t r = write(gw->wake, &one, sizeof(one));
+    (void)r;
+    gw->thread.join();
+    {
+        std::unique_lock<std::mutex> g(gw->lock);
+        gw->not_empty.notify_all();
+        gw->no_waiters.wait(g, [gw] { return gw->waiters == 0; });
+        for (Frame *f : gw->queue) {
+            free(f->data);
+            delete f;
+        }
+        gw->queue.clear();
+    }
+    std::vector<Conn *> all;
+    for (auto &it : gw->conns) {
+        all.push_back(it.second);
+    }
+    for (Conn *c : all) {
+        gw->close_conn(c);
+    }
+    for (int fd : {gw->ep, gw->wake, gw->spare_fd, gw->listen_fd[0], gw->listen_fd[1]}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    delete gw;
+}
+
+ig_frame_t *ig_next(ig_gateway_t *gw, int wait_ms) {
+    if (!gw) {
+        return nullptr;
+    }
+    std::unique_lock<std::mutex> g(gw->lock);
+    gw->waiters++;
+    gw->not_empty.wait_for(g, std::chrono::milliseconds(wait_ms > 0 ? wait_ms : 0),
+                           [gw] { return !gw->queue.empty() || gw->stopping; });
+    Frame *f = nullptr;
+    if (!gw->queue.empty() && !gw->stopping) {
+        f = gw->queue.front();
+        gw->queue.pop_front();
+    }
+    if (--gw->waiters == 0 && gw->stopping) {
+        gw->no_waiters.notify_all();
+    }
+    return f ? &f->pub : nullptr;
+}
+
+int ig_reply(ig_gateway_t *gw, ig_frame_t *frame, int status, const char *body, int len) {
+    if (!gw || !frame || len < 0 || (!body && frame->kind == IG_UPLOAD)) {
+        return IG_BAD_ARG;
+    }
+    Frame *f = reinterpret_cast<Frame *>(frame);
+    Reply r;
+    r.conn = frame->conn;
+    r.keep_alive = f->keep_alive;
+    if (frame->kind == IG_UPLOAD) {
+        r.bytes = http_response(status, body, len, f->keep_alive);
+    } else if (body) {
+        r.bytes.assign(body, len);
+        r.bytes += '\n';
+    }
+    free(f->data);
+    delete f;
+    bool first;
+    {
+        std::lock_guard<std::mutex> g(gw->reply_lock);
+        first = gw->replies.empty();
+        gw->replies.push_back(std::move(r));
+    }
+    // One wakeup per batch: the loop takes every reply queued by then
+    if (first) {
+        uint64_t one = 1;
+        ssize_t w = write(gw->wake, &one, sizeof(one));
+        (void)w;
+    }
+    return 0;
+}
+
+void ig_stats(ig_gateway_t *gw, ig_stats_t *s) {
+    memset(s, 0, sizeof(*s));
+    if (!gw) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> g(gw->lock);
+        s->queue_capacity = gw->capacity;
+        s->queue_depth = gw->queue.size();
+        s->queue_peak = gw->peak;
+    }
+    s->connections = gw->connections;
+    s->accepted = gw->accepted;
+    s->refused = gw->refused;
+    s->uploads = gw->uploads;
+    s->parts = gw->parts;
+    s->rejected = gw->rejected;
+    s->bad_requests = gw->bad_requests;
+    s->replies = gw->replied;
+    s->orphaned = gw->orphaned;
+    s->bytes_in = gw->bytes_in;
+    s->bytes_out = gw->bytes_out;
+    clockid_t cid;
+    timespec ts;
+    if (pthread_getcpuclockid(gw->thread.native_handle(), &cid) == 0 && clock_gettime(cid, &ts) == 0) {
+        s->loop_cpu_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    }
+    s->uptime_us = us_since(gw->started);
+}
+
+}  // extern "C"
@@ -0,0 +1,91 @@
+// Native ingest gateway for app.py (loaded through ingest_gw.py).
+//
+// One epoll thread owns every camera connection, so a camera costs a
+// buffer and an epoll entry instead of a Python thread. It speaks both
+// ESP32 transports:
+//   - POST /upload over keep-alive HTTP/1.1 with a raw JPEG body, as
+//     esp32_cam_upload.ino and tools/loadgen send it;
+//   - the persistent ingest stream of IngestHandler in app.py ("--frame"
+//     parts with Content-Length and X-Seq, one JSON line back per frame).
+// A complete frame (its header lines and body in one buffer) goes into one
+// bounded queue. Python threads take frames with ig_next, which waits with
+// the GIL released, run them through the Scheduler and answer with
+// ig_reply. The loop writes that back as an HTTP response or as a JSON line.
+// While the queue is full the loop answers by itself (503, or a "dropped"
+// line), and Python never sees the frame.
+//
+// JSON and form /upload bodies get 415; those clients keep using Flask's
+// /upload. Requests on one HTTP connection are answered in order, one at a
+// time. Stream frames are answered as they finish.
+//
+//   g++ -O2 -std=c++17 -shared -fPIC -o detector/libingest_gw.so
+//       detector/ingest_gw.cpp -pthread                      (one line)
+#ifndef INGEST_GW_H
+#define INGEST_GW_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IG_UPLOAD  0    // Frame from POST /upload
+#define IG_INGEST  1    // Frame from the ingest stream
+
+#define IG_BAD_ARG -1
+
+typedef struct ig_gateway ig_gateway_t;
+
+typedef struct {
+    uint64_t conn;              // Connection id, never reused
+    int32_t kind;               // IG_UPLOAD or IG_INGEST
+    uint32_t peer;              // IPv4 address, network byte order
+    int64_t recv_us;            // Epoch us when the last body byte arrived
+    const char *headers;        // "Name: value\r\n" lines as received
+    uint32_t headers_len;
+    const uint8_t *body;
+    uint32_t body_len;
+} ig_frame_t;
+
+typedef struct {
+    uint32_t connections;       // Open now
+    uint32_t queue_capacity;
+    uint32_t queue_depth;       // Frames waiting for ig_next now
+    uint32_t queue_peak;
+    uint64_t accepted;          // Connections, all time
+    uint64_t refused;           // Closed at accept: max_conns open or out of fds
+    uint64_t uploads;           // POST /upload requests queued
+    uint64_t parts;             // Stream frames queued
+    uint64_t rejected;          // Answered by the loop because the queue was full
+    uint64_t bad_requests;      // Protocol errors; answered 4xx and closed
+    uint64_t replies;
+    uint64_t orphaned;          // Replies for connections already closed
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t loop_cpu_us;       // CPU time of the event loop thread
+    uint64_t uptime_us;
+} ig_stats_t;
+
+// Listens on upload_port (HTTP) and ingest_port (stream); port 0 leaves that
+// listener off. Bodies above max_body bytes are refused with 413. Connections
+// beyond max_conns are closed at once. NULL when a port cannot be bound.
+ig_gateway_t *ig_create(int upload_port, int ingest_port, int queue_capacity, int max_body, int max_conns);
+// Closes every connection and stops the loop; waiting ig_next calls return
+// NULL. Frames not yet answered must be freed with ig_reply first.
+void ig_destroy(ig_gateway_t *gw);
+// Next frame, waiting up to wait_ms; NULL on timeout
+ig_frame_t *ig_next(ig_gateway_t *gw, int wait_ms);
+// Answers a frame from ig_next and frees it: an HTTP response with status
+// and the JSON body for IG_UPLOAD, or the body plus '\n' for IG_INGEST
+// (status unused). body NULL frees an IG_INGEST frame without writing
+// anything (a tile whose set a later part completes). Callable from any
+// thread; a reply for a connection that closed meanwhile is dropped and
+// counted in orphaned. 0 or IG_BAD_ARG.
+int ig_reply(ig_gateway_t *gw, ig_frame_t *frame, int status, const char *body, int len);
+void ig_stats(ig_gateway_t *gw, ig_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
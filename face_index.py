@@ -0,0 +1,290 @@
+"""
+Chỉ mục embedding khuôn mặt của sinh viên đã đăng ký (xem detector/face_index.h).
+
+Thư viện C++ quét phẳng int8 / float16 bằng SIMD (vài nghìn người: một
+truy vấn cỡ 0.05 ms) hoặc dùng đồ thị HNSW cho trường lớn hơn; nhiều mặt
+của cùng 1 frame tìm trong 1 lần gọi. Build (1 lần, không cần OpenCV):
+
+    g++ -O3 -march=native -std=c++17 -shared -fPIC -o detector/libface_index.so \\
+        detector/face_index.cpp -pthread
+
+Chưa build thì load() trả NumpyIndex: cùng API, nhân ma trận float32 bằng numpy.
+
+Danh sách lớn đăng ký trước bằng tools/enroll_build.py ra 1 file chỉ mục
+(write_mapped); server mở bằng open_mapped(): mmap rồi tìm ngay trên các
+trang của file, không dựng lại gì, nên khởi động không phụ thuộc số sinh
+viên và mọi tiến trình server dùng chung 1 bản trong page cache.
+"""
+import ctypes
+import os
+import struct
+import threading
+
+import numpy as np
+
+LIB_PATH = os.environ.get('FACE_INDEX_LIB', os.path.join(os.path.dirname(os.path.abspath(__file__)), 'detector', 'libface_index.so'))
+KINDS = {'int8': 0, 'f16': 1, 'hnsw': 2}
+
+# File chỉ mục đăng ký, little-endian, mỗi phần bắt đầu ở bội số ALIGN byte:
+#   header    HEADER: magic, version, dim, padded, số dòng, số sinh viên, 4 offset
+#   rows      int8 [dòng][padded], chuẩn hoá + lượng tử như FI_FLAT_INT8, nhóm theo sinh viên
+#   scales    float32 [dòng]
+#   labels    int64 [dòng]: chỉ số sinh viên của dòng
+#   students  STUDENT [sinh viên], sắp theo uid để tìm nhị phân
+MAGIC = b'FENRIDX\0'
+VERSION = 1
+ALIGN = 64
+PAD = 32    # kPad của face_index.cpp
+HEADER = struct.Struct('<8s6I4Q')
+STUDENT = np.dtype([('uid', 'S32'), ('student_id', 'S24'), ('first', '<u4'), ('count', '<u4')])
+
+
+class FaceIndex:
+    def __init__(self, lib, dim, kind, hnsw_m=0, ef_construction=0):
+        lib.fi_create.restype = ctypes.c_void_p
+        lib.fi_create.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int]
+        lib.fi_attach_int8.restype = ctypes.c_void_p
+        lib.fi_attach_int8.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+        lib.fi_destroy.argtypes = [ctypes.c_void_p]
+        lib.fi_add.restype = ctypes.c_int
+        lib.fi_add.argtypes = [ctypes.c_void_p, ctypes.c_int64, ctypes.c_void_p]
+        lib.fi_search.restype = ctypes.c_int
+        lib.fi_search.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_void_p, ctypes.c_void_p]
+        lib.fi_size.restype = ctypes.c_int
+        lib.fi_size.argtypes = [ctypes.c_void_p]
+        lib.fi_memory.restype = ctypes.c_uint64
+        lib.fi_memory.argtypes = [ctypes.c_void_p]
+        self.lib = lib
+        self.dim = dim
+        self.kind = kind
+        self.handle = None
+        if kind == 'attached':
+            return
+        self.handle = lib.fi_create(dim, KINDS[kind], hnsw_m, ef_construction)
+        if not self.handle:
+            raise RuntimeError(f'fi_create failed for dim {dim}, {kind}')
+
+    @classmethod
+    def attach(cls, lib, dim, rows, scales, labels):
+        """Chỉ mục int8 chỉ đọc trên các mảng có sẵn (mmap), không copy; giữ các mảng sống cùng nó"""
+        index = cls(lib, dim, 'attached')
+        index.handle = lib.fi_attach_int8(dim, rows.shape[1], len(rows), rows.ctypes.data, scales.ctypes.data, labels.ctypes.data)
+        if not index.handle:
+            raise RuntimeError(f'fi_attach_int8 failed for dim {dim}, row {rows.shape[1]} bytes')
+        index.arrays = (rows, scales, labels)
+        return index
+
+    def add(self, label, vec):
+        vec = np.ascontiguousarray(vec, np.float32).reshape(self.dim)
+        if self.lib.fi_add(self.handle, label, vec.ctypes.data) < 0:
+            raise ValueError('zero embedding')
+
+    def search(self, queries, k=1, ef=0):
+        """
+        (labels, scores) cỡ (số truy vấn, k), tốt nhất trước; score là cosine,
+        label -1 khi chỉ mục có ít hơn k dòng
+        """
+        queries = np.ascontiguousarray(queries, np.float32).reshape(-1, self.dim)
+        labels = np.empty((len(queries), k), np.int64)
+        scores = np.empty((len(queries), k), np.float32)
+        self.lib.fi_search(self.handle, queries.ctypes.data, len(queries), k, ef, labels.ctypes.data, scores.ctypes.data)
+        return labels, scores
+
+    def memory(self):
+        return self.lib.fi_memory(self.handle)
+
+    def __len__(self):
+        return self.lib.fi_size(self.handle)
+
+    def close(self):
+        if self.handle:
+            self.lib.fi_destroy(self.handle)
+            self.handle = None
+
+
+class NumpyIndex:
+    """Như FaceIndex khi chưa build libface_index.so: ma trận float32, quét phẳng"""
+
+    def __init__(self, dim):
+        self.dim = dim
+        self.kind = 'numpy'
+        self.rows = np.zeros((0, dim), np.float32)
+        self.labels = np.zeros(0, np.int64)
+        self.lock = threading.Lock()
+
+    def add(self, label, vec):
+        vec = np.asarray(vec, np.float32).reshape(self.dim)
+        norm = np.linalg.norm(vec)
+        if norm == 0:
+            raise ValueError('zero embedding')
+        with self.lock:
+            self.rows = np.vstack([self.rows, vec / norm])
+            self.labels = np.append(self.labels, label)
+
+    def search(self, queries, k=1, ef=0):
+        queries = np.asarray(queries, np.float32).reshape(-1, self.dim)
+        queries = queries / np.maximum(np.linalg.norm(queries, axis=1, keepdims=True), 1e-12)
+        rows, labels = self.rows, self.labels
+        sims = queries @ rows.T
+        n = min(k, len(rows))
+        order = np.argsort(-sims, axis=1)[:, :n]
+        out_labels = np.full((len(queries), k), -1, np.int64)
+        out_scores = np.full((len(queries), k), -1, np.float32)
+        out_labels[:, :n] = labels[order]
+        out_scores[:, :n] = np.take_along_axis(sims, order, axis=1)
+        return out_labels, out_scores
+
+    def memory(self):
+        return self.rows.nbytes + self.labels.nbytes
+
+    def __len__(self):
+        return len(self.rows)
+
+    def close(self):
+        pass
+
+
+def padded(dim):
+    return (dim + PAD - 1) // PAD * PAD
+
+
+def aligned(offset):
+    return (offset + ALIGN - 1) // ALIGN * ALIGN
+
+
+def quantise(unit, width):
+    """(int8 [width], scale) của 1 vector đã chuẩn hoá, giống quantise() của face_index.cpp"""
+    row = np.zeros(width, np.float32)
+    row[:len(unit)] = unit
+    peak = float(np.max(np.abs(row)))
+    scale = peak / 127 if peak > 0 else 1.0
+    return np.rint(row / scale).astype(np.int8), scale
+
+
+def write_mapped(path, dim, students):
+    """
+    Ghi file chỉ mục đăng ký. students: [(uid, student_id, ma trận embedding
+    (số ảnh, dim))]. Ghi ra file tạm rồi os.replace: server đang mmap file cũ
+    vẫn đọc bản cũ trọn vẹn tới lần khởi động sau
+    """
+    students = sorted(students, key=lambda s: s[0].encode())
+    width = padded(dim)
+    rows, scales, labels, table = [], [], [], np.zeros(len(students), STUDENT)
+    for i, (uid, student_id, vectors) in enumerate(students):
+        if len(uid.encode()) > STUDENT['uid'].itemsize or len((student_id or '').encode()) > STUDENT['student_id'].itemsize:
+            raise ValueError(f'{uid}: UID / student id too long')
+        if i and students[i - 1][0] == uid:
+            raise ValueError(f'{uid}: listed twice')
+        table[i] = (uid.encode(), (student_id or '').encode(), len(rows), 0)
+        for vec in np.asarray(vectors, np.float32).reshape(-1, dim):
+            norm = np.linalg.norm(vec)
+            if norm == 0:
+                continue
+            row, scale = quantise(vec / norm, width)
+            rows.append(row)
+            scales.append(scale)
+            labels.append(i)
+        table['count'][i] = len(rows) - table['first'][i]
+    rows = np.array(rows, np.int8).reshape(-1, width)
+    off_rows = aligned(HEADER.size)
+    off_scales = aligned(off_rows + rows.nbytes)
+    off_labels = aligned(off_scales + 4 * len(rows))
+    off_students = aligned(off_labels + 8 * len(rows))
+    tmp = path + '.tmp'
+    with open(tmp, 'wb') as f:
+        f.write(HEADER.pack(MAGIC, VERSION, dim, width, len(rows), len(table), off_rows, off_scales, off_labels, off_students))
+        for offset, data in ((off_rows, rows), (off_scales, np.array(scales, '<f4')), (off_labels, np.array(labels, '<i8')), (off_students, table)):
+            f.write(b'\0' * (offset - f.tell()))
+            f.write(data.tobytes())
+    os.replace(tmp, path)
+    return len(rows)
+
+
+class MappedIndex:
+    """
+    File của write_mapped, mmap chỉ đọc. search() như FaceIndex (label là
+    chỉ số sinh viên trong file): bằng fi_attach_int8 trên chính các trang
+    của file khi có libface_index.so, không thì numpy (đổi int8 -> float mỗi lần tìm)
+    """
+
+    def __init__(self, path, dim, lib=None):
+        self.path = path
+        self.map = np.memmap(path, np.uint8, 'r')
+        if len(self.map) < HEADER.size:
+            raise ValueError(f'{path}: not an enrolment index')
+        magic, version, fdim, width, n, students, off_rows, off_scales, off_labels, off_students = HEADER.unpack_from(self.map)
+        if magic != MAGIC:
+            raise ValueError(f'{path}: not an enrolment index')
+        if version != VERSION:
+            raise ValueError(f'{path}: version {version}, expected {VERSION}; rebuild with tools/enroll_build.py')
+        if fdim != dim or width != padded(dim):
+            raise ValueError(f'{path}: {fdim}-d rows, expected {dim}')
+        if off_students + students * STUDENT.itemsize > len(self.map):
+            raise ValueError(f'{path}: truncated')
+        self.dim = dim
+        self.rows = np.frombuffer(self.map, np.int8, n * width, off_rows).reshape(n, width)
+        self.scales = np.frombuffer(self.map, '<f4', n, off_scales)
+        self.labels = np.frombuffer(self.map, '<i8', n, off_labels)
+        self.students = np.frombuffer(self.map, STUDENT, students, off_students)
+        self.native = FaceIndex.attach(lib, dim, self.rows, self.scales, self.labels) if lib is not None else None
+        self.kind = 'mmap-int8' if self.native else 'mmap-numpy'
+
+    def search(self, queries, k=1, ef=0):
+        if self.native is not None:
+            return self.native.search(queries, k)
+        queries = np.asarray(queries, np.float32).reshape(-1, self.dim)
+        queries = queries / np.maximum(np.linalg.norm(queries, axis=1, keepdims=True), 1e-12)
+        sims = (queries @ self.rows[:, :self.dim].T.astype(np.float32)) * self.scales
+        n = min(k, len(self.rows))
+        order = np.argsort(-sims, axis=1)[:, :n]
+        out_labels = np.full((len(queries), k), -1, np.int64)
+        out_scores = np.full((len(queries), k), -1, np.float32)
+        out_labels[:, :n] = self.labels[order]
+        out_scores[:, :n] = np.take_along_axis(sims, order, axis=1)
+        return out_labels, out_scores
+
+    def find(self, uid):
+        """Chỉ số sinh viên của uid (tìm nhị phân trên bảng đã sắp), None nếu không có"""
+        key = uid.encode()
+        i = int(np.searchsorted(self.students['uid'], key))
+        return i if i < len(self.students) and self.students['uid'][i] == key else None
+
+    def student(self, label):
+        """(uid, mã sinh viên) của 1 label"""
+        rec = self.students[label]
+        return rec['uid'].decode(), rec['student_id'].decode()
+
+    def templates(self, label):
+        """Các embedding đăng ký của 1 sinh viên, đã chuẩn hoá (float32), cho verify 1:1"""
+        rec = self.students[label]
+        rows = slice(int(rec['first']), int(rec['first'] + rec['count']))
+        return self.rows[rows, :self.dim].astype(np.float32) * self.scales[rows, np.newaxis]
+
+    def memory(self):
+        return len(self.map)
+
+    def __len__(self):
+        return len(self.rows)
+
+    def close(self):
+        if self.native is not None:
+            self.native.close()
+            self.native = None
+
+
+def open_mapped(path, dim):
+    """MappedIndex của file chỉ mục đăng ký, tìm bằng libface_index.so nếu đã build"""
+    return MappedIndex(path, dim, ctypes.CDLL(LIB_PATH) if os.path.exists(LIB_PATH) else None)
+
+
+def load(dim, kind=None):
+    """
+    Chỉ mục rỗng cho embedding dim chiều. kind (hoặc biến môi trường
+    FACE_INDEX): 'int8' (mặc định), 'f16', 'hnsw' cho vài chục nghìn người trở lên
+    """
+    kind = kind or os.environ.get('FACE_INDEX', 'int8')
+    if kind not in KINDS:
+        raise ValueError(f'FACE_INDEX must be one of {", ".join(KINDS)}')
+    if not os.path.exists(LIB_PATH):
+        return NumpyIndex(dim)
+    return FaceIndex(ctypes.CDLL(LIB_PATH), dim, kind)
@@ -0,0 +1,110 @@
+"""
+Binding ctypes cho detector/libface_pool.so (xem detector/face_pool.h).
+
+Mỗi worker C++ giữ 1 CascadeClassifier riêng, nhận việc qua 1 hàng đợi có
+giới hạn; luồng Python gọi detect() chờ với GIL đã nhả (ctypes nhả GIL
+trong lúc gọi), nên nhiều camera nhận diện song song theo số nhân CPU thay
+vì xếp hàng sau GIL trong luồng request của Flask.
+
+Build thư viện (1 lần, cần OpenCV C++):
+
+    g++ -O2 -std=c++17 -shared -fPIC -o detector/libface_pool.so \\
+        detector/face_pool.cpp $(pkg-config --cflags --libs opencv4) -pthread
+
+Chưa build thì load() trả None và app.py chạy Haar bằng cv2 như cũ.
+"""
+import ctypes
+import os
+
+LIB_PATH = os.environ.get('FACE_POOL_LIB', os.path.join(os.path.dirname(os.path.abspath(__file__)), 'detector', 'libface_pool.so'))
+MAX_BOXES = 64
+FP_BUSY = -1
+
+
+class FpBox(ctypes.Structure):
+    _fields_ = [('x', ctypes.c_int32), ('y', ctypes.c_int32), ('w', ctypes.c_int32), ('h', ctypes.c_int32)]
+
+
+class FpStats(ctypes.Structure):
+    _fields_ = [
+        ('workers', ctypes.c_uint32),
+        ('queue_capacity', ctypes.c_uint32),
+        ('queue_depth', ctypes.c_uint32),
+        ('queue_peak', ctypes.c_uint32),
+        ('submitted', ctypes.c_uint64),
+        ('completed', ctypes.c_uint64),
+        ('rejected', ctypes.c_uint64),
+        ('wait_us', ctypes.c_uint64),
+        ('uptime_us', ctypes.c_uint64),
+    ]
+
+
+class FpWorkerStats(ctypes.Structure):
+    _fields_ = [('jobs', ctypes.c_uint64), ('busy_us', ctypes.c_uint64)]
+
+
+class FacePool:
+    def __init__(self, lib, cascade_path, workers, queue, scale, neighbors, min_size):
+        lib.fp_create.restype = ctypes.c_void_p
+        lib.fp_create.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_int, ctypes.c_double, ctypes.c_int, ctypes.c_int]
+        lib.fp_destroy.argtypes = [ctypes.c_void_p]
+        lib.fp_detect_gray.restype = ctypes.c_int
+        lib.fp_detect_gray.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                                       ctypes.POINTER(FpBox), ctypes.c_int]
+        lib.fp_stats.restype = ctypes.c_int
+        lib.fp_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(FpStats), ctypes.POINTER(FpWorkerStats), ctypes.c_int]
+        self.lib = lib
+        self.workers = workers
+        self.handle = lib.fp_create(cascade_path.encode(), workers, queue, scale, neighbors, min_size)
+        if not self.handle:
+            raise RuntimeError(f'fp_create failed for {cascade_path}')
+
+    def detect(self, gray, min_size=0, wait_ms=200):
+        """
+        Danh sách khung (x, y, w, h) như detectMultiScale; None khi hàng đợi
+        đầy quá wait_ms. min_size 0: giá trị lúc tạo pool
+        """
+        if gray.dtype.itemsize != 1 or gray.ndim != 2 or gray.strides[1] != 1:
+            raise ValueError('gray must be a 2-D uint8 image')
+        boxes = (FpBox * MAX_BOXES)()
+        # gray phải còn sống tới khi hàm trả về: C++ đọc thẳng bộ nhớ của nó
+        n = self.lib.fp_detect_gray(self.handle, gray.ctypes.data, gray.shape[1], gray.shape[0], gray.strides[0], min_size, wait_ms, boxes, MAX_BOXES)
+        if n == FP_BUSY:
+            return None
+        if n < 0:
+            raise ValueError(f'fp_detect_gray: {n}')
+        return [(b.x, b.y, b.w, b.h) for b in boxes[:min(n, MAX_BOXES)]]
+
+    def stats(self):
+        """Độ sâu hàng đợi và mức bận (%) của từng worker từ lúc khởi động"""
+        s = FpStats()
+        w = (FpWorkerStats * self.workers)()
+        n = self.lib.fp_stats(self.handle, ctypes.byref(s), w, self.workers)
+        up = max(s.uptime_us, 1)
+        return {
+            'workers': n,
+            'queue_depth': s.queue_depth,
+            'queue_capacity': s.queue_capacity,
+            'queue_peak': s.queue_peak,
+            'submitted': s.submitted,
+            'completed': s.completed,
+            'rejected': s.rejected,
+            'avg_wait_ms': round(s.wait_us / max(s.completed, 1) / 1000, 2),
+            'utilization': [round(100 * w[i].busy_us / up, 1) for i in range(n)],
+            'jobs': [w[i].jobs for i in range(n)],
+        }
+
+    def close(self):
+        if self.handle:
+            self.lib.fp_destroy(self.handle)
+            self.handle = None
+
+
+def load(cascade_path, workers=None, queue=None, scale=1.1, neighbors=5, min_size=30):
+    """FacePool chạy trên thư viện C++, None khi chưa build libface_pool.so"""
+    if not os.path.exists(LIB_PATH):
+        return None
+    workers = workers or int(os.environ.get('FACE_POOL_WORKERS', 0)) or os.cpu_count() or 1
+    # Mỗi worker 2 việc chờ: đủ che lúc decode, không đủ để trễ dồn lên
+    queue = queue or 2 * workers
+    return FacePool(ctypes.CDLL(LIB_PATH), cascade_path, workers, queue, scale, neighbors, min_size)
@@ -0,0 +1,264 @@
+"""
+Lưu JPEG gốc của mọi frame để kiểm tra lại (audit) đoạn camera thấy quanh 1
+lần quẹt thẻ. Mỗi giờ (UTC) 1 segment trong thư mục lưu trữ, chỉ ghi thêm:
+
+    YYYYMMDD-HH.seg    JPEG gốc nối tiếp nhau
+    YYYYMMDD-HH.idx    RECORD mỗi frame, theo thứ tự ghi (ts không giảm)
+    YYYYMMDD-HH.taps   TAP mỗi lần quẹt: frame đầu tiên mang X-Tap-Seq đó
+    YYYYMMDD-HH.cams   tên camera, dòng thứ i là camera số i của segment
+
+Worker nhận diện chỉ xếp frame vào hàng đợi (append); 1 luồng ghi tuần tự
+qua bộ đệm lớn và flush mỗi flush_s giây, .seg trước .idx nên bản ghi đã
+flush luôn trỏ vào dữ liệu đã có. Tìm theo thời gian là tìm nhị phân trên
+các bản ghi cỡ cố định của .idx (pread, không đọc cả file); lần quẹt tra
+bảng taps trong bộ nhớ (dựng lại từ các file .taps nhỏ lúc khởi động) ra
+thời điểm rồi tìm như trên. Hết hạn giữ thì xoá nguyên segment.
+"""
+import calendar
+import collections
+import glob
+import os
+import re
+import struct
+import threading
+import time
+
+RECORD = struct.Struct('<qQIiHH')   # ts_us (epoch), offset trong .seg, độ dài, tap seq (-1: không có), số mặt, số camera
+TAP = struct.Struct('<iqH')         # tap seq, ts_us của frame, số camera
+SEGMENT_RE = re.compile(r'^\d{8}-\d{2}$')
+WRITE_BUFFER = 1 << 20
+TAP_REPEAT_S = 60   # Cùng tap seq, cùng camera trong chừng này giây: vẫn là lần quẹt đó (ảnh chụp loạt)
+
+
+def segment_name(ts_us):
+    return time.strftime('%Y%m%d-%H', time.gmtime(ts_us / 1e6))
+
+
+def segment_start(name):
+    """ts_us đầu giờ của segment"""
+    return calendar.timegm(time.strptime(name, '%Y%m%d-%H')) * 1000000
+
+
+class Segment:
+    """Segment đang ghi (luồng ghi độc quyền)"""
+
+    def __init__(self, root, name):
+        self.name = name
+        base = os.path.join(root, name)
+        self.seg = open(base + '.seg', 'ab', buffering=WRITE_BUFFER)
+        self.idx = open(base + '.idx', 'ab', buffering=0)
+        self.idx_buf = bytearray()  # Bản ghi chỉ ra file sau khi .seg đã flush
+        # Lần chạy trước tắt giữa 1 bản ghi: cắt phần dở
+        size = self.idx.tell()
+        if size % RECORD.size:
+            self.idx.truncate(size - size % RECORD.size)
+            self.idx.seek(0, os.SEEK_END)
+        self.taps = open(base + '.taps', 'ab', buffering=0)
+        self.cams_file = open(base + '.cams', 'a+', encoding='utf-8')
+        self.cams_file.seek(0)
+        self.cams = {cam: i for i, cam in enumerate(self.cams_file.read().splitlines())}
+        self.offset = self.seg.tell()
+
+    def camera(self, cam):
+        i = self.cams.get(cam)
+        if i is None:
+            i = self.cams[cam] = len(self.cams)
+            self.cams_file.write(cam + '\n')
+            self.cams_file.flush()
+        return i
+
+    def write(self, ts, cam, jpeg, tap_seq, faces, new_tap):
+        i = self.camera(cam)
+        self.seg.write(jpeg)
+        self.idx_buf += RECORD.pack(ts, self.offset, len(jpeg), -1 if tap_seq is None else tap_seq, min(faces, 0xFFFF), i)
+        self.offset += len(jpeg)
+        if new_tap:
+            self.taps.write(TAP.pack(tap_seq, ts, i))
+
+    def flush(self):
+        self.seg.flush()
+        if self.idx_buf:
+            self.idx.write(self.idx_buf)
+            self.idx_buf.clear()
+
+    def close(self):
+        self.flush()
+        for f in (self.seg, self.idx, self.taps, self.cams_file):
+            f.close()
+
+
+class FrameArchive:
+    def __init__(self, root, hours, flush_s=1.0, queue=256):
+        self.root = root
+        self.hours = hours
+        self.flush_s = flush_s
+        self.queue = queue
+        os.makedirs(root, exist_ok=True)
+        self.cond = threading.Condition()
+        self.pending = collections.deque()
+        self.last_ts = 0
+        self.current = None
+        self.written = 0
+        self.bytes = 0
+        self.dropped = 0
+        self.removed = 0
+        self.taps = {}      # (camera, tap seq) -> ts_us của frame đầu, lần quẹt mới nhất có seq đó
+        self.taps_lock = threading.Lock()
+        for name in self.segments():
+            self.load_taps(name)
+
+    def start(self):
+        threading.Thread(target=self.run, name='archive', daemon=True).start()
+        return self
+
+    def append(self, cam, jpeg, recv_us, tap_seq=None, faces=0):
+        """Xếp 1 frame chờ ghi; hàng đợi đầy (đĩa chậm) thì bỏ frame, không chặn worker"""
+        if not jpeg:
+            return
+        with self.cond:
+            if len(self.pending) >= self.queue:
+                self.dropped += 1
+                return
+            # Nhiều worker xếp gần như cùng lúc: ts không giảm để .idx tìm nhị phân được
+            ts = self.last_ts = max(recv_us, self.last_ts)
+            self.pending.append((ts, cam, jpeg, tap_seq, faces))
+            self.cond.notify()
+
+    def run(self):
+        flushed = time.monotonic()
+        while True:
+            with self.cond:
+                if not self.pending:
+                    self.cond.wait(self.flush_s)
+                batch = list(self.pending)
+                self.pending.clear()
+            for ts, cam, jpeg, tap_seq, faces in batch:
+                name = segment_name(ts)
+                if self.current is None or self.current.name != name:
+                    self.rotate(name)
+                new_tap = False
+                if tap_seq is not None:
+                    with self.taps_lock:
+                        prev = self.taps.get((cam, tap_seq))
+                        new_tap = prev is None or ts - prev > TAP_REPEAT_S * 1000000
+                        if new_tap:
+                            self.taps[(cam, tap_seq)] = ts
+                self.current.write(ts, cam, jpeg, tap_seq, faces, new_tap)
+                self.written += 1
+                self.bytes += len(jpeg)
+            if self.current is not None and time.monotonic() - flushed >= self.flush_s:
+                self.current.flush()
+                flushed = time.monotonic()
+
+    def rotate(self, name):
+        if self.current is not None:
+            self.current.close()
+        self.current = Segment(self.root, name)
+        # Giữ hours giờ gần nhất, tính cả giờ đang ghi
+        oldest = segment_start(name) - (self.hours - 1) * 3600 * 1000000
+        for old in self.segments():
+            if segment_start(old) < oldest:
+                for ext in ('.seg', '.idx', '.taps', '.cams'):
+                    try:
+                        os.remove(os.path.join(self.root, old + ext))
+                    except FileNotFoundError:
+                        pass
+                self.removed += 1
+        with self.taps_lock:
+            self.taps = {k: ts for k, ts in self.taps.items() if ts >= oldest}
+
+    def segments(self):
+        names = (os.path.basename(p)[:-4] for p in glob.glob(os.path.join(self.root, '*.idx')))
+        return sorted(n for n in names if SEGMENT_RE.match(n))
+
+    def cameras(self, name):
+        try:
+            with open(os.path.join(self.root, name + '.cams'), encoding='utf-8') as f:
+                return f.read().splitlines()
+        except FileNotFoundError:
+            return []
+
+    def load_taps(self, name):
+        cams = self.cameras(name)
+        try:
+            with open(os.path.join(self.root, name + '.taps'), 'rb') as f:
+                data = f.read()
+        except FileNotFoundError:
+            return
+        for i in range(len(data) // TAP.size):
+            seq, ts, cam = TAP.unpack_from(data, i * TAP.size)
+            if cam < len(cams):
+                self.taps[(cams[cam], seq)] = ts
+
+    def tap_time(self, seq, cam=None):
+        """ts_us của lần quẹt X-Tap-Seq seq (mới nhất nếu không chỉ camera), None nếu không có"""
+        with self.taps_lock:
+            times = [ts for (c, s), ts in self.taps.items() if s == seq and (cam is None or c == cam)]
+        return max(times) if times else None
+
+    def frames(self, t0, t1, cam=None, limit=500):
+        """Frame có t0 <= ts <= t1 (µs epoch), theo thời gian; mỗi frame là dict kèm segment và số bản ghi"""
+        out = []
+        for name in self.segments():
+            start = segment_start(name)
+            if start > t1 or start + 3600 * 1000000 <= t0:
+                continue
+            cams = self.cameras(name)
+            with open(os.path.join(self.root, name + '.idx'), 'rb') as f:
+                fd = f.fileno()
+                n = os.fstat(fd).st_size // RECORD.size
+                lo, hi = 0, n
+                while lo < hi:
+                    mid = (lo + hi) // 2
+                    if RECORD.unpack(os.pread(fd, RECORD.size, mid * RECORD.size))[0] < t0:
+                        lo = mid + 1
+                    else:
+                        hi = mid
+                # Đọc tiếp từng khối bản ghi liền nhau từ vị trí tìm được
+                while lo < n and len(out) < limit:
+                    count = min(n - lo, 256)
+                    block = os.pread(fd, count * RECORD.size, lo * RECORD.size)
+                    for k in range(count):
+                        ts, offset, length, tap, faces, c = RECORD.unpack_from(block, k * RECORD.size)
+                        if ts > t1:
+                            return out
+                        name_cam = cams[c] if c < len(cams) else str(c)
+                        if cam is None or name_cam == cam:
+                            out.append({'segment': name, 'n': lo + k, 'ts_us': ts, 'camera': name_cam, 'bytes': length,
+                                        'tap_seq': None if tap < 0 else tap, 'faces': faces})
+                            if len(out) >= limit:
+                                return out
+                    lo += count
+        return out
+
+    def read(self, name, n):
+        """JPEG của bản ghi n trong segment name, None nếu không có"""
+        if not SEGMENT_RE.match(name) or n < 0:
+            return None
+        try:
+            with open(os.path.join(self.root, name + '.idx'), 'rb') as f:
+                rec = os.pread(f.fileno(), RECORD.size, n * RECORD.size)
+            if len(rec) < RECORD.size:
+                return None
+            _, offset, length, _, _, _ = RECORD.unpack(rec)
+            with open(os.path.join(self.root, name + '.seg'), 'rb') as f:
+                data = os.pread(f.fileno(), length, offset)
+        except FileNotFoundError:
+            return None
+        return data if len(data) == length else None
+
+    def stats(self):
+        with self.cond:
+            queued = len(self.pending)
+        return {
+            'dir': self.root,
+            'hours': self.hours,
+            'segments': len(self.segments()),
+            'current': self.current.name if self.current else None,
+            'written': self.written,
+            'mb_written': round(self.bytes / 1e6, 1),
+            'queued': queued,
+            'dropped': self.dropped,
+            'segments_removed': self.removed,
+            'taps': len(self.taps),
+        }
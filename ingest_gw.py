@@ -0,0 +1,158 @@
+"""
+Binding ctypes cho detector/libingest_gw.so (xem detector/ingest_gw.h).
+
+Gateway C++ nhận frame của camera bằng 1 luồng epoll thay cho server dev của
+Flask (1 luồng mỗi request) và ThreadingTCPServer của luồng ingest (1 luồng
+mỗi camera): POST /upload keep-alive (body JPEG thô) và luồng ingest
+"--frame" cùng định dạng IngestHandler. Frame đủ byte vào 1 hàng đợi có giới
+hạn; luồng Python lấy bằng next() (chờ với GIL đã nhả), đưa vào Scheduler rồi
+trả lời bằng reply(). Hàng đợi đầy thì gateway tự trả 503 / 'dropped', frame
+không tới Python.
+
+Build thư viện (1 lần, không cần thư viện ngoài):
+
+    g++ -O2 -std=c++17 -shared -fPIC -o detector/libingest_gw.so \\
+        detector/ingest_gw.cpp -pthread
+
+Chưa build thì load() trả None và app.py nhận frame bằng Flask/IngestServer như cũ.
+"""
+import ctypes
+import json
+import os
+import socket
+import struct
+
+LIB_PATH = os.environ.get('INGEST_GW_LIB', os.path.join(os.path.dirname(os.path.abspath(__file__)), 'detector', 'libingest_gw.so'))
+IG_UPLOAD = 0
+IG_INGEST = 1
+
+
+class IgFrame(ctypes.Structure):
+    _fields_ = [
+        ('conn', ctypes.c_uint64),
+        ('kind', ctypes.c_int32),
+        ('peer', ctypes.c_uint32),
+        ('recv_us', ctypes.c_int64),
+        ('headers', ctypes.c_void_p),
+        ('headers_len', ctypes.c_uint32),
+        ('body', ctypes.c_void_p),
+        ('body_len', ctypes.c_uint32),
+    ]
+
+
+class IgStats(ctypes.Structure):
+    _fields_ = [
+        ('connections', ctypes.c_uint32),
+        ('queue_capacity', ctypes.c_uint32),
+        ('queue_depth', ctypes.c_uint32),
+        ('queue_peak', ctypes.c_uint32),
+        ('accepted', ctypes.c_uint64),
+        ('refused', ctypes.c_uint64),
+        ('uploads', ctypes.c_uint64),
+        ('parts', ctypes.c_uint64),
+        ('rejected', ctypes.c_uint64),
+        ('bad_requests', ctypes.c_uint64),
+        ('replies', ctypes.c_uint64),
+        ('orphaned', ctypes.c_uint64),
+        ('bytes_in', ctypes.c_uint64),
+        ('bytes_out', ctypes.c_uint64),
+        ('loop_cpu_us', ctypes.c_uint64),
+        ('uptime_us', ctypes.c_uint64),
+    ]
+
+
+class Frame:
+    """1 frame lấy từ gateway; reply() đúng 1 lần để gateway trả lời và giải phóng nó"""
+    __slots__ = ('ptr', 'conn', 'kind', 'peer', 'recv_us', 'headers', 'body')
+
+    def __init__(self, ptr):
+        f = ptr.contents
+        self.ptr = ptr
+        self.conn = f.conn
+        self.kind = f.kind
+        self.peer = socket.inet_ntoa(struct.pack('=I', f.peer))
+        self.recv_us = f.recv_us
+        # Header nguyên văn "Name: value\r\n"; app.py dựng Headers từ danh sách này
+        raw = ctypes.string_at(f.headers, f.headers_len).decode('latin-1')
+        self.headers = []
+        for line in raw.split('\r\n'):
+            key, sep, value = line.partition(':')
+            if sep:
+                self.headers.append((key.strip(), value.strip()))
+        self.body = ctypes.string_at(f.body, f.body_len)
+
+
+class Gateway:
+    def __init__(self, lib, upload_port, ingest_port, queue, max_body, max_conns):
+        lib.ig_create.restype = ctypes.c_void_p
+        lib.ig_create.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int]
+        lib.ig_destroy.argtypes = [ctypes.c_void_p]
+        lib.ig_next.restype = ctypes.POINTER(IgFrame)
+        lib.ig_next.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        lib.ig_reply.restype = ctypes.c_int
+        lib.ig_reply.argtypes = [ctypes.c_void_p, ctypes.POINTER(IgFrame), ctypes.c_int, ctypes.c_char_p, ctypes.c_int]
+        lib.ig_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(IgStats)]
+        self.lib = lib
+        self.upload_port = upload_port
+        self.ingest_port = ingest_port
+        self.handle = lib.ig_create(upload_port, ingest_port, queue, max_body, max_conns)
+        if not self.handle:
+            raise RuntimeError(f'ig_create failed for ports {upload_port}/{ingest_port}')
+
+    def next(self, wait_ms=1000):
+        """Frame tiếp theo, None khi chờ quá wait_ms"""
+        ptr = self.lib.ig_next(self.handle, wait_ms)
+        return Frame(ptr) if ptr else None
+
+    def reply(self, frame, status, result):
+        """Trả result (dict) cho frame: HTTP status + JSON với /upload, 1 dòng JSON với luồng ingest"""
+        if frame.ptr is None:
+            return
+        body = json.dumps(result).encode()
+        self.lib.ig_reply(self.handle, frame.ptr, status, body, len(body))
+        frame.ptr = None
+
+    def release(self, frame):
+        """Giải phóng frame ingest không cần trả lời (ô cắt chưa phải ô cuối)"""
+        if frame.ptr is not None:
+            self.lib.ig_reply(self.handle, frame.ptr, 0, None, 0)
+            frame.ptr = None
+
+    def stats(self):
+        """Số liệu của vòng epoll; frames_per_core_s là frame chuyển tiếp mỗi giây CPU của luồng đó"""
+        s = IgStats()
+        self.lib.ig_stats(self.handle, ctypes.byref(s))
+        frames = s.uploads + s.parts
+        up_s = max(s.uptime_us, 1) / 1e6
+        return {
+            'upload_port': self.upload_port or None,
+            'ingest_port': self.ingest_port or None,
+            'connections': s.connections,
+            'accepted': s.accepted,
+            'refused': s.refused,
+            'uploads': s.uploads,
+            'parts': s.parts,
+            'rejected': s.rejected,
+            'bad_requests': s.bad_requests,
+            'replies': s.replies,
+            'orphaned': s.orphaned,
+            'queue_depth': s.queue_depth,
+            'queue_capacity': s.queue_capacity,
+            'queue_peak': s.queue_peak,
+            'mb_in': round(s.bytes_in / 1e6, 1),
+            'frames_per_s': round(frames / up_s, 1),
+            'loop_cpu_pct': round(100 * s.loop_cpu_us / 1e6 / up_s, 1),
+            'frames_per_core_s': round(frames / (s.loop_cpu_us / 1e6), 0) if s.loop_cpu_us else None,
+        }
+
+    def close(self):
+        if self.handle:
+            self.lib.ig_destroy(self.handle)
+            self.handle = None
+
+
+def load(upload_port, ingest_port, queue=256, max_body=4 << 20, max_conns=1024):
+    """Gateway chạy trên thư viện C++, None khi chưa build libingest_gw.so"""
+    if not os.path.exists(LIB_PATH):
+        return None
+    return Gateway(ctypes.CDLL(LIB_PATH), upload_port, ingest_port, queue, max_body, max_conns)
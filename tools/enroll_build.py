@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""
+Dựng file chỉ mục đăng ký (face_index.write_mapped) từ ảnh của cả danh sách
+sinh viên, chạy 1 lần ngoài server. app.py mmap file này lúc khởi động
+(ENROLL_INDEX, mặc định enrolled.idx) thay vì tính lại embedding từng ảnh.
+
+Danh sách là roster CSV của tools/roster_compile.py (cùng file dựng
+whitelist cho đầu đọc thẻ), mỗi dòng: UID thẻ, mã sinh viên, ảnh (tương đối
+theo thư mục của CSV), allow/deny. Nhiều dòng cùng UID là nhiều ảnh của 1
+sinh viên; dòng không có ảnh hoặc thẻ deny không được đăng ký mặt. UID được
+chuẩn hoá về đúng chuỗi X-Card-UID ESP32 gửi (hex in hoa).
+
+    python3 tools/enroll_build.py roster.csv -o enrolled.idx --jobs 8
+    python3 tools/enroll_build.py roster.csv --merge enrolled.npz   # gộp cả các lần /enroll
+
+Mỗi ảnh lấy mặt lớn nhất (Haar), cắt và đưa về 112x112 như
+FaceIdentifier.embed của app.py, nên embedding khớp với lúc server nhận diện.
+Ảnh không có mặt được in ra và bỏ qua. Ghi file mới rồi mới thay file cũ:
+server đang chạy vẫn đọc bản cũ tới lần khởi động sau.
+"""
+import argparse
+import os
+import sys
+from concurrent.futures import ProcessPoolExecutor
+
+import cv2
+import numpy as np
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+import face_index  # noqa: E402
+from roster_compile import read_roster  # noqa: E402
+
+DIM = 128
+worker = {}
+
+
+def init_worker(model, cascade):
+    worker['net'] = cv2.FaceRecognizerSF.create(model, '')
+    worker['cascade'] = cv2.CascadeClassifier(cascade)
+
+
+def embed(path):
+    """Embedding của mặt lớn nhất trong ảnh, hoặc chuỗi lý do khi không dùng được"""
+    image = cv2.imread(path, cv2.IMREAD_COLOR)
+    if image is None:
+        return 'cannot read image'
+    gray = cv2.cvtColor(image, cv2.COLOR_BGR2GRAY)
+    faces = worker['cascade'].detectMultiScale(gray, scaleFactor=1.1, minNeighbors=5, minSize=(30, 30))
+    if not len(faces):
+        return 'no face'
+    x, y, w, h = max(faces, key=lambda f: f[2] * f[3])
+    crop = cv2.resize(image[y:y + h, x:x + w], (112, 112))
+    return worker['net'].feature(crop).reshape(-1)[:DIM].astype(np.float32)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument('roster', help='CSV: uid,student_id,photo,access')
+    ap.add_argument('-o', '--output', default='enrolled.idx')
+    ap.add_argument('--model', default='face_recognition_sface_2021dec.onnx')
+    ap.add_argument('--cascade', default=cv2.data.haarcascades + 'haarcascade_frontalface_default.xml')
+    ap.add_argument('--merge', help='enrolled.npz của server (các lần /enroll) gộp vào file')
+    ap.add_argument('--jobs', type=int, default=os.cpu_count() or 1, help='số tiến trình tính embedding')
+    args = ap.parse_args()
+
+    roster = read_roster(args.roster)
+    denied = {uid for uid, _, _, allow in roster if not allow}
+    rows = [(uid, sid, photo) for uid, sid, photo, _ in roster if photo and uid not in denied]
+    students = {}   # UID -> (mã sinh viên, [embedding])
+    with ProcessPoolExecutor(args.jobs, initializer=init_worker, initargs=(args.model, args.cascade)) as pool:
+        for (uid, student_id, photo), vec in zip(rows, pool.map(embed, [r[2] for r in rows], chunksize=16)):
+            entry = students.setdefault(uid, (student_id, []))
+            if isinstance(vec, str):
+                print(f'{photo}: {vec}, skipped', file=sys.stderr)
+                continue
+            entry[1].append(vec)
+
+    if args.merge:
+        data = np.load(args.merge)
+        for label, vec in zip(data['labels'], data['vectors']):
+            students.setdefault(str(data['students'][label]), ('', []))[1].append(vec)
+
+    empty = [uid for uid, (_, vecs) in students.items() if not vecs]
+    for uid in empty:
+        print(f'{uid}: no usable photo, not enrolled', file=sys.stderr)
+    table = [(uid, sid, np.array(vecs, np.float32)) for uid, (sid, vecs) in students.items() if vecs]
+    n = face_index.write_mapped(args.output, DIM, table)
+    print(f'{args.output}: {len(table)} student(s), {n} embedding(s), {os.path.getsize(args.output)} bytes')
+    return 1 if empty else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
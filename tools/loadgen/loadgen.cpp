@@ -0,0 +1,443 @@
+// Synthetic multi-camera load for app.py: M emulated ESP32-CAMs, each
+// replaying a JPEG corpus at N fps with the headers the firmware sends
+// (X-Camera-Id, X-Motion-Score, X-Frame-Time, and the X-Card-UID tap set of
+// esp32_cam_upload.ino every --tap-every frames), either as keep-alive
+// POST /upload or over the TCP ingest stream (port 5001, CameraWebServer.ino
+// with USE_STREAM_INGEST).
+//
+// Each camera behaves like the firmware's single-slot upload queue: a frame
+// whose send time comes while the previous one is still waiting for its
+// answer (or, on ingest, while --window frames are unacknowledged) is
+// skipped, so an overloaded server shows up as skipped frames and long
+// latencies instead of an ever-growing client backlog.
+//
+// Reports throughput, the ok / dropped / error / skipped split and the
+// p50 / p95 / p99 / max send -> response latency, in total and per camera.
+// --max-p95-ms and --max-error-pct turn it into a capacity check: the exit
+// status is 1 when either is exceeded, 2 on bad arguments.
+//
+//   g++ -O2 -std=c++17 -o /tmp/loadgen tools/loadgen/loadgen.cpp -pthread
+//   /tmp/loadgen --cameras 8 --fps 5 --seconds 30 corpus/*.jpg
+//   /tmp/loadgen --mode ingest --cameras 8 --fps 10 --max-p95-ms 300 corpus/*.jpg
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 0;  // 0: 5000 for upload, 5001 for ingest
+    std::string mode = "upload";
+    int cameras = 4;
+    double fps = 5;
+    double seconds = 10;
+    int tap_every = 0;
+    int window = 4;
+    double timeout_s = 10;
+    double max_p95_ms = 0;
+    double max_error_pct = -1;
+    std::vector<std::string> files;
+};
+
+struct Stats {
+    uint64_t sent = 0;
+    uint64_t ok = 0;
+    uint64_t dropped = 0;  // Server shed the frame ("status": "dropped" / 503)
+    uint64_t errors = 0;   // Network errors, other non-2xx, "status": "error"
+    uint64_t skipped = 0;  // Send slot missed because the camera was still busy
+    uint64_t bytes = 0;
+    std::vector<double> latency_ms;
+
+    void merge(const Stats &o) {
+        sent += o.sent;
+        ok += o.ok;
+        dropped += o.dropped;
+        errors += o.errors;
+        skipped += o.skipped;
+        bytes += o.bytes;
+        latency_ms.insert(latency_ms.end(), o.latency_ms.begin(), o.latency_ms.end());
+    }
+};
+
+std::vector<std::string> corpus;
+
+int64_t epoch_us() {
+    timeval tv;
+    gettimeofday(&tv, nullptr);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+double ms_since(Clock::time_point t) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+}
+
+int connect_to(const std::string &host, int port, double timeout_s) {
+    addrinfo hints = {}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        timeval tv = {(time_t)timeout_s, (suseconds_t)((timeout_s - (time_t)timeout_s) * 1e6)};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    return fd;
+}
+
+bool send_all(int fd, const char *p, size_t n) {
+    while (n) {
+        ssize_t k = send(fd, p, n, MSG_NOSIGNAL);
+        if (k <= 0) {
+            return false;
+        }
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+// Buffered reader over a socket: lines and fixed-size bodies
+struct Reader {
+    int fd;
+    std::string buf;
+
+    bool fill() {
+        char tmp[4096];
+        ssize_t k = recv(fd, tmp, sizeof(tmp), 0);
+        if (k <= 0) {
+            return false;
+        }
+        buf.append(tmp, k);
+        return true;
+    }
+
+    bool line(std::string &out) {
+        size_t nl;
+        while ((nl = buf.find('\n')) == std::string::npos) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        out.assign(buf, 0, nl);
+        if (!out.empty() && out.back() == '\r') {
+            out.pop_back();
+        }
+        buf.erase(0, nl + 1);
+        return true;
+    }
+
+    bool body(size_t n, std::string &out) {
+        while (buf.size() < n) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        out.assign(buf, 0, n);
+        buf.erase(0, n);
+        return true;
+    }
+};
+
+// The X-* headers one frame carries, as CRLF-terminated lines
+std::string frame_headers(int cam, uint32_t seq, const Options &o) {
+    char h[512];
+    int64_t now = epoch_us();
+    int n = snprintf(h, sizeof(h), "X-Camera-Id: loadgen-%d\r\nX-Seq: %u\r\nX-Motion-Score: %d\r\nX-Frame-Time: %lld\r\n", cam, seq,
+                     (int)(seq * 7 % 100), (long long)now);
+    if (o.tap_every > 0 && seq % o.tap_every == 0) {
+        // A card tap 150 ms before the frame, as the STM32 -> ESP32 path reports it
+        snprintf(h + n, sizeof(h) - n, "X-Card-UID: %08X\r\nX-Tap-Seq: %u\r\nX-Reader: A\r\nX-Decision: GRANT\r\nX-Tap-Time: %lld\r\n",
+                 0xC0DE0000u + cam, seq / o.tap_every, (long long)(now - 150000));
+    }
+    return h;
+}
+
+// "status" of a JSON result line / body
+std::string json_status(const std::string &body) {
+    size_t k = body.find("\"status\"");
+    if (k == std::string::npos) {
+        return "";
+    }
+    size_t a = body.find('"', body.find(':', k) + 1);
+    size_t b = a == std::string::npos ? a : body.find('"', a + 1);
+    return b == std::string::npos ? "" : body.substr(a + 1, b - a - 1);
+}
+
+void classify(Stats &s, int http, const std::string &status, double ms) {
+    if (status == "dropped" || http == 503) {
+        s.dropped++;
+    } else if (http / 100 == 2 && status == "success") {
+        s.ok++;
+        s.latency_ms.push_back(ms);
+    } else {
+        s.errors++;
+    }
+}
+
+void run_upload(int cam, const Options &o, Clock::time_point start, Stats &s) {
+    const auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1 / o.fps));
+    const auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(o.seconds));
+    int fd = -1;
+    Reader rd{-1, ""};
+    uint32_t seq = 0;
+    for (auto slot = start; slot < end; slot += period) {
+        if (Clock::now() > slot + period) {
+            // The previous POST ran past this frame's slot: the firmware drops it
+            s.skipped++;
+            continue;
+        }
+        std::this_thread::sleep_until(slot);
+        const std::string &jpeg = corpus[(cam + seq) % corpus.size()];
+        seq++;
+        for (int attempt = 0; attempt < 2; attempt++) {
+            bool reused = fd >= 0;
+            if (fd < 0) {
+                fd = connect_to(o.host, o.port, o.timeout_s);
+                rd = {fd, ""};
+            }
+            auto t0 = Clock::now();
+            std::string head = "POST /upload HTTP/1.1\r\nHost: " + o.host + "\r\nConnection: keep-alive\r\nContent-Type: image/jpeg\r\nContent-Length: " +
+                               std::to_string(jpeg.size()) + "\r\n" + frame_headers(cam, seq, o) + "\r\n";
+            std::string line, body;
+            int http = 0;
+            size_t length = 0;
+            bool keep = true;
+            bool sent = fd >= 0 && send_all(fd, head.data(), head.size()) && send_all(fd, jpeg.data(), jpeg.size());
+            bool got = sent && rd.line(line) && sscanf(line.c_str(), "HTTP/1.%*d %d", &http) == 1;
+            while (got && rd.line(line) && !line.empty()) {
+                if (!strncasecmp(line.c_str(), "Content-Length:", 15)) {
+                    length = strtoul(line.c_str() + 15, nullptr, 10);
+                } else if (!strncasecmp(line.c_str(), "Connection:", 11) && strcasestr(line.c_str(), "close")) {
+                    keep = false;
+                }
+            }
+            got = got && line.empty() && rd.body(length, body);
+            if (!got) {
+                if (fd >= 0) {
+                    close(fd);
+                    fd = -1;
+                }
+                // A kept-alive connection the server closed meanwhile: one retry on a fresh one
+                if (attempt == 0 && reused) {
+                    continue;
+                }
+                s.sent++;
+                s.errors++;
+                break;
+            }
+            s.sent++;
+            s.bytes += jpeg.size();
+            classify(s, http, json_status(body), ms_since(t0));
+            if (!keep) {
+                close(fd);
+                fd = -1;
+            }
+            break;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void run_ingest(int cam, const Options &o, Clock::time_point start, Stats &s) {
+    const auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1 / o.fps));
+    const auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(o.seconds));
+    int fd = connect_to(o.host, o.port, o.timeout_s);
+    if (fd < 0) {
+        fprintf(stderr, "camera %d: cannot connect to %s:%d\n", cam, o.host.c_str(), o.port);
+        s.errors++;
+        return;
+    }
+    std::mutex lock;
+    std::map<uint32_t, Clock::time_point> in_flight;  // seq -> send time
+    std::atomic<bool> closed{false};
+
+    // ACK lines come back in completion order, each with its "seq"
+    std::thread acks([&] {
+        Reader rd{fd, ""};
+        std::string line;
+        while (rd.line(line)) {
+            size_t k = line.find("\"seq\":");
+            if (k == std::string::npos) {
+                continue;
+            }
+            uint32_t seq = strtoul(line.c_str() + k + 6, nullptr, 10);
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = in_flight.find(seq);
+            if (it != in_flight.end()) {
+                classify(s, 200, json_status(line), ms_since(it->second));
+                in_flight.erase(it);
+            }
+        }
+        closed = true;
+    });
+
+    uint32_t seq = 0;
+    for (auto slot = start; slot < end && !closed; slot += period) {
+        std::this_thread::sleep_until(slot);
+        const std::string &jpeg = corpus[(cam + seq) % corpus.size()];
+        seq++;
+        std::string head = "\r\n--frame\r\nContent-Type: image/jpeg\r\nContent-Length: " + std::to_string(jpeg.size()) + "\r\n" +
+                           frame_headers(cam, seq, o) + "\r\n";
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if ((int)in_flight.size() >= o.window) {
+                // Window full: the firmware would not send this frame either
+                s.skipped++;
+                continue;
+            }
+            in_flight[seq] = Clock::now();
+            s.sent++;
+            s.bytes += jpeg.size();
+        }
+        if (!send_all(fd, head.data(), head.size()) || !send_all(fd, jpeg.data(), jpeg.size())) {
+            break;
+        }
+    }
+    // Let the last ACKs arrive, then count whatever is still missing as errors
+    auto grace = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(o.timeout_s));
+    while (Clock::now() < grace && !closed) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (in_flight.empty()) {
+                break;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    shutdown(fd, SHUT_RDWR);
+    acks.join();
+    close(fd);
+    s.errors += in_flight.size();
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = std::min(sorted.size() - 1, (size_t)(p / 100 * sorted.size()));
+    return sorted[i];
+}
+
+void report(const char *name, Stats &s, double seconds) {
+    std::sort(s.latency_ms.begin(), s.latency_ms.end());
+    printf("%-12s %7llu sent %7llu ok %6llu drop %6llu err %6llu skip %7.1f fps %7.2f MB/s  p50 %7.1f  p95 %7.1f  p99 %7.1f  max %7.1f ms\n", name,
+           (unsigned long long)s.sent, (unsigned long long)s.ok, (unsigned long long)s.dropped, (unsigned long long)s.errors,
+           (unsigned long long)s.skipped, s.ok / seconds, s.bytes / seconds / 1e6, percentile(s.latency_ms, 50), percentile(s.latency_ms, 95),
+           percentile(s.latency_ms, 99), s.latency_ms.empty() ? 0 : s.latency_ms.back());
+}
+
+void usage() {
+    fprintf(stderr,
+            "usage: loadgen [--host H] [--port P] [--mode upload|ingest] [--cameras M] [--fps N] [--seconds S]\n"
+            "               [--tap-every K] [--window W] [--timeout S] [--max-p95-ms MS] [--max-error-pct PCT] file.jpg...\n");
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    Options o;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool has = i + 1 < argc;
+        if (a == "--host" && has) o.host = argv[++i];
+        else if (a == "--port" && has) o.port = atoi(argv[++i]);
+        else if (a == "--mode" && has) o.mode = argv[++i];
+        else if (a == "--cameras" && has) o.cameras = atoi(argv[++i]);
+        else if (a == "--fps" && has) o.fps = atof(argv[++i]);
+        else if (a == "--seconds" && has) o.seconds = atof(argv[++i]);
+        else if (a == "--tap-every" && has) o.tap_every = atoi(argv[++i]);
+        else if (a == "--window" && has) o.window = atoi(argv[++i]);
+        else if (a == "--timeout" && has) o.timeout_s = atof(argv[++i]);
+        else if (a == "--max-p95-ms" && has) o.max_p95_ms = atof(argv[++i]);
+        else if (a == "--max-error-pct" && has) o.max_error_pct = atof(argv[++i]);
+        else if (a.rfind("--", 0) == 0) {
+            usage();
+            return 2;
+        } else o.files.push_back(a);
+    }
+    if (o.files.empty() || o.cameras < 1 || o.fps <= 0 || o.seconds <= 0 || o.window < 1 || (o.mode != "upload" && o.mode != "ingest")) {
+        usage();
+        return 2;
+    }
+    if (!o.port) {
+        o.port = o.mode == "upload" ? 5000 : 5001;
+    }
+    for (const std::string &f : o.files) {
+        std::ifstream in(f, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (data.size() < 4 || (uint8_t)data[0] != 0xFF || (uint8_t)data[1] != 0xD8) {
+            fprintf(stderr, "%s: not a JPEG\n", f.c_str());
+            return 2;
+        }
+        corpus.push_back(std::move(data));
+    }
+
+    printf("%d camera(s) x %.1f fps for %.0f s -> %s:%d (%s), %zu corpus frame(s)\n", o.cameras, o.fps, o.seconds, o.host.c_str(), o.port,
+           o.mode.c_str(), corpus.size());
+    std::vector<Stats> per(o.cameras);
+    std::vector<std::thread> threads;
+    auto start = Clock::now() + std::chrono::milliseconds(100);
+    for (int c = 0; c < o.cameras; c++) {
+        // Cameras start spread over one frame period, as they would in a real deployment
+        auto offset = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(c / o.fps / o.cameras));
+        threads.emplace_back(o.mode == "upload" ? run_upload : run_ingest, c, std::cref(o), start + offset, std::ref(per[c]));
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    Stats total;
+    for (int c = 0; c < o.cameras; c++) {
+        char name[32];
+        snprintf(name, sizeof(name), "loadgen-%d", c);
+        report(name, per[c], elapsed);
+        total.merge(per[c]);
+    }
+    report("total", total, elapsed);
+
+    double error_pct = total.sent ? 100.0 * total.errors / total.sent : 100;
+    double p95 = percentile(total.latency_ms, 95);
+    bool fail = false;
+    if (o.max_p95_ms > 0 && p95 > o.max_p95_ms) {
+        printf("FAIL: p95 %.1f ms > %.1f ms\n", p95, o.max_p95_ms);
+        fail = true;
+    }
+    if (o.max_error_pct >= 0 && error_pct > o.max_error_pct) {
+        printf("FAIL: errors %.2f%% > %.2f%%\n", error_pct, o.max_error_pct);
+        fail = true;
+    }
+    return fail ? 1 : 0;
+}
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""
+Biên dịch 1 danh sách sinh viên (roster) ra mọi thứ các thiết bị cần, để
+server và đầu đọc thẻ không còn giữ 2 danh sách riêng.
+
+Roster là CSV, mỗi dòng: UID thẻ (hex, có hay không dấu ":"/cách), mã sinh
+viên, ảnh mặt (có thể trống), "allow" (mặc định) hoặc "deny" (thẻ mất / bị
+khoá). Nhiều dòng cùng UID là nhiều ảnh của 1 sinh viên; chỉ 1 dòng "deny"
+là đủ khoá thẻ. Dòng bắt đầu bằng # bỏ qua. tools/enroll_build.py đọc cùng file.
+
+    python3 tools/roster_compile.py roster.csv -o build/roster
+    python3 tools/roster_compile.py roster.csv -o build/roster --previous build/roster/whitelist.csv
+
+Ghi vào thư mục -o:
+    whitelist.bin    ảnh flash vùng WHITELIST (Student_card/tools/whitelist_build.py:
+                     các trang UID sắp xếp, CRC từng trang, version), nạp bằng st-flash
+    whitelist.csv    danh sách thẻ đã chuẩn hoá kèm "# version N": --previous của lần sau
+    whitelist.delta  (có --previous) chỉ các thẻ thêm / đổi / bỏ từ version trước,
+                     đẩy xuống mọi đầu đọc qua UART:
+                     whitelist_sync.py --port ... --port ... --delta whitelist.delta
+"""
+import argparse
+import csv
+import os
+import re
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'Student_card', 'tools'))
+from whitelist_build import FLAG_ALLOW, LEN_FLAGS, UID_MAX, build, parse, uid_of  # noqa: E402
+from whitelist_sync import delta_commands, write_delta  # noqa: E402
+
+
+def normalise_uid(text):
+    """UID dạng X-Card-UID của ESP32 (hex in hoa, không dấu phân cách); ValueError khi sai"""
+    uid = re.sub(r'[\s:\-]', '', text).upper()
+    if not re.fullmatch(r'[0-9A-F]*', uid) or len(uid) not in (8, 14, 20):
+        raise ValueError(f'UID {text!r}: expected 4, 7 or 10 bytes of hex')
+    return uid
+
+
+def read_roster(path):
+    """[(UID, mã sinh viên, đường dẫn ảnh hoặc None, allow)] theo thứ tự trong file; ảnh tương đối theo thư mục CSV"""
+    base = os.path.dirname(os.path.abspath(path))
+    rows = []
+    with open(path, newline='') as f:
+        for n, row in enumerate(csv.reader(f), 1):
+            if not row or row[0].strip().startswith('#'):
+                continue
+            row = [v.strip() for v in row] + [''] * 3
+            access = row[3].lower() or 'allow'
+            if access not in ('allow', 'deny'):
+                sys.exit(f'{path}:{n}: access must be allow or deny, not {row[3]!r}')
+            try:
+                uid = normalise_uid(row[0])
+            except ValueError as e:
+                sys.exit(f'{path}:{n}: {e}')
+            rows.append((uid, row[1], os.path.join(base, row[2]) if row[2] else None, access == 'allow'))
+    return rows
+
+
+def device_list(rows):
+    """Roster -> {(UID 10 byte đệm 0, cờ độ dài): cờ} như whitelist_build.parse"""
+    entries = {}
+    for uid, _, _, allow in rows:
+        key = bytes.fromhex(uid)
+        len_flag = LEN_FLAGS[len(key)]
+        k = (key.ljust(UID_MAX, b'\0'), len_flag)
+        # 1 dòng deny là khoá, dù dòng khác của cùng UID ghi allow
+        entries[k] = len_flag | (FLAG_ALLOW if allow and entries.get(k, FLAG_ALLOW) & FLAG_ALLOW else 0)
+    return entries
+
+
+def read_version(path):
+    """Version ghi ở dòng '# version N' của whitelist.csv"""
+    with open(path) as f:
+        for line in f:
+            m = re.match(r'#\s*version\s+(\d+)', line)
+            if m:
+                return int(m.group(1))
+    sys.exit(f'{path}: no "# version N" line')
+
+
+def write_list(path, entries, version):
+    with open(path, 'w') as f:
+        f.write(f'# version {version}\n# Sinh bởi tools/roster_compile.py, không sửa tay\n')
+        for (key, len_flag), flags in sorted(entries.items()):
+            uid = uid_of(key, len_flag)
+            f.write(f"{uid.hex().upper()},{'allow' if flags & FLAG_ALLOW else 'deny'}\n")
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument('roster', help='CSV: uid,student_id,photo,access')
+    ap.add_argument('-o', '--output', default='build/roster', help='thư mục ghi kết quả')
+    ap.add_argument('--previous', help='whitelist.csv của lần biên dịch trước (đang có trên các đầu đọc)')
+    ap.add_argument('--version', type=int, help='version mới (mặc định: version trước + 1, hoặc 1)')
+    args = ap.parse_args()
+
+    entries = device_list(read_roster(args.roster))
+    old = parse(args.previous) if args.previous else None
+    base = read_version(args.previous) if args.previous else 0
+    version = args.version if args.version is not None else base + 1
+    if not 0 < version <= 0xFFFF or (old is not None and version == base):
+        sys.exit(f'version {version}: must be 1..65535 and differ from the previous {base}')
+
+    os.makedirs(args.output, exist_ok=True)
+    image = build(entries, version)
+    with open(os.path.join(args.output, 'whitelist.bin'), 'wb') as f:
+        f.write(image)
+    write_list(os.path.join(args.output, 'whitelist.csv'), entries, version)
+    print(f'{len(entries)} card(s), version {version}: whitelist.bin ({len(image)} bytes), whitelist.csv')
+    if old is not None:
+        commands = delta_commands(old, entries)
+        write_delta(os.path.join(args.output, 'whitelist.delta'), base, version, commands)
+        print(f'whitelist.delta: {len(commands)} change(s) from version {base}')
+
+
+if __name__ == '__main__':
+    main()